@@ -0,0 +1,267 @@
+#!/bin/bash
+# Runs the performance benchmarks of httpserver, malloc, the shell and
+# Pintos, writes the results as JSON, and compares them with a baseline.
+#
+# Usage: bench/bench.sh [--runs N] [--threshold PERCENT] [--baseline FILE]
+#                       [--output FILE] [--update] [SUITE]...
+#
+# The suites are http, malloc, shell and pintos, all by default. Each one
+# builds what it measures and runs its benchmarks --runs times (default
+# 5). Every metric is reported as a mean with a 95% confidence interval.
+# A metric regresses if its mean is worse than the baseline's by more
+# than --threshold percent (default 5) and the two intervals don't
+# overlap, so noise alone doesn't fail a run. The script exits 1 if any
+# metric regressed. --update writes the results over the baseline
+# instead. The pintos suite needs the pintos script and qemu on PATH, and
+# is skipped without them.
+#
+# The JSON has one metric per line, the way this script reads the
+# baseline back; keep it so when editing it by hand.
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+RUNS=5
+THRESHOLD=5
+BASELINE=$ROOT/bench/baseline.json
+OUTPUT=bench-results.json
+UPDATE=
+SUITES=
+PORT=${PORT:-8200}
+HTTP_DURATION=${HTTP_DURATION:-2}
+MALLOC_OPS=${MALLOC_OPS:-300000}
+
+usage() {
+  sed -n '5,6p' "$0" | sed 's/^# //' >&2
+  exit 2
+}
+
+while [ $# -gt 0 ]; do
+  case $1 in
+    --runs) RUNS=$2; shift ;;
+    --threshold) THRESHOLD=$2; shift ;;
+    --baseline) BASELINE=$2; shift ;;
+    --output) OUTPUT=$2; shift ;;
+    --update) UPDATE=1 ;;
+    http|malloc|shell|pintos) SUITES="$SUITES $1" ;;
+    *) usage ;;
+  esac
+  shift
+done
+[ "$RUNS" -ge 2 ] 2>/dev/null || { echo "bench: --runs must be 2 or more" >&2; exit 2; }
+SUITES=${SUITES:-http malloc shell pintos}
+
+WORK=$(mktemp -d)
+SAMPLES=$WORK/samples
+: > "$SAMPLES"
+SERVER_PIDS=
+trap 'kill $SERVER_PIDS 2>/dev/null; rm -rf "$WORK"' EXIT
+
+# Records one sample: metric NAME in UNIT, where BETTER (higher or lower)
+# is an improvement, had VALUE.
+record() {
+  [ -n "$4" ] && echo "$1 $2 $3 $4" >> "$SAMPLES"
+}
+
+# Prints how many milliseconds running its arguments took.
+elapsed_ms() {
+  local start=$(date +%s%N)
+  "$@" >/dev/null 2>&1
+  echo $((($(date +%s%N) - start) / 1000000))
+}
+
+suite_http() {
+  make -s -C "$ROOT/httpserver" >/dev/null || return 1
+  cd "$ROOT/httpserver" || return 1
+  local urls=$WORK/urls
+  for i in 1 2 3 4 5 6; do echo /index.html; done > "$urls"
+  for i in 1 2 3; do echo /my_documents/credit.txt; done >> "$urls"
+  echo /my_documents/WEB_SCALE.jpg >> "$urls"
+
+  ./httpserver --files files --port $PORT --num-threads 8 >/dev/null 2>&1 &
+  SERVER_PIDS="$SERVER_PIDS $!"
+  ./httpserver --files files --port $((PORT + 1)) --event-loop >/dev/null 2>&1 &
+  SERVER_PIDS="$SERVER_PIDS $!"
+  sleep 0.5
+
+  local run mode port keep out
+  for run in $(seq $RUNS); do
+    for mode in threads.keepalive threads.close event.keepalive; do
+      port=$PORT
+      [ ${mode%%.*} = event ] && port=$((PORT + 1))
+      keep=
+      [ ${mode#*.} = keepalive ] && keep=--keep-alive
+      out=$(./httpbench --port $port --connections 64 --duration $HTTP_DURATION \
+            --urls "$urls" $keep)
+      record http.$mode.rps req/s higher \
+        "$(echo "$out" | sed -n 's/^Throughput: \([0-9.]*\) requests.*/\1/p')"
+      record http.$mode.p99 us lower "$(echo "$out" | sed -n 's/.* p99 \([0-9]*\),.*/\1/p')"
+    done
+  done
+  kill $SERVER_PIDS 2>/dev/null
+  wait $SERVER_PIDS 2>/dev/null
+  SERVER_PIDS=
+}
+
+suite_malloc() {
+  make -s -C "$ROOT/malloc" >/dev/null 2>&1 || return 1
+  cd "$ROOT/malloc" || return 1
+  local run
+  for run in $(seq $RUNS); do
+    ./mm_bench --ops $MALLOC_OPS --lib ./hw3lib.so \
+      | awk 'NR > 1 && $3 != "failed" { print $1, $3, $6 }' \
+      | while read workload ops ratio; do
+          record malloc.$workload.ops ops/s higher $ops
+          record malloc.$workload.rss_per_live ratio lower $ratio
+        done
+  done
+}
+
+suite_shell() {
+  make -s -C "$ROOT/shell" >/dev/null || return 1
+  local shell=$ROOT/shell/shell
+  local i run
+  for i in $(seq 2000); do echo "echo line $i > $WORK/out"; done > "$WORK/builtins.sh"
+  for i in $(seq 300); do echo "/bin/true"; done > "$WORK/spawn.sh"
+  echo "parallel -j 4 /bin/true ::: $(seq -s ' ' 200)" > "$WORK/parallel.sh"
+  for run in $(seq $RUNS); do
+    record shell.builtins.ms ms lower "$(elapsed_ms "$shell" "$WORK/builtins.sh")"
+    record shell.spawn.ms ms lower "$(elapsed_ms "$shell" "$WORK/spawn.sh")"
+    record shell.parallel.ms ms lower "$(elapsed_ms "$shell" "$WORK/parallel.sh")"
+  done
+}
+
+# Records the "NAME: N ops in M ms: ... X ops/s" lines the file system
+# benchmarks and the bench-* examples print, as PREFIX.NAME.ops.
+record_pintos() {
+  sed -n 's/^\((\([^)]*\)) \)\{0,1\}\(.*\): [0-9]* ops in .* \([0-9]*\) ops\/s.*/\2 \3 \4/p' \
+    | while read -r line; do
+        local ops=${line##* }
+        local name=${line% *}
+        name=$(echo "$name" | tr ' =' '_-')
+        record "$1.${name#_}.ops" ops/s higher $ops
+      done
+}
+
+suite_pintos() {
+  if ! command -v pintos >/dev/null || ! command -v qemu-system-i386 >/dev/null; then
+    echo "bench: pintos: skipped, needs pintos and qemu-system-i386 on PATH" >&2
+    return 0
+  fi
+  local src=$ROOT/pintos/src
+  make -s -C "$src/filesys" >/dev/null && make -s -C "$src/examples" >/dev/null || return 1
+  local run
+  for run in $(seq $RUNS); do
+    make -s -C "$src/filesys" bench 2>/dev/null | record_pintos pintos.fs
+    make -s -C "$src/examples" bench-examples 2>/dev/null | record_pintos pintos.examples
+  done
+}
+
+for suite in $SUITES; do
+  echo "bench: running $suite ($RUNS runs)" >&2
+  suite_$suite || echo "bench: $suite: failed to build or run" >&2
+  cd "$ROOT"
+done
+
+# Summarizes the samples: a line per metric of its name, unit, better
+# direction, mean, 95% confidence half-width, and samples joined by ",".
+summarize() {
+  sort -s -k1,1 "$SAMPLES" | awk '
+    # Two-sided 95% t values for 1 to 30 degrees of freedom.
+    BEGIN {
+      values = "12.706 4.303 3.182 2.776 2.571 2.447 2.365 2.306 2.262 2.228"
+      values = values " 2.201 2.179 2.160 2.145 2.131 2.120 2.110 2.101 2.093 2.086"
+      values = values " 2.080 2.074 2.069 2.064 2.060 2.056 2.052 2.048 2.045 2.042"
+      split(values, t, " ")
+    }
+    function flush() {
+      if (n == 0) return
+      mean = sum / n
+      var = n > 1 ? (sumsq - sum * sum / n) / (n - 1) : 0
+      df = n - 1
+      ci = n > 1 ? (df <= 30 ? t[df] : 1.960) * sqrt(var > 0 ? var : 0) / sqrt(n) : 0
+      printf "%s %s %s %.6g %.6g %s\n", name, unit, better, mean, ci, list
+    }
+    $1 != name { flush(); name = $1; unit = $2; better = $3; n = sum = sumsq = 0; list = "" }
+    { n++; sum += $4; sumsq += $4 * $4; list = list (list == "" ? "" : ",") $4 }
+    END { flush() }'
+}
+
+# Prints the machine the results come from, as JSON members.
+machine_json() {
+  local cpu=$(sed -n 's/^model name[[:space:]]*: //p' /proc/cpuinfo 2>/dev/null | head -1)
+  local mem=$(awk '/^MemTotal/ { print $2 }' /proc/meminfo 2>/dev/null)
+  local commit=$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null)
+  cat <<EOF
+  "machine": {
+    "host": "$(hostname)",
+    "kernel": "$(uname -sr)",
+    "cpu": "${cpu:-unknown}",
+    "cpus": $(getconf _NPROCESSORS_ONLN),
+    "memory_kb": ${mem:-0},
+    "compiler": "$(gcc -dumpfullversion 2>/dev/null || echo unknown)"
+  },
+  "commit": "${commit:-unknown}",
+  "date": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+  "runs": $RUNS,
+EOF
+}
+
+SUMMARY=$WORK/summary
+summarize > "$SUMMARY"
+{
+  echo "{"
+  machine_json
+  echo '  "metrics": {'
+  awk '{
+    printf "%s    \"%s\": {\"unit\": \"%s\", \"better\": \"%s\", \"mean\": %s, \"ci95\": %s, \"samples\": [%s]}",
+      (NR > 1 ? ",\n" : ""), $1, $2, $3, $4, $5, $6
+  } END { if (NR) printf "\n" }' "$SUMMARY"
+  echo "  }"
+  echo "}"
+} > "$WORK/results.json"
+
+if [ -n "$UPDATE" ]; then
+  cp "$WORK/results.json" "$BASELINE"
+  echo "bench: wrote the baseline $BASELINE" >&2
+  exit 0
+fi
+cp "$WORK/results.json" "$OUTPUT"
+echo "bench: wrote $OUTPUT" >&2
+
+if [ ! -f "$BASELINE" ]; then
+  echo "bench: no baseline $BASELINE to compare with" >&2
+  exit 0
+fi
+BASE_CPU=$(sed -n 's/^ *"cpu": "\(.*\)",$/\1/p' "$BASELINE")
+THIS_CPU=$(sed -n 's/^ *"cpu": "\(.*\)",$/\1/p' "$WORK/results.json")
+[ "$BASE_CPU" != "$THIS_CPU" ] &&
+  echo "bench: warning: the baseline is from a different CPU ($BASE_CPU)" >&2
+
+# Compares each metric measured with the baseline's.
+sed -n 's/^ *"\([^"]*\)": {"unit": "[^"]*", "better": "\([a-z]*\)", "mean": \([^,]*\), "ci95": \([^,]*\),.*/\1 \2 \3 \4/p' \
+    "$BASELINE" > "$WORK/base"
+awk -v threshold="$THRESHOLD" '
+    BEGIN { printf "%-40s %14s %14s %8s\n", "metric", "mean", "baseline", "change" }
+    NR == FNR { base[$1] = $3; base_ci[$1] = $4; next }
+    {
+      name = $1; better = $3; mean = $4; ci = $5
+      if (!(name in base)) { printf "%-40s %14.6g %14s  new\n", name, mean, "-"; next }
+      b = base[name]
+      change = b != 0 ? (mean - b) / b * 100 : 0
+      worse = better == "higher" ? -change : change
+      below = mean + ci < b - base_ci[name]
+      above = mean - ci > b + base_ci[name]
+      verdict = "ok"
+      if (worse > threshold && (better == "higher" ? below : above)) {
+        verdict = "REGRESSED"
+        regressed++
+      } else if (-worse > threshold && (better == "higher" ? above : below)) {
+        verdict = "improved"
+      }
+      printf "%-40s %14.6g %14.6g %+7.1f%%  %s\n", name, mean, b, change, verdict
+    }
+    END {
+      if (regressed) {
+        printf "%d metric%s regressed beyond %s%%\n", regressed, (regressed > 1 ? "s" : ""), threshold
+        exit 1
+      }
+    }' "$WORK/base" "$SUMMARY"
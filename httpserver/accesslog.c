@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+
+/* One thread's lines. HEAD and TAIL count bytes ever written and ever
+ * flushed; the thread moves HEAD and the log's thread moves TAIL. */
+struct access_log_buffer {
+  char data[ACCESS_LOG_BUFFER_SIZE];
+  size_t head;
+  size_t tail;
+  unsigned dropped;       /* Lines that didn't fit. */
+  struct access_log_buffer *next;
+};
+
+static int access_log_fd = -1;
+static const char *access_log_format;
+static unsigned access_log_sample;
+
+/* Every thread's buffer. Buffers are only ever added, at the front. */
+static struct access_log_buffer *access_log_buffers;
+
+static __thread struct access_log_buffer *access_log_mine;
+static __thread unsigned access_log_count;
+
+/* The last second formatted for %t, by this thread. */
+static __thread time_t access_log_second = -1;
+static __thread char access_log_date[32];
+
+static long access_log_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Writes every buffer's unflushed lines to the log, forever. */
+static void *access_log_flush(void *aux) {
+  struct iovec iov[IOV_MAX];
+  struct access_log_buffer *owners[IOV_MAX];
+  size_t heads[IOV_MAX];
+
+  while (1) {
+    usleep(ACCESS_LOG_FLUSH_MS * 1000);
+
+    struct access_log_buffer *buffer =
+        __atomic_load_n(&access_log_buffers, __ATOMIC_ACQUIRE);
+    while (buffer) {
+      /* Gather as many buffers as fit in one writev(), each as up to two
+       * pieces where its unflushed bytes wrap around. */
+      int cnt = 0, owner_cnt = 0;
+      for (; buffer && cnt + 2 <= IOV_MAX; buffer = buffer->next) {
+        size_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+        size_t tail = buffer->tail;
+        unsigned dropped = __atomic_exchange_n(&buffer->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0)
+          fprintf(stderr, "Access log: %u lines dropped\n", dropped);
+        if (head == tail) continue;
+
+        size_t start = tail & (ACCESS_LOG_BUFFER_SIZE - 1);
+        size_t len = head - tail;
+        size_t first = ACCESS_LOG_BUFFER_SIZE - start;
+        if (first > len) first = len;
+        iov[cnt++] = (struct iovec) { buffer->data + start, first };
+        if (len > first) iov[cnt++] = (struct iovec) { buffer->data, len - first };
+        owners[owner_cnt] = buffer;
+        heads[owner_cnt++] = head;
+      }
+
+      struct iovec *next = iov;
+      while (cnt > 0) {
+        ssize_t n = writev(access_log_fd, next, cnt);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        while (cnt > 0 && (size_t) n >= next->iov_len) {
+          n -= next->iov_len;
+          next++;
+          cnt--;
+        }
+        if (cnt > 0) {
+          next->iov_base = (char *) next->iov_base + n;
+          next->iov_len -= n;
+        }
+      }
+
+      /* Written or not, the bytes are done with, so the room is freed. */
+      for (int i = 0; i < owner_cnt; i++)
+        __atomic_store_n(&owners[i]->tail, heads[i], __ATOMIC_RELEASE);
+    }
+  }
+  return NULL;
+}
+
+void access_log_open(const char *path, const char *format, unsigned sample) {
+  if (strcmp(path, "-") == 0) {
+    access_log_fd = STDOUT_FILENO;
+  } else {
+    access_log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (access_log_fd == -1) {
+      fprintf(stderr, "Cannot open access log %s: %s\n", path, strerror(errno));
+      exit(errno);
+    }
+  }
+  access_log_format = format ? format : ACCESS_LOG_DEFAULT_FORMAT;
+  access_log_sample = sample > 0 ? sample : 1;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, access_log_flush, NULL) == 0)
+    pthread_detach(thread);
+}
+
+bool access_log_begin(struct access_log_entry *entry, const char *method,
+    size_t method_len, const char *path, size_t path_len) {
+  if (access_log_fd == -1 || access_log_count++ % access_log_sample != 0)
+    return false;
+
+  if (method_len >= sizeof(entry->method)) method_len = sizeof(entry->method) - 1;
+  memcpy(entry->method, method, method_len);
+  entry->method[method_len] = '\0';
+  if (path_len >= sizeof(entry->path)) path_len = sizeof(entry->path) - 1;
+  memcpy(entry->path, path, path_len);
+  entry->path[path_len] = '\0';
+  entry->start_us = access_log_now_us();
+  return true;
+}
+
+/* Returns this thread's buffer, making it on first use. */
+static struct access_log_buffer *access_log_buffer(void) {
+  if (access_log_mine) return access_log_mine;
+  struct access_log_buffer *buffer = calloc(1, sizeof(struct access_log_buffer));
+  if (!buffer) return NULL;
+  buffer->next = __atomic_load_n(&access_log_buffers, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&access_log_buffers, &buffer->next, buffer,
+        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    continue;
+  access_log_mine = buffer;
+  return buffer;
+}
+
+/* Formats %t into this thread's cache, again only once a second. */
+static const char *access_log_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  if (ts.tv_sec != access_log_second) {
+    struct tm tm;
+    gmtime_r(&ts.tv_sec, &tm);
+    strftime(access_log_date, sizeof(access_log_date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    access_log_second = ts.tv_sec;
+  }
+  return access_log_date;
+}
+
+void access_log_end(const struct access_log_entry *entry, int status, long long bytes) {
+  struct access_log_buffer *buffer = access_log_buffer();
+  if (!buffer) return;
+  long latency_us = access_log_now_us() - entry->start_us;
+
+  char line[ACCESS_LOG_PATH_MAX + 256];
+  size_t len = 0;
+  for (const char *f = access_log_format; *f && len < sizeof(line) - 1; f++) {
+    size_t room = sizeof(line) - 1 - len;
+    int n;
+    if (*f != '%' || !f[1]) {
+      line[len++] = *f;
+      continue;
+    }
+    switch (*++f) {
+      case 't': n = snprintf(line + len, room, "%s", access_log_time()); break;
+      case 'm': n = snprintf(line + len, room, "%s", entry->method); break;
+      case 'U': n = snprintf(line + len, room, "%s", entry->path); break;
+      case 's': n = snprintf(line + len, room, "%d", status); break;
+      case 'b':
+        n = bytes < 0 ? snprintf(line + len, room, "-")
+            : snprintf(line + len, room, "%lld", bytes);
+        break;
+      case 'D': n = snprintf(line + len, room, "%ld", latency_us); break;
+      case '%': n = snprintf(line + len, room, "%%"); break;
+      default: n = snprintf(line + len, room, "%%%c", *f); break;
+    }
+    len += (size_t) n < room ? (size_t) n : room;
+  }
+  line[len++] = '\n';
+
+  size_t head = buffer->head;
+  size_t tail = __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE);
+  if (ACCESS_LOG_BUFFER_SIZE - (head - tail) < len) {
+    __atomic_fetch_add(&buffer->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  size_t start = head & (ACCESS_LOG_BUFFER_SIZE - 1);
+  size_t first = ACCESS_LOG_BUFFER_SIZE - start;
+  if (first > len) first = len;
+  memcpy(buffer->data + start, line, first);
+  memcpy(buffer->data, line + first, len - first);
+  __atomic_store_n(&buffer->head, head + len, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,57 @@
+#ifndef __ACCESSLOG__
+#define __ACCESSLOG__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The access log records a line per request, or per ACCESS_LOG_SAMPLE
+ * requests. Each thread formats its lines into a ring buffer of its own,
+ * which only it writes and only the log's thread reads, so logging takes
+ * no lock. The log's thread gathers every buffer into one writev() each
+ * ACCESS_LOG_FLUSH_MS. Lines of different threads may come out of order.
+ * If a thread's buffer fills before it is flushed, its lines are dropped,
+ * and the drops counted on stderr, rather than making it wait. */
+
+/* Bytes in each thread's buffer. Must be a power of two. */
+#define ACCESS_LOG_BUFFER_SIZE 65536
+
+/* How often buffers are written out, in ms. */
+#define ACCESS_LOG_FLUSH_MS 100
+
+/* Longest path kept for a line; the rest is cut off. */
+#define ACCESS_LOG_PATH_MAX 256
+
+/* Used when no format is given. The escapes are:
+ *   %t  when the response was done, in UTC
+ *   %m  request method
+ *   %U  request path
+ *   %s  status code
+ *   %b  bytes sent, or "-" if not known
+ *   %D  time from having the request to having sent the response, in µs
+ *   %%  a "%" */
+#define ACCESS_LOG_DEFAULT_FORMAT "%t %m %U %s %b %D"
+
+/* What a request's line is made of, gathered while it is served. */
+struct access_log_entry {
+  long start_us;
+  char method[16];
+  char path[ACCESS_LOG_PATH_MAX];
+};
+
+/* Starts logging to PATH, or standard output if it is "-", with lines in
+ * FORMAT (or ACCESS_LOG_DEFAULT_FORMAT if NULL), one per SAMPLE requests.
+ * Exits if PATH can't be opened. Call before any other access log
+ * function. */
+void access_log_open(const char *path, const char *format, unsigned sample);
+
+/* Starts ENTRY for a request for the PATH_LEN-byte PATH with the
+ * METHOD_LEN-byte METHOD. Returns false, and leaves ENTRY alone, if the
+ * log is off or the request isn't sampled; then don't finish it. */
+bool access_log_begin(struct access_log_entry *entry, const char *method,
+    size_t method_len, const char *path, size_t path_len);
+
+/* Logs ENTRY's request as answered with STATUS after sending BYTES bytes,
+ * or an unknown number if BYTES is negative. */
+void access_log_end(const struct access_log_entry *entry, int status, long long bytes);
+
+#endif
@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+
+/* CPUs threads are pinned to, in the order they are handed out. */
+static int affinity_cpus[AFFINITY_MAX_CPUS];
+static int affinity_cpu_cnt;
+
+/* Parses a CPU list like "0-3,8" into SET. Returns false if it is
+ * malformed. */
+static bool affinity_parse_list(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10), last = first;
+    if (end == p) return false;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p) return false;
+    }
+    if (first < 0 || last < first || last >= AFFINITY_MAX_CPUS) return false;
+    for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+    p = end;
+    if (*p == ',') p++;
+    else if (*p && *p != '\n') return false;
+    else break;
+  }
+  return true;
+}
+
+/* Adds the CPUs of SET that are ALLOWED and not yet listed, lowest first. */
+static void affinity_add(const cpu_set_t *set, cpu_set_t *allowed) {
+  for (int cpu = 0; cpu < AFFINITY_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, set) && CPU_ISSET(cpu, allowed)) {
+      affinity_cpus[affinity_cpu_cnt++] = cpu;
+      CPU_CLR(cpu, allowed);
+    }
+  }
+}
+
+bool affinity_parse(const char *spec) {
+  cpu_set_t allowed, set;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return false;
+  affinity_cpu_cnt = 0;
+
+  if (strcmp(spec, "auto") == 0) {
+    /* A node's CPUs together, so neighboring threads share a node. CPUs
+     * no node lists, as without NUMA, come last. */
+    for (int node = 0; ; node++) {
+      char path[64], list[4096];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+      FILE *file = fopen(path, "r");
+      if (!file) break;
+      bool ok = fgets(list, sizeof(list), file) != NULL;
+      fclose(file);
+      if (ok && affinity_parse_list(list, &set)) affinity_add(&set, &allowed);
+    }
+    affinity_add(&allowed, &allowed);
+  } else {
+    if (!affinity_parse_list(spec, &set)) return false;
+    affinity_add(&set, &allowed);
+  }
+  return affinity_cpu_cnt > 0;
+}
+
+int affinity_cpu(int index) {
+  return affinity_cpu_cnt > 0 ? affinity_cpus[index % affinity_cpu_cnt] : -1;
+}
+
+void affinity_pin(int cpu) {
+  if (cpu == -1) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (error != 0) fprintf(stderr, "Cannot pin thread to CPU %d: %s\n", cpu, strerror(error));
+}
+
+void affinity_steer(int fd, int cpu) {
+  if (cpu == -1) return;
+  if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1)
+    perror("Failed to set SO_INCOMING_CPU");
+}
@@ -0,0 +1,36 @@
+#ifndef __AFFINITY__
+#define __AFFINITY__
+
+#include <stdbool.h>
+
+/* Workers and event loops can each be pinned to a CPU, so the scheduler
+ * doesn't move them between cores and NUMA nodes. The Ith thread gets the
+ * Ith CPU of the list, wrapping around. What a pinned thread allocates
+ * and first touches for its connections comes from its own node, since
+ * Linux places a page on the node of the CPU that first touches it.
+ *
+ * A pinned thread's own listening socket, with --reuseport or an event
+ * loop, is marked with SO_INCOMING_CPU, so the kernel hands it the
+ * connections whose packets arrive on its CPU. A connection is then served
+ * on the core that took its interrupts. */
+
+/* Most CPUs that can be listed. */
+#define AFFINITY_MAX_CPUS 1024
+
+/* Sets the CPUs threads are pinned to from SPEC: "auto", for every CPU
+ * this process may run on in order of NUMA node, or a list like "0-3,8".
+ * Returns false if SPEC is malformed or names no CPU we may run on. */
+bool affinity_parse(const char *spec);
+
+/* Returns the CPU the INDEXth thread is pinned to, or -1 if threads
+ * aren't pinned. */
+int affinity_cpu(int index);
+
+/* Pins the calling thread to CPU, unless it is -1. */
+void affinity_pin(int cpu);
+
+/* Asks for the connections CPU receives to go to listening socket FD,
+ * unless CPU is -1. */
+void affinity_steer(int fd, int cpu);
+
+#endif
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Benchmarks httpserver serving files/, directly and through a second
+# httpserver in proxy mode, each with fresh and kept-alive connections.
+# Set PORT, CONNECTIONS, or DURATION to change the defaults.
+
+PORT=${PORT:-8100}
+CONNECTIONS=${CONNECTIONS:-64}
+DURATION=${DURATION:-5}
+URLS=$(mktemp)
+trap 'kill $FILES_PID $EVENT_PID $PROXY_PID 2>/dev/null; rm -f "$URLS"' EXIT
+
+# The mix: mostly the small page, some text, a few of the large image.
+for i in 1 2 3 4 5 6; do echo /index.html; done >> "$URLS"
+for i in 1 2 3; do echo /my_documents/credit.txt; done >> "$URLS"
+echo /my_documents/WEB_SCALE.jpg >> "$URLS"
+
+./httpserver --files files --port $PORT --num-threads 8 >/dev/null 2>&1 &
+FILES_PID=$!
+./httpserver --files files --port $((PORT + 1)) --event-loop >/dev/null 2>&1 &
+EVENT_PID=$!
+./httpserver --proxy 127.0.0.1:$PORT --port $((PORT + 2)) --num-threads 8 >/dev/null 2>&1 &
+PROXY_PID=$!
+sleep 0.5
+
+run() {
+  echo "== $1"
+  shift
+  ./httpbench --connections $CONNECTIONS --duration $DURATION --urls "$URLS" "$@"
+  echo
+}
+
+run "files, thread pool" --port $PORT
+run "files, thread pool, keep-alive" --port $PORT --keep-alive
+run "files, event loop" --port $((PORT + 1))
+run "files, event loop, keep-alive" --port $((PORT + 1)) --keep-alive
+run "proxy" --port $((PORT + 2))
+run "proxy, keep-alive" --port $((PORT + 2)) --keep-alive
@@ -0,0 +1,1399 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "affinity.h"
+#include "evloop.h"
+#include "fdcache.h"
+#include "filecache.h"
+#include "h2.h"
+#include "libhttp.h"
+#include "pathcache.h"
+#include "ratelimit.h"
+#include "reload.h"
+#include "stats.h"
+#include "tcptune.h"
+#include "uring.h"
+#include "utlist.h"
+
+/* Most events taken from epoll_wait at once. */
+#define EVLOOP_MAX_EVENTS 256
+
+/* Closed connections each loop keeps to reuse for new ones, and the
+ * largest output buffer one may keep. */
+#define EVLOOP_SPARE_CONNS 256
+#define EVLOOP_SPARE_OUT_MAX 65536
+
+/* Fixed-file slots each io_uring loop registers for its connections'
+ * sockets. Connections past this many use their fds as they are. */
+#define EVLOOP_URING_FILES 4096
+
+/* Most of a file the io_uring backend splices through a connection's pipe
+ * at once. */
+#define EVLOOP_SPLICE_CHUNK 65536
+
+/* Which timeout a connection is held to, by what it waits on. */
+enum conn_timer {
+  CONN_TIMER_IDLE,      /* A request to begin, or with HTTP/2, anything. */
+  CONN_TIMER_HEAD,      /* The rest of a request head, from its start. */
+  CONN_TIMER_SEND,      /* Room to write more of a response. */
+  CONN_TIMER_CNT
+};
+
+/* What a connection is doing. */
+enum conn_state {
+  CONN_READING,   /* Reading a request. */
+  CONN_WRITING,   /* Writing the headers and any in-memory or cached body. */
+  CONN_SENDING,   /* Streaming a file body. */
+  CONN_H2,        /* Speaking HTTP/2, through its session. */
+};
+
+/* A client connection and its place in the request/response cycle. */
+struct conn {
+  int fd;
+  enum conn_state state;
+  uint32_t events;      /* Events registered with epoll. */
+  bool keep_alive;      /* Read another request after this response. */
+  int requests;         /* Requests answered so far. */
+  enum conn_timer timer;
+  long last_active;     /* When TIMER was last started, in ms. */
+  struct conn *prev;    /* Neighbors in the loop's list for TIMER. */
+  struct conn *next;
+
+  /* Request bytes read but not yet handled. Keep-alive clients may send
+   * the next request before the last response is done. */
+  char in[LIBHTTP_REQUEST_MAX_SIZE + 1];
+  size_t in_len;
+  struct http_parser parser;  /* Progress through the head at the front. */
+
+  /* Response headers, and the body for short generated responses. */
+  char *out;
+  size_t out_len;
+  size_t out_sent;
+  size_t out_cap;
+
+  /* Body in memory, part of a cached file, sent along with OUT. */
+  struct file_cache_entry *cached;
+  const char *body;
+  size_t body_left;
+
+  /* File body, sent after OUT with sendfile() from the fd OPENED holds. */
+  struct fd_cache_entry *opened;
+  int file_fd;
+  off_t file_off;
+  size_t file_left;
+
+  /* A multipart/byteranges response's ranges. Each is queued with its part
+   * header once the one before has gone out, and then the end. */
+  struct http_range ranges[HTTP_RANGE_MAX];
+  int range_cnt;        /* 0 unless the response is multipart. */
+  int range_next;
+  const char *range_type;   /* Content-Type of the parts. */
+  off_t range_size;         /* Size of the whole file. */
+
+  /* The access log's line for the response, if it is logged. */
+  bool logged;
+  struct access_log_entry log;
+  int status;
+  long long sent;           /* Bytes of the response sent so far. */
+
+  /* When the request began, for the stats, if it is counted there. */
+  bool counted;
+  long start;
+
+  /* Once the client has started HTTP/2, what the connection carries. Its
+   * frames go out through OUT. */
+  struct h2_session *h2;
+
+  /* With io_uring, what the connection has in flight. */
+  int slot;             /* Fixed-file slot holding FD, or -1. */
+  bool recv_pending;
+  int send_pending;     /* Ops of the send chain not yet complete. */
+  bool failed;          /* Close once nothing is in flight. */
+  bool killed;          /* Off the loop's list, to be closed. */
+  int pipe[2];          /* For splicing the file to the socket, or -1s. */
+  size_t pipe_len;      /* Bytes spliced into PIPE and not yet out. */
+  struct iovec iov[2];
+  struct msghdr msg;
+};
+
+/* One loop thread's sockets and connections. */
+struct event_loop {
+  int cpu;              /* Pinned to, or -1. */
+  int listen_fd;
+  int epoll_fd;         /* Without io_uring. */
+  /* Connections by the timer they're held to, in the order each was last
+   * started. As every one on a list has the same timeout, its first are
+   * the ones due first. */
+  struct conn *timers[CONN_TIMER_CNT];
+  struct conn *spare;   /* Closed ones to reuse, linked by NEXT. */
+  int spare_cnt;
+
+  /* With io_uring. */
+  struct uring ring;
+  bool multishot;       /* The kernel takes multishot accepts. */
+  int *free_slots;      /* Fixed-file slots no connection holds. */
+  int free_slot_cnt;
+  struct __kernel_timespec tick;
+};
+
+static int loop_port;
+static const char *loop_files_directory;
+static bool loop_uring;
+
+/* Opens a non-blocking listening socket on PORT that other loops can bind
+ * to as well, or takes one the server this one is replacing handed over.
+ * Exits on failure, as serve_forever() does. */
+static int open_listen_socket(int port) {
+  struct sockaddr_in server_address;
+  int socket_option = 1;
+
+  /* One handed over is non-blocking only if the old server ran loops too;
+   * the flag is shared with it, but it drains once we've started. */
+  int fd = reload_take_listener(port);
+  if (fd != -1) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+  }
+
+  fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("Failed to create a new socket");
+    exit(errno);
+  }
+
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+        sizeof(socket_option)) == -1
+      || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &socket_option,
+        sizeof(socket_option)) == -1) {
+    perror("Failed to set socket options");
+    exit(errno);
+  }
+
+  memset(&server_address, 0, sizeof(server_address));
+  server_address.sin_family = AF_INET;
+  server_address.sin_addr.s_addr = INADDR_ANY;
+  server_address.sin_port = htons(port);
+
+  if (bind(fd, (struct sockaddr *) &server_address,
+        sizeof(server_address)) == -1) {
+    perror("Failed to bind on socket");
+    exit(errno);
+  }
+
+  if (tcp_tune_listen(fd) == -1) {
+    perror("Failed to listen on socket");
+    exit(errno);
+  }
+  reload_add_listener(fd);
+  return fd;
+}
+
+/* Appends formatted text to C's output buffer, growing it as needed. */
+static void conn_printf(struct conn *c, const char *format, ...) {
+  va_list args;
+  int n;
+
+  while (1) {
+    size_t room = c->out_cap - c->out_len;
+    va_start(args, format);
+    n = vsnprintf(c->out + c->out_len, room, format, args);
+    va_end(args);
+    if (n < 0) return;
+    if ((size_t) n < room) break;
+
+    size_t cap = c->out_cap ? c->out_cap * 2 : 512;
+    while (cap - c->out_len <= (size_t) n) cap *= 2;
+    char *out = realloc(c->out, cap);
+    if (!out) return;
+    c->out = out;
+    c->out_cap = cap;
+  }
+  c->out_len += n;
+}
+
+/* Makes room for SIZE more bytes in C's output buffer. Returns false if
+ * out of memory. */
+static bool conn_reserve(struct conn *c, size_t size) {
+  if (c->out_cap - c->out_len >= size) return true;
+  size_t cap = c->out_cap ? c->out_cap : 512;
+  while (cap - c->out_len < size) cap *= 2;
+  char *out = realloc(c->out, cap);
+  if (!out) return false;
+  c->out = out;
+  c->out_cap = cap;
+  return true;
+}
+
+/* Appends SIZE bytes of DATA to C's output buffer. */
+static void conn_append(struct conn *c, const char *data, size_t size) {
+  if (!conn_reserve(c, size)) return;
+  memcpy(c->out + c->out_len, data, size);
+  c->out_len += size;
+}
+
+/* Queues a status line and the headers every response carries, leaving
+ * room for more. */
+static void conn_begin_headers(struct conn *c, int status_code,
+    const char *content_type, size_t content_length) {
+  c->status = status_code;
+  conn_printf(c, "HTTP/1.1 %d %s\r\n", status_code,
+      http_get_response_message(status_code));
+  if (content_type) conn_printf(c, "Content-Type: %s\r\n", content_type);
+  conn_printf(c, "Content-Length: %zu\r\n", content_length);
+}
+
+/* Queues the last header and the blank line that ends them. */
+static void conn_end_headers(struct conn *c) {
+  conn_printf(c, "Connection: %s\r\n\r\n", c->keep_alive ? "keep-alive" : "close");
+}
+
+static void conn_start_headers(struct conn *c, int status_code,
+    const char *content_type, size_t content_length) {
+  conn_begin_headers(c, status_code, content_type, content_length);
+  conn_end_headers(c);
+}
+
+/* Queues a 304 for a client whose copy of the file with ETAG is current. */
+static void respond_not_modified(struct conn *c, const char *etag,
+    const char *cache_control) {
+  c->status = 304;
+  conn_printf(c, "HTTP/1.1 304 %s\r\nETag: %s\r\n",
+      http_get_response_message(304), etag);
+  if (cache_control) conn_printf(c, "Cache-Control: %s\r\n", cache_control);
+  conn_end_headers(c);
+}
+
+/* Sets C to send RANGE of its file next, from memory if it's cached. */
+static void conn_set_body(struct conn *c, const struct http_range *range) {
+  if (c->cached) {
+    c->body = c->cached->body + range->start;
+    c->body_left = range->length;
+  } else {
+    c->file_off = range->start;
+    c->file_left = range->length;
+  }
+}
+
+/* Queues the next part of C's multipart response, or the end of it.
+ * Returns false if there's nothing more to send. */
+static bool conn_next_part(struct conn *c) {
+  if (c->range_cnt == 0 || c->range_next > c->range_cnt) return false;
+
+  c->out_len = c->out_sent = 0;
+  if (c->range_next == c->range_cnt) {
+    conn_append(c, HTTP_RANGE_END, strlen(HTTP_RANGE_END));
+  } else {
+    char part[HTTP_RANGE_PART_MAX];
+    const struct http_range *range = &c->ranges[c->range_next];
+    int part_len = http_format_range_part(part, c->range_type, range, c->range_size);
+    conn_append(c, part, part_len);
+    conn_set_body(c, range);
+  }
+  c->range_next++;
+  return true;
+}
+
+/*
+ * Queues a response to REQUEST for C's file, which is SIZE bytes of
+ * CONTENT_TYPE with ETAG, if REQUEST asks for ranges of it: a 206, or a
+ * 416 if none of the ranges is in the file. Returns false and queues
+ * nothing if the whole file should be sent.
+ */
+static bool respond_ranges(struct conn *c, const struct http_request *request,
+    const char *content_type, off_t size, const char *etag, time_t mtime) {
+  int cnt = http_request_ranges(request, etag, mtime, size, c->ranges);
+  if (cnt == 0) return false;
+
+  if (cnt < 0) {
+    conn_begin_headers(c, 416, NULL, 0);
+    conn_printf(c, "Content-Range: bytes */%lld\r\n", (long long) size);
+    conn_end_headers(c);
+  } else if (cnt == 1) {
+    conn_begin_headers(c, 206, content_type, c->ranges[0].length);
+    conn_printf(c, "Content-Range: bytes %lld-%lld/%lld\r\nETag: %s\r\n",
+        (long long) c->ranges[0].start,
+        (long long) (c->ranges[0].start + c->ranges[0].length - 1),
+        (long long) size, etag);
+    conn_end_headers(c);
+    conn_set_body(c, &c->ranges[0]);
+  } else {
+    conn_begin_headers(c, 206, "multipart/byteranges; boundary=" HTTP_RANGE_BOUNDARY,
+        http_range_multipart_length(content_type, c->ranges, cnt, size));
+    conn_printf(c, "ETag: %s\r\n", etag);
+    conn_end_headers(c);
+    c->range_cnt = cnt;
+    c->range_next = 0;
+    c->range_type = content_type;
+    c->range_size = size;
+  }
+  return true;
+}
+
+/* Queues the headers of C's cached file; its body goes out with them.
+ * Sends a 304 instead if REQUEST shows the client has the file already,
+ * or just the ranges it asks for. */
+static void respond_cached(struct conn *c, const struct http_request *request) {
+  struct file_cache_entry *entry = c->cached;
+  if (http_request_not_modified(request, entry->etag, entry->mtime.tv_sec)) {
+    respond_not_modified(c, entry->etag, http_cache_control_lookup(request->path));
+    return;
+  }
+  if (respond_ranges(c, request, entry->content_type, entry->size,
+        entry->etag, entry->mtime.tv_sec))
+    return;
+
+  /* Cached headers all start with a 200 status line. */
+  c->status = 200;
+  conn_append(c, entry->headers, entry->headers_len);
+  conn_end_headers(c);
+  c->body = entry->body;
+  c->body_left = entry->size;
+}
+
+/* Queues C's response to REQUEST. Serves the same things
+ * handle_files_request() does. */
+static void respond(struct conn *c, const struct http_request *request) {
+  /* The path in canonical form, so it can't climb out of the files directory
+   * and each file has one cache key. */
+  char path[strlen(request->path) + 2];
+  if (http_normalize_path(request->path, path) == -1) {
+    conn_start_headers(c, 400, NULL, 0);
+    return;
+  }
+
+  size_t path_len = strlen(loop_files_directory) + strlen(path) + strlen("/index.html") + 1;
+  char file_path[path_len];
+  snprintf(file_path, path_len, "%s%s", loop_files_directory, path);
+
+  unsigned encodings = http_request_encodings(request);
+  char cache_key[path_len + FILE_CACHE_KEY_EXTRA];
+  file_cache_make_key(cache_key, file_path, encodings);
+  c->cached = file_cache_lookup(cache_key);
+  if (c->cached) {
+    respond_cached(c, request);
+    return;
+  }
+
+  /* The file, the directory's index.html, or the directory to list; the
+   * path cache remembers which, so a directory isn't probed each time. */
+  struct stat sb;
+  enum path_target target = path_cache_resolve(file_path, &sb);
+  if (target == PATH_NONE) {
+    conn_start_headers(c, 404, NULL, 0);
+    return;
+  }
+  if (target == PATH_DIRECTORY) {
+    c->cached = file_cache_listing(cache_key, file_path, &sb);
+    if (c->cached)
+      respond_cached(c, request);
+    else
+      conn_start_headers(c, 404, NULL, 0);
+    return;
+  }
+
+  const char *cache_control = http_cache_control_lookup(path);
+  const char *content_type = http_get_mime_type(file_path);
+
+  /* Send a compressed sibling instead if the client takes it. */
+  char encoded_path[path_len + 4];
+  struct stat encoded_sb;
+  unsigned missing;
+  enum http_encoding encoding = http_find_encoded_sibling(file_path, content_type,
+      encodings, encoded_path, &encoded_sb, &missing);
+  const char *send_path = file_path;
+  if (encoding != HTTP_ENCODING_IDENTITY) {
+    send_path = encoded_path;
+    sb = encoded_sb;
+  }
+
+  char etag[HTTP_ETAG_MAX];
+  http_format_etag(etag, &sb);
+  if (http_request_not_modified(request, etag, sb.st_mtim.tv_sec)) {
+    respond_not_modified(c, etag, cache_control);
+    return;
+  }
+
+  /* Files too big for the file cache are kept open for the next request. */
+  c->opened = fd_cache_open(send_path, !file_cache_fits(sb.st_size));
+  if (!c->opened) {
+    conn_start_headers(c, 404, NULL, 0);
+    return;
+  }
+  c->file_fd = c->opened->fd;
+  struct file_cache_source source = {
+    .path = send_path, .fd = c->file_fd, .sb = &sb,
+    .content_type = content_type, .cache_control = cache_control,
+    .encoding = encoding, .gzip = encodings & (1u << HTTP_ENCODING_GZIP),
+    .base_path = file_path, .missing = missing,
+  };
+  c->cached = file_cache_insert(cache_key, &source);
+  if (c->cached) {
+    fd_cache_release(c->opened);
+    c->opened = NULL;
+    c->file_fd = -1;
+    respond_cached(c, request);
+    return;
+  }
+  if (respond_ranges(c, request, content_type, sb.st_size, etag, sb.st_mtim.tv_sec))
+    return;
+
+  c->file_off = 0;
+  c->file_left = sb.st_size;
+  char last_modified[HTTP_DATE_MAX];
+  http_format_date(last_modified, sb.st_mtim.tv_sec);
+  conn_begin_headers(c, 200, content_type, sb.st_size);
+  conn_printf(c, "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n",
+      etag, last_modified);
+  if (encoding != HTTP_ENCODING_IDENTITY)
+    conn_printf(c, "Content-Encoding: %s\r\n", http_encoding_name(encoding));
+  if (http_mime_type_is_compressible(content_type))
+    conn_printf(c, "Vary: Accept-Encoding\r\n");
+  if (cache_control) conn_printf(c, "Cache-Control: %s\r\n", cache_control);
+  conn_end_headers(c);
+}
+
+/* Sets up C's response to the request head its parser has found at the
+ * front of its input buffer, then drops the head from the buffer. */
+static void conn_respond(struct conn *c) {
+  struct http_request request;
+  size_t head_len = c->parser.head_len;
+  http_parser_get_request(&c->parser, c->in, &request);
+
+  /* An HTTP/2 client's preface: the rest of the connection is its. */
+  if (h2_is_preface(&request)) {
+    c->state = CONN_H2;
+    c->keep_alive = false;
+    c->out_len = c->out_sent = 0;
+    c->h2 = h2_session_new(loop_files_directory);
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (c->h2) h2_session_input(c->h2, c->in + head_len, c->in_len - head_len);
+    c->in_len = 0;
+    return;
+  }
+
+  c->keep_alive = request.keep_alive
+      && ++c->requests < HTTP_KEEP_ALIVE_MAX_REQUESTS && !reload_draining();
+  c->out_len = c->out_sent = 0;
+  c->state = CONN_WRITING;
+  c->logged = access_log_begin(&c->log, request.method, strlen(request.method),
+      request.path, strlen(request.path));
+  c->sent = 0;
+  c->counted = !stats_is_request(request.path, strlen(request.path));
+  c->start = stats_start();
+  bool head = strcmp(request.method, "HEAD") == 0;
+  if (c->counted) {
+    respond(c, &request);
+    /* A response to HEAD is the headers GET's would have, without the body,
+     * or the client would read the body as the next response. */
+    if (head) c->body_left = c->file_left = c->range_cnt = 0;
+  } else {
+    const char *content_type;
+    size_t size;
+    char *text = stats_render(request.path, strlen(request.path), &content_type, &size);
+    conn_begin_headers(c, text ? 200 : 500, text ? content_type : NULL, text ? size : 0);
+    conn_printf(c, "Cache-Control: no-store\r\n");
+    conn_end_headers(c);
+    if (text && !head) conn_append(c, text, size);
+    free(text);
+  }
+
+  c->in_len -= head_len;
+  memmove(c->in, c->in + head_len, c->in_len);
+  http_parser_init(&c->parser);
+}
+
+/* Asks epoll to report EVENTS for C, if it isn't already. */
+static void conn_watch(struct event_loop *loop, struct conn *c, uint32_t events) {
+  if (c->events == events) return;
+  struct epoll_event event = { .events = events, .data.ptr = c };
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+  c->events = events;
+}
+
+/* Returns the time in milliseconds on a clock that only moves forward. */
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Lets go of what C's last response was sent from. */
+static void conn_end_response(struct conn *c) {
+  if (c->opened) {
+    fd_cache_release(c->opened);
+    c->opened = NULL;
+    c->file_fd = -1;
+  }
+  if (c->cached) {
+    file_cache_release(c->cached);
+    c->cached = NULL;
+  }
+  c->range_cnt = 0;
+}
+
+/* Closes C, which is off LOOP's list already, keeping it to reuse if
+ * LOOP hasn't enough spares. */
+static void conn_release(struct event_loop *loop, struct conn *c) {
+  stats_count(STATS_CONNECTIONS_CLOSED);
+  reload_connection_closed();
+  conn_end_response(c);
+  if (c->h2) h2_session_free(c->h2);
+  if (c->pipe[0] != -1) {
+    close(c->pipe[0]);
+    close(c->pipe[1]);
+  }
+  close(c->fd);
+  if (loop->spare_cnt < EVLOOP_SPARE_CONNS && c->out_cap <= EVLOOP_SPARE_OUT_MAX) {
+    c->next = loop->spare;
+    loop->spare = c;
+    loop->spare_cnt++;
+    return;
+  }
+  free(c->out);
+  free(c);
+}
+
+static void conn_close(struct event_loop *loop, struct conn *c) {
+  DL_DELETE(loop->timers[c->timer], c);
+  conn_release(loop, c);
+}
+
+/* Returns a connection with every field cleared but its output buffer,
+ * reusing a closed one if LOOP has any. */
+static struct conn *conn_new(struct event_loop *loop) {
+  struct conn *c = loop->spare;
+  if (!c) return calloc(1, sizeof(struct conn));
+  loop->spare = c->next;
+  loop->spare_cnt--;
+
+  /* The input buffer needn't be cleared, only its length. */
+  char *out = c->out;
+  size_t out_cap = c->out_cap;
+  memset(c, 0, offsetof(struct conn, in));
+  memset((char *) c + offsetof(struct conn, in_len), 0,
+      sizeof(struct conn) - offsetof(struct conn, in_len));
+  c->out = out;
+  c->out_cap = out_cap;
+  return c;
+}
+
+/* Handles what C has read of a request so far: sets up the response once
+ * the head is whole, or a 400 if it's bad. Returns false if C needs to read
+ * more first. */
+static bool conn_parse(struct conn *c) {
+  /* Picks up where the last feed stopped, so each byte is looked at once
+   * however the request is split across reads. */
+  enum http_parse_state state = http_parser_feed(&c->parser, c->in, c->in_len);
+  if (state == HTTP_PARSE_DONE) {
+    conn_respond(c);
+    return true;
+  }
+  if (state == HTTP_PARSE_ERROR) {
+    /* Malformed, or too big to be a request we'd serve. */
+    c->keep_alive = false;
+    c->out_len = c->out_sent = 0;
+    c->counted = true;
+    c->start = stats_start();
+    conn_start_headers(c, 400, NULL, 0);
+    c->in_len = 0;
+    c->state = CONN_WRITING;
+    return true;
+  }
+  return false;
+}
+
+/* Counts N bytes as sent of C's headers and then its in-memory body. */
+static void conn_sent(struct conn *c, size_t n) {
+  size_t out_n = n < c->out_len - c->out_sent ? n : c->out_len - c->out_sent;
+  c->sent += n;
+  c->out_sent += out_n;
+  c->body += n - out_n;
+  c->body_left -= n - out_n;
+}
+
+/* Goes on once all C has queued of its response is out: to the next part
+ * of a multipart response, or else to reading the next request, once the
+ * response is logged and counted. Returns false if C should close. */
+static bool conn_response_sent(struct conn *c) {
+  if (conn_next_part(c)) {
+    c->state = CONN_WRITING;
+    return true;
+  }
+  if (c->logged) {
+    access_log_end(&c->log, c->status, c->sent);
+    c->logged = false;
+  }
+  if (c->counted) stats_request(STATS_FILES, c->status, c->sent, c->start);
+  conn_end_response(c);
+  if (!c->keep_alive) return false;
+  c->state = CONN_READING;
+  return true;
+}
+
+/* Refills C's output from its HTTP/2 session, once the last of it is out.
+ * Returns false if out of memory. */
+static bool conn_h2_output(struct conn *c) {
+  if (c->out_sent < c->out_len) return true;
+  c->out_len = c->out_sent = 0;
+  if (!conn_reserve(c, H2_OUTPUT_MIN)) return false;
+  c->out_len = h2_session_output(c->h2, c->out, c->out_cap);
+  return true;
+}
+
+/* Returns how long a connection may wait under TIMER, in ms. */
+static int conn_timeout_ms(enum conn_timer timer) {
+  switch (timer) {
+    case CONN_TIMER_HEAD: return http_header_timeout_ms;
+    case CONN_TIMER_SEND: return http_body_timeout_ms;
+    default: return http_idle_timeout_ms;
+  }
+}
+
+/* Starts C's timer over for what it is about to wait on, the client's
+ * next move. A request head's timer keeps running until all of the head
+ * is in, however it trickles in. */
+static void conn_touch(struct event_loop *loop, struct conn *c) {
+  enum conn_timer timer = CONN_TIMER_IDLE;
+  if (c->state == CONN_READING && c->in_len > 0)
+    timer = CONN_TIMER_HEAD;
+  else if (c->state == CONN_WRITING || c->state == CONN_SENDING)
+    timer = CONN_TIMER_SEND;
+  if (timer == CONN_TIMER_HEAD && c->timer == CONN_TIMER_HEAD) return;
+
+  DL_DELETE(loop->timers[c->timer], c);
+  c->timer = timer;
+  c->last_active = now_ms();
+  DL_APPEND(loop->timers[timer], c);
+}
+
+/* Waits for EVENTS on C, under the timer for what it waits on. */
+static void conn_wait(struct event_loop *loop, struct conn *c, uint32_t events) {
+  conn_touch(loop, c);
+  conn_watch(loop, c, events);
+}
+
+/* Moves C along as far as it can go without blocking: reading a request,
+ * writing the response, then reading the next request if the connection
+ * is kept alive. Returns when the socket would block or C is closed. */
+static void conn_run(struct event_loop *loop, struct conn *c) {
+  struct iovec iov[2];
+  ssize_t n;
+
+  while (1) {
+    switch (c->state) {
+      case CONN_READING:
+        if (conn_parse(c)) break;
+        n = read(c->fd, c->in + c->in_len, LIBHTTP_REQUEST_MAX_SIZE - c->in_len);
+        if (n > 0) {
+          c->in_len += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          conn_wait(loop, c, EPOLLIN);
+          return;
+        } else if (n < 0 && errno == EINTR) {
+          continue;
+        } else {
+          conn_close(loop, c);
+          return;
+        }
+        break;
+
+      case CONN_WRITING:
+        if (c->out_sent == c->out_len && c->body_left == 0) {
+          c->state = CONN_SENDING;
+          break;
+        }
+        iov[0] = (struct iovec) { c->out + c->out_sent, c->out_len - c->out_sent };
+        iov[1] = (struct iovec) { (char *) c->body, c->body_left };
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+        /* Holds the headers back to share a segment with the file, if one
+         * follows, even with TCP_NODELAY. */
+        n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | (c->file_left > 0 ? MSG_MORE : 0));
+        if (n >= 0) {
+          conn_sent(c, n);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          conn_wait(loop, c, EPOLLOUT);
+          return;
+        } else if (errno != EINTR) {
+          conn_close(loop, c);
+          return;
+        }
+        break;
+
+      case CONN_SENDING:
+        if (c->file_left > 0) {
+          n = sendfile(c->fd, c->file_fd, &c->file_off, c->file_left);
+          if (n > 0) {
+            c->file_left -= n;
+            c->sent += n;
+          } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn_wait(loop, c, EPOLLOUT);
+            return;
+          } else if (n < 0 && errno == EINTR) {
+            continue;
+          } else {
+            /* The file shrank or the client went away. */
+            conn_close(loop, c);
+            return;
+          }
+          break;
+        }
+        if (!conn_response_sent(c)) {
+          conn_close(loop, c);
+          return;
+        }
+        break;
+
+      case CONN_H2:
+        /* Sends what the session has for the client, reading what the
+         * client sends whenever that blocks or runs out. */
+        if (!c->h2 || !conn_h2_output(c)) {
+          conn_close(loop, c);
+          return;
+        }
+        bool blocked = false;
+        if (c->out_sent < c->out_len) {
+          n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+          if (n >= 0) {
+            c->out_sent += n;
+            break;
+          }
+          if (errno == EINTR) break;
+          if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn_close(loop, c);
+            return;
+          }
+          blocked = true;
+        } else if (h2_session_done(c->h2)) {
+          conn_close(loop, c);
+          return;
+        }
+        n = read(c->fd, c->in, LIBHTTP_REQUEST_MAX_SIZE);
+        if (n > 0) {
+          h2_session_input(c->h2, c->in, n);
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          conn_wait(loop, c, blocked ? EPOLLIN | EPOLLOUT : EPOLLIN);
+          return;
+        } else if (n < 0 && errno == EINTR) {
+          continue;
+        } else {
+          conn_close(loop, c);
+          return;
+        }
+        break;
+    }
+  }
+}
+
+/* Starts C reading a request from FD, a new connection. */
+static void conn_start(struct event_loop *loop, struct conn *c, int fd) {
+  stats_count(STATS_CONNECTIONS_OPENED);
+  reload_connection_opened();
+  c->fd = fd;
+  c->opened = NULL;
+  c->file_fd = -1;
+  c->slot = -1;
+  c->pipe[0] = c->pipe[1] = -1;
+  c->state = CONN_READING;
+  http_parser_init(&c->parser);
+  c->timer = CONN_TIMER_IDLE;
+  c->last_active = now_ms();
+  DL_APPEND(loop->timers[CONN_TIMER_IDLE], c);
+}
+
+/* Accepts every pending connection on LOOP's listening socket. */
+static void accept_connections(struct event_loop *loop) {
+  while (1) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = accept4(loop->listen_fd, (struct sockaddr *) &addr, &addr_len,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Error accepting socket");
+      return;
+    }
+    if (!rate_limit_allow(addr.sin_addr)) {
+      rate_limit_refuse(fd, true);
+      close(fd);
+      continue;
+    }
+
+    struct conn *c = conn_new(loop);
+    if (!c) {
+      close(fd);
+      continue;
+    }
+    tcp_tune_accepted(fd);
+    conn_start(loop, c, fd);
+    c->events = EPOLLIN;
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      conn_close(loop, c);
+      continue;
+    }
+  }
+}
+
+/* Returns the first of LOOP's connections whose timer has run out by NOW,
+ * or NULL if there is none. Only the front of each timer's list needs a
+ * look. */
+static struct conn *conn_expired(struct event_loop *loop, long now) {
+  for (int i = 0; i < CONN_TIMER_CNT; i++) {
+    struct conn *c = loop->timers[i];
+    if (c && now - c->last_active >= conn_timeout_ms(i)) return c;
+  }
+  return NULL;
+}
+
+/* Returns how long until the next of LOOP's connections' timers runs out,
+ * in ms, or -1 if LOOP has none. */
+static int conn_next_expiry_ms(struct event_loop *loop, long now) {
+  long next = -1;
+  for (int i = 0; i < CONN_TIMER_CNT; i++) {
+    struct conn *c = loop->timers[i];
+    if (!c) continue;
+    long left = c->last_active + conn_timeout_ms(i) - now;
+    if (left < 0) left = 0;
+    if (next == -1 || left < next) next = left;
+  }
+  return next;
+}
+
+/* Closes LOOP's connections whose timers have run out. */
+static void close_expired_connections(struct event_loop *loop) {
+  long now = now_ms();
+  struct conn *c;
+  while ((c = conn_expired(loop, now))) conn_close(loop, c);
+}
+
+/* Stops LOOP accepting, once the server is draining for a reload. The
+ * socket stays open in the server that took it over. */
+static void stop_accepting(struct event_loop *loop) {
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+  close(loop->listen_fd);
+  loop->listen_fd = -1;
+  reload_stop_accepting();
+}
+
+/* Runs one event loop forever. */
+static void *event_loop_run(void *arg) {
+  struct event_loop *loop = arg;
+  struct epoll_event events[EVLOOP_MAX_EVENTS];
+  affinity_pin(loop->cpu);
+
+  while (1) {
+    if (loop->listen_fd != -1 && reload_draining()) stop_accepting(loop);
+
+    /* Wake when the next connection's timer runs out. */
+    int timeout = conn_next_expiry_ms(loop, now_ms());
+    reload_accepting(loop->listen_fd != -1);
+    int n = epoll_wait(loop->epoll_fd, events, EVLOOP_MAX_EVENTS, timeout);
+    reload_accepting(false);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait failed");
+      exit(errno);
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL && loop->listen_fd != -1)
+        accept_connections(loop);
+      else
+        conn_run(loop, events[i].data.ptr);
+    }
+    close_expired_connections(loop);
+  }
+  return NULL;
+}
+
+/*
+ * With io_uring, a loop doesn't wait for its sockets to be ready and then
+ * call read() and sendmsg() on them: it queues the I/O each connection is
+ * waiting on in its ring and is told once that's done, so the ops of all
+ * its connections take one system call between them. The listening socket
+ * has a multishot accept queued, which keeps accepting until cancelled.
+ * Connections' sockets go in the ring's fixed-file table, which saves the
+ * kernel looking them up for every op. A file body is spliced through a
+ * pipe of the connection's own, each piece linked to go after the headers
+ * or the piece before it.
+ */
+
+/* What a connection's completion is for, in the low bits of its
+ * user_data; the rest is the connection's address. */
+enum uring_op {
+  URING_RECV,
+  URING_SEND,
+  URING_SPLICE_IN,      /* From the file into the connection's pipe. */
+  URING_SPLICE_OUT,     /* From the pipe to the socket. */
+};
+#define URING_OP_MASK 3
+
+/* user_data of the completions that aren't a connection's. */
+#define URING_IGNORE 0    /* Fixed-file updates and cancellations. */
+#define URING_ACCEPT 1
+#define URING_TICK 2
+
+static const int uring_no_fd = -1;
+
+/* Returns an SQE for OPCODE, completing with DATA, or NULL if LOOP's ring
+ * is full. */
+static struct io_uring_sqe *uring_sqe(struct event_loop *loop, int opcode, uint64_t data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+  if (!sqe) return NULL;
+  sqe->opcode = opcode;
+  sqe->user_data = data;
+  return sqe;
+}
+
+/* Returns an SQE for OPCODE on C's socket, completing as OP, or NULL and
+ * marks C failed if LOOP's ring is full. */
+static struct io_uring_sqe *uring_conn_sqe(struct event_loop *loop, struct conn *c,
+    int opcode, enum uring_op op) {
+  struct io_uring_sqe *sqe = uring_sqe(loop, opcode, (uintptr_t) c | op);
+  if (!sqe) {
+    c->failed = true;
+    return NULL;
+  }
+  if (c->slot >= 0) {
+    sqe->fd = c->slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = c->fd;
+  }
+  return sqe;
+}
+
+static void uring_accept(struct event_loop *loop) {
+  struct io_uring_sqe *sqe = uring_sqe(loop, IORING_OP_ACCEPT, URING_ACCEPT);
+  if (!sqe) return;
+  sqe->fd = loop->listen_fd;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  if (loop->multishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* Wakes LOOP after a while to close connections whose timers have run
+ * out, often enough that none runs more than a quarter over. */
+static void uring_arm_tick(struct event_loop *loop) {
+  struct io_uring_sqe *sqe = uring_sqe(loop, IORING_OP_TIMEOUT, URING_TICK);
+  if (!sqe) return;
+  int tick_ms = conn_timeout_ms(0);
+  for (int i = 1; i < CONN_TIMER_CNT; i++)
+    if (conn_timeout_ms(i) < tick_ms) tick_ms = conn_timeout_ms(i);
+  tick_ms = tick_ms / 4 > 0 ? tick_ms / 4 : 1;
+  loop->tick.tv_sec = tick_ms / 1000;
+  loop->tick.tv_nsec = tick_ms % 1000 * 1000000L;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t) &loop->tick;
+  sqe->len = 1;
+}
+
+/* Queues a read from C's socket of up to LEN bytes into BUF. */
+static void uring_recv(struct event_loop *loop, struct conn *c, char *buf, size_t len) {
+  struct io_uring_sqe *sqe = uring_conn_sqe(loop, c, IORING_OP_RECV, URING_RECV);
+  if (!sqe) return;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = len;
+  c->recv_pending = true;
+}
+
+/* Opens C's pipe, if it hasn't one. Returns false if that fails. */
+static bool uring_conn_pipe(struct conn *c) {
+  if (c->pipe[0] != -1) return true;
+  if (pipe2(c->pipe, O_CLOEXEC) == -1) {
+    c->pipe[0] = c->pipe[1] = -1;
+    return false;
+  }
+  fcntl(c->pipe[1], F_SETPIPE_SZ, EVLOOP_SPLICE_CHUNK);
+  return true;
+}
+
+/* Queues the next piece of C's file: what's left of the last one in its
+ * pipe, or else a new piece from the file into the pipe, linked to one
+ * out of the pipe. A short splice in breaks the link. */
+static void uring_splice(struct event_loop *loop, struct conn *c) {
+  if (!uring_conn_pipe(c) || !uring_reserve(&loop->ring, 2)) {
+    c->failed = true;
+    return;
+  }
+  size_t n = c->pipe_len;
+  if (n == 0) {
+    n = c->file_left < EVLOOP_SPLICE_CHUNK ? c->file_left : EVLOOP_SPLICE_CHUNK;
+    struct io_uring_sqe *sqe = uring_sqe(loop, IORING_OP_SPLICE,
+        (uintptr_t) c | URING_SPLICE_IN);
+    sqe->splice_fd_in = c->file_fd;
+    sqe->splice_off_in = c->file_off;
+    sqe->fd = c->pipe[1];
+    sqe->off = -1;
+    sqe->len = n;
+    sqe->flags = IOSQE_IO_LINK;
+    c->send_pending++;
+  }
+  struct io_uring_sqe *sqe = uring_conn_sqe(loop, c, IORING_OP_SPLICE, URING_SPLICE_OUT);
+  sqe->splice_fd_in = c->pipe[0];
+  sqe->splice_off_in = -1;
+  sqe->off = -1;
+  sqe->len = n;
+  c->send_pending++;
+}
+
+/* Queues sending what's left of C's headers and in-memory body, linked to
+ * the first piece of its file if that comes next. */
+static void uring_send(struct event_loop *loop, struct conn *c) {
+  bool chain = c->state != CONN_H2 && c->body_left == 0 && c->file_left > 0
+      && c->pipe_len == 0 && uring_conn_pipe(c);
+  if (!uring_reserve(&loop->ring, chain ? 3 : 1)) {
+    c->failed = true;
+    return;
+  }
+  c->iov[0] = (struct iovec) { c->out + c->out_sent, c->out_len - c->out_sent };
+  c->iov[1] = (struct iovec) { (char *) c->body, c->body_left };
+  c->msg = (struct msghdr) { .msg_iov = c->iov, .msg_iovlen = 2 };
+  struct io_uring_sqe *sqe = uring_conn_sqe(loop, c, IORING_OP_SENDMSG, URING_SEND);
+  sqe->addr = (uintptr_t) &c->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL | (c->file_left > 0 ? MSG_MORE : 0);
+  c->send_pending = 1;
+  if (chain) {
+    /* The headers must all be out before the file is: with MSG_WAITALL a
+     * short send breaks the link. */
+    sqe->msg_flags |= MSG_WAITALL;
+    sqe->flags |= IOSQE_IO_LINK;
+    uring_splice(loop, c);
+  }
+}
+
+/* Closes C, which nothing is in flight for and is off LOOP's list. */
+static void uring_conn_close(struct event_loop *loop, struct conn *c) {
+  if (c->slot >= 0) {
+    struct io_uring_sqe *sqe = uring_sqe(loop, IORING_OP_FILES_UPDATE, URING_IGNORE);
+    if (sqe) {
+      sqe->fd = -1;
+      sqe->addr = (uintptr_t) &uring_no_fd;
+      sqe->len = 1;
+      sqe->off = c->slot;
+    } else {
+      uring_set_file(&loop->ring, c->slot, -1);
+    }
+    loop->free_slots[loop->free_slot_cnt++] = c->slot;
+  }
+  conn_release(loop, c);
+}
+
+/* Closes C once nothing is in flight for it, shutting its socket down so
+ * that whatever is ends soon. */
+static void uring_conn_kill(struct event_loop *loop, struct conn *c) {
+  c->failed = true;
+  if (!c->killed) {
+    c->killed = true;
+    DL_DELETE(loop->timers[c->timer], c);
+  }
+  if (c->recv_pending || c->send_pending)
+    shutdown(c->fd, SHUT_RDWR);
+  else
+    uring_conn_close(loop, c);
+}
+
+/* Moves C along as far as it can go until it has to wait for I/O, which
+ * it queues. The io_uring counterpart of conn_run(). */
+static void uring_conn_run(struct event_loop *loop, struct conn *c) {
+  bool more = !c->failed;
+  while (more && !c->failed) {
+    more = false;
+    switch (c->state) {
+      case CONN_READING:
+        if (conn_parse(c))
+          more = true;
+        else if (!c->recv_pending)
+          uring_recv(loop, c, c->in + c->in_len, LIBHTTP_REQUEST_MAX_SIZE - c->in_len);
+        break;
+
+      case CONN_WRITING:
+        if (c->send_pending) break;
+        if (c->out_sent == c->out_len && c->body_left == 0) {
+          c->state = CONN_SENDING;
+          more = true;
+        } else {
+          uring_send(loop, c);
+        }
+        break;
+
+      case CONN_SENDING:
+        if (c->send_pending) break;
+        if (c->file_left > 0 || c->pipe_len > 0)
+          uring_splice(loop, c);
+        else if (conn_response_sent(c))
+          more = true;
+        else
+          c->failed = true;
+        break;
+
+      case CONN_H2:
+        /* Keeps a send of what the session has for the client in flight
+         * alongside a read of what the client sends. */
+        if (!c->h2 || (!c->send_pending && !conn_h2_output(c))) {
+          c->failed = true;
+          break;
+        }
+        if (!c->send_pending && c->out_sent < c->out_len)
+          uring_send(loop, c);
+        else if (!c->send_pending && h2_session_done(c->h2))
+          c->failed = true;
+        if (!c->recv_pending && !c->failed)
+          uring_recv(loop, c, c->in, LIBHTTP_REQUEST_MAX_SIZE);
+        break;
+    }
+  }
+  if (c->failed)
+    uring_conn_kill(loop, c);
+  else
+    conn_touch(loop, c);
+}
+
+/* Takes FD, a new connection or a negative errno, from LOOP's accept. */
+static void uring_accepted(struct event_loop *loop, int fd) {
+  if (fd < 0) {
+    /* A kernel older than multishot accepts refuses them. */
+    if (fd == -EINVAL && loop->multishot)
+      loop->multishot = false;
+    else if (fd != -ECANCELED && fd != -EINTR && fd != -ECONNABORTED && fd != -EAGAIN)
+      fprintf(stderr, "Error accepting socket: %s\n", strerror(-fd));
+    return;
+  }
+
+  /* A multishot accept has nowhere to put each client's address. */
+  if (rate_limit_enabled()) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *) &addr, &addr_len) == 0
+        && !rate_limit_allow(addr.sin_addr)) {
+      rate_limit_refuse(fd, true);
+      close(fd);
+      return;
+    }
+  }
+
+  struct conn *c = conn_new(loop);
+  if (!c) {
+    close(fd);
+    return;
+  }
+  tcp_tune_accepted(fd);
+  conn_start(loop, c, fd);
+  if (loop->free_slot_cnt > 0 && uring_reserve(&loop->ring, 2)) {
+    /* The first read is linked after the slot is filled. */
+    c->slot = loop->free_slots[--loop->free_slot_cnt];
+    struct io_uring_sqe *sqe = uring_sqe(loop, IORING_OP_FILES_UPDATE, URING_IGNORE);
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) &c->fd;
+    sqe->len = 1;
+    sqe->off = c->slot;
+    sqe->flags = IOSQE_IO_LINK;
+  }
+  uring_conn_run(loop, c);
+}
+
+/* Handles the completion of the SQE queued with DATA, which had result RES
+ * and flags FLAGS. */
+static void uring_complete(struct event_loop *loop, uint64_t data, int res,
+    unsigned flags) {
+  if (data == URING_IGNORE) return;
+  if (data == URING_ACCEPT) {
+    uring_accepted(loop, res);
+    if (!(flags & IORING_CQE_F_MORE) && loop->listen_fd != -1) uring_accept(loop);
+    return;
+  }
+  if (data == URING_TICK) {
+    long now = now_ms();
+    struct conn *c;
+    while ((c = conn_expired(loop, now))) uring_conn_kill(loop, c);
+    uring_arm_tick(loop);
+    return;
+  }
+
+  struct conn *c = (struct conn *) (uintptr_t) (data & ~(uint64_t) URING_OP_MASK);
+  bool retry = res == -EINTR || res == -EAGAIN;
+  switch (data & URING_OP_MASK) {
+    case URING_RECV:
+      c->recv_pending = false;
+      if (res > 0 && c->state == CONN_H2)
+        h2_session_input(c->h2, c->in, res);
+      else if (res > 0)
+        c->in_len += res;
+      else if (!retry)
+        c->failed = true;
+      break;
+
+    case URING_SEND:
+      c->send_pending--;
+      if (res >= 0)
+        conn_sent(c, res);
+      else if (!retry)
+        c->failed = true;
+      break;
+
+    case URING_SPLICE_IN:
+      c->send_pending--;
+      if (res > 0) {
+        c->pipe_len += res;
+        c->file_off += res;
+        c->file_left -= res;
+      } else if (res != -ECANCELED && !retry) {
+        /* The file shrank. */
+        c->failed = true;
+      }
+      break;
+
+    case URING_SPLICE_OUT:
+      c->send_pending--;
+      if (res > 0) {
+        c->pipe_len -= res;
+        c->sent += res;
+      } else if (res != -ECANCELED && !retry) {
+        c->failed = true;
+      }
+      break;
+  }
+  uring_conn_run(loop, c);
+}
+
+/* Stops LOOP accepting, once the server is draining for a reload. */
+static void uring_stop_accepting(struct event_loop *loop) {
+  struct io_uring_sqe *sqe = uring_sqe(loop, IORING_OP_ASYNC_CANCEL, URING_IGNORE);
+  if (sqe) {
+    sqe->fd = -1;
+    sqe->addr = URING_ACCEPT;
+  }
+  close(loop->listen_fd);
+  loop->listen_fd = -1;
+  reload_stop_accepting();
+}
+
+/* Runs one event loop on io_uring forever. */
+static void *uring_loop_run(void *arg) {
+  struct event_loop *loop = arg;
+  affinity_pin(loop->cpu);
+
+  /* The ring is set up here, in the only thread that will submit to it. */
+  int error = uring_init(&loop->ring);
+  if (error < 0) {
+    fprintf(stderr, "Failed to set up io_uring: %s\n", strerror(-error));
+    exit(-error);
+  }
+  loop->multishot = true;
+  loop->free_slot_cnt = 0;
+  loop->free_slots = malloc(EVLOOP_URING_FILES * sizeof(int));
+  if (loop->free_slots && uring_register_files(&loop->ring, EVLOOP_URING_FILES) == 0)
+    for (int slot = EVLOOP_URING_FILES - 1; slot >= 0; slot--)
+      loop->free_slots[loop->free_slot_cnt++] = slot;
+  uring_accept(loop);
+  uring_arm_tick(loop);
+
+  while (1) {
+    if (loop->listen_fd != -1 && reload_draining()) uring_stop_accepting(loop);
+
+    reload_accepting(loop->listen_fd != -1);
+    int n = uring_submit_and_wait(&loop->ring, 1);
+    reload_accepting(false);
+    if (n < 0 && n != -EINTR && n != -EAGAIN && n != -EBUSY) {
+      fprintf(stderr, "io_uring_enter failed: %s\n", strerror(-n));
+      exit(-n);
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&loop->ring))) {
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      uring_cqe_seen(&loop->ring);
+      uring_complete(loop, data, res, flags);
+    }
+  }
+  return NULL;
+}
+
+/* Creates the INDEXth loop, with its own listening socket. */
+static struct event_loop *event_loop_create(int index) {
+  struct event_loop *loop = malloc(sizeof(struct event_loop));
+  if (!loop) {
+    perror("Failed to allocate event loop");
+    exit(ENOMEM);
+  }
+
+  for (int i = 0; i < CONN_TIMER_CNT; i++) loop->timers[i] = NULL;
+  loop->spare = NULL;
+  loop->spare_cnt = 0;
+  loop->cpu = affinity_cpu(index);
+  loop->listen_fd = open_listen_socket(loop_port);
+  affinity_steer(loop->listen_fd, loop->cpu);
+  loop->epoll_fd = -1;
+  if (loop_uring) return loop;
+
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd == -1) {
+    perror("Failed to create epoll instance");
+    exit(errno);
+  }
+
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &event) == -1) {
+    perror("Failed to watch listening socket");
+    exit(errno);
+  }
+  return loop;
+}
+
+void event_loop_serve(int port, const char *files_directory, int num_loops,
+    bool io_uring, int *socket_number) {
+  loop_port = port;
+  loop_files_directory = files_directory;
+  if (io_uring && !uring_available()) {
+    fprintf(stderr, "Falling back to epoll\n");
+    io_uring = false;
+  }
+  loop_uring = io_uring;
+  void *(*run)(void *) = io_uring ? uring_loop_run : event_loop_run;
+
+  /* Writes to a client that has gone away should fail, not kill us. */
+  signal(SIGPIPE, SIG_IGN);
+
+  struct event_loop *first = event_loop_create(0);
+  *socket_number = first->listen_fd;
+
+  for (int i = 1; i < num_loops; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run, event_loop_create(i)) != 0) {
+      perror("Failed to start event loop thread");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
+
+  printf("Listening on port %d with %d %sevent loop%s...\n", port, num_loops,
+      io_uring ? "io_uring " : "", num_loops == 1 ? "" : "s");
+  reload_ready();
+  run(first);
+}
@@ -0,0 +1,21 @@
+#ifndef __EVLOOP__
+#define __EVLOOP__
+
+#include <stdbool.h>
+
+/* The event loop serves files from FILES_DIRECTORY on PORT with NUM_LOOPS
+ * threads, each running its own epoll loop over non-blocking sockets, so a
+ * few threads can hold thousands of keep-alive connections. Each loop has
+ * its own listening socket bound with SO_REUSEPORT, and the kernel spreads
+ * new connections across them. The first loop runs in the calling thread,
+ * and the fd number of its listening socket is saved in *socket_number.
+ * Does not return.
+ *
+ * With IO_URING, each loop queues its connections' I/O in an io_uring of
+ * its own instead of waiting on epoll, batching the system calls of all of
+ * them into one per pass. Kernels without a new enough io_uring fall back
+ * to epoll. */
+void event_loop_serve(int port, const char *files_directory, int num_loops,
+    bool io_uring, int *socket_number);
+
+#endif
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "stats.h"
+#include "utlist.h"
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fd_cache_entry *buckets[FD_CACHE_BUCKETS];
+static struct fd_cache_entry *lru;    /* Least recently used first. */
+static int capacity;
+static int used;
+
+void fd_cache_init(int size) {
+  capacity = size;
+}
+
+/* Returns the time in milliseconds on a clock that only moves forward. */
+static long cache_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static unsigned hash_path(const char *path) {
+  /* djb2 */
+  unsigned hash = 5381;
+  while (*path) hash = hash * 33 + (unsigned char) *path++;
+  return hash % FD_CACHE_BUCKETS;
+}
+
+static void entry_free(struct fd_cache_entry *entry) {
+  close(entry->fd);
+  free(entry->path);
+  free(entry);
+}
+
+/* Drops a reference to ENTRY. Must hold cache_lock. */
+static void entry_put(struct fd_cache_entry *entry) {
+  if (--entry->refs == 0) entry_free(entry);
+}
+
+/* Takes ENTRY out of the cache; holders keep it open until they release
+ * it. Must hold cache_lock. */
+static void entry_remove(struct fd_cache_entry *entry) {
+  struct fd_cache_entry **link = &buckets[hash_path(entry->path)];
+  while (*link != entry) link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  DL_DELETE(lru, entry);
+  used--;
+  entry_put(entry);
+}
+
+/* Returns the cached entry for PATH without touching its reference count,
+ * or NULL. Must hold cache_lock. */
+static struct fd_cache_entry *entry_find(const char *path) {
+  struct fd_cache_entry *entry = buckets[hash_path(path)];
+  while (entry && strcmp(entry->path, path) != 0) entry = entry->hash_next;
+  return entry;
+}
+
+/* Returns true if SB, the status of an entry's path now, is still of the
+ * file the entry has open, unchanged. */
+static bool entry_matches(const struct fd_cache_entry *entry, const struct stat *sb) {
+  return sb->st_dev == entry->sb.st_dev
+      && sb->st_ino == entry->sb.st_ino
+      && sb->st_size == entry->sb.st_size
+      && sb->st_mtim.tv_sec == entry->sb.st_mtim.tv_sec
+      && sb->st_mtim.tv_nsec == entry->sb.st_mtim.tv_nsec;
+}
+
+/* Returns the entry for PATH with a reference for the caller, checking it
+ * first if it's due, or NULL if there is none or it has changed. */
+static struct fd_cache_entry *entry_get(const char *path) {
+  if (capacity == 0) return NULL;
+
+  pthread_mutex_lock(&cache_lock);
+  struct fd_cache_entry *entry = entry_find(path);
+  if (!entry) {
+    pthread_mutex_unlock(&cache_lock);
+    return NULL;
+  }
+  entry->refs++;
+  DL_DELETE(lru, entry);
+  DL_APPEND(lru, entry);
+  long now = cache_now_ms();
+  bool stale = now - entry->checked_ms >= FD_CACHE_VALID_MS;
+  pthread_mutex_unlock(&cache_lock);
+  if (!stale) return entry;
+
+  /* Check the path without holding the lock. */
+  struct stat sb;
+  bool current = stat(path, &sb) == 0 && entry_matches(entry, &sb);
+  pthread_mutex_lock(&cache_lock);
+  if (current) {
+    entry->checked_ms = now;
+  } else {
+    if (entry_find(path) == entry) entry_remove(entry);
+    entry_put(entry);
+    entry = NULL;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return entry;
+}
+
+int fd_cache_stat(const char *path, struct stat *sb) {
+  struct fd_cache_entry *entry = entry_get(path);
+  if (!entry) return stat(path, sb);
+  *sb = entry->sb;
+  fd_cache_release(entry);
+  return 0;
+}
+
+struct fd_cache_entry *fd_cache_open(const char *path, bool keep) {
+  struct fd_cache_entry *entry = entry_get(path);
+  if (entry) {
+    stats_count(STATS_FD_CACHE_HITS);
+    return entry;
+  }
+
+  entry = calloc(1, sizeof(struct fd_cache_entry));
+  if (!entry) return NULL;
+  entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (entry->fd == -1) {
+    free(entry);
+    return NULL;
+  }
+  entry->path = strdup(path);
+  if (!entry->path || fstat(entry->fd, &entry->sb) == -1) {
+    entry_free(entry);
+    return NULL;
+  }
+  entry->checked_ms = cache_now_ms();
+  if (capacity == 0 || !keep) {
+    entry->refs = 1;    /* Just the caller. */
+    return entry;
+  }
+  stats_count(STATS_FD_CACHE_MISSES);
+  entry->refs = 2;      /* The cache and the caller. */
+
+  pthread_mutex_lock(&cache_lock);
+  /* Another thread may have opened the same file meanwhile. */
+  struct fd_cache_entry *old = entry_find(path);
+  if (old) entry_remove(old);
+  while (lru && used >= capacity) entry_remove(lru);
+
+  unsigned bucket = hash_path(path);
+  entry->hash_next = buckets[bucket];
+  buckets[bucket] = entry;
+  DL_APPEND(lru, entry);
+  used++;
+  pthread_mutex_unlock(&cache_lock);
+  return entry;
+}
+
+void fd_cache_release(struct fd_cache_entry *entry) {
+  pthread_mutex_lock(&cache_lock);
+  entry_put(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
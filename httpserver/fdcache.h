@@ -0,0 +1,60 @@
+#ifndef __FDCACHE__
+#define __FDCACHE__
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+/* The fd cache keeps files too big for the file cache open, along with
+ * their status, so serving one again costs no stat(), open() or close(),
+ * just the sendfile(). Entries are keyed by path and kept in least
+ * recently used order; the oldest is closed to make room once the cache
+ * holds as many as it was given.
+ *
+ * An entry is trusted for FD_CACHE_VALID_MS after it was last checked;
+ * the first lookup after that stat()s its path and drops the entry if the
+ * path now names another file, or the file's size or modification time
+ * changed. Since its bytes are read as they are sent, a file that is
+ * rewritten in place is sent as it is then either way.
+ *
+ * Entries are reference counted, so one dropped from the cache while a
+ * response is still being sent from it is closed once that's done. Its fd
+ * is shared by every response sent from it meanwhile, so it is only read
+ * at explicit offsets, never through its file position. */
+
+/* How long an entry is used without checking its path, in ms. */
+#define FD_CACHE_VALID_MS 1000
+
+/* Default number of files kept open. */
+#define FD_CACHE_DEFAULT_SIZE 256
+
+/* Number of hash chains. */
+#define FD_CACHE_BUCKETS 256
+
+struct fd_cache_entry {
+  char *path;
+  int fd;               /* PATH, open for reading. */
+  struct stat sb;       /* Its status when last checked. */
+
+  /* Owned by the cache and guarded by its lock. */
+  long checked_ms;      /* When PATH was last known to name it. */
+  int refs;             /* Holders, counting the cache itself. */
+  struct fd_cache_entry *hash_next;
+  struct fd_cache_entry *prev;    /* Neighbors in least recently used order. */
+  struct fd_cache_entry *next;
+};
+
+/* Sets how many files the cache keeps open. Zero turns it off. Call before
+ * any other fd cache function. */
+void fd_cache_init(int size);
+
+/* Like stat(), but answered from the cache if it holds PATH. */
+int fd_cache_stat(const char *path, struct stat *sb);
+
+/* Returns an entry holding PATH open for reading: the cache's, or else a
+ * new one, cached if KEEP is set. Returns NULL if PATH can't be opened.
+ * The caller must drop the entry with fd_cache_release(). */
+struct fd_cache_entry *fd_cache_open(const char *path, bool keep);
+
+void fd_cache_release(struct fd_cache_entry *entry);
+
+#endif
@@ -0,0 +1,552 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "filecache.h"
+#include "stats.h"
+#include "utlist.h"
+
+/* Number of hash chains. */
+#define FILE_CACHE_BUCKETS 1024
+
+/* Files bigger than this fraction of the capacity aren't cached, so one
+ * large file can't push out everything else. */
+#define FILE_CACHE_MAX_FILE_FRACTION 8
+
+/* zlib compression level for files gzipped as they are cached. They are
+ * compressed once and sent many times, so it's worth going past the
+ * default. */
+#define FILE_CACHE_GZIP_LEVEL 9
+
+/* Starts what file_cache_save() writes, so a process can't take what
+ * another kind of binary wrote. Bumped when struct cache_record changes. */
+#define FILE_CACHE_SAVE_MAGIC 0x48534301u
+
+/* An entry as file_cache_save() writes it, followed by its key, path,
+ * base path, headers, and body, unterminated. A record with a KEY_LEN of
+ * 0 ends them. */
+struct cache_record {
+  uint32_t key_len;
+  uint32_t path_len;
+  uint32_t base_path_len;   /* Or UINT32_MAX for no base path. */
+  uint32_t headers_len;
+  uint64_t size;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t file_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  /* Both processes read the same monotonic clock, so this carries over. */
+  int64_t checked_ms;
+  uint32_t type;
+  uint32_t missing;
+  char etag[HTTP_ETAG_MAX];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+static struct file_cache_entry *lru;   /* Least recently used first. */
+static size_t capacity;
+static size_t used;
+static bool gzip_enabled;
+
+void file_cache_init(size_t size) {
+  capacity = size;
+}
+
+void file_cache_make_key(char *key, const char *file_path, unsigned encodings) {
+  if (!http_mime_type_is_compressible(http_get_mime_type((char *) file_path)))
+    encodings = 1u << HTTP_ENCODING_IDENTITY;
+  sprintf(key, "%s\n%x", file_path, encodings);
+}
+
+/* Returns the time in milliseconds on a clock that only moves forward. */
+static long cache_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static unsigned hash_key(const char *key) {
+  /* djb2 */
+  unsigned hash = 5381;
+  while (*key) hash = hash * 33 + (unsigned char) *key++;
+  return hash % FILE_CACHE_BUCKETS;
+}
+
+/* Bytes ENTRY counts against the capacity. */
+static size_t entry_cost(const struct file_cache_entry *entry) {
+  return entry->size + entry->headers_len;
+}
+
+static void entry_free(struct file_cache_entry *entry) {
+  free(entry->key);
+  free(entry->path);
+  free(entry->base_path);
+  free(entry->headers);
+  free(entry->body);
+  free(entry);
+}
+
+/* Drops a reference to ENTRY. Must hold cache_lock. */
+static void entry_put(struct file_cache_entry *entry) {
+  if (--entry->refs == 0) entry_free(entry);
+}
+
+/* Takes ENTRY out of the cache; holders keep it alive until they release
+ * it. Must hold cache_lock. */
+static void entry_remove(struct file_cache_entry *entry) {
+  struct file_cache_entry **link = &buckets[hash_key(entry->key)];
+  while (*link != entry) link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  DL_DELETE(lru, entry);
+  used -= entry_cost(entry);
+  entry_put(entry);
+}
+
+/* Returns the cached entry for KEY without touching its reference count,
+ * or NULL. Must hold cache_lock. */
+static struct file_cache_entry *entry_find(const char *key) {
+  struct file_cache_entry *entry = buckets[hash_key(key)];
+  while (entry && strcmp(entry->key, key) != 0) entry = entry->hash_next;
+  return entry;
+}
+
+/* Returns true if the file ENTRY was read from is still the same, and no
+ * compressed sibling has turned up that would be sent instead. */
+static bool entry_is_current(const struct file_cache_entry *entry) {
+  struct stat sb;
+  if (stat(entry->path, &sb) != 0
+      || (sb.st_mode & S_IFMT) != entry->type
+      || sb.st_dev != entry->dev
+      || sb.st_ino != entry->ino
+      || sb.st_size != entry->file_size
+      || sb.st_mtim.tv_sec != entry->mtime.tv_sec
+      || sb.st_mtim.tv_nsec != entry->mtime.tv_nsec)
+    return false;
+
+  for (int encoding = 0; encoding < HTTP_ENCODING_CNT; encoding++) {
+    if (!(entry->missing & (1u << encoding))) continue;
+    char sibling[strlen(entry->base_path) + 4];
+    sprintf(sibling, "%s%s", entry->base_path, http_encoding_suffix(encoding));
+    if (stat(sibling, &sb) == 0 && S_ISREG(sb.st_mode)) return false;
+  }
+  return true;
+}
+
+/* Fills in the rest of ENTRY, read when the file's status was SB, and
+ * caches it under KEY if it fits. Either way the caller holds a reference
+ * to it. */
+static void entry_add(const char *key, struct file_cache_entry *entry,
+    const struct stat *sb) {
+  entry->dev = sb->st_dev;
+  entry->ino = sb->st_ino;
+  entry->type = sb->st_mode & S_IFMT;
+  entry->file_size = sb->st_size;
+  entry->mtime = sb->st_mtim;
+  entry->checked_ms = cache_now_ms();
+  if (capacity == 0 || entry_cost(entry) > capacity / FILE_CACHE_MAX_FILE_FRACTION) {
+    entry->refs = 1;    /* Just the caller. */
+    return;
+  }
+  entry->refs = 2;    /* The cache and the caller. */
+
+  pthread_mutex_lock(&cache_lock);
+  /* Another thread may have cached the same file meanwhile. */
+  struct file_cache_entry *old = entry_find(key);
+  if (old) entry_remove(old);
+  while (lru && used + entry_cost(entry) > capacity) entry_remove(lru);
+
+  unsigned bucket = hash_key(key);
+  entry->hash_next = buckets[bucket];
+  buckets[bucket] = entry;
+  DL_APPEND(lru, entry);
+  used += entry_cost(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+struct file_cache_entry *file_cache_lookup(const char *key) {
+  if (capacity == 0) return NULL;
+
+  pthread_mutex_lock(&cache_lock);
+  struct file_cache_entry *entry = entry_find(key);
+  if (!entry) {
+    pthread_mutex_unlock(&cache_lock);
+    stats_count(STATS_CACHE_MISSES);
+    return NULL;
+  }
+  entry->refs++;
+  DL_DELETE(lru, entry);
+  DL_APPEND(lru, entry);
+  long now = cache_now_ms();
+  bool stale = now - entry->checked_ms >= FILE_CACHE_VALID_MS;
+  pthread_mutex_unlock(&cache_lock);
+
+  if (!stale) {
+    stats_count(STATS_CACHE_HITS);
+    return entry;
+  }
+
+  /* Check the file without holding the lock. */
+  bool current = entry_is_current(entry);
+  pthread_mutex_lock(&cache_lock);
+  if (current) {
+    entry->checked_ms = now;
+  } else {
+    if (entry_find(key) == entry) entry_remove(entry);
+    entry_put(entry);
+    entry = NULL;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  stats_count(entry ? STATS_CACHE_HITS : STATS_CACHE_MISSES);
+  return entry;
+}
+
+/* Reads SIZE bytes of FILE_FD into BUF. Returns false on error or if the
+ * file is shorter than SIZE. */
+static bool read_file(int file_fd, char *buf, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(file_fd, buf + done, size - done, done);
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+/* Compresses the SIZE bytes at DATA with gzip into a new buffer, storing
+ * its length in *OUT_SIZE. Returns NULL on failure, or if compressing
+ * wouldn't save anything. */
+static char *gzip_compress(const char *data, size_t size, size_t *out_size) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  /* 16 more window bits asks for a gzip wrapper rather than zlib's. */
+  if (deflateInit2(&zs, FILE_CACHE_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  size_t cap = deflateBound(&zs, size);
+  char *out = malloc(cap);
+  if (out) {
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = size;
+    zs.next_out = (Bytef *) out;
+    zs.avail_out = cap;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= size) {
+      free(out);
+      out = NULL;
+    }
+  }
+  *out_size = zs.total_out;
+  deflateEnd(&zs);
+  if (!out) return NULL;
+
+  char *shrunk = realloc(out, *out_size > 0 ? *out_size : 1);
+  return shrunk ? shrunk : out;
+}
+
+void file_cache_enable_gzip(void) {
+  gzip_enabled = true;
+}
+
+bool file_cache_fits(off_t size) {
+  return capacity > 0 && (size_t) size <= capacity / FILE_CACHE_MAX_FILE_FRACTION;
+}
+
+struct file_cache_entry *file_cache_insert(const char *key,
+    const struct file_cache_source *source) {
+  const struct stat *sb = source->sb;
+  size_t size = sb->st_size;
+  if (!file_cache_fits(size)) return NULL;
+
+  struct file_cache_entry *entry = calloc(1, sizeof(struct file_cache_entry));
+  if (!entry) return NULL;
+  entry->key = strdup(key);
+  entry->path = strdup(source->path);
+  entry->base_path = strdup(source->base_path);
+  entry->body = malloc(size > 0 ? size : 1);
+  if (!entry->key || !entry->path || !entry->base_path || !entry->body
+      || !read_file(source->fd, entry->body, size)) {
+    entry_free(entry);
+    return NULL;
+  }
+  entry->size = size;
+  http_format_etag(entry->etag, sb);
+
+  int compressible = http_mime_type_is_compressible(source->content_type);
+  enum http_encoding encoding = source->encoding;
+  if (encoding == HTTP_ENCODING_IDENTITY && gzip_enabled && source->gzip
+      && compressible) {
+    size_t gzip_size;
+    char *gzipped = gzip_compress(entry->body, size, &gzip_size);
+    if (gzipped) {
+      free(entry->body);
+      entry->body = gzipped;
+      entry->size = gzip_size;
+      encoding = HTTP_ENCODING_GZIP;
+      /* This representation needs an ETag of its own. */
+      size_t len = strlen(entry->etag);
+      snprintf(entry->etag + len - 1, HTTP_ETAG_MAX - len + 1, "-gzip\"");
+    }
+  }
+
+  char last_modified[HTTP_DATE_MAX];
+  http_format_date(last_modified, sb->st_mtim.tv_sec);
+  const char *encoding_name = http_encoding_name(encoding);
+  const char *cache_control = source->cache_control;
+  int len = asprintf(&entry->headers,
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Length: %zu\r\n"
+      "ETag: %s\r\n"
+      "Last-Modified: %s\r\n"
+      "Accept-Ranges: bytes\r\n"
+      "%s%s%s%s%s%s%s",
+      source->content_type, entry->size, entry->etag, last_modified,
+      encoding_name ? "Content-Encoding: " : "", encoding_name ? encoding_name : "",
+      encoding_name ? "\r\n" : "",
+      compressible ? "Vary: Accept-Encoding\r\n" : "",
+      cache_control ? "Cache-Control: " : "", cache_control ? cache_control : "",
+      cache_control ? "\r\n" : "");
+  if (len < 0) {
+    entry->headers = NULL;
+    entry_free(entry);
+    return NULL;
+  }
+  entry->headers_len = len;
+  entry->content_type = source->content_type;
+  entry->missing = source->missing;
+  entry_add(key, entry, sb);
+  return entry;
+}
+
+/* Appends NAME to STREAM, escaped for HTML text and attribute values. */
+static void write_html_escaped(FILE *stream, const char *name) {
+  for (; *name; name++) {
+    switch (*name) {
+      case '&': fputs("&amp;", stream); break;
+      case '<': fputs("&lt;", stream); break;
+      case '>': fputs("&gt;", stream); break;
+      case '"': fputs("&quot;", stream); break;
+      case '\'': fputs("&#39;", stream); break;
+      default: fputc(*name, stream);
+    }
+  }
+}
+
+/* Appends NAME to STREAM as a relative URL path segment. Colons are
+ * escaped too, or "a:b" would read as a URL with scheme "a". */
+static void write_url_escaped(FILE *stream, const char *name) {
+  for (; *name; name++) {
+    unsigned char ch = *name;
+    if (isalnum(ch) || strchr("-._~!$()*+,;=@", ch))
+      fputc(ch, stream);
+    else
+      fprintf(stream, "%%%02X", ch);
+  }
+}
+
+struct file_cache_entry *file_cache_listing(const char *key, const char *dir_path,
+    const struct stat *sb) {
+  struct dirent **names;
+  int cnt = scandir(dir_path, &names, NULL, alphasort);
+  if (cnt < 0) return NULL;
+
+  struct file_cache_entry *entry = calloc(1, sizeof(struct file_cache_entry));
+  FILE *stream = entry ? open_memstream(&entry->body, &entry->size) : NULL;
+  for (int i = 0; i < cnt; i++) {
+    if (stream) {
+      fputs("<p><a href=\"", stream);
+      write_url_escaped(stream, names[i]->d_name);
+      fputs("\">", stream);
+      write_html_escaped(stream, names[i]->d_name);
+      fputs("</a></p>\n", stream);
+    }
+    free(names[i]);
+  }
+  free(names);
+  if (!stream || fclose(stream) != 0) {
+    if (entry) entry_free(entry);
+    return NULL;
+  }
+
+  entry->key = strdup(key);
+  entry->path = strdup(dir_path);
+  entry->content_type = "text/html";
+  http_format_etag(entry->etag, sb);
+  char last_modified[HTTP_DATE_MAX];
+  http_format_date(last_modified, sb->st_mtim.tv_sec);
+  int len = asprintf(&entry->headers,
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/html\r\n"
+      "Content-Length: %zu\r\n"
+      "ETag: %s\r\n"
+      "Last-Modified: %s\r\n",
+      entry->size, entry->etag, last_modified);
+  if (len < 0) entry->headers = NULL;
+  if (!entry->key || !entry->path || !entry->headers) {
+    entry_free(entry);
+    return NULL;
+  }
+  entry->headers_len = len;
+  entry_add(key, entry, sb);
+  return entry;
+}
+
+void file_cache_release(struct file_cache_entry *entry) {
+  pthread_mutex_lock(&cache_lock);
+  entry_put(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* Writes the LEN bytes at BUF to FD. Returns false if it can't. */
+static bool write_all(int fd, const void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(fd, (const char *) buf + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+/* Reads LEN bytes from FD into BUF. Returns false on error or end of file. */
+static bool read_all(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (char *) buf + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool save_entry(int fd, const struct file_cache_entry *entry) {
+  struct cache_record record;
+  memset(&record, 0, sizeof(record));
+  record.key_len = strlen(entry->key);
+  record.path_len = strlen(entry->path);
+  record.base_path_len = entry->base_path ? strlen(entry->base_path) : UINT32_MAX;
+  record.headers_len = entry->headers_len;
+  record.size = entry->size;
+  record.dev = entry->dev;
+  record.ino = entry->ino;
+  record.file_size = entry->file_size;
+  record.mtime_sec = entry->mtime.tv_sec;
+  record.mtime_nsec = entry->mtime.tv_nsec;
+  record.checked_ms = entry->checked_ms;
+  record.type = entry->type;
+  record.missing = entry->missing;
+  memcpy(record.etag, entry->etag, HTTP_ETAG_MAX);
+  return write_all(fd, &record, sizeof(record))
+      && write_all(fd, entry->key, record.key_len)
+      && write_all(fd, entry->path, record.path_len)
+      && (!entry->base_path || write_all(fd, entry->base_path, record.base_path_len))
+      && write_all(fd, entry->headers, entry->headers_len)
+      && write_all(fd, entry->body, entry->size);
+}
+
+bool file_cache_save(int fd) {
+  /* Hold the entries rather than the lock while they are written. */
+  pthread_mutex_lock(&cache_lock);
+  struct file_cache_entry *entry;
+  int cnt = 0;
+  DL_FOREACH(lru, entry) cnt++;
+  struct file_cache_entry **entries = malloc(sizeof(entry) * (cnt > 0 ? cnt : 1));
+  if (!entries) {
+    pthread_mutex_unlock(&cache_lock);
+    return false;
+  }
+  int i = 0;
+  DL_FOREACH(lru, entry) {
+    entry->refs++;
+    entries[i++] = entry;
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  uint32_t magic = FILE_CACHE_SAVE_MAGIC;
+  bool saved = write_all(fd, &magic, sizeof(magic));
+  for (i = 0; i < cnt && saved; i++) saved = save_entry(fd, entries[i]);
+  struct cache_record end = { .key_len = 0 };
+  saved = saved && write_all(fd, &end, sizeof(end));
+
+  for (i = 0; i < cnt; i++) file_cache_release(entries[i]);
+  free(entries);
+  return saved;
+}
+
+/* Reads LEN bytes of FD into a new string. Returns NULL on failure. */
+static char *read_string(int fd, size_t len) {
+  char *str = malloc(len + 1);
+  if (!str) return NULL;
+  if (!read_all(fd, str, len)) {
+    free(str);
+    return NULL;
+  }
+  str[len] = '\0';
+  return str;
+}
+
+int file_cache_restore(int fd) {
+  uint32_t magic;
+  if (!read_all(fd, &magic, sizeof(magic)) || magic != FILE_CACHE_SAVE_MAGIC)
+    return -1;
+
+  for (int cnt = 0; ; cnt++) {
+    struct cache_record record;
+    if (!read_all(fd, &record, sizeof(record))) return -1;
+    if (record.key_len == 0) return cnt;
+
+    struct file_cache_entry *entry = calloc(1, sizeof(struct file_cache_entry));
+    if (!entry) return -1;
+    entry->key = read_string(fd, record.key_len);
+    entry->path = entry->key ? read_string(fd, record.path_len) : NULL;
+    bool ok = entry->path != NULL;
+    if (ok && record.base_path_len != UINT32_MAX)
+      ok = (entry->base_path = read_string(fd, record.base_path_len)) != NULL;
+    if (ok) ok = (entry->headers = read_string(fd, record.headers_len)) != NULL;
+    if (ok) {
+      entry->body = malloc(record.size > 0 ? record.size : 1);
+      ok = entry->body && read_all(fd, entry->body, record.size);
+    }
+    if (!ok) {
+      entry_free(entry);
+      return -1;
+    }
+    entry->headers_len = record.headers_len;
+    entry->size = record.size;
+    entry->missing = record.missing;
+    memcpy(entry->etag, record.etag, HTTP_ETAG_MAX);
+    entry->etag[HTTP_ETAG_MAX - 1] = '\0';
+    /* CONTENT_TYPE pointed into the saving process's tables, so it is
+     * looked up again in ours. */
+    entry->content_type = record.type == S_IFDIR ? "text/html"
+        : http_get_mime_type(entry->base_path ? entry->base_path : entry->path);
+
+    struct stat sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.st_dev = record.dev;
+    sb.st_ino = record.ino;
+    sb.st_mode = record.type;
+    sb.st_size = record.file_size;
+    sb.st_mtim.tv_sec = record.mtime_sec;
+    sb.st_mtim.tv_nsec = record.mtime_nsec;
+    entry_add(entry->key, entry, &sb);
+    pthread_mutex_lock(&cache_lock);
+    entry->checked_ms = record.checked_ms;
+    entry_put(entry);
+    pthread_mutex_unlock(&cache_lock);
+  }
+}
@@ -0,0 +1,126 @@
+#ifndef __FILECACHE__
+#define __FILECACHE__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libhttp.h"
+
+/* The file cache keeps the bytes of small, often-requested files in memory,
+ * along with the start of their response, so a hit is answered with one
+ * writev() and no filesystem calls. Entries are kept in least recently used
+ * order and the oldest are dropped to stay under the cache's capacity.
+ *
+ * An entry is trusted for FILE_CACHE_VALID_MS after it was last checked;
+ * the first hit after that stat()s the file and drops the entry if the
+ * file's inode, size, or modification time changed. So a changed file may
+ * be served stale for up to that long. */
+
+/* How long an entry is served without checking its file, in ms. */
+#define FILE_CACHE_VALID_MS 1000
+
+/* Default capacity, in bytes. */
+#define FILE_CACHE_DEFAULT_SIZE (32 * 1024 * 1024)
+
+/* A cached file. Its fields don't change once it's been returned. */
+struct file_cache_entry {
+  char *key;            /* Path as requested, under the files directory. */
+  char *path;           /* File served: KEY, or KEY/index.html. */
+
+  /* Status line and the Content-Type, Content-Length, ETag, Last-Modified,
+   * Accept-Ranges, and any Content-Encoding, Vary, and Cache-Control
+   * headers. Not followed by a blank line, so the
+   * caller can add more headers. */
+  char *headers;
+  size_t headers_len;
+
+  char *body;           /* What is sent, compressed if it was gzipped. */
+  size_t size;
+  const char *content_type;
+
+  /* What the file looked like when it was read. */
+  dev_t dev;
+  ino_t ino;
+  mode_t type;          /* S_IFREG, or S_IFDIR for a listing. */
+  off_t file_size;
+  struct timespec mtime;
+  char etag[HTTP_ETAG_MAX];
+
+  /* Compressed siblings of BASE_PATH that didn't exist when the entry was
+   * made, as bits (1 << coding). If one appears, the entry is stale. */
+  char *base_path;
+  unsigned missing;
+
+  /* Owned by the cache and guarded by its lock. */
+  long checked_ms;      /* When the file was last known to match. */
+  int refs;             /* Holders, counting the cache itself. */
+  struct file_cache_entry *hash_next;
+  struct file_cache_entry *prev;    /* Neighbors in least recently used order. */
+  struct file_cache_entry *next;
+};
+
+/* Room file_cache_make_key() needs past the length of the path. */
+#define FILE_CACHE_KEY_EXTRA 16
+
+/* Makes the key under which FILE_PATH, as sent to a client accepting
+ * ENCODINGS, is cached. Clients accepting different codings may be sent
+ * different things for files of compressible types. */
+void file_cache_make_key(char *key, const char *file_path, unsigned encodings);
+
+/* Sets the cache's capacity in bytes. Zero turns the cache off. Call before
+ * any other file cache function. */
+void file_cache_init(size_t capacity);
+
+/* Returns whether a file of SIZE bytes is small enough to cache. */
+bool file_cache_fits(off_t size);
+
+/* Returns the entry for KEY, or NULL if there isn't one or its file has
+ * changed. The caller must drop the entry with file_cache_release(). */
+struct file_cache_entry *file_cache_lookup(const char *key);
+
+/* Turns on compressing files for gzip-accepting clients as they are
+ * cached, for those of compressible types that have no .gz sibling. */
+void file_cache_enable_gzip(void);
+
+/* What file_cache_insert() caches. */
+struct file_cache_source {
+  const char *path;           /* File to read. */
+  int fd;                     /* PATH, open for reading. */
+  const struct stat *sb;      /* PATH's status. */
+  const char *content_type;
+  const char *cache_control;  /* Or NULL. */
+  enum http_encoding encoding;    /* Coding PATH is stored in. */
+  int gzip;                   /* Whether the client accepts gzip. */
+  const char *base_path;      /* File PATH is a compressed sibling of. */
+  unsigned missing;           /* See struct file_cache_entry. */
+};
+
+/* Reads SOURCE's file into the cache under KEY, along with the headers it
+ * is sent with, gzipping it first if that's turned on and the client
+ * accepts it. Returns the new entry, which the caller must drop with
+ * file_cache_release(), or NULL if the file can't be cached: the cache is
+ * off, the file is too big, or it couldn't be read. */
+struct file_cache_entry *file_cache_insert(const char *key,
+    const struct file_cache_source *source);
+
+/* Returns an entry holding the HTML listing of directory DIR_PATH, whose
+ * status is SB, sorted by name. It is cached under KEY and rendered again
+ * only once the directory changes. Returns NULL if the directory can't be
+ * read. The caller must drop the entry with file_cache_release(). */
+struct file_cache_entry *file_cache_listing(const char *key, const char *dir_path,
+    const struct stat *sb);
+
+void file_cache_release(struct file_cache_entry *entry);
+
+/* Writes the cached entries to FD, least recently used first, for another
+ * process to take with file_cache_restore(). Returns false if FD fails. */
+bool file_cache_save(int fd);
+
+/* Caches the entries file_cache_save() wrote to FD, as far as they fit.
+ * Each is checked against its file as it would have been in the process
+ * that saved it. Returns how many were read, or -1 on error. */
+int file_cache_restore(int fd);
+
+#endif
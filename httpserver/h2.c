@@ -0,0 +1,1034 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "fdcache.h"
+#include "filecache.h"
+#include "h2.h"
+#include "hpack.h"
+#include "pathcache.h"
+#include "reload.h"
+#include "stats.h"
+#include "utlist.h"
+
+/* Frame types. */
+enum h2_frame_type {
+  H2_DATA,
+  H2_HEADERS,
+  H2_PRIORITY,
+  H2_RST_STREAM,
+  H2_SETTINGS,
+  H2_PUSH_PROMISE,
+  H2_PING,
+  H2_GOAWAY,
+  H2_WINDOW_UPDATE,
+  H2_CONTINUATION,
+};
+
+/* Frame flags. */
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+/* Error codes, for RST_STREAM and GOAWAY. */
+enum h2_error {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_COMPRESSION_ERROR = 0x9,
+  H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+/* Settings we look at or send. */
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define H2_FRAME_HEADER_LEN 9
+#define H2_WINDOW_DEFAULT 65535
+#define H2_WINDOW_MAX 0x7fffffff
+
+/* Largest header block taken, across its CONTINUATION frames. */
+#define H2_HEADER_BLOCK_MAX 65536
+
+/* Bytes of control frames, like acks and window updates, a client may
+ * leave unread before it is cut off. */
+#define H2_CONTROL_MAX 65536
+
+/* Bytes h2_serve() sends at a time. */
+#define H2_SERVE_BUFFER_SIZE (4 * H2_OUTPUT_MIN)
+
+/* A request being answered. Once its response's headers are encoded and
+ * its body found, they are sent a frame at a time as the flow control
+ * windows allow. */
+struct h2_stream {
+  uint32_t id;
+  int64_t window;       /* What we may still send on it. */
+  bool client_open;     /* The client may still send on it. */
+
+  /* Response headers, as a header block, until they're sent. */
+  unsigned char head_buf[LIBHTTP_RESPONSE_HEADER_MAX];
+  struct hpack_block head;
+  bool head_sent;
+
+  /* Body in memory: part of a cached file, or generated, as the stats. */
+  struct file_cache_entry *cached;
+  char *generated;
+  const char *body;
+  size_t body_left;
+
+  /* File body, read as it's sent from the fd OPENED holds. */
+  struct fd_cache_entry *opened;
+  int file_fd;
+  off_t file_off;
+  size_t file_left;
+
+  /* The access log's line for the response, if it is logged. */
+  bool logged;
+  struct access_log_entry log;
+  int status;
+  long long sent;
+
+  /* When the request began, for the stats, if it is counted there. */
+  bool counted;
+  long start;
+
+  struct h2_stream *prev;   /* Neighbors in the session's send order. */
+  struct h2_stream *next;
+};
+
+/* A request's fields as decoded, kept in the session while its header
+ * block is read: the pseudo-headers and the headers the HTTP/1.1 parser
+ * would pick out. */
+struct h2_request {
+  char fields[LIBHTTP_REQUEST_MAX_SIZE];
+  size_t len;
+  char *method;
+  char *path;
+  char *scheme;
+  char *headers[HTTP_HEADER_CNT];
+  bool regular;         /* A regular field has been seen. */
+  bool malformed;
+};
+
+struct h2_session {
+  const char *files_directory;
+  size_t preface_got;   /* Bytes of H2_PREFACE_REST had so far. */
+  bool settings_seen;   /* The client's first frame, which must be SETTINGS. */
+
+  /* A frame being read. */
+  unsigned char in[H2_FRAME_HEADER_LEN + H2_FRAME_SIZE];
+  size_t in_len;
+
+  /* A header block being gathered from CONTINUATION frames, while
+   * BLOCK_STREAM isn't 0. */
+  uint32_t block_stream;
+  bool block_new;       /* It opens the stream, rather than ending it. */
+  bool block_end_stream;
+  unsigned char *block;
+  size_t block_len;
+
+  struct hpack_decoder decoder;
+  struct h2_request request;
+  uint32_t last_stream; /* Highest stream the client has opened. */
+  int requests;
+
+  int64_t window;       /* What we may still send on the connection. */
+  int64_t initial_window;   /* A new stream's, by the client's settings. */
+  struct h2_stream *streams;    /* Being answered, next to send from first. */
+  int stream_cnt;
+
+  /* Control frames waiting to go out, ahead of the streams' frames. */
+  unsigned char *ctrl;
+  size_t ctrl_len;
+  size_t ctrl_sent;
+  size_t ctrl_cap;
+
+  bool goaway;          /* Taking no more streams. */
+  bool failed;          /* Broken: nothing more is read or answered. */
+};
+
+bool h2_is_preface(const struct http_request *request) {
+  return strcmp(request->method, "PRI") == 0 && strcmp(request->path, "*") == 0;
+}
+
+static uint32_t h2_get32(const unsigned char *p) {
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void h2_put32(unsigned char *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+/* Writes the header of a frame with a LEN-byte payload at P. */
+static void h2_put_frame_header(unsigned char *p, size_t len, int type, int flags,
+    uint32_t stream) {
+  p[0] = len >> 16;
+  p[1] = len >> 8;
+  p[2] = len;
+  p[3] = type;
+  p[4] = flags;
+  h2_put32(p + 5, stream & 0x7fffffff);
+}
+
+/* Queues a control frame with the LEN-byte PAYLOAD. A client that lets
+ * too many pile up unread is cut off. */
+static void h2_queue(struct h2_session *session, int type, int flags,
+    uint32_t stream, const void *payload, size_t len) {
+  size_t need = session->ctrl_len + H2_FRAME_HEADER_LEN + len;
+  if (need - session->ctrl_sent > H2_CONTROL_MAX) {
+    session->ctrl_len = session->ctrl_sent = 0;
+    session->failed = session->goaway = true;
+    return;
+  }
+  if (need > session->ctrl_cap) {
+    size_t cap = session->ctrl_cap ? session->ctrl_cap : 256;
+    while (cap < need) cap *= 2;
+    unsigned char *ctrl = realloc(session->ctrl, cap);
+    if (!ctrl) {
+      session->failed = session->goaway = true;
+      return;
+    }
+    session->ctrl = ctrl;
+    session->ctrl_cap = cap;
+  }
+  h2_put_frame_header(session->ctrl + session->ctrl_len, len, type, flags, stream);
+  if (len > 0) memcpy(session->ctrl + session->ctrl_len + H2_FRAME_HEADER_LEN, payload, len);
+  session->ctrl_len = need;
+}
+
+/* Queues a frame carrying the one value VALUE: a window update, or a
+ * stream's reset. */
+static void h2_queue32(struct h2_session *session, int type, uint32_t stream,
+    uint32_t value) {
+  unsigned char payload[4];
+  h2_put32(payload, value);
+  h2_queue(session, type, 0, stream, payload, sizeof(payload));
+}
+
+/* Finishes STREAM, logging its response and letting go of its body. */
+static void h2_stream_end(struct h2_session *session, struct h2_stream *stream) {
+  if (stream->logged) access_log_end(&stream->log, stream->status, stream->sent);
+  if (stream->counted) stats_request(STATS_FILES, stream->status, stream->sent, stream->start);
+  if (stream->opened) fd_cache_release(stream->opened);
+  if (stream->cached) file_cache_release(stream->cached);
+  free(stream->generated);
+  DL_DELETE(session->streams, stream);
+  session->stream_cnt--;
+  free(stream);
+}
+
+static struct h2_stream *h2_stream_find(struct h2_session *session, uint32_t id) {
+  struct h2_stream *stream;
+  DL_FOREACH(session->streams, stream)
+    if (stream->id == id) return stream;
+  return NULL;
+}
+
+/* Ends stream ID with ERROR, finishing it if it's being answered. */
+static void h2_reset(struct h2_session *session, uint32_t id, enum h2_error error) {
+  h2_queue32(session, H2_RST_STREAM, id, error);
+  struct h2_stream *stream = h2_stream_find(session, id);
+  if (stream) h2_stream_end(session, stream);
+}
+
+/* Fails the connection with ERROR. The client is told with a GOAWAY, and
+ * the streams being answered are dropped. */
+static void h2_fail(struct h2_session *session, enum h2_error error) {
+  if (session->failed) return;
+  unsigned char payload[8];
+  h2_put32(payload, session->last_stream);
+  h2_put32(payload + 4, error);
+  h2_queue(session, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  session->failed = session->goaway = true;
+  while (session->streams) h2_stream_end(session, session->streams);
+}
+
+struct h2_session *h2_session_new(const char *files_directory) {
+  struct h2_session *session = calloc(1, sizeof(struct h2_session));
+  if (!session) return NULL;
+  session->files_directory = files_directory;
+  hpack_decoder_init(&session->decoder);
+  session->window = H2_WINDOW_DEFAULT;
+  session->initial_window = H2_WINDOW_DEFAULT;
+
+  unsigned char settings[6];
+  settings[0] = 0;
+  settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  h2_put32(settings + 2, H2_MAX_STREAMS);
+  h2_queue(session, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  return session;
+}
+
+void h2_session_free(struct h2_session *session) {
+  while (session->streams) h2_stream_end(session, session->streams);
+  hpack_decoder_free(&session->decoder);
+  free(session->block);
+  free(session->ctrl);
+  free(session);
+}
+
+void h2_session_shutdown(struct h2_session *session) {
+  if (session->goaway) return;
+  unsigned char payload[8];
+  h2_put32(payload, session->last_stream);
+  h2_put32(payload + 4, H2_NO_ERROR);
+  h2_queue(session, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  session->goaway = true;
+}
+
+bool h2_session_done(const struct h2_session *session) {
+  return (session->failed || (session->goaway && !session->streams))
+      && session->ctrl_sent == session->ctrl_len;
+}
+
+bool h2_session_busy(const struct h2_session *session) {
+  return session->streams != NULL;
+}
+
+/*
+ * Building a response.
+ */
+
+/* Starts STREAM's response headers with STATUS. */
+static void h2_stream_status(struct h2_stream *stream, int status) {
+  stream->status = status;
+  hpack_block_init(&stream->head, stream->head_buf, sizeof(stream->head_buf));
+  hpack_encode_status(&stream->head, status);
+}
+
+static void h2_stream_header(struct h2_stream *stream, const char *name,
+    const char *value) {
+  hpack_encode(&stream->head, name, strlen(name), value, strlen(value));
+}
+
+static void h2_stream_content_length(struct h2_stream *stream, off_t length) {
+  char value[24];
+  snprintf(value, sizeof(value), "%lld", (long long) length);
+  h2_stream_header(stream, "content-length", value);
+}
+
+/* Adds the LEN bytes of HTTP/1.1 headers at HEADERS, past their status
+ * line, to STREAM's response headers. */
+static void h2_stream_http1_headers(struct h2_stream *stream, const char *headers,
+    size_t len) {
+  const char *end = headers + len;
+  const char *line = memchr(headers, '\n', len);
+  line = line ? line + 1 : end;
+  while (line < end) {
+    const char *eol = memchr(line, '\n', end - line);
+    const char *next = eol ? eol + 1 : end;
+    const char *line_end = eol ? eol : end;
+    if (line_end > line && line_end[-1] == '\r') line_end--;
+
+    const char *colon = memchr(line, ':', line_end - line);
+    if (colon) {
+      const char *value = colon + 1;
+      while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+      hpack_encode(&stream->head, line, colon - line, value, line_end - value);
+    }
+    line = next;
+  }
+}
+
+/* Sets STREAM's response to STATUS with no body. */
+static void h2_respond_empty(struct h2_stream *stream, int status) {
+  h2_stream_status(stream, status);
+  h2_stream_content_length(stream, 0);
+}
+
+/* Sets a 304 for a client whose copy of the file with ETAG is current. */
+static void h2_respond_not_modified(struct h2_stream *stream, const char *etag,
+    const char *cache_control) {
+  h2_stream_status(stream, 304);
+  h2_stream_header(stream, "etag", etag);
+  if (cache_control) h2_stream_header(stream, "cache-control", cache_control);
+}
+
+/*
+ * Sets a response to REQUEST for STREAM's file, which is SIZE bytes of
+ * CONTENT_TYPE with ETAG, if REQUEST asks for a range of it: a 206, or a
+ * 416 if the range isn't in the file. Returns false and sets nothing if
+ * the whole file should be sent. Requests for several ranges get the
+ * whole file; multiplexed streams leave little to gain from multipart
+ * bodies.
+ */
+static bool h2_respond_ranges(struct h2_stream *stream, const struct http_request *request,
+    const char *content_type, off_t size, const char *etag, time_t mtime) {
+  struct http_range ranges[HTTP_RANGE_MAX];
+  int cnt = http_request_ranges(request, etag, mtime, size, ranges);
+  if (cnt == 0 || cnt > 1) return false;
+
+  char content_range[64];
+  if (cnt < 0) {
+    h2_respond_empty(stream, 416);
+    snprintf(content_range, sizeof(content_range), "bytes */%lld", (long long) size);
+    h2_stream_header(stream, "content-range", content_range);
+    return true;
+  }
+  h2_stream_status(stream, 206);
+  h2_stream_header(stream, "content-type", content_type);
+  h2_stream_content_length(stream, ranges[0].length);
+  snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%lld",
+      (long long) ranges[0].start,
+      (long long) (ranges[0].start + ranges[0].length - 1), (long long) size);
+  h2_stream_header(stream, "content-range", content_range);
+  h2_stream_header(stream, "etag", etag);
+  if (stream->cached) {
+    stream->body = stream->cached->body + ranges[0].start;
+    stream->body_left = ranges[0].length;
+  } else {
+    stream->file_off = ranges[0].start;
+    stream->file_left = ranges[0].length;
+  }
+  return true;
+}
+
+/* Sets the response for STREAM's cached file, as respond_cached() does in
+ * the event loop. */
+static void h2_respond_cached(struct h2_stream *stream, const struct http_request *request) {
+  struct file_cache_entry *entry = stream->cached;
+  if (http_request_not_modified(request, entry->etag, entry->mtime.tv_sec)) {
+    h2_respond_not_modified(stream, entry->etag, http_cache_control_lookup(request->path));
+    return;
+  }
+  if (h2_respond_ranges(stream, request, entry->content_type, entry->size,
+        entry->etag, entry->mtime.tv_sec))
+    return;
+
+  /* Cached headers all start with a 200 status line. */
+  h2_stream_status(stream, 200);
+  h2_stream_http1_headers(stream, entry->headers, entry->headers_len);
+  stream->body = entry->body;
+  stream->body_left = entry->size;
+}
+
+/* Sets STREAM's response to REQUEST for a file under FILES_DIRECTORY. It
+ * serves the same things the event loop's respond() does. */
+static void h2_respond_files(struct h2_stream *stream, const struct http_request *request,
+    const char *files_directory) {
+  /* The path in canonical form, so it can't climb out of FILES_DIRECTORY
+   * and each file has one cache key. */
+  char path[strlen(request->path) + 2];
+  if (http_normalize_path(request->path, path) == -1) {
+    h2_respond_empty(stream, 400);
+    return;
+  }
+
+  size_t path_len = strlen(files_directory) + strlen(path) + strlen("/index.html") + 1;
+  char file_path[path_len];
+  snprintf(file_path, path_len, "%s%s", files_directory, path);
+
+  unsigned encodings = http_request_encodings(request);
+  char cache_key[path_len + FILE_CACHE_KEY_EXTRA];
+  file_cache_make_key(cache_key, file_path, encodings);
+  stream->cached = file_cache_lookup(cache_key);
+  if (stream->cached) {
+    h2_respond_cached(stream, request);
+    return;
+  }
+
+  /* The file, the directory's index.html, or the directory to list; the
+   * path cache remembers which, so a directory isn't probed each time. */
+  struct stat sb;
+  enum path_target target = path_cache_resolve(file_path, &sb);
+  if (target == PATH_NONE) {
+    h2_respond_empty(stream, 404);
+    return;
+  }
+  if (target == PATH_DIRECTORY) {
+    stream->cached = file_cache_listing(cache_key, file_path, &sb);
+    if (stream->cached)
+      h2_respond_cached(stream, request);
+    else
+      h2_respond_empty(stream, 404);
+    return;
+  }
+
+  const char *cache_control = http_cache_control_lookup(path);
+  const char *content_type = http_get_mime_type(file_path);
+
+  /* Send a compressed sibling instead if the client takes it. */
+  char encoded_path[path_len + 4];
+  struct stat encoded_sb;
+  unsigned missing;
+  enum http_encoding encoding = http_find_encoded_sibling(file_path, content_type,
+      encodings, encoded_path, &encoded_sb, &missing);
+  const char *send_path = file_path;
+  if (encoding != HTTP_ENCODING_IDENTITY) {
+    send_path = encoded_path;
+    sb = encoded_sb;
+  }
+
+  char etag[HTTP_ETAG_MAX];
+  http_format_etag(etag, &sb);
+  if (http_request_not_modified(request, etag, sb.st_mtim.tv_sec)) {
+    h2_respond_not_modified(stream, etag, cache_control);
+    return;
+  }
+
+  /* Files too big for the file cache are kept open for the next request. */
+  stream->opened = fd_cache_open(send_path, !file_cache_fits(sb.st_size));
+  if (!stream->opened) {
+    h2_respond_empty(stream, 404);
+    return;
+  }
+  stream->file_fd = stream->opened->fd;
+  struct file_cache_source source = {
+    .path = send_path, .fd = stream->file_fd, .sb = &sb,
+    .content_type = content_type, .cache_control = cache_control,
+    .encoding = encoding, .gzip = encodings & (1u << HTTP_ENCODING_GZIP),
+    .base_path = file_path, .missing = missing,
+  };
+  stream->cached = file_cache_insert(cache_key, &source);
+  if (stream->cached) {
+    fd_cache_release(stream->opened);
+    stream->opened = NULL;
+    stream->file_fd = -1;
+    h2_respond_cached(stream, request);
+    return;
+  }
+  if (h2_respond_ranges(stream, request, content_type, sb.st_size, etag, sb.st_mtim.tv_sec))
+    return;
+
+  stream->file_off = 0;
+  stream->file_left = sb.st_size;
+  char last_modified[HTTP_DATE_MAX];
+  http_format_date(last_modified, sb.st_mtim.tv_sec);
+  h2_stream_status(stream, 200);
+  h2_stream_header(stream, "content-type", content_type);
+  h2_stream_content_length(stream, sb.st_size);
+  h2_stream_header(stream, "etag", etag);
+  h2_stream_header(stream, "last-modified", last_modified);
+  h2_stream_header(stream, "accept-ranges", "bytes");
+  if (encoding != HTTP_ENCODING_IDENTITY)
+    h2_stream_header(stream, "content-encoding", http_encoding_name(encoding));
+  if (http_mime_type_is_compressible(content_type))
+    h2_stream_header(stream, "vary", "accept-encoding");
+  if (cache_control) h2_stream_header(stream, "cache-control", cache_control);
+}
+
+/* Sets STREAM's response to a request for the stats at PATH. */
+static void h2_respond_stats(struct h2_stream *stream, const char *path) {
+  const char *content_type;
+  size_t size;
+  stream->generated = stats_render(path, strlen(path), &content_type, &size);
+  if (!stream->generated) {
+    h2_respond_empty(stream, 500);
+    return;
+  }
+  h2_stream_status(stream, 200);
+  h2_stream_header(stream, "content-type", content_type);
+  h2_stream_content_length(stream, size);
+  h2_stream_header(stream, "cache-control", "no-store");
+  stream->body = stream->generated;
+  stream->body_left = size;
+}
+
+/* Starts answering the request the session has just decoded, on stream
+ * ID. CLIENT_OPEN is set if the client has more of it to send. */
+static void h2_respond(struct h2_session *session, uint32_t id, bool client_open) {
+  struct h2_request *fields = &session->request;
+  if (fields->malformed || !fields->method || !fields->path || fields->path[0] == '\0') {
+    h2_queue32(session, H2_RST_STREAM, id, H2_PROTOCOL_ERROR);
+    return;
+  }
+  struct h2_stream *stream;
+  if (session->stream_cnt >= H2_MAX_STREAMS
+      || !(stream = calloc(1, sizeof(struct h2_stream)))) {
+    h2_queue32(session, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+    return;
+  }
+  stream->id = id;
+  stream->window = session->initial_window;
+  stream->client_open = client_open;
+  stream->file_fd = -1;
+  DL_APPEND(session->streams, stream);
+  session->stream_cnt++;
+
+  struct http_request request = {
+    .method = fields->method, .path = fields->path, .keep_alive = 1,
+  };
+  memcpy(request.headers, fields->headers, sizeof(request.headers));
+  size_t path_len = strlen(request.path);
+  stream->logged = access_log_begin(&stream->log, request.method,
+      strlen(request.method), request.path, path_len);
+  stream->counted = !stats_is_request(request.path, path_len);
+  stream->start = stats_start();
+  if (stream->counted)
+    h2_respond_files(stream, &request, session->files_directory);
+  else
+    h2_respond_stats(stream, request.path);
+
+  if (stream->head.overflow) {
+    h2_respond_empty(stream, 500);
+    stream->body_left = stream->file_left = 0;
+  }
+  if (strcmp(request.method, "HEAD") == 0) stream->body_left = stream->file_left = 0;
+
+  /* A server being replaced takes no more once this is answered. */
+  if (++session->requests >= H2_MAX_REQUESTS || reload_draining())
+    h2_session_shutdown(session);
+}
+
+/*
+ * Reading frames.
+ */
+
+/* Keeps the LEN bytes of S with the request's fields, returning the copy,
+ * or NULL if there's no room. */
+static char *h2_request_keep(struct h2_request *request, const char *s, size_t len) {
+  if (sizeof(request->fields) - request->len <= len) {
+    request->malformed = true;
+    return NULL;
+  }
+  char *copy = request->fields + request->len;
+  memcpy(copy, s, len + 1);
+  request->len += len + 1;
+  return copy;
+}
+
+/* Takes a field of the request being decoded. */
+static void h2_request_field(void *aux, const char *name, size_t name_len,
+    const char *value, size_t value_len) {
+  struct h2_request *request = aux;
+  if (name[0] == ':') {
+    /* Pseudo-headers come first, once each. */
+    char **slot = NULL;
+    if (strcmp(name, ":method") == 0) slot = &request->method;
+    else if (strcmp(name, ":path") == 0) slot = &request->path;
+    else if (strcmp(name, ":scheme") == 0) slot = &request->scheme;
+    else if (strcmp(name, ":authority") == 0) slot = &request->headers[HTTP_HEADER_HOST];
+    if (!slot || *slot || request->regular) {
+      request->malformed = true;
+      return;
+    }
+    *slot = h2_request_keep(request, value, value_len);
+    return;
+  }
+
+  request->regular = true;
+  enum http_header_id id = http_header_lookup(name, name_len);
+  if (id != HTTP_HEADER_CNT && !request->headers[id])
+    request->headers[id] = h2_request_keep(request, value, value_len);
+}
+
+/* Decodes the LEN-byte header block BLOCK of stream ID, and answers it if
+ * it opens the stream (NEW). */
+static void h2_header_block(struct h2_session *session, uint32_t id, bool new,
+    bool end_stream, const unsigned char *block, size_t len) {
+  struct h2_request *request = &session->request;
+  request->len = 0;
+  request->method = request->path = request->scheme = NULL;
+  memset(request->headers, 0, sizeof(request->headers));
+  request->regular = request->malformed = false;
+
+  /* A block has to be decoded even if it's not answered, or the dynamic
+   * table would fall out of step. */
+  if (!hpack_decode(&session->decoder, block, len, h2_request_field, request)) {
+    h2_fail(session, H2_COMPRESSION_ERROR);
+    return;
+  }
+  if (new && !session->goaway) h2_respond(session, id, !end_stream);
+
+  /* Trailers end the client's side of a stream. */
+  struct h2_stream *stream;
+  if (!new && end_stream && (stream = h2_stream_find(session, id)))
+    stream->client_open = false;
+}
+
+/* Strips the padding, and for HEADERS the priority too, from the frame
+ * whose payload is *PAYLOAD and *LEN bytes. Returns false if the padding is
+ * longer than the frame. */
+static bool h2_strip(int type, int flags, const unsigned char **payload, size_t *len) {
+  size_t pad = 0;
+  if (flags & H2_FLAG_PADDED) {
+    if (*len < 1) return false;
+    pad = (*payload)[0];
+    (*payload)++;
+    (*len)--;
+  }
+  if (type == H2_HEADERS && (flags & H2_FLAG_PRIORITY)) {
+    if (*len < 5) return false;
+    *payload += 5;
+    *len -= 5;
+  }
+  if (pad > *len) return false;
+  *len -= pad;
+  return true;
+}
+
+/* Applies the client's LEN bytes of settings at P. */
+static void h2_settings(struct h2_session *session, const unsigned char *p, size_t len) {
+  for (size_t i = 0; i + 6 <= len; i += 6) {
+    unsigned id = p[i] << 8 | p[i + 1];
+    uint32_t value = h2_get32(p + i + 2);
+    if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+      if (value > H2_WINDOW_MAX) {
+        h2_fail(session, H2_FLOW_CONTROL_ERROR);
+        return;
+      }
+      /* Windows of streams already open move by the change. */
+      int64_t delta = (int64_t) value - session->initial_window;
+      struct h2_stream *stream;
+      DL_FOREACH(session->streams, stream) stream->window += delta;
+      session->initial_window = value;
+    } else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+      /* We send frames of the default size, which every client takes. */
+      if (value < H2_FRAME_SIZE || value > 0xffffff) {
+        h2_fail(session, H2_PROTOCOL_ERROR);
+        return;
+      }
+    }
+  }
+}
+
+/* Acts on a frame of TYPE with FLAGS on STREAM whose LEN-byte payload is
+ * PAYLOAD. */
+static void h2_frame(struct h2_session *session, int type, int flags, uint32_t id,
+    const unsigned char *payload, size_t len) {
+  struct h2_stream *stream;
+
+  /* A header block's frames come one after another. */
+  if (session->block_stream && type != H2_CONTINUATION) {
+    h2_fail(session, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (!session->settings_seen && type != H2_SETTINGS) {
+    h2_fail(session, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  switch (type) {
+    case H2_DATA:
+      /* A request body, which no file needs. It's let through so the
+       * client isn't left waiting on flow control. */
+      if (id == 0) {
+        h2_fail(session, H2_PROTOCOL_ERROR);
+        return;
+      }
+      if (len > 0) h2_queue32(session, H2_WINDOW_UPDATE, 0, len);
+      stream = h2_stream_find(session, id);
+      if (stream && stream->client_open) {
+        if (flags & H2_FLAG_END_STREAM)
+          stream->client_open = false;
+        else if (len > 0)
+          h2_queue32(session, H2_WINDOW_UPDATE, id, len);
+      }
+      return;
+
+    case H2_HEADERS:
+      if (id == 0 || !h2_strip(type, flags, &payload, &len)) {
+        h2_fail(session, H2_PROTOCOL_ERROR);
+        return;
+      }
+      bool new = id > session->last_stream;
+      if (new) {
+        /* Client streams are odd, and each above the last. */
+        if (id % 2 == 0) {
+          h2_fail(session, H2_PROTOCOL_ERROR);
+          return;
+        }
+        session->last_stream = id;
+      }
+      if (flags & H2_FLAG_END_HEADERS) {
+        h2_header_block(session, id, new, flags & H2_FLAG_END_STREAM, payload, len);
+        return;
+      }
+      if (!session->block && !(session->block = malloc(H2_HEADER_BLOCK_MAX))) {
+        h2_fail(session, H2_INTERNAL_ERROR);
+        return;
+      }
+      memcpy(session->block, payload, len);
+      session->block_len = len;
+      session->block_stream = id;
+      session->block_new = new;
+      session->block_end_stream = flags & H2_FLAG_END_STREAM;
+      return;
+
+    case H2_CONTINUATION:
+      if (id == 0 || id != session->block_stream) {
+        h2_fail(session, H2_PROTOCOL_ERROR);
+        return;
+      }
+      if (H2_HEADER_BLOCK_MAX - session->block_len < len) {
+        h2_fail(session, H2_ENHANCE_YOUR_CALM);
+        return;
+      }
+      memcpy(session->block + session->block_len, payload, len);
+      session->block_len += len;
+      if (flags & H2_FLAG_END_HEADERS) {
+        session->block_stream = 0;
+        h2_header_block(session, id, session->block_new, session->block_end_stream,
+            session->block, session->block_len);
+      }
+      return;
+
+    case H2_RST_STREAM:
+      if (id == 0 || len != 4) {
+        h2_fail(session, id == 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+        return;
+      }
+      stream = h2_stream_find(session, id);
+      if (stream) h2_stream_end(session, stream);
+      return;
+
+    case H2_SETTINGS:
+      if (id != 0 || (flags & H2_FLAG_ACK ? len != 0 : len % 6 != 0)) {
+        h2_fail(session, id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+        return;
+      }
+      session->settings_seen = true;
+      if (flags & H2_FLAG_ACK) return;
+      h2_settings(session, payload, len);
+      h2_queue(session, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+      return;
+
+    case H2_PUSH_PROMISE:
+      /* Only servers push. */
+      h2_fail(session, H2_PROTOCOL_ERROR);
+      return;
+
+    case H2_PING:
+      if (id != 0 || len != 8) {
+        h2_fail(session, id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+        return;
+      }
+      if (!(flags & H2_FLAG_ACK)) h2_queue(session, H2_PING, H2_FLAG_ACK, 0, payload, len);
+      return;
+
+    case H2_GOAWAY:
+      /* The client is going; finish what it has asked for. */
+      session->goaway = true;
+      return;
+
+    case H2_WINDOW_UPDATE: {
+      if (len != 4) {
+        h2_fail(session, H2_FRAME_SIZE_ERROR);
+        return;
+      }
+      uint32_t increment = h2_get32(payload) & 0x7fffffff;
+      if (id == 0) {
+        session->window += increment;
+        if (increment == 0 || session->window > H2_WINDOW_MAX)
+          h2_fail(session, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        return;
+      }
+      stream = h2_stream_find(session, id);
+      if (!stream) return;
+      stream->window += increment;
+      if (increment == 0 || stream->window > H2_WINDOW_MAX)
+        h2_reset(session, id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+      return;
+    }
+
+    default:
+      /* PRIORITY, which we don't act on, and unknown types are ignored. */
+      return;
+  }
+}
+
+void h2_session_input(struct h2_session *session, const char *data, size_t len) {
+  const unsigned char *p = (const unsigned char *) data, *end = p + len;
+  const size_t preface_len = strlen(H2_PREFACE_REST);
+
+  while (p < end && !session->failed) {
+    if (session->preface_got < preface_len) {
+      if (*p++ != H2_PREFACE_REST[session->preface_got++]) h2_fail(session, H2_PROTOCOL_ERROR);
+      continue;
+    }
+
+    /* Gather the frame's header, then its payload. */
+    size_t need = H2_FRAME_HEADER_LEN;
+    if (session->in_len >= H2_FRAME_HEADER_LEN)
+      need += session->in[0] << 16 | session->in[1] << 8 | session->in[2];
+    size_t take = need - session->in_len;
+    if (take > (size_t) (end - p)) take = end - p;
+    memcpy(session->in + session->in_len, p, take);
+    session->in_len += take;
+    p += take;
+    if (session->in_len < H2_FRAME_HEADER_LEN) break;
+
+    const unsigned char *in = session->in;
+    size_t frame_len = in[0] << 16 | in[1] << 8 | in[2];
+    if (frame_len > H2_FRAME_SIZE) {
+      h2_fail(session, H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if (session->in_len < H2_FRAME_HEADER_LEN + frame_len) continue;
+    session->in_len = 0;
+    h2_frame(session, in[3], in[4], h2_get32(in + 5) & 0x7fffffff,
+        in + H2_FRAME_HEADER_LEN, frame_len);
+  }
+}
+
+/*
+ * Writing frames.
+ */
+
+/* Returns true if STREAM has a frame that may be sent now. */
+static bool h2_stream_ready(const struct h2_session *session,
+    const struct h2_stream *stream) {
+  if (!stream->head_sent) return true;
+  return stream->body_left + stream->file_left > 0
+      && stream->window > 0 && session->window > 0;
+}
+
+size_t h2_session_output(struct h2_session *session, char *out, size_t cap) {
+  size_t n = 0;
+
+  /* Control frames go first. */
+  if (session->ctrl_sent < session->ctrl_len) {
+    n = session->ctrl_len - session->ctrl_sent;
+    if (n > cap) n = cap;
+    memcpy(out, session->ctrl + session->ctrl_sent, n);
+    session->ctrl_sent += n;
+    if (session->ctrl_sent < session->ctrl_len) return n;
+  }
+  session->ctrl_len = session->ctrl_sent = 0;
+
+  /* Then a frame of each stream that can send one, in turn. A stream that
+   * sends goes to the back of the line. */
+  while (!session->failed) {
+    struct h2_stream *stream;
+    DL_FOREACH(session->streams, stream)
+      if (h2_stream_ready(session, stream)) break;
+    if (!stream) break;
+
+    unsigned char *frame = (unsigned char *) out + n;
+    size_t room = cap - n;
+    size_t body_left = stream->body_left + stream->file_left;
+    if (!stream->head_sent) {
+      size_t head_len = stream->head.len;
+      if (room < H2_FRAME_HEADER_LEN + head_len) break;
+      h2_put_frame_header(frame, head_len, H2_HEADERS,
+          H2_FLAG_END_HEADERS | (body_left == 0 ? H2_FLAG_END_STREAM : 0), stream->id);
+      memcpy(frame + H2_FRAME_HEADER_LEN, stream->head_buf, head_len);
+      n += H2_FRAME_HEADER_LEN + head_len;
+      stream->head_sent = true;
+    } else {
+      if (room <= H2_FRAME_HEADER_LEN) break;
+      size_t chunk = body_left;
+      if (chunk > H2_FRAME_SIZE) chunk = H2_FRAME_SIZE;
+      if (chunk > room - H2_FRAME_HEADER_LEN) chunk = room - H2_FRAME_HEADER_LEN;
+      if ((int64_t) chunk > stream->window) chunk = stream->window;
+      if ((int64_t) chunk > session->window) chunk = session->window;
+
+      unsigned char *data = frame + H2_FRAME_HEADER_LEN;
+      if (stream->body_left > 0) {
+        memcpy(data, stream->body, chunk);
+        stream->body += chunk;
+        stream->body_left -= chunk;
+      } else {
+        ssize_t got = pread(stream->file_fd, data, chunk, stream->file_off);
+        if (got <= 0) {
+          /* The file shrank, or can't be read. */
+          h2_reset(session, stream->id, H2_INTERNAL_ERROR);
+          continue;
+        }
+        chunk = got;
+        stream->file_off += chunk;
+        stream->file_left -= chunk;
+      }
+      body_left -= chunk;
+      h2_put_frame_header(frame, chunk, H2_DATA,
+          body_left == 0 ? H2_FLAG_END_STREAM : 0, stream->id);
+      n += H2_FRAME_HEADER_LEN + chunk;
+      stream->window -= chunk;
+      session->window -= chunk;
+      stream->sent += chunk;
+    }
+
+    if (body_left == 0) {
+      /* The response is all sent. A client still sending the request is
+       * told it needn't. */
+      if (stream->client_open) h2_queue32(session, H2_RST_STREAM, stream->id, H2_NO_ERROR);
+      h2_stream_end(session, stream);
+    } else {
+      DL_DELETE(session->streams, stream);
+      DL_APPEND(session->streams, stream);
+    }
+  }
+
+  /* Frames queued meanwhile, as resets, go out with these if they fit. */
+  if (session->ctrl_len > 0 && n < cap) n += h2_session_output(session, out + n, cap - n);
+  return n;
+}
+
+/* Writes the LEN bytes at DATA to FD. Returns false if it fails. */
+static bool h2_send_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+void h2_serve(int fd, const struct http_conn_io *io, const char *data, size_t len,
+    const char *files_directory) {
+  struct h2_session *session = h2_session_new(files_directory);
+  char *out = malloc(H2_SERVE_BUFFER_SIZE);
+  if (!session || !out) {
+    if (session) h2_session_free(session);
+    free(out);
+    return;
+  }
+  char in[H2_FRAME_SIZE];
+  h2_session_input(session, data, len);
+
+  /* A frame the client waits on, like the last of a flow control window,
+   * shouldn't wait on the client's ack of the one before. */
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  while (1) {
+    size_t n;
+    bool sent = true;
+    while (sent && (n = h2_session_output(session, out, H2_SERVE_BUFFER_SIZE)) > 0)
+      sent = h2_send_all(fd, out, n);
+    if (!sent || h2_session_done(session)) break;
+
+    if (!io || !io->pending(io->aux)) {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN };
+      int ready = poll(&pfd, 1, http_idle_timeout_ms);
+      if (ready < 0 && errno == EINTR) continue;
+      if (ready < 0) break;
+      if (ready == 0) {
+        /* Idle: say goodbye, and give the client one more wait to take
+         * what it was sent. */
+        if (session->goaway) break;
+        h2_session_shutdown(session);
+        continue;
+      }
+    }
+    ssize_t got = io ? io->read(io->aux, in, sizeof(in)) : read(fd, in, sizeof(in));
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) break;
+    h2_session_input(session, in, got);
+  }
+  h2_session_free(session);
+  free(out);
+}
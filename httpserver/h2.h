@@ -0,0 +1,79 @@
+#ifndef __H2__
+#define __H2__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "libhttp.h"
+
+/* HTTP/2 (RFC 9113) for the files handler, over TLS to clients that offer
+ * "h2" and in the clear to clients that know to start with it (h2c, with
+ * prior knowledge), as proxies and other internal traffic do. Each request
+ * is a stream of its own on the one connection, and the frames of the
+ * streams being answered are sent in turn, so no response holds up the
+ * others. Files come from the file cache as they do for HTTP/1.1.
+ *
+ * A session is just the protocol: it takes the bytes read from a client
+ * and hands back the bytes to send, and never touches a socket itself.
+ * h2_serve() drives one on a pool thread; the event loop drives its own
+ * without blocking.
+ *
+ * Both kinds of client start with a preface that reads like an HTTP/1.1
+ * request, "PRI * HTTP/2.0" and empty headers, so it is spotted by the
+ * HTTP/1.1 parser. The session takes what comes after it. */
+
+/* Bytes of the preface after what the HTTP/1.1 parser takes as a head. */
+#define H2_PREFACE_REST "SM\r\n\r\n"
+
+/* Largest frame we take or send, the protocol's default. */
+#define H2_FRAME_SIZE 16384
+
+/* Room a session needs to write its next frame into. */
+#define H2_OUTPUT_MIN (H2_FRAME_SIZE + 9)
+
+/* Streams a client may have open at once. */
+#define H2_MAX_STREAMS 100
+
+/* Requests a connection carries before it is closed, once they're
+ * answered, so that one client doesn't keep a pool thread forever. */
+#define H2_MAX_REQUESTS 1000
+
+struct h2_session;
+
+/* Returns true if REQUEST is the start of an HTTP/2 preface. */
+bool h2_is_preface(const struct http_request *request);
+
+/* Starts a session serving files under FILES_DIRECTORY, with our settings
+ * queued to be sent. Returns NULL if out of memory. */
+struct h2_session *h2_session_new(const char *files_directory);
+void h2_session_free(struct h2_session *session);
+
+/* Takes the LEN bytes at DATA read from the client. */
+void h2_session_input(struct h2_session *session, const char *data, size_t len);
+
+/* Writes what should be sent next into OUT, which has room for CAP bytes,
+ * at least H2_OUTPUT_MIN. Returns how many were written: 0 if nothing can
+ * be sent until the client sends more. */
+size_t h2_session_output(struct h2_session *session, char *out, size_t cap);
+
+/* Returns true once the connection should be closed: the session has
+ * failed or been shut down, and what it had to send has been taken. */
+bool h2_session_done(const struct h2_session *session);
+
+/* Tells the client no more requests will be taken, after those it has
+ * sent are answered. */
+void h2_session_shutdown(struct h2_session *session);
+
+/* Returns true if the session is answering any requests. */
+bool h2_session_busy(const struct h2_session *session);
+
+/*
+ * Serves HTTP/2 to the client on FD, read through IO if it isn't NULL,
+ * whose preface has been read up to the LEN bytes at DATA. Returns once
+ * the session is done, the client goes away, or it is idle for
+ * http_idle_timeout_ms. The caller closes FD.
+ */
+void h2_serve(int fd, const struct http_conn_io *io, const char *data, size_t len,
+    const char *files_directory);
+
+#endif
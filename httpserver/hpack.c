@@ -0,0 +1,426 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "hpack.h"
+
+/* The static table (RFC 7541, appendix A). Index 1 is its first entry. */
+#define HPACK_STATIC_CNT 61
+
+static const char *hpack_static_table[HPACK_STATIC_CNT][2] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+/* The Huffman code (RFC 7541, appendix B), by symbol. Symbol 256 is EOS,
+ * which must not appear in a string. */
+static const uint32_t hpack_huffman_codes[257] = {
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+  0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+  0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+  0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+  0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+  0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+  0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+  0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+  0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+  0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+  0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+  0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+  0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+  0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+  0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+  0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+  0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+  0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+  0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+  0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+  0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+  0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+  0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+  0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+  0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+  0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+  0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+  0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+  0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+  0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+  0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+  0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+
+static const uint8_t hpack_huffman_lengths[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30,
+};
+
+/* The Huffman code as a binary tree: node I's children for a 0 bit and a 1
+ * bit. A child below 0 is the leaf of symbol -child - 1. Node 0 is the
+ * root, which is no node's child, so 0 marks a child not yet made. */
+static int16_t hpack_tree[256][2];
+static pthread_once_t hpack_tree_once = PTHREAD_ONCE_INIT;
+
+static void hpack_build_tree(void) {
+  int nodes = 1;
+  for (int sym = 0; sym < 257; sym++) {
+    uint32_t code = hpack_huffman_codes[sym];
+    int node = 0;
+    for (int bit = hpack_huffman_lengths[sym] - 1; bit > 0; bit--) {
+      int b = (code >> bit) & 1;
+      if (hpack_tree[node][b] == 0) hpack_tree[node][b] = nodes++;
+      node = hpack_tree[node][b];
+    }
+    hpack_tree[node][code & 1] = -sym - 1;
+  }
+}
+
+/* Decodes the LEN Huffman-coded bytes at SRC into DST, which has room for
+ * HPACK_FIELD_MAX with the terminator, and sets *DST_LEN. Returns false if
+ * they don't decode, or decode to too much. */
+static bool hpack_huffman_decode(const unsigned char *src, size_t len,
+    char *dst, size_t *dst_len) {
+  size_t n = 0;
+  int node = 0;
+  int depth = 0;        /* Bits read since the last symbol ended. */
+  bool ones = true;     /* And whether they were all 1s. */
+  for (size_t i = 0; i < len; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      int b = (src[i] >> bit) & 1;
+      int next = hpack_tree[node][b];
+      depth++;
+      ones = ones && b;
+      if (next >= 0) {
+        node = next;
+        continue;
+      }
+      int sym = -next - 1;
+      if (sym == 256 || n + 1 >= HPACK_FIELD_MAX) return false;
+      dst[n++] = sym;
+      node = 0;
+      depth = 0;
+      ones = true;
+    }
+  }
+  /* The string is padded out to a byte with the start of EOS: up to 7 1s. */
+  if (depth > 7 || !ones) return false;
+  dst[n] = '\0';
+  *dst_len = n;
+  return true;
+}
+
+/* Reads an integer with a PREFIX-bit prefix at *P, before END, into
+ * *VALUE, moving *P past it. */
+static bool hpack_read_int(const unsigned char **p, const unsigned char *end,
+    int prefix, size_t *value) {
+  if (*p == end) return false;
+  size_t mask = (1u << prefix) - 1;
+  size_t v = *(*p)++ & mask;
+  if (v == mask) {
+    for (int shift = 0; ; shift += 7) {
+      if (*p == end || shift > 28) return false;
+      unsigned char b = *(*p)++;
+      v += (size_t) (b & 0x7f) << shift;
+      if (!(b & 0x80)) break;
+    }
+  }
+  *value = v;
+  return true;
+}
+
+/* Reads a string at *P, before END, into DST, which has room for
+ * HPACK_FIELD_MAX with the terminator, and sets *LEN. */
+static bool hpack_read_string(const unsigned char **p, const unsigned char *end,
+    char *dst, size_t *len) {
+  if (*p == end) return false;
+  bool huffman = **p & 0x80;
+  size_t n;
+  if (!hpack_read_int(p, end, 7, &n) || n > (size_t) (end - *p)) return false;
+  const unsigned char *src = *p;
+  *p += n;
+  if (huffman) return hpack_huffman_decode(src, n, dst, len);
+  if (n >= HPACK_FIELD_MAX) return false;
+  memcpy(dst, src, n);
+  dst[n] = '\0';
+  *len = n;
+  return true;
+}
+
+void hpack_decoder_init(struct hpack_decoder *decoder) {
+  decoder->first = 0;
+  decoder->cnt = 0;
+  decoder->size = 0;
+  decoder->max_size = HPACK_TABLE_SIZE;
+}
+
+/* Drops DECODER's oldest entry. */
+static void hpack_evict(struct hpack_decoder *decoder) {
+  struct hpack_entry *entry =
+      &decoder->entries[(decoder->first + decoder->cnt - 1) % HPACK_TABLE_ENTRIES];
+  decoder->size -= entry->name_len + entry->value_len + 32;
+  free(entry->name);
+  decoder->cnt--;
+}
+
+void hpack_decoder_free(struct hpack_decoder *decoder) {
+  while (decoder->cnt > 0) hpack_evict(decoder);
+}
+
+/* Adds NAME: VALUE as DECODER's newest entry, dropping the oldest to make
+ * room. One bigger than the whole table empties it and isn't added. */
+static bool hpack_insert(struct hpack_decoder *decoder, const char *name,
+    size_t name_len, const char *value, size_t value_len) {
+  size_t size = name_len + value_len + 32;
+  char *copy = NULL;
+  if (size <= decoder->max_size) {
+    copy = malloc(name_len + value_len + 2);
+    if (!copy) return false;
+    memcpy(copy, name, name_len + 1);
+    memcpy(copy + name_len + 1, value, value_len + 1);
+  }
+  while (decoder->cnt > 0 && decoder->size + size > decoder->max_size)
+    hpack_evict(decoder);
+  if (!copy) return true;
+
+  decoder->first = (decoder->first + HPACK_TABLE_ENTRIES - 1) % HPACK_TABLE_ENTRIES;
+  decoder->entries[decoder->first] = (struct hpack_entry) {
+    copy, name_len, copy + name_len + 1, value_len,
+  };
+  decoder->cnt++;
+  decoder->size += size;
+  return true;
+}
+
+/* Finds the field at INDEX of the static table, then the dynamic one. */
+static bool hpack_lookup(const struct hpack_decoder *decoder, size_t index,
+    const char **name, size_t *name_len, const char **value, size_t *value_len) {
+  if (index == 0) return false;
+  if (index <= HPACK_STATIC_CNT) {
+    *name = hpack_static_table[index - 1][0];
+    *value = hpack_static_table[index - 1][1];
+    *name_len = strlen(*name);
+    *value_len = strlen(*value);
+    return true;
+  }
+  index -= HPACK_STATIC_CNT + 1;
+  if (index >= (size_t) decoder->cnt) return false;
+  const struct hpack_entry *entry =
+      &decoder->entries[(decoder->first + index) % HPACK_TABLE_ENTRIES];
+  *name = entry->name;
+  *name_len = entry->name_len;
+  *value = entry->value;
+  *value_len = entry->value_len;
+  return true;
+}
+
+bool hpack_decode(struct hpack_decoder *decoder, const unsigned char *block,
+    size_t len, hpack_field_fn field, void *aux) {
+  pthread_once(&hpack_tree_once, hpack_build_tree);
+  const unsigned char *p = block, *end = block + len;
+  char name_buf[HPACK_FIELD_MAX], value_buf[HPACK_FIELD_MAX];
+  const char *name, *value;
+  size_t name_len, value_len, index;
+
+  while (p < end) {
+    unsigned char b = *p;
+    if (b & 0x80) {
+      /* Indexed: the whole field is in a table. */
+      if (!hpack_read_int(&p, end, 7, &index)
+          || !hpack_lookup(decoder, index, &name, &name_len, &value, &value_len))
+        return false;
+      field(aux, name, name_len, value, value_len);
+      continue;
+    }
+    if ((b & 0xe0) == 0x20) {
+      /* A dynamic table size update. */
+      if (!hpack_read_int(&p, end, 5, &index) || index > HPACK_TABLE_SIZE)
+        return false;
+      decoder->max_size = index;
+      while (decoder->size > decoder->max_size) hpack_evict(decoder);
+      continue;
+    }
+
+    /* A literal, to be kept in the dynamic table or not. Its name may be
+     * a table's, copied out because adding the field may evict it. */
+    bool keep = (b & 0xc0) == 0x40;
+    if (!hpack_read_int(&p, end, keep ? 6 : 4, &index)) return false;
+    if (index == 0) {
+      if (!hpack_read_string(&p, end, name_buf, &name_len)) return false;
+    } else {
+      if (!hpack_lookup(decoder, index, &name, &name_len, &value, &value_len))
+        return false;
+      memcpy(name_buf, name, name_len + 1);
+    }
+    if (!hpack_read_string(&p, end, value_buf, &value_len)) return false;
+    if (keep && !hpack_insert(decoder, name_buf, name_len, value_buf, value_len))
+      return false;
+    field(aux, name_buf, name_len, value_buf, value_len);
+  }
+  return true;
+}
+
+void hpack_block_init(struct hpack_block *block, void *buf, size_t cap) {
+  block->buf = buf;
+  block->len = 0;
+  block->cap = cap;
+  block->overflow = false;
+}
+
+/* Adds VALUE as an integer with a PREFIX-bit prefix, the first byte's
+ * other bits set to FLAGS. */
+static void hpack_put_int(struct hpack_block *block, unsigned char flags,
+    int prefix, size_t value) {
+  size_t mask = (1u << prefix) - 1;
+  unsigned char bytes[16];
+  int n = 0;
+  if (value < mask) {
+    bytes[n++] = flags | value;
+  } else {
+    bytes[n++] = flags | mask;
+    for (value -= mask; value >= 0x80; value >>= 7)
+      bytes[n++] = 0x80 | (value & 0x7f);
+    bytes[n++] = value;
+  }
+  if (block->cap - block->len < (size_t) n) {
+    block->overflow = true;
+    return;
+  }
+  memcpy(block->buf + block->len, bytes, n);
+  block->len += n;
+}
+
+/* Adds LEN bytes of S as a string, without Huffman coding, lowercased if
+ * LOWER is set. */
+static void hpack_put_string(struct hpack_block *block, const char *s, size_t len,
+    bool lower) {
+  hpack_put_int(block, 0, 7, len);
+  if (block->overflow || block->cap - block->len < len) {
+    block->overflow = true;
+    return;
+  }
+  unsigned char *dst = block->buf + block->len;
+  for (size_t i = 0; i < len; i++)
+    dst[i] = lower ? tolower((unsigned char) s[i]) : s[i];
+  block->len += len;
+}
+
+void hpack_encode_status(struct hpack_block *block, int status) {
+  char digits[8];
+  int len = snprintf(digits, sizeof(digits), "%03d", status);
+
+  /* The common ones are whole static entries, 8 through 14. */
+  for (int i = 7; i < 14; i++) {
+    if (strcmp(hpack_static_table[i][1], digits) == 0) {
+      hpack_put_int(block, 0x80, 7, i + 1);
+      return;
+    }
+  }
+  hpack_put_int(block, 0x00, 4, 8);
+  hpack_put_string(block, digits, len, false);
+}
+
+void hpack_encode(struct hpack_block *block, const char *name, size_t name_len,
+    const char *value, size_t value_len) {
+  /* A literal not to be indexed, its name the static table's if it's
+   * there. The pseudo-headers come first in the table and aren't looked
+   * at. */
+  size_t index = 0;
+  for (int i = 14; i < HPACK_STATIC_CNT; i++) {
+    const char *entry = hpack_static_table[i][0];
+    if (strlen(entry) == name_len && strncasecmp(entry, name, name_len) == 0) {
+      index = i + 1;
+      break;
+    }
+  }
+  hpack_put_int(block, 0x00, 4, index);
+  if (index == 0) hpack_put_string(block, name, name_len, true);
+  hpack_put_string(block, value, value_len, false);
+}
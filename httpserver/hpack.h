@@ -0,0 +1,71 @@
+#ifndef __HPACK__
+#define __HPACK__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* HPACK, the header compression of HTTP/2 (RFC 7541). Request headers are
+ * decoded with everything a client may use: the static table, a dynamic
+ * table of the fields it has asked to keep, and Huffman-coded strings.
+ * Response headers are encoded as literals that the client is told not to
+ * keep, so the encoding side has no table to keep in step. */
+
+/* Size of the dynamic table a client may use: the default, which we never
+ * raise. Each entry costs at least 32 bytes, so it has room for at most
+ * HPACK_TABLE_ENTRIES. */
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_TABLE_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+/* Longest name or value decoded. A block with a longer one is an error. */
+#define HPACK_FIELD_MAX 8192
+
+/* A field the client asked to keep, in one allocation: NAME, its
+ * terminator, VALUE, and its terminator. */
+struct hpack_entry {
+  char *name;
+  size_t name_len;
+  char *value;
+  size_t value_len;
+};
+
+/* A connection's dynamic table, as a ring of entries, newest first. */
+struct hpack_decoder {
+  struct hpack_entry entries[HPACK_TABLE_ENTRIES];
+  int first;            /* Index of the newest. */
+  int cnt;
+  size_t size;          /* What the entries cost, by the RFC's count. */
+  size_t max_size;      /* What the client last set the table's size to. */
+};
+
+/* Called with each field of a block, in order. NAME and VALUE are
+ * terminated and good only for the call. */
+typedef void (*hpack_field_fn)(void *aux, const char *name, size_t name_len,
+    const char *value, size_t value_len);
+
+void hpack_decoder_init(struct hpack_decoder *decoder);
+void hpack_decoder_free(struct hpack_decoder *decoder);
+
+/* Decodes the LEN-byte header block BLOCK, calling FIELD with AUX for each
+ * field. Returns false if the block is malformed, after which DECODER is
+ * out of step with the client's encoder and the connection must end. */
+bool hpack_decode(struct hpack_decoder *decoder, const unsigned char *block,
+    size_t len, hpack_field_fn field, void *aux);
+
+/* A header block being encoded into a caller's buffer. */
+struct hpack_block {
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+  bool overflow;        /* Set once a field didn't fit. */
+};
+
+void hpack_block_init(struct hpack_block *block, void *buf, size_t cap);
+
+/* Adds the :status pseudo-header for STATUS. Goes first. */
+void hpack_encode_status(struct hpack_block *block, int status);
+
+/* Adds the field NAME: VALUE, lowercasing NAME as HTTP/2 requires. */
+void hpack_encode(struct hpack_block *block, const char *name, size_t name_len,
+    const char *value, size_t value_len);
+
+#endif
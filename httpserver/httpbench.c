@@ -0,0 +1,434 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+
+/*
+ * httpbench: a load generator for httpserver. Each of --threads threads
+ * runs an epoll loop over its share of --connections connections, each of
+ * which sends one request at a time, chosen at random from the URL mix,
+ * and waits for the whole response before sending the next. Without
+ * --keep-alive each request gets a connection of its own, and its latency
+ * includes connecting.
+ *
+ * Latencies go into a histogram with 64 buckets per power of two, so the
+ * percentiles reported are within about 1.6% of the true ones.
+ */
+
+/* Histogram buckets: exact below HIST_LINEAR microseconds, then 64 per
+ * power of two up to 2^HIST_MAX_BITS. */
+#define HIST_LINEAR 128
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS (HIST_LINEAR + (HIST_MAX_BITS - 7) * 64)
+
+#define MAX_EVENTS 256
+
+struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+/* Where a connection is in its request. */
+enum bench_state {
+  BENCH_CONNECTING,
+  BENCH_WRITING,
+  BENCH_READING_HEAD,
+  BENCH_READING_BODY,
+};
+
+struct bench_conn {
+  int fd;
+  enum bench_state state;
+  long start_us;          /* When the request began. */
+  char request[1024];
+  size_t request_len;
+  size_t request_sent;
+  struct http_parser parser;
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE + 1];
+  size_t len;
+  long long body_left;    /* Or -1 to read until the connection closes. */
+  bool chunked;           /* Or the body is chunked, and ends where this says. */
+  struct http_dechunker dechunker;
+};
+
+/* One thread's connections and results. */
+struct bench_thread {
+  pthread_t thread;
+  int connections;
+  unsigned seed;
+  struct histogram latency;
+  uint64_t completed;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t statuses[6];   /* By hundreds: 1xx through 5xx, and others. */
+};
+
+static struct sockaddr_in bench_address;
+static const char *bench_host = "127.0.0.1";
+static int bench_keep_alive;
+static char **bench_urls;
+static int bench_url_cnt;
+static long bench_deadline_us;      /* Stop then, if running for a time. */
+static long bench_requests_left;    /* Or after this many, if positive. */
+
+static long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int hist_index(uint64_t value) {
+  if (value < HIST_LINEAR) return value;
+  int msb = 63 - __builtin_clzll(value);
+  if (msb >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+  int shift = msb - 6;
+  return HIST_LINEAR + (msb - 7) * 64 + (int) ((value >> shift) - 64);
+}
+
+/* Returns the largest value that lands in bucket INDEX. */
+static uint64_t hist_value(int index) {
+  if (index < HIST_LINEAR) return index;
+  int msb = (index - HIST_LINEAR) / 64 + 7;
+  uint64_t sub = (index - HIST_LINEAR) % 64 + 64;
+  return ((sub + 1) << (msb - 6)) - 1;
+}
+
+static void hist_add(struct histogram *hist, uint64_t value) {
+  hist->counts[hist_index(value)]++;
+  hist->total++;
+  if (value > hist->max) hist->max = value;
+}
+
+static uint64_t hist_percentile(const struct histogram *hist, double percentile) {
+  uint64_t rank = (uint64_t) (percentile / 100.0 * hist->total + 0.5);
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank) return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+  }
+  return hist->max;
+}
+
+/* Claims the next request, or returns false once the run is over. */
+static bool bench_next_request(void) {
+  if (bench_requests_left > 0)
+    return __atomic_sub_fetch(&bench_requests_left, 1, __ATOMIC_RELAXED) >= 0;
+  return now_us() < bench_deadline_us;
+}
+
+/* Opens C's connection and queues its next request. Returns false if the
+ * run is over or the socket can't be made. */
+static bool bench_start(struct bench_thread *t, struct bench_conn *c, int epoll_fd,
+    bool reuse) {
+  if (!bench_next_request()) return false;
+
+  const char *url = bench_urls[rand_r(&t->seed) % bench_url_cnt];
+  c->request_len = snprintf(c->request, sizeof(c->request),
+      "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", url, bench_host,
+      bench_keep_alive ? "" : "Connection: close\r\n");
+  c->request_sent = 0;
+  c->len = 0;
+  c->start_us = now_us();
+
+  if (reuse) {
+    c->state = BENCH_WRITING;
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = c };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+    return true;
+  }
+
+  c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (c->fd == -1) return false;
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(c->fd, (struct sockaddr *) &bench_address, sizeof(bench_address)) < 0
+      && errno != EINPROGRESS) {
+    close(c->fd);
+    t->errors++;
+    return false;
+  }
+  c->state = BENCH_CONNECTING;
+  struct epoll_event event = { .events = EPOLLOUT, .data.ptr = c };
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event);
+  return true;
+}
+
+/* Ends C's request, counting it as done if OK, and starts the next.
+ * Returns false if C has nothing more to do. */
+static bool bench_finish(struct bench_thread *t, struct bench_conn *c, int epoll_fd,
+    bool ok) {
+  bool reuse = false;
+  if (ok) {
+    hist_add(&t->latency, now_us() - c->start_us);
+    t->completed++;
+    int status = c->parser.status;
+    t->statuses[status >= 100 && status < 600 ? status / 100 - 1 : 5]++;
+    reuse = bench_keep_alive && c->parser.keep_alive;
+  } else {
+    t->errors++;
+  }
+  if (!reuse) {
+    close(c->fd);
+    c->fd = -1;
+  }
+  if (bench_start(t, c, epoll_fd, reuse)) return true;
+  if (c->fd != -1) {
+    close(c->fd);
+    c->fd = -1;
+  }
+  return false;
+}
+
+/* Takes the BYTES just read into C's buffer. Returns 1 once the response
+ * is whole, 0 if more is to come, or -1 if it is malformed. */
+/* Decodes the LEN bytes of chunked body at DATA for C. Returns like
+ * bench_take(). */
+static int bench_dechunk(struct bench_conn *c, char *data, size_t len) {
+  http_dechunk(&c->dechunker, data, &len);
+  if (c->dechunker.state == HTTP_DECHUNK_ERROR) return -1;
+  return c->dechunker.state == HTTP_DECHUNK_DONE;
+}
+
+static int bench_take(struct bench_thread *t, struct bench_conn *c, size_t bytes) {
+  t->bytes += bytes;
+  if (c->state == BENCH_READING_BODY) {
+    c->len = 0;
+    if (c->chunked) return bench_dechunk(c, c->buffer, bytes);
+    if (c->body_left < 0) return 0;
+    c->body_left -= bytes;
+    return c->body_left <= 0;
+  }
+
+  c->len += bytes;
+  enum http_parse_state state = http_parser_feed(&c->parser, c->buffer, c->len);
+  if (state == HTTP_PARSE_ERROR) return -1;
+  if (state != HTTP_PARSE_DONE) return 0;
+
+  off_t length;
+  int has_length = http_parser_content_length(&c->parser, c->buffer, &length);
+  if (has_length < 0) return -1;
+  c->state = BENCH_READING_BODY;
+  c->chunked = http_parser_chunked(&c->parser, c->buffer);
+  if (c->chunked) {
+    http_dechunker_init(&c->dechunker);
+    size_t len = c->len;
+    c->len = 0;
+    return bench_dechunk(c, c->buffer + c->parser.head_len, len - c->parser.head_len);
+  }
+  c->body_left = has_length ? length - (long long) (c->len - c->parser.head_len) : -1;
+  c->len = 0;
+  if (!has_length) {
+    /* Only a response that ends with the connection can do without. */
+    c->parser.keep_alive = 0;
+    return 0;
+  }
+  return c->body_left <= 0;
+}
+
+static void *bench_run(void *aux) {
+  struct bench_thread *t = aux;
+  int epoll_fd = epoll_create1(0);
+  struct bench_conn *conns = calloc(t->connections, sizeof(struct bench_conn));
+  if (epoll_fd == -1 || !conns) {
+    perror("httpbench");
+    exit(1);
+  }
+
+  int active = 0;
+  for (int i = 0; i < t->connections; i++) {
+    conns[i].fd = -1;
+    if (bench_start(t, &conns[i], epoll_fd, false)) active++;
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (active > 0) {
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+    if (n < 0 && errno != EINTR) break;
+    for (int i = 0; i < n; i++) {
+      struct bench_conn *c = events[i].data.ptr;
+      int done = 0;
+      while (!done) {
+        if (c->state == BENCH_CONNECTING) {
+          int error = 0;
+          socklen_t len = sizeof(error);
+          getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+          if (error) {
+            done = -1;
+            break;
+          }
+          c->state = BENCH_WRITING;
+        }
+        if (c->state == BENCH_WRITING) {
+          ssize_t sent = send(c->fd, c->request + c->request_sent,
+              c->request_len - c->request_sent, MSG_NOSIGNAL);
+          if (sent < 0 && errno == EAGAIN) break;
+          if (sent < 0) {
+            done = -1;
+            break;
+          }
+          c->request_sent += sent;
+          if (c->request_sent < c->request_len) continue;
+          c->state = BENCH_READING_HEAD;
+          http_parser_init_response(&c->parser);
+          struct epoll_event event = { .events = EPOLLIN, .data.ptr = c };
+          epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+        }
+
+        size_t room = c->state == BENCH_READING_BODY
+            ? sizeof(c->buffer) : LIBHTTP_REQUEST_MAX_SIZE - c->len;
+        ssize_t got = recv(c->fd, c->buffer + c->len, room, 0);
+        if (got < 0 && errno == EAGAIN) break;
+        if (got == 0 && c->state == BENCH_READING_BODY && c->body_left < 0) {
+          done = 1;
+        } else if (got <= 0) {
+          done = -1;
+        } else {
+          done = bench_take(t, c, got);
+        }
+      }
+      if (done != 0 && !bench_finish(t, c, epoll_fd, done > 0)) active--;
+    }
+    if (bench_deadline_us && now_us() > bench_deadline_us + 5000000L) break;
+  }
+
+  for (int i = 0; i < t->connections; i++) {
+    if (conns[i].fd != -1) close(conns[i].fd);
+  }
+  free(conns);
+  close(epoll_fd);
+  return NULL;
+}
+
+/* Adds the paths in file PATH to the URL mix, one per line. A path listed
+ * several times is requested that much more often. */
+static void bench_read_urls(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    exit(1);
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] != '/') continue;
+    bench_urls = realloc(bench_urls, (bench_url_cnt + 1) * sizeof(char *));
+    bench_urls[bench_url_cnt++] = strdup(line);
+  }
+  fclose(file);
+}
+
+static void exit_with_usage(void) {
+  fprintf(stderr,
+      "Usage: ./httpbench [--host 127.0.0.1] [--port 8000] [--connections 64]\n"
+      "                   [--threads 4] [--duration SECONDS | --requests N]\n"
+      "                   [--keep-alive] [--url PATH]... [--urls FILE]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int port = 8000, connections = 64, threads = 4;
+  double duration = 10;
+  long requests = 0;
+
+  for (int i = 1; i < argc; i++) {
+    char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(argv[i], "--keep-alive") == 0) {
+      bench_keep_alive = 1;
+      continue;
+    }
+    if (!value) exit_with_usage();
+    i++;
+    if (strcmp(argv[i - 1], "--host") == 0) bench_host = value;
+    else if (strcmp(argv[i - 1], "--port") == 0) port = atoi(value);
+    else if (strcmp(argv[i - 1], "--connections") == 0) connections = atoi(value);
+    else if (strcmp(argv[i - 1], "--threads") == 0) threads = atoi(value);
+    else if (strcmp(argv[i - 1], "--duration") == 0) duration = atof(value);
+    else if (strcmp(argv[i - 1], "--requests") == 0) requests = atol(value);
+    else if (strcmp(argv[i - 1], "--urls") == 0) bench_read_urls(value);
+    else if (strcmp(argv[i - 1], "--url") == 0) {
+      bench_urls = realloc(bench_urls, (bench_url_cnt + 1) * sizeof(char *));
+      bench_urls[bench_url_cnt++] = value;
+    } else {
+      exit_with_usage();
+    }
+  }
+  if (connections < 1 || threads < 1 || duration <= 0) exit_with_usage();
+  if (threads > connections) threads = connections;
+  if (bench_url_cnt == 0) {
+    static char *index_url = "/";
+    bench_urls = &index_url;
+    bench_url_cnt = 1;
+  }
+
+  struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *result;
+  if (getaddrinfo(bench_host, NULL, &hints, &result) != 0) {
+    fprintf(stderr, "Cannot find host: %s\n", bench_host);
+    exit(1);
+  }
+  memcpy(&bench_address, result->ai_addr, sizeof(bench_address));
+  bench_address.sin_port = htons(port);
+  freeaddrinfo(result);
+  signal(SIGPIPE, SIG_IGN);
+
+  struct bench_thread *workers = calloc(threads, sizeof(struct bench_thread));
+  long start = now_us();
+  if (requests > 0) bench_requests_left = requests;
+  else bench_deadline_us = start + (long) (duration * 1000000);
+  for (int i = 0; i < threads; i++) {
+    workers[i].connections = connections / threads + (i < connections % threads);
+    workers[i].seed = i + 1;
+    pthread_create(&workers[i].thread, NULL, bench_run, &workers[i]);
+  }
+
+  struct histogram *latency = calloc(1, sizeof(struct histogram));
+  uint64_t completed = 0, errors = 0, bytes = 0, statuses[6] = { 0 };
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    for (int b = 0; b < HIST_BUCKETS; b++) latency->counts[b] += workers[i].latency.counts[b];
+    latency->total += workers[i].latency.total;
+    if (workers[i].latency.max > latency->max) latency->max = workers[i].latency.max;
+    completed += workers[i].completed;
+    errors += workers[i].errors;
+    bytes += workers[i].bytes;
+    for (int s = 0; s < 6; s++) statuses[s] += workers[i].statuses[s];
+  }
+  double elapsed = (now_us() - start) / 1e6;
+
+  printf("%llu requests in %.2fs over %d connections%s, %llu errors\n",
+      (unsigned long long) completed, elapsed, connections,
+      bench_keep_alive ? " (keep-alive)" : "", (unsigned long long) errors);
+  printf("Throughput: %.0f requests/s, %.2f MB/s\n", completed / elapsed,
+      bytes / elapsed / (1024 * 1024));
+  printf("Status: 1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+      (unsigned long long) statuses[0], (unsigned long long) statuses[1],
+      (unsigned long long) statuses[2], (unsigned long long) statuses[3],
+      (unsigned long long) statuses[4], (unsigned long long) statuses[5]);
+  if (latency->total > 0) {
+    printf("Latency (us): p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+        (unsigned long long) hist_percentile(latency, 50),
+        (unsigned long long) hist_percentile(latency, 90),
+        (unsigned long long) hist_percentile(latency, 99),
+        (unsigned long long) hist_percentile(latency, 99.9),
+        (unsigned long long) latency->max);
+  }
+  return errors > 0 && completed == 0;
+}
@@ -1,11 +1,16 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,7 +20,22 @@
 #include <unistd.h>
 #include <unistd.h>
 
+#include "accesslog.h"
+#include "affinity.h"
+#include "evloop.h"
+#include "fdcache.h"
+#include "filecache.h"
+#include "h2.h"
 #include "libhttp.h"
+#include "pathcache.h"
+#include "pool.h"
+#include "proxy.h"
+#include "proxycache.h"
+#include "ratelimit.h"
+#include "reload.h"
+#include "stats.h"
+#include "tcptune.h"
+#include "tls.h"
 #include "wq.h"
 
 /*
@@ -25,15 +45,162 @@
  * command line arguments (already implemented for you).
  */
 wq_t work_queue;
+struct pool work_pool;
 int num_threads;
+int max_threads;
 int server_port;
 char *server_files_directory;
 char *server_proxy_hostname;
 int server_proxy_port;
+int event_loop;
+int io_uring;
+int reuse_port;
+int log_connections;
+int queue_size = WQ_DEFAULT_CAPACITY;
+int queue_timeout_ms;
+int https_port;
+wq_t https_work_queue;
+struct pool https_pool;
 
 /*
- * Reads an HTTP request from stream (fd), and writes an HTTP response
- * containing:
+ * Buffers the headers every files response carries: the status line, the
+ * body's length, which lets the client find the end of the body without
+ * the connection closing, and whether the connection stays open.
+ */
+static void start_files_response(struct http_response *response, int fd,
+    int status_code, char *content_type, long long content_length, int keep_alive) {
+  char content_size[64];
+  http_response_begin(response, fd, status_code);
+  if (content_type) http_response_header(response, "Content-Type", content_type);
+  sprintf(content_size, "%lld", content_length);
+  http_response_header(response, "Content-Length", content_size);
+  http_response_header(response, "Connection", keep_alive ? "keep-alive" : "close");
+}
+
+/* Sends a response with no body. */
+static void send_empty_response(int fd, int status_code, int keep_alive) {
+  struct http_response response;
+  start_files_response(&response, fd, status_code, NULL, 0, keep_alive);
+  http_response_flush(&response, NULL, 0);
+}
+
+/* Tells the client its copy of the file with ETAG is current. */
+static void send_not_modified(int fd, char *etag, const char *cache_control,
+    int keep_alive) {
+  struct http_response response;
+  http_response_begin(&response, fd, 304);
+  http_response_header(&response, "ETag", etag);
+  if (cache_control)
+    http_response_header(&response, "Cache-Control", (char *) cache_control);
+  http_response_header(&response, "Connection", keep_alive ? "keep-alive" : "close");
+  http_response_flush(&response, NULL, 0);
+}
+
+/* Tells the client none of the ranges it asked for are in the SIZE-byte
+ * file. */
+static void send_range_not_satisfiable(int fd, off_t size, int keep_alive) {
+  struct http_response response;
+  char content_range[64];
+  start_files_response(&response, fd, 416, NULL, 0, keep_alive);
+  snprintf(content_range, sizeof(content_range), "bytes */%lld", (long long) size);
+  http_response_header(&response, "Content-Range", content_range);
+  http_response_flush(&response, NULL, 0);
+}
+
+/*
+ * Sends the CNT RANGES of a SIZE-byte file of CONTENT_TYPE with ETAG as a
+ * 206 Partial Content. The file's bytes come from DATA if it's in memory,
+ * or else from FILE_FD. A response to HEAD stops after the headers.
+ */
+static void send_partial_response(int fd, const struct http_range *ranges, int cnt,
+    char *content_type, off_t size, char *etag, char *data, int file_fd,
+    int head, int keep_alive) {
+  struct http_response response;
+  char part[HTTP_RANGE_PART_MAX];
+
+  if (cnt == 1) {
+    start_files_response(&response, fd, 206, content_type, ranges[0].length, keep_alive);
+    snprintf(part, sizeof(part), "bytes %lld-%lld/%lld", (long long) ranges[0].start,
+        (long long) (ranges[0].start + ranges[0].length - 1), (long long) size);
+    http_response_header(&response, "Content-Range", part);
+    http_response_header(&response, "ETag", etag);
+    if (head)
+      http_response_flush(&response, NULL, 0);
+    else if (data)
+      http_response_flush(&response, data + ranges[0].start, ranges[0].length);
+    else
+      http_response_flush_file(&response, file_fd, ranges[0].start, ranges[0].length);
+    return;
+  }
+
+  // several ranges go out as the parts of a multipart body, written a
+  // piece at a time; with TCP_NODELAY, corked so they fill whole segments
+  int cork = tcp_tuning.nodelay && !head;
+  if (cork) setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+  start_files_response(&response, fd, 206,
+      "multipart/byteranges; boundary=" HTTP_RANGE_BOUNDARY,
+      http_range_multipart_length(content_type, ranges, cnt, size), keep_alive);
+  http_response_header(&response, "ETag", etag);
+  http_response_flush(&response, NULL, 0);
+  if (head) return;
+  for (int i = 0; i < cnt; i++) {
+    int part_len = http_format_range_part(part, content_type, &ranges[i], size);
+    if (data) {
+      struct iovec iov[2] = {
+        { .iov_base = part, .iov_len = part_len },
+        { .iov_base = data + ranges[i].start, .iov_len = ranges[i].length },
+      };
+      http_writev_all(fd, iov, 2);
+    } else {
+      http_send_data(fd, part, part_len);
+      http_send_file_range(fd, file_fd, ranges[i].start, ranges[i].length);
+    }
+  }
+  http_send_string(fd, HTTP_RANGE_END);
+  if (cork) {
+    cork = 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+  }
+}
+
+/* Sends a cached file's headers and bytes in a single writev(), or a 304
+ * if REQUEST shows the client has it already, or the ranges it asks for.
+ * A response to HEAD is the headers alone. */
+static void send_cached_response(int fd, struct http_request *request,
+    struct file_cache_entry *entry, int head, int keep_alive) {
+  if (http_request_not_modified(request, entry->etag, entry->mtime.tv_sec)) {
+    send_not_modified(fd, entry->etag, http_cache_control_lookup(request->path),
+        keep_alive);
+    return;
+  }
+
+  struct http_range ranges[HTTP_RANGE_MAX];
+  int range_cnt = http_request_ranges(request, entry->etag, entry->mtime.tv_sec,
+      entry->size, ranges);
+  if (range_cnt < 0) {
+    send_range_not_satisfiable(fd, entry->size, keep_alive);
+    return;
+  }
+  if (range_cnt > 0) {
+    send_partial_response(fd, ranges, range_cnt, (char *) entry->content_type,
+        entry->size, entry->etag, entry->body, -1, head, keep_alive);
+    return;
+  }
+
+  // cached headers all start with a 200 status line
+  http_sent_status = 200;
+  char *connection = keep_alive
+      ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  struct iovec iov[3] = {
+    { .iov_base = entry->headers, .iov_len = entry->headers_len },
+    { .iov_base = connection, .iov_len = strlen(connection) },
+    { .iov_base = entry->body, .iov_len = entry->size },
+  };
+  http_writev_all(fd, iov, entry->size > 0 && !head ? 3 : 2);
+}
+
+/*
+ * Writes an HTTP response to REQUEST on stream (fd) containing:
  *
  *   1) If user requested an existing file, respond with the file
  *   2) If user requested a directory and index.html exists in the directory,
@@ -42,122 +209,259 @@ int server_proxy_port;
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
  */
-void handle_files_request(int fd) {
+static void serve_files_request(int fd, struct http_request *request, int keep_alive) {
+  struct http_response response;
+  // a response to HEAD has the headers GET's would, but no body; sending
+  // one anyway would be read as the start of the next response
+  int head = strcmp(request->method, "HEAD") == 0;
 
-  /*
-   * TODO: Your solution for Task 1 goes here! Feel free to delete/modify *
-   * any existing code.
-   */
-
-  struct http_request *request = http_request_parse(fd);
+  // put the path in canonical form, so it can't climb out of the files
+  // directory and each file has one cache key
+  char path[strlen(request->path) + 2];
+  if (http_normalize_path(request->path, path) == -1) {
+    send_empty_response(fd, 400, keep_alive);
+    return;
+  }
 
   // construct relative path for the target path
-  char file_path[strlen(server_files_directory) + strlen(request->path) + 1];
+  char file_path[strlen(server_files_directory) + strlen(path)
+      + strlen("/index.html") + 1];
   strcpy(file_path, server_files_directory);
-  strcat(file_path, request->path);
+  strcat(file_path, path);
 
-  // get type of file
-  struct stat sb;
-  int status = stat(file_path, &sb);
-  int isRegFile;
-
-  // Status Code
-  if (status == -1) {
-    http_start_response(fd, 404);
-    http_end_headers(fd);
-    close(fd);
+  // recently served files are answered from memory
+  unsigned encodings = http_request_encodings(request);
+  char cache_key[strlen(file_path) + FILE_CACHE_KEY_EXTRA];
+  file_cache_make_key(cache_key, file_path, encodings);
+  struct file_cache_entry *entry = file_cache_lookup(cache_key);
+  if (entry) {
+    send_cached_response(fd, request, entry, head, keep_alive);
+    file_cache_release(entry);
     return;
-  } else {
-    http_start_response(fd, 200);
   }
-  
-  if (S_ISDIR(sb.st_mode)) {
-    isRegFile = 0;
-
-    // check to see if directory contains index.html
-    char tmp[strlen(file_path) + strlen("index.html") + 1];
-    strcpy(tmp, file_path);
-    strcat(tmp, "/index.html");
-    // display index.html as usual if index.html exists
-    if (fopen(tmp, "r")) {
-      isRegFile = 1;
-      strcat(file_path, "/index.html");
-      stat(file_path, &sb);
-    }
-  } else if (S_ISREG(sb.st_mode)) {
-    isRegFile = 1;
-  } else {
-    http_start_response(fd, 404);
-    http_end_headers(fd);
-    close(fd);
+
+  // find the file, the directory's index.html, or the directory to list;
+  // the path cache remembers which, so a directory isn't probed each time
+  struct stat sb;
+  enum path_target target = path_cache_resolve(file_path, &sb);
+  if (target == PATH_NONE) {
+    send_empty_response(fd, 404, keep_alive);
     return;
   }
 
-  if (isRegFile) {
-    http_send_header(fd, "Content-Type", http_get_mime_type(file_path));
+  if (target != PATH_DIRECTORY) {
+    const char *cache_control = http_cache_control_lookup(path);
+    char *content_type = http_get_mime_type(file_path);
 
-    char content_size[64];
-    sprintf(content_size, "%zd", sb.st_size);
-    http_send_header(fd, "Content-Length", content_size);
-    http_end_headers(fd);
+    // send a compressed sibling instead if the client takes it
+    char encoded_path[strlen(file_path) + 4];
+    struct stat encoded_sb;
+    unsigned missing;
+    enum http_encoding encoding = http_find_encoded_sibling(file_path, content_type,
+        encodings, encoded_path, &encoded_sb, &missing);
+    char *send_path = file_path;
+    if (encoding != HTTP_ENCODING_IDENTITY) {
+      send_path = encoded_path;
+      sb = encoded_sb;
+    }
+
+    // the client may have this version already
+    char etag[HTTP_ETAG_MAX];
+    http_format_etag(etag, &sb);
+    if (http_request_not_modified(request, etag, sb.st_mtim.tv_sec)) {
+      send_not_modified(fd, etag, cache_control, keep_alive);
+      return;
+    }
+
+    // files too big for the file cache are kept open for the next request
+    struct fd_cache_entry *opened = fd_cache_open(send_path, !file_cache_fits(sb.st_size));
+    if (!opened) {
+      send_empty_response(fd, 404, keep_alive);
+      return;
+    }
+    int file_fd = opened->fd;
+    struct file_cache_source source = {
+      .path = send_path, .fd = file_fd, .sb = &sb,
+      .content_type = content_type, .cache_control = cache_control,
+      .encoding = encoding, .gzip = encodings & (1u << HTTP_ENCODING_GZIP),
+      .base_path = file_path, .missing = missing,
+    };
+    entry = file_cache_insert(cache_key, &source);
+    if (entry) {
+      fd_cache_release(opened);
+      send_cached_response(fd, request, entry, head, keep_alive);
+      file_cache_release(entry);
+      return;
+    }
+
+    struct http_range ranges[HTTP_RANGE_MAX];
+    int range_cnt = http_request_ranges(request, etag, sb.st_mtim.tv_sec,
+        sb.st_size, ranges);
+    if (range_cnt != 0) {
+      if (range_cnt < 0)
+        send_range_not_satisfiable(fd, sb.st_size, keep_alive);
+      else
+        send_partial_response(fd, ranges, range_cnt, content_type,
+            sb.st_size, etag, NULL, file_fd, head, keep_alive);
+      fd_cache_release(opened);
+      return;
+    }
+
+    char last_modified[HTTP_DATE_MAX];
+    http_format_date(last_modified, sb.st_mtim.tv_sec);
+    start_files_response(&response, fd, 200, content_type, sb.st_size, keep_alive);
+    http_response_header(&response, "ETag", etag);
+    http_response_header(&response, "Last-Modified", last_modified);
+    http_response_header(&response, "Accept-Ranges", "bytes");
+    if (encoding != HTTP_ENCODING_IDENTITY)
+      http_response_header(&response, "Content-Encoding",
+          (char *) http_encoding_name(encoding));
+    if (http_mime_type_is_compressible(content_type))
+      http_response_header(&response, "Vary", "Accept-Encoding");
+    if (cache_control)
+      http_response_header(&response, "Cache-Control", (char *) cache_control);
 
-    // read and send file
-    FILE *f = fopen(file_path, "r");
-    char data[sb.st_size+1];
-    size_t sizeRead = fread(data, 1, sb.st_size, f);
-    http_send_data(fd, data, sizeRead);
+    // stream the file straight from the page cache to the socket
+    if (head)
+      http_response_flush(&response, NULL, 0);
+    else
+      http_response_flush_file(&response, file_fd, 0, sb.st_size);
+    fd_cache_release(opened);
 
   } else {
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    
-    // list directory files
-    DIR *dir = opendir(file_path);
-    struct dirent *cur;
-    char *format = "<p><a href='%s'>%s</a></p>\n";
-    char fileName[2*NAME_MAX+strlen(format)+1];
-    while (dir) {
-      cur = readdir(dir);
-      if (cur != NULL) {
-        sprintf(fileName, format, cur->d_name, cur->d_name);
-        http_send_string(fd, fileName);
-      } else {
-        break;
+    // list the directory, rendered again only when it changes
+    entry = file_cache_listing(cache_key, file_path, &sb);
+    if (!entry) {
+      send_empty_response(fd, 404, keep_alive);
+      return;
+    }
+    send_cached_response(fd, request, entry, head, keep_alive);
+    file_cache_release(entry);
+  }
+}
+
+/*
+ * Serves requests from stream (fd), read through io unless it is NULL,
+ * until the client closes the connection or sends "Connection: close",
+ * the connection carries HTTP_KEEP_ALIVE_MAX_REQUESTS requests, or it
+ * sits idle for http_idle_timeout_ms. Requests the client pipelines
+ * are answered in order. A client that opens with the HTTP/2 preface is
+ * served by h2_serve() instead. The caller closes fd.
+ */
+static void serve_files_connection(int fd, const struct http_conn_io *io) {
+  // each thread reuses one connection's buffer for every client it serves;
+  // requests are parsed in place in it, so serving one allocates nothing
+  static __thread struct http_conn *conn;
+  if (!conn && !(conn = malloc(sizeof(struct http_conn)))) return;
+  http_conn_init(conn, fd);
+  conn->io = io;
+
+  for (int requests = 1; ; requests++) {
+    struct http_request *request = http_conn_read_request(conn,
+        http_idle_timeout_ms);
+    if (!request) {
+      if (conn->malformed) {
+        long start = stats_start();
+        send_empty_response(fd, 400, 0);
+        stats_request(STATS_FILES, 400, -1, start);
       }
+      break;
+    }
+
+    // an HTTP/2 client's preface; the rest of the connection is its
+    if (h2_is_preface(request)) {
+      h2_serve(fd, io, conn->buffer + conn->consumed, conn->len - conn->consumed,
+          server_files_directory);
+      break;
+    }
+
+    // a server being replaced answers what it has and lets clients go
+    int keep_alive = request->keep_alive
+        && requests < HTTP_KEEP_ALIVE_MAX_REQUESTS && !reload_draining();
+    if (stats_is_request(request->path, strlen(request->path))) {
+      // stats_send() always sends the body, so HEAD can't be followed by
+      // another request
+      if (strcmp(request->method, "HEAD") == 0) keep_alive = 0;
+      stats_send(fd, request->path, strlen(request->path), keep_alive);
+      if (!keep_alive) break;
+      continue;
     }
+
+    struct access_log_entry log_entry;
+    long start = stats_start();
+    bool logged = access_log_begin(&log_entry, request->method,
+        strlen(request->method), request->path, strlen(request->path));
+    http_sent_bytes = 0;
+    serve_files_request(fd, request, keep_alive);
+    if (logged) access_log_end(&log_entry, http_sent_status, http_sent_bytes);
+    stats_request(STATS_FILES, http_sent_status, http_sent_bytes, start);
+    if (!keep_alive) break;
   }
+}
 
-  close(fd);
+void handle_files_request(int fd) {
+  serve_files_connection(fd, NULL);
 }
 
+/*
+ * Serves files to the HTTPS client on fd, once its handshake is done.
+ */
+void handle_https_request(int fd) {
+  tls_serve(fd, serve_files_connection);
+}
 
 /*
- * A thread in an infinite loop keep trying to handle requests
- * from work_queue
+ * Turns a client away with a 503 without waiting on it, when the server
+ * is too busy to serve it. What it has sent so far is read first, so
+ * closing the socket with it unread doesn't reset the connection before
+ * the client sees the response.
  */
-void *thread_handle_request(void *args) {
-  while (1) {
-    int client_socket_number = wq_pop(&work_queue);
-    work_queue.request_handler(client_socket_number);
-    close(client_socket_number);
-  }
+static void send_overloaded(int fd) {
+  static const char response[] =
+      "HTTP/1.1 503 Service Unavailable\r\n"
+      "Retry-After: 1\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n\r\n";
+  char discard[4096];
+  stats_count(STATS_SHED);
+  for (int i = 0; i < 4 && recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++)
+    continue;
+  send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * Closes a client's socket once it has been served or turned away.
+ */
+static void close_connection(int fd) {
+  close(fd);
+  stats_count(STATS_CONNECTIONS_CLOSED);
+  reload_connection_closed();
 }
 
 /*
- * Read data from a to b, until one of the two is closed
+ * Serves a client a worker took from QUEUE after it waited WAITED_MS
+ * there.
  */
-void *thread_communicate(void *arg) {
-  char buf[2048*2048];
-  ssize_t nread; 
-  int *fds = (int *) arg;
-  int in  = fds[0];
-  int out = fds[1];
-
-  while ((nread = read(in, buf, sizeof(buf) - 1)) > 0) {
-    write(out, buf, nread);
+static void serve_queued(wq_t *queue, int client_socket_number, long waited_ms) {
+  // a client queued that long has likely given up; answer the next one
+  if (queue_timeout_ms > 0 && waited_ms > queue_timeout_ms) {
+    // an HTTPS client can't read a plain 503, so it is only hung up on
+    if (queue == &work_queue) send_overloaded(client_socket_number);
+  } else {
+    queue->request_handler(client_socket_number);
   }
-  close(out);
-  pthread_exit(NULL);
+  close_connection(client_socket_number);
+}
+
+/*
+ * Starts NUM_THREADS threads serving QUEUE with REQUEST_HANDLER in POOL,
+ * which grows up to max_threads of them as the load needs if that's more.
+ */
+static void start_workers(struct pool *pool, wq_t *queue, int num_threads,
+    void (*request_handler)(int)) {
+  wq_init(queue, queue_size);
+  queue->request_handler = request_handler;
+  pool_start(pool, queue, num_threads, max_threads, serve_queued);
 }
 
 /*
@@ -172,100 +476,101 @@ void *thread_communicate(void *arg) {
  *   +--------+     +------------+     +--------------+
  */
 void handle_proxy_request(int fd) {
+  /* Connections to the target are looked up, pooled, and relayed by the
+   * proxy module. The caller closes fd. */
+  proxy_handle(fd);
+}
 
+void init_thread_pool(int num_threads, void (*request_handler)(int)) {
   /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
-
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
-
-  int client_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (client_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    exit(errno);
-  }
-
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
-  }
+   * TODO: Part of your solution for Task 2 goes here!
+   */
+  start_workers(&work_pool, &work_queue, num_threads, request_handler);
+  stats_watch_pool(&work_pool);
+}
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+/*
+ * Connection logging. Accepting threads only queue the client's address;
+ * a thread of its own formats and prints it, so a slow stdout never holds
+ * up accept(). Records that don't fit while the printer is behind are
+ * dropped and counted.
+ */
+#define CONNECTION_LOG_SIZE 1024
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(client_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct sockaddr_in addresses[CONNECTION_LOG_SIZE];
+  unsigned head;          // next record to print
+  unsigned tail;          // next record to fill
+  unsigned dropped;
+} connection_log = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .ready = PTHREAD_COND_INITIALIZER,
+};
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(fd);
+static void *connection_log_print(void *args) {
+  pthread_mutex_lock(&connection_log.lock);
+  while (1) {
+    while (connection_log.head == connection_log.tail && connection_log.dropped == 0)
+      pthread_cond_wait(&connection_log.ready, &connection_log.lock);
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
-    return;
+    unsigned dropped = connection_log.dropped;
+    connection_log.dropped = 0;
+    struct sockaddr_in address;
+    int have = connection_log.head != connection_log.tail;
+    if (have)
+      address = connection_log.addresses[connection_log.head++ % CONNECTION_LOG_SIZE];
+    pthread_mutex_unlock(&connection_log.lock);
 
+    if (dropped > 0) printf("(%u connections not logged)\n", dropped);
+    if (have) {
+      char name[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &address.sin_addr, name, sizeof(name));
+      printf("Accepted connection from %s on port %d\n", name, ntohs(address.sin_port));
+    }
+    fflush(stdout);
+    pthread_mutex_lock(&connection_log.lock);
   }
-
-  /* 
-  * TODO: Your solution for task 3 belongs here! 
-  */
-  pthread_t *threads = malloc(sizeof(pthread_t)* 2);
-  int forward_args[2];
-  int backward_args[2];
-  
-  forward_args[0] = fd;
-  forward_args[1] = client_socket_fd;
-
-  backward_args[0] = client_socket_fd;
-  backward_args[1] = fd;
-  
-
-  pthread_create(&threads[0], NULL, thread_communicate, (void *) forward_args);
-  pthread_create(&threads[1], NULL, thread_communicate, (void *) backward_args);
-
-  pthread_join(threads[0], NULL);
+  return NULL;
 }
 
-void init_thread_pool(int num_threads, void (*request_handler)(int)) {
-  /*
-   * TODO: Part of your solution for Task 2 goes here!
-   */
-  wq_init(&work_queue);
-  work_queue.request_handler = request_handler;
-  pthread_t *threads = malloc(sizeof(pthread_t)* num_threads);
-  for (int i = 0; i < num_threads; i++)
-  {
-    pthread_create(&threads[i], NULL, thread_handle_request, NULL);
-  }
+static void log_connection(const struct sockaddr_in *address) {
+  pthread_mutex_lock(&connection_log.lock);
+  if (connection_log.tail - connection_log.head < CONNECTION_LOG_SIZE)
+    connection_log.addresses[connection_log.tail++ % CONNECTION_LOG_SIZE] = *address;
+  else
+    connection_log.dropped++;
+  pthread_cond_signal(&connection_log.ready);
+  pthread_mutex_unlock(&connection_log.lock);
 }
 
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Opens a TCP stream socket listening on all interfaces on port,
+ * sharing the port with other such sockets if reuse_port is set, or takes
+ * one the server this one is replacing handed over. Exits on failure.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+static int open_server_socket(int port) {
+  struct sockaddr_in server_address;
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+  // one from an old server run with --event-loop is non-blocking
+  int fd = reload_take_listener(port);
+  if (fd != -1) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+  }
 
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
+  fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
     perror("Failed to create a new socket");
     exit(errno);
   }
 
   int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
-        sizeof(socket_option)) == -1) {
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+        sizeof(socket_option)) == -1
+      || (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &socket_option,
+        sizeof(socket_option)) == -1)) {
     perror("Failed to set socket options");
     exit(errno);
   }
@@ -273,47 +578,185 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
   memset(&server_address, 0, sizeof(server_address));
   server_address.sin_family = AF_INET;
   server_address.sin_addr.s_addr = INADDR_ANY;
-  server_address.sin_port = htons(server_port);
+  server_address.sin_port = htons(port);
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
+  if (bind(fd, (struct sockaddr *) &server_address,
         sizeof(server_address)) == -1) {
     perror("Failed to bind on socket");
     exit(errno);
   }
 
-  if (listen(*socket_number, 1024) == -1) {
+  if (tcp_tune_listen(fd) == -1) {
     perror("Failed to listen on socket");
     exit(errno);
   }
+  reload_add_listener(fd);
+  return fd;
+}
 
-  printf("Listening on port %d...\n", server_port);
+/*
+ * Accepts the next connection on SERVER_SOCKET, logging it if that's
+ * turned on. Returns its fd, or -1, also if its client is over its rate
+ * limit and was turned away: with a 429, unless HTTPS is set and it
+ * couldn't read one. Once the server is draining for a
+ * reload, doesn't return: the calling thread accepts no more.
+ */
+static int accept_connection(int server_socket, bool https) {
+  struct sockaddr_in client_address;
+  socklen_t client_address_length = sizeof(client_address);
 
-  init_thread_pool(num_threads, request_handler);
+  if (reload_draining()) reload_park();
+  reload_accepting(true);
+  int client_socket_number = accept4(server_socket,
+      (struct sockaddr *) &client_address, &client_address_length, SOCK_CLOEXEC);
+  reload_accepting(false);
+  if (client_socket_number < 0) {
+    // interrupted, perhaps to drain
+    if (errno != EINTR) perror("Error accepting socket");
+    return -1;
+  }
+  // a client over its rate is turned away before it can take a worker
+  if (!rate_limit_allow(client_address.sin_addr)) {
+    rate_limit_refuse(client_socket_number, !https);
+    close(client_socket_number);
+    return -1;
+  }
+  // a blocking read or write that a client stalls gives up, so the worker
+  // serving it can't be held forever
+  struct timeval timeout = { .tv_sec = http_body_timeout_ms / 1000,
+      .tv_usec = http_body_timeout_ms % 1000 * 1000 };
+  setsockopt(client_socket_number, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client_socket_number, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  tcp_tune_accepted(client_socket_number);
+  if (log_connections) log_connection(&client_address);
+  stats_count(STATS_CONNECTIONS_OPENED);
+  reload_connection_opened();
+  return client_socket_number;
+}
 
+/*
+ * Accepts connections on SERVER_SOCKET and serves each in this thread,
+ * forever.
+ */
+static void accept_and_serve(int server_socket, void (*request_handler)(int)) {
   while (1) {
-    client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
-    if (client_socket_number < 0) {
-      perror("Error accepting socket");
-      continue;
+    int client_socket_number = accept_connection(server_socket, false);
+    if (client_socket_number < 0) continue;
+    request_handler(client_socket_number);
+    close_connection(client_socket_number);
+  }
+}
+
+/*
+ * The listening sockets of the reuse_port workers, by index.
+ */
+static int *reuse_port_sockets;
+
+/*
+ * A worker with a listening socket of its own, bound with SO_REUSEPORT so
+ * the kernel spreads new connections across the workers' sockets. ARGS is
+ * the worker's index.
+ */
+static void *thread_accept_requests(void *args) {
+  int cpu = affinity_cpu((intptr_t) args);
+  affinity_pin(cpu);
+  int server_socket = reuse_port_sockets[(intptr_t) args];
+  affinity_steer(server_socket, cpu);
+  accept_and_serve(server_socket, work_queue.request_handler);
+  return NULL;
+}
+
+/*
+ * Accepts HTTPS clients on the listening socket ARGS, queueing each for
+ * the HTTPS workers, or serving it here if there are none.
+ */
+static void *thread_accept_https(void *args) {
+  int server_socket = (intptr_t) args;
+  while (1) {
+    int client_socket_number = accept_connection(server_socket, true);
+    if (client_socket_number < 0) continue;
+    if (num_threads > 0) {
+      if (!pool_push(&https_pool, client_socket_number))
+        close_connection(client_socket_number);
+    } else {
+      handle_https_request(client_socket_number);
+      close_connection(client_socket_number);
     }
+  }
+  return NULL;
+}
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+/*
+ * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
+ * the fd number of the server socket in *socket_number. For each accepted
+ * connection, calls request_handler with the accepted fd number.
+ *
+ * With reuse_port set, each of the num_threads workers (this thread among
+ * them) accepts on its own socket instead of taking connections from the
+ * work queue, which is then unused.
+ *
+ * With https_port set, HTTPS clients are accepted on that port as well, by
+ * a thread of their own, and served by their own num_threads workers.
+ *
+ * On SIGHUP the server hands its sockets to a new one and drains; see
+ * reload.h.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+  *socket_number = open_server_socket(server_port);
+
+  printf("Listening on port %d...\n", server_port);
+
+  if (log_connections) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, connection_log_print, NULL);
+  }
+
+  // HTTPS clients get a listener, queue, and workers of their own
+  if (https_port) {
+    int https_socket = open_server_socket(https_port);
+    if (num_threads > 0)
+      start_workers(&https_pool, &https_work_queue, num_threads, handle_https_request);
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_accept_https, (void *) (intptr_t) https_socket);
+    printf("Listening for HTTPS on port %d...\n", https_port);
+  }
+
+  if (reuse_port) {
+    work_queue.request_handler = request_handler;
+    // opened here, so all of them are ready to be handed over on reload
+    reuse_port_sockets = malloc(sizeof(int) * (num_threads > 1 ? num_threads : 1));
+    reuse_port_sockets[0] = *socket_number;
+    for (int i = 1; i < num_threads; i++)
+      reuse_port_sockets[i] = open_server_socket(server_port);
+    reload_ready();
+    for (int i = 1; i < num_threads; i++) {
+      pthread_t thread;
+      pthread_create(&thread, NULL, thread_accept_requests, (void *) (intptr_t) i);
+    }
+    int cpu = affinity_cpu(0);
+    affinity_pin(cpu);
+    affinity_steer(*socket_number, cpu);
+    accept_and_serve(*socket_number, request_handler);
+  }
+
+  init_thread_pool(num_threads, request_handler);
+  reload_ready();
+
+  while (1) {
+    int client_socket_number = accept_connection(*socket_number, false);
+    if (client_socket_number < 0) continue;
 
     // TODO: Change me?
     if (num_threads > 0) {
-      wq_push(&work_queue, client_socket_number);
+      // a full queue means workers are behind; say so at once
+      if (!pool_push(&work_pool, client_socket_number)) {
+        send_overloaded(client_socket_number);
+        close_connection(client_socket_number);
+      }
     } else {
       request_handler(client_socket_number);
-      close(client_socket_number);
+      close_connection(client_socket_number);
     }
-
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
   }
 
   shutdown(*socket_number, SHUT_RDWR);
@@ -329,8 +772,25 @@ void signal_callback_handler(int signum) {
 }
 
 char *USAGE =
-  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5 [--max-threads N]]\n"
+  "                    [--event-loop] [--io-uring] [--reuseport] [--log-connections]\n"
+  "                    [--queue-size N] [--queue-timeout MS]\n"
+  "                    [--idle-timeout MS] [--header-timeout MS] [--body-timeout MS]\n"
+  "                    [--backlog N] [--tcp-defer-accept S] [--tcp-fastopen QLEN] [--tcp-nodelay]\n"
+  "                    [--busy-poll US] [--cpu-affinity auto|CPU-LIST] [--reload-cache]\n"
+  "                    [--access-log FILE [--access-log-format FORMAT] [--access-log-sample N]]\n"
+  "                    [--cache-size MB] [--fd-cache N] [--cache-control PREFIX VALUE]... [--gzip]\n"
+  "                    [--stats]\n"
+  "                    [--mime-types FILE] [--https-port PORT --tls-cert FILE --tls-key FILE]\n"
+  "                    [--rate-limit PER_SECOND [--rate-limit-burst N]]\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80[,HOST:PORT|,unix:PATH]... --port 8000\n"
+  "                    [--num-threads 5 [--max-threads N]] [--queue-size N] [--queue-timeout MS]\n"
+  "                    [--idle-timeout MS] [--header-timeout MS] [--body-timeout MS]\n"
+  "                    [--backlog N] [--tcp-defer-accept S] [--tcp-fastopen QLEN] [--tcp-nodelay]\n"
+  "                    [--busy-poll US] [--reuseport] [--log-connections]\n"
+  "                    [--balance round-robin|least-conn|hash] [--cpu-affinity auto|CPU-LIST] [--stats]\n"
+  "                    [--rate-limit PER_SECOND [--rate-limit-burst N]]\n"
+  "                    [--proxy-cache MB [--proxy-cache-dir DIR [--proxy-cache-disk MB]]]\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -338,10 +798,27 @@ void exit_with_usage() {
 }
 
 int main(int argc, char **argv) {
+  reload_init(argv);
   signal(SIGINT, signal_callback_handler);
+  /* A client that hangs up mid-response should cost a failed write, not
+   * the whole server. */
+  signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
+  int cache_size = FILE_CACHE_DEFAULT_SIZE / (1024 * 1024);
+  int fd_cache_size = FD_CACHE_DEFAULT_SIZE;
+  enum proxy_balance proxy_balance = PROXY_ROUND_ROBIN;
+  int proxy_cache_size = 0;
+  char *proxy_cache_dir = NULL;
+  int proxy_cache_disk = PROXY_CACHE_DEFAULT_DISK_SIZE / (1024 * 1024);
+  char *access_log_path = NULL;
+  char *access_log_format = NULL;
+  int access_log_sample = 1;
+  char *tls_cert_path = NULL;
+  char *tls_key_path = NULL;
+  int rate_limit = 0;
+  int rate_limit_burst = 0;
   void (*request_handler)(int) = NULL;
 
   int i;
@@ -363,14 +840,36 @@ int main(int argc, char **argv) {
         exit_with_usage();
       }
 
-      char *colon_pointer = strchr(proxy_target, ':');
-      if (colon_pointer != NULL) {
-        *colon_pointer = '\0';
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = atoi(colon_pointer + 1);
+      /* A comma-separated list of backends, each HOST[:PORT] or unix:PATH;
+       * the first is kept in server_proxy_hostname and server_proxy_port. */
+      char *saveptr;
+      for (char *backend = strtok_r(proxy_target, ",", &saveptr); backend;
+          backend = strtok_r(NULL, ",", &saveptr)) {
+        int port = 80;
+        char *colon_pointer = strchr(backend, ':');
+        if (strncmp(backend, "unix:", 5) == 0) {
+          port = 0;
+        } else if (colon_pointer != NULL) {
+          *colon_pointer = '\0';
+          port = atoi(colon_pointer + 1);
+        }
+        if (!server_proxy_hostname) {
+          server_proxy_hostname = backend;
+          server_proxy_port = port;
+        }
+        proxy_add_backend(backend, port);
+      }
+    } else if (strcmp("--balance", argv[i]) == 0) {
+      char *policy = argv[++i];
+      if (policy && strcmp(policy, "round-robin") == 0) {
+        proxy_balance = PROXY_ROUND_ROBIN;
+      } else if (policy && strcmp(policy, "least-conn") == 0) {
+        proxy_balance = PROXY_LEAST_CONN;
+      } else if (policy && strcmp(policy, "hash") == 0) {
+        proxy_balance = PROXY_HASH;
       } else {
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = 80;
+        fprintf(stderr, "Expected round-robin, least-conn, or hash after --balance\n");
+        exit_with_usage();
       }
     } else if (strcmp("--port", argv[i]) == 0) {
       char *server_port_string = argv[++i];
@@ -385,6 +884,187 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--max-threads", argv[i]) == 0) {
+      char *max_threads_str = argv[++i];
+      if (!max_threads_str || (max_threads = atoi(max_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--event-loop", argv[i]) == 0) {
+      event_loop = 1;
+    } else if (strcmp("--io-uring", argv[i]) == 0) {
+      /* The event loops, on io_uring. */
+      event_loop = 1;
+      io_uring = 1;
+    } else if (strcmp("--queue-size", argv[i]) == 0) {
+      char *queue_size_str = argv[++i];
+      if (!queue_size_str || (queue_size = atoi(queue_size_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --queue-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-timeout", argv[i]) == 0) {
+      char *queue_timeout_str = argv[++i];
+      if (!queue_timeout_str || (queue_timeout_ms = atoi(queue_timeout_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --queue-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--idle-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (http_idle_timeout_ms = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --idle-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--header-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (http_header_timeout_ms = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --header-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--body-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (http_body_timeout_ms = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --body-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--backlog", argv[i]) == 0) {
+      char *backlog_str = argv[++i];
+      if (!backlog_str || (tcp_tuning.backlog = atoi(backlog_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --backlog\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--tcp-defer-accept", argv[i]) == 0) {
+      char *seconds_str = argv[++i];
+      if (!seconds_str || (tcp_tuning.defer_accept_s = atoi(seconds_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --tcp-defer-accept\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--tcp-fastopen", argv[i]) == 0) {
+      char *qlen_str = argv[++i];
+      if (!qlen_str || (tcp_tuning.fastopen_qlen = atoi(qlen_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --tcp-fastopen\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--tcp-nodelay", argv[i]) == 0) {
+      tcp_tuning.nodelay = true;
+    } else if (strcmp("--busy-poll", argv[i]) == 0) {
+      char *busy_poll_str = argv[++i];
+      if (!busy_poll_str || (tcp_tuning.busy_poll_us = atoi(busy_poll_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --busy-poll\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--reuseport", argv[i]) == 0) {
+      reuse_port = 1;
+    } else if (strcmp("--log-connections", argv[i]) == 0) {
+      log_connections = 1;
+    } else if (strcmp("--cpu-affinity", argv[i]) == 0) {
+      char *cpu_list = argv[++i];
+      if (!cpu_list || !affinity_parse(cpu_list)) {
+        fprintf(stderr, "Expected auto, or a list of CPUs we may run on like 0-3,8, "
+                        "after --cpu-affinity\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--stats", argv[i]) == 0) {
+      stats_enable();
+    } else if (strcmp("--access-log", argv[i]) == 0) {
+      access_log_path = argv[++i];
+      if (!access_log_path) {
+        fprintf(stderr, "Expected a file, or - for standard output, after --access-log\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log-format", argv[i]) == 0) {
+      access_log_format = argv[++i];
+      if (!access_log_format) {
+        fprintf(stderr, "Expected argument after --access-log-format\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log-sample", argv[i]) == 0) {
+      char *sample_str = argv[++i];
+      if (!sample_str || (access_log_sample = atoi(sample_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --access-log-sample\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-control", argv[i]) == 0) {
+      char *prefix = argv[++i];
+      char *value = prefix ? argv[++i] : NULL;
+      if (!value) {
+        fprintf(stderr, "Expected a path prefix and a value after --cache-control\n");
+        exit_with_usage();
+      }
+      http_cache_control_add(prefix, value);
+    } else if (strcmp("--https-port", argv[i]) == 0) {
+      char *https_port_str = argv[++i];
+      if (!https_port_str || (https_port = atoi(https_port_str)) < 1) {
+        fprintf(stderr, "Expected a port after --https-port\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--tls-cert", argv[i]) == 0) {
+      tls_cert_path = argv[++i];
+      if (!tls_cert_path) {
+        fprintf(stderr, "Expected a PEM certificate chain after --tls-cert\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--tls-key", argv[i]) == 0) {
+      tls_key_path = argv[++i];
+      if (!tls_key_path) {
+        fprintf(stderr, "Expected a PEM private key after --tls-key\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--mime-types", argv[i]) == 0) {
+      char *mime_types_path = argv[++i];
+      if (!mime_types_path) {
+        fprintf(stderr, "Expected argument after --mime-types\n");
+        exit_with_usage();
+      }
+      if (http_mime_types_load(mime_types_path) < 0) {
+        fprintf(stderr, "Cannot read %s: %s\n", mime_types_path, strerror(errno));
+        exit(errno);
+      }
+    } else if (strcmp("--reload-cache", argv[i]) == 0) {
+      reload_enable_cache();
+    } else if (strcmp("--gzip", argv[i]) == 0) {
+      file_cache_enable_gzip();
+    } else if (strcmp("--cache-size", argv[i]) == 0) {
+      char *cache_size_str = argv[++i];
+      if (!cache_size_str || (cache_size = atoi(cache_size_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --cache-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--fd-cache", argv[i]) == 0) {
+      char *fd_cache_str = argv[++i];
+      if (!fd_cache_str || (fd_cache_size = atoi(fd_cache_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --fd-cache\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-limit", argv[i]) == 0) {
+      char *rate_str = argv[++i];
+      if (!rate_str || (rate_limit = atoi(rate_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --rate-limit\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-limit-burst", argv[i]) == 0) {
+      char *burst_str = argv[++i];
+      if (!burst_str || (rate_limit_burst = atoi(burst_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --rate-limit-burst\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-cache", argv[i]) == 0) {
+      char *size_str = argv[++i];
+      if (!size_str || (proxy_cache_size = atoi(size_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --proxy-cache\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-cache-dir", argv[i]) == 0) {
+      proxy_cache_dir = argv[++i];
+      if (!proxy_cache_dir) {
+        fprintf(stderr, "Expected a directory after --proxy-cache-dir\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-cache-disk", argv[i]) == 0) {
+      char *size_str = argv[++i];
+      if (!size_str || (proxy_cache_disk = atoi(size_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --proxy-cache-disk\n");
+        exit_with_usage();
+      }
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -399,6 +1079,41 @@ int main(int argc, char **argv) {
     exit_with_usage();
   }
 
+  file_cache_init((size_t) cache_size * 1024 * 1024);
+  fd_cache_init(fd_cache_size);
+  // a client may open --rate-limit connections a second, twice that at once
+  if (rate_limit)
+    rate_limit_init(rate_limit, rate_limit_burst ? rate_limit_burst : 2 * rate_limit);
+  reload_inherit();
+  if (access_log_path)
+    access_log_open(access_log_path, access_log_format, access_log_sample);
+  if (server_proxy_hostname) {
+    proxy_cache_init((size_t) proxy_cache_size * 1024 * 1024, proxy_cache_dir,
+        (size_t) proxy_cache_disk * 1024 * 1024);
+    proxy_init(proxy_balance);
+  }
+  if (https_port) {
+    if (request_handler != handle_files_request || event_loop) {
+      fprintf(stderr, "--https-port only serves --files, without --event-loop\n");
+      exit_with_usage();
+    }
+    if (!tls_cert_path || !tls_key_path) {
+      fprintf(stderr, "--https-port needs --tls-cert and --tls-key\n");
+      exit_with_usage();
+    }
+    tls_init(tls_cert_path, tls_key_path);
+  }
+
+  if (event_loop) {
+    if (request_handler != handle_files_request) {
+      fprintf(stderr, "--event-loop only serves --files\n");
+      exit_with_usage();
+    }
+    /* --num-threads sets the number of loops. */
+    event_loop_serve(server_port, server_files_directory,
+        num_threads > 0 ? num_threads : 1, io_uring, &server_fd);
+  }
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
@@ -1,70 +1,413 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libhttp.h"
 
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
-
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
+/* A request from http_request_parse() and the bytes it points into. */
+struct http_request_block {
+  struct http_request request;
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE + 1];
+};
+
 struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
-
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
-
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
-
-  char *read_start, *read_end;
-  size_t read_size;
-
-  do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
+  struct http_request_block *block = malloc(sizeof(struct http_request_block));
+  if (!block) http_fatal_error("Malloc failed");
+
+  int bytes_read = read(fd, block->buffer, LIBHTTP_REQUEST_MAX_SIZE);
+  if (bytes_read < 0) bytes_read = 0;
+  block->buffer[bytes_read] = '\0'; /* Always null-terminate. */
+
+  /* One read is all we wait for, so the request line is enough. */
+  struct http_parser parser;
+  http_parser_init(&parser);
+  enum http_parse_state state = http_parser_feed(&parser, block->buffer, bytes_read);
+  if (state == HTTP_PARSE_LINE || state == HTTP_PARSE_ERROR) {
+    free(block);
+    return NULL;
+  }
+  http_parser_get_request(&parser, block->buffer, &block->request);
+  return &block->request;
+}
+
+void http_request_free(struct http_request *request) {
+  /* REQUEST is the first member of its block. */
   free(request);
-  free(read_buffer);
-  return NULL;
+}
+
+/* Names of the headers in enum http_header_id, in order. */
+static const char *http_header_names[HTTP_HEADER_CNT] = {
+  "Host", "Connection", "Range", "If-None-Match", "Accept-Encoding",
+  "If-Modified-Since", "If-Range", "Content-Length", "Transfer-Encoding",
+  "Expect", "Cache-Control", "Expires", "ETag", "Last-Modified", "Authorization",
+  "Set-Cookie", "Vary",
+};
+
+void http_parser_init(struct http_parser *parser) {
+  memset(parser, 0, sizeof(*parser));
+  parser->state = HTTP_PARSE_LINE;
+}
+
+void http_parser_init_response(struct http_parser *parser) {
+  http_parser_init(parser);
+  parser->response = 1;
+}
+
+/* Returns true if the LEN bytes at S are exactly WORD, ignoring case. */
+static int http_span_is(const char *s, size_t len, const char *word) {
+  return strlen(word) == len && strncasecmp(s, word, len) == 0;
+}
+
+enum http_header_id http_header_lookup(const char *name, size_t len) {
+  for (int id = 0; id < HTTP_HEADER_CNT; id++)
+    if (http_span_is(name, len, http_header_names[id])) return id;
+  return HTTP_HEADER_CNT;
+}
+
+/* Parses the request line in BUFFER[START, END): "METHOD PATH VERSION". */
+static void http_parse_request_line(struct http_parser *parser, const char *buffer,
+    size_t start, size_t end) {
+  size_t i = start;
+
+  /* The HTTP method: "[A-Z]+" */
+  while (i < end && buffer[i] >= 'A' && buffer[i] <= 'Z') i++;
+  parser->method = (struct http_span) { start, i - start };
+  if (parser->method.len == 0 || i == end || buffer[i] != ' ') {
+    parser->state = HTTP_PARSE_ERROR;
+    return;
+  }
+  i++;
+
+  /* The path: "[^ ]+" */
+  size_t path_start = i;
+  while (i < end && buffer[i] != ' ') i++;
+  parser->path = (struct http_span) { path_start, i - path_start };
+  if (parser->path.len == 0) {
+    parser->state = HTTP_PARSE_ERROR;
+    return;
+  }
+
+  /* The version, which may be missing. */
+  while (i < end && buffer[i] == ' ') i++;
+  parser->version = (struct http_span) { i, end - i };
+  parser->keep_alive = http_span_is(buffer + i, end - i, "HTTP/1.1");
+  parser->state = HTTP_PARSE_HEADERS;
+}
+
+/* Parses the status line in BUFFER[START, END): "HTTP/x.y ddd reason". */
+static void http_parse_status_line(struct http_parser *parser, const char *buffer,
+    size_t start, size_t end) {
+  size_t i = start;
+  while (i < end && buffer[i] != ' ') i++;
+  parser->version = (struct http_span) { start, i - start };
+  if (i - start < 5 || strncmp(buffer + start, "HTTP/", 5) != 0) {
+    parser->state = HTTP_PARSE_ERROR;
+    return;
+  }
+  parser->keep_alive = http_span_is(buffer + start, i - start, "HTTP/1.1");
+
+  while (i < end && buffer[i] == ' ') i++;
+  int digits = 0;
+  parser->status = 0;
+  while (i < end && buffer[i] >= '0' && buffer[i] <= '9' && digits < 4) {
+    parser->status = parser->status * 10 + (buffer[i++] - '0');
+    digits++;
+  }
+  if (digits != 3 || (i < end && buffer[i] != ' ')) {
+    parser->state = HTTP_PARSE_ERROR;
+    return;
+  }
+  parser->state = HTTP_PARSE_HEADERS;
+}
+
+/* Parses the header line in BUFFER[START, END), or notes the end of the
+ * head if it is blank. Lines without a colon are ignored. */
+static void http_parse_header_line(struct http_parser *parser, const char *buffer,
+    size_t start, size_t end) {
+  if (start == end) {
+    parser->state = HTTP_PARSE_DONE;
+    return;
+  }
+
+  const char *colon = memchr(buffer + start, ':', end - start);
+  if (!colon) return;
+  size_t name_len = colon - (buffer + start);
+  size_t value = colon - buffer + 1;
+  while (value < end && (buffer[value] == ' ' || buffer[value] == '\t')) value++;
+  size_t value_end = end;
+  while (value_end > value
+      && (buffer[value_end - 1] == ' ' || buffer[value_end - 1] == '\t'))
+    value_end--;
+
+  enum http_header_id id = http_header_lookup(buffer + start, name_len);
+  if (id == HTTP_HEADER_CNT) return;
+  parser->headers[id] = (struct http_span) { value, value_end - value };
+  parser->headers_seen |= 1u << id;
+  if (id == HTTP_HEADER_CONNECTION) {
+    if (http_span_is(buffer + value, value_end - value, "close"))
+      parser->keep_alive = 0;
+    else if (http_span_is(buffer + value, value_end - value, "keep-alive"))
+      parser->keep_alive = 1;
+  }
+}
+
+enum http_parse_state http_parser_feed(struct http_parser *parser,
+    const char *buffer, size_t len) {
+  while (parser->state == HTTP_PARSE_LINE || parser->state == HTTP_PARSE_HEADERS) {
+    const char *newline = memchr(buffer + parser->scan, '\n', len - parser->scan);
+    if (!newline) {
+      parser->scan = len;
+      if (len >= LIBHTTP_REQUEST_MAX_SIZE) parser->state = HTTP_PARSE_ERROR;
+      break;
+    }
+
+    size_t line_end = newline - buffer;
+    size_t end = line_end;
+    if (end > parser->line_start && buffer[end - 1] == '\r') end--;
+    if (parser->state == HTTP_PARSE_LINE && parser->response)
+      http_parse_status_line(parser, buffer, parser->line_start, end);
+    else if (parser->state == HTTP_PARSE_LINE)
+      http_parse_request_line(parser, buffer, parser->line_start, end);
+    else
+      http_parse_header_line(parser, buffer, parser->line_start, end);
+    parser->line_start = parser->scan = line_end + 1;
+  }
+  if (parser->state == HTTP_PARSE_DONE) parser->head_len = parser->line_start;
+  return parser->state;
+}
+
+/* Returns SPAN of BUFFER as a string, terminating it in place. */
+static char *http_span_string(char *buffer, struct http_span span) {
+  buffer[span.off + span.len] = '\0';
+  return buffer + span.off;
+}
+
+void http_parser_get_request(const struct http_parser *parser, char *buffer,
+    struct http_request *request) {
+  request->method = http_span_string(buffer, parser->method);
+  request->path = http_span_string(buffer, parser->path);
+  request->keep_alive = parser->keep_alive;
+  for (int id = 0; id < HTTP_HEADER_CNT; id++) {
+    request->headers[id] = parser->headers_seen & (1u << id)
+        ? http_span_string(buffer, parser->headers[id]) : NULL;
+  }
+}
+
+void http_conn_init(struct http_conn *conn, int fd) {
+  conn->fd = fd;
+  conn->io = NULL;
+  conn->malformed = 0;
+  conn->len = 0;
+  conn->consumed = 0;
+}
 
+int http_parser_content_length(const struct http_parser *parser,
+    const char *buffer, off_t *length) {
+  if (!(parser->headers_seen & (1u << HTTP_HEADER_CONTENT_LENGTH))) return 0;
+  struct http_span span = parser->headers[HTTP_HEADER_CONTENT_LENGTH];
+  if (span.len == 0 || span.len > 18) return -1;
+  off_t value = 0;
+  for (size_t i = span.off; i < span.off + span.len; i++) {
+    if (buffer[i] < '0' || buffer[i] > '9') return -1;
+    value = value * 10 + (buffer[i] - '0');
+  }
+  *length = value;
+  return 1;
+}
+
+int http_parser_chunked(const struct http_parser *parser, const char *buffer) {
+  if (!(parser->headers_seen & (1u << HTTP_HEADER_TRANSFER_ENCODING))) return 0;
+  struct http_span span = parser->headers[HTTP_HEADER_TRANSFER_ENCODING];
+  size_t end = span.off + span.len, start = end;
+  while (start > span.off && buffer[start - 1] != ',') start--;
+  while (start < end && (buffer[start] == ' ' || buffer[start] == '\t')) start++;
+  return http_span_is(buffer + start, end - start, "chunked");
+}
+
+void http_dechunker_init(struct http_dechunker *dechunker) {
+  dechunker->state = HTTP_DECHUNK_SIZE;
+  dechunker->left = 0;
+  dechunker->digits = 0;
+}
+
+/* Returns the value of hex digit C, or -1 if it isn't one. */
+static int http_hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+size_t http_dechunk(struct http_dechunker *dechunker, char *data, size_t *len) {
+  size_t in = 0, out = 0;
+  while (in < *len && dechunker->state < HTTP_DECHUNK_DONE) {
+    char c = data[in];
+    switch (dechunker->state) {
+      case HTTP_DECHUNK_DATA: {
+        size_t n = *len - in;
+        if ((off_t) n > dechunker->left) n = dechunker->left;
+        memmove(data + out, data + in, n);
+        in += n;
+        out += n;
+        dechunker->left -= n;
+        if (dechunker->left == 0) dechunker->state = HTTP_DECHUNK_DATA_END;
+        continue;
+      }
+      case HTTP_DECHUNK_SIZE: {
+        /* Sizes that would overflow are refused. */
+        int digit = http_hex_digit(c);
+        if (digit >= 0 && dechunker->digits < 15) {
+          dechunker->left = dechunker->left * 16 + digit;
+          dechunker->digits++;
+        } else if (digit >= 0 || dechunker->digits == 0) {
+          dechunker->state = HTTP_DECHUNK_ERROR;
+        } else {
+          dechunker->state = HTTP_DECHUNK_SIZE_LINE;
+          continue;
+        }
+        break;
+      }
+      case HTTP_DECHUNK_SIZE_LINE:
+        if (c == '\n') {
+          dechunker->digits = 0;
+          dechunker->state = dechunker->left > 0 ? HTTP_DECHUNK_DATA : HTTP_DECHUNK_TRAILER;
+        }
+        break;
+      case HTTP_DECHUNK_DATA_END:
+        if (c == '\n')
+          dechunker->state = HTTP_DECHUNK_SIZE;
+        else if (c != '\r')
+          dechunker->state = HTTP_DECHUNK_ERROR;
+        break;
+      case HTTP_DECHUNK_TRAILER:
+        /* A blank line ends the body. */
+        if (c == '\n')
+          dechunker->state = HTTP_DECHUNK_DONE;
+        else if (c != '\r')
+          dechunker->state = HTTP_DECHUNK_TRAILER_LINE;
+        break;
+      case HTTP_DECHUNK_TRAILER_LINE:
+        if (c == '\n') dechunker->state = HTTP_DECHUNK_TRAILER;
+        break;
+      default:
+        break;
+    }
+    in++;
+  }
+  *len = in;
+  return out;
+}
+
+ssize_t http_normalize_path(const char *path, char *out) {
+  if (*path != '/') return -1;
+  out[0] = '/';
+  size_t len = 1;
+  size_t seg = 1;       /* Start of the segment being written. */
+  for (const char *p = path + 1; ; p++) {
+    char c = *p;
+    int escaped = c == '%';
+    if (escaped) {
+      int high = http_hex_digit(p[1]);
+      int low = high < 0 ? -1 : http_hex_digit(p[2]);
+      if (low < 0 || (high | low) == 0) return -1;
+      c = (char) (high << 4 | low);
+      p += 2;
+    }
+    int end = !escaped && (c == '\0' || c == '?');
+    if (!end && c != '/') {
+      out[len++] = c;
+      continue;
+    }
+
+    /* The segment is done; drop it with its "/" if it's empty or ".", and
+     * the one before it too if it's "..". */
+    size_t n = len - seg;
+    if (n == 0 || (n == 1 && out[seg] == '.')) {
+      len = seg - 1;
+    } else if (n == 2 && out[seg] == '.' && out[seg + 1] == '.') {
+      len = seg - 1;
+      while (len > 0 && out[len - 1] != '/') len--;
+      if (len > 0) len--;
+    }
+    if (end) break;
+    out[len++] = '/';
+    seg = len;
+  }
+  if (len == 0) out[len++] = '/';
+  out[len] = '\0';
+  return len;
+}
+
+static long http_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+int http_conn_read_head(struct http_conn *conn, int timeout_ms, int response) {
+  /* Drop the last head, keeping whatever was pipelined after it. */
+  conn->len -= conn->consumed;
+  memmove(conn->buffer, conn->buffer + conn->consumed, conn->len);
+  conn->consumed = 0;
+
+  if (response)
+    http_parser_init_response(&conn->parser);
+  else
+    http_parser_init(&conn->parser);
+  const struct http_conn_io *io = conn->io;
+  /* Once a request has begun, all of its head must come by the deadline,
+   * however it trickles in. */
+  long deadline = 0;
+  while (http_parser_feed(&conn->parser, conn->buffer, conn->len) < HTTP_PARSE_DONE) {
+    if (!response && conn->len > 0) {
+      if (!deadline) deadline = http_now_ms() + http_header_timeout_ms;
+      timeout_ms = deadline - http_now_ms();
+      if (timeout_ms <= 0) return 0;
+    }
+    if (!io || !io->pending(io->aux)) {
+      struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+      int ready = poll(&pfd, 1, timeout_ms);
+      if (ready < 0 && errno == EINTR) continue;
+      if (ready <= 0) return 0;
+    }
+
+    size_t room = LIBHTTP_REQUEST_MAX_SIZE - conn->len;
+    ssize_t bytes_read = io ? io->read(io->aux, conn->buffer + conn->len, room)
+        : read(conn->fd, conn->buffer + conn->len, room);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) return 0;
+    conn->len += bytes_read;
+  }
+  if (conn->parser.state == HTTP_PARSE_ERROR) {
+    conn->malformed = 1;
+    return -1;
+  }
+  conn->consumed = conn->parser.head_len;
+  return 1;
+}
+
+struct http_request *http_conn_read_request(struct http_conn *conn, int timeout_ms) {
+  if (http_conn_read_head(conn, timeout_ms, 0) <= 0) return NULL;
+  http_parser_get_request(&conn->parser, conn->buffer, &conn->request);
+  return &conn->request;
 }
 
 char* http_get_response_message(int status_code) {
@@ -73,6 +416,8 @@ char* http_get_response_message(int status_code) {
       return "Continue";
     case 200:
       return "OK";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -89,22 +434,41 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 416:
+      return "Range Not Satisfiable";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
     default:
       return "Internal Server Error";
   }
 }
 
+__thread int http_sent_status;
+__thread long long http_sent_bytes;
+
+int http_idle_timeout_ms = HTTP_KEEP_ALIVE_TIMEOUT_MS;
+int http_header_timeout_ms = HTTP_HEADER_TIMEOUT_MS;
+int http_body_timeout_ms = HTTP_BODY_TIMEOUT_MS;
+
+/* Counts N bytes sent, if N isn't an error. */
+static void http_count_sent(ssize_t n) {
+  if (n > 0) http_sent_bytes += n;
+}
+
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
-      http_get_response_message(status_code));
+  http_sent_status = status_code;
+  http_count_sent(dprintf(fd, "HTTP/1.1 %d %s\r\n", status_code,
+      http_get_response_message(status_code)));
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  http_count_sent(dprintf(fd, "%s: %s\r\n", key, value));
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  http_count_sent(dprintf(fd, "\r\n"));
 }
 
 void http_send_string(int fd, char *data) {
@@ -117,30 +481,591 @@ void http_send_data(int fd, char *data, size_t size) {
     bytes_sent = write(fd, data, size);
     if (bytes_sent < 0)
       return;
+    http_sent_bytes += bytes_sent;
     size -= bytes_sent;
     data += bytes_sent;
   }
 }
 
+void http_send_file(int fd, int file_fd, size_t size) {
+  http_send_file_range(fd, file_fd, 0, size);
+}
+
+void http_send_file_range(int fd, int file_fd, off_t offset, size_t size) {
+  ssize_t bytes_sent;
+  while (size > 0) {
+    /* A client that stops reading gets http_body_timeout_ms to make room,
+     * and each call is kept short enough that the kernel gives up on it
+     * after that too, rather than only once all of SIZE is out. */
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int ready = poll(&pfd, 1, http_body_timeout_ms);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0)
+      return;
+    bytes_sent = sendfile(fd, file_fd, &offset,
+        size < HTTP_SEND_FILE_CHUNK ? size : HTTP_SEND_FILE_CHUNK);
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
+    /* Stop on error, or if the file got shorter. */
+    if (bytes_sent <= 0)
+      return;
+    http_sent_bytes += bytes_sent;
+    size -= bytes_sent;
+  }
+}
+
+int http_writev_all(int fd, struct iovec *iov, int cnt) {
+  while (cnt > 0) {
+    ssize_t bytes_sent = writev(fd, iov, cnt);
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
+    if (bytes_sent < 0)
+      return -1;
+    http_sent_bytes += bytes_sent;
+    while (cnt > 0 && (size_t) bytes_sent >= iov->iov_len) {
+      bytes_sent -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + bytes_sent;
+      iov->iov_len -= bytes_sent;
+    }
+  }
+  return 0;
+}
+
+/* Appends LEN bytes of TEXT to RESPONSE's headers. If they don't fit, what
+ * is already buffered goes out first, flagged as having more to follow. */
+static void http_response_append(struct http_response *response, const char *text,
+    size_t len) {
+  while (len > 0) {
+    size_t room = LIBHTTP_RESPONSE_HEADER_MAX - response->len;
+    if (room == 0) {
+      http_send_data(response->fd, response->buffer, response->len);
+      response->len = 0;
+      room = LIBHTTP_RESPONSE_HEADER_MAX;
+    }
+    size_t chunk = len < room ? len : room;
+    memcpy(response->buffer + response->len, text, chunk);
+    response->len += chunk;
+    text += chunk;
+    len -= chunk;
+  }
+}
+
+void http_response_begin(struct http_response *response, int fd, int status_code) {
+  char line[64];
+  int len = snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", status_code,
+      http_get_response_message(status_code));
+  response->fd = fd;
+  response->len = 0;
+  http_sent_status = status_code;
+  http_response_append(response, line, len);
+}
+
+void http_response_header(struct http_response *response, char *key, char *value) {
+  http_response_append(response, key, strlen(key));
+  http_response_append(response, ": ", 2);
+  http_response_append(response, value, strlen(value));
+  http_response_append(response, "\r\n", 2);
+}
+
+void http_response_flush(struct http_response *response, char *body, size_t size) {
+  http_response_append(response, "\r\n", 2);
+  struct iovec iov[2] = {
+    { .iov_base = response->buffer, .iov_len = response->len },
+    { .iov_base = body, .iov_len = size },
+  };
+  http_writev_all(response->fd, iov, size > 0 ? 2 : 1);
+  response->len = 0;
+}
+
+void http_response_flush_file(struct http_response *response, int file_fd,
+    off_t offset, size_t size) {
+  http_response_append(response, "\r\n", 2);
+
+  /* MSG_MORE holds the headers back to share a segment with the file,
+   * like TCP_CORK but without two more setsockopt() calls. */
+  char *data = response->buffer;
+  size_t len = response->len;
+  while (len > 0) {
+    ssize_t bytes_sent = send(response->fd, data, len, size > 0 ? MSG_MORE : 0);
+    if (bytes_sent < 0 && errno == EINTR)
+      continue;
+    if (bytes_sent < 0)
+      return;
+    http_sent_bytes += bytes_sent;
+    data += bytes_sent;
+    len -= bytes_sent;
+  }
+  response->len = 0;
+  http_send_file_range(response->fd, file_fd, offset, size);
+}
+
+void http_chunked_init(struct http_chunked *chunked, int fd) {
+  chunked->fd = fd;
+  chunked->failed = 0;
+  chunked->len = 0;
+}
+
+/* Sends SIZE bytes of DATA as a chunk, and the last chunk after it if
+ * LAST is set, in one writev(). Once a write has failed, nothing more is
+ * sent. */
+static void http_chunked_send(struct http_chunked *chunked, const char *data,
+    size_t size, int last) {
+  static const char end[] = "\r\n0\r\n\r\n";
+  char line[24];
+  struct iovec iov[3];
+  int cnt = 0;
+  if (size > 0) {
+    iov[cnt++] = (struct iovec) { line, snprintf(line, sizeof(line), "%zx\r\n", size) };
+    iov[cnt++] = (struct iovec) { (char *) data, size };
+    iov[cnt++] = (struct iovec) { (char *) end, last ? sizeof(end) - 1 : 2 };
+  } else if (last) {
+    iov[cnt++] = (struct iovec) { (char *) end + 2, sizeof(end) - 3 };
+  }
+  if (cnt > 0 && !chunked->failed && http_writev_all(chunked->fd, iov, cnt) == -1)
+    chunked->failed = 1;
+}
+
+void http_chunked_write(struct http_chunked *chunked, const char *data, size_t size) {
+  if (chunked->len + size > HTTP_CHUNK_BUFFER_SIZE) {
+    http_chunked_flush(chunked);
+    if (size >= HTTP_CHUNK_BUFFER_SIZE) {
+      http_chunked_send(chunked, data, size, 0);
+      return;
+    }
+  }
+  memcpy(chunked->buffer + chunked->len, data, size);
+  chunked->len += size;
+}
+
+void http_chunked_flush(struct http_chunked *chunked) {
+  http_chunked_send(chunked, chunked->buffer, chunked->len, 0);
+  chunked->len = 0;
+}
+
+int http_chunked_end(struct http_chunked *chunked) {
+  http_chunked_send(chunked, chunked->buffer, chunked->len, 1);
+  chunked->len = 0;
+  return chunked->failed ? -1 : 0;
+}
+
+/* Types known without a mime.types file, sorted by extension. */
+static const struct http_mime_type {
+  const char *extension;
+  char *type;
+} http_mime_defaults[] = {
+  { "avif", "image/avif" },
+  { "bmp", "image/bmp" },
+  { "css", "text/css" },
+  { "csv", "text/csv" },
+  { "eot", "application/vnd.ms-fontobject" },
+  { "gif", "image/gif" },
+  { "gz", "application/gzip" },
+  { "htm", "text/html" },
+  { "html", "text/html" },
+  { "ico", "image/vnd.microsoft.icon" },
+  { "jpeg", "image/jpeg" },
+  { "jpg", "image/jpeg" },
+  { "js", "application/javascript" },
+  { "json", "application/json" },
+  { "jsonld", "application/ld+json" },
+  { "m4a", "audio/mp4" },
+  { "map", "application/json" },
+  { "md", "text/markdown" },
+  { "mjs", "application/javascript" },
+  { "mp3", "audio/mpeg" },
+  { "mp4", "video/mp4" },
+  { "oga", "audio/ogg" },
+  { "ogg", "audio/ogg" },
+  { "ogv", "video/ogg" },
+  { "otf", "font/otf" },
+  { "pdf", "application/pdf" },
+  { "png", "image/png" },
+  { "rss", "application/rss+xml" },
+  { "svg", "image/svg+xml" },
+  { "tar", "application/x-tar" },
+  { "tif", "image/tiff" },
+  { "tiff", "image/tiff" },
+  { "ttf", "font/ttf" },
+  { "txt", "text/plain" },
+  { "wasm", "application/wasm" },
+  { "wav", "audio/wav" },
+  { "webm", "video/webm" },
+  { "webmanifest", "application/manifest+json" },
+  { "webp", "image/webp" },
+  { "woff", "font/woff" },
+  { "woff2", "font/woff2" },
+  { "xhtml", "application/xhtml+xml" },
+  { "xml", "application/xml" },
+  { "zip", "application/zip" },
+};
+
+/* Types read from a mime.types file, in an open-addressed table keyed by
+ * extension. Filled in before any thread starts and only read after. */
+static struct {
+  char extension[HTTP_MIME_EXTENSION_MAX + 1];
+  char *type;
+} *http_mime_table;
+static size_t http_mime_mask;
+static size_t http_mime_cnt;
+
+static uint32_t http_mime_hash(const char *extension) {
+  uint32_t hash = 2166136261u;
+  for (const char *p = extension; *p; p++) hash = (hash ^ (unsigned char) *p) * 16777619u;
+  return hash;
+}
+
+/* Returns EXTENSION's slot in the table: its own, or the empty one it
+ * would go in. */
+static size_t http_mime_slot(const char *extension) {
+  size_t i = http_mime_hash(extension) & http_mime_mask;
+  while (http_mime_table[i].type && strcmp(http_mime_table[i].extension, extension) != 0)
+    i = (i + 1) & http_mime_mask;
+  return i;
+}
+
+/* Maps EXTENSION to TYPE in the table, growing it as needed. Returns -1
+ * if out of memory. */
+static int http_mime_add(const char *extension, char *type) {
+  if ((http_mime_cnt + 1) * 2 > http_mime_mask + 1 || !http_mime_table) {
+    size_t old_cap = http_mime_table ? http_mime_mask + 1 : 0;
+    size_t cap = old_cap ? old_cap * 2 : 256;
+    typeof(http_mime_table) old = http_mime_table;
+    http_mime_table = calloc(cap, sizeof(*http_mime_table));
+    if (!http_mime_table) {
+      http_mime_table = old;
+      return -1;
+    }
+    http_mime_mask = cap - 1;
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].type) http_mime_table[http_mime_slot(old[i].extension)] = old[i];
+    }
+    free(old);
+  }
+  size_t i = http_mime_slot(extension);
+  if (!http_mime_table[i].type) http_mime_cnt++;
+  strcpy(http_mime_table[i].extension, extension);
+  http_mime_table[i].type = type;
+  return 0;
+}
+
+int http_mime_types_load(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) return -1;
+  char line[1024];
+  int cnt = 0;
+  while (fgets(line, sizeof(line), file)) {
+    /* "type ext ext ...", with # starting a comment. */
+    char *saveptr;
+    line[strcspn(line, "#")] = '\0';
+    char *name = strtok_r(line, " \t\r\n", &saveptr);
+    if (!name) continue;
+    char *type = NULL;
+    for (char *ext = strtok_r(NULL, " \t\r\n", &saveptr); ext;
+        ext = strtok_r(NULL, " \t\r\n", &saveptr)) {
+      size_t len = strlen(ext);
+      if (len > HTTP_MIME_EXTENSION_MAX) continue;
+      for (size_t i = 0; i < len; i++) ext[i] = tolower((unsigned char) ext[i]);
+      if (!type && !(type = strdup(name))) break;
+      if (http_mime_add(ext, type) == -1) break;
+      cnt++;
+    }
+  }
+  fclose(file);
+  return cnt;
+}
+
+static int http_mime_compare(const void *key, const void *entry) {
+  return strcmp(key, ((const struct http_mime_type *) entry)->extension);
+}
+
 char *http_get_mime_type(char *file_name) {
-  char *file_extension = strrchr(file_name, '.');
-  if (file_extension == NULL) {
+  const char *file_extension = strrchr(file_name, '.');
+  if (file_extension == NULL || strchr(file_extension, '/')) {
     return "text/plain";
   }
 
-  if (strcmp(file_extension, ".html") == 0 || strcmp(file_extension, ".htm") == 0) {
-    return "text/html";
-  } else if (strcmp(file_extension, ".jpg") == 0 || strcmp(file_extension, ".jpeg") == 0) {
-    return "image/jpeg";
-  } else if (strcmp(file_extension, ".png") == 0) {
-    return "image/png";
-  } else if (strcmp(file_extension, ".css") == 0) {
-    return "text/css";
-  } else if (strcmp(file_extension, ".js") == 0) {
-    return "application/javascript";
-  } else if (strcmp(file_extension, ".pdf") == 0) {
-    return "application/pdf";
-  } else {
-    return "text/plain";
+  char extension[HTTP_MIME_EXTENSION_MAX + 1];
+  size_t len = strlen(++file_extension);
+  if (len == 0 || len > HTTP_MIME_EXTENSION_MAX) return "text/plain";
+  for (size_t i = 0; i <= len; i++)
+    extension[i] = tolower((unsigned char) file_extension[i]);
+
+  if (http_mime_table) {
+    size_t i = http_mime_slot(extension);
+    if (http_mime_table[i].type) return http_mime_table[i].type;
+  }
+  const struct http_mime_type *known = bsearch(extension, http_mime_defaults,
+      sizeof(http_mime_defaults) / sizeof(http_mime_defaults[0]),
+      sizeof(http_mime_defaults[0]), http_mime_compare);
+  return known ? known->type : "text/plain";
+}
+
+unsigned http_request_encodings(const struct http_request *request) {
+  unsigned encodings = 1u << HTTP_ENCODING_IDENTITY;
+  const char *p = request->headers[HTTP_HEADER_ACCEPT_ENCODING];
+  if (!p || request->headers[HTTP_HEADER_RANGE]) return encodings;
+
+  /* A comma-separated list of "coding;q=VALUE", where q=0 means no. */
+  unsigned any = 0, refused = 0;
+  while (*p) {
+    while (*p == ' ' || *p == '\t' || *p == ',') p++;
+    const char *name = p;
+    while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+    size_t name_len = p - name;
+    int allowed = 1;
+    while (*p && *p != ',') {
+      if (*p == 'q' && p[1] == '=') {
+        double q = strtod(p + 2, NULL);
+        allowed = q > 0;
+      }
+      p++;
+    }
+    if (name_len == 0) continue;
+
+    unsigned bits = 0;
+    if (http_span_is(name, name_len, "gzip") || http_span_is(name, name_len, "x-gzip"))
+      bits = 1u << HTTP_ENCODING_GZIP;
+    else if (http_span_is(name, name_len, "br"))
+      bits = 1u << HTTP_ENCODING_BR;
+    else if (http_span_is(name, name_len, "*"))
+      any = allowed ? ~0u : 0;
+    if (allowed)
+      encodings |= bits;
+    else
+      refused |= bits;
   }
+  return encodings | (any & ~refused);
+}
+
+const char *http_encoding_name(enum http_encoding encoding) {
+  switch (encoding) {
+    case HTTP_ENCODING_GZIP:
+      return "gzip";
+    case HTTP_ENCODING_BR:
+      return "br";
+    default:
+      return NULL;
+  }
+}
+
+const char *http_encoding_suffix(enum http_encoding encoding) {
+  switch (encoding) {
+    case HTTP_ENCODING_GZIP:
+      return ".gz";
+    case HTTP_ENCODING_BR:
+      return ".br";
+    default:
+      return "";
+  }
+}
+
+int http_mime_type_is_compressible(const char *content_type) {
+  static const char *const compressible[] = {
+    "application/javascript", "application/json", "application/manifest+json",
+    "application/wasm", "application/xml", "image/svg+xml",
+    "image/vnd.microsoft.icon", "application/vnd.ms-fontobject", "font/otf", "font/ttf",
+  };
+  if (strncmp(content_type, "text/", 5) == 0) return 1;
+  size_t len = strlen(content_type);
+  if (len > 5 && (strcmp(content_type + len - 5, "+json") == 0
+        || strcmp(content_type + len - 4, "+xml") == 0))
+    return 1;
+  for (size_t i = 0; i < sizeof(compressible) / sizeof(compressible[0]); i++) {
+    if (strcmp(content_type, compressible[i]) == 0) return 1;
+  }
+  return 0;
+}
+
+enum http_encoding http_find_encoded_sibling(const char *path, const char *content_type,
+    unsigned encodings, char *encoded_path, struct stat *sb, unsigned *missing) {
+  /* Best compression first. */
+  static const enum http_encoding preference[] = { HTTP_ENCODING_BR, HTTP_ENCODING_GZIP };
+
+  *missing = 0;
+  if (!http_mime_type_is_compressible(content_type)) return HTTP_ENCODING_IDENTITY;
+  for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); i++) {
+    enum http_encoding encoding = preference[i];
+    if (!(encodings & (1u << encoding))) continue;
+    sprintf(encoded_path, "%s%s", path, http_encoding_suffix(encoding));
+    if (stat(encoded_path, sb) == 0 && S_ISREG(sb->st_mode)) return encoding;
+    *missing |= 1u << encoding;
+  }
+  return HTTP_ENCODING_IDENTITY;
+}
+
+void http_format_etag(char *etag, const struct stat *sb) {
+  unsigned long long mtime_ns = sb->st_mtim.tv_sec * 1000000000ULL + sb->st_mtim.tv_nsec;
+  snprintf(etag, HTTP_ETAG_MAX, "\"%llx-%llx-%llx\"", (unsigned long long) sb->st_ino,
+      (unsigned long long) sb->st_size, mtime_ns);
+}
+
+void http_format_date(char *date, time_t time) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(date, HTTP_DATE_MAX, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Returns true if the comma-separated ETags in LIST include ETAG or "*".
+ * Weak tags ("W/...") match their strong form, as If-None-Match allows. */
+static int http_etag_list_has(const char *list, const char *etag) {
+  size_t etag_len = strlen(etag);
+  const char *p = list;
+  while (*p) {
+    while (*p == ' ' || *p == '\t' || *p == ',') p++;
+    if (*p == '*') return 1;
+    if (strncmp(p, "W/", 2) == 0) p += 2;
+    const char *end = p;
+    while (*end && *end != ',' && *end != ' ' && *end != '\t') end++;
+    if ((size_t) (end - p) == etag_len && strncmp(p, etag, etag_len) == 0)
+      return 1;
+    p = end;
+  }
+  return 0;
+}
+
+int http_request_not_modified(const struct http_request *request,
+    const char *etag, time_t mtime) {
+  const char *if_none_match = request->headers[HTTP_HEADER_IF_NONE_MATCH];
+  if (if_none_match) return http_etag_list_has(if_none_match, etag);
+
+  const char *if_modified_since = request->headers[HTTP_HEADER_IF_MODIFIED_SINCE];
+  if (!if_modified_since) return 0;
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return end && *end == '\0' && mtime <= timegm(&tm);
+}
+
+/* A Cache-Control rule. */
+struct http_cache_control {
+  char *prefix;
+  size_t prefix_len;
+  char *value;
+  struct http_cache_control *next;
+};
+
+/* Set up before serving starts, and only read after. */
+static struct http_cache_control *http_cache_controls;
+
+void http_cache_control_add(const char *prefix, const char *value) {
+  struct http_cache_control *rule = malloc(sizeof(struct http_cache_control));
+  if (!rule) http_fatal_error("Malloc failed");
+  rule->prefix = strdup(prefix);
+  rule->prefix_len = strlen(prefix);
+  rule->value = strdup(value);
+  if (!rule->prefix || !rule->value) http_fatal_error("Malloc failed");
+  rule->next = http_cache_controls;
+  http_cache_controls = rule;
+}
+
+const char *http_cache_control_lookup(const char *path) {
+  struct http_cache_control *best = NULL;
+  for (struct http_cache_control *rule = http_cache_controls; rule; rule = rule->next) {
+    if (strncmp(path, rule->prefix, rule->prefix_len) == 0
+        && (!best || rule->prefix_len > best->prefix_len))
+      best = rule;
+  }
+  return best ? best->value : NULL;
+}
+
+/* Parses the digits at *P into *VALUE, moving *P past them. Returns false
+ * if there are none or they overflow. */
+static int http_parse_offset(const char **p, off_t *value) {
+  const char *s = *p;
+  off_t v = 0;
+  if (*s < '0' || *s > '9') return 0;
+  for (; *s >= '0' && *s <= '9'; s++) {
+    if (v > (INT64_MAX - 9) / 10) return 0;
+    v = v * 10 + (*s - '0');
+  }
+  *p = s;
+  *value = v;
+  return 1;
+}
+
+/* Parses a Range header, "bytes=" followed by comma-separated "A-B",
+ * "A-", or "-N" specs, against a SIZE-byte file. Returns as
+ * http_request_ranges() does. */
+static int http_parse_range(const char *header, off_t size, struct http_range *ranges) {
+  if (strncmp(header, "bytes=", 6) != 0) return 0;
+  const char *p = header + 6;
+  int cnt = 0;
+
+  while (1) {
+    off_t start, end;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '-') {
+      /* The last N bytes. */
+      off_t suffix;
+      p++;
+      if (!http_parse_offset(&p, &suffix)) return 0;
+      start = suffix < size ? size - suffix : 0;
+      end = suffix > 0 ? size : 0;
+    } else {
+      if (!http_parse_offset(&p, &start) || *p++ != '-') return 0;
+      end = size;
+      off_t last;
+      if (http_parse_offset(&p, &last)) {
+        if (last < start) return 0;
+        if (last < size) end = last + 1;
+      }
+    }
+
+    /* Ranges that start past the end are left out. */
+    if (start < end) {
+      if (cnt == HTTP_RANGE_MAX) return 0;
+      ranges[cnt++] = (struct http_range) { start, end - start };
+    }
+
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '\0') break;
+    if (*p++ != ',') return 0;
+  }
+  return cnt > 0 ? cnt : -1;
+}
+
+int http_request_ranges(const struct http_request *request, const char *etag,
+    time_t mtime, off_t size, struct http_range *ranges) {
+  const char *range = request->headers[HTTP_HEADER_RANGE];
+  if (!range) return 0;
+
+  /* If-Range holds an ETag or a date; the ranges only apply to that
+   * version of the file. */
+  const char *if_range = request->headers[HTTP_HEADER_IF_RANGE];
+  if (if_range) {
+    if (if_range[0] == '"') {
+      if (strcmp(if_range, etag) != 0) return 0;
+    } else {
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      const char *end = strptime(if_range, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+      if (!end || *end != '\0' || timegm(&tm) != mtime) return 0;
+    }
+  }
+  return http_parse_range(range, size, ranges);
+}
+
+int http_format_range_part(char *part, const char *content_type,
+    const struct http_range *range, off_t size) {
+  return snprintf(part, HTTP_RANGE_PART_MAX,
+      "\r\n--" HTTP_RANGE_BOUNDARY "\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+      content_type, (long long) range->start,
+      (long long) (range->start + range->length - 1), (long long) size);
+}
+
+off_t http_range_multipart_length(const char *content_type,
+    const struct http_range *ranges, int cnt, off_t size) {
+  char part[HTTP_RANGE_PART_MAX];
+  off_t length = strlen(HTTP_RANGE_END);
+  for (int i = 0; i < cnt; i++)
+    length += http_format_range_part(part, content_type, &ranges[i], size)
+        + ranges[i].length;
+  return length;
 }
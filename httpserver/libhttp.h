@@ -15,33 +15,467 @@
  *     http_send_string(fd, "<html><body><a href='/'>Home</a></body></html>");
  *
  *     close(fd);
+ *
+ * Or, to send the headers and body together in one system call:
+ *
+ *     struct http_response response;
+ *     http_response_begin(&response, fd, 200);
+ *     http_response_header(&response, "Content-type", "text/html");
+ *     http_response_flush(&response, body, body_size);
  */
 
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/* Largest request, line and headers, that is read. */
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+
+/* Room for a buffered response's status line and headers. */
+#define LIBHTTP_RESPONSE_HEADER_MAX 2048
+
+/* How long a kept-alive connection may sit idle, and how many requests
+ * it may carry, before the server closes it. */
+#define HTTP_KEEP_ALIVE_TIMEOUT_MS 5000
+#define HTTP_KEEP_ALIVE_MAX_REQUESTS 100
+
+/* How long a request head may take to arrive once it has begun, and how
+ * long a read or write of a body may go without progress. */
+#define HTTP_HEADER_TIMEOUT_MS 10000
+#define HTTP_BODY_TIMEOUT_MS 30000
+
+/* Most of a file sent with one sendfile() call. */
+#define HTTP_SEND_FILE_CHUNK (1024 * 1024)
+
+/* The timeouts the server enforces on clients, in ms, so that a slow or
+ * silent one can only hold a worker or a connection slot that long. They
+ * default to the above and are set from the command line. */
+extern int http_idle_timeout_ms;
+extern int http_header_timeout_ms;
+extern int http_body_timeout_ms;
+
 /*
  * Functions for parsing an HTTP request.
  */
+
+/* Headers the parser picks out. Others are skipped. */
+enum http_header_id {
+  HTTP_HEADER_HOST,
+  HTTP_HEADER_CONNECTION,
+  HTTP_HEADER_RANGE,
+  HTTP_HEADER_IF_NONE_MATCH,
+  HTTP_HEADER_ACCEPT_ENCODING,
+  HTTP_HEADER_IF_MODIFIED_SINCE,
+  HTTP_HEADER_IF_RANGE,
+  HTTP_HEADER_CONTENT_LENGTH,
+  HTTP_HEADER_TRANSFER_ENCODING,
+  HTTP_HEADER_EXPECT,
+  HTTP_HEADER_CACHE_CONTROL,
+  HTTP_HEADER_EXPIRES,
+  HTTP_HEADER_ETAG,
+  HTTP_HEADER_LAST_MODIFIED,
+  HTTP_HEADER_AUTHORIZATION,
+  HTTP_HEADER_SET_COOKIE,
+  HTTP_HEADER_VARY,
+  HTTP_HEADER_CNT
+};
+
+/* Returns the id of the LEN-byte header NAME, in any case, or
+ * HTTP_HEADER_CNT if it isn't one the parser picks out. */
+enum http_header_id http_header_lookup(const char *name, size_t len);
+
 struct http_request {
   char *method;
   char *path;
+  int keep_alive;   /* Client wants the connection kept open afterwards. */
+  char *headers[HTTP_HEADER_CNT];   /* Values of known headers, or NULL. */
 };
 
+/*
+ * Reads one request from fd. Returns NULL if an error was encountered.
+ * The request is a single allocation; free it with http_request_free().
+ */
 struct http_request *http_request_parse(int fd);
+void http_request_free(struct http_request *request);
+
+/*
+ * A resumable parser for a request head (request line and headers) held in
+ * a caller's buffer. It allocates nothing: it records where things are as
+ * offsets into the buffer. Feed it the buffer each time more bytes arrive;
+ * it picks up where it stopped.
+ */
+enum http_parse_state {
+  HTTP_PARSE_LINE,      /* Waiting for the rest of the request line. */
+  HTTP_PARSE_HEADERS,   /* Waiting for the rest of the headers. */
+  HTTP_PARSE_DONE,      /* Have the whole head. */
+  HTTP_PARSE_ERROR,     /* Malformed, or longer than LIBHTTP_REQUEST_MAX_SIZE. */
+};
+
+struct http_span {
+  size_t off;
+  size_t len;
+};
+
+struct http_parser {
+  enum http_parse_state state;
+  size_t line_start;    /* Start of the line being parsed. */
+  size_t scan;          /* Bytes already searched for its end. */
+  size_t head_len;      /* Length of the head, once done. */
+  struct http_span method;
+  struct http_span path;
+  struct http_span version;
+  struct http_span headers[HTTP_HEADER_CNT];
+  unsigned headers_seen;    /* Bit (1 << id) for each header found. */
+  int keep_alive;
+  int response;         /* Parsing a response head: a status line first. */
+  int status;           /* Its status code. */
+};
+
+void http_parser_init(struct http_parser *parser);
+
+/* Like http_parser_init(), for the head of a response. Only VERSION and
+ * STATUS are set from its status line. */
+void http_parser_init_response(struct http_parser *parser);
+enum http_parse_state http_parser_feed(struct http_parser *parser,
+    const char *buffer, size_t len);
+
+/*
+ * Fills in REQUEST with pointers into BUFFER, null-terminating the method,
+ * path, and header values in place. Call once the parser is past the
+ * request line; REQUEST is good while BUFFER's head is left alone.
+ */
+void http_parser_get_request(const struct http_parser *parser, char *buffer,
+    struct http_request *request);
+
+/*
+ * Writes PATH, a request's path, to OUT in canonical form, in one pass:
+ * the query is dropped, %XX escapes are decoded, empty and "." segments
+ * are removed, and each ".." removes the segment before it, never going
+ * above "/". The result starts with "/" and has no trailing "/" unless it
+ * is just that, so it can't name anything outside the directory it's
+ * appended to. OUT needs room for strlen(PATH) + 2 bytes. Returns the
+ * length written, or -1 if PATH doesn't start with "/" or has a malformed
+ * or null escape.
+ */
+ssize_t http_normalize_path(const char *path, char *out);
+
+/*
+ * Reads the Content-Length of a finished head in BUFFER into *LENGTH.
+ * Returns 1 if it has a valid one, 0 if it has none, or -1 if it is
+ * malformed.
+ */
+int http_parser_content_length(const struct http_parser *parser,
+    const char *buffer, off_t *length);
+
+/*
+ * Returns whether the finished head in BUFFER has a chunked body: whether
+ * chunked is the last coding of its Transfer-Encoding.
+ */
+int http_parser_chunked(const struct http_parser *parser, const char *buffer);
+
+/*
+ * A resumable decoder for a chunked body, which strips the framing from
+ * its bytes as they arrive. Chunk extensions and trailers are dropped.
+ */
+enum http_dechunk_state {
+  HTTP_DECHUNK_SIZE,          /* In a chunk's size. */
+  HTTP_DECHUNK_SIZE_LINE,     /* In the rest of its line. */
+  HTTP_DECHUNK_DATA,          /* In its data. */
+  HTTP_DECHUNK_DATA_END,      /* In the line break after the data. */
+  HTTP_DECHUNK_TRAILER,       /* At the start of a trailer line. */
+  HTTP_DECHUNK_TRAILER_LINE,  /* In the rest of one. */
+  HTTP_DECHUNK_DONE,          /* Past the end of the body. */
+  HTTP_DECHUNK_ERROR,         /* Malformed. */
+};
+
+struct http_dechunker {
+  enum http_dechunk_state state;
+  off_t left;     /* The chunk's size so far, then its data still to come. */
+  int digits;
+};
+
+void http_dechunker_init(struct http_dechunker *dechunker);
+
+/*
+ * Decodes up to *LEN bytes at DATA, moving the body's bytes among them to
+ * its start. Returns how many there are, and sets *LEN to the bytes used,
+ * fewer only if the body ended among them. DECHUNKER->state is then
+ * HTTP_DECHUNK_DONE, or HTTP_DECHUNK_ERROR if the framing is malformed.
+ */
+size_t http_dechunk(struct http_dechunker *dechunker, char *data, size_t *len);
+
+/*
+ * Where a connection's bytes come from when not straight from its fd, as
+ * through a TLS session. READ is called like read(). PENDING returns
+ * whether READ has bytes at hand that poll() on the fd wouldn't show.
+ */
+struct http_conn_io {
+  ssize_t (*read)(void *aux, void *buf, size_t len);
+  int (*pending)(void *aux);
+  void *aux;
+};
+
+/*
+ * A connection that may carry several requests, one after another or
+ * pipelined. Bytes read past the end of one request are kept for the next.
+ */
+struct http_conn {
+  int fd;
+  const struct http_conn_io *io;    /* Or NULL to read FD. */
+  int malformed;    /* Set if the last request could not be parsed. */
+  size_t len;
+  size_t consumed;  /* Head of the request last returned. */
+  struct http_parser parser;
+  struct http_request request;
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE + 1];
+};
+
+/* Starts CONN on FD, read directly. Set CONN->io afterwards to read it
+ * some other way. */
+void http_conn_init(struct http_conn *conn, int fd);
+
+/*
+ * Reads the next request on CONN. Returns NULL if the client closes the
+ * connection, or sends nothing for TIMEOUT_MS milliseconds while no
+ * request is buffered, or takes http_header_timeout_ms to send all of one
+ * once it has begun, or sends a request that is too large or can't be
+ * parsed, in which case CONN->malformed is set. The request lives in CONN
+ * and is good until the next call.
+ */
+struct http_request *http_conn_read_request(struct http_conn *conn, int timeout_ms);
+
+/*
+ * Reads the next head on CONN, of a response if RESPONSE is set, leaving
+ * its bytes as they arrived, for relaying. Returns 1 once CONN->parser has
+ * it, 0 under the same conditions as http_conn_read_request() returns NULL
+ * for, or -1 if it is malformed, also setting CONN->malformed. Only a
+ * request's head is held to http_header_timeout_ms.
+ */
+int http_conn_read_head(struct http_conn *conn, int timeout_ms, int response);
 
 /*
  * Functions for sending an HTTP response.
  */
 void http_start_response(int fd, int status_code);
+
+/* The status of the last response this thread started, and the bytes it
+ * has sent through the functions below, for the access log. The caller
+ * zeroes HTTP_SENT_BYTES to count a response's. */
+extern __thread int http_sent_status;
+extern __thread long long http_sent_bytes;
 void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
 void http_send_data(int fd, char *data, size_t size);
 
 /*
- * Helper function: gets the Content-Type based on a file name.
+ * Sends SIZE bytes of the file open as FILE_FD, from its start, without
+ * copying them through user memory.
+ */
+void http_send_file(int fd, int file_fd, size_t size);
+
+/* Like http_send_file(), but starts OFFSET bytes into the file. */
+void http_send_file_range(int fd, int file_fd, off_t offset, size_t size);
+
+/* Writes the CNT buffers in IOV to FD, resuming after partial writes. IOV
+ * is updated as it goes. Returns 0, or -1 if FD failed. */
+int http_writev_all(int fd, struct iovec *iov, int cnt);
+
+/*
+ * Functions for sending an HTTP response whose status line and headers
+ * are gathered in memory and sent along with the body, instead of with a
+ * write per line. Headers that overflow the buffer are sent early.
+ */
+struct http_response {
+  int fd;
+  size_t len;
+  char buffer[LIBHTTP_RESPONSE_HEADER_MAX];
+};
+
+void http_response_begin(struct http_response *response, int fd, int status_code);
+void http_response_header(struct http_response *response, char *key, char *value);
+
+/* Ends the headers and sends them with the SIZE bytes of BODY, in one
+ * writev() when possible. */
+void http_response_flush(struct http_response *response, char *body, size_t size);
+
+/* Ends the headers and sends them, then SIZE bytes of the file open as
+ * FILE_FD from OFFSET on, coalescing the headers with the start of the
+ * file. */
+void http_response_flush_file(struct http_response *response, int file_fd,
+    off_t offset, size_t size);
+
+/*
+ * Functions for sending a body of unknown length in chunks, which lets
+ * the connection carry another response after it, where otherwise only
+ * closing it could end the body:
+ *
+ *     http_response_header(&response, "Transfer-Encoding", "chunked");
+ *     http_response_flush(&response, NULL, 0);
+ *     http_chunked_init(&chunked, fd);
+ *     http_chunked_write(&chunked, data, size);     // as often as needed
+ *     http_chunked_end(&chunked);
+ *
+ * Small writes are gathered into chunks of up to HTTP_CHUNK_BUFFER_SIZE
+ * bytes; larger ones go out as chunks of their own.
+ */
+#define HTTP_CHUNK_BUFFER_SIZE 16384
+
+struct http_chunked {
+  int fd;
+  int failed;
+  size_t len;
+  char buffer[HTTP_CHUNK_BUFFER_SIZE];
+};
+
+void http_chunked_init(struct http_chunked *chunked, int fd);
+void http_chunked_write(struct http_chunked *chunked, const char *data, size_t size);
+
+/* Sends what has been gathered as a chunk now, as before waiting on more
+ * of the body. */
+void http_chunked_flush(struct http_chunked *chunked);
+
+/* Sends what has been gathered and the last, empty chunk. Returns 0, or
+ * -1 if writing to the fd failed along the way. */
+int http_chunked_end(struct http_chunked *chunked);
+
+/*
+ * Helper function: gets the reason phrase for a status code.
+ */
+char *http_get_response_message(int status_code);
+
+/*
+ * Helper function: gets the Content-Type based on a file name's extension,
+ * any case, from the types loaded with http_mime_types_load() and then
+ * from a built-in list. Unknown ones are text/plain.
  */
 char *http_get_mime_type(char *file_name);
 
+/* Longest extension looked up. */
+#define HTTP_MIME_EXTENSION_MAX 16
+
+/*
+ * Adds the types listed in the mime.types file PATH, as lines of a type
+ * and its extensions, over the built-in ones. Returns how many extensions
+ * were read, or -1 if PATH can't be opened. Call before any thread looks
+ * up a type.
+ */
+int http_mime_types_load(const char *path);
+
+/*
+ * Functions for content codings. A file of a compressible type may have
+ * compressed siblings, FILE.br and FILE.gz, sent in its place to clients
+ * that accept them.
+ */
+enum http_encoding {
+  HTTP_ENCODING_IDENTITY,
+  HTTP_ENCODING_GZIP,
+  HTTP_ENCODING_BR,
+  HTTP_ENCODING_CNT
+};
+
+/* Returns a bit (1 << coding) for each content coding REQUEST's
+ * Accept-Encoding allows. Identity is always allowed, and is the only one
+ * for range requests, so that byte offsets mean the same to every client. */
+unsigned http_request_encodings(const struct http_request *request);
+
+/* Returns the Content-Encoding name for ENCODING, or NULL for identity. */
+const char *http_encoding_name(enum http_encoding encoding);
+
+/* Returns the file name suffix of siblings in ENCODING. */
+const char *http_encoding_suffix(enum http_encoding encoding);
+
+/* Returns true if files of CONTENT_TYPE are worth compressing. */
+int http_mime_type_is_compressible(const char *content_type);
+
+/*
+ * Finds the sibling of PATH, a file of CONTENT_TYPE, to send a client
+ * accepting ENCODINGS, preferring brotli. If there is one, stores its name
+ * in ENCODED_PATH, which must have room for strlen(PATH) + 4 bytes, and
+ * its status in SB, and returns its coding; otherwise returns identity.
+ * Sets *MISSING to the codings whose siblings were looked for and absent.
+ */
+enum http_encoding http_find_encoded_sibling(const char *path, const char *content_type,
+    unsigned encodings, char *encoded_path, struct stat *sb, unsigned *missing);
+
+/*
+ * Functions for conditional requests. A file's ETag is made from its inode,
+ * size, and modification time, so it changes whenever the file does.
+ */
+
+/* Room for an ETag or an HTTP date, with the terminator. */
+#define HTTP_ETAG_MAX 64
+#define HTTP_DATE_MAX 32
+
+void http_format_etag(char *etag, const struct stat *sb);
+void http_format_date(char *date, time_t time);
+
+/*
+ * Returns true if REQUEST's If-None-Match, or failing that its
+ * If-Modified-Since, shows the client already has the version of a file
+ * with ETAG, last modified at MTIME, so a 304 Not Modified will do.
+ */
+int http_request_not_modified(const struct http_request *request,
+    const char *etag, time_t mtime);
+
+/*
+ * Cache-Control values by path prefix. The value for the longest prefix of
+ * a request path is sent with files under it.
+ */
+void http_cache_control_add(const char *prefix, const char *value);
+
+/* Returns the Cache-Control value for PATH, or NULL if there is none. */
+const char *http_cache_control_lookup(const char *path);
+
+/*
+ * Functions for range requests. A 206 response to a request for one range
+ * carries just that range; one for several is a multipart/byteranges body
+ * with a part per range.
+ */
+
+/* Most ranges honored in one request. A request for more gets the whole
+ * file, which spares us answering with more part headers than data. */
+#define HTTP_RANGE_MAX 16
+
+/* Separates the parts of a multipart/byteranges body. */
+#define HTTP_RANGE_BOUNDARY "httpserver-byteranges-3d6b7a1f"
+
+/* Room for a part's header, with the terminator. */
+#define HTTP_RANGE_PART_MAX 256
+
+/* The bytes [start, start + length) of a file. */
+struct http_range {
+  off_t start;
+  off_t length;
+};
+
+/*
+ * Finds the ranges of a SIZE-byte file with ETAG, last modified at MTIME,
+ * that REQUEST asks for, and stores them in RANGES, which has room for
+ * HTTP_RANGE_MAX. Returns how many there are; 0 if the whole file should
+ * be sent, because REQUEST has no usable Range header or its If-Range
+ * names some other version; or -1 if none of the ranges is in the file,
+ * which calls for a 416.
+ */
+int http_request_ranges(const struct http_request *request, const char *etag,
+    time_t mtime, off_t size, struct http_range *ranges);
+
+/* Formats the header that starts the part of a multipart/byteranges body
+ * for RANGE, of a SIZE-byte file of CONTENT_TYPE, into PART. Returns its
+ * length. */
+int http_format_range_part(char *part, const char *content_type,
+    const struct http_range *range, off_t size);
+
+/* The end of a multipart/byteranges body. */
+#define HTTP_RANGE_END "\r\n--" HTTP_RANGE_BOUNDARY "--\r\n"
+
+/* Returns the length of the multipart/byteranges body for the CNT RANGES
+ * of a SIZE-byte file of CONTENT_TYPE. */
+off_t http_range_multipart_length(const char *content_type,
+    const struct http_range *ranges, int cnt, off_t size);
+
 #endif
@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fdcache.h"
+#include "pathcache.h"
+#include "utlist.h"
+
+struct path_cache_entry {
+  char *path;
+  enum path_target target;
+  long made_ms;         /* When PATH was last probed. */
+  struct path_cache_entry *hash_next;
+  struct path_cache_entry *prev;    /* Neighbors in least recently used order. */
+  struct path_cache_entry *next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct path_cache_entry *buckets[PATH_CACHE_BUCKETS];
+static struct path_cache_entry *lru;    /* Least recently used first. */
+static int used;
+
+/* Returns the time in milliseconds on a clock that only moves forward. */
+static long cache_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static unsigned hash_path(const char *path) {
+  /* djb2 */
+  unsigned hash = 5381;
+  while (*path) hash = hash * 33 + (unsigned char) *path++;
+  return hash % PATH_CACHE_BUCKETS;
+}
+
+/* Returns the entry for PATH, or NULL. Must hold cache_lock. */
+static struct path_cache_entry *entry_find(const char *path) {
+  struct path_cache_entry *entry = buckets[hash_path(path)];
+  while (entry && strcmp(entry->path, path) != 0) entry = entry->hash_next;
+  return entry;
+}
+
+/* Takes ENTRY out of the cache and frees it. Must hold cache_lock. */
+static void entry_remove(struct path_cache_entry *entry) {
+  struct path_cache_entry **link = &buckets[hash_path(entry->path)];
+  while (*link != entry) link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  DL_DELETE(lru, entry);
+  used--;
+  free(entry->path);
+  free(entry);
+}
+
+/* Returns what PATH resolved to when last probed, or PATH_NONE if it isn't
+ * cached or is due to be probed again. */
+static enum path_target cache_lookup(const char *path, long now) {
+  enum path_target target = PATH_NONE;
+  pthread_mutex_lock(&cache_lock);
+  struct path_cache_entry *entry = entry_find(path);
+  if (entry && now - entry->made_ms < PATH_CACHE_VALID_MS) {
+    DL_DELETE(lru, entry);
+    DL_APPEND(lru, entry);
+    target = entry->target;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return target;
+}
+
+/* Records that PATH resolved to TARGET at NOW, or forgets PATH if TARGET is
+ * PATH_NONE. */
+static void cache_store(const char *path, enum path_target target, long now) {
+  pthread_mutex_lock(&cache_lock);
+  struct path_cache_entry *entry = entry_find(path);
+  if (target == PATH_NONE) {
+    if (entry) entry_remove(entry);
+  } else if (entry) {
+    entry->target = target;
+    entry->made_ms = now;
+    DL_DELETE(lru, entry);
+    DL_APPEND(lru, entry);
+  } else if ((entry = calloc(1, sizeof(struct path_cache_entry)))
+      && (entry->path = strdup(path))) {
+    while (lru && used >= PATH_CACHE_SIZE) entry_remove(lru);
+    entry->target = target;
+    entry->made_ms = now;
+    unsigned bucket = hash_path(path);
+    entry->hash_next = buckets[bucket];
+    buckets[bucket] = entry;
+    DL_APPEND(lru, entry);
+    used++;
+  } else {
+    free(entry);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* Returns whether FILE_PATH still resolves to TARGET, filling in SB with
+ * the status of what is served and appending "/index.html" for an index. */
+static bool target_matches(char *file_path, enum path_target target, struct stat *sb) {
+  size_t len = strlen(file_path);
+  if (target == PATH_INDEX) strcpy(file_path + len, "/index.html");
+  if (fd_cache_stat(file_path, sb) == 0 && (target == PATH_DIRECTORY
+        ? S_ISDIR(sb->st_mode) : S_ISREG(sb->st_mode)))
+    return true;
+  file_path[len] = '\0';
+  return false;
+}
+
+/* Resolves FILE_PATH by looking at it, and if it's a directory, for its
+ * index.html. */
+static enum path_target probe(char *file_path, struct stat *sb) {
+  if (fd_cache_stat(file_path, sb) == -1) return PATH_NONE;
+  if (S_ISREG(sb->st_mode)) return PATH_FILE;
+  if (!S_ISDIR(sb->st_mode)) return PATH_NONE;
+
+  size_t len = strlen(file_path);
+  struct stat index_sb;
+  strcpy(file_path + len, "/index.html");
+  if (fd_cache_stat(file_path, &index_sb) == 0 && S_ISREG(index_sb.st_mode)) {
+    *sb = index_sb;
+    return PATH_INDEX;
+  }
+  file_path[len] = '\0';
+  return PATH_DIRECTORY;
+}
+
+enum path_target path_cache_resolve(char *file_path, struct stat *sb) {
+  long now = cache_now_ms();
+  enum path_target cached = cache_lookup(file_path, now);
+  if (cached != PATH_NONE && target_matches(file_path, cached, sb)) return cached;
+
+  enum path_target target = probe(file_path, sb);
+  if (target != PATH_NONE || cached != PATH_NONE) {
+    /* Keyed by the path as asked, without any index.html. */
+    size_t len = strlen(file_path);
+    if (target == PATH_INDEX) file_path[len - strlen("/index.html")] = '\0';
+    cache_store(file_path, target, now);
+    if (target == PATH_INDEX) file_path[len - strlen("/index.html")] = '/';
+  }
+  return target;
+}
@@ -0,0 +1,43 @@
+#ifndef __PATHCACHE__
+#define __PATHCACHE__
+
+#include <sys/stat.h>
+
+/* The path cache remembers what each recently requested path under the
+ * files directory turned out to be: a file, a directory with an
+ * index.html, or a directory to list. A directory request then costs one
+ * stat() of what is served, not a stat() of the directory and another
+ * probing for its index.html. Paths are expected in the canonical form
+ * http_normalize_path() makes, so each has one entry.
+ *
+ * An entry is trusted for PATH_CACHE_VALID_MS after it was made; the
+ * first lookup after that probes the path afresh. What is served is still
+ * stat()ed every time (through the fd cache), and an entry it no longer
+ * matches is dropped, so a removed file or index.html is noticed at once;
+ * a new index.html may go unnoticed for up to that long. Only paths that
+ * resolved to something are kept, in least recently used order, up to
+ * PATH_CACHE_SIZE of them. */
+
+/* How long an entry is used without probing its path afresh, in ms. */
+#define PATH_CACHE_VALID_MS 1000
+
+/* Most entries kept. */
+#define PATH_CACHE_SIZE 1024
+
+/* Number of hash chains. */
+#define PATH_CACHE_BUCKETS 1024
+
+/* What a path resolved to. */
+enum path_target {
+  PATH_NONE = -1,       /* Nothing that can be served. */
+  PATH_FILE,            /* A regular file. */
+  PATH_INDEX,           /* A directory's index.html. */
+  PATH_DIRECTORY,       /* A directory without one, to be listed. */
+};
+
+/* Resolves FILE_PATH, appending "/index.html" to it if that's what is
+ * served, so FILE_PATH needs room for that. Fills in SB with the status of
+ * what is served. */
+enum path_target path_cache_resolve(char *file_path, struct stat *sb);
+
+#endif
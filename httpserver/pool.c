@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "affinity.h"
+#include "pool.h"
+
+static long pool_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static bool pool_adaptive(const struct pool *pool) {
+  return pool->max_workers > pool->min_workers;
+}
+
+static void *pool_worker(void *arg);
+
+/* Starts one of POOL's workers, already counted in its workers. Returns
+ * false if the thread can't be made. */
+static bool pool_spawn(struct pool *pool) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, pool_worker, pool) != 0) return false;
+  pthread_detach(thread);
+  return true;
+}
+
+/* Starts another of POOL's workers, unless it is at its maximum or one
+ * was started less than POOL_GROW_INTERVAL_MS ago. */
+static void pool_grow(struct pool *pool) {
+  long now = pool_now_ms();
+  long grown = __atomic_load_n(&pool->grown_ms, __ATOMIC_RELAXED);
+  if (now - grown < POOL_GROW_INTERVAL_MS
+      || !__atomic_compare_exchange_n(&pool->grown_ms, &grown, now, false,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return;
+
+  int workers = __atomic_load_n(&pool->workers, __ATOMIC_RELAXED);
+  do {
+    if (workers >= pool->max_workers) return;
+  } while (!__atomic_compare_exchange_n(&pool->workers, &workers, workers + 1, true,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  if (!pool_spawn(pool)) __atomic_sub_fetch(&pool->workers, 1, __ATOMIC_RELAXED);
+}
+
+/* Takes one of POOL's running workers away, unless that would leave fewer
+ * than its minimum. Returns whether it did. */
+static bool pool_retire(struct pool *pool) {
+  int workers = __atomic_load_n(&pool->workers, __ATOMIC_RELAXED);
+  do {
+    if (workers <= pool->min_workers) return false;
+  } while (!__atomic_compare_exchange_n(&pool->workers, &workers, workers - 1, true,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return true;
+}
+
+/* Serves sockets from POOL's queue until the worker is retired. */
+static void *pool_worker(void *arg) {
+  struct pool *pool = arg;
+  int index = __atomic_fetch_add(&pool->started, 1, __ATOMIC_RELAXED);
+  affinity_pin(affinity_cpu(index));
+  bool adaptive = pool_adaptive(pool);
+  while (1) {
+    long waited_ms;
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+    int fd = wq_pop_timed(pool->queue, &waited_ms, adaptive ? POOL_IDLE_MS : -1);
+    __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+    if (fd < 0) {
+      if (pool_retire(pool)) return NULL;
+      continue;
+    }
+    if (adaptive && waited_ms >= POOL_GROW_WAIT_MS) pool_grow(pool);
+    pool->serve(pool->queue, fd, waited_ms);
+  }
+}
+
+void pool_start(struct pool *pool, wq_t *queue, int min_workers, int max_workers,
+    void (*serve)(wq_t *queue, int fd, long waited_ms)) {
+  pool->queue = queue;
+  pool->min_workers = min_workers;
+  pool->max_workers = max_workers > min_workers ? max_workers : min_workers;
+  pool->workers = min_workers;
+  pool->idle = 0;
+  pool->started = 0;
+  pool->grown_ms = 0;
+  pool->serve = serve;
+  for (int i = 0; i < min_workers; i++) {
+    if (!pool_spawn(pool)) {
+      perror("Failed to start worker thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+int pool_push(struct pool *pool, int fd) {
+  if (!wq_push(pool->queue, fd)) return 0;
+  /* Every worker is busy and more sockets are queued than they'll get to
+   * soon. */
+  if (pool_adaptive(pool) && __atomic_load_n(&pool->idle, __ATOMIC_RELAXED) == 0
+      && wq_depth(pool->queue) > __atomic_load_n(&pool->workers, __ATOMIC_RELAXED))
+    pool_grow(pool);
+  return 1;
+}
+
+int pool_workers(struct pool *pool) {
+  return __atomic_load_n(&pool->workers, __ATOMIC_RELAXED);
+}
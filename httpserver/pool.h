@@ -0,0 +1,53 @@
+#ifndef __POOL__
+#define __POOL__
+
+#include <stdbool.h>
+
+#include "wq.h"
+
+/* A pool of worker threads serving the sockets pushed onto its work queue.
+ *
+ * A fixed pool runs the same number of workers forever. An adaptive one
+ * sizes itself between a minimum and a maximum: it starts a worker when a
+ * socket waited POOL_GROW_WAIT_MS or more in the queue before a worker
+ * took it, or when one is pushed while no worker is waiting and the queue
+ * holds more sockets than there are workers, so handlers that block on a
+ * slow upstream don't leave the queue to back up. Growth is paced to one
+ * worker every POOL_GROW_INTERVAL_MS, so a burst doesn't start them all
+ * before the first few have had a chance to catch up. A worker that waits
+ * POOL_IDLE_MS for a socket exits if the pool is above its minimum, so a
+ * pool serving cheap requests shrinks back to fewer threads than it would
+ * switch between.
+ *
+ * None of this takes a lock: the counts are kept with atomics, and the
+ * queue is the lock-free one in wq.h. */
+
+#define POOL_GROW_WAIT_MS 10
+#define POOL_GROW_INTERVAL_MS 5
+#define POOL_IDLE_MS 10000
+
+struct pool {
+  wq_t *queue;
+  int min_workers;
+  int max_workers;
+  int workers;            /* Running. */
+  int idle;               /* Waiting on the queue for a socket. */
+  int started;            /* Ever started, which numbers the next for affinity. */
+  long grown_ms;          /* When the last worker was started. */
+  void (*serve)(wq_t *queue, int fd, long waited_ms);
+};
+
+/* Starts POOL serving QUEUE with MIN_WORKERS workers, adaptive up to
+ * MAX_WORKERS if that's more. Each socket popped is passed to SERVE with
+ * how long it was queued; SERVE must close it. */
+void pool_start(struct pool *pool, wq_t *queue, int min_workers, int max_workers,
+    void (*serve)(wq_t *queue, int fd, long waited_ms));
+
+/* Pushes FD onto POOL's queue, starting another worker if it looks to be
+ * needed. Returns 1, or 0 without waiting if the queue is full. */
+int pool_push(struct pool *pool, int fd);
+
+/* Returns how many workers POOL is running. */
+int pool_workers(struct pool *pool);
+
+#endif
@@ -0,0 +1,1175 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "libhttp.h"
+#include "proxy.h"
+#include "proxycache.h"
+#include "reload.h"
+#include "stats.h"
+#include "tcptune.h"
+
+/* Bytes a relay direction holds in its pipe at most. */
+#define RELAY_PIPE_SIZE 65536
+
+/* Capacity asked of each pipe. A pipe holds a fixed number of pages, and
+ * each piece spliced in from a socket takes one however small, so give it
+ * enough that it isn't full before RELAY_PIPE_SIZE bytes are. */
+#define RELAY_PIPE_CAPACITY (16 * RELAY_PIPE_SIZE)
+
+/* Sent upstream in place of the client's Connection header. */
+#define PROXY_KEEP_ALIVE_HEADER "Connection: keep-alive\r\n"
+
+/* Sent to the client in place of a reframed response's framing headers,
+ * by whether it takes a chunked body. */
+#define PROXY_CHUNKED_HEADER "Transfer-Encoding: chunked\r\n"
+#define PROXY_CLOSE_HEADER "Connection: close\r\n"
+
+/* Room for what a head passed on may grow by. */
+#define PROXY_HEAD_EXTRA 64
+
+/* How a backend listening on a Unix domain socket is named. */
+#define PROXY_UNIX_PREFIX "unix:"
+
+/* A server requests are forwarded to. */
+struct proxy_backend {
+  char *hostname;
+  int port;
+  char *unix_path;            /* Or NULL for a TCP backend. */
+  char *name;                 /* HOSTNAME:PORT, or unix:UNIX_PATH. */
+
+  pthread_mutex_t lock;       /* Guards everything below. */
+  struct sockaddr_in address;
+  long resolved_ms;           /* When ADDRESS was looked up. */
+  int down;                   /* Last connect to it failed. */
+  int active;                 /* Sessions using it now. */
+
+  /* Idle connections, most recently used last. */
+  struct {
+    int fd;
+    long idle_since_ms;
+  } pool[PROXY_POOL_MAX];
+  int pool_cnt;
+};
+
+static struct proxy_backend *proxy_backends;
+static int proxy_backend_cnt;
+static enum proxy_balance proxy_balance;
+static unsigned proxy_next;     /* Where round robin goes next. */
+
+/* The hash ring: PROXY_RING_POINTS points per backend, sorted by hash. */
+struct proxy_ring_point {
+  uint32_t hash;
+  int backend;
+};
+static struct proxy_ring_point *proxy_ring;
+static int proxy_ring_cnt;
+
+/* One client's connection and the upstream connection serving it. */
+struct proxy_session {
+  struct http_conn client;
+  struct http_conn upstream;
+  struct proxy_backend *backend;  /* UPSTREAM's, or NULL with no upstream. */
+  int upstream_used;      /* UPSTREAM has answered a request before. */
+  int pipe[2];
+  char head[LIBHTTP_REQUEST_MAX_SIZE + PROXY_HEAD_EXTRA];
+  struct http_chunked chunked;    /* A reframed response's body. */
+  int cache_fill;         /* The request is fetching CACHE_KEY for the cache. */
+  char cache_key[LIBHTTP_REQUEST_MAX_SIZE + PROXY_CACHE_KEY_EXTRA];
+};
+
+/* What is left of a session after a request. */
+enum proxy_result {
+  PROXY_NEXT,           /* Both connections can carry another request. */
+  PROXY_CLIENT_DONE,    /* The client is done; the upstream can be reused. */
+  PROXY_UPSTREAM_DONE,  /* The client can go on; the upstream can't be reused. */
+  PROXY_CLOSE,          /* Neither connection can be used again. */
+  PROXY_RETRY,          /* The upstream closed before answering. */
+};
+
+static long proxy_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* 32-bit FNV-1a of the LEN bytes at DATA, with MurmurHash3's finalizer
+ * on top: FNV alone leaves names that differ in their last few bytes,
+ * like the ring's, bunched together. */
+static uint32_t proxy_hash(const char *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 16777619u;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/* Looks up BACKEND's address into *ADDRESS. Returns 0 on success. */
+static int proxy_resolve(const struct proxy_backend *backend,
+    struct sockaddr_in *address) {
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(backend->hostname, NULL, &hints, &result) != 0) return -1;
+  memcpy(address, result->ai_addr, sizeof(*address));
+  address->sin_port = htons(backend->port);
+  freeaddrinfo(result);
+  return 0;
+}
+
+/* Returns BACKEND's address, looking it up again if it's older than
+ * PROXY_DNS_TTL_S. If that fails the old address is kept. */
+static struct sockaddr_in proxy_backend_address(struct proxy_backend *backend) {
+  long now = proxy_now_ms();
+  pthread_mutex_lock(&backend->lock);
+  if (now - backend->resolved_ms >= PROXY_DNS_TTL_S * 1000L) {
+    /* Other threads go on with the old address while this one looks. */
+    backend->resolved_ms = now;
+    pthread_mutex_unlock(&backend->lock);
+    struct sockaddr_in address;
+    int failed = proxy_resolve(backend, &address);
+    pthread_mutex_lock(&backend->lock);
+    if (!failed) backend->address = address;
+  }
+  struct sockaddr_in address = backend->address;
+  pthread_mutex_unlock(&backend->lock);
+  return address;
+}
+
+/* Closes BACKEND's idle connections. Call with its lock held. */
+static void proxy_pool_clear(struct proxy_backend *backend) {
+  for (int i = 0; i < backend->pool_cnt; i++) close(backend->pool[i].fd);
+  backend->pool_cnt = 0;
+}
+
+/* Marks BACKEND up or down. */
+static void proxy_backend_mark(struct proxy_backend *backend, int down) {
+  pthread_mutex_lock(&backend->lock);
+  if (down && !backend->down)
+    fprintf(stderr, "Backend %s is down\n", backend->name);
+  else if (!down && backend->down)
+    fprintf(stderr, "Backend %s is up\n", backend->name);
+  backend->down = down;
+  if (down) proxy_pool_clear(backend);
+  pthread_mutex_unlock(&backend->lock);
+}
+
+/* Sets how long a blocking send on FD may wait, in ms, or forever if MS is
+ * 0. */
+static void proxy_set_send_timeout(int fd, int ms) {
+  struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* proxy_connect() for BACKEND on a Unix domain socket. Such a connect()
+ * is done at once unless the backend's backlog is full, and then can't be
+ * waited on with poll(), so it blocks instead, as long as a TCP one may
+ * be waited on. No TCP options apply. */
+static int proxy_connect_unix(struct proxy_backend *backend) {
+  int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  strcpy(address.sun_path, backend->unix_path);
+  proxy_set_send_timeout(fd, PROXY_CONNECT_TIMEOUT_MS);
+  int failed;
+  while ((failed = connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0)
+      && errno == EINTR)
+    continue;
+  proxy_backend_mark(backend, failed);
+  if (failed) {
+    close(fd);
+    return -1;
+  }
+  proxy_set_send_timeout(fd, 0);
+  return fd;
+}
+
+/* Opens a new connection to BACKEND, giving up after
+ * PROXY_CONNECT_TIMEOUT_MS, and marks the backend up or down by whether
+ * that worked. Returns the blocking socket, or -1. */
+static int proxy_connect(struct proxy_backend *backend) {
+  if (backend->unix_path) return proxy_connect_unix(backend);
+  struct sockaddr_in address = proxy_backend_address(backend);
+  int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+
+  int error = 0;
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    error = errno;
+    if (error == EINPROGRESS) {
+      struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+      socklen_t len = sizeof(error);
+      int ready;
+      while ((ready = poll(&pfd, 1, PROXY_CONNECT_TIMEOUT_MS)) < 0 && errno == EINTR)
+        continue;
+      if (ready <= 0)
+        error = ETIMEDOUT;
+      else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+    }
+  }
+  proxy_backend_mark(backend, error != 0);
+  if (error != 0) {
+    close(fd);
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  tcp_tune_upstream(fd);
+  return fd;
+}
+
+/* Connects to every backend in turn, forever, to find which are up. */
+static void *proxy_health_check(void *aux) {
+  while (1) {
+    usleep(PROXY_HEALTH_INTERVAL_MS * 1000);
+    for (int i = 0; i < proxy_backend_cnt; i++) {
+      int fd = proxy_connect(&proxy_backends[i]);
+      if (fd != -1) close(fd);
+    }
+  }
+  return NULL;
+}
+
+static int proxy_ring_compare(const void *a, const void *b) {
+  uint32_t x = ((const struct proxy_ring_point *) a)->hash;
+  uint32_t y = ((const struct proxy_ring_point *) b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+void proxy_add_backend(const char *hostname, int port) {
+  proxy_backends = realloc(proxy_backends,
+      (proxy_backend_cnt + 1) * sizeof(struct proxy_backend));
+  if (!proxy_backends) {
+    perror("realloc");
+    exit(ENOMEM);
+  }
+  struct proxy_backend *backend = &proxy_backends[proxy_backend_cnt++];
+  memset(backend, 0, sizeof(*backend));
+  backend->hostname = strdup(hostname);
+  backend->port = port;
+  if (strncmp(hostname, PROXY_UNIX_PREFIX, strlen(PROXY_UNIX_PREFIX)) == 0) {
+    backend->unix_path = backend->hostname + strlen(PROXY_UNIX_PREFIX);
+    if (backend->unix_path[0] == '\0'
+        || strlen(backend->unix_path) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+      fprintf(stderr, "Bad Unix domain socket path: %s\n", backend->unix_path);
+      exit(EINVAL);
+    }
+    backend->name = backend->hostname;
+  } else if (asprintf(&backend->name, "%s:%d", hostname, port) == -1) {
+    perror("asprintf");
+    exit(ENOMEM);
+  }
+  pthread_mutex_init(&backend->lock, NULL);
+}
+
+void proxy_init(enum proxy_balance balance) {
+  proxy_balance = balance;
+  for (int i = 0; i < proxy_backend_cnt; i++) {
+    struct proxy_backend *backend = &proxy_backends[i];
+    if (backend->unix_path) continue;
+    if (proxy_resolve(backend, &backend->address) != 0) {
+      fprintf(stderr, "Cannot find host: %s\n", backend->hostname);
+      exit(ENXIO);
+    }
+    backend->resolved_ms = proxy_now_ms();
+  }
+
+  if (balance == PROXY_HASH) {
+    proxy_ring_cnt = proxy_backend_cnt * PROXY_RING_POINTS;
+    proxy_ring = malloc(proxy_ring_cnt * sizeof(struct proxy_ring_point));
+    if (!proxy_ring) {
+      perror("malloc");
+      exit(ENOMEM);
+    }
+    for (int i = 0; i < proxy_ring_cnt; i++) {
+      struct proxy_backend *backend = &proxy_backends[i / PROXY_RING_POINTS];
+      char name[256];
+      int len = snprintf(name, sizeof(name), "%s#%d", backend->name,
+          i % PROXY_RING_POINTS);
+      proxy_ring[i].hash = proxy_hash(name, len < (int) sizeof(name) ? len : sizeof(name) - 1);
+      proxy_ring[i].backend = i / PROXY_RING_POINTS;
+    }
+    qsort(proxy_ring, proxy_ring_cnt, sizeof(struct proxy_ring_point), proxy_ring_compare);
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, proxy_health_check, NULL) == 0)
+    pthread_detach(thread);
+}
+
+/* Returns whether BACKEND is down, reading the flag under its lock. */
+static int proxy_backend_down(struct proxy_backend *backend) {
+  pthread_mutex_lock(&backend->lock);
+  int down = backend->down;
+  pthread_mutex_unlock(&backend->lock);
+  return down;
+}
+
+/* Picks the backend for a request for the LEN-byte PATH, passing over
+ * those that are down, unless all are. */
+static struct proxy_backend *proxy_choose(const char *path, size_t len) {
+  int cnt = proxy_backend_cnt;
+  if (cnt == 1) return &proxy_backends[0];
+
+  if (proxy_balance == PROXY_HASH) {
+    /* The first point at or after the path's hash, wrapping around. */
+    uint32_t hash = proxy_hash(path, len);
+    int lo = 0, hi = proxy_ring_cnt;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (proxy_ring[mid].hash < hash) lo = mid + 1;
+      else hi = mid;
+    }
+    for (int i = 0; i < proxy_ring_cnt; i++) {
+      struct proxy_backend *backend =
+          &proxy_backends[proxy_ring[(lo + i) % proxy_ring_cnt].backend];
+      if (!proxy_backend_down(backend)) return backend;
+    }
+    return &proxy_backends[proxy_ring[lo % proxy_ring_cnt].backend];
+  }
+
+  unsigned start = __sync_fetch_and_add(&proxy_next, 1);
+  struct proxy_backend *best = NULL;
+  int best_active = 0;
+  for (int i = 0; i < cnt; i++) {
+    struct proxy_backend *backend = &proxy_backends[(start + i) % cnt];
+    pthread_mutex_lock(&backend->lock);
+    int down = backend->down, active = backend->active;
+    pthread_mutex_unlock(&backend->lock);
+    if (down) continue;
+    if (proxy_balance == PROXY_ROUND_ROBIN) return backend;
+    if (!best || active < best_active) {
+      best = backend;
+      best_active = active;
+    }
+  }
+  return best ? best : &proxy_backends[start % cnt];
+}
+
+/* Takes the most recently idled connection from BACKEND's pool that is
+ * still open, or returns -1 if there is none. A pooled connection with
+ * anything to read has been closed by the backend, or sent something
+ * unasked. */
+static int proxy_pool_take(struct proxy_backend *backend) {
+  long now = proxy_now_ms();
+  int fd = -1;
+  pthread_mutex_lock(&backend->lock);
+  while (fd == -1 && backend->pool_cnt > 0) {
+    backend->pool_cnt--;
+    int candidate = backend->pool[backend->pool_cnt].fd;
+    struct pollfd pfd = { .fd = candidate, .events = POLLIN };
+    if (now - backend->pool[backend->pool_cnt].idle_since_ms < PROXY_POOL_IDLE_MS
+        && poll(&pfd, 1, 0) == 0)
+      fd = candidate;
+    else
+      close(candidate);
+  }
+  pthread_mutex_unlock(&backend->lock);
+  return fd;
+}
+
+/* Puts connection FD in BACKEND's pool, dropping the longest idle one if
+ * it is full. */
+static void proxy_pool_put(struct proxy_backend *backend, int fd) {
+  int dropped = -1;
+  pthread_mutex_lock(&backend->lock);
+  if (backend->pool_cnt == PROXY_POOL_MAX) {
+    dropped = backend->pool[0].fd;
+    memmove(backend->pool, backend->pool + 1,
+        (PROXY_POOL_MAX - 1) * sizeof(backend->pool[0]));
+    backend->pool_cnt--;
+  }
+  backend->pool[backend->pool_cnt].fd = fd;
+  backend->pool[backend->pool_cnt].idle_since_ms = proxy_now_ms();
+  backend->pool_cnt++;
+  pthread_mutex_unlock(&backend->lock);
+  if (dropped != -1) close(dropped);
+}
+
+/* Sends LEN bytes of BUF to socket FD with FLAGS. Returns 0, or -1 if FD
+ * failed. */
+static int proxy_send_all(int fd, const char *buf, size_t len, int flags) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, flags);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Writes LEN bytes of BUF to FD. Returns 0, or -1 if FD failed. */
+static int proxy_write_all(int fd, const char *buf, size_t len) {
+  return proxy_send_all(fd, buf, len, 0);
+}
+
+/* Reads LEN bytes from FD into BUF. Returns 0, or -1 if FD failed or
+ * closed first. */
+static int proxy_read_all(int fd, char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Reads the LENGTH-byte body of the response whose head is at the start
+ * of UPSTREAM into a new allocation. Returns it, or NULL if memory ran out
+ * or UPSTREAM failed, and says in *FAILED which. */
+static char *proxy_read_body(struct http_conn *upstream, off_t length, int *failed) {
+  const struct http_parser *response = &upstream->parser;
+  size_t buffered = upstream->len - response->head_len;
+  if ((off_t) buffered > length) buffered = length;
+  *failed = 0;
+  char *body = malloc(length + 1);
+  if (!body) return NULL;
+  memcpy(body, upstream->buffer + response->head_len, buffered);
+  if (proxy_read_all(upstream->fd, body + buffered, length - buffered) == -1) {
+    *failed = 1;
+    free(body);
+    return NULL;
+  }
+  upstream->consumed = response->head_len + buffered;
+  return body;
+}
+
+/* Moves SIZE bytes from IN to OUT through the empty pipe PIPEFD, or if
+ * SIZE is negative, everything IN sends until it closes. Returns 0, or -1
+ * if a socket failed or IN closed early. */
+static int proxy_splice(int in, int out, int pipefd[2], off_t size) {
+  while (size != 0) {
+    size_t want = size < 0 || size > RELAY_PIPE_SIZE ? RELAY_PIPE_SIZE : size;
+    ssize_t n = splice(in, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n == 0 && size < 0) return 0;
+    if (n <= 0) return -1;
+
+    for (ssize_t moved = 0; moved < n; ) {
+      ssize_t m = splice(pipefd[0], NULL, out, NULL, n - moved, SPLICE_F_MOVE);
+      if (m < 0 && errno == EINTR) continue;
+      if (m <= 0) return -1;
+      moved += m;
+    }
+    if (size > 0) size -= n;
+  }
+  return 0;
+}
+
+/*
+ * One direction of a proxied connection. Bytes are spliced from IN into a
+ * pipe and from the pipe to OUT, so they never enter user memory.
+ */
+struct relay {
+  int in;
+  int out;
+  int pipe[2];
+  size_t buffered;    /* Bytes in the pipe. */
+  int eof;            /* IN has nothing more to send, */
+  int done;           /* and all of it reached OUT, which has been shut down. */
+};
+
+/*
+ * Moves what RELAY can without blocking. Returns -1 if a socket failed,
+ * or else whether any progress was made.
+ */
+static int relay_step(struct relay *relay) {
+  const unsigned flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+  int progress = 0;
+  ssize_t n;
+
+  if (!relay->eof && relay->buffered < RELAY_PIPE_SIZE) {
+    n = splice(relay->in, NULL, relay->pipe[1], NULL,
+        RELAY_PIPE_SIZE - relay->buffered, flags);
+    if (n > 0) {
+      relay->buffered += n;
+      progress = 1;
+    } else if (n == 0) {
+      relay->eof = 1;
+      progress = 1;
+    } else if (errno != EAGAIN && errno != EINTR) {
+      return -1;
+    }
+  }
+
+  if (relay->buffered > 0) {
+    n = splice(relay->pipe[0], NULL, relay->out, NULL, relay->buffered, flags);
+    if (n > 0) {
+      relay->buffered -= n;
+      progress = 1;
+    } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      return -1;
+    }
+  }
+
+  /* Pass the half-close on once everything before it is through. */
+  if (relay->eof && relay->buffered == 0 && !relay->done) {
+    shutdown(relay->out, SHUT_WR);
+    relay->done = 1;
+    progress = 1;
+  }
+  return progress;
+}
+
+/*
+ * Relays bytes both ways between sockets A and B until each side has
+ * finished sending and the other has been told, or one of them fails.
+ * Runs in the calling thread; neither socket is closed.
+ */
+static void relay_connection(int a, int b) {
+  struct relay relays[2] = {
+    { .in = a, .out = b },
+    { .in = b, .out = a },
+  };
+  if (pipe2(relays[0].pipe, O_NONBLOCK) == -1) return;
+  if (pipe2(relays[1].pipe, O_NONBLOCK) == -1) {
+    close(relays[0].pipe[0]);
+    close(relays[0].pipe[1]);
+    return;
+  }
+  fcntl(relays[0].pipe[1], F_SETPIPE_SZ, RELAY_PIPE_CAPACITY);
+  fcntl(relays[1].pipe[1], F_SETPIPE_SZ, RELAY_PIPE_CAPACITY);
+  fcntl(a, F_SETFL, fcntl(a, F_GETFL) | O_NONBLOCK);
+  fcntl(b, F_SETFL, fcntl(b, F_GETFL) | O_NONBLOCK);
+
+  while (!relays[0].done || !relays[1].done) {
+    int progress = 0;
+    int failed = 0;
+    for (int i = 0; i < 2; i++) {
+      int result = relay_step(&relays[i]);
+      if (result < 0) failed = 1;
+      else progress |= result;
+    }
+    if (failed) break;
+    if (progress) continue;
+
+    /* Wait for room or data where each direction is stuck; a hang-up
+     * shows up as end of file or a failed write on the next step. */
+    struct pollfd pfds[2] = { { .fd = a }, { .fd = b } };
+    for (int i = 0; i < 2; i++) {
+      struct relay *relay = &relays[i];
+      if (!relay->eof && relay->buffered < RELAY_PIPE_SIZE)
+        pfds[i].events |= POLLIN;
+      if (relay->buffered > 0)
+        pfds[1 - i].events |= POLLOUT;
+    }
+    /* A socket with nothing to wait for would only report its hang-up. */
+    for (int i = 0; i < 2; i++) {
+      if (pfds[i].events == 0) pfds[i].fd = -1;
+    }
+    /* Neither side has moved for that long: give up on them. */
+    int ready = poll(pfds, 2, http_body_timeout_ms);
+    if ((ready < 0 && errno != EINTR) || ready == 0) break;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    close(relays[i].pipe[0]);
+    close(relays[i].pipe[1]);
+  }
+}
+
+/* Relays the rest of both connections blindly, starting with what each
+ * has buffered past what was already relayed. */
+static void proxy_tunnel(struct proxy_session *s) {
+  struct http_conn *client = &s->client, *upstream = &s->upstream;
+  if (proxy_write_all(upstream->fd, client->buffer + client->consumed,
+        client->len - client->consumed) == -1)
+    return;
+  if (proxy_write_all(client->fd, upstream->buffer + upstream->consumed,
+        upstream->len - upstream->consumed) == -1)
+    return;
+  relay_connection(client->fd, upstream->fd);
+}
+
+static void proxy_bad_gateway(int fd) {
+  http_start_response(fd, 502);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_send_header(fd, "Connection", "close");
+  http_end_headers(fd);
+  http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+}
+
+/* Copies the request head the client sent into S->head with its
+ * Connection header, if any, replaced by PROXY_KEEP_ALIVE_HEADER, so the
+ * upstream connection stays open whatever the client wants of its own.
+ * Returns the length of the copy. */
+static size_t proxy_upstream_head(struct proxy_session *s) {
+  const struct http_parser *parser = &s->client.parser;
+  const char *buffer = s->client.buffer;
+  size_t head_len = parser->head_len;
+  size_t blank = head_len >= 2 && buffer[head_len - 2] == '\r' ? 2 : 1;
+  size_t len = 0;
+
+  size_t line_start = head_len - blank, line_end = line_start;
+  if (parser->headers_seen & (1u << HTTP_HEADER_CONNECTION)) {
+    struct http_span value = parser->headers[HTTP_HEADER_CONNECTION];
+    line_start = value.off;
+    while (buffer[line_start - 1] != '\n') line_start--;
+    line_end = value.off + value.len;
+    while (buffer[line_end - 1] != '\n') line_end++;
+  }
+  memcpy(s->head, buffer, line_start);
+  len += line_start;
+  memcpy(s->head + len, buffer + line_end, head_len - blank - line_end);
+  len += head_len - blank - line_end;
+  memcpy(s->head + len, PROXY_KEEP_ALIVE_HEADER, strlen(PROXY_KEEP_ALIVE_HEADER));
+  len += strlen(PROXY_KEEP_ALIVE_HEADER);
+  memcpy(s->head + len, buffer + head_len - blank, blank);
+  return len + blank;
+}
+
+/* Copies the head of the response at the start of S->upstream into
+ * S->head for a client whose body is reframed: as HTTP/1.1, with its
+ * Connection, Content-Length and Transfer-Encoding headers replaced by
+ * FRAMING. Returns the length of the copy. */
+static size_t proxy_reframed_head(struct proxy_session *s, const char *framing) {
+  const struct http_parser *parser = &s->upstream.parser;
+  const char *buffer = s->upstream.buffer;
+  const unsigned dropped = (1u << HTTP_HEADER_CONNECTION)
+      | (1u << HTTP_HEADER_CONTENT_LENGTH) | (1u << HTTP_HEADER_TRANSFER_ENCODING);
+  size_t head_len = parser->head_len;
+  size_t blank = head_len >= 2 && buffer[head_len - 2] == '\r' ? 2 : 1;
+
+  /* The status line, after its version. */
+  size_t line = parser->version.off + parser->version.len;
+  size_t next = (const char *) memchr(buffer + line, '\n', head_len - line) - buffer + 1;
+  size_t len = strlen("HTTP/1.1");
+  memcpy(s->head, "HTTP/1.1", len);
+  memcpy(s->head + len, buffer + line, next - line);
+  len += next - line;
+
+  for (line = next; line < head_len - blank; line = next) {
+    next = (const char *) memchr(buffer + line, '\n', head_len - line) - buffer + 1;
+    const char *colon = memchr(buffer + line, ':', next - line);
+    if (colon && (dropped & (1u << http_header_lookup(buffer + line,
+            colon - (buffer + line)))))
+      continue;
+    memcpy(s->head + len, buffer + line, next - line);
+    len += next - line;
+  }
+  memcpy(s->head + len, framing, strlen(framing));
+  len += strlen(framing);
+  memcpy(s->head + len, "\r\n", 2);
+  return len + 2;
+}
+
+/* Relays the response at the head of S->upstream, whose body is chunked if
+ * CHUNKED is set and otherwise runs until the backend closes. An HTTP/1.1
+ * client is sent the body decoded and chunked afresh, so its connection
+ * can carry another request after it; an older one is sent it decoded
+ * until its connection closes. Sets *BYTES to what was sent of it, if it
+ * all was. */
+static enum proxy_result proxy_relay_reframed(struct proxy_session *s, int chunked,
+    long long *bytes) {
+  struct http_conn *client = &s->client, *upstream = &s->upstream;
+  const struct http_parser *request = &client->parser, *response = &upstream->parser;
+  int rechunk = request->version.len == 8
+      && memcmp(client->buffer + request->version.off, "HTTP/1.1", 8) == 0;
+  if (!chunked && !rechunk) {
+    proxy_write_all(client->fd, upstream->buffer, upstream->len);
+    proxy_splice(upstream->fd, client->fd, s->pipe, -1);
+    return PROXY_CLOSE;
+  }
+
+  size_t head_len = proxy_reframed_head(s,
+      rechunk ? PROXY_CHUNKED_HEADER : PROXY_CLOSE_HEADER);
+  /* MSG_MORE holds the head back to share a segment with the body, rather
+   * than go out alone and leave the body waiting on its ACK. */
+  if (proxy_send_all(client->fd, s->head, head_len, MSG_MORE) == -1) return PROXY_CLOSE;
+  http_chunked_init(&s->chunked, client->fd);
+  struct http_dechunker dechunker;
+  http_dechunker_init(&dechunker);
+
+  /* Start with what came along with the head, then read into the buffer
+   * it was in, until the body ends. */
+  upstream->consumed = response->head_len;
+  int drained = upstream->len < LIBHTTP_REQUEST_MAX_SIZE;
+  long long body = 0;
+  int ended = 0, nodelay = tcp_tuning.nodelay;
+  while (1) {
+    char *data = upstream->buffer + upstream->consumed;
+    size_t len = upstream->len - upstream->consumed;
+    size_t n = chunked ? http_dechunk(&dechunker, data, &len) : len;
+    upstream->consumed += len;
+    body += n;
+    if (rechunk)
+      http_chunked_write(&s->chunked, data, n);
+    else if (proxy_write_all(client->fd, data, n) == -1)
+      break;
+    if (chunked && dechunker.state >= HTTP_DECHUNK_DONE) {
+      ended = dechunker.state == HTTP_DECHUNK_DONE;
+      break;
+    }
+    /* Pass on what there is before waiting on more, but not before finding
+     * the end, if it has already come, so the last chunk goes with it. */
+    struct pollfd pfd = { .fd = upstream->fd, .events = POLLIN };
+    if (rechunk && drained && s->chunked.len > 0 && poll(&pfd, 1, 0) == 0) {
+      http_chunked_flush(&s->chunked);
+      /* Chunks are written whole, so the last one needn't wait on the ACK
+       * for this one, as it would under Nagle's algorithm. */
+      if (!nodelay) {
+        nodelay = 1;
+        setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+      }
+    }
+    if (s->chunked.failed) break;
+
+    ssize_t got;
+    while ((got = read(upstream->fd, upstream->buffer, LIBHTTP_REQUEST_MAX_SIZE)) < 0
+        && errno == EINTR)
+      continue;
+    if (got == 0 && !chunked) ended = 1;
+    if (got <= 0) break;
+    upstream->len = got;
+    upstream->consumed = 0;
+    drained = got < LIBHTTP_REQUEST_MAX_SIZE;
+  }
+  if (ended && rechunk && http_chunked_end(&s->chunked) == -1) ended = 0;
+  if (!ended) return PROXY_CLOSE;
+  *bytes = head_len + body;
+
+  int client_next = rechunk && request->keep_alive;
+  if (!chunked) return client_next ? PROXY_UPSTREAM_DONE : PROXY_CLOSE;
+  s->upstream_used = 1;
+  /* Anything past the response wasn't asked for. */
+  if (!response->keep_alive || upstream->consumed != upstream->len)
+    return client_next ? PROXY_UPSTREAM_DONE : PROXY_CLOSE;
+  return client_next ? PROXY_NEXT : PROXY_CLIENT_DONE;
+}
+
+/* Forwards the request at the head of S->client upstream and relays the
+ * response back. Sets *STATUS to the response's status, if there was one
+ * that isn't retried, and *BYTES to what was sent of it, if that's known. */
+static enum proxy_result proxy_forward(struct proxy_session *s, int *status,
+    long long *bytes) {
+  struct http_conn *client = &s->client, *upstream = &s->upstream;
+  const struct http_parser *request = &client->parser;
+  const unsigned blind = (1u << HTTP_HEADER_TRANSFER_ENCODING)
+      | (1u << HTTP_HEADER_EXPECT);
+
+  off_t body = 0;
+  int has_body = http_parser_content_length(request, client->buffer, &body);
+  if (has_body < 0 || (request->headers_seen & blind)) {
+    client->consumed = 0;
+    proxy_tunnel(s);
+    return PROXY_CLOSE;
+  }
+
+  /* A connection the backend closed while it sat idle only shows it once
+   * written to, so a request that can be sent again is. */
+  int retry = s->upstream_used && body == 0 ? PROXY_RETRY : PROXY_CLOSE;
+  size_t head_len = proxy_upstream_head(s);
+  if (proxy_write_all(upstream->fd, s->head, head_len) == -1) {
+    if (retry == PROXY_RETRY) return retry;
+    *status = 502;
+    proxy_bad_gateway(client->fd);
+    return PROXY_CLOSE;
+  }
+  size_t buffered = client->len - client->consumed;
+  if ((off_t) buffered > body) buffered = body;
+  if (proxy_write_all(upstream->fd, client->buffer + client->consumed, buffered) == -1
+      || proxy_splice(client->fd, upstream->fd, s->pipe, body - buffered) == -1) {
+    *status = 502;
+    proxy_bad_gateway(client->fd);
+    return PROXY_CLOSE;
+  }
+  client->consumed += buffered;
+
+  int got = http_conn_read_head(upstream, PROXY_UPSTREAM_TIMEOUT_MS, 1);
+  if (got == 0 && upstream->len == 0 && retry == PROXY_RETRY) return retry;
+  if (got <= 0) {
+    *status = 502;
+    proxy_bad_gateway(client->fd);
+    return PROXY_CLOSE;
+  }
+
+  const struct http_parser *response = &upstream->parser;
+  *status = response->status;
+  off_t length = 0;
+  int has_length = http_parser_content_length(response, upstream->buffer, &length);
+  int head = request->method.len == 4
+      && memcmp(client->buffer + request->method.off, "HEAD", 4) == 0;
+  if (head || response->status == 204 || response->status == 304) {
+    length = 0;
+  } else if (response->status >= 200 && http_parser_chunked(response, upstream->buffer)) {
+    return proxy_relay_reframed(s, 1, bytes);
+  } else if (response->status < 200 || has_length < 0) {
+    upstream->consumed = 0;
+    proxy_tunnel(s);
+    return PROXY_CLOSE;
+  } else if (has_length == 0
+      || (response->headers_seen & (1u << HTTP_HEADER_TRANSFER_ENCODING))) {
+    /* The body runs until the backend closes the connection. */
+    return proxy_relay_reframed(s, 0, bytes);
+  }
+
+  /* A response for the cache is read whole before it is relayed, which is
+   * no slower for the client, since it fits in memory anyway. */
+  char *cached = NULL;
+  int failed = 0;
+  if (s->cache_fill && !head
+      && proxy_cache_response_ok(response, upstream->buffer, length))
+    cached = proxy_read_body(upstream, length, &failed);
+  if (failed) return PROXY_CLOSE;
+  if (cached) {
+    struct iovec iov[] = {
+      { upstream->buffer, response->head_len },
+      { cached, length },
+    };
+    http_writev_all(client->fd, iov, 2);
+    proxy_cache_insert(s->cache_key, s->head, head_len, response, upstream->buffer,
+        cached, length);
+  } else {
+    buffered = upstream->len - response->head_len;
+    if ((off_t) buffered > length) buffered = length;
+    if (proxy_write_all(client->fd, upstream->buffer, response->head_len + buffered) == -1
+        || proxy_splice(upstream->fd, client->fd, s->pipe, length - buffered) == -1)
+      return PROXY_CLOSE;
+    upstream->consumed = response->head_len + buffered;
+  }
+  s->upstream_used = 1;
+  *bytes = response->head_len + length;
+
+  /* Anything past the response wasn't asked for. */
+  if (!response->keep_alive || upstream->consumed != upstream->len)
+    return PROXY_CLOSE;
+  return request->keep_alive ? PROXY_NEXT : PROXY_CLIENT_DONE;
+}
+
+/* Answers the request at the head of S->client, which no backend can be
+ * reached for, logging it if it was PARSED. */
+static void proxy_unreachable(struct proxy_session *s, int parsed) {
+  const struct http_parser *request = &s->client.parser;
+  const char *buffer = s->client.buffer;
+  struct access_log_entry log_entry;
+  long start = stats_start();
+  bool logged = parsed && access_log_begin(&log_entry, buffer + request->method.off,
+      request->method.len, buffer + request->path.off, request->path.len);
+  proxy_bad_gateway(s->client.fd);
+  if (logged) access_log_end(&log_entry, 502, -1);
+  stats_request(STATS_PROXY, 502, -1, start);
+}
+
+/* proxy_forward(), logged and counted. */
+static enum proxy_result proxy_exchange(struct proxy_session *s) {
+  const struct http_parser *request = &s->client.parser;
+  const char *buffer = s->client.buffer;
+  struct access_log_entry log_entry;
+  long start = stats_start();
+  bool logged = access_log_begin(&log_entry, buffer + request->method.off,
+      request->method.len, buffer + request->path.off, request->path.len);
+
+  int status = 0;
+  long long bytes = -1;
+  enum proxy_result result = proxy_forward(s, &status, &bytes);
+  if (logged && status != 0) access_log_end(&log_entry, status, bytes);
+  if (status != 0) stats_request(STATS_PROXY, status, bytes, start);
+  return result;
+}
+
+/* Answers the request at the head of S->client with ENTRY, AGE seconds
+ * old, logged and counted. Returns whether the client connection can carry
+ * another request. */
+static int proxy_serve_cached(struct proxy_session *s,
+    const struct proxy_cache_entry *entry, long age) {
+  const struct http_parser *request = &s->client.parser;
+  const char *buffer = s->client.buffer;
+  struct access_log_entry log_entry;
+  long start = stats_start();
+  bool logged = access_log_begin(&log_entry, buffer + request->method.off,
+      request->method.len, buffer + request->path.off, request->path.len);
+
+  int keep_alive = request->keep_alive && !reload_draining();
+  char extra[64];
+  int n = snprintf(extra, sizeof(extra), "Age: %ld\r\n%s\r\n", age,
+      keep_alive ? "" : "Connection: close\r\n");
+  struct iovec iov[] = {
+    { entry->head, entry->head_len },
+    { extra, n },
+    { entry->body, entry->size },
+  };
+  http_writev_all(s->client.fd, iov, 3);
+
+  long long bytes = entry->head_len + n + entry->size;
+  if (logged) access_log_end(&log_entry, entry->status, bytes);
+  stats_request(STATS_PROXY, entry->status, bytes, start);
+  return keep_alive;
+}
+
+/* Asks a backend whether ENTRY is still good, with the validators it came
+ * with, and refreshes or replaces it by the answer. Runs in a thread of
+ * its own, so that the request that found ENTRY stale isn't held up. */
+static void *proxy_revalidate(void *aux) {
+  struct proxy_cache_entry *entry = aux;
+  const char *path = proxy_cache_path(entry->key);
+  struct proxy_backend *backend = proxy_choose(path, strlen(path));
+  struct http_conn *upstream = malloc(sizeof(struct http_conn));
+  int fd = -1;
+  if (upstream) {
+    fd = proxy_pool_take(backend);
+    if (fd == -1) fd = proxy_connect(backend);
+  }
+  if (fd == -1) {
+    free(upstream);
+    proxy_cache_revalidated(entry);
+    return NULL;
+  }
+
+  http_conn_init(upstream, fd);
+  int keep = 0;
+  if (proxy_write_all(fd, entry->request, entry->request_len) == 0
+      && proxy_write_all(fd, entry->validators, entry->validators_len) == 0
+      && proxy_write_all(fd, "\r\n", 2) == 0
+      && http_conn_read_head(upstream, PROXY_UPSTREAM_TIMEOUT_MS, 1) > 0) {
+    const struct http_parser *response = &upstream->parser;
+    off_t length = 0;
+    int has_length = http_parser_content_length(response, upstream->buffer, &length);
+    char *body = NULL;
+    int failed = 0;
+    if (response->status == 304) {
+      proxy_cache_refresh(entry, response, upstream->buffer);
+      upstream->consumed = response->head_len;
+      keep = 1;
+    } else if (has_length > 0
+        && proxy_cache_response_ok(response, upstream->buffer, length)
+        && (body = proxy_read_body(upstream, length, &failed))) {
+      proxy_cache_insert(entry->key, entry->request, entry->request_len, response,
+          upstream->buffer, body, length);
+      keep = 1;
+    }
+    keep = keep && response->keep_alive && upstream->consumed == upstream->len;
+  }
+  if (keep)
+    proxy_pool_put(backend, fd);
+  else
+    close(fd);
+  free(upstream);
+  proxy_cache_revalidated(entry);
+  return NULL;
+}
+
+/* Ends S's fetch for the cache, if it was one. */
+static void proxy_fill_done(struct proxy_session *s) {
+  if (s->cache_fill) proxy_cache_fill_done(s->cache_key);
+  s->cache_fill = 0;
+}
+
+/* Points S->upstream at a pooled connection to BACKEND, or a new one if
+ * FRESH is set or there is none, or failing that, at the other backends in
+ * turn. Returns 0, or -1 if none can be reached. */
+static int proxy_attach(struct proxy_session *s, struct proxy_backend *backend,
+    int fresh) {
+  for (int tries = 0; tries < proxy_backend_cnt; tries++) {
+    int fd = fresh ? -1 : proxy_pool_take(backend);
+    s->upstream_used = fd != -1;
+    if (fd == -1) fd = proxy_connect(backend);
+    if (fd != -1) {
+      http_conn_init(&s->upstream, fd);
+      s->backend = backend;
+      pthread_mutex_lock(&backend->lock);
+      backend->active++;
+      pthread_mutex_unlock(&backend->lock);
+      return 0;
+    }
+    /* BACKEND is marked down now, so it won't be picked again. */
+    backend = proxy_choose(s->client.buffer + s->client.parser.path.off,
+        s->client.parser.path.len);
+  }
+  return -1;
+}
+
+/* Lets go of S's upstream connection, keeping it for reuse if KEEP is
+ * set. */
+static void proxy_detach(struct proxy_session *s, int keep) {
+  struct proxy_backend *backend = s->backend;
+  pthread_mutex_lock(&backend->lock);
+  backend->active--;
+  pthread_mutex_unlock(&backend->lock);
+  if (keep)
+    proxy_pool_put(backend, s->upstream.fd);
+  else
+    close(s->upstream.fd);
+  s->upstream.fd = -1;
+  s->backend = NULL;
+}
+
+int proxy_get_stats(struct proxy_backend_stats *stats, int max) {
+  for (int i = 0; i < proxy_backend_cnt && i < max; i++) {
+    struct proxy_backend *backend = &proxy_backends[i];
+    pthread_mutex_lock(&backend->lock);
+    stats[i] = (struct proxy_backend_stats) {
+      .name = backend->name, .down = backend->down,
+      .active = backend->active, .idle = backend->pool_cnt,
+    };
+    pthread_mutex_unlock(&backend->lock);
+  }
+  return proxy_backend_cnt;
+}
+
+/* The calling thread's session, kept from one client to the next along
+ * with its pipe. */
+static __thread struct proxy_session *proxy_mine;
+
+/* Returns this thread's session, with an empty pipe, or NULL. */
+static struct proxy_session *proxy_session(void) {
+  struct proxy_session *s = proxy_mine;
+  if (!s) {
+    s = malloc(sizeof(struct proxy_session));
+    if (!s) return NULL;
+    s->pipe[0] = -1;
+    proxy_mine = s;
+  }
+  if (s->pipe[0] == -1) {
+    if (pipe(s->pipe) == -1) {
+      s->pipe[0] = -1;
+      return NULL;
+    }
+    fcntl(s->pipe[1], F_SETPIPE_SZ, RELAY_PIPE_CAPACITY);
+  }
+  return s;
+}
+
+void proxy_handle(int fd) {
+  struct proxy_session *s = proxy_session();
+  if (!s) return;
+  http_conn_init(&s->client, fd);
+  s->upstream.fd = -1;
+  s->backend = NULL;
+
+  while (1) {
+    int got = http_conn_read_head(&s->client, http_idle_timeout_ms, 0);
+    if (got == 0) break;
+
+    /* The stats are answered here rather than forwarded. A body, which
+     * they don't take, would be read as the next request, so end there. */
+    const struct http_parser *request = &s->client.parser;
+    if (got > 0 && stats_is_request(s->client.buffer + request->path.off,
+          request->path.len)) {
+      off_t body = 0;
+      int keep_alive = request->keep_alive && !reload_draining()
+          && http_parser_content_length(request, s->client.buffer, &body) >= 0 && body == 0;
+      stats_send(fd, s->client.buffer + request->path.off, request->path.len, keep_alive);
+      if (keep_alive) continue;
+      break;
+    }
+
+    /* Answer from the cache if it can. Otherwise this request may be the
+     * one that fetches the response into it. */
+    s->cache_fill = 0;
+    if (got > 0 && proxy_cache_enabled()
+        && proxy_cache_request_ok(request, s->client.buffer)) {
+      enum proxy_cache_status cached;
+      long age;
+      proxy_cache_make_key(s->cache_key, request, s->client.buffer);
+      struct proxy_cache_entry *entry = proxy_cache_lookup(s->cache_key, &cached, &age);
+      if (entry) {
+        int keep_alive = proxy_serve_cached(s, entry, age);
+        pthread_t thread;
+        if (cached != PROXY_CACHE_REVALIDATE)
+          proxy_cache_release(entry);
+        else if (pthread_create(&thread, NULL, proxy_revalidate, entry) == 0)
+          pthread_detach(thread);
+        else
+          proxy_cache_revalidated(entry);
+        if (keep_alive) continue;
+        break;
+      }
+      s->cache_fill = cached == PROXY_CACHE_FILL;
+    }
+
+    /* Only hashing picks a backend for each request; otherwise a client
+     * stays with the one it started on. */
+    struct proxy_backend *backend = s->backend;
+    if (!backend || (proxy_balance == PROXY_HASH && got > 0)) {
+      backend = proxy_choose(s->client.buffer + request->path.off,
+          got > 0 ? request->path.len : 0);
+    }
+    if (s->backend && s->backend != backend) proxy_detach(s, 1);
+    if (!s->backend && proxy_attach(s, backend, 0) == -1) {
+      proxy_fill_done(s);
+      proxy_unreachable(s, got > 0);
+      break;
+    }
+    if (got < 0) {
+      /* Not something we can follow; let the backend make of it what it
+       * will. */
+      proxy_tunnel(s);
+      proxy_detach(s, 0);
+      break;
+    }
+
+    enum proxy_result result = proxy_exchange(s);
+    if (result == PROXY_RETRY) {
+      backend = s->backend;
+      proxy_detach(s, 0);
+      if (proxy_attach(s, backend, 1) == -1) {
+        proxy_fill_done(s);
+        proxy_unreachable(s, 1);
+        break;
+      }
+      result = proxy_exchange(s);
+    }
+    proxy_fill_done(s);
+
+    /* A server being replaced hangs up between responses, where a
+     * keep-alive client must expect it might. */
+    if (result == PROXY_NEXT && reload_draining()) result = PROXY_CLIENT_DONE;
+    if (result == PROXY_UPSTREAM_DONE && reload_draining()) result = PROXY_CLOSE;
+    if (result == PROXY_NEXT) continue;
+    if (result == PROXY_UPSTREAM_DONE) {
+      proxy_detach(s, 0);
+      continue;
+    }
+    proxy_detach(s, result == PROXY_CLIENT_DONE);
+    break;
+  }
+
+  /* The client went quiet with the upstream connection still good. */
+  if (s->backend) proxy_detach(s, 1);
+
+  /* A splice cut short by a failed socket can leave bytes in the pipe,
+   * which the next client mustn't be sent; start that one afresh. */
+  int left = 0;
+  if (ioctl(s->pipe[0], FIONREAD, &left) == -1 || left > 0) {
+    close(s->pipe[0]);
+    close(s->pipe[1]);
+    s->pipe[0] = -1;
+  }
+}
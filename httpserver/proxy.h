@@ -0,0 +1,79 @@
+#ifndef __PROXY__
+#define __PROXY__
+
+/* The proxy forwards requests to one or more backends, picked per the
+ * balancing policy. A backend's address is looked up once at startup and
+ * again after PROXY_DNS_TTL_S. Upstream connections whose responses end
+ * cleanly are kept in a pool of idle connections for each backend and
+ * reused for later requests, instead of connecting for each client.
+ *
+ * Requests and responses are relayed as they arrived, byte for byte, with
+ * bodies spliced through a pipe. A response whose body is chunked, or
+ * lasts until the backend closes the connection, is reframed instead: its
+ * body is decoded and sent to an HTTP/1.1 client chunked afresh, so the
+ * client's connection is kept either way, and the upstream one too if the
+ * chunked body ended cleanly. A request whose end can't be told from its
+ * head alone (a chunked body or an Expect header), or a 1xx response, is
+ * relayed blindly both ways until both sides finish, after which neither
+ * connection is kept.
+ *
+ * A backend that can't be connected to is marked down and the next one is
+ * tried. A thread connects to every backend each PROXY_HEALTH_INTERVAL_MS
+ * and marks each up or down by whether that worked. Backends that are
+ * down aren't picked unless all of them are. */
+
+/* How long a looked-up address is used, in seconds. The resolver doesn't
+ * tell its callers the record's TTL, so this stands in for it. */
+#define PROXY_DNS_TTL_S 60
+
+/* Most idle upstream connections kept per backend, and how long each is
+ * kept, in ms. */
+#define PROXY_POOL_MAX 64
+#define PROXY_POOL_IDLE_MS 30000
+
+/* How long the target may take to start a response, in ms. */
+#define PROXY_UPSTREAM_TIMEOUT_MS 30000
+
+/* How long connecting to a backend may take, in ms. */
+#define PROXY_CONNECT_TIMEOUT_MS 2000
+
+/* How often each backend is checked, in ms. */
+#define PROXY_HEALTH_INTERVAL_MS 2000
+
+/* Points each backend gets on the hash ring. */
+#define PROXY_RING_POINTS 64
+
+/* How a backend is picked for a client. */
+enum proxy_balance {
+  PROXY_ROUND_ROBIN,    /* Each in turn. */
+  PROXY_LEAST_CONN,     /* The one serving the fewest clients. */
+  PROXY_HASH,           /* By the request's path, on a consistent hash ring,
+                         * so adding a backend moves few paths. */
+};
+
+/* Adds backend HOSTNAME:PORT, or if HOSTNAME is unix:PATH, the backend
+ * listening on the Unix domain socket at PATH, for one on the same host
+ * without TCP's overhead; PORT is then ignored. Call before proxy_init(). */
+void proxy_add_backend(const char *hostname, int port);
+
+/* Looks up the backends, exiting if one can't be found, and starts the
+ * health checks. Call before proxy_handle(). */
+void proxy_init(enum proxy_balance balance);
+
+/* A backend's state, for the stats. */
+struct proxy_backend_stats {
+  const char *name;   /* HOSTNAME:PORT, or unix:PATH. */
+  int down;
+  int active;     /* Clients it is serving. */
+  int idle;       /* Connections to it in the pool. */
+};
+
+/* Fills in up to MAX of STATS, one per backend, and returns how many
+ * backends there are. */
+int proxy_get_stats(struct proxy_backend_stats *stats, int max);
+
+/* Serves the client on FD until it or the backend is done. FD is left
+ * open. */
+void proxy_handle(int fd);
+
+#endif
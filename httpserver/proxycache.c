@@ -0,0 +1,753 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proxycache.h"
+#include "stats.h"
+#include "utlist.h"
+
+/* Number of hash chains, in memory and on disk. */
+#define PROXY_CACHE_BUCKETS 1024
+
+/* Responses bigger than this fraction of the capacity aren't cached, so
+ * one large response can't push out everything else. */
+#define PROXY_CACHE_MAX_ENTRY_FRACTION 8
+
+/* Starts each file of the disk tier, so a process can't take what another
+ * kind of binary wrote. Bumped when struct disk_record changes. */
+#define PROXY_CACHE_DISK_MAGIC 0x48535001u
+
+/* An entry as a file of the disk tier holds it, followed by its key,
+ * request, validators, head, and body, unterminated. */
+struct disk_record {
+  uint32_t magic;
+  uint32_t key_len;
+  uint32_t request_len;
+  uint32_t validators_len;
+  uint32_t head_len;
+  int32_t status;
+  uint64_t size;
+  int64_t date;
+  int64_t expires;
+  int64_t stale_until;
+};
+
+/* A file of the disk tier, named for the hash of its key. */
+struct disk_entry {
+  uint64_t id;
+  size_t size;
+  struct disk_entry *hash_next;
+  struct disk_entry *prev;   /* Neighbors in least recently used order. */
+  struct disk_entry *next;
+};
+
+/* A key some request is fetching. */
+struct cache_fill {
+  char *key;
+  struct cache_fill *next;
+};
+
+/* Guards everything below. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct proxy_cache_entry *buckets[PROXY_CACHE_BUCKETS];
+static struct proxy_cache_entry *lru;   /* Least recently used first. */
+static size_t capacity;
+static size_t used;
+
+static struct cache_fill *fills;
+static pthread_cond_t fill_cond = PTHREAD_COND_INITIALIZER;
+
+static char *disk_dir;    /* NULL without a disk tier. */
+static struct disk_entry *disk_buckets[PROXY_CACHE_BUCKETS];
+static struct disk_entry *disk_lru;
+static size_t disk_capacity;
+static size_t disk_used;
+
+static unsigned hash_key(const char *key) {
+  /* djb2 */
+  unsigned hash = 5381;
+  while (*key) hash = hash * 33 + (unsigned char) *key++;
+  return hash % PROXY_CACHE_BUCKETS;
+}
+
+/* Returns the id naming KEY's file in the disk tier. */
+static uint64_t disk_id(const char *key) {
+  /* 64-bit FNV-1a */
+  uint64_t hash = 0xcbf29ce484222325ull;
+  while (*key) hash = (hash ^ (unsigned char) *key++) * 0x100000001b3ull;
+  return hash;
+}
+
+static void disk_path(char *path, size_t size, uint64_t id) {
+  snprintf(path, size, "%s/%016llx", disk_dir, (unsigned long long) id);
+}
+
+/* Bytes ENTRY counts against the capacity. */
+static size_t entry_cost(const struct proxy_cache_entry *entry) {
+  return strlen(entry->key) + entry->request_len + entry->validators_len
+      + entry->head_len + entry->size;
+}
+
+static void entry_free(struct proxy_cache_entry *entry) {
+  free(entry->key);
+  free(entry->request);
+  free(entry->validators);
+  free(entry->head);
+  free(entry->body);
+  free(entry);
+}
+
+/* Drops a reference to ENTRY. Must hold cache_lock. */
+static void entry_put(struct proxy_cache_entry *entry) {
+  if (--entry->refs == 0) entry_free(entry);
+}
+
+/* Takes ENTRY out of the cache; holders keep it alive until they release
+ * it. Must hold cache_lock. */
+static void entry_remove(struct proxy_cache_entry *entry) {
+  struct proxy_cache_entry **link = &buckets[hash_key(entry->key)];
+  while (*link != entry) link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  DL_DELETE(lru, entry);
+  used -= entry_cost(entry);
+  entry_put(entry);
+}
+
+/* Returns the cached entry for KEY without touching its reference count,
+ * or NULL. Must hold cache_lock. */
+static struct proxy_cache_entry *entry_find(const char *key) {
+  struct proxy_cache_entry *entry = buckets[hash_key(key)];
+  while (entry && strcmp(entry->key, key) != 0) entry = entry->hash_next;
+  return entry;
+}
+
+/* Caches ENTRY, whose REFS the caller has set, in place of any entry with
+ * its key. Must hold cache_lock. */
+static void entry_add(struct proxy_cache_entry *entry) {
+  struct proxy_cache_entry *old = entry_find(entry->key);
+  if (old) entry_remove(old);
+  while (lru && used + entry_cost(entry) > capacity) entry_remove(lru);
+
+  unsigned bucket = hash_key(entry->key);
+  entry->hash_next = buckets[bucket];
+  buckets[bucket] = entry;
+  DL_APPEND(lru, entry);
+  used += entry_cost(entry);
+}
+
+static struct disk_entry *disk_find(uint64_t id) {
+  struct disk_entry *disk = disk_buckets[id % PROXY_CACHE_BUCKETS];
+  while (disk && disk->id != id) disk = disk->hash_next;
+  return disk;
+}
+
+/* Forgets DISK and deletes its file. Must hold cache_lock. */
+static void disk_remove(struct disk_entry *disk) {
+  struct disk_entry **link = &disk_buckets[disk->id % PROXY_CACHE_BUCKETS];
+  while (*link != disk) link = &(*link)->hash_next;
+  *link = disk->hash_next;
+  DL_DELETE(disk_lru, disk);
+  disk_used -= disk->size;
+
+  char path[strlen(disk_dir) + 20];
+  disk_path(path, sizeof(path), disk->id);
+  unlink(path);
+  free(disk);
+}
+
+/* Notes that the file for ID holds SIZE bytes, deleting the least
+ * recently used files past the disk tier's capacity. Must hold
+ * cache_lock. */
+static void disk_add(uint64_t id, size_t size) {
+  struct disk_entry *disk = disk_find(id);
+  if (disk) {
+    disk_used -= disk->size;
+    DL_DELETE(disk_lru, disk);
+  } else {
+    disk = malloc(sizeof(*disk));
+    if (!disk) return;
+    disk->id = id;
+    disk->hash_next = disk_buckets[id % PROXY_CACHE_BUCKETS];
+    disk_buckets[id % PROXY_CACHE_BUCKETS] = disk;
+  }
+  disk->size = size;
+  DL_APPEND(disk_lru, disk);
+  disk_used += size;
+  while (disk_lru != disk && disk_used > disk_capacity) disk_remove(disk_lru);
+}
+
+/* Reads the whole of LEN bytes from FD into BUF. */
+static bool read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* Reads the LEN-byte string at FD's position into a new allocation. */
+static char *read_string(int fd, size_t len) {
+  char *s = malloc(len + 1);
+  if (!s) return NULL;
+  if (!read_all(fd, s, len)) {
+    free(s);
+    return NULL;
+  }
+  s[len] = '\0';
+  return s;
+}
+
+/* Writes ENTRY to its file in the disk tier, replacing the file whole so
+ * that no reader sees half of it. */
+static void disk_write(const struct proxy_cache_entry *entry) {
+  uint64_t id = disk_id(entry->key);
+  char path[strlen(disk_dir) + 20];
+  char temp[strlen(disk_dir) + 40];
+  disk_path(path, sizeof(path), id);
+  snprintf(temp, sizeof(temp), "%s/.%016llx.%lx", disk_dir, (unsigned long long) id,
+      (unsigned long) pthread_self());
+
+  struct disk_record record = {
+    .magic = PROXY_CACHE_DISK_MAGIC,
+    .key_len = strlen(entry->key),
+    .request_len = entry->request_len,
+    .validators_len = entry->validators_len,
+    .head_len = entry->head_len,
+    .status = entry->status,
+    .size = entry->size,
+  };
+  pthread_mutex_lock(&cache_lock);
+  record.date = entry->date;
+  record.expires = entry->expires;
+  record.stale_until = entry->stale_until;
+  pthread_mutex_unlock(&cache_lock);
+
+  struct iovec iov[] = {
+    { &record, sizeof(record) },
+    { entry->key, record.key_len },
+    { entry->request, entry->request_len },
+    { entry->validators, entry->validators_len },
+    { entry->head, entry->head_len },
+    { entry->body, entry->size },
+  };
+  size_t total = 0;
+  for (size_t i = 0; i < sizeof(iov) / sizeof(*iov); i++) total += iov[i].iov_len;
+
+  int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return;
+  ssize_t n = writev(fd, iov, sizeof(iov) / sizeof(*iov));
+  close(fd);
+  if (n != (ssize_t) total || rename(temp, path) != 0) {
+    unlink(temp);
+    return;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  disk_add(id, total);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/* Reads the entry for KEY from the disk tier, or returns NULL if its file
+ * is missing, for another key, or too stale to serve. */
+static struct proxy_cache_entry *disk_read(const char *key) {
+  char path[strlen(disk_dir) + 20];
+  disk_path(path, sizeof(path), disk_id(key));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct disk_record record;
+  struct proxy_cache_entry *entry = calloc(1, sizeof(*entry));
+  if (!entry) {
+    close(fd);
+    return NULL;
+  }
+  bool ok = read_all(fd, &record, sizeof(record))
+      && record.magic == PROXY_CACHE_DISK_MAGIC
+      && record.key_len == strlen(key)
+      && time(NULL) < record.stale_until
+      && (entry->key = read_string(fd, record.key_len))
+      && strcmp(entry->key, key) == 0
+      && (entry->request = read_string(fd, record.request_len))
+      && (entry->validators = read_string(fd, record.validators_len))
+      && (entry->head = read_string(fd, record.head_len))
+      && (entry->body = read_string(fd, record.size));
+  close(fd);
+  if (!ok) {
+    entry_free(entry);
+    return NULL;
+  }
+  entry->status = record.status;
+  entry->request_len = record.request_len;
+  entry->validators_len = record.validators_len;
+  entry->head_len = record.head_len;
+  entry->size = record.size;
+  entry->date = record.date;
+  entry->expires = record.expires;
+  entry->stale_until = record.stale_until;
+  return entry;
+}
+
+/* Takes up the files a past process left in the disk tier, deleting any
+ * it didn't finish writing. */
+static void disk_scan(void) {
+  DIR *dir = opendir(disk_dir);
+  if (!dir) return;
+  struct dirent *de;
+  while ((de = readdir(dir))) {
+    char path[strlen(disk_dir) + strlen(de->d_name) + 2];
+    sprintf(path, "%s/%s", disk_dir, de->d_name);
+    if (de->d_name[0] == '.') {
+      if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) unlink(path);
+      continue;
+    }
+    char *end;
+    uint64_t id = strtoull(de->d_name, &end, 16);
+    if (strlen(de->d_name) != 16 || *end) continue;
+
+    struct stat sb;
+    struct disk_record record;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) continue;
+    bool ok = fstat(fd, &sb) == 0 && read_all(fd, &record, sizeof(record))
+        && record.magic == PROXY_CACHE_DISK_MAGIC && time(NULL) < record.stale_until;
+    close(fd);
+    if (ok)
+      disk_add(id, sb.st_size);
+    else
+      unlink(path);
+  }
+  closedir(dir);
+}
+
+void proxy_cache_init(size_t size, const char *dir, size_t disk_size) {
+  capacity = size;
+  if (size == 0 || !dir) return;
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    perror("Failed to create proxy cache directory");
+    exit(errno);
+  }
+  disk_dir = strdup(dir);
+  disk_capacity = disk_size;
+  disk_scan();
+}
+
+bool proxy_cache_enabled(void) {
+  return capacity > 0;
+}
+
+/* Cache-Control directives the cache heeds. Ages are -1 if absent. */
+struct cache_control {
+  bool no_store;
+  bool no_cache;
+  bool private_;
+  bool must_revalidate;
+  long max_age;
+  long s_maxage;
+  long stale_while_revalidate;
+};
+
+/* Returns true if the LEN bytes at S are exactly WORD, ignoring case. */
+static bool span_is(const char *s, size_t len, const char *word) {
+  return strlen(word) == len && strncasecmp(s, word, len) == 0;
+}
+
+/* Reads the Cache-Control header, if PARSER found one in BUFFER, into
+ * *CC. */
+static void cache_control_parse(const struct http_parser *parser, const char *buffer,
+    struct cache_control *cc) {
+  *cc = (struct cache_control) { .max_age = -1, .s_maxage = -1,
+      .stale_while_revalidate = -1 };
+  if (!(parser->headers_seen & (1u << HTTP_HEADER_CACHE_CONTROL))) return;
+  struct http_span span = parser->headers[HTTP_HEADER_CACHE_CONTROL];
+  const char *p = buffer + span.off;
+  const char *end = p + span.len;
+
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *name = p;
+    while (p < end && *p != ',' && *p != '=' && *p != ' ' && *p != '\t') p++;
+    size_t name_len = p - name;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    long value = -1;
+    if (p < end && *p == '=') {
+      p++;
+      if (p < end && *p == '"') p++;
+      if (p < end && isdigit((unsigned char) *p))
+        for (value = 0; p < end && isdigit((unsigned char) *p); p++)
+          value = value < 100000000 ? value * 10 + (*p - '0') : value;
+    }
+    while (p < end && *p != ',') p++;
+
+    if (span_is(name, name_len, "no-store"))
+      cc->no_store = true;
+    else if (span_is(name, name_len, "no-cache"))
+      cc->no_cache = true;
+    else if (span_is(name, name_len, "private"))
+      cc->private_ = true;
+    else if (span_is(name, name_len, "must-revalidate")
+        || span_is(name, name_len, "proxy-revalidate"))
+      cc->must_revalidate = true;
+    else if (span_is(name, name_len, "max-age"))
+      cc->max_age = value;
+    else if (span_is(name, name_len, "s-maxage"))
+      cc->s_maxage = value;
+    else if (span_is(name, name_len, "stale-while-revalidate"))
+      cc->stale_while_revalidate = value;
+  }
+}
+
+/* Works out from the response head PARSER found in BUFFER how long past
+ * NOW it stays fresh and may then be served stale, into *EXPIRES and
+ * *STALE_UNTIL. Returns false if it says nothing of its freshness or
+ * mustn't be cached. */
+static bool response_freshness(const struct http_parser *parser, const char *buffer,
+    time_t now, time_t *expires, time_t *stale_until) {
+  struct cache_control cc;
+  cache_control_parse(parser, buffer, &cc);
+  if (cc.no_store || cc.no_cache || cc.private_) return false;
+
+  long lifetime = cc.s_maxage >= 0 ? cc.s_maxage : cc.max_age;
+  if (lifetime < 0 && (parser->headers_seen & (1u << HTTP_HEADER_EXPIRES))) {
+    struct http_span span = parser->headers[HTTP_HEADER_EXPIRES];
+    char date[HTTP_DATE_MAX];
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    snprintf(date, sizeof(date), "%.*s", (int) span.len, buffer + span.off);
+    /* An Expires that doesn't parse means already expired. */
+    lifetime = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) ? timegm(&tm) - now : 0;
+  }
+  if (lifetime <= 0) return false;
+
+  *expires = now + lifetime;
+  *stale_until = *expires + (cc.must_revalidate ? 0
+      : cc.stale_while_revalidate >= 0 ? cc.stale_while_revalidate
+      : PROXY_CACHE_STALE_S);
+  return true;
+}
+
+bool proxy_cache_request_ok(const struct http_parser *request, const char *buffer) {
+  unsigned refuse = (1u << HTTP_HEADER_AUTHORIZATION) | (1u << HTTP_HEADER_RANGE)
+      | (1u << HTTP_HEADER_TRANSFER_ENCODING);
+  off_t length;
+  if (!span_is(buffer + request->method.off, request->method.len, "GET")
+      || (request->headers_seen & refuse)
+      || http_parser_content_length(request, buffer, &length) != 0)
+    return false;
+  struct cache_control cc;
+  cache_control_parse(request, buffer, &cc);
+  return !cc.no_store && !cc.no_cache;
+}
+
+void proxy_cache_make_key(char *key, const struct http_parser *request,
+    const char *buffer) {
+  struct http_span host = { 0, 0 }, encodings = { 0, 0 };
+  if (request->headers_seen & (1u << HTTP_HEADER_HOST))
+    host = request->headers[HTTP_HEADER_HOST];
+  if (request->headers_seen & (1u << HTTP_HEADER_ACCEPT_ENCODING))
+    encodings = request->headers[HTTP_HEADER_ACCEPT_ENCODING];
+  /* The path goes last, where proxy_cache_path() finds it. */
+  sprintf(key, "GET\n%.*s\n%.*s\n%.*s", (int) host.len, buffer + host.off,
+      (int) encodings.len, buffer + encodings.off,
+      (int) request->path.len, buffer + request->path.off);
+}
+
+const char *proxy_cache_path(const char *key) {
+  return strrchr(key, '\n') + 1;
+}
+
+/* Must hold cache_lock. */
+static struct cache_fill *fill_find(const char *key) {
+  struct cache_fill *fill = fills;
+  while (fill && strcmp(fill->key, key) != 0) fill = fill->next;
+  return fill;
+}
+
+/* Must hold cache_lock. */
+static void fill_remove(const char *key) {
+  struct cache_fill **link = &fills;
+  while (*link && strcmp((*link)->key, key) != 0) link = &(*link)->next;
+  struct cache_fill *fill = *link;
+  if (!fill) return;
+  *link = fill->next;
+  free(fill->key);
+  free(fill);
+  pthread_cond_broadcast(&fill_cond);
+}
+
+/* Waits for another request's fetch of KEY to end, for up to
+ * PROXY_CACHE_FILL_WAIT_MS. Must hold cache_lock. */
+static void fill_wait(const char *key) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += PROXY_CACHE_FILL_WAIT_MS / 1000;
+  deadline.tv_nsec += PROXY_CACHE_FILL_WAIT_MS % 1000 * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while (fill_find(key))
+    if (pthread_cond_timedwait(&fill_cond, &cache_lock, &deadline) == ETIMEDOUT) break;
+}
+
+struct proxy_cache_entry *proxy_cache_lookup(const char *key,
+    enum proxy_cache_status *status, long *age) {
+  bool waited = false;
+  pthread_mutex_lock(&cache_lock);
+  for (;;) {
+    time_t now = time(NULL);
+    struct proxy_cache_entry *entry = entry_find(key);
+    if (entry && now < entry->stale_until) {
+      entry->refs++;
+      DL_DELETE(lru, entry);
+      DL_APPEND(lru, entry);
+      *age = now > entry->date ? now - entry->date : 0;
+      if (now < entry->expires) {
+        *status = PROXY_CACHE_FRESH;
+      } else if (entry->revalidating) {
+        *status = PROXY_CACHE_STALE;
+      } else {
+        entry->revalidating = true;
+        *status = PROXY_CACHE_REVALIDATE;
+      }
+      pthread_mutex_unlock(&cache_lock);
+      stats_count(*status == PROXY_CACHE_FRESH ? STATS_CACHE_HITS : STATS_CACHE_STALE);
+      return entry;
+    }
+    if (entry) entry_remove(entry);   /* Too stale to serve. */
+
+    if (fill_find(key) && !waited) {
+      stats_count(STATS_CACHE_COLLAPSED);
+      fill_wait(key);
+      waited = true;
+      continue;
+    }
+    /* The fetch waited for didn't cache anything, or is taking too long:
+     * fetching again would only line requests up behind each other. */
+    if (waited) {
+      *status = PROXY_CACHE_BYPASS;
+      break;
+    }
+
+    struct cache_fill *fill = malloc(sizeof(*fill));
+    if (fill && !(fill->key = strdup(key))) {
+      free(fill);
+      fill = NULL;
+    }
+    if (!fill) {
+      *status = PROXY_CACHE_BYPASS;
+      break;
+    }
+    fill->next = fills;
+    fills = fill;
+    *status = PROXY_CACHE_FILL;
+
+    struct disk_entry *disk = disk_dir ? disk_find(disk_id(key)) : NULL;
+    if (!disk) break;
+    DL_DELETE(disk_lru, disk);
+    DL_APPEND(disk_lru, disk);
+    pthread_mutex_unlock(&cache_lock);
+    entry = disk_read(key);
+    pthread_mutex_lock(&cache_lock);
+    if (!entry) {
+      /* Gone, or another key's that hashed alike. */
+      if ((disk = disk_find(disk_id(key)))) disk_remove(disk);
+      break;
+    }
+    entry->refs = 1;    /* The cache. */
+    if (entry_cost(entry) <= capacity / PROXY_CACHE_MAX_ENTRY_FRACTION)
+      entry_add(entry);
+    else
+      entry_put(entry);
+    fill_remove(key);
+    /* Serve it as if it had been in memory, or if it was too big to keep
+     * there, fetch it afresh. */
+    if (entry_find(key) != entry) {
+      *status = PROXY_CACHE_BYPASS;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  stats_count(STATS_CACHE_MISSES);
+  return NULL;
+}
+
+/* Returns whether the response PARSER found in BUFFER varies by nothing
+ * but what the key holds: Accept-Encoding. */
+static bool vary_ok(const struct http_parser *parser, const char *buffer) {
+  if (!(parser->headers_seen & (1u << HTTP_HEADER_VARY))) return true;
+  struct http_span span = parser->headers[HTTP_HEADER_VARY];
+  const char *p = buffer + span.off;
+  const char *end = p + span.len;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *name = p;
+    while (p < end && *p != ',' && *p != ' ' && *p != '\t') p++;
+    if (p > name && !span_is(name, p - name, "Accept-Encoding")) return false;
+  }
+  return true;
+}
+
+bool proxy_cache_response_ok(const struct http_parser *response, const char *buffer,
+    size_t size) {
+  switch (response->status) {
+  case 200: case 203: case 300: case 301: case 404: case 410:
+    break;
+  default:
+    return false;
+  }
+  time_t expires, stale_until;
+  return !(response->headers_seen & (1u << HTTP_HEADER_SET_COOKIE))
+      && vary_ok(response, buffer)
+      && size <= capacity / PROXY_CACHE_MAX_ENTRY_FRACTION
+      && response_freshness(response, buffer, time(NULL), &expires, &stale_until);
+}
+
+/* Returns whether the header line at LINE is one of the NULL-terminated
+ * NAMES. */
+static bool line_is_one_of(const char *line, size_t len, const char *const *names) {
+  const char *colon = memchr(line, ':', len);
+  if (!colon) return false;
+  for (; *names; names++)
+    if (span_is(line, colon - line, *names)) return true;
+  return false;
+}
+
+/* Copies the LEN-byte head at HEAD, less its blank line and any header in
+ * the NULL-terminated NAMES, into a new allocation, and stores its length
+ * in *OUT_LEN. */
+static char *head_copy(const char *head, size_t len, const char *const *names,
+    size_t *out_len) {
+  char *out = malloc(len + 1);
+  if (!out) return NULL;
+  size_t n = 0;
+  for (const char *p = head, *end = head + len; p < end; ) {
+    const char *newline = memchr(p, '\n', end - p);
+    size_t line_len = newline ? (size_t) (newline - p) + 1 : (size_t) (end - p);
+    if (line_len <= 2 && (*p == '\r' || *p == '\n')) break;
+    if (p == head || !line_is_one_of(p, line_len, names)) {
+      memcpy(out + n, p, line_len);
+      n += line_len;
+    }
+    p += line_len;
+  }
+  out[n] = '\0';
+  *out_len = n;
+  return out;
+}
+
+/* Makes the conditional header lines to revalidate the response PARSER
+ * found in BUFFER, storing their length in *LEN. */
+static char *make_validators(const struct http_parser *parser, const char *buffer,
+    size_t *len) {
+  static const struct { enum http_header_id id; const char *name; } validators[] = {
+    { HTTP_HEADER_ETAG, "If-None-Match" },
+    { HTTP_HEADER_LAST_MODIFIED, "If-Modified-Since" },
+  };
+  size_t room = 1;
+  for (size_t i = 0; i < sizeof(validators) / sizeof(*validators); i++)
+    room += strlen(validators[i].name) + parser->headers[validators[i].id].len + 4;
+  char *out = malloc(room);
+  if (!out) return NULL;
+  size_t n = 0;
+  out[0] = '\0';
+  for (size_t i = 0; i < sizeof(validators) / sizeof(*validators); i++) {
+    if (!(parser->headers_seen & (1u << validators[i].id))) continue;
+    struct http_span span = parser->headers[validators[i].id];
+    n += sprintf(out + n, "%s: %.*s\r\n", validators[i].name, (int) span.len,
+        buffer + span.off);
+  }
+  *len = n;
+  return out;
+}
+
+void proxy_cache_insert(const char *key, const char *request, size_t request_len,
+    const struct http_parser *response, const char *buffer, char *body, size_t size) {
+  static const char *const request_drop[] = {
+    "If-None-Match", "If-Modified-Since", NULL,
+  };
+  static const char *const response_drop[] = {
+    "Connection", "Keep-Alive", "Age", NULL,
+  };
+  time_t now = time(NULL);
+  struct proxy_cache_entry *entry = calloc(1, sizeof(*entry));
+  if (!proxy_cache_response_ok(response, buffer, size) || !entry) {
+    free(entry);
+    free(body);
+    return;
+  }
+  entry->body = body;
+  entry->size = size;
+  entry->status = response->status;
+  entry->date = now;
+  response_freshness(response, buffer, now, &entry->expires, &entry->stale_until);
+  if (!(entry->key = strdup(key))
+      || !(entry->request = head_copy(request, request_len, request_drop,
+          &entry->request_len))
+      || !(entry->validators = make_validators(response, buffer, &entry->validators_len))
+      || !(entry->head = head_copy(buffer, response->head_len, response_drop,
+          &entry->head_len))) {
+    entry_free(entry);
+    return;
+  }
+
+  entry->refs = disk_dir ? 2 : 1;   /* The cache, and the disk write. */
+  pthread_mutex_lock(&cache_lock);
+  entry_add(entry);
+  pthread_mutex_unlock(&cache_lock);
+  if (!disk_dir) return;
+
+  disk_write(entry);
+  proxy_cache_release(entry);
+}
+
+void proxy_cache_fill_done(const char *key) {
+  pthread_mutex_lock(&cache_lock);
+  fill_remove(key);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void proxy_cache_refresh(struct proxy_cache_entry *entry,
+    const struct http_parser *response, const char *buffer) {
+  time_t now = time(NULL);
+  time_t expires, stale_until;
+  pthread_mutex_lock(&cache_lock);
+  if (!response_freshness(response, buffer, now, &expires, &stale_until)) {
+    expires = now + (entry->expires - entry->date);
+    stale_until = expires + (entry->stale_until - entry->expires);
+  }
+  entry->date = now;
+  entry->expires = expires;
+  entry->stale_until = stale_until;
+  pthread_mutex_unlock(&cache_lock);
+  if (disk_dir) disk_write(entry);
+}
+
+void proxy_cache_revalidated(struct proxy_cache_entry *entry) {
+  pthread_mutex_lock(&cache_lock);
+  entry->revalidating = false;
+  entry_put(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void proxy_cache_release(struct proxy_cache_entry *entry) {
+  pthread_mutex_lock(&cache_lock);
+  entry_put(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,145 @@
+#ifndef __PROXYCACHE__
+#define __PROXYCACHE__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "libhttp.h"
+
+/* The proxy cache keeps responses to GET requests that their backend marks
+ * cacheable, with an s-maxage or max-age in Cache-Control or with Expires,
+ * so that identical requests are answered without going upstream. Entries
+ * are keyed by method, Host, Accept-Encoding, and path. They are kept in
+ * memory in least recently used order and, if a directory is given, also
+ * written to files there, which outlast their copy in memory and the
+ * process.
+ *
+ * Only one request at a time fetches a key that isn't cached; others that
+ * ask for it meanwhile wait for that fetch and are answered from what it
+ * cached. An entry past its freshness is still served for a while, per its
+ * stale-while-revalidate or else PROXY_CACHE_STALE_S, while one request
+ * revalidates it upstream in the background.
+ *
+ * Responses that set cookies, vary by more than Accept-Encoding, or are
+ * marked no-store, no-cache, or private aren't cached, nor are answers to
+ * requests with a body, a Range, Authorization, or a Cache-Control of
+ * no-store or no-cache. */
+
+/* How long past its freshness an entry is served while it is revalidated,
+ * in seconds, if the response doesn't say. */
+#define PROXY_CACHE_STALE_S 60
+
+/* How long a request waits for another's fetch of the same key, in ms. */
+#define PROXY_CACHE_FILL_WAIT_MS 30000
+
+/* Default capacity of the disk tier, in bytes. */
+#define PROXY_CACHE_DEFAULT_DISK_SIZE (256 * 1024 * 1024)
+
+/* Room proxy_cache_make_key() needs past the length of the request head. */
+#define PROXY_CACHE_KEY_EXTRA 8
+
+/* A cached response. Its strings don't change once it's been returned. */
+struct proxy_cache_entry {
+  char *key;
+  int status;
+
+  /* The request sent upstream, less its blank line and any conditions the
+   * client added, for revalidating. */
+  char *request;
+  size_t request_len;
+
+  /* If-None-Match and If-Modified-Since lines made from the response's
+   * ETag and Last-Modified, which may be none. */
+  char *validators;
+  size_t validators_len;
+
+  /* Status line and headers, less Connection, Keep-Alive, and Age. Not
+   * followed by a blank line, so the caller can add more headers. */
+  char *head;
+  size_t head_len;
+
+  char *body;
+  size_t size;
+
+  /* Owned by the cache and guarded by its lock. */
+  time_t date;          /* When it was fetched or last revalidated. */
+  time_t expires;       /* Fresh until then, */
+  time_t stale_until;   /* and served while revalidating until then. */
+  bool revalidating;
+  int refs;             /* Holders, counting the cache itself. */
+  struct proxy_cache_entry *hash_next;
+  struct proxy_cache_entry *prev;   /* Neighbors in least recently used order. */
+  struct proxy_cache_entry *next;
+};
+
+/* What proxy_cache_lookup() found. */
+enum proxy_cache_status {
+  PROXY_CACHE_FRESH,        /* Serve the entry. */
+  PROXY_CACHE_STALE,        /* Serve the entry; another request is
+                             * revalidating it. */
+  PROXY_CACHE_REVALIDATE,   /* Serve the entry, then revalidate it and call
+                             * proxy_cache_revalidated(). */
+  PROXY_CACHE_FILL,         /* Nothing: fetch it, offering the response to
+                             * proxy_cache_insert(), then call
+                             * proxy_cache_fill_done(). */
+  PROXY_CACHE_BYPASS,       /* Nothing, and another request's fetch didn't
+                             * cache it: just forward the request. */
+};
+
+/* Sets the memory tier's capacity in bytes, and if DISK_DIR isn't NULL,
+ * keeps up to DISK_CAPACITY bytes of entries as files in it, creating it
+ * if need be and taking up entries a past process left there. Zero
+ * CAPACITY turns the cache off. Call before any other proxy cache
+ * function. */
+void proxy_cache_init(size_t capacity, const char *disk_dir, size_t disk_capacity);
+
+bool proxy_cache_enabled(void);
+
+/* Returns whether the request whose head is in BUFFER may be answered from
+ * the cache. */
+bool proxy_cache_request_ok(const struct http_parser *request, const char *buffer);
+
+/* Makes the key for the request whose head is in BUFFER, which must have
+ * room for the head's length plus PROXY_CACHE_KEY_EXTRA bytes. */
+void proxy_cache_make_key(char *key, const struct http_parser *request,
+    const char *buffer);
+
+/* Returns the request path within KEY. */
+const char *proxy_cache_path(const char *key);
+
+/* Looks KEY up, waiting while another request fetches it, and stores what
+ * was found in *STATUS and, with an entry, its age in seconds in *AGE.
+ * Returns the entry to serve, which the caller must drop with
+ * proxy_cache_release() or proxy_cache_revalidated(), or NULL. */
+struct proxy_cache_entry *proxy_cache_lookup(const char *key,
+    enum proxy_cache_status *status, long *age);
+
+/* Returns whether the response whose head is in BUFFER, with a SIZE-byte
+ * body, would be cached. */
+bool proxy_cache_response_ok(const struct http_parser *response, const char *buffer,
+    size_t size);
+
+/* Caches under KEY the response whose head is in BUFFER, with the SIZE
+ * bytes of BODY, which the cache takes over, to the REQUEST_LEN-byte
+ * upstream REQUEST. Does nothing but free BODY if the response isn't one
+ * proxy_cache_response_ok() allows or memory runs out. */
+void proxy_cache_insert(const char *key, const char *request, size_t request_len,
+    const struct http_parser *response, const char *buffer, char *body, size_t size);
+
+/* Ends the fetch proxy_cache_lookup() asked for with PROXY_CACHE_FILL,
+ * letting requests that wait for KEY go on. */
+void proxy_cache_fill_done(const char *key);
+
+/* Marks ENTRY fresh again, per the 304 Not Modified whose head is in
+ * BUFFER, or for as long as it was fresh before if that doesn't say. */
+void proxy_cache_refresh(struct proxy_cache_entry *entry,
+    const struct http_parser *response, const char *buffer);
+
+/* Ends the revalidation of ENTRY that proxy_cache_lookup() asked for with
+ * PROXY_CACHE_REVALIDATE, and drops the caller's reference. */
+void proxy_cache_revalidated(struct proxy_cache_entry *entry);
+
+void proxy_cache_release(struct proxy_cache_entry *entry);
+
+#endif
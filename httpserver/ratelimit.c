@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "stats.h"
+
+/* A client's bucket. */
+struct rate_limit_client {
+  struct in_addr addr;
+  double tokens;
+  long refilled_ms;     /* When TOKENS was last brought up to date. */
+  struct rate_limit_client *next;
+};
+
+/* A slice of the clients, by hash, with a lock of its own. Aligned so
+ * neighbors' locks don't share a cache line. */
+struct rate_limit_stripe {
+  pthread_mutex_t lock;
+  struct rate_limit_client *chains[RATE_LIMIT_STRIPE_CHAINS];
+  int cnt;
+  long swept_ms;
+} __attribute__((aligned(64)));
+
+static bool rate_limit_on;
+static double rate_limit_rate;      /* Tokens a ms. */
+static double rate_limit_burst;
+static long rate_limit_refill_ms;   /* How long an empty bucket takes to fill. */
+static struct rate_limit_stripe rate_limit_stripes[RATE_LIMIT_STRIPES];
+
+static long rate_limit_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void rate_limit_init(double rate, double burst) {
+  rate_limit_on = true;
+  rate_limit_rate = rate / 1000;
+  rate_limit_burst = burst;
+  rate_limit_refill_ms = burst / rate_limit_rate + 1;
+  for (int i = 0; i < RATE_LIMIT_STRIPES; i++)
+    pthread_mutex_init(&rate_limit_stripes[i].lock, NULL);
+}
+
+bool rate_limit_enabled(void) {
+  return rate_limit_on;
+}
+
+/* Drops STRIPE's buckets that have had time to fill up again. */
+static void rate_limit_sweep(struct rate_limit_stripe *stripe, long now) {
+  stripe->swept_ms = now;
+  for (int i = 0; i < RATE_LIMIT_STRIPE_CHAINS; i++) {
+    struct rate_limit_client **link = &stripe->chains[i];
+    while (*link) {
+      struct rate_limit_client *client = *link;
+      if (now - client->refilled_ms >= rate_limit_refill_ms) {
+        *link = client->next;
+        free(client);
+        stripe->cnt--;
+      } else {
+        link = &client->next;
+      }
+    }
+  }
+}
+
+bool rate_limit_allow(struct in_addr addr) {
+  if (!rate_limit_on) return true;
+
+  /* Fibonacci hashing: the top bits pick the stripe, the next the chain. */
+  uint32_t hash = (uint32_t) addr.s_addr * 2654435769u;
+  struct rate_limit_stripe *stripe = &rate_limit_stripes[hash >> 26];
+  struct rate_limit_client **chain = &stripe->chains[(hash >> 18) % RATE_LIMIT_STRIPE_CHAINS];
+  long now = rate_limit_now_ms();
+  bool allowed = true;
+
+  pthread_mutex_lock(&stripe->lock);
+  if (now - stripe->swept_ms >= RATE_LIMIT_SWEEP_MS) rate_limit_sweep(stripe, now);
+
+  struct rate_limit_client *client = *chain;
+  while (client && client->addr.s_addr != addr.s_addr) client = client->next;
+  if (client) {
+    client->tokens += (now - client->refilled_ms) * rate_limit_rate;
+    if (client->tokens > rate_limit_burst) client->tokens = rate_limit_burst;
+    client->refilled_ms = now;
+    if (client->tokens >= 1)
+      client->tokens--;
+    else
+      allowed = false;
+  } else if (stripe->cnt < RATE_LIMIT_STRIPE_CLIENTS
+      && (client = malloc(sizeof(struct rate_limit_client)))) {
+    client->addr = addr;
+    client->tokens = rate_limit_burst - 1;
+    client->refilled_ms = now;
+    client->next = *chain;
+    *chain = client;
+    stripe->cnt++;
+  }
+  pthread_mutex_unlock(&stripe->lock);
+  return allowed;
+}
+
+void rate_limit_refuse(int fd, bool respond) {
+  static const char response[] =
+      "HTTP/1.1 429 Too Many Requests\r\n"
+      "Retry-After: 1\r\n"
+      "Content-Length: 0\r\n"
+      "Connection: close\r\n\r\n";
+  stats_count(STATS_RATE_LIMITED);
+  if (!respond) return;
+  /* As with a 503 for overload, what the client has sent is read first so
+   * that closing with it unread doesn't reset the connection under the
+   * response. Nothing waits: a client that hasn't sent yet just gets the
+   * response. */
+  char discard[4096];
+  for (int i = 0; i < 4 && recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0; i++)
+    continue;
+  send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
@@ -0,0 +1,43 @@
+#ifndef __RATELIMIT__
+#define __RATELIMIT__
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+/* Per-client rate limiting, checked as soon as a connection is accepted,
+ * before it is queued or read from, so that one client opening connections
+ * as fast as it can doesn't fill the work queue and tie up every worker.
+ * Each client address has a token bucket that holds up to a burst of
+ * connections and refills at a steady rate; a connection that finds its
+ * client's bucket empty is refused with a 429, or for HTTPS just closed.
+ *
+ * Buckets are kept in a hash table split into RATE_LIMIT_STRIPES stripes,
+ * each with a lock of its own, so threads accepting at once seldom wait on
+ * each other. A bucket left alone long enough to refill is as good as none
+ * and is dropped when its stripe is next swept. A stripe holds at most
+ * RATE_LIMIT_STRIPE_CLIENTS clients; past that, new clients aren't tracked
+ * and so aren't limited, rather than memory growing without bound. */
+
+#define RATE_LIMIT_STRIPES 64
+#define RATE_LIMIT_STRIPE_CHAINS 256
+#define RATE_LIMIT_STRIPE_CLIENTS 4096
+
+/* How often a stripe is swept of expired buckets, in ms. */
+#define RATE_LIMIT_SWEEP_MS 1000
+
+/* Limits each client to RATE connections a second on average, with up to
+ * BURST at once. Call before any other rate limit function. */
+void rate_limit_init(double rate, double burst);
+
+bool rate_limit_enabled(void);
+
+/* Takes a token from ADDR's bucket. Returns false if it has none left, in
+ * which case the connection should be refused. Always true if rate
+ * limiting is off. */
+bool rate_limit_allow(struct in_addr addr);
+
+/* Turns away the client on FD, which ran out of tokens, with a 429 if
+ * RESPOND is set, without waiting on it. Doesn't close FD. */
+void rate_limit_refuse(int fd, bool respond);
+
+#endif
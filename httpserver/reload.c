@@ -0,0 +1,436 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "filecache.h"
+#include "reload.h"
+
+/* Most fds sent in one message; the kernel takes at most 253. */
+#define RELOAD_FDS_PER_MESSAGE 253
+
+/* Most threads that accept connections. */
+#define RELOAD_MAX_ACCEPTORS 1024
+
+/* How often a draining process interrupts the accepting threads that
+ * haven't stopped, and checks its connections, in ms. */
+#define RELOAD_POLL_MS 10
+
+/* The fd the old process hands its sockets over on, in the new one, as
+ * a string for RELOAD_FD_ENV too. */
+#define RELOAD_CHILD_FD 3
+#define RELOAD_CHILD_FD_STR "3"
+
+static char **reload_argv;
+static bool cache_enabled;
+static int parent_fd = -1;      /* To the old process, until reload_ready(). */
+
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Listening sockets, and which of them were inherited and not yet taken. */
+static int listeners[RELOAD_MAX_LISTENERS];
+static bool untaken[RELOAD_MAX_LISTENERS];
+static int listener_cnt;
+
+/* A thread that accepts connections, while it is blocked doing so. */
+struct acceptor {
+  pthread_t thread;
+  bool blocked;
+  bool stopped;
+};
+
+static struct acceptor acceptors[RELOAD_MAX_ACCEPTORS];
+static int acceptor_cnt;
+static __thread struct acceptor *self;
+
+static bool draining;
+static int connections;
+
+/* Interrupts a blocked accept() or epoll_wait(), and nothing else. */
+static void reload_wake(int signum) {
+}
+
+void reload_init(char **argv) {
+  /* Copied, as parsing the options cuts some of them up. */
+  int cnt = 0;
+  while (argv[cnt]) cnt++;
+  reload_argv = calloc(cnt + 1, sizeof(char *));
+  for (int i = 0; reload_argv && i < cnt; i++) reload_argv[i] = strdup(argv[i]);
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  /* Without SA_RESTART, so the call fails with EINTR. */
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = reload_wake;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR2, &action, NULL);
+}
+
+void reload_enable_cache(void) {
+  cache_enabled = true;
+}
+
+static long reload_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Reads or writes all LEN bytes at BUF on FD. Returns false if it can't. */
+static bool reload_read(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (char *) buf + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool reload_write(int fd, const void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(fd, (const char *) buf + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+/* Sends the CNT fds at FDS on SOCK, after their count. */
+static bool send_fds(int sock, const int *fds, uint32_t cnt) {
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * RELOAD_FDS_PER_MESSAGE)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = &cnt, .iov_len = sizeof(cnt) };
+  struct msghdr msg = {
+    .msg_iov = &iov, .msg_iovlen = 1,
+    .msg_control = control.buf, .msg_controllen = CMSG_SPACE(sizeof(int) * cnt),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * cnt);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * cnt);
+
+  ssize_t n;
+  do n = sendmsg(sock, &msg, MSG_NOSIGNAL); while (n < 0 && errno == EINTR);
+  if (n < 0) return false;
+  /* The fds went with the first byte; the rest of the count may follow. */
+  return reload_write(sock, (char *) &cnt + n, sizeof(cnt) - n);
+}
+
+/* Receives fds sent by send_fds() on SOCK into FDS, which has room for
+ * RELOAD_FDS_PER_MESSAGE. Returns how many, or -1. */
+static int recv_fds(int sock, int *fds) {
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * RELOAD_FDS_PER_MESSAGE)];
+    struct cmsghdr align;
+  } control;
+  uint32_t cnt;
+  struct iovec iov = { .iov_base = &cnt, .iov_len = sizeof(cnt) };
+  struct msghdr msg = {
+    .msg_iov = &iov, .msg_iovlen = 1,
+    .msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+  };
+
+  ssize_t n;
+  do n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC); while (n < 0 && errno == EINTR);
+  if (n <= 0 || (msg.msg_flags & MSG_CTRUNC)
+      || !reload_read(sock, (char *) &cnt + n, sizeof(cnt) - n))
+    return -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+      || cnt > RELOAD_FDS_PER_MESSAGE
+      || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * cnt))
+    return -1;
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * cnt);
+  return cnt;
+}
+
+void reload_inherit(void) {
+  const char *fd_str = getenv(RELOAD_FD_ENV);
+  if (!fd_str) return;
+  int sock = atoi(fd_str);
+  unsetenv(RELOAD_FD_ENV);
+
+  uint32_t total;
+  if (!reload_read(sock, &total, sizeof(total)) || total > RELOAD_MAX_LISTENERS) {
+    fprintf(stderr, "Failed to take the listening sockets over\n");
+    exit(EXIT_FAILURE);
+  }
+  while (listener_cnt < (int) total) {
+    int cnt = recv_fds(sock, listeners + listener_cnt);
+    if (cnt <= 0 || listener_cnt + cnt > (int) total) {
+      fprintf(stderr, "Failed to take the listening sockets over\n");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < cnt; i++) untaken[listener_cnt + i] = true;
+    listener_cnt += cnt;
+  }
+
+  char with_cache;
+  if (!reload_read(sock, &with_cache, 1)) {
+    fprintf(stderr, "Failed to take the listening sockets over\n");
+    exit(EXIT_FAILURE);
+  }
+  if (with_cache) {
+    int cnt = file_cache_restore(sock);
+    if (cnt < 0) {
+      fprintf(stderr, "Failed to take the file cache over\n");
+      exit(EXIT_FAILURE);
+    }
+    printf("Took over %d cached files\n", cnt);
+  }
+  parent_fd = sock;
+}
+
+/* Returns the port FD is bound to, or -1. */
+static int socket_port(int fd) {
+  struct sockaddr_storage address;
+  socklen_t len = sizeof(address);
+  if (getsockname(fd, (struct sockaddr *) &address, &len) == -1) return -1;
+  if (address.ss_family == AF_INET)
+    return ntohs(((struct sockaddr_in *) &address)->sin_port);
+  if (address.ss_family == AF_INET6)
+    return ntohs(((struct sockaddr_in6 *) &address)->sin6_port);
+  return -1;
+}
+
+int reload_take_listener(int port) {
+  int fd = -1;
+  pthread_mutex_lock(&reload_lock);
+  for (int i = 0; i < listener_cnt && fd == -1; i++) {
+    if (untaken[i] && socket_port(listeners[i]) == port) {
+      untaken[i] = false;
+      fd = listeners[i];
+    }
+  }
+  pthread_mutex_unlock(&reload_lock);
+  return fd;
+}
+
+void reload_add_listener(int fd) {
+  pthread_mutex_lock(&reload_lock);
+  if (listener_cnt < RELOAD_MAX_LISTENERS) listeners[listener_cnt++] = fd;
+  pthread_mutex_unlock(&reload_lock);
+}
+
+/* Hands the listening sockets and, if that's turned on, the file cache
+ * over on SOCK. */
+static bool hand_over(int sock) {
+  pthread_mutex_lock(&reload_lock);
+  uint32_t total = listener_cnt;
+  bool sent = reload_write(sock, &total, sizeof(total));
+  for (uint32_t i = 0; i < total && sent; i += RELOAD_FDS_PER_MESSAGE) {
+    uint32_t cnt = total - i < RELOAD_FDS_PER_MESSAGE ? total - i : RELOAD_FDS_PER_MESSAGE;
+    sent = send_fds(sock, listeners + i, cnt);
+  }
+  pthread_mutex_unlock(&reload_lock);
+
+  char with_cache = cache_enabled;
+  return sent && reload_write(sock, &with_cache, 1)
+      && (!with_cache || file_cache_save(sock));
+}
+
+/* Starts the new process, with the other end of a socket pair on
+ * RELOAD_CHILD_FD, and hands everything over. Returns true once it is
+ * serving, or kills it and returns false. */
+static bool start_successor(void) {
+  int pair[2];
+  if (!reload_argv) return false;
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+    perror("Failed to reload");
+    return false;
+  }
+
+  /* Made before forking, as the child of a threaded process may not
+   * allocate. */
+  extern char **environ;
+  int env_cnt = 0;
+  while (environ[env_cnt]) env_cnt++;
+  char **env = malloc(sizeof(char *) * (env_cnt + 2));
+  if (!env) {
+    close(pair[0]);
+    close(pair[1]);
+    return false;
+  }
+  static char fd_var[] = RELOAD_FD_ENV "=" RELOAD_CHILD_FD_STR;
+  env[0] = fd_var;
+  memcpy(env + 1, environ, sizeof(char *) * (env_cnt + 1));
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("Failed to reload");
+    free(env);
+    close(pair[0]);
+    close(pair[1]);
+    return false;
+  }
+  if (pid == 0) {
+    /* Only the socket pair goes to the new process; the listening
+     * sockets are sent over it, and everything else is left behind.
+     * SIGHUP stays blocked, so one sent early can't kill it. */
+    if (dup2(pair[1], RELOAD_CHILD_FD) == -1) _exit(EXIT_FAILURE);
+    close_range(RELOAD_CHILD_FD + 1, ~0U, 0);
+    execve(reload_argv[0], reload_argv, env);
+    perror("Failed to reload");
+    _exit(EXIT_FAILURE);
+  }
+  free(env);
+  close(pair[1]);
+
+  char ready = 0;
+  bool started = hand_over(pair[0]);
+  if (started) {
+    struct pollfd pfd = { .fd = pair[0], .events = POLLIN };
+    int n;
+    do n = poll(&pfd, 1, RELOAD_READY_TIMEOUT_MS); while (n < 0 && errno == EINTR);
+    started = n > 0 && read(pair[0], &ready, 1) == 1 && ready == 1;
+  }
+  close(pair[0]);
+  if (!started) {
+    fprintf(stderr, "New server failed to start; carrying on\n");
+    kill(pid, SIGKILL);
+  }
+  /* Reaped either way; a running one is no longer our child once we
+   * exit. */
+  if (!started) waitpid(pid, NULL, 0);
+  return started;
+}
+
+/* Returns true once every accepting thread has stopped, interrupting
+ * those still blocked. */
+static bool acceptors_stopped(void) {
+  bool stopped = true;
+  pthread_mutex_lock(&reload_lock);
+  for (int i = 0; i < acceptor_cnt; i++) {
+    if (__atomic_load_n(&acceptors[i].stopped, __ATOMIC_SEQ_CST)) continue;
+    stopped = false;
+    if (__atomic_load_n(&acceptors[i].blocked, __ATOMIC_SEQ_CST))
+      pthread_kill(acceptors[i].thread, SIGUSR2);
+  }
+  pthread_mutex_unlock(&reload_lock);
+  return stopped;
+}
+
+/* Stops accepting, lets the connections we have finish, and exits. */
+static void drain(void) {
+  printf("Reloaded; draining %d connections\n",
+      __atomic_load_n(&connections, __ATOMIC_SEQ_CST));
+  fflush(stdout);
+  __atomic_store_n(&draining, true, __ATOMIC_SEQ_CST);
+
+  long deadline = reload_now_ms() + RELOAD_DRAIN_TIMEOUT_MS;
+  while (!acceptors_stopped() && reload_now_ms() < deadline)
+    usleep(RELOAD_POLL_MS * 1000);
+  while (__atomic_load_n(&connections, __ATOMIC_SEQ_CST) > 0
+      && reload_now_ms() < deadline)
+    usleep(RELOAD_POLL_MS * 1000);
+
+  /* Give the access log its last write. */
+  usleep(2 * ACCESS_LOG_FLUSH_MS * 1000);
+  exit(EXIT_SUCCESS);
+}
+
+/* Waits for SIGHUP, then hands over to a new process. */
+static void *reload_run(void *aux) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  while (1) {
+    int signum;
+    if (sigwait(&set, &signum) != 0) continue;
+    printf("Caught SIGHUP: reloading\n");
+    fflush(stdout);
+    if (start_successor()) drain();
+  }
+  return NULL;
+}
+
+void reload_ready(void) {
+  /* What the old process listened on that we have no use for now. */
+  pthread_mutex_lock(&reload_lock);
+  int kept = 0;
+  for (int i = 0; i < listener_cnt; i++) {
+    if (untaken[i]) {
+      close(listeners[i]);
+      untaken[i] = false;
+    } else {
+      listeners[kept++] = listeners[i];
+    }
+  }
+  listener_cnt = kept;
+  pthread_mutex_unlock(&reload_lock);
+
+  if (parent_fd != -1) {
+    char ready = 1;
+    reload_write(parent_fd, &ready, 1);
+    close(parent_fd);
+    parent_fd = -1;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, reload_run, NULL) == 0)
+    pthread_detach(thread);
+}
+
+bool reload_draining(void) {
+  return __atomic_load_n(&draining, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the calling thread's acceptor, registering it the first time. */
+static struct acceptor *reload_self(void) {
+  if (self) return self;
+  pthread_mutex_lock(&reload_lock);
+  if (acceptor_cnt < RELOAD_MAX_ACCEPTORS) {
+    self = &acceptors[acceptor_cnt++];
+    self->thread = pthread_self();
+  }
+  pthread_mutex_unlock(&reload_lock);
+  return self;
+}
+
+void reload_accepting(bool blocked) {
+  struct acceptor *acceptor = reload_self();
+  if (acceptor) __atomic_store_n(&acceptor->blocked, blocked, __ATOMIC_SEQ_CST);
+}
+
+void reload_stop_accepting(void) {
+  struct acceptor *acceptor = reload_self();
+  if (!acceptor) return;
+  __atomic_store_n(&acceptor->blocked, false, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&acceptor->stopped, true, __ATOMIC_SEQ_CST);
+}
+
+void reload_park(void) {
+  reload_stop_accepting();
+  while (1) pause();
+}
+
+void reload_connection_opened(void) {
+  __atomic_add_fetch(&connections, 1, __ATOMIC_SEQ_CST);
+}
+
+void reload_connection_closed(void) {
+  __atomic_sub_fetch(&connections, 1, __ATOMIC_SEQ_CST);
+}
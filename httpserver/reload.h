@@ -0,0 +1,82 @@
+#ifndef __RELOAD__
+#define __RELOAD__
+
+#include <stdbool.h>
+
+/* Reloading without downtime. On SIGHUP the server starts a new process,
+ * running whatever binary its command now names, with the same arguments,
+ * and hands it its listening sockets over a UNIX socket (SCM_RIGHTS). The
+ * sockets never close, so clients connecting meanwhile wait in their
+ * backlog for whichever process accepts them.
+ *
+ * Once the new process says it is serving, the old one drains: it stops
+ * accepting, answers the requests it has, keeps no connection alive past
+ * its current response, and exits once the last is closed, or after
+ * RELOAD_DRAIN_TIMEOUT_MS. If the new process fails to start, the old one
+ * carries on as if nothing happened.
+ *
+ * With the file cache handed over as well, the old process sends its
+ * entries after the sockets, and the new one starts with them. Each is
+ * checked against its file on its first hit, as an entry that has gone
+ * unchecked for a while is. */
+
+/* Environment variable telling a new process which fd the old one is on. */
+#define RELOAD_FD_ENV "HTTPSERVER_RELOAD_FD"
+
+/* How long the new process has to start serving, in ms. */
+#define RELOAD_READY_TIMEOUT_MS 10000
+
+/* How long the old process waits for its connections to finish, in ms. */
+#define RELOAD_DRAIN_TIMEOUT_MS 30000
+
+/* Most listening sockets handed over. */
+#define RELOAD_MAX_LISTENERS 1024
+
+/* Copies ARGV, the server's arguments, to start the new process with,
+ * and keeps SIGHUP for the thread reload_ready() starts. Call first thing
+ * in main(), before any thread is started. */
+void reload_init(char **argv);
+
+/* Hands the file cache to the new process too. */
+void reload_enable_cache(void);
+
+/* If an old process started this one, takes the listening sockets and
+ * file cache it hands over. Exits if that fails, since the old process
+ * will carry on. Call after file_cache_init() and before any listening
+ * socket is opened. */
+void reload_inherit(void);
+
+/* Returns a listening socket on PORT inherited from the old process and
+ * not taken yet, or -1 if there's none; then open one and pass it to
+ * reload_add_listener(). */
+int reload_take_listener(int port);
+
+/* Adds FD to the listening sockets handed over on reload. */
+void reload_add_listener(int fd);
+
+/* Call once the server has its listening sockets and is about to serve.
+ * Tells the old process, if any, to drain, and starts waiting for SIGHUP. */
+void reload_ready(void);
+
+/* Returns true once this process is draining: it should accept nothing
+ * more, and keep no connection alive. */
+bool reload_draining(void);
+
+/* Call with BLOCKED set before an accepting thread blocks in accept() or
+ * epoll_wait(), and cleared after. A draining process interrupts it
+ * there, so it can stop. */
+void reload_accepting(bool blocked);
+
+/* Call once an accepting thread has stopped accepting for good. */
+void reload_stop_accepting(void);
+
+/* For an accepting thread that has nothing else to do once draining:
+ * stops accepting and blocks forever. */
+void reload_park(void);
+
+/* Counts a client connection opened or closed, so a draining process
+ * knows when it's done. */
+void reload_connection_opened(void);
+void reload_connection_closed(void);
+
+#endif
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhttp.h"
+#include "proxy.h"
+#include "stats.h"
+
+/* Status codes counted one by one, from 100; others are counted together
+ * in the last slot. */
+#define STATS_STATUS_CNT 501
+
+/* Most backends reported. */
+#define STATS_BACKENDS_MAX 64
+
+/* One thread's counts. Only its thread writes them, with atomic stores so
+ * a reader never sees a torn value. */
+struct stats_block {
+  uint64_t counters[STATS_COUNTER_CNT];
+  struct {
+    uint64_t statuses[STATS_STATUS_CNT];
+    uint64_t bytes;
+    uint64_t latency[STATS_LATENCY_BUCKETS];
+    uint64_t latency_sum_us;
+  } handlers[STATS_HANDLER_CNT];
+  struct stats_block *next;
+} __attribute__((aligned(64)));
+
+static const long stats_latency_bounds[] = STATS_LATENCY_BOUNDS;
+static const char *stats_handler_names[STATS_HANDLER_CNT] = { "files", "proxy" };
+
+static bool stats_enabled;
+static long stats_started_us;
+static struct pool *stats_pool;
+
+/* Every thread's block. Blocks are only ever added, at the front. */
+static struct stats_block *stats_blocks;
+static __thread struct stats_block *stats_mine;
+
+static long stats_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void stats_enable(void) {
+  stats_enabled = true;
+  stats_started_us = stats_now_us();
+}
+
+void stats_watch_pool(struct pool *pool) {
+  stats_pool = pool;
+}
+
+/* Returns this thread's block, making it on first use. */
+static struct stats_block *stats_block(void) {
+  if (stats_mine) return stats_mine;
+  struct stats_block *block;
+  if (posix_memalign((void **) &block, 64, sizeof(struct stats_block)) != 0)
+    return NULL;
+  memset(block, 0, sizeof(struct stats_block));
+  block->next = __atomic_load_n(&stats_blocks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&stats_blocks, &block->next, block,
+        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    continue;
+  stats_mine = block;
+  return block;
+}
+
+/* Adds N to the calling thread's COUNTER. */
+static inline void stats_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void stats_count(enum stats_counter counter) {
+  if (!stats_enabled) return;
+  struct stats_block *block = stats_block();
+  if (block) stats_add(&block->counters[counter], 1);
+}
+
+long stats_start(void) {
+  return stats_enabled ? stats_now_us() : 0;
+}
+
+void stats_request(enum stats_handler handler, int status, long long bytes, long start) {
+  if (!stats_enabled) return;
+  struct stats_block *block = stats_block();
+  if (!block) return;
+
+  long latency_us = stats_now_us() - start;
+  int bucket = 0;
+  while (bucket < STATS_LATENCY_BUCKETS - 1 && latency_us > stats_latency_bounds[bucket])
+    bucket++;
+  int slot = status >= 100 && status < 100 + STATS_STATUS_CNT - 1
+      ? status - 100 : STATS_STATUS_CNT - 1;
+
+  stats_add(&block->handlers[handler].statuses[slot], 1);
+  if (bytes > 0) stats_add(&block->handlers[handler].bytes, bytes);
+  stats_add(&block->handlers[handler].latency[bucket], 1);
+  stats_add(&block->handlers[handler].latency_sum_us, latency_us);
+}
+
+bool stats_is_request(const char *path, size_t path_len) {
+  size_t len = strlen(STATS_PATH);
+  return stats_enabled && path_len >= len && memcmp(path, STATS_PATH, len) == 0
+      && (path_len == len || path[len] == '?');
+}
+
+/* Adds every thread's block into TOTAL. */
+static void stats_sum(struct stats_block *total) {
+  uint64_t *sum = (uint64_t *) total;
+  size_t cnt = offsetof(struct stats_block, next) / sizeof(uint64_t);
+  for (struct stats_block *block = __atomic_load_n(&stats_blocks, __ATOMIC_ACQUIRE);
+      block; block = block->next) {
+    uint64_t *counts = (uint64_t *) block;
+    for (size_t i = 0; i < cnt; i++)
+      sum[i] += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+  }
+}
+
+/* What the stats report besides the threads' counts. */
+struct stats_gauges {
+  long uptime_us;
+  uint64_t active;
+  int queue_depth;        /* -1 if there is no queue. */
+  int workers;
+  struct proxy_backend_stats backends[STATS_BACKENDS_MAX];
+  int backend_cnt;
+};
+
+static void stats_write_json(FILE *out, const struct stats_block *total,
+    const struct stats_gauges *gauges) {
+  const uint64_t *c = total->counters;
+  uint64_t lookups = c[STATS_CACHE_HITS] + c[STATS_CACHE_MISSES];
+  fprintf(out, "{\"uptime_s\":%.3f,", gauges->uptime_us / 1e6);
+  fprintf(out, "\"connections\":{\"active\":%llu,\"opened\":%llu},",
+      (unsigned long long) gauges->active,
+      (unsigned long long) c[STATS_CONNECTIONS_OPENED]);
+  fprintf(out, "\"queue\":{\"depth\":%d,\"workers\":%d,\"shed\":%llu,"
+      "\"rate_limited\":%llu},",
+      gauges->queue_depth, gauges->workers, (unsigned long long) c[STATS_SHED],
+      (unsigned long long) c[STATS_RATE_LIMITED]);
+  fprintf(out, "\"cache\":{\"hits\":%llu,\"misses\":%llu,\"hit_ratio\":%.4f,"
+      "\"stale\":%llu,\"collapsed\":%llu,\"fd_hits\":%llu,\"fd_misses\":%llu},",
+      (unsigned long long) c[STATS_CACHE_HITS], (unsigned long long) c[STATS_CACHE_MISSES],
+      lookups ? (double) c[STATS_CACHE_HITS] / lookups : 0.0,
+      (unsigned long long) c[STATS_CACHE_STALE], (unsigned long long) c[STATS_CACHE_COLLAPSED],
+      (unsigned long long) c[STATS_FD_CACHE_HITS],
+      (unsigned long long) c[STATS_FD_CACHE_MISSES]);
+
+  fprintf(out, "\"handlers\":{");
+  for (int h = 0; h < STATS_HANDLER_CNT; h++) {
+    uint64_t requests = 0;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) requests += total->handlers[h].latency[b];
+    fprintf(out, "%s\"%s\":{\"requests\":%llu,\"bytes\":%llu,\"status\":{", h ? "," : "",
+        stats_handler_names[h], (unsigned long long) requests,
+        (unsigned long long) total->handlers[h].bytes);
+    const char *sep = "";
+    for (int s = 0; s < STATS_STATUS_CNT; s++) {
+      if (total->handlers[h].statuses[s] == 0) continue;
+      if (s == STATS_STATUS_CNT - 1)
+        fprintf(out, "%s\"other\":", sep);
+      else
+        fprintf(out, "%s\"%d\":", sep, s + 100);
+      fprintf(out, "%llu", (unsigned long long) total->handlers[h].statuses[s]);
+      sep = ",";
+    }
+    fprintf(out, "},\"latency_us\":{\"buckets\":{");
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+      if (b < STATS_LATENCY_BUCKETS - 1)
+        fprintf(out, "%s\"%ld\":", b ? "," : "", stats_latency_bounds[b]);
+      else
+        fprintf(out, ",\"+Inf\":");
+      fprintf(out, "%llu", (unsigned long long) total->handlers[h].latency[b]);
+    }
+    fprintf(out, "},\"sum\":%llu}}",
+        (unsigned long long) total->handlers[h].latency_sum_us);
+  }
+  fprintf(out, "},");
+
+  fprintf(out, "\"upstreams\":[");
+  for (int i = 0; i < gauges->backend_cnt; i++) {
+    const struct proxy_backend_stats *b = &gauges->backends[i];
+    fprintf(out, "%s{\"backend\":\"%s\",\"up\":%s,\"active\":%d,\"idle\":%d}",
+        i ? "," : "", b->name, b->down ? "false" : "true",
+        b->active, b->idle);
+  }
+  fprintf(out, "]}\n");
+}
+
+static void stats_write_prometheus(FILE *out, const struct stats_block *total,
+    const struct stats_gauges *gauges) {
+  const uint64_t *c = total->counters;
+  fprintf(out, "# TYPE httpserver_uptime_seconds gauge\n"
+      "httpserver_uptime_seconds %.3f\n", gauges->uptime_us / 1e6);
+  fprintf(out, "# TYPE httpserver_connections_active gauge\n"
+      "httpserver_connections_active %llu\n", (unsigned long long) gauges->active);
+  fprintf(out, "# TYPE httpserver_connections_total counter\n"
+      "httpserver_connections_total %llu\n",
+      (unsigned long long) c[STATS_CONNECTIONS_OPENED]);
+  if (gauges->queue_depth >= 0)
+    fprintf(out, "# TYPE httpserver_queue_depth gauge\n"
+        "httpserver_queue_depth %d\n"
+        "# TYPE httpserver_workers gauge\n"
+        "httpserver_workers %d\n", gauges->queue_depth, gauges->workers);
+  fprintf(out, "# TYPE httpserver_shed_total counter\n"
+      "httpserver_shed_total %llu\n", (unsigned long long) c[STATS_SHED]);
+  fprintf(out, "# TYPE httpserver_rate_limited_total counter\n"
+      "httpserver_rate_limited_total %llu\n", (unsigned long long) c[STATS_RATE_LIMITED]);
+  fprintf(out, "# TYPE httpserver_cache_hits_total counter\n"
+      "httpserver_cache_hits_total %llu\n", (unsigned long long) c[STATS_CACHE_HITS]);
+  fprintf(out, "# TYPE httpserver_cache_misses_total counter\n"
+      "httpserver_cache_misses_total %llu\n", (unsigned long long) c[STATS_CACHE_MISSES]);
+  fprintf(out, "# TYPE httpserver_cache_stale_total counter\n"
+      "httpserver_cache_stale_total %llu\n", (unsigned long long) c[STATS_CACHE_STALE]);
+  fprintf(out, "# TYPE httpserver_cache_collapsed_total counter\n"
+      "httpserver_cache_collapsed_total %llu\n",
+      (unsigned long long) c[STATS_CACHE_COLLAPSED]);
+  fprintf(out, "# TYPE httpserver_fd_cache_hits_total counter\n"
+      "httpserver_fd_cache_hits_total %llu\n", (unsigned long long) c[STATS_FD_CACHE_HITS]);
+  fprintf(out, "# TYPE httpserver_fd_cache_misses_total counter\n"
+      "httpserver_fd_cache_misses_total %llu\n",
+      (unsigned long long) c[STATS_FD_CACHE_MISSES]);
+
+  fprintf(out, "# TYPE httpserver_requests_total counter\n");
+  for (int h = 0; h < STATS_HANDLER_CNT; h++) {
+    for (int s = 0; s < STATS_STATUS_CNT; s++) {
+      if (total->handlers[h].statuses[s] == 0) continue;
+      fprintf(out, "httpserver_requests_total{handler=\"%s\",code=\"", stats_handler_names[h]);
+      if (s == STATS_STATUS_CNT - 1)
+        fprintf(out, "other");
+      else
+        fprintf(out, "%d", s + 100);
+      fprintf(out, "\"} %llu\n", (unsigned long long) total->handlers[h].statuses[s]);
+    }
+  }
+  fprintf(out, "# TYPE httpserver_sent_bytes_total counter\n");
+  for (int h = 0; h < STATS_HANDLER_CNT; h++)
+    fprintf(out, "httpserver_sent_bytes_total{handler=\"%s\"} %llu\n",
+        stats_handler_names[h], (unsigned long long) total->handlers[h].bytes);
+
+  fprintf(out, "# TYPE httpserver_request_duration_seconds histogram\n");
+  for (int h = 0; h < STATS_HANDLER_CNT; h++) {
+    uint64_t cumulative = 0;
+    for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+      cumulative += total->handlers[h].latency[b];
+      fprintf(out, "httpserver_request_duration_seconds_bucket{handler=\"%s\",le=\"",
+          stats_handler_names[h]);
+      if (b < STATS_LATENCY_BUCKETS - 1)
+        fprintf(out, "%g", stats_latency_bounds[b] / 1e6);
+      else
+        fprintf(out, "+Inf");
+      fprintf(out, "\"} %llu\n", (unsigned long long) cumulative);
+    }
+    fprintf(out, "httpserver_request_duration_seconds_sum{handler=\"%s\"} %.6f\n",
+        stats_handler_names[h], total->handlers[h].latency_sum_us / 1e6);
+    fprintf(out, "httpserver_request_duration_seconds_count{handler=\"%s\"} %llu\n",
+        stats_handler_names[h], (unsigned long long) cumulative);
+  }
+
+  if (gauges->backend_cnt > 0) {
+    static const char *names[] = { "up", "active", "idle" };
+    for (int g = 0; g < 3; g++) {
+      fprintf(out, "# TYPE httpserver_upstream_%s gauge\n", names[g]);
+      for (int i = 0; i < gauges->backend_cnt; i++) {
+        const struct proxy_backend_stats *b = &gauges->backends[i];
+        int value = g == 0 ? !b->down : g == 1 ? b->active : b->idle;
+        fprintf(out, "httpserver_upstream_%s{backend=\"%s\"} %d\n", names[g],
+            b->name, value);
+      }
+    }
+  }
+}
+
+char *stats_render(const char *path, size_t path_len, const char **content_type,
+    size_t *size) {
+  struct stats_block *total = calloc(1, sizeof(struct stats_block));
+  struct stats_gauges *gauges = calloc(1, sizeof(struct stats_gauges));
+  char *text = NULL;
+  FILE *out = total && gauges ? open_memstream(&text, size) : NULL;
+  if (!out) {
+    free(total);
+    free(gauges);
+    return NULL;
+  }
+
+  stats_sum(total);
+  gauges->uptime_us = stats_now_us() - stats_started_us;
+  /* Opened and closed are counted by whichever threads did each, so only
+   * their totals are comparable. */
+  gauges->active = total->counters[STATS_CONNECTIONS_OPENED]
+      - total->counters[STATS_CONNECTIONS_CLOSED];
+  if (gauges->active > total->counters[STATS_CONNECTIONS_OPENED]) gauges->active = 0;
+  gauges->queue_depth = stats_pool ? wq_depth(stats_pool->queue) : -1;
+  gauges->workers = stats_pool ? pool_workers(stats_pool) : 0;
+  gauges->backend_cnt = proxy_get_stats(gauges->backends, STATS_BACKENDS_MAX);
+  if (gauges->backend_cnt > STATS_BACKENDS_MAX) gauges->backend_cnt = STATS_BACKENDS_MAX;
+
+  const char *query = memchr(path, '?', path_len);
+  if (query && memmem(query, path + path_len - query, "format=prometheus",
+        strlen("format=prometheus"))) {
+    *content_type = "text/plain; version=0.0.4";
+    stats_write_prometheus(out, total, gauges);
+  } else {
+    *content_type = "application/json";
+    stats_write_json(out, total, gauges);
+  }
+  fclose(out);
+  free(total);
+  free(gauges);
+  return text;
+}
+
+void stats_send(int fd, const char *path, size_t path_len, int keep_alive) {
+  const char *content_type;
+  size_t size;
+  char *text = stats_render(path, path_len, &content_type, &size);
+  struct http_response response;
+  char content_length[32];
+  snprintf(content_length, sizeof(content_length), "%zu", text ? size : 0);
+
+  http_response_begin(&response, fd, text ? 200 : 500);
+  if (text) http_response_header(&response, "Content-Type", (char *) content_type);
+  http_response_header(&response, "Content-Length", content_length);
+  http_response_header(&response, "Cache-Control", "no-store");
+  http_response_header(&response, "Connection", keep_alive ? "keep-alive" : "close");
+  http_response_flush(&response, text, text ? size : 0);
+  free(text);
+}
@@ -0,0 +1,78 @@
+#ifndef __STATS__
+#define __STATS__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pool.h"
+
+/* Live counters, served as JSON at STATS_PATH, or as Prometheus text at
+ * STATS_PATH?format=prometheus, once stats_enable() is called. Each thread
+ * counts into a block of its own, which only it writes, so counting takes
+ * no lock and no cache line is shared between threads; a request for the
+ * stats adds up every thread's block as it reads them. Gauges kept
+ * elsewhere, the work queue's depth and workers and the proxy's pools, are
+ * read then too. Requests for the stats aren't counted themselves. */
+
+#define STATS_PATH "/__stats"
+
+/* Who answered a request. */
+enum stats_handler {
+  STATS_FILES,
+  STATS_PROXY,
+  STATS_HANDLER_CNT
+};
+
+/* Events counted. */
+enum stats_counter {
+  STATS_CONNECTIONS_OPENED,
+  STATS_CONNECTIONS_CLOSED,
+  STATS_CACHE_HITS,
+  STATS_CACHE_MISSES,
+  STATS_CACHE_STALE,      /* Proxy cache entries served while revalidated. */
+  STATS_CACHE_COLLAPSED,  /* Proxy cache misses that waited on another's fetch. */
+  STATS_FD_CACHE_HITS,    /* Large files sent from an fd kept open. */
+  STATS_FD_CACHE_MISSES,  /* Large files opened to be kept. */
+  STATS_SHED,             /* Clients turned away with a 503 by the queue. */
+  STATS_RATE_LIMITED,     /* Clients turned away by the rate limit. */
+  STATS_COUNTER_CNT
+};
+
+/* Latency buckets' upper bounds, in µs. A last bucket counts the rest. */
+#define STATS_LATENCY_BOUNDS { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, \
+    50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 }
+#define STATS_LATENCY_BUCKETS 17
+
+/* Turns the stats on. Call before any other stats function. */
+void stats_enable(void);
+
+/* Reports the depth of POOL's queue and how many workers it runs in the
+ * stats. */
+void stats_watch_pool(struct pool *pool);
+
+/* Counts one COUNTER event for the calling thread. */
+void stats_count(enum stats_counter counter);
+
+/* Returns when a request starts, to pass to stats_request(), or 0 if the
+ * stats are off. */
+long stats_start(void);
+
+/* Counts a request HANDLER answered with STATUS after sending BYTES bytes,
+ * or an unknown number if BYTES is negative, that began at START. */
+void stats_request(enum stats_handler handler, int status, long long bytes, long start);
+
+/* Returns whether the PATH_LEN-byte PATH asks for the stats, and they are
+ * on. */
+bool stats_is_request(const char *path, size_t path_len);
+
+/* Returns the stats, in the format the PATH_LEN-byte PATH asks for, as a
+ * string of *SIZE bytes the caller must free, with its Content-Type in
+ * *CONTENT_TYPE. Returns NULL if out of memory. */
+char *stats_render(const char *path, size_t path_len, const char **content_type,
+    size_t *size);
+
+/* Answers a request for the PATH_LEN-byte PATH on FD with the stats,
+ * keeping the connection open afterwards if KEEP_ALIVE is set. */
+void stats_send(int fd, const char *path, size_t path_len, int keep_alive);
+
+#endif
@@ -0,0 +1,41 @@
+#define _GNU_SOURCE
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "tcptune.h"
+
+struct tcp_tuning tcp_tuning = { .backlog = TCP_TUNE_DEFAULT_BACKLOG };
+
+/* Sets the int option NAME at LEVEL on FD to VALUE, saying so if the
+ * kernel won't. */
+static void tcp_tune_set(int fd, int level, int name, int value, const char *what) {
+  if (setsockopt(fd, level, name, &value, sizeof(value)) == -1) perror(what);
+}
+
+int tcp_tune_listen(int fd) {
+  if (tcp_tuning.defer_accept_s > 0)
+    tcp_tune_set(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, tcp_tuning.defer_accept_s,
+        "Failed to set TCP_DEFER_ACCEPT");
+  if (tcp_tuning.fastopen_qlen > 0)
+    tcp_tune_set(fd, IPPROTO_TCP, TCP_FASTOPEN, tcp_tuning.fastopen_qlen,
+        "Failed to set TCP_FASTOPEN");
+  /* Accepted sockets inherit it. */
+  if (tcp_tuning.busy_poll_us > 0)
+    tcp_tune_set(fd, SOL_SOCKET, SO_BUSY_POLL, tcp_tuning.busy_poll_us,
+        "Failed to set SO_BUSY_POLL");
+  return listen(fd, tcp_tuning.backlog);
+}
+
+void tcp_tune_accepted(int fd) {
+  if (tcp_tuning.nodelay) tcp_tune_set(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+}
+
+void tcp_tune_upstream(int fd) {
+  /* Heads are written whole, so don't hold back the last piece of one. */
+  tcp_tune_set(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  if (tcp_tuning.busy_poll_us > 0)
+    tcp_tune_set(fd, SOL_SOCKET, SO_BUSY_POLL, tcp_tuning.busy_poll_us, "SO_BUSY_POLL");
+}
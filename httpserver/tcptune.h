@@ -0,0 +1,48 @@
+#ifndef __TCPTUNE__
+#define __TCPTUNE__
+
+#include <stdbool.h>
+
+/* TCP tuning set from the command line, for the listening sockets, the
+ * connections accepted on them, and in proxy mode the connections to the
+ * backends. Whatever isn't asked for is left at the kernel's default.
+ *
+ *   backlog          How many connections the kernel queues for accept().
+ *   defer_accept_s   TCP_DEFER_ACCEPT: a connection isn't handed to accept()
+ *                    until its request starts arriving, up to this many
+ *                    seconds, so a worker or loop isn't woken to wait on it.
+ *   fastopen_qlen    TCP_FASTOPEN: clients that have connected before may
+ *                    send their request with the SYN, saving a round trip;
+ *                    up to this many such connections may be pending.
+ *   nodelay          TCP_NODELAY: don't hold the last small segment of a
+ *                    response back waiting on the client's ACK. Responses
+ *                    written a piece at a time are corked meanwhile, so
+ *                    they don't go out as a segment per piece.
+ *   busy_poll_us     SO_BUSY_POLL: a blocking read on a socket spins on the
+ *                    device's queue for up to this many µs before sleeping,
+ *                    trading CPU for latency. The event loops' epoll_wait()
+ *                    only busy polls per net.core.busy_poll. */
+
+#define TCP_TUNE_DEFAULT_BACKLOG 1024
+
+struct tcp_tuning {
+  int backlog;
+  int defer_accept_s;
+  int fastopen_qlen;
+  bool nodelay;
+  int busy_poll_us;
+};
+
+extern struct tcp_tuning tcp_tuning;
+
+/* Applies the listener options to FD, a bound socket, and listens on it.
+ * Returns like listen(). */
+int tcp_tune_listen(int fd);
+
+/* Applies the connection options to FD, just accepted. */
+void tcp_tune_accepted(int fd);
+
+/* Applies the connection options to FD, connected to a backend. */
+void tcp_tune_upstream(int fd);
+
+#endif
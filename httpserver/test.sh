@@ -0,0 +1,67 @@
+#!/bin/bash
+# Sends pipelined requests to httpserver serving files/, with a thread pool
+# and with an event loop, each from the file cache and with sendfile(), and
+# checks that every response is framed so the next one can be found.
+# Set PORT to change the first port used.
+#
+# Usage: ./test.sh   (or "make test")
+
+PORT=${PORT:-8200}
+PIDS=()
+RESPONSE=$(mktemp)
+trap 'kill "${PIDS[@]}" 2>/dev/null; rm -f "$RESPONSE"' EXIT
+failed=0
+count=0
+
+# Starts a server on port P with the rest of the arguments.
+start() {
+  local p=$1
+  shift
+  ./httpserver --files files --port "$p" "$@" >/dev/null 2>&1 &
+  PIDS+=($!)
+}
+
+# Sends REQUESTS on one connection to port P, leaving what comes back in
+# $RESPONSE. The last request should close the connection.
+send() {
+  local p=$1 requests=$2
+  exec 3<>"/dev/tcp/127.0.0.1/$p" || return 1
+  printf '%b' "$requests" >&3
+  timeout 5 cat <&3 > "$RESPONSE"
+  exec 3<&-
+}
+
+# Sends HEAD and then GET for PATH to port P on one connection, and checks
+# that only the GET's response has a body: that what comes before the
+# file's bytes is two responses' headers and nothing else.
+check_head_get() {
+  local name=$1 p=$2 path=$3 file=files$3 size
+  size=$(stat -c %s "$file")
+  count=$((count + 1))
+  send "$p" "HEAD $path HTTP/1.1\r\nHost: test\r\n\r\nGET $path HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n"
+  local headers=$(head -c -"$size" "$RESPONSE")
+  if ! tail -c "$size" "$RESPONSE" | cmp -s - "$file" \
+      || [ "$(grep -c '^HTTP/1.1 200 ' <<< "$headers")" != 2 ] \
+      || grep -qvE $'^(HTTP/1.1 [0-9]{3} .*|[A-Za-z-]+: .*|)\r$' <<< "$headers"; then
+    echo "FAIL: $name"
+    head -c 2000 "$RESPONSE" | sed 's/^/  /'
+    echo
+    failed=$((failed + 1))
+  fi
+}
+
+start $PORT --num-threads 2
+start $((PORT + 1)) --num-threads 2 --cache-size 0
+start $((PORT + 2)) --event-loop
+start $((PORT + 3)) --event-loop --cache-size 0
+sleep 0.5
+
+for path in /index.html /my_documents/credit.txt; do
+  check_head_get "thread pool, cached, $path" $PORT $path
+  check_head_get "thread pool, sendfile, $path" $((PORT + 1)) $path
+  check_head_get "event loop, cached, $path" $((PORT + 2)) $path
+  check_head_get "event loop, sendfile, $path" $((PORT + 3)) $path
+done
+
+echo "$((count - failed)) of $count passed"
+[ $failed -eq 0 ]
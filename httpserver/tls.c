@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "tls.h"
+
+static SSL_CTX *tls_ctx;
+
+/* Protocols offered by ALPN, in order of preference, each after its
+ * length. */
+static const unsigned char tls_alpn_protocols[] = "\x02h2\x08http/1.1";
+
+/* Picks the protocol the connection speaks from those the client offers,
+ * or none if it offers neither of ours; it is then spoken to in HTTP/1.1.
+ * An HTTP/2 client starts with the preface, which the files handler
+ * spots, so the choice needn't be passed on. */
+static int tls_select_alpn(SSL *ssl, const unsigned char **out, unsigned char *out_len,
+    const unsigned char *in, unsigned int in_len, void *arg) {
+  unsigned char *selected;
+  if (SSL_select_next_proto(&selected, out_len, tls_alpn_protocols,
+        sizeof(tls_alpn_protocols) - 1, in, in_len) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+void tls_init(const char *cert_path, const char *key_path) {
+  tls_ctx = SSL_CTX_new(TLS_server_method());
+  if (!tls_ctx) {
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+  }
+  SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+  SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+      | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_CTX_set_alpn_select_cb(tls_ctx, tls_select_alpn, NULL);
+
+  if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert_path) != 1
+      || SSL_CTX_use_PrivateKey_file(tls_ctx, key_path, SSL_FILETYPE_PEM) != 1
+      || SSL_CTX_check_private_key(tls_ctx) != 1) {
+    fprintf(stderr, "Cannot load certificate %s and key %s:\n", cert_path, key_path);
+    ERR_print_errors_fp(stderr);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Makes reads and writes on FD fail after MS ms of waiting, or never if
+ * MS is 0. */
+static void tls_set_timeout(int fd, int option, int ms) {
+  struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+  setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+
+static ssize_t tls_read(void *aux, void *buf, size_t len) {
+  SSL *ssl = aux;
+  int n = SSL_read(ssl, buf, len > INT_MAX ? INT_MAX : len);
+  if (n > 0) return n;
+  int error = SSL_get_error(ssl, n);
+  ERR_clear_error();
+  if (error == SSL_ERROR_ZERO_RETURN) return 0;
+  if (error != SSL_ERROR_SYSCALL || errno == 0) errno = EIO;
+  return -1;
+}
+
+static int tls_pending(void *aux) {
+  return SSL_pending(aux) > 0;
+}
+
+/* Sets *EVENTS to what FD must be polled for after SSL returned N.
+ * Returns false if the session is done with, by close or failure. */
+static bool tls_wants(SSL *ssl, int n, short *events) {
+  switch (SSL_get_error(ssl, n)) {
+    case SSL_ERROR_WANT_READ:
+      *events |= POLLIN;
+      return true;
+    case SSL_ERROR_WANT_WRITE:
+      *events |= POLLOUT;
+      return true;
+    default:
+      ERR_clear_error();
+      return false;
+  }
+}
+
+/* A connection the kernel couldn't take: the session on FD and the end of
+ * the socket pair APP it is relayed to. */
+struct tls_relay {
+  SSL *ssl;
+  int fd;
+  int app;
+};
+
+/* Relays between RELAY's session and APP until APP has nothing more to
+ * send and all of it is sent, or either side fails. Closes APP, so a
+ * handler still writing to the other end finds out. */
+static void *tls_relay_run(void *aux) {
+  struct tls_relay *relay = aux;
+  SSL *ssl = relay->ssl;
+  char in[TLS_RELAY_BUFFER_SIZE], out[TLS_RELAY_BUFFER_SIZE];
+  size_t in_off = 0, in_len = 0, out_off = 0, out_len = 0;
+  bool client_done = false, app_done = false, failed = false;
+
+  fcntl(relay->fd, F_SETFL, fcntl(relay->fd, F_GETFL) | O_NONBLOCK);
+  fcntl(relay->app, F_SETFL, fcntl(relay->app, F_GETFL) | O_NONBLOCK);
+
+  while (!failed && !(app_done && out_len == 0)) {
+    short fd_events = 0, app_events = 0;
+    bool progress = false;
+    ssize_t n;
+
+    /* From the client to the handler. */
+    if (!client_done && in_len == 0) {
+      n = SSL_read(ssl, in, sizeof(in));
+      if (n > 0) {
+        in_off = 0;
+        in_len = n;
+        progress = true;
+      } else if (!tls_wants(ssl, n, &fd_events)) {
+        client_done = true;
+        shutdown(relay->app, SHUT_WR);
+        progress = true;
+      }
+    }
+    if (in_len > 0) {
+      n = write(relay->app, in + in_off, in_len);
+      if (n > 0) {
+        in_off += n;
+        in_len -= n;
+        progress = true;
+      } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        app_events |= POLLOUT;
+      } else if (n < 0 && errno != EINTR) {
+        failed = true;
+      }
+    }
+
+    /* From the handler to the client. */
+    if (!app_done && out_len == 0) {
+      n = read(relay->app, out, sizeof(out));
+      if (n > 0) {
+        out_off = 0;
+        out_len = n;
+        progress = true;
+      } else if (n == 0) {
+        app_done = true;
+        progress = true;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        app_events |= POLLIN;
+      } else if (errno != EINTR) {
+        failed = true;
+      }
+    }
+    if (out_len > 0) {
+      n = SSL_write(ssl, out + out_off, out_len);
+      if (n > 0) {
+        out_off += n;
+        out_len -= n;
+        progress = true;
+      } else if (!tls_wants(ssl, n, &fd_events)) {
+        failed = true;
+      }
+    }
+
+    if (progress || failed) continue;
+    struct pollfd pfds[2] = {
+      { .fd = fd_events ? relay->fd : -1, .events = fd_events },
+      { .fd = app_events ? relay->app : -1, .events = app_events },
+    };
+    if (poll(pfds, 2, -1) < 0 && errno != EINTR) failed = true;
+  }
+
+  if (!failed) SSL_shutdown(ssl);
+  close(relay->app);
+  return NULL;
+}
+
+void tls_serve(int fd, tls_handler_t handler) {
+  SSL *ssl = SSL_new(tls_ctx);
+  if (!ssl) return;
+  tls_set_timeout(fd, SO_RCVTIMEO, TLS_HANDSHAKE_TIMEOUT_MS);
+  tls_set_timeout(fd, SO_SNDTIMEO, TLS_HANDSHAKE_TIMEOUT_MS);
+  if (SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+    ERR_clear_error();
+    SSL_free(ssl);
+    return;
+  }
+  /* From here reads and writes may stall as long as on a plain
+   * connection. */
+  tls_set_timeout(fd, SO_RCVTIMEO, http_body_timeout_ms);
+  tls_set_timeout(fd, SO_SNDTIMEO, http_body_timeout_ms);
+
+  /* Records are written whole, so none need wait to be filled out; an
+   * HTTP/2 client may be waiting on the last of a flow control window. */
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+    struct http_conn_io io = { .read = tls_read, .pending = tls_pending, .aux = ssl };
+    handler(fd, &io);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    return;
+  }
+
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+    SSL_free(ssl);
+    return;
+  }
+  struct tls_relay relay = { .ssl = ssl, .fd = fd, .app = pair[1] };
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, tls_relay_run, &relay) != 0) {
+    close(pair[0]);
+    close(pair[1]);
+    SSL_free(ssl);
+    return;
+  }
+  handler(pair[0], NULL);
+  close(pair[0]);
+  pthread_join(thread, NULL);
+  SSL_free(ssl);
+}
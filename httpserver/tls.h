@@ -0,0 +1,39 @@
+#ifndef __TLS__
+#define __TLS__
+
+#include "libhttp.h"
+
+/* HTTPS. OpenSSL does the handshake and then hands the connection's
+ * record encryption to the kernel (kTLS). Once the kernel has taken the
+ * sending side, whatever is written to the socket goes out encrypted,
+ * sendfile() included, so responses are sent as on a plain connection
+ * and files still go out without being copied through user memory. Only
+ * reading goes through OpenSSL, which may hold decrypted bytes the socket
+ * no longer shows.
+ *
+ * If the kernel can't take the connection (it has no tls module, or lacks
+ * the cipher agreed on), a thread of the connection's own relays between
+ * OpenSSL and one end of a socket pair, and the connection is served on
+ * the other end.
+ *
+ * Clients that offer HTTP/2 by ALPN get it. */
+
+/* How long a client may take over its handshake, in ms. */
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+
+/* Bytes the relay moves at a time each way: a TLS record's worth. */
+#define TLS_RELAY_BUFFER_SIZE 16384
+
+/* What serves a connection once its handshake is done: FD, read through
+ * IO if it isn't NULL. */
+typedef void (*tls_handler_t)(int fd, const struct http_conn_io *io);
+
+/* Loads the certificate chain in CERT_PATH and the private key in
+ * KEY_PATH. Exits if either can't be loaded. Call before tls_serve(). */
+void tls_init(const char *cert_path, const char *key_path);
+
+/* Does the handshake on client socket FD and then has HANDLER serve it.
+ * Returns once HANDLER is done and the session closed. FD is left open. */
+void tls_serve(int fd, tls_handler_t handler);
+
+#endif
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/* Ops the backend issues. */
+static const int uring_ops[] = {
+  IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SPLICE,
+  IORING_OP_FILES_UPDATE, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL,
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+  int fd = syscall(__NR_io_uring_setup, entries, params);
+  return fd < 0 ? -errno : fd;
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  int n = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+  return n < 0 ? -errno : n;
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  int n = syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+  return n < 0 ? -errno : n;
+}
+
+bool uring_available(void) {
+  struct uring ring;
+  int error = uring_init(&ring);
+  if (error < 0) {
+    fprintf(stderr, "io_uring is unavailable: %s\n", strerror(-error));
+    return false;
+  }
+
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  error = probe ? uring_register(ring.fd, IORING_REGISTER_PROBE, probe, 256) : -ENOMEM;
+  bool ok = error == 0;
+  for (size_t i = 0; ok && i < sizeof(uring_ops) / sizeof(*uring_ops); i++)
+    ok = uring_ops[i] <= probe->last_op
+        && (probe->ops[uring_ops[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  uring_free(&ring);
+  if (!ok) fprintf(stderr, "io_uring is unavailable: this kernel's is too old\n");
+  return ok;
+}
+
+int uring_init(struct uring *ring) {
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(*ring));
+
+  /* Only the thread that submits reaps completions, so let the kernel put
+   * their work off until it does, rather than interrupt it, on kernels
+   * that can. */
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER
+      | IORING_SETUP_DEFER_TASKRUN;
+  params.cq_entries = URING_ENTRIES * URING_CQ_FACTOR;
+  int fd = uring_setup(URING_ENTRIES, &params);
+  if (fd == -EINVAL) {
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * URING_CQ_FACTOR;
+    fd = uring_setup(URING_ENTRIES, &params);
+  }
+  if (fd < 0) return fd;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+    close(fd);
+    return -ENOSYS;
+  }
+
+  size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_map_len = sq_len > cq_len ? sq_len : cq_len;
+  ring->ring_map = mmap(NULL, ring->ring_map_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->sqes_map_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_map_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->ring_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    int error = -errno;
+    if (ring->ring_map != MAP_FAILED) munmap(ring->ring_map, ring->ring_map_len);
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_map_len);
+    close(fd);
+    return error;
+  }
+
+  char *map = ring->ring_map;
+  ring->fd = fd;
+  ring->sq_entries = params.sq_entries;
+  ring->sq_head = (unsigned *) (map + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (map + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *) (map + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (map + params.sq_off.array);
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *) (map + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (map + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (map + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (map + params.cq_off.cqes);
+  return 0;
+}
+
+void uring_free(struct uring *ring) {
+  munmap(ring->sqes, ring->sqes_map_len);
+  munmap(ring->ring_map, ring->ring_map_len);
+  close(ring->fd);
+}
+
+int uring_register_files(struct uring *ring, unsigned cnt) {
+  int *fds = malloc(cnt * sizeof(int));
+  if (!fds) return -ENOMEM;
+  for (unsigned i = 0; i < cnt; i++) fds[i] = -1;
+  int error = uring_register(ring->fd, IORING_REGISTER_FILES, fds, cnt);
+  free(fds);
+  return error < 0 ? error : 0;
+}
+
+/* Returns the number of SQEs handed out that the kernel hasn't taken. */
+static unsigned uring_queued(const struct uring *ring) {
+  return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+  if (uring_queued(ring) == ring->sq_entries) {
+    uring_submit_and_wait(ring, 0);
+    if (uring_queued(ring) == ring->sq_entries) return NULL;
+  }
+  unsigned index = ring->sq_local_tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->sq_local_tail++;
+  return sqe;
+}
+
+bool uring_reserve(struct uring *ring, unsigned cnt) {
+  if (ring->sq_entries - uring_queued(ring) >= cnt) return true;
+  uring_submit_and_wait(ring, 0);
+  return ring->sq_entries - uring_queued(ring) >= cnt;
+}
+
+int uring_set_file(struct uring *ring, unsigned slot, int fd) {
+  struct io_uring_files_update update = { .offset = slot, .fds = (uintptr_t) &fd };
+  int n = uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+  return n < 0 ? n : 0;
+}
+
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr) {
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  return uring_enter(ring->fd, uring_queued(ring), wait_nr,
+      wait_nr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
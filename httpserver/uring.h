@@ -0,0 +1,76 @@
+#ifndef __URING__
+#define __URING__
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A thin layer over the io_uring system calls, enough for the event loops'
+ * io_uring backend without depending on liburing. A ring belongs to the
+ * thread that set it up: nothing here locks.
+ *
+ * SQEs are taken with uring_get_sqe(), filled in, and go to the kernel on
+ * the next uring_submit_and_wait(). Completions are read with
+ * uring_peek_cqe() and handed back with uring_cqe_seen(). */
+
+/* Submission queue size. The completion queue is URING_CQ_FACTOR times
+ * bigger, since a multishot accept posts many completions for one SQE. */
+#define URING_ENTRIES 1024
+#define URING_CQ_FACTOR 4
+
+struct uring {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned sq_local_tail;     /* Past the last SQE handed out. */
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *ring_map;
+  size_t ring_map_len;
+  size_t sqes_map_len;
+};
+
+/* Returns whether this kernel has an io_uring with all the backend uses,
+ * or prints why not to stderr. */
+bool uring_available(void);
+
+/* Sets up RING. Returns 0, or a negative errno. */
+int uring_init(struct uring *ring);
+
+void uring_free(struct uring *ring);
+
+/* Registers CNT empty fixed-file slots with RING, for IORING_OP_FILES_UPDATE
+ * to fill. Returns 0, or a negative errno. */
+int uring_register_files(struct uring *ring, unsigned cnt);
+
+/* Returns a cleared SQE, submitting those queued first if the queue is
+ * full, or NULL if it stays full. */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* Makes sure the next CNT calls to uring_get_sqe() succeed without
+ * submitting, so that a chain of linked SQEs goes to the kernel whole.
+ * Returns false if the queue stays too full. */
+bool uring_reserve(struct uring *ring, unsigned cnt);
+
+/* Puts FD, or nothing if it's -1, in fixed-file slot SLOT right away,
+ * rather than by queuing IORING_OP_FILES_UPDATE. Returns 0, or a negative
+ * errno. */
+int uring_set_file(struct uring *ring, unsigned slot, int fd);
+
+/* Submits the queued SQEs and waits until at least WAIT_NR completions are
+ * ready. Returns the number submitted, or a negative errno. */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+
+/* Returns the oldest completion not yet seen, or NULL if there's none. */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+/* Hands the completion uring_peek_cqe() returned back to the kernel. */
+void uring_cqe_seen(struct uring *ring);
+
+#endif
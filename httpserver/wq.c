@@ -1,55 +1,139 @@
-#include <stdlib.h>
-#include "wq.h"
-#include "utlist.h"
+#define _GNU_SOURCE
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "wq.h"
 
-/* Initializes a work queue WQ. */
-void wq_init(wq_t *wq) {
-
-  /* TODO: Make me thread-safe! */
-  
-  wq->size = 0;
-  wq->head = NULL;
-  pthread_mutex_init(&wq->lock, NULL);
-  pthread_cond_init(&wq->dataReady, NULL);
+static long wq_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
 }
 
-/* Remove an item from the WQ. This function should block until there
- * is at least one item on the queue. */
-int wq_pop(wq_t *wq) {
-
-  /* TODO: Make me blocking and thread-safe! */
-  pthread_mutex_lock(&wq->lock);
-  while (wq->size == 0) {
-    pthread_cond_wait(&wq->dataReady, &wq->lock);
-
+/* Initializes a work queue WQ that holds up to CAPACITY sockets. */
+void wq_init(wq_t *wq, size_t capacity) {
+  size_t cells = 1;
+  while (cells < capacity) cells *= 2;
+  wq->cells = malloc(cells * sizeof(wq_cell_t));
+  if (!wq->cells) {
+    perror("malloc");
+    exit(ENOMEM);
   }
+  wq->mask = cells - 1;
+  for (size_t i = 0; i < cells; i++) wq->cells[i].seq = i;
+  wq->enqueue_pos = 0;
+  wq->dequeue_pos = 0;
+  sem_init(&wq->items, 0, 0);
+  /* The ring may have more cells than that; only CAPACITY are used. */
+  sem_init(&wq->slots, 0, capacity);
+}
 
-  wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
-  wq->size--;
-  DL_DELETE(wq->head, wq->head);
+/* Tells the CPU it is spinning on another thread's store. */
+static inline void wq_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
 
-  free(wq_item);
+/* Waits on SEM, through any signals. */
+static void wq_wait(sem_t *sem) {
+  while (sem_wait(sem) == -1 && errno == EINTR)
+    continue;
+}
 
-  pthread_mutex_unlock(&wq->lock);
+/* Waits on SEM for up to TIMEOUT_MS, through any signals. Returns 0 if
+ * it timed out. */
+static int wq_wait_timed(sem_t *sem, int timeout_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += timeout_ms % 1000 * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while (sem_clockwait(sem, CLOCK_MONOTONIC, &deadline) == -1) {
+    if (errno != EINTR) return 0;
+  }
+  return 1;
+}
 
-  return client_socket_fd;
+/* Remove an item from the WQ. This function should block until there
+ * is at least one item on the queue. If WAITED_MS isn't NULL, it is set to
+ * how long the socket was queued. */
+int wq_pop(wq_t *wq, long *waited_ms) {
+  return wq_pop_timed(wq, waited_ms, -1);
 }
 
-/* Add ITEM to WQ. */
-void wq_push(wq_t *wq, int client_socket_fd) {
+/* Like wq_pop(), but gives up and returns -1 once TIMEOUT_MS pass with
+ * the queue empty, unless TIMEOUT_MS is negative. */
+int wq_pop_timed(wq_t *wq, long *waited_ms, int timeout_ms) {
+  if (timeout_ms < 0)
+    wq_wait(&wq->items);
+  else if (!wq_wait_timed(&wq->items, timeout_ms))
+    return -1;
 
-  /* TODO: Make me thread-safe! */
+  /* An item is ours, but the slot claimed may still be being filled by a
+   * producer that claimed it before the one that posted; then try again. */
+  size_t pos = __atomic_load_n(&wq->dequeue_pos, __ATOMIC_RELAXED);
+  while (1) {
+    wq_cell_t *cell = &wq->cells[pos & wq->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long diff = (long) (seq - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&wq->dequeue_pos, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        int client_socket_fd = cell->client_socket_fd;
+        if (waited_ms) *waited_ms = wq_now_ms() - cell->pushed_ms;
+        /* Ready for the producer one lap on. */
+        __atomic_store_n(&cell->seq, pos + wq->mask + 1, __ATOMIC_RELEASE);
+        sem_post(&wq->slots);
+        return client_socket_fd;
+      }
+    } else if (diff < 0) {
+      wq_relax();
+      pos = __atomic_load_n(&wq->dequeue_pos, __ATOMIC_RELAXED);
+    } else {
+      pos = __atomic_load_n(&wq->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
 
-  pthread_mutex_lock(&wq->lock);
+/* Returns how many sockets are queued in WQ now. */
+int wq_depth(wq_t *wq) {
+  int depth;
+  sem_getvalue(&wq->items, &depth);
+  return depth > 0 ? depth : 0;
+}
 
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
-  wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
-  wq->size++;
-  pthread_cond_broadcast(&wq->dataReady);
-  pthread_mutex_unlock(&wq->lock);
+/* Add ITEM to WQ. Returns 1, or 0 without waiting if the queue is full. */
+int wq_push(wq_t *wq, int client_socket_fd) {
+  while (sem_trywait(&wq->slots) == -1) {
+    if (errno != EINTR) return 0;
+  }
 
+  size_t pos = __atomic_load_n(&wq->enqueue_pos, __ATOMIC_RELAXED);
+  while (1) {
+    wq_cell_t *cell = &wq->cells[pos & wq->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long diff = (long) (seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&wq->enqueue_pos, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->client_socket_fd = client_socket_fd;
+        cell->pushed_ms = wq_now_ms();
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        sem_post(&wq->items);
+        return 1;
+      }
+    } else if (diff < 0) {
+      /* A consumer hasn't finished emptying the slot yet. */
+      wq_relax();
+      pos = __atomic_load_n(&wq->enqueue_pos, __ATOMIC_RELAXED);
+    } else {
+      pos = __atomic_load_n(&wq->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
 }
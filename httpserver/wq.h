@@ -2,27 +2,44 @@
 #define __WQ__
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * It is a bounded ring of sockets that producers and consumers claim slots
+ * of with compare-and-swap (Dmitry Vyukov's MPMC queue), so nothing is
+ * allocated per socket and no lock is held. Two semaphores count the full
+ * and empty slots; a worker with nothing to do sleeps on one, and each
+ * push wakes a single worker. A push onto a full queue fails at once, so
+ * the caller can turn the client away instead of waiting. */
 
-typedef struct wq_item {
-  int client_socket_fd; // Client socket to be served.
-  struct wq_item *next;
-  struct wq_item *prev;
-} wq_item_t;
+/* Sockets a queue holds by default. */
+#define WQ_DEFAULT_CAPACITY 4096
+
+typedef struct wq_cell {
+  size_t seq;               // Which lap of the ring this slot is ready for.
+  int client_socket_fd;     // Client socket to be served.
+  long pushed_ms;           // When it was pushed.
+} wq_cell_t;
 
 typedef struct wq {
-  int size;
-  wq_item_t *head;
-  /* TODO: More stuff here, maybe? */
-  pthread_mutex_t lock;
-  pthread_cond_t dataReady;
- void (*request_handler)(int);
+  wq_cell_t *cells;         // A power of two of them, at least the capacity.
+  size_t mask;
+  /* Each on its own cache line, so producers and consumers don't contend
+   * for one. */
+  size_t enqueue_pos __attribute__((aligned(64)));
+  size_t dequeue_pos __attribute__((aligned(64)));
+  sem_t items;              // Sockets pushed and not yet popped.
+  sem_t slots;              // Free slots.
+  void (*request_handler)(int);
 } wq_t;
 
-void wq_init(wq_t *wq);
-void wq_push(wq_t *wq, int client_socket_fd);
-int wq_pop(wq_t *wq);
+void wq_init(wq_t *wq, size_t capacity);
+int wq_push(wq_t *wq, int client_socket_fd);
+int wq_pop(wq_t *wq, long *waited_ms);
+int wq_pop_timed(wq_t *wq, long *waited_ms, int timeout_ms);
+int wq_depth(wq_t *wq);
 
 #endif
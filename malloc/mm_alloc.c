@@ -4,140 +4,1590 @@
  * Stub implementations of the mm_* routines.
  */
 
+#define _GNU_SOURCE
+
 #include "mm_alloc.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
 
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/* Free blocks of up to SMALL_MAX bytes are kept in a list per size, so a
+ * small request that has an exact fit finds it in O(1). Larger ones are
+ * kept in a left-leaning red-black tree ordered by size, then address,
+ * whose nodes are the blocks' own metadata, so the best fit, the lowest
+ * of the smallest that fit, is found in O(log n). */
+#define SMALL_MAX 256
+#define SMALL_CLASSES (SMALL_MAX + 1)
+
+/* Requests of at least MMAP_THRESHOLD bytes get a mapping of their own,
+ * unmapped when they are freed. */
+#define MMAP_THRESHOLD (128 * 1024)
+
+/* A free block of at least RELEASE_THRESHOLD bytes has its pages given
+ * back to the kernel: by lowering the break if it is the last block on
+ * the heap, or else with madvise. */
+#define RELEASE_THRESHOLD (128 * 1024)
+
+/* With MM_HUGEPAGES=1 in the environment, the heap grows not by moving
+ * the break but inside a reservation of ARENA_RESERVE bytes of address
+ * space, aligned to HUGE_PAGE_SIZE and marked for transparent huge pages,
+ * made usable a huge page at a time, so a big heap takes fewer TLB
+ * misses. Runs of slots are mapped a huge page at a time too. The heap
+ * falls back to sbrk if the reservation can't be made. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ARENA_RESERVE ((size_t) 64 << 30)
+
+/* Marks the metadata of every block on the heap, so a pointer can be
+ * checked to be one we handed out without walking the chain. */
+#define BLOCK_MAGIC 0x6d6d626bu
+
+/* Build with -DMM_POISON to fill freed memory with POISON_BYTE and check
+ * that it is untouched when handed out again, to catch writes after free. */
+#define POISON_BYTE 0x6b
+
+/* Words in the bitmap of non-empty classes. */
+#define CLASS_WORDS ((SMALL_CLASSES + 63) / 64)
 
-/* The pointer to the start of heap */
+/* Runs of slots for requests of up to SMALL_MAX. */
+#define RUN_SIZE 4096
+#define RUN_MAGIC 0x6d6d7275u
+#define RUN_WORDS ((RUN_SIZE / 4 + 63) / 64)
+#define RUN_HEADER ((sizeof(struct run) + 15) & ~(size_t) 15)
+#define SLOT_CLASSES MM_SLOT_CLASSES
+#define RUNS_PER_CHUNK 16
+#define RUN_RESERVE 64
+
+/* Most free slots of each class a thread keeps for itself, and how many
+ * it moves to or from the runs at a time. */
+#define TCACHE_COUNT 16
+#define TCACHE_BATCH 8
+
+/* The pointer to the start of heap, and to its last block */
 static struct metadata *start;
+static struct metadata *end;
+
+/* Blocks with mappings of their own, linked by PREV and NEXT */
+static struct metadata *mapped;
+
+/* The huge page arena, if the heap is in one: where it starts, the end of
+ * the heap in it, and the end of what has been made usable. */
+static pthread_once_t huge_once = PTHREAD_ONCE_INIT;
+static bool huge_pages;
+static char *arena;
+static char *arena_break;
+static char *arena_ready;
+
+/* There is one heap, as the break is the process's, so one lock guards
+ * it: the chain, the free lists and the mapped blocks. A free that finds
+ * it held doesn't wait, but pushes the block on PENDING_FREES, linked by
+ * FREE_NEXT, for whoever holds the lock next to free. */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metadata *pending_frees;
 
 /* Metadata of data */
 struct metadata {
     size_t size;
     bool free;
+    bool mapped;
+    // waiting on PENDING_FREES to be freed; in use as far as the heap can
+    // tell, but not to be freed again
+    bool pending;
+    // color of its link from its parent, while in the tree of free blocks
+    bool red;
+    uint32_t magic;
     struct metadata *prev;
     struct metadata *next;
+    // while free, neighbors in the free list of its class if small, or
+    // children in the tree if large
+    union {
+        struct metadata *free_prev;
+        struct metadata *left;
+    };
+    union {
+        struct metadata *free_next;
+        struct metadata *right;
+    };
     char data[];
 };
 
+/* Free blocks by size class, and which classes have any, and the root of
+ * the tree of larger free blocks */
+static struct metadata *free_lists[SMALL_CLASSES];
+static uint64_t nonempty[CLASS_WORDS];
+static struct metadata *free_tree;
+
+/* Requests of up to SMALL_MAX get a slot in a run instead of a block:
+ * a RUN_SIZE span, aligned to its size, of slots of one of SLOT_SIZES,
+ * each aligned as any object that fits it. A slot has no metadata of its
+ * own; the run it is in is found by masking its address, and its header
+ * has a bit per slot, set while it is free. Runs are not on the heap. */
+struct run {
+    uint32_t magic;
+    uint16_t class;
+    uint16_t slots;
+    unsigned free;
+    // neighbors in the list of runs of its class with a free slot
+    struct run *prev;
+    struct run *next;
+    uint64_t free_bits[RUN_WORDS];
+};
+
+static const uint16_t slot_sizes[SLOT_CLASSES] = {
+    4, 8, 12, 16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256
+};
+
+/* Runs with a free slot by class, and empty runs kept for reuse, linked
+ * by NEXT, all guarded by SLAB_LOCK. */
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct run *runs[SLOT_CLASSES];
+static struct run *spare_runs;
+static int spare_count;
+
+/* Slots in runs of each class, and of those not free in their runs, for
+ * mm_stats(), and bytes mapped for runs. */
+static size_t class_slots[SLOT_CLASSES];
+static size_t class_taken[SLOT_CLASSES];
+static size_t run_bytes;
+
+/* Bytes taken from the kernel with sbrk and mmap, and the most ever. */
+static size_t footprint;
+static size_t peak_footprint;
+
+/* Each thread keeps up to TCACHE_COUNT free slots of each class, and
+ * hands them out again without taking the slab lock. It takes and gives
+ * them back TCACHE_BATCH at a time, and gives back all when it exits. The
+ * slots needn't be its own, as the runs are shared. */
+struct tcache {
+    void *slots[SLOT_CLASSES][TCACHE_COUNT];
+    // stored atomically, as mm_stats() reads them
+    unsigned char counts[SLOT_CLASSES];
+    bool registered;
+    // neighbors in the list of registered caches
+    struct tcache *prev;
+    struct tcache *next;
+};
+static __thread struct tcache tcache;
+static struct tcache *tcaches;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* Return the first non-empty class at or after CLASS, or -1. */
+static int next_class(int class) {
+    for (int word = class / 64; word < CLASS_WORDS; word++) {
+        uint64_t bits = nonempty[word];
+        if (word == class / 64) {
+            bits &= ~0ULL << (class % 64);
+        }
+        if (bits != 0) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+/* Return whether free block A goes before B in the tree. */
+static bool tree_less(struct metadata *a, struct metadata *b) {
+    return a->size < b->size || (a->size == b->size && a < b);
+}
+
+static bool is_red(struct metadata *node) {
+    return node != NULL && node->red;
+}
+
+/* Rotations and color flips that keep the tree balanced, each returning
+ * the new root of the subtree that was rooted at H. */
+static struct metadata *rotate_left(struct metadata *h) {
+    struct metadata *x = h->right;
+    h->right = x->left;
+    x->left = h;
+    x->red = h->red;
+    h->red = true;
+    return x;
+}
+
+static struct metadata *rotate_right(struct metadata *h) {
+    struct metadata *x = h->left;
+    h->left = x->right;
+    x->right = h;
+    x->red = h->red;
+    h->red = true;
+    return x;
+}
+
+static void flip_colors(struct metadata *h) {
+    h->red = !h->red;
+    h->left->red = !h->left->red;
+    h->right->red = !h->right->red;
+}
+
+static struct metadata *fix_up(struct metadata *h) {
+    if (is_red(h->right) && !is_red(h->left)) {
+        h = rotate_left(h);
+    }
+    if (is_red(h->left) && is_red(h->left->left)) {
+        h = rotate_right(h);
+    }
+    if (is_red(h->left) && is_red(h->right)) {
+        flip_colors(h);
+    }
+    return h;
+}
+
+static struct metadata *move_red_left(struct metadata *h) {
+    flip_colors(h);
+    if (is_red(h->right->left)) {
+        h->right = rotate_right(h->right);
+        h = rotate_left(h);
+        flip_colors(h);
+    }
+    return h;
+}
+
+static struct metadata *move_red_right(struct metadata *h) {
+    flip_colors(h);
+    if (is_red(h->left->left)) {
+        h = rotate_right(h);
+        flip_colors(h);
+    }
+    return h;
+}
+
+/* Add BLOCK to the subtree rooted at H, and return its new root. */
+static struct metadata *tree_insert(struct metadata *h, struct metadata *block) {
+    if (h == NULL) {
+        block->left = NULL;
+        block->right = NULL;
+        block->red = true;
+        return block;
+    }
+    if (tree_less(block, h)) {
+        h->left = tree_insert(h->left, block);
+    } else {
+        h->right = tree_insert(h->right, block);
+    }
+    return fix_up(h);
+}
+
+/* Take the least block out of the subtree rooted at H, and return its
+ * new root. */
+static struct metadata *tree_remove_min(struct metadata *h) {
+    if (h->left == NULL) {
+        return h->right;
+    }
+    if (!is_red(h->left) && !is_red(h->left->left)) {
+        h = move_red_left(h);
+    }
+    h->left = tree_remove_min(h->left);
+    return fix_up(h);
+}
+
+/* Take BLOCK out of the subtree rooted at H, which holds it, and return
+ * its new root. A block with two children is replaced by the least block
+ * after it, as the nodes can't swap contents. */
+static struct metadata *tree_remove(struct metadata *h, struct metadata *block) {
+    if (tree_less(block, h)) {
+        if (!is_red(h->left) && !is_red(h->left->left)) {
+            h = move_red_left(h);
+        }
+        h->left = tree_remove(h->left, block);
+    } else {
+        if (is_red(h->left)) {
+            h = rotate_right(h);
+        }
+        if (h == block && h->right == NULL) {
+            return NULL;
+        }
+        if (!is_red(h->right) && !is_red(h->right->left)) {
+            h = move_red_right(h);
+        }
+        if (h == block) {
+            struct metadata *min = h->right;
+            while (min->left != NULL) {
+                min = min->left;
+            }
+            min->right = tree_remove_min(h->right);
+            min->left = h->left;
+            min->red = h->red;
+            h = min;
+        } else {
+            h->right = tree_remove(h->right, block);
+        }
+    }
+    return fix_up(h);
+}
+
+/* Return the best fit for SIZE in the tree, or NULL. */
+static struct metadata *tree_fit(size_t size) {
+    struct metadata *best = NULL;
+    struct metadata *cur = free_tree;
+    while (cur != NULL) {
+        if (cur->size >= size) {
+            best = cur;
+            cur = cur->left;
+        } else {
+            cur = cur->right;
+        }
+    }
+    return best;
+}
+
+/* Add free block BLOCK to the list of its class, or the tree. */
+static void free_list_insert(struct metadata *block) {
+    if (block->size > SMALL_MAX) {
+        free_tree = tree_insert(free_tree, block);
+        free_tree->red = false;
+        return;
+    }
+    int class = block->size;
+    block->free_prev = NULL;
+    block->free_next = free_lists[class];
+    if (free_lists[class] != NULL) {
+        free_lists[class]->free_prev = block;
+    }
+    free_lists[class] = block;
+    nonempty[class / 64] |= 1ULL << (class % 64);
+}
+
+/* Take free block BLOCK out of the list of its class, or the tree. */
+static void free_list_remove(struct metadata *block) {
+    if (block->size > SMALL_MAX) {
+        if (!is_red(free_tree->left) && !is_red(free_tree->right)) {
+            free_tree->red = true;
+        }
+        free_tree = tree_remove(free_tree, block);
+        if (free_tree != NULL) {
+            free_tree->red = false;
+        }
+        block->left = NULL;
+        block->right = NULL;
+        return;
+    }
+    int class = block->size;
+    if (block->free_prev != NULL) {
+        block->free_prev->free_next = block->free_next;
+    } else {
+        free_lists[class] = block->free_next;
+    }
+    if (block->free_next != NULL) {
+        block->free_next->free_prev = block->free_prev;
+    }
+    if (free_lists[class] == NULL) {
+        nonempty[class / 64] &= ~(1ULL << (class % 64));
+    }
+    block->free_prev = NULL;
+    block->free_next = NULL;
+}
+
+/* Return the best free block for SIZE, or NULL: a small one from the
+ * first non-empty list at or after SIZE's, or else the best fit in the
+ * tree. */
+static struct metadata *find_fit(size_t size) {
+    if (size <= SMALL_MAX) {
+        int class = next_class(size);
+        if (class >= 0) {
+            return free_lists[class];
+        }
+    }
+    return tree_fit(size);
+}
+
+/* Return N rounded down or up to a multiple of the page size. */
+static uintptr_t page_down(uintptr_t n) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    return n & ~(page - 1);
+}
+
+static uintptr_t page_up(uintptr_t n) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    return (n + page - 1) & ~(page - 1);
+}
+
+/* Return N rounded up to a multiple of HUGE_PAGE_SIZE. */
+static uintptr_t huge_up(uintptr_t n) {
+    return (n + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1);
+}
+
+/* Read MM_HUGEPAGES, once; the heap may be grown before any constructor
+ * runs. */
+static void huge_init(void) {
+    const char *env = getenv("MM_HUGEPAGES");
+    huge_pages = env != NULL && strcmp(env, "1") == 0;
+}
+
+static bool use_huge_pages(void) {
+    pthread_once(&huge_once, huge_init);
+    return huge_pages;
+}
+
+/* Map LENGTH bytes with PROT and FLAGS, aligned to HUGE_PAGE_SIZE and
+ * marked for huge pages. Return NULL if failed. */
+static char *map_huge(size_t length, int prot, int flags) {
+    char *ptr = mmap(NULL, length + HUGE_PAGE_SIZE, prot, flags | MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *) huge_up((uintptr_t) ptr);
+    if (aligned > ptr) {
+        munmap(ptr, aligned - ptr);
+    }
+    munmap(aligned + length, ptr + HUGE_PAGE_SIZE - aligned);
+    madvise(aligned, length, MADV_HUGEPAGE);
+    return aligned;
+}
+
+/* Move the end of the heap by DELTA bytes and return where it was, or
+ * (void *) -1 if it can't be, as sbrk does. In the huge page arena, the
+ * whole pages past a lowered end are given back, so they read as zero
+ * when it is raised again, as past the break. The heap lock must be
+ * held. */
+static void *heap_sbrk(intptr_t delta) {
+    static bool started;
+    if (!started) {
+        started = true;
+        if (use_huge_pages() && (arena = map_huge(ARENA_RESERVE, PROT_NONE,
+                                                  MAP_NORESERVE)) != NULL) {
+            arena_break = arena_ready = arena;
+        }
+    }
+    if (arena == NULL) {
+        return sbrk(delta);
+    }
+    char *old = arena_break;
+    if (delta > 0) {
+        if ((size_t) delta > (size_t) (arena + ARENA_RESERVE - arena_break)) {
+            return (void *) -1;
+        }
+        char *need = arena_break + delta;
+        if (need > arena_ready) {
+            char *ready = (char *) huge_up((uintptr_t) need);
+            if (mprotect(arena_ready, ready - arena_ready, PROT_READ | PROT_WRITE) != 0) {
+                return (void *) -1;
+            }
+            arena_ready = ready;
+        }
+    } else if (delta < 0) {
+        char *first = (char *) page_up((uintptr_t) (arena_break + delta));
+        if (first < arena_break) {
+            madvise(first, arena_break - first, MADV_DONTNEED);
+        }
+    }
+    arena_break += delta;
+    return old;
+}
+
+/* Count DELTA bytes taken from the kernel, or given back if negative. */
+static void account(intptr_t delta) {
+    size_t now = __atomic_add_fetch(&footprint, delta, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_footprint, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&peak_footprint, &peak, now, true,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        continue;
+    }
+}
+
+/* Fill the SIZE bytes at PTR, just freed, with POISON_BYTE if poisoning. */
+static void poison(void *ptr, size_t size) {
+#ifdef MM_POISON
+    memset(ptr, POISON_BYTE, size);
+#endif
+}
+
+/* Abort if poisoning and the data of free block BLOCK has been written
+ * since it was freed. */
+static void check_poison(struct metadata *block) {
+#ifdef MM_POISON
+    for (size_t i = 0; i < block->size; i++) {
+        if ((unsigned char) block->data[i] != POISON_BYTE) {
+            fprintf(stderr, "mm_alloc: block at %p written after free\n",
+                    (void *) block->data);
+            abort();
+        }
+    }
+#endif
+}
+
 /* Create a pointer to a new metadata allocated on heap
  * of size SIZE and inserted right after block PREV. 
+ * Its data is zero, as the kernel hands out memory past the break.
  * Return NULL if failed. */
 void *allocate_meta(struct metadata *prev, size_t size) {
-    void *ptr = sbrk(sizeof(struct metadata) + size);
+    void *ptr = heap_sbrk(sizeof(struct metadata) + size);
     // failed to expand mapped heap region
     if (ptr == (void *) -1) {
         return NULL;
     }
+    // the heap starts aligned to 16, so blocks whose sizes are multiples
+    // of 16 stay aligned
+    if (prev == NULL && (uintptr_t) ptr % 16 != 0) {
+        uintptr_t pad = 16 - (uintptr_t) ptr % 16;
+        if (heap_sbrk(pad) == (void *) -1) {
+            heap_sbrk(-(intptr_t) (sizeof(struct metadata) + size));
+            return NULL;
+        }
+        ptr = (char *) ptr + pad;
+        account(pad);
+    }
+    account(sizeof(struct metadata) + size);
     // create and initialize a new block
     struct metadata *block = (struct metadata *) ptr;
     block->size = size;
     block->free = false;
+    block->mapped = false;
+    block->pending = false;
+    block->magic = BLOCK_MAGIC;
     block->prev = prev;
     block->next = NULL;
-    // zero-fill the allocated memory
-    memset(block->data, 0, size);
+    block->free_prev = NULL;
+    block->free_next = NULL;
     // set pointers for blocks
     if (prev == NULL) {
-        start = block;
+        __atomic_store_n(&start, block, __ATOMIC_RELEASE);
     } else {
         block->next = prev->next;
         prev->next  = block;
     }
+    if (block->next == NULL) {
+        __atomic_store_n(&end, block, __ATOMIC_RELEASE);
+    }
     // return the pointer to the metadata of the new block
     return block;
 }
 
-/* Allocate and return a pointer to a new block of heap memory of SIZE.
- * Return NULL if size is 0 or cannot allocate new requested size. */
-void *mm_malloc(size_t size) {
-    // base case
-    if (size == 0) {
+/* Merge block CUR's right neighbor into it. Neither may be on a free
+ * list. */
+static void coalesce(struct metadata *cur) {
+    struct metadata *right = cur->next;
+    // increase size of the left block
+    cur->size += right->size + sizeof(struct metadata);
+    // release the metadata for the right block
+    cur->next = right->next;
+    if (right->next != NULL) {
+        right->next->prev = cur;
+    } else {
+        __atomic_store_n(&end, cur, __ATOMIC_RELEASE);
+    }
+    // zero out metadata
+    memset(right, 0, sizeof(struct metadata));
+    poison(right, sizeof(struct metadata));
+}
+
+/* Return the length of the mapping of a mapped block of SIZE. */
+static size_t map_length(size_t size) {
+    return page_up(sizeof(struct metadata) + size);
+}
+
+/* Create a block of SIZE with a mapping of its own. Its data is zero, as
+ * the kernel hands out new mappings. Return NULL if failed. The mapping
+ * is made before taking the heap lock, which only linking it needs. */
+static struct metadata *allocate_mapped(size_t size) {
+    void *ptr = mmap(NULL, map_length(size), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
         return NULL;
     }
-    // look for a first-fit free block of sufficient size
-    struct metadata *cur = start;
-    struct metadata *prev = NULL;
-    while (cur != NULL && !(cur->free && cur->size >= size)) {
-        prev = cur;
-        cur = cur->next;
+    account(map_length(size));
+    struct metadata *block = ptr;
+    block->size = size;
+    block->free = false;
+    block->mapped = true;
+    block->pending = false;
+    block->magic = BLOCK_MAGIC;
+    block->prev = NULL;
+    pthread_mutex_lock(&heap_lock);
+    block->next = mapped;
+    if (mapped != NULL) {
+        mapped->prev = block;
+    }
+    mapped = block;
+    pthread_mutex_unlock(&heap_lock);
+    return block;
+}
+
+/* Point the neighbors of mapped block BLOCK at it, once it has moved. */
+static void relink_mapped(struct metadata *block) {
+    if (block->prev != NULL) {
+        block->prev->next = block;
+    } else {
+        mapped = block;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block;
     }
+}
+
+/* Unlink mapped block BLOCK, for it to be unmapped once the heap lock is
+ * released. */
+static void unlink_mapped(struct metadata *block) {
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        mapped = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+}
+
+/* Give the whole pages inside free block CUR, which is on its free list,
+ * back to the kernel if it is big enough to be worth it. In the huge page
+ * arena, only whole huge pages are, as giving back part of one splits
+ * it. */
+static void release(struct metadata *cur) {
+    if (cur->size < RELEASE_THRESHOLD) {
+        return;
+    }
+    char *first = (char *) page_up((uintptr_t) cur->data);
+    char *last = (char *) page_down((uintptr_t) (cur->data + cur->size));
+    if (arena != NULL) {
+        first = (char *) huge_up((uintptr_t) first);
+        last = (char *) ((uintptr_t) last & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    }
+    if (first >= last) {
+        return;
+    }
+    // the last block ends at the break, unless something else moved it;
+    // lower it to a page boundary, so memory past it comes back zeroed
+    if (cur == end && heap_sbrk(0) == (void *) (cur->data + cur->size)) {
+        if (heap_sbrk(-(intptr_t) (cur->data + cur->size - first)) != (void *) -1) {
+            account(-(intptr_t) (cur->data + cur->size - first));
+            free_list_remove(cur);
+            cur->size = first - cur->data;
+            free_list_insert(cur);
+            return;
+        }
+    }
+#ifndef MM_POISON
+    // the pages read back as zero, which would look like a write after free
+    madvise(first, last - first, MADV_DONTNEED);
+#endif
+}
+
+/* Shrink block CUR to SIZE, making what's left past it a free block of
+ * its own. There must be room for the new block's metadata. */
+static void split_block(struct metadata *cur, size_t size) {
+    size_t residual_size = cur->size - size;
+    // pointer to the metadata of new block within the block
+    struct metadata *ptr = (void *) cur + sizeof(struct metadata) + size;
+    // set pointers for the metadata of new block
+    ptr->prev = cur;
+    ptr->next = cur->next;
+    ptr->free = true;
+    ptr->mapped = false;
+    ptr->pending = false;
+    ptr->magic = BLOCK_MAGIC;
+    ptr->size = residual_size - sizeof(struct metadata);
+    // set pointers for the shrunk block
+    cur->size = size;
+    if (cur->next != NULL) {
+        cur->next->prev = ptr;
+    } else {
+        __atomic_store_n(&end, ptr, __ATOMIC_RELEASE);
+    }
+    cur->next = ptr;
+    // coalesce with any right free block
+    if (ptr->next != NULL && ptr->next->free == true) {
+        free_list_remove(ptr->next);
+        coalesce(ptr);
+    }
+    free_list_insert(ptr);
+}
+
+/* Allocate and return a pointer to a new block on the heap of SIZE,
+ * setting *FRESH if it is new to the heap and so zero-filled. The heap
+ * lock must be held. */
+static void *heap_allocate(size_t size, bool *fresh) {
+    // look for a free block of sufficient size
+    struct metadata *cur = find_fit(size);
     // no sufficiently large free block found; allocate new block
     if (cur == NULL) {
-        struct metadata *ptr = allocate_meta(prev, size);
+        struct metadata *ptr = allocate_meta(end, size);
         if (ptr == NULL) {
             return NULL;
         }
+        *fresh = true;
         return ptr->data;
     }
     // found a free block
-    size_t residual_size = cur->size - size;
+    *fresh = false;
+    check_poison(cur);
+    free_list_remove(cur);
+    cur->free = false;
     // split the block if large enough
-    if (residual_size >= sizeof(struct metadata)) {
-        // pointer to the metadata of new block within the block
-        struct metadata *ptr = (void *) cur + sizeof(struct metadata) + size;
-        // set pointers for the metadata of new block
-        ptr->prev = cur;
-        ptr->next = cur->next;
-        ptr->free = true;
-        ptr->size = residual_size - sizeof(struct metadata);
-        // set pointers for block to return
-        cur->free = false;
-        cur->size = size;
-        if (cur->next != NULL) {
-            cur->next->prev = ptr;
-        }
-        cur->next = ptr;
-    } else {
-        cur->free = false;
+    if (cur->size - size >= sizeof(struct metadata)) {
+        split_block(cur, size);
     }
     // return the pointer to the beginning of allocated space
     return cur->data;
 }
 
+/* Return the metadata of the block in use whose data PTR points at, or
+ * NULL if PTR isn't one. Found by pointer arithmetic and checked: PTR
+ * must lie on the heap, and the metadata before it must bear the magic
+ * number and be linked to by its neighbors. Merging a block into its
+ * neighbor zeroes its metadata, so a stale pointer to it is refused.
+ * A pointer off the heap is looked for among the mapped blocks, which
+ * are few, as each is at least MMAP_THRESHOLD; reading before it could
+ * fault if it is stale. The heap lock must be held. */
+static struct metadata *find_block(void *ptr) {
+    if (start == NULL || (char *) ptr < start->data || (char *) ptr > end->data) {
+        struct metadata *cur = mapped;
+        while (cur != NULL && cur->data != ptr) {
+            cur = cur->next;
+        }
+        return cur;
+    }
+    struct metadata *cur = (void *) ((char *) ptr - offsetof(struct metadata, data));
+    if (cur->magic != BLOCK_MAGIC || cur->free || cur->mapped || cur->pending
+            || (cur->prev != NULL ? cur->prev->next != cur : cur != start)
+            || (cur->next != NULL ? cur->next->prev != cur : cur != end)) {
+        return NULL;
+    }
+    return cur;
+}
+
+/* Free block CUR, in use on the heap. The heap lock must be held. */
+static void heap_free(struct metadata *cur) {
+    // mark the block as free
+    cur->free = true;
+    poison(cur->data, cur->size);
+    // coalesce with any right free block
+    if (cur->next != NULL && cur->next->free == true) {
+        free_list_remove(cur->next);
+        coalesce(cur);
+    }
+    // coalesce with any left free block
+    if (cur->prev != NULL && cur->prev->free == true) {
+        cur = cur->prev;
+        free_list_remove(cur);
+        coalesce(cur);
+    }
+    free_list_insert(cur);
+    release(cur);
+}
+
+/* Leave block CUR, in use on the heap, for whoever holds the heap lock
+ * next to free. */
+static void pending_push(struct metadata *cur) {
+    cur->pending = true;
+    cur->free_next = __atomic_load_n(&pending_frees, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pending_frees, &cur->free_next, cur, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        continue;
+    }
+}
+
+/* Free the blocks left on PENDING_FREES. The heap lock must be held. */
+static void drain_pending(void) {
+    struct metadata *cur = __atomic_exchange_n(&pending_frees, NULL, __ATOMIC_ACQUIRE);
+    while (cur != NULL) {
+        struct metadata *next = cur->free_next;
+        cur->pending = false;
+        if (find_block(cur->data) == cur) {
+            heap_free(cur);
+        }
+        cur = next;
+    }
+}
+
+/* Take and release the heap lock, freeing what was left pending. */
+static void lock_heap(void) {
+    pthread_mutex_lock(&heap_lock);
+    drain_pending();
+}
+
+static void unlock_heap(void) {
+    drain_pending();
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* Return the class of slots that fit SIZE, of up to SMALL_MAX. */
+static int slot_class(size_t size) {
+    int class = 0;
+    while (slot_sizes[class] < size) {
+        class++;
+    }
+    return class;
+}
+
+/* Return the run PTR is a slot of, or NULL if it isn't one. Any pointer
+ * off the heap that isn't where a mapped block's data would be is taken
+ * to be in a run; reading its header could fault if it is stale. */
+static struct run *find_run(void *ptr) {
+    struct metadata *first = __atomic_load_n(&start, __ATOMIC_ACQUIRE);
+    struct metadata *last = __atomic_load_n(&end, __ATOMIC_ACQUIRE);
+    if (first != NULL && (char *) ptr >= first->data && (char *) ptr <= last->data) {
+        return NULL;
+    }
+    uintptr_t offset = (uintptr_t) ptr % RUN_SIZE;
+    if (offset == offsetof(struct metadata, data) || offset < RUN_HEADER) {
+        return NULL;
+    }
+    struct run *run = (void *) ((uintptr_t) ptr - offset);
+    if (run->magic != RUN_MAGIC) {
+        return NULL;
+    }
+    size_t size = slot_sizes[run->class];
+    if ((offset - RUN_HEADER) % size != 0 || (offset - RUN_HEADER) / size >= run->slots) {
+        return NULL;
+    }
+    return run;
+}
+
+/* Return whether slot INDEX of RUN is free. Its bit changes only with
+ * the slab lock held, but is read without it. */
+static bool slot_is_free(struct run *run, unsigned index) {
+    uint64_t word = __atomic_load_n(&run->free_bits[index / 64], __ATOMIC_RELAXED);
+    return word & (1ULL << (index % 64));
+}
+
+/* Add RUN, which has a free slot, to or take it out of its class's. The
+ * slab lock must be held. */
+static void run_link(struct run *run) {
+    run->prev = NULL;
+    run->next = runs[run->class];
+    if (run->next != NULL) {
+        run->next->prev = run;
+    }
+    runs[run->class] = run;
+}
+
+static void run_unlink(struct run *run) {
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        runs[run->class] = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+}
+
+/* Start a run of slots of CLASS, and add it to its class's. Runs are
+ * mapped RUNS_PER_CHUNK at a time, or a huge page's worth with
+ * MM_HUGEPAGES=1, and reused once empty. Return NULL if failed. The slab
+ * lock must be held. */
+static struct run *run_new(int class) {
+    if (spare_runs == NULL) {
+        size_t length = use_huge_pages() ? HUGE_PAGE_SIZE : RUN_SIZE * RUNS_PER_CHUNK;
+        char *chunk = use_huge_pages() ? map_huge(length, PROT_READ | PROT_WRITE, 0)
+                                       : mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == NULL || chunk == MAP_FAILED) {
+            return NULL;
+        }
+        account(length);
+        run_bytes += length;
+        for (size_t i = 0; i < length / RUN_SIZE; i++) {
+            struct run *run = (void *) (chunk + i * RUN_SIZE);
+            run->next = spare_runs;
+            spare_runs = run;
+            spare_count++;
+        }
+    }
+    struct run *run = spare_runs;
+    spare_runs = run->next;
+    spare_count--;
+    run->magic = RUN_MAGIC;
+    run->class = class;
+    run->slots = (RUN_SIZE - RUN_HEADER) / slot_sizes[class];
+    run->free = run->slots;
+    class_slots[class] += run->slots;
+    memset(run->free_bits, 0, sizeof(run->free_bits));
+    for (unsigned i = 0; i < run->slots; i++) {
+        run->free_bits[i / 64] |= 1ULL << (i % 64);
+    }
+    poison((char *) run + RUN_HEADER, RUN_SIZE - RUN_HEADER);
+    run_link(run);
+    return run;
+}
+
+/* Take the lowest free slot of CLASS, or return NULL. The slab lock must
+ * be held. */
+static void *run_take(int class) {
+    struct run *run = runs[class];
+    if (run == NULL && (run = run_new(class)) == NULL) {
+        return NULL;
+    }
+    int word = 0;
+    while (run->free_bits[word] == 0) {
+        word++;
+    }
+    unsigned index = word * 64 + __builtin_ctzll(run->free_bits[word]);
+    __atomic_fetch_and(&run->free_bits[word], ~(1ULL << (index % 64)), __ATOMIC_RELAXED);
+    class_taken[class]++;
+    if (--run->free == 0) {
+        run_unlink(run);
+    }
+    return (char *) run + RUN_HEADER + index * slot_sizes[class];
+}
+
+/* Give slot PTR back to its run RUN. A run left empty is kept for reuse
+ * unless its class has others, or there are RUN_RESERVE spare already,
+ * when it is unmapped; with MM_HUGEPAGES=1 it is always kept, as
+ * unmapping it would split its huge page. The slab lock must be held. */
+static void run_put(struct run *run, void *ptr) {
+    unsigned index = ((char *) ptr - (char *) run - RUN_HEADER) / slot_sizes[run->class];
+    if (slot_is_free(run, index)) {
+        return;
+    }
+    __atomic_fetch_or(&run->free_bits[index / 64], 1ULL << (index % 64), __ATOMIC_RELAXED);
+    class_taken[run->class]--;
+    if (run->free++ == 0) {
+        run_link(run);
+    }
+    if (run->free == run->slots && (run->prev != NULL || run->next != NULL)) {
+        run_unlink(run);
+        run->magic = 0;
+        class_slots[run->class] -= run->slots;
+        if (spare_count < RUN_RESERVE || use_huge_pages()) {
+            run->next = spare_runs;
+            spare_runs = run;
+            spare_count++;
+        } else {
+            munmap(run, RUN_SIZE);
+            account(-RUN_SIZE);
+            run_bytes -= RUN_SIZE;
+        }
+    }
+}
+
+/* Give the slots in exiting thread's cache CACHE back to their runs. */
+static void tcache_flush(void *cache_) {
+    struct tcache *cache = cache_;
+    pthread_mutex_lock(&slab_lock);
+    for (int class = 0; class < SLOT_CLASSES; class++) {
+        for (int i = 0; i < cache->counts[class]; i++) {
+            run_put(find_run(cache->slots[class][i]), cache->slots[class][i]);
+        }
+        __atomic_store_n(&cache->counts[class], 0, __ATOMIC_RELAXED);
+    }
+    if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+    } else {
+        tcaches = cache->next;
+    }
+    if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+    }
+    cache->registered = false;
+    pthread_mutex_unlock(&slab_lock);
+}
+
+static void tcache_init(void) {
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+/* Have this thread's cache flushed when it exits. Return false if that
+ * can't be done, and it must keep nothing. */
+static bool tcache_register(void) {
+    // pthread_setspecific() may allocate, which must not register again
+    static __thread bool registering;
+    if (!tcache.registered) {
+        if (registering) {
+            return false;
+        }
+        registering = true;
+        pthread_once(&tcache_once, tcache_init);
+        int error = pthread_setspecific(tcache_key, &tcache);
+        registering = false;
+        if (error != 0) {
+            return false;
+        }
+        tcache.registered = true;
+        pthread_mutex_lock(&slab_lock);
+        tcache.prev = NULL;
+        tcache.next = tcaches;
+        if (tcaches != NULL) {
+            tcaches->prev = &tcache;
+        }
+        tcaches = &tcache;
+        pthread_mutex_unlock(&slab_lock);
+    }
+    return true;
+}
+
+/* Allocate a slot for SIZE, of up to SMALL_MAX, from this thread's cache,
+ * filling it with TCACHE_BATCH slots from the runs if empty. Return NULL
+ * if failed. */
+static void *slot_allocate(size_t size) {
+    int class = slot_class(size);
+    unsigned char *count = &tcache.counts[class];
+    if (*count == 0) {
+        void *taken[TCACHE_BATCH];
+        int n = 0;
+        // a thread whose cache can't be registered takes one at a time
+        int batch = tcache_register() ? TCACHE_BATCH : 1;
+        pthread_mutex_lock(&slab_lock);
+        while (n < batch && (taken[n] = run_take(class)) != NULL) {
+            n++;
+        }
+        pthread_mutex_unlock(&slab_lock);
+        // the lowest is handed out first
+        for (int i = 0; i < n; i++) {
+            tcache.slots[class][i] = taken[n - 1 - i];
+        }
+        if (n == 0) {
+            return NULL;
+        }
+        __atomic_store_n(count, n, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(count, *count - 1, __ATOMIC_RELAXED);
+    void *ptr = tcache.slots[class][*count];
+#ifdef MM_POISON
+    for (size_t i = 0; i < slot_sizes[class]; i++) {
+        if (((unsigned char *) ptr)[i] != POISON_BYTE) {
+            fprintf(stderr, "mm_alloc: block at %p written after free\n", ptr);
+            abort();
+        }
+    }
+#endif
+    return ptr;
+}
+
+/* Free slot PTR of RUN into this thread's cache, first giving the
+ * TCACHE_BATCH it has kept longest back to their runs if it is full. */
+static void slot_free(struct run *run, void *ptr) {
+    int class = run->class;
+    unsigned char *count = &tcache.counts[class];
+    unsigned index = ((char *) ptr - (char *) run - RUN_HEADER) / slot_sizes[class];
+    // not a slot in use, do nothing
+    if (slot_is_free(run, index)) {
+        return;
+    }
+    for (int i = 0; i < *count; i++) {
+        if (tcache.slots[class][i] == ptr) {
+            return;
+        }
+    }
+    poison(ptr, slot_sizes[class]);
+    if (!tcache_register()) {
+        pthread_mutex_lock(&slab_lock);
+        run_put(run, ptr);
+        pthread_mutex_unlock(&slab_lock);
+        return;
+    }
+    if (*count == TCACHE_COUNT) {
+        pthread_mutex_lock(&slab_lock);
+        for (int i = 0; i < TCACHE_BATCH; i++) {
+            run_put(find_run(tcache.slots[class][i]), tcache.slots[class][i]);
+        }
+        pthread_mutex_unlock(&slab_lock);
+        memmove(tcache.slots[class], tcache.slots[class] + TCACHE_BATCH,
+                (TCACHE_COUNT - TCACHE_BATCH) * sizeof(void *));
+        __atomic_store_n(count, TCACHE_COUNT - TCACHE_BATCH, __ATOMIC_RELAXED);
+    }
+    tcache.slots[class][*count] = ptr;
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+/* With MM_PROFILE=FILE in the environment, about one allocation in every
+ * MM_PROFILE_RATE bytes allocated (PROFILE_DEFAULT_RATE by default) is
+ * sampled: the stack it was made from is recorded, and it is counted
+ * against that stack until it is freed. The gaps between samples are
+ * drawn from an exponential distribution of that mean, so any allocation
+ * is sampled with a chance that grows with its size, and pprof can scale
+ * the counts back up. They are written as a pprof heap profile to
+ * FILE.PID.SEQ.heap on SIGUSR2 and at exit. A block resized in place by
+ * mm_realloc keeps the size it was sampled at. */
+#define PROFILE_DEFAULT_RATE (512 * 1024)
+#define PROFILE_SIGNAL SIGUSR2
+
+/* Frames kept of each stack, and most stacks and live samples tracked;
+ * allocations past either go unsampled. Both counts are powers of two. */
+#define PROFILE_DEPTH 32
+#define PROFILE_STACKS 4096
+#define PROFILE_SAMPLES 65536
+
+struct profile_stack {
+    void *pcs[PROFILE_DEPTH];
+    int depth;
+    size_t live_count;
+    size_t live_bytes;
+    size_t total_count;
+    size_t total_bytes;
+};
+
+struct profile_sample {
+    void *ptr;
+    size_t size;
+    struct profile_stack *stack;
+    // next in its hash chain, or among the unused samples
+    struct profile_sample *next;
+};
+
+/* Mean bytes between samples, or 0 if the profiler is off. The stacks,
+ * samples, and the hash chains of live samples by address are mapped
+ * when it is turned on, and all guarded by PROFILE_LOCK. A chain's head
+ * is also read without it, by frees checking for a sample. */
+static size_t profile_rate;
+static const char *profile_path;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct profile_stack *profile_stacks;
+static struct profile_sample **profile_chains;
+static struct profile_sample *profile_unused;
+static int profile_seq;
+static volatile sig_atomic_t profile_dump_pending;
+
+/* Bytes this thread allocates before its next sample, the state of its
+ * random numbers, and whether it is taking a sample, when it allocates
+ * nothing more for the profile. */
+static __thread intptr_t profile_left;
+static __thread uint64_t profile_random;
+static __thread bool profile_busy;
+
+/* The profile being written, formatted by hand, as stdio might
+ * allocate. */
+static int profile_fd;
+static char profile_buffer[16 * 1024];
+static size_t profile_len;
+
+static unsigned profile_hash(void *ptr) {
+    return ((uintptr_t) ptr >> 4) * 0x9e3779b97f4a7c15ull >> 48 & (PROFILE_SAMPLES - 1);
+}
+
+/* Return the bytes until this thread's next sample: exponentially
+ * distributed, with a mean of PROFILE_RATE. */
+static intptr_t profile_gap(void) {
+    if (profile_random == 0) {
+        profile_random = ((uintptr_t) &profile_random ^ (uint64_t) time(NULL) << 32) | 1;
+    }
+    // xorshift64*
+    profile_random ^= profile_random >> 12;
+    profile_random ^= profile_random << 25;
+    profile_random ^= profile_random >> 27;
+    double u = ((profile_random * 0x2545f4914f6cdd1dull >> 11) + 1.0) / 9007199254740992.0;
+    return (intptr_t) (-log(u) * profile_rate) + 1;
+}
+
+/* Return the stack of DEPTH frames at PCS, adding it if it is new, or
+ * NULL if there's no room for it. The profile lock must be held. */
+static struct profile_stack *profile_find_stack(void **pcs, int depth) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t) pcs[i]) * 1099511628211ull;
+    }
+    for (int probe = 0; probe < PROFILE_STACKS; probe++) {
+        struct profile_stack *stack = &profile_stacks[(hash + probe) & (PROFILE_STACKS - 1)];
+        if (stack->depth == 0) {
+            memcpy(stack->pcs, pcs, depth * sizeof(void *));
+            stack->depth = depth;
+            return stack;
+        }
+        if (stack->depth == depth && memcmp(stack->pcs, pcs, depth * sizeof(void *)) == 0) {
+            return stack;
+        }
+    }
+    return NULL;
+}
+
+static void profile_flush(void) {
+    size_t done = 0;
+    while (done < profile_len) {
+        ssize_t n = write(profile_fd, profile_buffer + done, profile_len - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    profile_len = 0;
+}
+
+/* Append string S, and number N in BASE, to the profile. */
+static void profile_string(const char *s) {
+    for (; *s != '\0'; s++) {
+        if (profile_len == sizeof(profile_buffer)) {
+            profile_flush();
+        }
+        profile_buffer[profile_len++] = *s;
+    }
+}
+
+static void profile_number(uintptr_t n, unsigned base) {
+    char digits[24];
+    int count = 0;
+    do {
+        digits[count++] = "0123456789abcdef"[n % base];
+        n /= base;
+    } while (n != 0);
+    digits[count] = '\0';
+    for (int i = 0; i < count / 2; i++) {
+        char c = digits[i];
+        digits[i] = digits[count - 1 - i];
+        digits[count - 1 - i] = c;
+    }
+    profile_string(digits);
+}
+
+/* Append a profile line's counts: "LIVE: BYTES [TOTAL: BYTES] @ ". */
+static void profile_counts(size_t live_count, size_t live_bytes, size_t total_count,
+                           size_t total_bytes) {
+    profile_number(live_count, 10);
+    profile_string(": ");
+    profile_number(live_bytes, 10);
+    profile_string(" [");
+    profile_number(total_count, 10);
+    profile_string(": ");
+    profile_number(total_bytes, 10);
+    profile_string("] @ ");
+}
+
+/* Write the next profile: a line for the totals and one for each stack,
+ * then the process's mappings, for pprof to find its symbols in. The
+ * profile lock must be held. */
+static void profile_dump(void) {
+    profile_dump_pending = 0;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d.%04d.heap", profile_path, (int) getpid(),
+             ++profile_seq);
+    profile_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (profile_fd < 0) {
+        return;
+    }
+    size_t totals[4] = { 0 };
+    for (int i = 0; i < PROFILE_STACKS; i++) {
+        totals[0] += profile_stacks[i].live_count;
+        totals[1] += profile_stacks[i].live_bytes;
+        totals[2] += profile_stacks[i].total_count;
+        totals[3] += profile_stacks[i].total_bytes;
+    }
+    profile_string("heap profile: ");
+    profile_counts(totals[0], totals[1], totals[2], totals[3]);
+    profile_string("heap_v2/");
+    profile_number(profile_rate, 10);
+    profile_string("\n");
+    for (int i = 0; i < PROFILE_STACKS; i++) {
+        struct profile_stack *stack = &profile_stacks[i];
+        if (stack->depth == 0) {
+            continue;
+        }
+        profile_counts(stack->live_count, stack->live_bytes, stack->total_count,
+                       stack->total_bytes);
+        for (int frame = 0; frame < stack->depth; frame++) {
+            profile_string(frame > 0 ? " 0x" : "0x");
+            profile_number((uintptr_t) stack->pcs[frame], 16);
+        }
+        profile_string("\n");
+    }
+    profile_string("\nMAPPED_LIBRARIES:\n");
+    profile_flush();
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        ssize_t n;
+        while ((n = read(maps, profile_buffer, sizeof(profile_buffer))) > 0) {
+            profile_len = n;
+            profile_flush();
+        }
+        close(maps);
+    }
+    close(profile_fd);
+}
+
+/* Sample PTR, just allocated for SIZE, unless this thread is just
+ * starting, whose first gap is drawn instead. The two frames above the
+ * caller's, this one and the mm_* routine's, are left out of its stack. */
+__attribute__((noinline))
+static void profile_sample(void *ptr, size_t size) {
+    bool started = profile_random != 0;
+    profile_left = profile_gap();
+    if (!started || profile_busy) {
+        return;
+    }
+    // backtrace() may allocate, the first time
+    profile_busy = true;
+    void *pcs[PROFILE_DEPTH + 2];
+    int depth = backtrace(pcs, PROFILE_DEPTH + 2) - 2;
+    pthread_mutex_lock(&profile_lock);
+    struct profile_stack *stack = depth > 0 ? profile_find_stack(pcs + 2, depth) : NULL;
+    struct profile_sample *sample = profile_unused;
+    if (stack != NULL && sample != NULL) {
+        profile_unused = sample->next;
+        sample->ptr = ptr;
+        sample->size = size;
+        sample->stack = stack;
+        struct profile_sample **chain = &profile_chains[profile_hash(ptr)];
+        sample->next = *chain;
+        __atomic_store_n(chain, sample, __ATOMIC_RELEASE);
+        stack->live_count++;
+        stack->live_bytes += size;
+        stack->total_count++;
+        stack->total_bytes += size;
+    }
+    if (profile_dump_pending) {
+        profile_dump();
+    }
+    pthread_mutex_unlock(&profile_lock);
+    profile_busy = false;
+}
+
+/* Count an allocation of SIZE at PTR toward the next sample. */
+static inline __attribute__((always_inline)) void profile_allocated(void *ptr, size_t size) {
+    if (profile_rate != 0 && ptr != NULL && (profile_left -= size) < 0) {
+        profile_sample(ptr, size);
+    }
+}
+
+/* Stop counting PTR, about to be freed, if it was sampled. */
+static void profile_freed(void *ptr) {
+    struct profile_sample **chain = &profile_chains[profile_hash(ptr)];
+    if (__atomic_load_n(chain, __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&profile_lock);
+    for (; *chain != NULL; chain = &(*chain)->next) {
+        struct profile_sample *sample = *chain;
+        if (sample->ptr == ptr) {
+            __atomic_store_n(chain, sample->next, __ATOMIC_RELEASE);
+            sample->stack->live_count--;
+            sample->stack->live_bytes -= sample->size;
+            sample->next = profile_unused;
+            profile_unused = sample;
+            break;
+        }
+    }
+    if (profile_dump_pending) {
+        profile_dump();
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* Write a profile now, or if the profile lock is held, perhaps by the
+ * thread the signal interrupted, have whoever holds it next write it. */
+static void profile_signal(int sig) {
+    int saved = errno;
+    if (pthread_mutex_trylock(&profile_lock) == 0) {
+        profile_dump();
+        pthread_mutex_unlock(&profile_lock);
+    } else {
+        profile_dump_pending = 1;
+    }
+    errno = saved;
+}
+
+static void profile_exit(void) {
+    pthread_mutex_lock(&profile_lock);
+    profile_dump();
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* Turn the profiler on, writing to PATH. */
+static void profile_init(const char *path) {
+    const char *rate = getenv("MM_PROFILE_RATE");
+    size_t mean = rate != NULL ? strtoul(rate, NULL, 10) : PROFILE_DEFAULT_RATE;
+    size_t length = PROFILE_STACKS * sizeof(struct profile_stack)
+                    + PROFILE_SAMPLES * (sizeof(struct profile_sample) + sizeof(void *));
+    char *tables = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    if (mean == 0 || tables == MAP_FAILED) {
+        return;
+    }
+    profile_stacks = (void *) tables;
+    profile_chains = (void *) (tables + PROFILE_STACKS * sizeof(struct profile_stack));
+    struct profile_sample *samples = (void *) (profile_chains + PROFILE_SAMPLES);
+    for (int i = 0; i < PROFILE_SAMPLES; i++) {
+        samples[i].next = profile_unused;
+        profile_unused = &samples[i];
+    }
+    profile_path = path;
+    // load what backtrace() needs now, rather than while sampling
+    void *pcs[1];
+    backtrace(pcs, 1);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_signal;
+    action.sa_flags = SA_RESTART;
+    sigaction(PROFILE_SIGNAL, &action, NULL);
+    atexit(profile_exit);
+    __atomic_store_n(&profile_rate, mean, __ATOMIC_RELEASE);
+}
+
+/* Allocate and return a pointer to a new block of heap memory of SIZE,
+ * setting *FRESH if it is new to the heap and so zero-filled. */
+static void *allocate(size_t size, bool *fresh) {
+    // a small request gets a slot
+    if (size <= SMALL_MAX) {
+        *fresh = false;
+        return slot_allocate(size);
+    }
+    // a large block gets a mapping of its own
+    if (size >= MMAP_THRESHOLD) {
+        struct metadata *ptr = allocate_mapped(size);
+        if (ptr != NULL) {
+            *fresh = true;
+            return ptr->data;
+        }
+    }
+    lock_heap();
+    void *ptr = heap_allocate(size, fresh);
+    unlock_heap();
+    return ptr;
+}
+
+/* Allocate and return a pointer to a new block of heap memory of SIZE.
+ * Its contents are undefined.
+ * Return NULL if size is 0 or cannot allocate new requested size. */
+void *mm_malloc(size_t size) {
+    // base case
+    if (size == 0) {
+        return NULL;
+    }
+    bool fresh;
+    void *ptr = allocate(size, &fresh);
+    profile_allocated(ptr, size);
+    return ptr;
+}
+
+/* Allocate and return a pointer to a new zero-filled block of heap memory
+ * for NMEMB elements of SIZE. Return NULL if either is 0, their product
+ * overflows, or it cannot be allocated. */
+void *mm_calloc(size_t nmemb, size_t size) {
+    // base case
+    if (nmemb == 0 || size == 0 || nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    bool fresh;
+    void *ptr = allocate(nmemb * size, &fresh);
+    // a block new to the heap is zero already
+    if (ptr != NULL && !fresh) {
+        memset(ptr, 0, nmemb * size);
+    }
+    profile_allocated(ptr, nmemb * size);
+    return ptr;
+}
+
+/* Return the metadata before PTR if PTR lies on the heap and it looks
+ * like a block in use, or else NULL, without taking the heap lock. Only
+ * the caller's own block is read, which no other thread changes. */
+static struct metadata *peek_block(void *ptr) {
+    struct metadata *first = __atomic_load_n(&start, __ATOMIC_ACQUIRE);
+    struct metadata *last = __atomic_load_n(&end, __ATOMIC_ACQUIRE);
+    if (first == NULL || (char *) ptr < first->data || (char *) ptr > last->data) {
+        return NULL;
+    }
+    struct metadata *cur = (void *) ((char *) ptr - offsetof(struct metadata, data));
+    if (cur->magic != BLOCK_MAGIC || cur->free || cur->pending) {
+        return NULL;
+    }
+    return cur;
+}
+
 /* Free the block memory pointed at PTR. */
 void mm_free(void *ptr) {
     // base case
     if (ptr == NULL) {
         return;
     }
-    // get the pointer to the metadata of the block to be freed
-    // note that we walk through the chain, instead of doing 
-    // pointer arithmetics to prevent invalid pointer to a block
-    struct metadata *cur = start;
-    while (cur != NULL && cur->data != ptr) {
-        cur = cur->next;
+    if (profile_rate != 0) {
+        profile_freed(ptr);
     }
-    // block not found, do nothing
-    if (cur == NULL) {
+    struct run *run = find_run(ptr);
+    if (run != NULL) {
+        slot_free(run, ptr);
         return;
     }
-    // mark the block as free
-    cur->free = true;
-    // zero out data
-    memset(cur->data, 0, cur->size);
-    // if the right block is free, we advance our pointer
-    if (cur->next != NULL && cur->next->free == true) {
-        cur = cur->next;
-    } 
-    // coalesce with any left free block
-    if (cur->prev != NULL && cur->prev->free == true) {
-        // increase size of the left block
-        cur->prev->size += cur->size + sizeof(struct metadata);
-        // release the metadata for this block
-        cur->prev->next = cur->next;
-        if (cur->next != NULL) {
-            cur->next->prev = cur->prev;
+    struct metadata *cur = peek_block(ptr);
+    if (cur != NULL) {
+        // rather than wait for the lock, leave it to whoever holds it
+        if (pthread_mutex_trylock(&heap_lock) != 0) {
+            pending_push(cur);
+            return;
         }
-        // zero out metadata
-        memset(cur, 0, sizeof(struct metadata));
+        drain_pending();
+    } else {
+        lock_heap();
     }
+    // get the pointer to the metadata of the block to be freed
+    cur = find_block(ptr);
+    // a mapped block goes straight back to the kernel, once unlocked
+    if (cur != NULL && cur->mapped) {
+        unlink_mapped(cur);
+        unlock_heap();
+        account(-(intptr_t) map_length(cur->size));
+        munmap(cur, map_length(cur->size));
+        return;
+    }
+    // not a block in use, do nothing
+    if (cur != NULL) {
+        heap_free(cur);
+    }
+    unlock_heap();
 }
 
+/* Resize block CUR to SIZE without copying it, if it can be done. Return
+ * the pointer to its data, which a mapped block may have moved, or NULL
+ * if it must be copied. The heap lock must be held. */
+static void *resize_in_place(struct metadata *cur, size_t size) {
+    // a mapped block that stays large is remapped, moving if it must
+    if (cur->mapped && size >= MMAP_THRESHOLD) {
+        struct metadata *moved = mremap(cur, map_length(cur->size), map_length(size),
+                                        MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED) {
+            return NULL;
+        }
+        account(map_length(size) - map_length(moved->size));
+        moved->size = size;
+        relink_mapped(moved);
+        return moved->data;
+    }
+    // shrink in place, giving back what's left if it makes a block
+    if (!cur->mapped && size <= cur->size) {
+        if (cur->size - size >= sizeof(struct metadata)) {
+            poison(cur->data + size, cur->size - size);
+            split_block(cur, size);
+            release(cur->next);
+        }
+        return cur->data;
+    }
+    // grow in place into a free right neighbor, if that makes room
+    struct metadata *right = cur->mapped ? NULL : cur->next;
+    bool right_free = right != NULL && right->free;
+    if (right_free && cur->size + sizeof(struct metadata) + right->size >= size) {
+        check_poison(right);
+        free_list_remove(right);
+        coalesce(cur);
+        if (cur->size - size >= sizeof(struct metadata)) {
+            split_block(cur, size);
+        }
+        return cur->data;
+    }
+    // grow a large block at the end of the heap by extending the heap;
+    // a small one costs less to copy than the sbrk
+    if (!cur->mapped && cur->size > SMALL_MAX
+            && (cur == end || (right_free && right == end))) {
+        struct metadata *last = cur == end ? cur : right;
+        // only if nothing else has moved the break since
+        if (heap_sbrk(0) == (void *) (last->data + last->size)) {
+            size_t extra = size - cur->size;
+            if (last != cur) {
+                extra -= right->size + sizeof(struct metadata);
+            }
+            if (heap_sbrk(extra) != (void *) -1) {
+                account(extra);
+                if (last != cur) {
+                    check_poison(right);
+                    free_list_remove(right);
+                    coalesce(cur);
+                }
+                cur->size = size;
+                return cur->data;
+            }
+        }
+    }
+    return NULL;
+}
 
 /* Reallocate the block of memory at PTR to SIZE. 
  * Return the pointer to the new block of memory. */
@@ -153,36 +1603,292 @@ void *mm_realloc(void *ptr, size_t size) {
         mm_free(ptr);
         return NULL;
     }
-    // get the pointer to the metadata of the block to be freed
-    // note that we walk through the chain, instead of doing 
-    // pointer arithmetics to prevent invalid pointer to a block
-    struct metadata *cur = start;
-    while (cur != NULL && cur->data != ptr) {
-        cur = cur->next;
+    // a slot that still fits stays put; otherwise it is copied
+    struct run *run = find_run(ptr);
+    if (run != NULL) {
+        size_t slot_size = slot_sizes[run->class];
+        if (size <= slot_size) {
+            return ptr;
+        }
+        void *new_ptr = mm_malloc(size);
+        if (new_ptr != NULL) {
+            memcpy(new_ptr, ptr, slot_size);
+            mm_free(ptr);
+        }
+        return new_ptr;
     }
-    // block not found, do nothing
-    if (cur == NULL) {
-        return NULL;
+    lock_heap();
+    // get the pointer to the metadata of the block to be reallocated
+    struct metadata *cur = find_block(ptr);
+    size_t old_size = cur != NULL ? cur->size : 0;
+    void *new_ptr = cur != NULL ? resize_in_place(cur, size) : NULL;
+    unlock_heap();
+    // not a block in use, do nothing
+    if (cur == NULL || new_ptr != NULL) {
+        return new_ptr;
     }
-    // copy our entire block to stack for backup
-    size_t old_data_size = cur->size;
-    size_t old_block_size = cur->size + sizeof(struct metadata);
-    char old_block[old_block_size];
-    memcpy(old_block, cur, old_block_size);
-    // free old block
-    mm_free(cur->data);
-    // allocate a new block
-    void *new_ptr = mm_malloc(size);
+    // allocate a new block, keeping the old one until that succeeds;
+    // it stays ours meanwhile, so needs no lock
+    new_ptr = mm_malloc(size);
     if (new_ptr == NULL) {
-        // restore our entire old block
-        memcpy(cur, old_block, old_block_size);
         return NULL;
     }
-    // copy over content of old block;
-    if (old_data_size < size) {
-        size = old_data_size;
-    }
-    memcpy(new_ptr, (void *)old_block + sizeof(struct metadata), size);
+    // copy over content of old block
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    mm_free(ptr);
     return new_ptr;
 }
 
+/* Return where data aligned to ALIGNMENT would start in block CUR: its
+ * own data if that is aligned, or else the first aligned address with
+ * room for metadata before it. */
+static char *aligned_data(struct metadata *cur, size_t alignment) {
+    if ((uintptr_t) cur->data % alignment == 0) {
+        return cur->data;
+    }
+    return (char *) (((uintptr_t) cur->data + sizeof(struct metadata) + alignment - 1)
+                     & ~(uintptr_t) (alignment - 1));
+}
+
+/* Return whether free block CUR can hold SIZE at data aligned to
+ * ALIGNMENT. */
+static bool fits_aligned(struct metadata *cur, size_t alignment, size_t size) {
+    return aligned_data(cur, alignment) + size <= cur->data + cur->size;
+}
+
+/* Return the least block in the subtree rooted at H that can hold SIZE at
+ * data aligned to ALIGNMENT, or NULL. Subtrees of blocks too small are
+ * skipped. */
+static struct metadata *tree_aligned_fit(struct metadata *h, size_t alignment, size_t size) {
+    while (h != NULL && h->size < size) {
+        h = h->right;
+    }
+    if (h == NULL) {
+        return NULL;
+    }
+    struct metadata *found = tree_aligned_fit(h->left, alignment, size);
+    if (found == NULL && fits_aligned(h, alignment, size)) {
+        found = h;
+    }
+    return found != NULL ? found : tree_aligned_fit(h->right, alignment, size);
+}
+
+/* Return a free block that can hold SIZE at data aligned to ALIGNMENT,
+ * or NULL. Any block of SIZE or more may, so all are searched, smallest
+ * first. */
+static struct metadata *find_aligned_fit(size_t alignment, size_t size) {
+    int class = size <= SMALL_MAX ? next_class(size) : -1;
+    while (class >= 0) {
+        for (struct metadata *cur = free_lists[class]; cur != NULL; cur = cur->free_next) {
+            if (fits_aligned(cur, alignment, size)) {
+                return cur;
+            }
+        }
+        class = class + 1 < SMALL_CLASSES ? next_class(class + 1) : -1;
+    }
+    return tree_aligned_fit(free_tree, alignment, size);
+}
+
+/* Carve a block for SIZE at data aligned to ALIGNMENT out of block CUR,
+ * taken off the free lists and marked in use, which must be able to hold
+ * it. What's before it goes back on the free lists as a block of its
+ * own, or to the block in use before, if too small to be worth one, and
+ * what's after as well, if big enough. Return the aligned data. */
+static void *carve_aligned(struct metadata *cur, size_t alignment, size_t size) {
+    char *data = aligned_data(cur, alignment);
+    if (data != cur->data) {
+        size_t gap = data - cur->data;
+        struct metadata *block = (void *) (data - offsetof(struct metadata, data));
+        block->size = cur->size - gap;
+        block->free = false;
+        block->mapped = false;
+        block->pending = false;
+        block->magic = BLOCK_MAGIC;
+        block->prev = cur;
+        block->next = cur->next;
+        block->free_prev = NULL;
+        block->free_next = NULL;
+        if (cur->next != NULL) {
+            cur->next->prev = block;
+        } else {
+            __atomic_store_n(&end, block, __ATOMIC_RELEASE);
+        }
+        cur->next = block;
+        cur->size = gap - sizeof(struct metadata);
+        struct metadata *prev = cur->prev;
+        if (cur->size < sizeof(struct metadata) && prev != NULL && !prev->free) {
+            prev->size += gap;
+            prev->next = block;
+            block->prev = prev;
+            memset(cur, 0, sizeof(struct metadata));
+        } else {
+            heap_free(cur);
+        }
+        cur = block;
+    }
+    if (cur->size - size >= sizeof(struct metadata)) {
+        poison(cur->data + size, cur->size - size);
+        split_block(cur, size);
+    }
+    return cur->data;
+}
+
+/* Allocate a block for SIZE on the heap whose data is aligned to
+ * ALIGNMENT, carved out of a free block that can hold it, or else out of
+ * a new block big enough to. The heap lock must be held. */
+static void *heap_allocate_aligned(size_t alignment, size_t size) {
+    struct metadata *cur = find_aligned_fit(alignment, size);
+    if (cur != NULL) {
+        check_poison(cur);
+        free_list_remove(cur);
+        cur->free = false;
+    } else {
+        bool fresh;
+        char *data = heap_allocate(size + alignment + sizeof(struct metadata), &fresh);
+        if (data == NULL) {
+            return NULL;
+        }
+        cur = (void *) (data - offsetof(struct metadata, data));
+    }
+    return carve_aligned(cur, alignment, size);
+}
+
+void *mm_memalign(size_t alignment, size_t size) {
+    // base case
+    if (size == 0 || alignment == 0 || (alignment & (alignment - 1)) != 0
+            || size > SIZE_MAX - alignment - sizeof(struct metadata)) {
+        return NULL;
+    }
+    // a slot of a size that is a multiple of ALIGNMENT is aligned to it,
+    // for ALIGNMENT up to 16
+    size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+    void *ptr;
+    if (alignment <= 16 && rounded <= SMALL_MAX) {
+        ptr = slot_allocate(rounded);
+    } else {
+        lock_heap();
+        ptr = heap_allocate_aligned(alignment, size);
+        unlock_heap();
+    }
+    profile_allocated(ptr, size);
+    return ptr;
+}
+
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    struct run *run = find_run(ptr);
+    if (run != NULL) {
+        return slot_sizes[run->class];
+    }
+    lock_heap();
+    struct metadata *cur = find_block(ptr);
+    size_t size = cur != NULL ? cur->size : 0;
+    unlock_heap();
+    return size;
+}
+
+void mm_stats(struct mm_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    size_t heap_free = 0;
+    lock_heap();
+    for (struct metadata *cur = start; cur != NULL; cur = cur->next) {
+        if (cur->free) {
+            heap_free += cur->size;
+            if (cur->size > stats->largest_free) {
+                stats->largest_free = cur->size;
+            }
+        } else {
+            stats->in_use += cur->size;
+        }
+    }
+    if (start != NULL) {
+        stats->heap_bytes = end->data + end->size - (char *) start;
+    }
+    for (struct metadata *cur = mapped; cur != NULL; cur = cur->next) {
+        stats->in_use += cur->size;
+        stats->mapped_bytes += map_length(cur->size);
+    }
+    unlock_heap();
+    stats->free = heap_free;
+    if (heap_free > 0) {
+        stats->fragmentation = 1 - (double) stats->largest_free / heap_free;
+    }
+
+    pthread_mutex_lock(&slab_lock);
+    for (int class = 0; class < SLOT_CLASSES; class++) {
+        size_t in_use = class_taken[class];
+        for (struct tcache *cache = tcaches; cache != NULL; cache = cache->next) {
+            in_use -= __atomic_load_n(&cache->counts[class], __ATOMIC_RELAXED);
+        }
+        stats->classes[class].size = slot_sizes[class];
+        stats->classes[class].in_use = in_use;
+        stats->classes[class].free = class_slots[class] - in_use;
+        stats->in_use += in_use * slot_sizes[class];
+        stats->free += (class_slots[class] - in_use) * slot_sizes[class];
+    }
+    stats->mapped_bytes += run_bytes;
+    pthread_mutex_unlock(&slab_lock);
+    stats->peak_bytes = __atomic_load_n(&peak_footprint, __ATOMIC_RELAXED);
+}
+
+static void print_stats(void) {
+    struct mm_stats stats;
+    mm_stats(&stats);
+    fprintf(stderr, "mm_alloc: %zu bytes in use, %zu free, largest free block %zu, "
+            "%.1f%% fragmented\n", stats.in_use, stats.free, stats.largest_free,
+            stats.fragmentation * 100);
+    fprintf(stderr, "mm_alloc: %zu bytes from sbrk, %zu mapped, peak %zu\n",
+            stats.heap_bytes, stats.mapped_bytes, stats.peak_bytes);
+    fprintf(stderr, "mm_alloc: %6s %10s %10s\n", "slot", "in use", "free");
+    for (int class = 0; class < SLOT_CLASSES; class++) {
+        if (stats.classes[class].in_use + stats.classes[class].free > 0) {
+            fprintf(stderr, "mm_alloc: %6zu %10zu %10zu\n", stats.classes[class].size,
+                    stats.classes[class].in_use, stats.classes[class].free);
+        }
+    }
+}
+
+/* Hold all three locks across fork(), so the child doesn't inherit them
+ * held by a thread it doesn't have. */
+static void fork_prepare(void) {
+    pthread_mutex_lock(&profile_lock);
+    pthread_mutex_lock(&heap_lock);
+    pthread_mutex_lock(&slab_lock);
+}
+
+static void fork_parent(void) {
+    pthread_mutex_unlock(&slab_lock);
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* The child has only the thread that forked, and the other threads'
+ * caches are gone with them; the slots they held stay taken. */
+static void fork_child(void) {
+    tcaches = NULL;
+    if (tcache.registered) {
+        tcache.prev = NULL;
+        tcache.next = NULL;
+        tcaches = &tcache;
+    }
+    pthread_mutex_unlock(&slab_lock);
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* Make fork() safe, print the stats at exit if MM_STATS=1, and start the
+ * profiler if MM_PROFILE is set. */
+__attribute__((constructor))
+static void mm_init(void) {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+    const char *env = getenv("MM_STATS");
+    if (env != NULL && strcmp(env, "1") == 0) {
+        atexit(print_stats);
+    }
+    const char *profile = getenv("MM_PROFILE");
+    if (profile != NULL && profile[0] != '\0') {
+        profile_init(profile);
+    }
+}
@@ -1,13 +1,59 @@
 /*
  * mm_alloc.h
  *
- * A clone of the interface documented in "man 3 malloc".
+ * A clone of the interface documented in "man 3 malloc". Every routine
+ * may be called from any thread. With MM_HUGEPAGES=1 in the environment,
+ * the heap and the runs of small slots are backed by transparent huge
+ * pages where the kernel allows. With MM_PROFILE=FILE, a sample of the
+ * allocations is profiled by call stack, and written as a pprof heap
+ * profile to FILE.PID.SEQ.heap on SIGUSR2 and at exit; MM_PROFILE_RATE
+ * sets the mean bytes allocated between samples.
  */
 
 #pragma once
 
 #include <stdlib.h>
 
+/* Requests of up to 256 bytes are served from slots in a class of each
+ * of these many sizes. */
+#define MM_SLOT_CLASSES 16
+
+/* What mm_stats() reports. Bytes in use and free count the data of
+ * blocks and slots, not their metadata. Slots kept by threads to hand
+ * out again count as free. */
+struct mm_stats {
+    size_t in_use;
+    size_t free;
+    size_t largest_free;    /* largest free block on the heap */
+    size_t heap_bytes;      /* taken with sbrk, and still held */
+    size_t mapped_bytes;    /* mapped for large blocks and runs of slots */
+    size_t peak_bytes;      /* most heap_bytes + mapped_bytes ever held */
+    /* share of the bytes free on the heap that aren't in its largest
+     * free block, from 0 to 1 */
+    double fragmentation;
+    struct {
+        size_t size;
+        size_t in_use;
+        size_t free;
+    } classes[MM_SLOT_CLASSES];
+};
+
 void *mm_malloc(size_t size);
+void *mm_calloc(size_t nmemb, size_t size);
 void *mm_realloc(void *ptr, size_t size);
 void mm_free(void *ptr);
+
+/* Allocate a block of SIZE whose data is aligned to ALIGNMENT, a power of
+ * two, to be freed with mm_free(). It is carved out of free memory where
+ * possible, and the padding around it is kept free rather than wasted.
+ * Return NULL if SIZE is 0, ALIGNMENT isn't a power of two, or it cannot
+ * be allocated. */
+void *mm_memalign(size_t alignment, size_t size);
+
+/* Return the bytes usable at PTR, a block in use, which may be more than
+ * were asked for, or 0 if PTR isn't one. */
+size_t mm_usable_size(void *ptr);
+
+/* Fill STATS in. With MM_STATS=1 in the environment, they are printed to
+ * stderr at exit. */
+void mm_stats(struct mm_stats *stats);
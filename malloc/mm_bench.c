@@ -0,0 +1,573 @@
+/*
+ * mm_bench.c
+ *
+ * Benchmarks allocators on standard workloads and on recorded traces,
+ * reporting throughput, the most the workload held (live MB), peak RSS
+ * past what the process had before it started, and the ratio of the two:
+ * what fragmentation and metadata cost, the same way for any allocator.
+ *
+ * Each workload runs once per allocator, in a process of its own, so
+ * peak RSS is its own. An allocator is either a library exporting the
+ * mm_* routines, loaded like mm_test does, or "libc" for the C library's.
+ *
+ * Traces are recorded by running a program with LD_PRELOAD=mm_preload.so
+ * and MM_TRACE=FILE, and replayed in order on one thread. Each line is
+ * one call: "m PTR SIZE", "c PTR SIZE", "r OLD NEW SIZE" or "f PTR".
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The allocator under test */
+static void *(*bench_malloc)(size_t);
+static void *(*bench_calloc)(size_t, size_t);
+static void *(*bench_realloc)(void *, size_t);
+static void (*bench_free)(void *);
+
+/* Workload parameters */
+static long ops = 1000000;
+static int threads = 4;
+static unsigned seed = 1;
+
+/* Bytes the workload holds, and the most it has */
+static size_t live;
+static size_t peak_live;
+
+/* What a run reports back to the parent */
+struct result {
+    bool ok;
+    long ops;
+    double seconds;
+    size_t peak_live;
+    long baseline_kb;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Count DELTA bytes allocated, or freed if negative. */
+static void count_live(intptr_t delta) {
+    size_t now = __atomic_add_fetch(&live, delta, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_live, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&peak_live, &peak, now, true,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        continue;
+    }
+}
+
+/* Allocate SIZE bytes and touch them, as a program using them would. */
+static void *bench_alloc(size_t size) {
+    char *ptr = bench_malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "mm_bench: allocation of %zu failed\n", size);
+        exit(1);
+    }
+    memset(ptr, 0xa5, size);
+    count_live(size);
+    return ptr;
+}
+
+static void bench_release(void *ptr, size_t size) {
+    bench_free(ptr);
+    count_live(-(intptr_t) size);
+}
+
+/* Return a size as programs ask for: mostly small, sometimes large. */
+static size_t random_size(unsigned *state) {
+    int pick = rand_r(state) % 100;
+    if (pick < 80) {
+        return 8 + rand_r(state) % 121;
+    } else if (pick < 95) {
+        return 128 + rand_r(state) % 3969;
+    }
+    return 4096 + rand_r(state) % 61441;
+}
+
+/* Run RUN on THREADS threads, each given its index, and wait for all. */
+static void run_threads(void *(*run)(void *), int count) {
+    pthread_t workers[count];
+    for (long i = 0; i < count; i++) {
+        pthread_create(&workers[i], NULL, run, (void *) i);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+/* random: each thread allocates and frees blocks of random sizes in
+ * random order, holding up to 1024 at a time. */
+static void *random_run(void *arg) {
+    unsigned state = seed + (long) arg;
+    enum { SLOTS = 1024 };
+    void *ptrs[SLOTS] = { NULL };
+    size_t sizes[SLOTS];
+    for (long i = 0; i < ops / threads; i++) {
+        int slot = rand_r(&state) % SLOTS;
+        if (ptrs[slot] != NULL) {
+            bench_release(ptrs[slot], sizes[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            sizes[slot] = random_size(&state);
+            ptrs[slot] = bench_alloc(sizes[slot]);
+        }
+    }
+    for (int slot = 0; slot < SLOTS; slot++) {
+        if (ptrs[slot] != NULL) {
+            bench_release(ptrs[slot], sizes[slot]);
+        }
+    }
+    return NULL;
+}
+
+static long bench_random(void) {
+    run_threads(random_run, threads);
+    return ops / threads * threads;
+}
+
+/* prodcons: pairs of threads, where one allocates blocks and hands them
+ * over a ring to the other, which frees them. */
+#define RING_SIZE 4096
+
+struct ring {
+    void *ptrs[RING_SIZE];
+    size_t sizes[RING_SIZE];
+    unsigned long head;
+    unsigned long tail;
+};
+
+static struct ring *rings;
+
+static void *prodcons_run(void *arg) {
+    long index = (long) arg;
+    struct ring *ring = &rings[index / 2];
+    long count = ops / threads;
+    if (index % 2 == 0) {
+        unsigned state = seed + index;
+        for (long i = 0; i < count; i++) {
+            size_t size = random_size(&state);
+            void *ptr = bench_alloc(size);
+            unsigned long head = ring->head;
+            while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+                sched_yield();
+            }
+            ring->ptrs[head % RING_SIZE] = ptr;
+            ring->sizes[head % RING_SIZE] = size;
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        }
+    } else {
+        for (long i = 0; i < count; i++) {
+            unsigned long tail = ring->tail;
+            while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+                sched_yield();
+            }
+            bench_release(ring->ptrs[tail % RING_SIZE], ring->sizes[tail % RING_SIZE]);
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+static long bench_prodcons(void) {
+    int count = threads < 2 ? 2 : threads / 2 * 2;
+    rings = calloc(count / 2, sizeof(struct ring));
+    int saved = threads;
+    threads = count;
+    run_threads(prodcons_run, count);
+    threads = saved;
+    free(rings);
+    return ops / count * count;
+}
+
+/* realloc: each thread grows 64 buffers a few bytes at a time, as
+ * strings and vectors are, starting over past 1 MB. */
+static void *realloc_run(void *arg) {
+    unsigned state = seed + (long) arg;
+    enum { BUFFERS = 64 };
+    char *ptrs[BUFFERS] = { NULL };
+    size_t sizes[BUFFERS] = { 0 };
+    for (long i = 0; i < ops / threads; i++) {
+        int buffer = rand_r(&state) % BUFFERS;
+        if (sizes[buffer] > 1024 * 1024) {
+            bench_release(ptrs[buffer], sizes[buffer]);
+            ptrs[buffer] = NULL;
+            sizes[buffer] = 0;
+            continue;
+        }
+        size_t grow = 1 + rand_r(&state) % 256;
+        char *ptr = bench_realloc(ptrs[buffer], sizes[buffer] + grow);
+        if (ptr == NULL) {
+            fprintf(stderr, "mm_bench: reallocation failed\n");
+            exit(1);
+        }
+        memset(ptr + sizes[buffer], 0xa5, grow);
+        count_live(grow);
+        ptrs[buffer] = ptr;
+        sizes[buffer] += grow;
+    }
+    for (int buffer = 0; buffer < BUFFERS; buffer++) {
+        if (ptrs[buffer] != NULL) {
+            bench_release(ptrs[buffer], sizes[buffer]);
+        }
+    }
+    return NULL;
+}
+
+static long bench_realloc_growth(void) {
+    run_threads(realloc_run, threads);
+    return ops / threads * threads;
+}
+
+/* fragment: each thread allocates small blocks it keeps, frees three in
+ * every four at random, then allocates larger ones, which fit the holes
+ * left only if they have been merged. */
+static void *fragment_run(void *arg) {
+    unsigned state = seed + (long) arg;
+    long count = ops / threads / 2;
+    void **ptrs = malloc(count * sizeof(void *));
+    size_t *sizes = malloc(count * sizeof(size_t));
+    for (long i = 0; i < count; i++) {
+        sizes[i] = 16 + rand_r(&state) % 241;
+        ptrs[i] = bench_alloc(sizes[i]);
+    }
+    for (long i = 0; i < count; i++) {
+        if (rand_r(&state) % 4 != 0) {
+            bench_release(ptrs[i], sizes[i]);
+            ptrs[i] = NULL;
+        }
+    }
+    void **large = malloc(count / 4 * sizeof(void *));
+    size_t *large_sizes = malloc(count / 4 * sizeof(size_t));
+    for (long i = 0; i < count / 4; i++) {
+        large_sizes[i] = 256 + rand_r(&state) % 769;
+        large[i] = bench_alloc(large_sizes[i]);
+    }
+    for (long i = 0; i < count; i++) {
+        if (ptrs[i] != NULL) {
+            bench_release(ptrs[i], sizes[i]);
+        }
+    }
+    for (long i = 0; i < count / 4; i++) {
+        bench_release(large[i], large_sizes[i]);
+    }
+    free(ptrs);
+    free(sizes);
+    free(large);
+    free(large_sizes);
+    return NULL;
+}
+
+static long bench_fragment(void) {
+    run_threads(fragment_run, threads);
+    return ops / threads / 2 * 9 / 4 * threads;
+}
+
+/* Replay: recorded pointers are mapped to ours in an open addressing
+ * table, which grows to stay at most half full. */
+struct replay_entry {
+    uintptr_t recorded;
+    void *ptr;
+    size_t size;
+};
+
+static struct replay_entry *replay_table;
+static size_t replay_capacity;
+static size_t replay_used;
+
+static struct replay_entry *replay_find(uintptr_t recorded) {
+    size_t i = (recorded >> 4) * 0x9e3779b97f4a7c15ull & (replay_capacity - 1);
+    while (replay_table[i].recorded != 0 && replay_table[i].recorded != recorded) {
+        i = (i + 1) & (replay_capacity - 1);
+    }
+    return &replay_table[i];
+}
+
+static void replay_remove(struct replay_entry *entry) {
+    // close the gap, so later entries of the same run are still found
+    size_t i = entry - replay_table;
+    replay_table[i].recorded = 0;
+    replay_used--;
+    for (size_t j = (i + 1) & (replay_capacity - 1); replay_table[j].recorded != 0;
+         j = (j + 1) & (replay_capacity - 1)) {
+        struct replay_entry moved = replay_table[j];
+        replay_table[j].recorded = 0;
+        *replay_find(moved.recorded) = moved;
+    }
+}
+
+static void replay_insert(uintptr_t recorded, void *ptr, size_t size) {
+    if ((replay_used + 1) * 2 > replay_capacity) {
+        struct replay_entry *old = replay_table;
+        size_t old_capacity = replay_capacity;
+        replay_capacity = old_capacity ? old_capacity * 2 : 1024;
+        replay_table = calloc(replay_capacity, sizeof(struct replay_entry));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].recorded != 0) {
+                *replay_find(old[i].recorded) = old[i];
+            }
+        }
+        free(old);
+    }
+    struct replay_entry *entry = replay_find(recorded);
+    if (entry->recorded == 0) {
+        replay_used++;
+    } else {
+        count_live(-(intptr_t) entry->size);
+    }
+    *entry = (struct replay_entry) { recorded, ptr, size };
+    count_live(size);
+}
+
+/* The calls of the trace being replayed, read before it is timed */
+struct call {
+    char op;
+    uintptr_t a;
+    uintptr_t b;
+    size_t size;
+};
+
+static struct call *calls;
+static size_t call_count;
+
+static void replay_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    size_t count = 0, capacity = 1024;
+    calls = malloc(capacity * sizeof(*calls));
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (count == capacity) {
+            capacity *= 2;
+            calls = realloc(calls, capacity * sizeof(*calls));
+        }
+        calls[count].b = 0;
+        calls[count].size = 0;
+        int n = line[0] == 'r'
+            ? sscanf(line, "%c %lx %lx %zu", &calls[count].op, &calls[count].a,
+                     &calls[count].b, &calls[count].size)
+            : sscanf(line, "%c %lx %zu", &calls[count].op, &calls[count].a, &calls[count].size);
+        if (n >= 2) {
+            count++;
+        }
+    }
+    fclose(file);
+    call_count = count;
+}
+
+static long bench_replay(void) {
+    for (size_t i = 0; i < call_count; i++) {
+        struct replay_entry *entry;
+        switch (calls[i].op) {
+            case 'm':
+            case 'c': {
+                void *ptr = calls[i].op == 'm' ? bench_malloc(calls[i].size)
+                                               : bench_calloc(1, calls[i].size);
+                if (ptr != NULL) {
+                    memset(ptr, 0xa5, calls[i].size);
+                    replay_insert(calls[i].a, ptr, calls[i].size);
+                }
+                break;
+            }
+            case 'r': {
+                void *old = NULL;
+                size_t old_size = 0;
+                if (calls[i].a != 0 && (entry = replay_find(calls[i].a))->recorded != 0) {
+                    old = entry->ptr;
+                    old_size = entry->size;
+                    replay_remove(entry);
+                    count_live(-(intptr_t) old_size);
+                }
+                void *ptr = bench_realloc(old, calls[i].size);
+                if (ptr != NULL && calls[i].b != 0) {
+                    if (calls[i].size > old_size) {
+                        memset((char *) ptr + old_size, 0xa5, calls[i].size - old_size);
+                    }
+                    replay_insert(calls[i].b, ptr, calls[i].size);
+                }
+                break;
+            }
+            case 'f':
+                if ((entry = replay_find(calls[i].a))->recorded != 0) {
+                    bench_free(entry->ptr);
+                    count_live(-(intptr_t) entry->size);
+                    replay_remove(entry);
+                }
+                break;
+        }
+    }
+    return call_count;
+}
+
+struct workload {
+    const char *name;
+    long (*run)(void);
+    void (*prepare)(const char *name);
+};
+
+static const struct workload workloads[] = {
+    { "random", bench_random },
+    { "prodcons", bench_prodcons },
+    { "realloc", bench_realloc_growth },
+    { "fragment", bench_fragment },
+};
+
+/* Return this process's RSS in KB. */
+static long rss_kb(void) {
+    long pages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file != NULL) {
+        if (fscanf(file, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(file);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Load allocator LIB, or the C library's for "libc". */
+static bool load(const char *lib) {
+    if (strcmp(lib, "libc") == 0) {
+        bench_malloc = malloc;
+        bench_calloc = calloc;
+        bench_realloc = realloc;
+        bench_free = free;
+        return true;
+    }
+    void *handle = dlopen(lib, RTLD_NOW);
+    if (handle == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+    bench_malloc = dlsym(handle, "mm_malloc");
+    bench_calloc = dlsym(handle, "mm_calloc");
+    bench_realloc = dlsym(handle, "mm_realloc");
+    bench_free = dlsym(handle, "mm_free");
+    if (!bench_malloc || !bench_calloc || !bench_realloc || !bench_free) {
+        fprintf(stderr, "%s lacks the mm_* routines\n", lib);
+        return false;
+    }
+    return true;
+}
+
+/* Run WORKLOAD with LIB in a child process and print a line of results. */
+static void bench(const struct workload *workload, const char *lib) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        struct result result = { .ok = load(lib) };
+        if (result.ok) {
+            if (workload->prepare != NULL) {
+                workload->prepare(workload->name);
+            }
+            result.baseline_kb = rss_kb();
+            double start = now();
+            result.ops = workload->run();
+            result.seconds = now() - start;
+            result.peak_live = peak_live;
+        }
+        if (write(fds[1], &result, sizeof(result)) != sizeof(result)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    struct result result = { 0 };
+    ssize_t n = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    struct rusage usage;
+    int status;
+    wait4(pid, &status, 0, &usage);
+    if (n != sizeof(result) || !result.ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%-10s %-14s failed\n", workload->name, lib);
+        return;
+    }
+    double rss_mb = (usage.ru_maxrss - result.baseline_kb) / 1024.0;
+    double live_mb = result.peak_live / (1024.0 * 1024.0);
+    printf("%-10s %-14s %12.0f %10.1f %10.1f %9.2f\n", workload->name, lib,
+           result.ops / result.seconds, live_mb, rss_mb, live_mb > 0 ? rss_mb / live_mb : 0);
+    fflush(stdout);
+}
+
+static void exit_with_usage(void) {
+    fprintf(stderr,
+            "Usage: ./mm_bench [--ops 1000000] [--threads 4] [--seed 1]\n"
+            "                  [--lib hw3lib.so]... [--trace FILE]... [WORKLOAD]...\n"
+            "Workloads: random, prodcons, realloc, fragment; all by default.\n"
+            "Allocators: hw3lib.so and libc by default.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *libs[16];
+    int lib_count = 0;
+    struct workload chosen[64];
+    int chosen_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strncmp(argv[i], "--", 2) != 0) {
+            int w = 0;
+            while (w < (int) (sizeof(workloads) / sizeof(workloads[0]))
+                   && strcmp(workloads[w].name, argv[i]) != 0) {
+                w++;
+            }
+            if (w == sizeof(workloads) / sizeof(workloads[0]) || chosen_count == 64) {
+                exit_with_usage();
+            }
+            chosen[chosen_count++] = workloads[w];
+            continue;
+        }
+        if (!value) exit_with_usage();
+        i++;
+        if (strcmp(argv[i - 1], "--ops") == 0) ops = atol(value);
+        else if (strcmp(argv[i - 1], "--threads") == 0) threads = atoi(value);
+        else if (strcmp(argv[i - 1], "--seed") == 0) seed = atoi(value);
+        else if (strcmp(argv[i - 1], "--lib") == 0 && lib_count < 16) libs[lib_count++] = value;
+        else if (strcmp(argv[i - 1], "--trace") == 0 && chosen_count < 64) {
+            chosen[chosen_count++] = (struct workload) { value, bench_replay, replay_load };
+        } else {
+            exit_with_usage();
+        }
+    }
+    if (ops < 1 || threads < 1) exit_with_usage();
+    if (lib_count == 0) {
+        libs[lib_count++] = "hw3lib.so";
+        libs[lib_count++] = "libc";
+    }
+    if (chosen_count == 0) {
+        for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+            chosen[chosen_count++] = workloads[w];
+        }
+    }
+
+    printf("%-10s %-14s %12s %10s %10s %9s\n", "workload", "allocator", "ops/s",
+           "live MB", "RSS MB", "RSS/live");
+    for (int w = 0; w < chosen_count; w++) {
+        for (int l = 0; l < lib_count; l++) {
+            bench(&chosen[w], libs[l]);
+        }
+    }
+    return 0;
+}
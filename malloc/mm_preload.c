@@ -0,0 +1,235 @@
+/*
+ * mm_preload.c
+ *
+ * The standard allocation routines over the mm_* ones, to be loaded with
+ * LD_PRELOAD=./mm_preload.so in place of the C library's. They need no
+ * initialization of their own, so allocations made while the program is
+ * loading, before any constructor has run, are served like any other.
+ *
+ * With MM_TRACE=FILE, each process writes every call it makes, once
+ * its constructors have run, to FILE.PID, for mm_bench to replay.
+ */
+
+#define _GNU_SOURCE
+
+#include "mm_alloc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Every block is aligned as any object may need, so sizes are rounded up
+ * to a multiple of ALIGNMENT, which keeps the heap's blocks aligned. */
+#define ALIGNMENT 16
+
+/* Return SIZE rounded up to a multiple of ALIGNMENT, or 0 if that
+ * overflows. A program may pass 0 and expect a block of its own. */
+static size_t round_size(size_t size) {
+    if (size == 0) {
+        return ALIGNMENT;
+    }
+    if (size > SIZE_MAX - ALIGNMENT) {
+        return 0;
+    }
+    return (size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+}
+
+/* The trace being written, if any, with what's buffered for it */
+static const char *trace_path;
+static int trace_fd = -1;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static char trace_buffer[64 * 1024];
+static size_t trace_len;
+
+static void trace_flush(void) {
+    size_t done = 0;
+    while (done < trace_len) {
+        ssize_t n = write(trace_fd, trace_buffer + done, trace_len - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    trace_len = 0;
+}
+
+/* Append N to the buffer in BASE, which has room. */
+static void trace_number(uintptr_t n, unsigned base) {
+    char digits[24];
+    int count = 0;
+    do {
+        digits[count++] = "0123456789abcdef"[n % base];
+        n /= base;
+    } while (n != 0);
+    while (count > 0) {
+        trace_buffer[trace_len++] = digits[--count];
+    }
+}
+
+/* Append a call to the trace: OP with pointers A and B, if not NULL, and
+ * SIZE. Formatted by hand, as stdio might allocate. */
+static void trace(char op, void *a, void *b, size_t size, bool has_size) {
+    if (trace_fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    if (trace_len + 64 > sizeof(trace_buffer)) {
+        trace_flush();
+    }
+    trace_buffer[trace_len++] = op;
+    trace_buffer[trace_len++] = ' ';
+    trace_number((uintptr_t) a, 16);
+    if (op == 'r') {
+        trace_buffer[trace_len++] = ' ';
+        trace_number((uintptr_t) b, 16);
+    }
+    if (has_size) {
+        trace_buffer[trace_len++] = ' ';
+        trace_number(size, 10);
+    }
+    trace_buffer[trace_len++] = '\n';
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Open this process's trace. */
+static void trace_open(void) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d", trace_path, (int) getpid());
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+/* Hold the trace across fork(). The child starts a trace of its own,
+ * without what the parent had buffered. */
+static void trace_prepare(void) {
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void trace_parent(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_child(void) {
+    close(trace_fd);
+    trace_len = 0;
+    trace_open();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((constructor))
+static void trace_init(void) {
+    trace_path = getenv("MM_TRACE");
+    if (trace_path != NULL) {
+        trace_open();
+        pthread_atfork(trace_prepare, trace_parent, trace_child);
+    }
+}
+
+__attribute__((destructor))
+static void trace_fini(void) {
+    if (trace_fd >= 0) {
+        pthread_mutex_lock(&trace_lock);
+        trace_flush();
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+void *malloc(size_t size) {
+    size_t rounded = round_size(size);
+    void *ptr = rounded != 0 ? mm_malloc(rounded) : NULL;
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    trace('m', ptr, NULL, size, true);
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (ptr != NULL) {
+        trace('f', ptr, NULL, 0, false);
+    }
+    mm_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t rounded = round_size(nmemb * size);
+    void *ptr = rounded != 0 ? mm_calloc(1, rounded) : NULL;
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    trace('c', ptr, NULL, nmemb * size, true);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr != NULL && size == 0) {
+        trace('f', ptr, NULL, 0, false);
+        mm_free(ptr);
+        return NULL;
+    }
+    size_t rounded = round_size(size);
+    void *new_ptr = rounded != 0 ? mm_realloc(ptr, rounded) : NULL;
+    if (new_ptr == NULL) {
+        errno = ENOMEM;
+    }
+    trace('r', ptr, new_ptr, size, true);
+    return new_ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t rounded = round_size(size);
+    void *ptr = rounded != 0
+        ? mm_memalign(alignment < ALIGNMENT ? ALIGNMENT : alignment, rounded) : NULL;
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    trace('m', ptr, NULL, size, true);
+    return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0
+            || alignment == 0) {
+        return EINVAL;
+    }
+    int saved = errno;
+    void *ptr = memalign(alignment, size);
+    errno = saved;
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
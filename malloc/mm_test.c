@@ -5,6 +5,7 @@
 
 /* Function pointers to hw3 functions */
 void* (*mm_malloc)(size_t);
+void* (*mm_calloc)(size_t, size_t);
 void* (*mm_realloc)(void*, size_t);
 void (*mm_free)(void*);
 
@@ -22,6 +23,12 @@ void load_alloc_functions() {
         exit(1);
     }
 
+    mm_calloc = dlsym(handle, "mm_calloc");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
     mm_realloc = dlsym(handle, "mm_realloc");
     if ((error = dlerror()) != NULL)  {
         fprintf(stderr, "%s\n", dlerror());
@@ -44,7 +51,7 @@ int main() {
     assert(data[0] == 0x162);
     mm_free(data);
 
-    int *data2 = (int*) mm_malloc(sizeof(int));
+    int *data2 = (int*) mm_calloc(1, sizeof(int));
     assert(data2 != NULL);
     assert(data == data2);
     assert(data2[0] == 0);
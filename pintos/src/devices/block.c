@@ -3,7 +3,14 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/trace.h"
+
+/* Most sectors the request queue merges into one transfer. */
+#define BLOCK_MERGE_MAX BLOCK_REQUEST_MAX
 
 /* A block device. */
 struct block
@@ -17,8 +24,26 @@ struct block
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
 
-    unsigned long long read_cnt;        /* Number of sectors read. */
-    unsigned long long write_cnt;       /* Number of sectors written. */
+    struct block_stats stats;           /* Counters, less NAME and
+                                           CYCLES_PER_TICK. */
+
+    /* Request queue, used if the driver has a start operation.
+       Guarded by disabling interrupts, since requests complete in
+       the driver's interrupt handler. */
+    struct list queue;                  /* Waiting requests, by sector. */
+    size_t queued;                      /* Requests in QUEUE. */
+    struct block_transfer *transfers;   /* BLOCK_DEPTH_MAX transfers. */
+    size_t depth;                       /* Most transfers in flight. */
+    size_t in_flight;                   /* Transfers in flight. */
+    block_sector_t head;                /* Sector after the last transfer
+                                           started. */
+  };
+
+/* A blocking transfer waiting for its request to complete. */
+struct sync_request
+  {
+    struct block_request req;           /* The request. */
+    struct semaphore done;              /* Up'd on completion. */
   };
 
 /* List of all block devices. */
@@ -27,7 +52,27 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 /* The block block assigned to each Pintos role. */
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
+/* Time stamp counter and tick count when the first device was
+   registered, to let block_get_stats() relate cycles to ticks. */
+static uint64_t start_tsc;
+static int64_t start_ticks;
+
 static struct block *list_elem_to_block (struct list_elem *);
+static void driver_read (struct block *, block_sector_t, size_t cnt,
+                         void *buffer);
+static void driver_write (struct block *, block_sector_t, size_t cnt,
+                          const void *buffer);
+static bool is_queued (const struct block *);
+static void queue_transfer (struct block *, block_sector_t, size_t cnt,
+                            bool write, void *buffer);
+static void dispatch (struct block *);
+static list_less_func request_less;
+static block_callback sync_done;
+static void count_sectors (struct block *, size_t cnt, bool write);
+static void count_transfer (struct block *, block_sector_t, size_t cnt,
+                            uint64_t start_tsc);
+static void hist_add (uint32_t hist[], uint64_t cycles);
+static void print_hist (const char *name, const uint32_t hist[]);
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -121,8 +166,10 @@ void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
   check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  if (is_queued (block))
+    queue_transfer (block, sector, 1, false, buffer);
+  else
+    driver_read (block, sector, 1, buffer);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -135,8 +182,95 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
   check_sector (block, sector);
   ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  if (is_queued (block))
+    queue_transfer (block, sector, 1, true, (void *) buffer);
+  else
+    driver_write (block, sector, 1, buffer);
+}
+
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Drivers that support it move the whole run with a
+   single request.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffer)
+{
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  if (is_queued (block))
+    queue_transfer (block, sector, cnt, false, buffer);
+  else
+    driver_read (block, sector, cnt, buffer);
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving the
+   data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                      const void *buffer)
+{
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  if (is_queued (block))
+    queue_transfer (block, sector, cnt, true, (void *) buffer);
+  else
+    driver_write (block, sector, cnt, buffer);
+}
+
+/* Has BLOCK's driver read the CNT sectors starting at SECTOR into
+   BUFFER, all at once if the driver can. */
+static void
+driver_read (struct block *block, block_sector_t sector, size_t cnt,
+             void *buffer_)
+{
+  uint8_t *buffer = buffer_;
+  uint64_t start = rdtsc ();
+  size_t i;
+
+  block->stats.requests++;
+  count_sectors (block, cnt, false);
+  if (block->ops->read_multiple != NULL)
+    block->ops->read_multiple (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->read (block->aux, sector + i,
+                        buffer + i * BLOCK_SECTOR_SIZE);
+  if (block->ops->lower == NULL)
+    count_transfer (block, sector, cnt, start);
+}
+
+/* Has BLOCK's driver write the CNT sectors starting at SECTOR
+   from BUFFER, all at once if the driver can. */
+static void
+driver_write (struct block *block, block_sector_t sector, size_t cnt,
+              const void *buffer_)
+{
+  const uint8_t *buffer = buffer_;
+  uint64_t start = rdtsc ();
+  size_t i;
+
+  block->stats.requests++;
+  count_sectors (block, cnt, true);
+  if (block->ops->write_multiple != NULL)
+    block->ops->write_multiple (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->write (block->aux, sector + i,
+                         buffer + i * BLOCK_SECTOR_SIZE);
+  if (block->ops->lower == NULL)
+    count_transfer (block, sector, cnt, start);
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,6 +294,21 @@ block_type (struct block *block)
   return block->type;
 }
 
+/* Copies BLOCK's statistics to STATS. */
+void
+block_get_stats (struct block *block, struct block_stats *stats)
+{
+  enum intr_level old_level = intr_disable ();
+  int64_t ticks = timer_ticks () - start_ticks;
+  uint64_t cycles = rdtsc () - start_tsc;
+
+  *stats = block->stats;
+  intr_set_level (old_level);
+
+  strlcpy (stats->name, block->name, sizeof stats->name);
+  stats->cycles_per_tick = ticks > 0 ? cycles / ticks : 0;
+}
+
 /* Prints statistics for each block device used for a Pintos role. */
 void
 block_print_stats (void)
@@ -171,9 +320,23 @@ block_print_stats (void)
       struct block *block = block_by_role[i];
       if (block != NULL)
         {
+          struct block_stats s;
+
+          block_get_stats (block, &s);
           printf ("%s (%s): %llu reads, %llu writes\n",
                   block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+                  s.read_cnt, s.write_cnt);
+          if (s.transfers == 0)
+            continue;
+          printf ("%s: %llu requests in %llu transfers, %llu sequential, "
+                  "depth %llu avg %"PRIu32" max, "
+                  "%llu queue %llu service cycles avg\n",
+                  block->name, s.requests, s.transfers, s.sequential,
+                  s.depth_sum / s.requests,
+                  s.depth_max, s.queue_cycles / s.requests,
+                  s.service_cycles / s.transfers);
+          print_hist ("queue", s.queue_hist);
+          print_hist ("service", s.service_hist);
         }
     }
 }
@@ -198,8 +361,29 @@ block_register (const char *name, enum block_type type,
   block->size = size;
   block->ops = ops;
   block->aux = aux;
-  block->read_cnt = 0;
-  block->write_cnt = 0;
+  memset (&block->stats, 0, sizeof block->stats);
+  list_init (&block->queue);
+  block->queued = 0;
+  block->transfers = NULL;
+  block->depth = 1;
+  block->in_flight = 0;
+  block->head = 0;
+  if (ops->start != NULL)
+    {
+      size_t i;
+
+      block->transfers = malloc (BLOCK_DEPTH_MAX * sizeof *block->transfers);
+      if (block->transfers == NULL)
+        PANIC ("Failed to allocate memory for block device transfers");
+      for (i = 0; i < BLOCK_DEPTH_MAX; i++)
+        block->transfers[i].in_use = false;
+    }
+
+  if (list_empty (&all_blocks))
+    {
+      start_tsc = rdtsc ();
+      start_ticks = timer_ticks ();
+    }
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -221,3 +405,299 @@ list_elem_to_block (struct list_elem *list_elem)
           : NULL);
 }
 
+/* Request queue.
+
+   Requests to a device whose driver can start a transfer and
+   report its completion wait in a queue, sorted by sector.
+   Whenever the device has room for another transfer in flight,
+   by default just one, the next is taken in C-SCAN order: the
+   first at or past the sector where the last transfer started
+   ended, wrapping around to the lowest.  Requests in the same
+   direction that pick up where the one before left off are
+   merged with it, up to BLOCK_MERGE_MAX sectors, into one
+   transfer.  When the driver reports a transfer done, from its
+   interrupt handler, the next one is started straight away, and
+   the callbacks of the requests it covered are called. */
+
+/* Submits REQ, whose SECTOR, CNT, WRITE, and BUFFER say what to
+   transfer, to BLOCK, and returns, usually before the transfer is
+   done.  CALLBACK is then called with REQ.  If BLOCK's driver
+   cannot work asynchronously, the transfer happens before this
+   returns, and CALLBACK is called from here. */
+void
+block_submit (struct block *block, struct block_request *req,
+              block_callback *callback)
+{
+  enum intr_level old_level;
+  size_t depth;
+
+  ASSERT (req->cnt > 0 && req->cnt <= BLOCK_REQUEST_MAX);
+  check_sector (block, req->sector);
+  check_sector (block, req->sector + req->cnt - 1);
+  ASSERT (!req->write || block->type != BLOCK_FOREIGN);
+
+  req->callback = callback;
+  req->pos = req->sector;
+  while (block->ops->lower != NULL)
+    {
+      block->stats.requests++;
+      count_sectors (block, req->cnt, req->write);
+      block = block->ops->lower (block->aux, &req->pos);
+    }
+
+  if (!is_queued (block))
+    {
+      if (req->write)
+        driver_write (block, req->pos, req->cnt, req->buffer);
+      else
+        driver_read (block, req->pos, req->cnt, req->buffer);
+      callback (req);
+      return;
+    }
+
+  old_level = intr_disable ();
+  req->queued_tsc = rdtsc ();
+  list_insert_ordered (&block->queue, &req->elem, request_less, NULL);
+  block->queued++;
+  block->stats.requests++;
+  count_sectors (block, req->cnt, req->write);
+  depth = block->queued + block->in_flight;
+  block->stats.depth_sum += depth;
+  if (depth > block->stats.depth_max)
+    block->stats.depth_max = depth;
+  trace (TRACE_BLOCK_QUEUE, req->pos, depth);
+  dispatch (block);
+  intr_set_level (old_level);
+}
+
+/* Lets BLOCK's driver have up to DEPTH transfers in flight at
+   once, instead of 1.  DEPTH may not exceed BLOCK_DEPTH_MAX. */
+void
+block_set_depth (struct block *block, size_t depth)
+{
+  ASSERT (block->ops->start != NULL);
+  ASSERT (depth >= 1 && depth <= BLOCK_DEPTH_MAX);
+  block->depth = depth;
+}
+
+/* Called by BLOCK's driver, with interrupts off, when transfer T
+   is done.  Starts the next one, then calls back the submitters
+   of the requests T covered. */
+void
+block_complete (struct block *block, struct block_transfer *t)
+{
+  struct list done;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (t->in_use);
+
+  count_transfer (block, t->sector, t->cnt, t->start_tsc);
+  list_init (&done);
+  while (!list_empty (&t->requests))
+    list_push_back (&done, list_pop_front (&t->requests));
+  t->in_use = false;
+  block->in_flight--;
+  dispatch (block);
+
+  while (!list_empty (&done))
+    {
+      struct block_request *r = list_entry (list_pop_front (&done),
+                                            struct block_request, elem);
+      r->callback (r);
+    }
+}
+
+/* Returns true if requests to BLOCK go through its queue. */
+static bool
+is_queued (const struct block *block)
+{
+  return block->ops->start != NULL;
+}
+
+/* Orders requests by first sector. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+  return a->pos < b->pos;
+}
+
+/* Returns the request in BLOCK's nonempty queue to serve next:
+   the first at or after the head, or the first of all if the
+   head has passed every one. */
+static struct block_request *
+next_request (struct block *block)
+{
+  struct list_elem *e;
+
+  ASSERT (!list_empty (&block->queue));
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->pos >= block->head)
+        return r;
+    }
+  return list_entry (list_front (&block->queue), struct block_request, elem);
+}
+
+/* While BLOCK has room for another transfer in flight and
+   requests waiting, moves the next request, and those that can be
+   merged with it, into a transfer, and has the driver start it.
+   Must be called with interrupts off. */
+static void
+dispatch (struct block *block)
+{
+  while (block->in_flight < block->depth && !list_empty (&block->queue))
+    {
+      struct block_transfer *t = block->transfers;
+      struct block_request *first = next_request (block);
+      struct list_elem *e = &first->elem;
+      uint64_t now = rdtsc ();
+
+      while (t->in_use)
+        t++;
+      t->in_use = true;
+      t->sector = first->pos;
+      t->cnt = 0;
+      t->write = first->write;
+      t->start_tsc = now;
+      list_init (&t->requests);
+      for (;;)
+        {
+          struct block_request *r = list_entry (e, struct block_request,
+                                                elem);
+          size_t i;
+
+          e = list_remove (e);
+          block->queued--;
+          block->stats.queue_cycles += now - r->queued_tsc;
+          hist_add (block->stats.queue_hist, now - r->queued_tsc);
+          list_push_back (&t->requests, &r->elem);
+          for (i = 0; i < r->cnt; i++)
+            t->buffers[t->cnt++] = (uint8_t *) r->buffer + i * BLOCK_SECTOR_SIZE;
+
+          if (e == list_end (&block->queue))
+            break;
+          r = list_entry (e, struct block_request, elem);
+          if (r->write != t->write || r->pos != t->sector + t->cnt
+              || t->cnt + r->cnt > BLOCK_MERGE_MAX)
+            break;
+        }
+
+      block->in_flight++;
+      if (t->sector == block->head)
+        block->stats.sequential++;
+      block->head = t->sector + t->cnt;
+      block->ops->start (block->aux, t);
+    }
+}
+
+/* Wakes up the thread waiting in queue_transfer() for REQ. */
+static void
+sync_done (struct block_request *req)
+{
+  struct sync_request *s = req->aux;
+  sema_up (&s->done);
+}
+
+/* Transfers CNT sectors starting at SECTOR to or from BUFFER
+   through BLOCK's request queue, and returns once they are done.
+   Runs of more than BLOCK_REQUEST_MAX sectors go as several
+   requests in turn. */
+static void
+queue_transfer (struct block *block, block_sector_t sector, size_t cnt,
+                bool write, void *buffer)
+{
+  struct sync_request s;
+
+  sema_init (&s.done, 0);
+  while (cnt > 0)
+    {
+      size_t n = cnt < BLOCK_REQUEST_MAX ? cnt : BLOCK_REQUEST_MAX;
+
+      s.req.sector = sector;
+      s.req.cnt = n;
+      s.req.write = write;
+      s.req.buffer = buffer;
+      s.req.aux = &s;
+      block_submit (block, &s.req, sync_done);
+      sema_down (&s.done);
+
+      sector += n;
+      cnt -= n;
+      buffer = (uint8_t *) buffer + n * BLOCK_SECTOR_SIZE;
+    }
+}
+
+/* Counts CNT sectors to be read from BLOCK, or written to it if
+   WRITE is true. */
+static void
+count_sectors (struct block *block, size_t cnt, bool write)
+{
+  if (write)
+    {
+      block->stats.write_cnt += cnt;
+      block->stats.write_bytes += cnt * BLOCK_SECTOR_SIZE;
+    }
+  else
+    {
+      block->stats.read_cnt += cnt;
+      block->stats.read_bytes += cnt * BLOCK_SECTOR_SIZE;
+    }
+}
+
+/* Counts a transfer of CNT sectors starting at SECTOR that BLOCK's
+   driver began when the time stamp counter read START_TSC and
+   has just finished.  A queued transfer was already checked for
+   being sequential when it was started. */
+static void
+count_transfer (struct block *block, block_sector_t sector, size_t cnt,
+                uint64_t start_tsc)
+{
+  uint64_t cycles = rdtsc () - start_tsc;
+
+  block->stats.transfers++;
+  block->stats.service_cycles += cycles;
+  hist_add (block->stats.service_hist, cycles);
+  if (!is_queued (block))
+    {
+      if (sector == block->head)
+        block->stats.sequential++;
+      block->head = sector + cnt;
+    }
+}
+
+/* Counts an interval of CYCLES cycles in histogram HIST. */
+static void
+hist_add (uint32_t hist[], uint64_t cycles)
+{
+  int b = 0;
+
+  while (cycles > 0 && b < BLOCK_HIST_BUCKETS - 1)
+    {
+      cycles >>= 1;
+      b++;
+    }
+  hist[b]++;
+}
+
+/* Prints the nonempty buckets of histogram HIST, labeled NAME. */
+static void
+print_hist (const char *name, const uint32_t hist[])
+{
+  int b;
+
+  printf ("Block: %s cycles:", name);
+  for (b = 0; b < BLOCK_HIST_BUCKETS; b++)
+    if (hist[b] != 0)
+      {
+        if (b == 0)
+          printf (" [0]=%"PRIu32, hist[b]);
+        else
+          printf (" [%u,%u)=%"PRIu32, 1u << (b - 1), 1u << b, hist[b]);
+      }
+  printf ("\n");
+}
@@ -1,8 +1,10 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,22 +55,136 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt, void *);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous I/O. */
+
+/* Most sectors one block_request may cover. */
+#define BLOCK_REQUEST_MAX 64
+
+struct block_request;
+
+/* Called when a request submitted with block_submit() is done.
+   May run in an interrupt handler, so it must not sleep. */
+typedef void block_callback (struct block_request *);
+
+/* A read or write submitted with block_submit(). */
+struct block_request
+  {
+    /* Set by the submitter. */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors, at most
+                                           BLOCK_REQUEST_MAX. */
+    bool write;                         /* True to write, false to read. */
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    void *aux;                          /* For the callback's use. */
+
+    /* Owned by the block layer until the callback. */
+    block_callback *callback;           /* Called when done. */
+    block_sector_t pos;                 /* SECTOR on the queued device. */
+    uint64_t queued_tsc;                /* Time stamp counter when queued. */
+    struct list_elem elem;              /* Element in a request queue. */
+  };
+
+void block_submit (struct block *, struct block_request *, block_callback *);
+
 /* Statistics. */
+
+/* Number of buckets in a block latency histogram.  Bucket 0
+   counts intervals of 0 cycles of the time stamp counter, bucket
+   B counts intervals of 2**(B-1) to 2**B - 1 cycles, and the
+   last bucket also takes anything longer. */
+#define BLOCK_HIST_BUCKETS 32
+
+/* Statistics for one block device since it was registered.
+   Requests to a partition are counted there and again on the
+   disk under it; only the disk, which has the queue, sees
+   transfers and their timing. */
+struct block_stats
+  {
+    char name[16];                      /* Device name. */
+    uint64_t read_cnt;                  /* Sectors read. */
+    uint64_t write_cnt;                 /* Sectors written. */
+    uint64_t read_bytes;                /* Bytes read. */
+    uint64_t write_bytes;               /* Bytes written. */
+    uint64_t requests;                  /* Reads and writes asked for. */
+    uint64_t transfers;                 /* Transfers the driver did; the
+                                           rest of REQUESTS were merged. */
+    uint64_t sequential;                /* Transfers starting where the
+                                           one before ended. */
+    uint64_t depth_sum;                 /* Requests queued or in flight,
+                                           summed over each new request. */
+    uint32_t depth_max;                 /* Most requests queued or in
+                                           flight at once. */
+    uint32_t cycles_per_tick;           /* Time stamp counter rate. */
+    uint64_t queue_cycles;              /* Total time requests waited to
+                                           be started. */
+    uint64_t service_cycles;            /* Total time transfers took. */
+    uint32_t queue_hist[BLOCK_HIST_BUCKETS];   /* Waits to be started. */
+    uint32_t service_hist[BLOCK_HIST_BUCKETS]; /* Transfer times. */
+  };
+
+void block_get_stats (struct block *, struct block_stats *);
 void block_print_stats (void);
 
 /* Lower-level interface to block device drivers. */
 
+/* Most transfers a request queue has in flight at once. */
+#define BLOCK_DEPTH_MAX 8
+
+/* A transfer the request queue has a driver start: CNT
+   consecutive sectors starting at SECTOR, sector I to or from
+   BUFFERS[I]. */
+struct block_transfer
+  {
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    bool write;                         /* True to write, false to read. */
+    void *buffers[BLOCK_REQUEST_MAX];   /* Buffer for each sector. */
+
+    /* Owned by the block layer. */
+    bool in_use;                        /* True while in flight. */
+    struct list requests;               /* Requests it covers. */
+    uint64_t start_tsc;                 /* Time stamp counter when started. */
+  };
+
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional.  Transfer CNT consecutive sectors at once; if
+       null, the block layer falls back to one sector at a time. */
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
+
+    /* Optional.  Starts transfer T and returns without waiting;
+       the driver calls block_complete() from its interrupt
+       handler once T is done.  Called with interrupts off,
+       possibly from within block_complete().  A driver that has
+       this gets a request queue, which issues requests in
+       elevator order, merges adjacent ones, and keeps as many
+       transfers in flight as block_set_depth() allows, and need
+       not provide the operations above. */
+    void (*start) (void *aux, struct block_transfer *t);
+
+    /* Optional.  For a device that is a part of another, such as
+       a partition: returns the other device and translates
+       *SECTOR to it, so that block_submit() can pass requests
+       down. */
+    struct block *(*lower) (void *aux, block_sector_t *sector);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+void block_set_depth (struct block *, size_t depth);
+void block_complete (struct block *, struct block_transfer *);
 
 #endif /* devices/block.h */
@@ -0,0 +1,516 @@
+#include "devices/e1000.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <list.h>
+#include <stdio.h>
+#include "devices/netbuf.h"
+#include "devices/pci.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file drives an Intel 8254x ("e1000") Ethernet
+   controller, such as QEMU provides with "-device e1000"
+   [8254x].  Frames move through two rings of descriptors in
+   memory, one for receiving and one for sending, which the
+   device reads and writes directly.  Both sides work in batches:
+   the interrupt handler takes every frame received since the
+   last interrupt and hands the ring back with one register
+   write, and e1000_send() queues any number of frames before
+   telling the device about them.  The device holds interrupts
+   back to at most ITR_RATE a second, so under load one interrupt
+   covers many frames.
+
+   Frames live in buffers from the netbuf pool, which the device
+   fills and drains in place: a received buffer is handed to the
+   reader as is, and a buffer given to e1000_send() belongs to
+   the driver until the device has sent it.
+
+   The registers are reached through the device's I/O BAR, an
+   address and a data port, since the kernel doesn't map the
+   memory-mapped BAR.  Only one device is supported. */
+
+/* PCI IDs of the 82540EM, the model QEMU emulates. */
+#define E1000_VENDOR 0x8086
+#define E1000_DEVICE 0x100e
+
+/* Ports, as offsets into the I/O BAR. */
+#define IOADDR 0x00                     /* Register to access. */
+#define IODATA 0x04                     /* Its contents. */
+
+/* Registers. */
+#define REG_CTRL 0x0000                 /* Device control. */
+#define REG_STATUS 0x0008               /* Device status. */
+#define REG_EERD 0x0014                 /* EEPROM read. */
+#define REG_ICR 0x00c0                  /* Interrupt cause read. */
+#define REG_ITR 0x00c4                  /* Interrupt throttling. */
+#define REG_IMS 0x00d0                  /* Interrupt mask set. */
+#define REG_IMC 0x00d8                  /* Interrupt mask clear. */
+#define REG_RCTL 0x0100                 /* Receive control. */
+#define REG_TCTL 0x0400                 /* Transmit control. */
+#define REG_TIPG 0x0410                 /* Transmit inter-packet gap. */
+#define REG_RDBAL 0x2800                /* Receive ring address, low. */
+#define REG_RDBAH 0x2804                /* Receive ring address, high. */
+#define REG_RDLEN 0x2808                /* Receive ring bytes. */
+#define REG_RDH 0x2810                  /* Receive ring head. */
+#define REG_RDT 0x2818                  /* Receive ring tail. */
+#define REG_TDBAL 0x3800                /* Transmit ring address, low. */
+#define REG_TDBAH 0x3804                /* Transmit ring address, high. */
+#define REG_TDLEN 0x3808                /* Transmit ring bytes. */
+#define REG_TDH 0x3810                  /* Transmit ring head. */
+#define REG_TDT 0x3818                  /* Transmit ring tail. */
+#define REG_MTA 0x5200                  /* Multicast table, 128 words. */
+#define REG_RAL0 0x5400                 /* Receive address, low. */
+#define REG_RAH0 0x5404                 /* Receive address, high. */
+
+/* CTRL bits. */
+#define CTRL_ASDE (1u << 5)             /* Detect link speed. */
+#define CTRL_SLU (1u << 6)              /* Set link up. */
+#define CTRL_RST (1u << 26)             /* Reset. */
+
+/* STATUS bits. */
+#define STATUS_LU (1u << 1)             /* Link is up. */
+
+/* EERD fields. */
+#define EERD_START (1u << 0)            /* Start a read. */
+#define EERD_DONE (1u << 4)             /* Read is done. */
+#define EERD_ADDR_SHIFT 8               /* Word to read. */
+#define EERD_DATA_SHIFT 16              /* Word read. */
+
+/* Interrupt causes. */
+#define ICR_TXDW (1u << 0)              /* Transmit descriptor written. */
+#define ICR_LSC (1u << 2)               /* Link status changed. */
+#define ICR_RXDMT0 (1u << 4)            /* Receive ring running low. */
+#define ICR_RXO (1u << 6)               /* Receive overrun. */
+#define ICR_RXT0 (1u << 7)              /* Receive timer expired. */
+
+/* RCTL bits.  A buffer size of 0 means 2048 bytes. */
+#define RCTL_EN (1u << 1)               /* Receive. */
+#define RCTL_BAM (1u << 15)             /* Accept broadcasts. */
+#define RCTL_SECRC (1u << 26)           /* Strip the CRC. */
+
+/* TCTL bits and fields. */
+#define TCTL_EN (1u << 1)               /* Transmit. */
+#define TCTL_PSP (1u << 3)              /* Pad short frames. */
+#define TCTL_CT (0x10u << 4)            /* Collision threshold. */
+#define TCTL_COLD (0x40u << 12)         /* Collision distance. */
+
+/* Recommended TIPG for copper. */
+#define TIPG_VALUE (10u | 8u << 10 | 6u << 20)
+
+/* RAH bits. */
+#define RAH_AV (1u << 31)               /* Address is valid. */
+
+/* Receive descriptor. */
+struct rx_desc
+  {
+    uint64_t addr;                      /* Buffer's physical address. */
+    uint16_t len;                       /* Bytes received. */
+    uint16_t csum;                      /* Packet checksum. */
+    uint8_t status;                     /* RXD_STAT_* bits. */
+    uint8_t errors;                     /* Receive errors. */
+    uint16_t special;
+  };
+
+#define RXD_STAT_DD 0x01                /* Descriptor done. */
+#define RXD_STAT_EOP 0x02               /* End of packet. */
+
+/* Transmit descriptor, in the legacy format. */
+struct tx_desc
+  {
+    uint64_t addr;                      /* Buffer's physical address. */
+    uint16_t len;                       /* Bytes to send. */
+    uint8_t cso;                        /* Checksum offset. */
+    uint8_t cmd;                        /* TXD_CMD_* bits. */
+    uint8_t status;                     /* TXD_STAT_* bits. */
+    uint8_t css;                        /* Checksum start. */
+    uint16_t special;
+  };
+
+#define TXD_CMD_EOP 0x01                /* End of packet. */
+#define TXD_CMD_IFCS 0x02               /* Append the CRC. */
+#define TXD_CMD_RS 0x08                 /* Report status. */
+#define TXD_STAT_DD 0x01                /* Descriptor done. */
+
+/* Descriptors in each ring.  The ring length in bytes must be a
+   multiple of 128, and both rings share a page. */
+#define RX_RING 32
+#define TX_RING 32
+
+/* Received frames held for readers before more are dropped. */
+#define RX_QUEUE_MAX 32
+
+/* Frames e1000_send() is expected to be handed at once, on top of
+   the buffers the rings hold; sizes the buffer pool. */
+#define TX_BATCH 16
+
+/* Most interrupts a second, and the ITR value, in 256 ns units,
+   that yields it. */
+#define ITR_RATE 8000
+#define ITR_INTERVAL (1000000000 / 256 / ITR_RATE)
+
+/* The device. */
+static bool present;                    /* Found and set up? */
+static uint16_t io_base;                /* Base of the I/O BAR. */
+static uint8_t irq;                     /* Interrupt vector. */
+static uint8_t mac[ETH_ADDR_LEN];       /* Ethernet address. */
+
+/* Receive ring.  The device owns the descriptors from RDH up to,
+   but not including, RDT; RX_NEXT is the first it may have
+   filled. */
+static struct rx_desc *rx_ring;
+static struct netbuf *rx_bufs[RX_RING];
+static size_t rx_next;
+
+/* Received frames, and one semaphore up for each. */
+static struct list rx_queue;
+static size_t rx_queued;
+static struct semaphore rx_ready;
+
+/* Transmit ring.  TX_USED descriptors from TX_HEAD on hold frames
+   not yet reclaimed; TX_TAIL is the next to fill.  Threads that
+   find the ring full wait on TX_SPACE, counted by TX_WAITERS. */
+static struct tx_desc *tx_ring;
+static struct netbuf *tx_bufs[TX_RING];
+static size_t tx_head, tx_tail, tx_used;
+static struct semaphore tx_space;
+static size_t tx_waiters;
+
+/* Statistics. */
+static unsigned long long rx_cnt, rx_bytes, rx_dropped;
+static unsigned long long tx_cnt, tx_bytes;
+static unsigned long long intr_cnt;
+
+static pci_found_func probe_device;
+static void interrupt_handler (struct intr_frame *);
+
+/* Returns register REG.  Interrupts must be off, so that no
+   handler moves IOADDR between the two accesses. */
+static uint32_t
+reg_read (uint32_t reg)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  outl (io_base + IOADDR, reg);
+  return inl (io_base + IODATA);
+}
+
+/* Sets register REG to VALUE.  Interrupts must be off. */
+static void
+reg_write (uint32_t reg, uint32_t value)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  outl (io_base + IOADDR, reg);
+  outl (io_base + IODATA, value);
+}
+
+/* Finds and sets up an e1000. */
+void
+e1000_init (void)
+{
+  pci_scan (E1000_VENDOR, E1000_DEVICE, probe_device, NULL);
+}
+
+/* Returns true if there is an e1000 to send and receive with. */
+bool
+e1000_present (void)
+{
+  return present;
+}
+
+/* Copies the device's Ethernet address into MAC_. */
+void
+e1000_get_mac (uint8_t mac_[ETH_ADDR_LEN])
+{
+  size_t i;
+
+  ASSERT (present);
+  for (i = 0; i < ETH_ADDR_LEN; i++)
+    mac_[i] = mac[i];
+}
+
+/* Reads word ADDR of the EEPROM.  Interrupts must be off. */
+static uint16_t
+eeprom_read (uint8_t addr)
+{
+  uint32_t value;
+  int i;
+
+  reg_write (REG_EERD, (uint32_t) addr << EERD_ADDR_SHIFT | EERD_START);
+  for (i = 0; i < 100000; i++)
+    {
+      value = reg_read (REG_EERD);
+      if (value & EERD_DONE)
+        return value >> EERD_DATA_SHIFT;
+    }
+  PANIC ("e1000: EEPROM read of word %"PRIu8" timed out", addr);
+}
+
+/* Sets up the e1000 at PCI address DEV. */
+static void
+probe_device (const struct pci_device *dev, void *aux UNUSED)
+{
+  enum intr_level old_level;
+  uint32_t line;
+  size_t i;
+
+  if (present)
+    return;
+
+  /* The 82540EM has a memory BAR first and an I/O BAR later;
+     take the first I/O one. */
+  io_base = 0;
+  for (i = 0; i < 6 && io_base == 0; i++)
+    {
+      uint32_t bar = pci_config_read (dev, PCI_REG_BAR0 + i * 4);
+      if (bar & 1)
+        io_base = bar & ~3u;
+    }
+  line = pci_config_read (dev, PCI_REG_INTERRUPT) & 0xff;
+  if (io_base == 0 || line >= 16)
+    {
+      printf ("e1000: no I/O BAR or legacy interrupt, ignoring\n");
+      return;
+    }
+  irq = 0x20 + line;
+  if (intr_is_registered (irq))
+    {
+      printf ("e1000: interrupt %"PRIu32" is taken by %s, ignoring\n",
+              line, intr_name (irq));
+      return;
+    }
+  pci_config_write (dev, PCI_REG_COMMAND,
+                    (pci_config_read (dev, PCI_REG_COMMAND)
+                     | PCI_COMMAND_IO | PCI_COMMAND_MASTER));
+
+  /* Buffers for both rings, for frames queued for readers, and
+     for a batch being sent. */
+  netbuf_init (RX_RING + RX_QUEUE_MAX + TX_RING + TX_BATCH);
+  rx_ring = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+  tx_ring = (struct tx_desc *) (rx_ring + RX_RING);
+  ASSERT (RX_RING * sizeof *rx_ring + TX_RING * sizeof *tx_ring <= PGSIZE);
+  list_init (&rx_queue);
+  sema_init (&rx_ready, 0);
+  sema_init (&tx_space, 0);
+
+  old_level = intr_disable ();
+
+  /* Reset, with interrupts masked. */
+  reg_write (REG_IMC, 0xffffffff);
+  reg_write (REG_CTRL, reg_read (REG_CTRL) | CTRL_RST);
+  for (i = 0; i < 100000 && (reg_read (REG_CTRL) & CTRL_RST); i++)
+    continue;
+  reg_write (REG_IMC, 0xffffffff);
+  reg_read (REG_ICR);
+  reg_write (REG_CTRL, reg_read (REG_CTRL) | CTRL_SLU | CTRL_ASDE);
+
+  /* Take our address from the EEPROM, and receive frames sent to
+     it, and broadcasts, but no multicasts. */
+  for (i = 0; i < ETH_ADDR_LEN / 2; i++)
+    {
+      uint16_t word = eeprom_read (i);
+      mac[i * 2] = word & 0xff;
+      mac[i * 2 + 1] = word >> 8;
+    }
+  reg_write (REG_RAL0, (mac[0] | mac[1] << 8 | mac[2] << 16
+                        | (uint32_t) mac[3] << 24));
+  reg_write (REG_RAH0, mac[4] | mac[5] << 8 | RAH_AV);
+  for (i = 0; i < 128; i++)
+    reg_write (REG_MTA + i * 4, 0);
+
+  /* Give the device every receive descriptor but one, which
+     tells a full ring from an empty one. */
+  for (i = 0; i < RX_RING; i++)
+    {
+      rx_bufs[i] = netbuf_alloc ();
+      rx_ring[i].addr = vtop (rx_bufs[i]->data);
+    }
+  rx_next = 0;
+  reg_write (REG_RDBAL, vtop (rx_ring));
+  reg_write (REG_RDBAH, 0);
+  reg_write (REG_RDLEN, RX_RING * sizeof *rx_ring);
+  reg_write (REG_RDH, 0);
+  reg_write (REG_RDT, RX_RING - 1);
+  reg_write (REG_RCTL, RCTL_EN | RCTL_BAM | RCTL_SECRC);
+
+  tx_head = tx_tail = tx_used = 0;
+  reg_write (REG_TDBAL, vtop (tx_ring));
+  reg_write (REG_TDBAH, 0);
+  reg_write (REG_TDLEN, TX_RING * sizeof *tx_ring);
+  reg_write (REG_TDH, 0);
+  reg_write (REG_TDT, 0);
+  reg_write (REG_TIPG, TIPG_VALUE);
+  reg_write (REG_TCTL, TCTL_EN | TCTL_PSP | TCTL_CT | TCTL_COLD);
+
+  reg_write (REG_ITR, ITR_INTERVAL);
+  intr_register_ext (irq, interrupt_handler, "e1000");
+  reg_write (REG_IMS, (ICR_TXDW | ICR_LSC | ICR_RXDMT0 | ICR_RXO
+                       | ICR_RXT0));
+  present = true;
+
+  printf ("e1000: PCI %02x:%02x.%x, "
+          "address %02x:%02x:%02x:%02x:%02x:%02x, link %s\n",
+          dev->bus, dev->slot, dev->func,
+          mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+          reg_read (REG_STATUS) & STATUS_LU ? "up" : "down");
+  intr_set_level (old_level);
+}
+
+/* Frees the buffers of the frames the device has sent.
+   Interrupts must be off. */
+static void
+reclaim_tx (void)
+{
+  while (tx_used > 0 && (tx_ring[tx_head].status & TXD_STAT_DD))
+    {
+      netbuf_free (tx_bufs[tx_head]);
+      tx_bufs[tx_head] = NULL;
+      tx_head = (tx_head + 1) % TX_RING;
+      tx_used--;
+    }
+}
+
+/* Sends the CNT frames in BUFS, each a buffer of no more than
+   ETH_FRAME_MAX bytes, and takes ownership of the buffers.
+   Waits for room in the ring if need be, but not for the frames
+   to go out; the device is told of them once for the whole
+   batch, or once each time the ring fills up. */
+void
+e1000_send (struct netbuf **bufs, size_t cnt)
+{
+  enum intr_level old_level;
+  size_t i;
+
+  ASSERT (present);
+  ASSERT (!intr_context ());
+
+  old_level = intr_disable ();
+  for (i = 0; i < cnt; i++)
+    {
+      struct netbuf *b = bufs[i];
+      struct tx_desc *d;
+
+      ASSERT (b->len <= ETH_FRAME_MAX);
+      reclaim_tx ();
+      while (tx_used == TX_RING - 1)
+        {
+          reg_write (REG_TDT, tx_tail);
+          tx_waiters++;
+          sema_down (&tx_space);
+          reclaim_tx ();
+        }
+
+      d = &tx_ring[tx_tail];
+      d->addr = vtop (b->data);
+      d->len = b->len;
+      d->cso = d->css = 0;
+      d->cmd = TXD_CMD_EOP | TXD_CMD_IFCS | TXD_CMD_RS;
+      d->status = 0;
+      d->special = 0;
+      tx_bufs[tx_tail] = b;
+      tx_tail = (tx_tail + 1) % TX_RING;
+      tx_used++;
+      tx_cnt++;
+      tx_bytes += b->len;
+    }
+  barrier ();
+  reg_write (REG_TDT, tx_tail);
+  intr_set_level (old_level);
+}
+
+/* Waits for a frame to arrive and returns its buffer, which the
+   caller must pass to netbuf_free() when done with it. */
+struct netbuf *
+e1000_receive (void)
+{
+  enum intr_level old_level;
+  struct netbuf *b;
+
+  ASSERT (present);
+
+  sema_down (&rx_ready);
+  old_level = intr_disable ();
+  b = list_entry (list_pop_front (&rx_queue), struct netbuf, elem);
+  rx_queued--;
+  intr_set_level (old_level);
+  return b;
+}
+
+/* Takes every frame the device has received off the ring,
+   queues it for readers, or drops it if they are too far
+   behind, and hands the emptied descriptors back at once. */
+static void
+drain_rx (void)
+{
+  bool any = false;
+  size_t last = 0;
+
+  for (;;)
+    {
+      struct rx_desc *d = &rx_ring[rx_next];
+      struct netbuf *fresh;
+
+      barrier ();
+      if (!(d->status & RXD_STAT_DD))
+        break;
+
+      /* A frame that fits a buffer comes in one descriptor. */
+      if ((d->status & RXD_STAT_EOP) && d->errors == 0
+          && rx_queued < RX_QUEUE_MAX
+          && (fresh = netbuf_alloc ()) != NULL)
+        {
+          struct netbuf *b = rx_bufs[rx_next];
+
+          b->len = d->len;
+          list_push_back (&rx_queue, &b->elem);
+          rx_queued++;
+          rx_cnt++;
+          rx_bytes += b->len;
+          sema_up (&rx_ready);
+
+          rx_bufs[rx_next] = fresh;
+          d->addr = vtop (fresh->data);
+        }
+      else
+        rx_dropped++;
+
+      d->status = 0;
+      last = rx_next;
+      rx_next = (rx_next + 1) % RX_RING;
+      any = true;
+    }
+  if (any)
+    {
+      barrier ();
+      reg_write (REG_RDT, last);
+    }
+}
+
+/* E1000 interrupt handler. */
+static void
+interrupt_handler (struct intr_frame *f UNUSED)
+{
+  /* Reading the causes acknowledges them. */
+  uint32_t icr = reg_read (REG_ICR);
+
+  intr_cnt++;
+  if (icr & (ICR_RXT0 | ICR_RXO | ICR_RXDMT0))
+    drain_rx ();
+  if (icr & ICR_TXDW)
+    {
+      reclaim_tx ();
+      for (; tx_waiters > 0 && tx_used < TX_RING - 1; tx_waiters--)
+        sema_up (&tx_space);
+    }
+}
+
+/* Prints network statistics, if there is a device. */
+void
+e1000_print_stats (void)
+{
+  if (present)
+    printf ("e1000: %llu frames received (%llu bytes, %llu dropped), "
+            "%llu sent (%llu bytes), %llu interrupts\n",
+            rx_cnt, rx_bytes, rx_dropped, tx_cnt, tx_bytes, intr_cnt);
+}
@@ -0,0 +1,22 @@
+#ifndef DEVICES_E1000_H
+#define DEVICES_E1000_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/netbuf.h"
+
+/* Bytes in an Ethernet address. */
+#define ETH_ADDR_LEN 6
+
+/* Largest frame sent or received, without its CRC. */
+#define ETH_FRAME_MAX 1514
+
+void e1000_init (void);
+bool e1000_present (void);
+void e1000_get_mac (uint8_t mac[ETH_ADDR_LEN]);
+void e1000_send (struct netbuf **, size_t cnt);
+struct netbuf *e1000_receive (void);
+void e1000_print_stats (void);
+
+#endif /* devices/e1000.h */
@@ -9,6 +9,8 @@
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/trace.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -50,6 +52,10 @@
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
 
+/* Most sectors a single READ or WRITE SECTOR command moves.
+   A sector count of 0 in the register means 256. */
+#define MAX_SECTORS_PER_CMD 256
+
 /* An ATA device. */
 struct ata_disk
   {
@@ -57,6 +63,15 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    block_sector_t capacity;    /* Size in sectors, if is_ata. */
+    char extra_info[128];       /* Model and serial, if is_ata. */
+    struct block *block;        /* Block device, once registered. */
+
+    /* Transfer started by ide_start() and not yet done. */
+    struct block_transfer *t;   /* The transfer. */
+    bool waiting;               /* Started while the channel was busy. */
+    size_t done;                /* Sectors transferred so far. */
+    size_t cmd_left;            /* Sectors left in the current command. */
   };
 
 /* An ATA channel (aka controller).
@@ -67,10 +82,14 @@ struct channel
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
 
-    struct lock lock;           /* Must acquire to access the controller. */
+    struct lock lock;           /* Must acquire to access the controller
+                                   while probing. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
-    struct semaphore completion_wait;   /* Up'd by interrupt handler. */
+    struct semaphore completion_wait;   /* Up'd by interrupt handler, while
+                                           probing. */
+    struct ata_disk *active;    /* Disk whose transfer is running, if any. */
+    struct semaphore probed;    /* Up'd when probe_channel() is done. */
 
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
@@ -80,12 +99,19 @@ struct channel
 static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
+static void ide_start (void *, struct block_transfer *);
 
+static thread_func probe_channel;
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void register_ata_device (struct ata_disk *);
+
+static void begin_transfer (struct ata_disk *);
+static void issue_transfer_command (struct ata_disk *);
+static void transfer_interrupt (struct channel *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -97,16 +123,20 @@ static void select_device_wait (const struct ata_disk *);
 
 static void interrupt_handler (struct intr_frame *);
 
-/* Initialize the disk subsystem and detect disks. */
+/* Initialize the disk subsystem and detect disks.
+   Each channel is probed by a thread of its own, since resetting
+   a channel spends most of its time sleeping.  Disks are
+   registered afterward, in order, so that they keep the same
+   names and roles whichever channel answers first. */
 void
 ide_init (void)
 {
   size_t chan_no;
+  int dev_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
       struct channel *c = &channels[chan_no];
-      int dev_no;
 
       /* Initialize channel. */
       snprintf (c->name, sizeof c->name, "ide%zu", chan_no);
@@ -124,8 +154,11 @@ ide_init (void)
           NOT_REACHED ();
         }
       lock_init (&c->lock);
+      lock_set_name (&c->lock, c->name);
       c->expecting_interrupt = false;
+      c->active = NULL;
       sema_init (&c->completion_wait, 0);
+      sema_init (&c->probed, 0);
 
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,27 +169,54 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->block = NULL;
+          d->waiting = false;
         }
 
       /* Register interrupt handler. */
       intr_register_ext (c->irq, interrupt_handler, c->name);
 
-      /* Reset hardware. */
-      reset_channel (c);
+      /* Probe the channel's devices. */
+      if (thread_create (c->name, PRI_DEFAULT, probe_channel, c) == TID_ERROR)
+        probe_channel (c);
+    }
 
-      /* Distinguish ATA hard disks from other devices. */
-      if (check_device_type (&c->devices[0]))
-        check_device_type (&c->devices[1]);
+  for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
+    {
+      struct channel *c = &channels[chan_no];
 
-      /* Read hard disk identity information. */
+      sema_down (&c->probed);
       for (dev_no = 0; dev_no < 2; dev_no++)
         if (c->devices[dev_no].is_ata)
-          identify_ata_device (&c->devices[dev_no]);
+          register_ata_device (&c->devices[dev_no]);
     }
 }
 
 /* Disk detection and identification. */
 
+/* Resets channel C_, finds out which of its devices are ATA
+   disks, and reads their identity information. */
+static void
+probe_channel (void *c_)
+{
+  struct channel *c = c_;
+  int dev_no;
+
+  /* Reset hardware. */
+  reset_channel (c);
+
+  /* Distinguish ATA hard disks from other devices. */
+  if (check_device_type (&c->devices[0]))
+    check_device_type (&c->devices[1]);
+
+  /* Read hard disk identity information. */
+  for (dev_no = 0; dev_no < 2; dev_no++)
+    if (c->devices[dev_no].is_ata)
+      identify_ata_device (&c->devices[dev_no]);
+
+  sema_up (&c->probed);
+}
+
 static char *descramble_ata_string (char *, int size);
 
 /* Resets an ATA channel and waits for any devices present on it
@@ -254,8 +314,7 @@ check_device_type (struct ata_disk *d)
 }
 
 /* Sends an IDENTIFY DEVICE command to disk D and reads the
-   response.  Registers the disk with the block device
-   layer. */
+   response into D's capacity and extra_info members. */
 static void
 identify_ata_device (struct ata_disk *d)
 {
@@ -263,8 +322,6 @@ identify_ata_device (struct ata_disk *d)
   char id[BLOCK_SECTOR_SIZE];
   block_sector_t capacity;
   char *model, *serial;
-  char extra_info[128];
-  struct block *block;
 
   ASSERT (d->is_ata);
 
@@ -286,7 +343,7 @@ identify_ata_device (struct ata_disk *d)
   capacity = *(uint32_t *) &id[60 * 2];
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
-  snprintf (extra_info, sizeof extra_info,
+  snprintf (d->extra_info, sizeof d->extra_info,
             "model \"%s\", serial \"%s\"", model, serial);
 
   /* Disable access to IDE disks over 1 GB, which are likely
@@ -302,10 +359,21 @@ identify_ata_device (struct ata_disk *d)
       d->is_ata = false;
       return;
     }
+  d->capacity = capacity;
+}
+
+/* Registers identified disk D with the block device layer and
+   scans it for partitions. */
+static void
+register_ata_device (struct ata_disk *d)
+{
+  struct block *block;
+
+  ASSERT (d->is_ata);
 
-  /* Register. */
-  block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
+  block = block_register (d->name, BLOCK_RAW, d->extra_info, d->capacity,
                           &ide_operations, d);
+  d->block = block;
   partition_scan (block);
 }
 
@@ -337,63 +405,140 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+/* Transfers.
+
+   A transfer runs from the interrupt handler, so the thread that
+   wants it, if any, is free to do other work meanwhile.  Starting
+   one writes the first command, of up to MAX_SECTORS_PER_CMD
+   sectors, and for a write the first sector.  The disk then
+   interrupts once per sector: for a read, when the sector can be
+   read from the data register, and for a write, when it has taken
+   the sector, so the handler writes the next.  After the last
+   sector the block layer is told, and it starts the next transfer
+   at once.  A channel runs one transfer at a time; one started
+   for the other disk meanwhile waits for it.  Interrupts are off
+   throughout, which is what serializes access to the channel. */
+
+/* Starts transfer T between disk D and memory.  Returns at once;
+   block_complete() is called when the transfer is done.  Must be
+   called with interrupts off. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_start (void *d_, struct block_transfer *t)
 {
   struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (t->cnt > 0);
+
+  trace (t->write ? TRACE_IDE_WRITE : TRACE_IDE_READ, t->sector, t->cnt);
+  d->t = t;
+  d->done = 0;
+  if (d->channel->active == NULL)
+    begin_transfer (d);
+  else
+    d->waiting = true;
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+/* Makes D's transfer the one running on its channel, and issues
+   its first command. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+begin_transfer (struct ata_disk *d)
+{
+  d->channel->active = d;
+  d->waiting = false;
+  issue_transfer_command (d);
+}
+
+/* Issues the command for the next part of D's transfer, and for a
+   write, sends its first sector. */
+static void
+issue_transfer_command (struct ata_disk *d)
 {
-  struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  size_t left = d->t->cnt - d->done;
+
+  d->cmd_left = left < MAX_SECTORS_PER_CMD ? left : MAX_SECTORS_PER_CMD;
+  select_sector (d, d->t->sector + d->done, d->cmd_left);
+  c->expecting_interrupt = true;
+  outb (reg_command (c),
+        d->t->write ? CMD_WRITE_SECTOR_RETRY : CMD_READ_SECTOR_RETRY);
+  if (d->t->write)
+    {
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name,
+               d->t->sector + d->done);
+      output_sector (c, d->t->buffers[d->done]);
+    }
+}
+
+/* Handles the interrupt for one sector of the transfer running
+   on channel C. */
+static void
+transfer_interrupt (struct channel *c)
+{
+  struct ata_disk *d = c->active;
+  struct ata_disk *other;
+
+  inb (reg_status (c));                 /* Acknowledge interrupt. */
+  if (!d->t->write)
+    {
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name,
+               d->t->sector + d->done);
+      input_sector (c, d->t->buffers[d->done]);
+    }
+  d->done++;
+  d->cmd_left--;
+
+  if (d->done < d->t->cnt)
+    {
+      if (d->cmd_left == 0)
+        issue_transfer_command (d);
+      else if (d->t->write)
+        {
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name,
+                   d->t->sector + d->done);
+          output_sector (c, d->t->buffers[d->done]);
+        }
+      return;
+    }
+
+  /* Done.  Give the other disk its turn before D's next transfer,
+     which block_complete() may start. */
+  trace (TRACE_IDE_DONE, d->t->sector + d->t->cnt, 0);
+  c->expecting_interrupt = false;
+  c->active = NULL;
+  other = &c->devices[1 - d->dev_no];
+  if (other->waiting)
+    begin_transfer (other);
+  block_complete (d->block, d->t);
 }
 
 static struct block_operations ide_operations =
   {
-    ide_read,
-    ide_write
+    NULL,                       /* Transfers go through ide_start(). */
+    NULL,
+    NULL,
+    NULL,
+    ide_start,
+    NULL
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the sector count CNT, which must be between
+   1 and MAX_SECTORS_PER_CMD, to the disk's sector selection
+   registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt >= 1 && cnt <= MAX_SECTORS_PER_CMD);
 
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_SECTORS_PER_CMD);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -446,7 +591,7 @@ wait_until_idle (const struct ata_disk *d)
     {
       if ((inb (reg_status (d->channel)) & (STA_BSY | STA_DRQ)) == 0)
         return;
-      timer_usleep (10);
+      timer_udelay (10);
     }
 
   printf ("%s: idle timeout\n", d->name);
@@ -472,7 +617,10 @@ wait_while_busy (const struct ata_disk *d)
             printf ("ok\n");
           return (inb (reg_alt_status (c)) & STA_DRQ) != 0;
         }
-      timer_msleep (10);
+      if (intr_get_level () == INTR_ON)
+        timer_msleep (10);
+      else
+        timer_mdelay (10);
     }
 
   printf ("failed\n");
@@ -489,7 +637,7 @@ select_device (const struct ata_disk *d)
     dev |= DEV_DEV;
   outb (reg_device (c), dev);
   inb (reg_alt_status (c));
-  timer_nsleep (400);
+  timer_ndelay (400);
 }
 
 /* Select disk D in its channel, as select_device(), but wait for
@@ -511,7 +659,9 @@ interrupt_handler (struct intr_frame *f)
   for (c = channels; c < channels + CHANNEL_CNT; c++)
     if (f->vec_no == c->irq)
       {
-        if (c->expecting_interrupt)
+        if (c->expecting_interrupt && c->active != NULL)
+          transfer_interrupt (c);
+        else if (c->expecting_interrupt)
           {
             inb (reg_status (c));               /* Acknowledge interrupt. */
             sema_up (&c->completion_wait);      /* Wake up waiter. */
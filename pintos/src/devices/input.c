@@ -41,6 +41,29 @@ input_getc (void)
   return key;
 }
 
+/* Retrieves up to SIZE keys from the input buffer into BUF and
+   returns the number retrieved.  Waits for a key to be pressed
+   only if the buffer is empty, then takes whatever else is
+   already queued in the same critical section. */
+size_t
+input_getbuf (uint8_t *buf, size_t size)
+{
+  enum intr_level old_level;
+  size_t cnt = 0;
+
+  if (size == 0)
+    return 0;
+
+  old_level = intr_disable ();
+  buf[cnt++] = intq_getc (&buffer);
+  while (cnt < size && !intq_empty (&buffer))
+    buf[cnt++] = intq_getc (&buffer);
+  serial_notify ();
+  intr_set_level (old_level);
+
+  return cnt;
+}
+
 /* Returns true if the input buffer is full,
    false otherwise.
    Interrupts must be off. */
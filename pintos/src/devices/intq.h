@@ -17,8 +17,12 @@
    protect kernel threads from one another, not from interrupt
    handlers. */
 
-/* Queue buffer size, in bytes. */
-#define INTQ_BUFSIZE 64
+/* Queue buffer size, in bytes.  Big enough to take a burst of
+   serial input, or a line or two of output, between the times a
+   thread gets to run; may be overridden at build time. */
+#ifndef INTQ_BUFSIZE
+#define INTQ_BUFSIZE 256
+#endif
 
 /* A circular queue of bytes. */
 struct intq
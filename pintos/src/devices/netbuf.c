@@ -0,0 +1,82 @@
+#include "devices/netbuf.h"
+#include <debug.h>
+#include "threads/interrupt.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* Free buffers. */
+static struct list free_bufs;
+static size_t free_cnt;
+
+/* Adds CNT buffers to the pool.  The first call also sets the
+   pool up; later calls grow it, as each device needs. */
+void
+netbuf_init (size_t cnt)
+{
+  static bool initialized;
+  struct netbuf *bufs;
+  uint8_t *page = NULL;
+  enum intr_level old_level;
+  size_t i;
+
+  if (!initialized)
+    {
+      list_init (&free_bufs);
+      initialized = true;
+    }
+
+  bufs = malloc (cnt * sizeof *bufs);
+  if (bufs == NULL)
+    PANIC ("netbuf: out of memory for %zu buffers", cnt);
+  old_level = intr_disable ();
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % (PGSIZE / NETBUF_SIZE) == 0)
+        page = palloc_get_page (PAL_ASSERT);
+      bufs[i].data = page + i % (PGSIZE / NETBUF_SIZE) * NETBUF_SIZE;
+      bufs[i].len = 0;
+      list_push_back (&free_bufs, &bufs[i].elem);
+      free_cnt++;
+    }
+  intr_set_level (old_level);
+}
+
+/* Takes a buffer from the pool and returns it, or a null
+   pointer if the pool is empty. */
+struct netbuf *
+netbuf_alloc (void)
+{
+  struct netbuf *b = NULL;
+  enum intr_level old_level = intr_disable ();
+
+  if (!list_empty (&free_bufs))
+    {
+      b = list_entry (list_pop_front (&free_bufs), struct netbuf, elem);
+      b->len = 0;
+      free_cnt--;
+    }
+  intr_set_level (old_level);
+  return b;
+}
+
+/* Returns B to the pool.  B may be a null pointer. */
+void
+netbuf_free (struct netbuf *b)
+{
+  enum intr_level old_level;
+
+  if (b == NULL)
+    return;
+  old_level = intr_disable ();
+  list_push_front (&free_bufs, &b->elem);
+  free_cnt++;
+  intr_set_level (old_level);
+}
+
+/* Returns the number of buffers in the pool. */
+size_t
+netbuf_free_cnt (void)
+{
+  return free_cnt;
+}
@@ -0,0 +1,32 @@
+#ifndef DEVICES_NETBUF_H
+#define DEVICES_NETBUF_H
+
+#include <list.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A pool of packet buffers, carved out of palloc pages.
+
+   A network device receives into and sends from these buffers
+   directly, and hands them on by pointer, so a frame is not
+   copied between the device and whoever consumes or produces it.
+   Buffers are physically contiguous, never cross a page, and may
+   be allocated and freed from interrupt handlers. */
+
+/* Bytes in a buffer: a whole Ethernet frame, with room to spare,
+   and two buffers to a page. */
+#define NETBUF_SIZE 2048
+
+struct netbuf
+  {
+    uint8_t *data;              /* NETBUF_SIZE bytes, in a palloc page. */
+    size_t len;                 /* Bytes of DATA in use. */
+    struct list_elem elem;      /* Free list or owner's queue. */
+  };
+
+void netbuf_init (size_t cnt);
+struct netbuf *netbuf_alloc (void);
+void netbuf_free (struct netbuf *);
+size_t netbuf_free_cnt (void);
+
+#endif /* devices/netbuf.h */
@@ -0,0 +1,86 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/interrupt.h"
+#include "threads/io.h"
+
+/* The code in this file reads and writes PCI configuration space
+   through the PC's configuration mechanism #1: an address written
+   to CONFIG_ADDRESS selects a 32-bit register, which is then
+   accessed through CONFIG_DATA. */
+
+#define CONFIG_ADDRESS 0xcf8
+#define CONFIG_DATA 0xcfc
+
+/* Header type register and its multi-function bit. */
+#define PCI_REG_HEADER_TYPE 0x0c
+#define HEADER_MULTIFUNCTION 0x00800000
+
+/* Returns the CONFIG_ADDRESS value that selects register REG of
+   DEV. */
+static uint32_t
+config_address (const struct pci_device *dev, uint8_t reg)
+{
+  ASSERT (reg % 4 == 0);
+  return (0x80000000 | (dev->bus << 16) | (dev->slot << 11)
+          | (dev->func << 8) | reg);
+}
+
+/* Returns configuration register REG of DEV. */
+uint32_t
+pci_config_read (const struct pci_device *dev, uint8_t reg)
+{
+  enum intr_level old_level = intr_disable ();
+  uint32_t value;
+
+  outl (CONFIG_ADDRESS, config_address (dev, reg));
+  value = inl (CONFIG_DATA);
+  intr_set_level (old_level);
+  return value;
+}
+
+/* Sets configuration register REG of DEV to VALUE. */
+void
+pci_config_write (const struct pci_device *dev, uint8_t reg, uint32_t value)
+{
+  enum intr_level old_level = intr_disable ();
+
+  outl (CONFIG_ADDRESS, config_address (dev, reg));
+  outl (CONFIG_DATA, value);
+  intr_set_level (old_level);
+}
+
+/* Calls FOUND, passing AUX, for each PCI function with the given
+   VENDOR and DEVICE IDs, in bus order. */
+void
+pci_scan (uint16_t vendor, uint16_t device, pci_found_func *found, void *aux)
+{
+  struct pci_device dev;
+  unsigned bus, slot, func;
+
+  for (bus = 0; bus < 256; bus++)
+    for (slot = 0; slot < 32; slot++)
+      for (func = 0; func < 8; func++)
+        {
+          uint32_t id;
+
+          dev.bus = bus;
+          dev.slot = slot;
+          dev.func = func;
+          id = pci_config_read (&dev, PCI_REG_ID);
+          if ((id & 0xffff) == 0xffff)
+            {
+              /* Nothing here.  Function 0 absent means no device. */
+              if (func == 0)
+                break;
+              continue;
+            }
+          if ((id & 0xffff) == vendor && (id >> 16) == device)
+            found (&dev, aux);
+
+          /* Only multi-function devices have functions past 0. */
+          if (func == 0
+              && !(pci_config_read (&dev, PCI_REG_HEADER_TYPE)
+                   & HEADER_MULTIFUNCTION))
+            break;
+        }
+}
@@ -0,0 +1,31 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdint.h>
+
+/* A PCI function, by its address. */
+struct pci_device
+  {
+    uint8_t bus;                /* Bus number. */
+    uint8_t slot;               /* Device number on the bus. */
+    uint8_t func;               /* Function number within the device. */
+  };
+
+/* Configuration space registers used by drivers. */
+#define PCI_REG_ID 0x00         /* Vendor ID (0:15), device ID (16:31). */
+#define PCI_REG_COMMAND 0x04    /* Command (0:15), status (16:31). */
+#define PCI_REG_BAR0 0x10       /* Base address register 0. */
+#define PCI_REG_INTERRUPT 0x3c  /* Interrupt line (0:7). */
+
+/* Command register bits. */
+#define PCI_COMMAND_IO 0x1      /* Respond to I/O space accesses. */
+#define PCI_COMMAND_MASTER 0x4  /* May act as bus master. */
+
+typedef void pci_found_func (const struct pci_device *, void *aux);
+
+void pci_scan (uint16_t vendor, uint16_t device, pci_found_func *, void *aux);
+uint32_t pci_config_read (const struct pci_device *, uint8_t reg);
+void pci_config_write (const struct pci_device *, uint8_t reg,
+                       uint32_t value);
+
+#endif /* devices/pci.h */
@@ -11,9 +11,6 @@
 #define PIT_PORT_CONTROL          0x43                /* Control port. */
 #define PIT_PORT_COUNTER(CHANNEL) (0x40 + (CHANNEL))  /* Counter port. */
 
-/* PIT cycles per second. */
-#define PIT_HZ 1193180
-
 /* Configure the given CHANNEL in the PIT.  In a PC, the PIT's
    three output channels are hooked up like this:
 
@@ -81,3 +78,37 @@ pit_configure_channel (int channel, int mode, int frequency)
   outb (PIT_PORT_COUNTER (channel), count >> 8);
   intr_set_level (old_level);
 }
+
+/* Starts channel 0 counting down COUNT PIT cycles in mode 0,
+   "interrupt on terminal count": its output goes high, raising
+   a single interrupt, when the count runs out, and stays high
+   until the channel is programmed again.  A COUNT of 0 stands
+   for 65536. */
+void
+pit_start_oneshot (uint16_t count)
+{
+  enum intr_level old_level = intr_disable ();
+  outb (PIT_PORT_CONTROL, 0x30);
+  outb (PIT_PORT_COUNTER (0), count);
+  outb (PIT_PORT_COUNTER (0), count >> 8);
+  intr_set_level (old_level);
+}
+
+/* Returns channel 0's current count and stores into *OUT whether
+   its output is high, using the 8254 read-back command to latch
+   both at the same instant. */
+uint16_t
+pit_read_channel0 (bool *out)
+{
+  enum intr_level old_level = intr_disable ();
+  uint8_t status, lo, hi;
+
+  outb (PIT_PORT_CONTROL, 0xc2);
+  status = inb (PIT_PORT_COUNTER (0));
+  lo = inb (PIT_PORT_COUNTER (0));
+  hi = inb (PIT_PORT_COUNTER (0));
+  intr_set_level (old_level);
+
+  *out = (status & 0x80) != 0;
+  return lo | (hi << 8);
+}
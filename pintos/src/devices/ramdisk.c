@@ -0,0 +1,142 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* The code in this file provides block devices kept in memory.
+   Their contents do not survive a reboot, but reading and writing
+   them costs no more than copying, so a file system on one shows
+   its own CPU cost apart from the disk's, and scratch data on one
+   never waits for a disk. */
+
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* A RAM disk. */
+struct ramdisk
+  {
+    char name[8];               /* Name, e.g. "ram0". */
+    enum block_type type;       /* Type to register as. */
+    size_t sector_cnt;          /* Size in sectors. */
+    uint8_t **pages;            /* Pages holding the sectors, in order. */
+  };
+
+/* RAM disks requested with ramdisk_add(). */
+#define RAMDISK_MAX 4
+static struct ramdisk ramdisks[RAMDISK_MAX];
+static size_t ramdisk_cnt;
+
+static struct block_operations ramdisk_operations;
+
+/* Asks ramdisk_init() to create a RAM disk of SECTOR_CNT sectors
+   of the given TYPE.  Panics if too many are requested. */
+void
+ramdisk_add (enum block_type type, size_t sector_cnt)
+{
+  struct ramdisk *rd;
+
+  if (ramdisk_cnt >= RAMDISK_MAX)
+    PANIC ("too many RAM disks (at most %d)", RAMDISK_MAX);
+  ASSERT (sector_cnt > 0);
+
+  rd = &ramdisks[ramdisk_cnt];
+  snprintf (rd->name, sizeof rd->name, "ram%zu", ramdisk_cnt);
+  rd->type = type;
+  rd->sector_cnt = sector_cnt;
+  ramdisk_cnt++;
+}
+
+/* Allocates the RAM disks requested with ramdisk_add() and
+   registers them.  Their memory comes from the user pool, which
+   is the larger, one page at a time, so they need not be
+   contiguous.  Since they are registered before any disk, a RAM
+   disk of a given type takes that role by default. */
+void
+ramdisk_init (void)
+{
+  size_t i, j;
+
+  for (i = 0; i < ramdisk_cnt; i++)
+    {
+      struct ramdisk *rd = &ramdisks[i];
+      size_t page_cnt = DIV_ROUND_UP (rd->sector_cnt, SECTORS_PER_PAGE);
+      char extra_info[32];
+
+      rd->pages = malloc (page_cnt * sizeof *rd->pages);
+      if (rd->pages == NULL)
+        PANIC ("%s: out of memory for page table", rd->name);
+      for (j = 0; j < page_cnt; j++)
+        {
+          rd->pages[j] = palloc_get_page (PAL_USER | PAL_ZERO);
+          if (rd->pages[j] == NULL)
+            PANIC ("%s: out of memory after %zu of %zu pages",
+                   rd->name, j, page_cnt);
+        }
+
+      snprintf (extra_info, sizeof extra_info, "RAM disk for %s",
+                block_type_name (rd->type));
+      block_register (rd->name, rd->type, extra_info, rd->sector_cnt,
+                      &ramdisk_operations, rd);
+    }
+}
+
+/* Returns the address of SECTOR in RAM disk RD. */
+static uint8_t *
+sector_addr (const struct ramdisk *rd, block_sector_t sector)
+{
+  return (rd->pages[sector / SECTORS_PER_PAGE]
+          + sector % SECTORS_PER_PAGE * BLOCK_SECTOR_SIZE);
+}
+
+/* Reads CNT sectors starting at SECTOR from RAM disk RD_ into
+   BUFFER. */
+static void
+ramdisk_read_multiple (void *rd_, block_sector_t sector, size_t cnt,
+                       void *buffer_)
+{
+  struct ramdisk *rd = rd_;
+  uint8_t *buffer = buffer_;
+
+  for (; cnt > 0; cnt--, sector++, buffer += BLOCK_SECTOR_SIZE)
+    memcpy (buffer, sector_addr (rd, sector), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes CNT sectors starting at SECTOR to RAM disk RD_ from
+   BUFFER. */
+static void
+ramdisk_write_multiple (void *rd_, block_sector_t sector, size_t cnt,
+                        const void *buffer_)
+{
+  struct ramdisk *rd = rd_;
+  const uint8_t *buffer = buffer_;
+
+  for (; cnt > 0; cnt--, sector++, buffer += BLOCK_SECTOR_SIZE)
+    memcpy (sector_addr (rd, sector), buffer, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SECTOR from RAM disk RD_ into BUFFER. */
+static void
+ramdisk_read (void *rd_, block_sector_t sector, void *buffer)
+{
+  ramdisk_read_multiple (rd_, sector, 1, buffer);
+}
+
+/* Writes SECTOR to RAM disk RD_ from BUFFER. */
+static void
+ramdisk_write (void *rd_, block_sector_t sector, const void *buffer)
+{
+  ramdisk_write_multiple (rd_, sector, 1, buffer);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_read_multiple,
+    ramdisk_write_multiple,
+    NULL,                       /* Copying needs no queue. */
+    NULL
+  };
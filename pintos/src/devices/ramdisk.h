@@ -0,0 +1,10 @@
+#ifndef DEVICES_RAMDISK_H
+#define DEVICES_RAMDISK_H
+
+#include <stddef.h>
+#include "devices/block.h"
+
+void ramdisk_add (enum block_type, size_t sector_cnt);
+void ramdisk_init (void);
+
+#endif /* devices/ramdisk.h */
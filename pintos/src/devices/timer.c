@@ -20,11 +20,31 @@
 /* Number of timer ticks since OS booted. */
 static int64_t ticks;
 
+/* Threads blocked in timer_sleep(), ordered by wakeup tick,
+   earliest first. */
+static struct list sleep_list;
+
 /* Number of loops per timer tick.
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
+/* -tickless: stop the periodic tick while the CPU is idle? */
+bool timer_tickless;
+
+/* PIT cycles per timer tick, and the most ticks one countdown of
+   the 16-bit PIT counter can span. */
+#define TICK_CYCLES ((PIT_HZ + TIMER_FREQ / 2) / TIMER_FREQ)
+#define MAX_STRETCH (UINT16_MAX / TICK_CYCLES)
+
+/* Number of ticks the running one-shot countdown stands for, or
+   0 if the timer is ticking periodically.  Interrupts must be
+   off to access. */
+static int64_t stretch_ticks;
+
+static void stretch_end (int64_t elapsed);
+
 static intr_handler_func timer_interrupt;
+static list_less_func wakeup_less;
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
@@ -36,6 +56,7 @@ void
 timer_init (void)
 {
   pit_configure_channel (0, 2, TIMER_FREQ);
+  list_init (&sleep_list);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 }
 
@@ -89,11 +110,30 @@ timer_elapsed (int64_t then)
 void
 timer_sleep (int64_t ticks)
 {
-  int64_t start = timer_ticks ();
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
 
   ASSERT (intr_get_level () == INTR_ON);
-  while (timer_elapsed (start) < ticks)
-    thread_yield ();
+  if (ticks <= 0)
+    return;
+
+  old_level = intr_disable ();
+  cur->wakeup_tick = timer_ticks () + ticks;
+  list_insert_ordered (&sleep_list, &cur->elem, wakeup_less, NULL);
+  thread_block ();
+  intr_set_level (old_level);
+}
+
+/* Orders threads on the sleep list by wakeup tick.  Threads with
+   equal ticks keep the order they went to sleep in. */
+static bool
+wakeup_less (const struct list_elem *a_, const struct list_elem *b_,
+             void *aux UNUSED)
+{
+  const struct thread *a = list_entry (a_, struct thread, elem);
+  const struct thread *b = list_entry (b_, struct thread, elem);
+
+  return a->wakeup_tick < b->wakeup_tick;
 }
 
 /* Sleeps for approximately MS milliseconds.  Interrupts must be
@@ -168,10 +208,97 @@ timer_print_stats (void)
 
 /* Timer interrupt handler. */
 static void
-timer_interrupt (struct intr_frame *args UNUSED)
+timer_interrupt (struct intr_frame *args)
 {
+  /* The one-shot countdown ran out: all of its ticks but this
+     one have gone by. */
+  if (stretch_ticks != 0)
+    stretch_end (stretch_ticks - 1);
+
   ticks++;
-  thread_tick ();
+
+  /* Wake every sleeper whose time has come.  The list is sorted,
+     so this stops at the first thread that must keep sleeping. */
+  while (!list_empty (&sleep_list))
+    {
+      struct thread *t = list_entry (list_front (&sleep_list),
+                                     struct thread, elem);
+      if (t->wakeup_tick > ticks)
+        break;
+      list_pop_front (&sleep_list);
+      thread_unblock (t);
+    }
+
+  thread_tick (args);
+}
+
+/* Called by the idle thread, with interrupts off, just before it
+   halts.  If tickless idle is enabled, replaces the periodic tick
+   by a single interrupt at the next sleeper's wakeup tick, or as
+   far off as the PIT can count, so that an idle CPU is not woken
+   every tick for nothing.  Not done under -mlfqs, whose once a
+   second updates need to see every tick. */
+void
+timer_idle_enter (void)
+{
+  int64_t n = MAX_STRETCH;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (!timer_tickless || thread_mlfqs || stretch_ticks != 0)
+    return;
+
+  if (!list_empty (&sleep_list))
+    {
+      struct thread *t = list_entry (list_front (&sleep_list),
+                                     struct thread, elem);
+      if (t->wakeup_tick - ticks < n)
+        n = t->wakeup_tick - ticks;
+    }
+  if (n < 2)
+    return;
+
+  pit_start_oneshot (n * TICK_CYCLES);
+  stretch_ticks = n;
+}
+
+/* Called with interrupts off when the CPU stops being idle.  If a
+   one-shot countdown started by timer_idle_enter() is still
+   running, charges the whole ticks that went by and returns the
+   timer to periodic mode. */
+void
+timer_idle_exit (void)
+{
+  uint16_t count;
+  bool fired;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (stretch_ticks == 0)
+    return;
+
+  count = pit_read_channel0 (&fired);
+  if (fired)
+    {
+      /* The interrupt for the final tick is pending and will
+         count that tick itself. */
+      stretch_end (stretch_ticks - 1);
+    }
+  else
+    stretch_end ((stretch_ticks * TICK_CYCLES - count) / TICK_CYCLES);
+}
+
+/* Ends the one-shot countdown, adding ELAPSED ticks to the tick
+   count, and restarts the periodic tick.  No sleeper can be due
+   yet, since the countdown ended no later than the first one's
+   wakeup tick.  The skipped ticks are not charged to the idle
+   thread's statistics. */
+static void
+stretch_end (int64_t elapsed)
+{
+  ticks += elapsed;
+  stretch_ticks = 0;
+  pit_configure_channel (0, 2, TIMER_FREQ);
 }
 
 /* Returns true if LOOPS iterations waits for more than one timer
@@ -0,0 +1,378 @@
+#include "devices/virtio-blk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file drives virtio block devices, such as
+   QEMU provides with "-drive if=virtio", through the legacy
+   virtio PCI interface [VIRTIO 0.9.5].  Unlike an IDE disk, which
+   moves data through an I/O port one word at a time, a virtio
+   disk reads and writes memory directly, and takes several
+   requests at once through a ring of descriptors shared with the
+   host, so a whole transfer costs one notification and one
+   interrupt. */
+
+/* PCI IDs of a legacy (or transitional) virtio block device. */
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_BLK_DEVICE 0x1001
+
+/* Legacy virtio registers, as offsets into I/O BAR 0. */
+#define REG_DEVICE_FEATURES 0x00        /* Features offered (32 bits). */
+#define REG_GUEST_FEATURES 0x04         /* Features accepted (32 bits). */
+#define REG_QUEUE_PFN 0x08              /* Queue page frame (32 bits). */
+#define REG_QUEUE_SIZE 0x0c             /* Queue size (16 bits). */
+#define REG_QUEUE_SELECT 0x0e           /* Queue selector (16 bits). */
+#define REG_QUEUE_NOTIFY 0x10           /* Queue notifier (16 bits). */
+#define REG_STATUS 0x12                 /* Device status (8 bits). */
+#define REG_ISR 0x13                    /* Interrupt status (8 bits). */
+#define REG_CAPACITY 0x14               /* Size in sectors (64 bits). */
+
+/* Device status bits. */
+#define STATUS_ACKNOWLEDGE 0x01         /* We noticed the device. */
+#define STATUS_DRIVER 0x02              /* We can drive it. */
+#define STATUS_DRIVER_OK 0x04           /* We are ready. */
+
+/* Interrupt status bits. */
+#define ISR_QUEUE 0x01                  /* A queue has used buffers. */
+
+/* Legacy virtqueue layout: descriptors, then the available ring,
+   then, at the next VRING_ALIGN boundary, the used ring. */
+#define VRING_ALIGN 4096
+
+/* Descriptor flags. */
+#define DESC_NEXT 0x1                   /* NEXT is valid. */
+#define DESC_WRITE 0x2                  /* Device writes the buffer. */
+
+struct vring_desc
+  {
+    uint64_t addr;                      /* Physical address. */
+    uint32_t len;                       /* Length in bytes. */
+    uint16_t flags;                     /* DESC_* flags. */
+    uint16_t next;                      /* Next descriptor in chain. */
+  };
+
+struct vring_avail
+  {
+    uint16_t flags;
+    uint16_t idx;                       /* Where we put the next entry. */
+    uint16_t ring[];                    /* Heads of chains for the device. */
+  };
+
+struct vring_used_elem
+  {
+    uint32_t id;                        /* Head of a finished chain. */
+    uint32_t len;                       /* Bytes the device wrote. */
+  };
+
+struct vring_used
+  {
+    uint16_t flags;
+    uint16_t idx;                       /* Where the device puts the next. */
+    struct vring_used_elem ring[];
+  };
+
+/* Request header and status. */
+#define BLK_T_IN 0                      /* Read. */
+#define BLK_T_OUT 1                     /* Write. */
+#define BLK_S_OK 0                      /* Success. */
+
+struct blk_header
+  {
+    uint32_t type;                      /* BLK_T_IN or BLK_T_OUT. */
+    uint32_t reserved;
+    uint64_t sector;                    /* First sector. */
+  };
+
+/* A transfer in flight.  The device reads HEADER and writes
+   STATUS, so slots live in a page of their own. */
+struct blk_slot
+  {
+    struct blk_header header;           /* Request header. */
+    uint8_t status;                     /* Written by the device. */
+    uint16_t head;                      /* First descriptor of the chain. */
+    struct block_transfer *t;           /* The transfer, or null if free. */
+  };
+
+/* A virtio block device. */
+struct vblk
+  {
+    char name[8];                       /* Name, e.g. "vda". */
+    uint16_t io_base;                   /* Base of I/O BAR 0. */
+    uint8_t irq;                        /* Interrupt vector. */
+    struct block *block;                /* Block device. */
+
+    uint16_t qsize;                     /* Descriptors in the queue. */
+    struct vring_desc *desc;            /* Descriptor table. */
+    struct vring_avail *avail;          /* Available ring. */
+    struct vring_used *used;            /* Used ring. */
+    uint16_t free_head;                 /* First free descriptor. */
+    uint16_t free_cnt;                  /* Number of free descriptors. */
+    uint16_t last_used;                 /* Used entries handled so far. */
+
+    struct blk_slot *slots;             /* Transfers in flight. */
+    size_t slot_cnt;                    /* Number of SLOTS. */
+  };
+
+/* We support a handful of disks. */
+#define VBLK_MAX 4
+static struct vblk disks[VBLK_MAX];
+static size_t disk_cnt;
+
+static struct block_operations vblk_operations;
+static pci_found_func probe_device;
+static void vblk_start (void *, struct block_transfer *);
+static uint16_t alloc_desc (struct vblk *);
+static void interrupt_handler (struct intr_frame *);
+
+/* Finds and registers virtio block devices. */
+void
+virtio_blk_init (void)
+{
+  pci_scan (VIRTIO_VENDOR, VIRTIO_BLK_DEVICE, probe_device, NULL);
+}
+
+/* Sets up the virtio block device at PCI address DEV and
+   registers it. */
+static void
+probe_device (const struct pci_device *dev, void *aux UNUSED)
+{
+  struct vblk *v;
+  uint32_t bar, line;
+  uint64_t capacity;
+  size_t avail_end, used_ofs, page_cnt, depth, i;
+  void *ring;
+  char extra_info[32];
+  bool shared_irq = false;
+
+  if (disk_cnt >= VBLK_MAX)
+    return;
+  v = &disks[disk_cnt];
+  snprintf (v->name, sizeof v->name, "vd%c", 'a' + (int) disk_cnt);
+
+  bar = pci_config_read (dev, PCI_REG_BAR0);
+  line = pci_config_read (dev, PCI_REG_INTERRUPT) & 0xff;
+  if (!(bar & 1) || line >= 16)
+    {
+      printf ("%s: no I/O BAR or legacy interrupt, ignoring\n", v->name);
+      return;
+    }
+  v->io_base = bar & ~3u;
+  v->irq = 0x20 + line;
+  pci_config_write (dev, PCI_REG_COMMAND,
+                    (pci_config_read (dev, PCI_REG_COMMAND)
+                     | PCI_COMMAND_IO | PCI_COMMAND_MASTER));
+
+  /* Reset, then tell the device we know it.  We take none of its
+     optional features. */
+  outb (v->io_base + REG_STATUS, 0);
+  outb (v->io_base + REG_STATUS, STATUS_ACKNOWLEDGE);
+  outb (v->io_base + REG_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+  outl (v->io_base + REG_GUEST_FEATURES, 0);
+
+  /* Lay out queue 0.  Each transfer in flight takes a descriptor
+     for its header, one per sector at most, and one for its
+     status. */
+  outw (v->io_base + REG_QUEUE_SELECT, 0);
+  v->qsize = inw (v->io_base + REG_QUEUE_SIZE);
+  depth = v->qsize / (BLOCK_REQUEST_MAX + 2);
+  if (depth == 0)
+    {
+      printf ("%s: queue of %"PRIu16" too small, ignoring\n",
+              v->name, v->qsize);
+      outb (v->io_base + REG_STATUS, 0);
+      return;
+    }
+  if (depth > BLOCK_DEPTH_MAX)
+    depth = BLOCK_DEPTH_MAX;
+  avail_end = v->qsize * sizeof *v->desc
+              + sizeof *v->avail + (v->qsize + 1) * sizeof (uint16_t);
+  used_ofs = ROUND_UP (avail_end, VRING_ALIGN);
+  page_cnt = DIV_ROUND_UP (used_ofs + sizeof *v->used
+                           + v->qsize * sizeof (struct vring_used_elem)
+                           + sizeof (uint16_t), PGSIZE);
+  ring = palloc_get_multiple (PAL_ASSERT | PAL_ZERO, page_cnt);
+  v->desc = ring;
+  v->avail = (struct vring_avail *) (v->desc + v->qsize);
+  v->used = (struct vring_used *) ((uint8_t *) ring + used_ofs);
+  for (i = 0; i + 1 < v->qsize; i++)
+    v->desc[i].next = i + 1;
+  v->free_head = 0;
+  v->free_cnt = v->qsize;
+  v->last_used = 0;
+  outl (v->io_base + REG_QUEUE_PFN, vtop (ring) / PGSIZE);
+
+  v->slots = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+  v->slot_cnt = depth;
+  ASSERT (depth * sizeof *v->slots <= PGSIZE);
+
+  /* Disks may share an interrupt line, and the handler serves
+     all of them. */
+  for (i = 0; i < disk_cnt; i++)
+    if (disks[i].irq == v->irq)
+      shared_irq = true;
+  if (!shared_irq)
+    intr_register_ext (v->irq, interrupt_handler, "virtio-blk");
+  outb (v->io_base + REG_STATUS,
+        STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+
+  capacity = (inl (v->io_base + REG_CAPACITY)
+              | (uint64_t) inl (v->io_base + REG_CAPACITY + 4) << 32);
+  if (capacity > UINT32_MAX)
+    capacity = UINT32_MAX;
+  disk_cnt++;
+
+  snprintf (extra_info, sizeof extra_info, "virtio, PCI %02x:%02x.%x",
+            dev->bus, dev->slot, dev->func);
+  v->block = block_register (v->name, BLOCK_RAW, extra_info, capacity,
+                             &vblk_operations, v);
+  block_set_depth (v->block, depth);
+  partition_scan (v->block);
+}
+
+/* Starts transfer T on disk V_: sets up a descriptor chain of its
+   header, its data, with physically adjacent sectors sharing a
+   descriptor, and its status, and passes it to the device.
+   Returns at once; the interrupt handler calls block_complete(). */
+static void
+vblk_start (void *v_, struct block_transfer *t)
+{
+  struct vblk *v = v_;
+  struct blk_slot *s;
+  uint16_t head, prev, d;
+  size_t i;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  for (s = v->slots; s->t != NULL; s++)
+    ASSERT (s < v->slots + v->slot_cnt - 1);
+  s->t = t;
+  s->header.type = t->write ? BLK_T_OUT : BLK_T_IN;
+  s->header.reserved = 0;
+  s->header.sector = t->sector;
+  s->status = 0xff;
+
+  head = prev = alloc_desc (v);
+  v->desc[head].addr = vtop (&s->header);
+  v->desc[head].len = sizeof s->header;
+  v->desc[head].flags = DESC_NEXT;
+  for (i = 0; i < t->cnt; i++)
+    {
+      if (i > 0 && prev != head
+          && t->buffers[i] == (uint8_t *) t->buffers[i - 1] + BLOCK_SECTOR_SIZE)
+        {
+          v->desc[prev].len += BLOCK_SECTOR_SIZE;
+          continue;
+        }
+      d = alloc_desc (v);
+      v->desc[prev].next = d;
+      v->desc[d].addr = vtop (t->buffers[i]);
+      v->desc[d].len = BLOCK_SECTOR_SIZE;
+      v->desc[d].flags = DESC_NEXT | (t->write ? 0 : DESC_WRITE);
+      prev = d;
+    }
+  d = alloc_desc (v);
+  v->desc[prev].next = d;
+  v->desc[d].addr = vtop (&s->status);
+  v->desc[d].len = 1;
+  v->desc[d].flags = DESC_WRITE;
+  s->head = head;
+
+  /* Publish the chain, then its index, then notify. */
+  v->avail->ring[v->avail->idx % v->qsize] = head;
+  barrier ();
+  v->avail->idx++;
+  barrier ();
+  outw (v->io_base + REG_QUEUE_NOTIFY, 0);
+}
+
+/* Takes a descriptor off V's free list. */
+static uint16_t
+alloc_desc (struct vblk *v)
+{
+  uint16_t d = v->free_head;
+
+  ASSERT (v->free_cnt > 0);
+  v->free_head = v->desc[d].next;
+  v->free_cnt--;
+  return d;
+}
+
+/* Finishes the transfers disk V has handed back. */
+static void
+complete_used (struct vblk *v)
+{
+  for (;;)
+    {
+      struct vring_used_elem *e;
+      struct block_transfer *t;
+      struct blk_slot *s;
+      uint16_t d;
+
+      barrier ();
+      if (v->last_used == v->used->idx)
+        break;
+      e = &v->used->ring[v->last_used % v->qsize];
+      v->last_used++;
+
+      for (s = v->slots; s->t == NULL || s->head != e->id; s++)
+        ASSERT (s < v->slots + v->slot_cnt - 1);
+      if (s->status != BLK_S_OK)
+        PANIC ("%s: disk %s failed, sector=%"PRDSNu, v->name,
+               s->t->write ? "write" : "read", s->t->sector);
+
+      /* Put the chain back on the free list. */
+      d = s->head;
+      for (;;)
+        {
+          bool more = v->desc[d].flags & DESC_NEXT;
+          uint16_t next = v->desc[d].next;
+
+          v->desc[d].next = v->free_head;
+          v->free_head = d;
+          v->free_cnt++;
+          if (!more)
+            break;
+          d = next;
+        }
+
+      t = s->t;
+      s->t = NULL;
+      block_complete (v->block, t);
+    }
+}
+
+/* Virtio block interrupt handler, shared by every disk on the
+   interrupt line. */
+static void
+interrupt_handler (struct intr_frame *f)
+{
+  size_t i;
+
+  for (i = 0; i < disk_cnt; i++)
+    {
+      struct vblk *v = &disks[i];
+
+      /* Reading the status acknowledges the interrupt. */
+      if (v->irq == f->vec_no
+          && (inb (v->io_base + REG_ISR) & ISR_QUEUE))
+        complete_used (v);
+    }
+}
+
+static struct block_operations vblk_operations =
+  {
+    NULL,                       /* Transfers go through vblk_start(). */
+    NULL,
+    NULL,
+    NULL,
+    vblk_start,
+    NULL
+  };
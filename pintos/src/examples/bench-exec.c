@@ -0,0 +1,49 @@
+/* bench-exec.c
+
+   Times starting a process and waiting for it:
+
+     bench-exec [count=N] [prog=PROGRAM]
+
+   runs PROGRAM, by default a copy of this program that exits at
+   once, N times in turn, waiting for each, and reports the round
+   trips along with what the children used. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "bench.h"
+
+int
+main (int argc, char *argv[])
+{
+  int count = atoi (bench_option (argc, argv, "count", "50"));
+  const char *prog = bench_option (argc, argv, "prog", "bench-exec child");
+  int i;
+
+  if (argc > 1 && !strcmp (argv[1], "child"))
+    return EXIT_SUCCESS;
+  if (count <= 0)
+    {
+      printf ("usage: bench-exec [count=N] [prog=PROGRAM]\n");
+      return EXIT_FAILURE;
+    }
+
+  bench_start (RUSAGE_CHILDREN);
+  for (i = 0; i < count; i++)
+    {
+      pid_t pid = exec (prog);
+      if (pid == PID_ERROR)
+        {
+          printf ("%s: exec failed\n", prog);
+          return EXIT_FAILURE;
+        }
+      if (wait (pid) != EXIT_SUCCESS)
+        {
+          printf ("%s: exited with failure\n", prog);
+          return EXIT_FAILURE;
+        }
+    }
+  bench_report ("exec+wait", count, 0);
+  return EXIT_SUCCESS;
+}
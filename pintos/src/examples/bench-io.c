@@ -0,0 +1,99 @@
+/* bench-io.c
+
+   Times writing and then reading back a file, dd-style:
+
+     bench-io [file=NAME] [bs=BYTES] [count=BLOCKS] [offset=BYTES]
+              [op=rw|w|r] [cold=1]
+
+   writes COUNT blocks of BS bytes to NAME starting OFFSET bytes
+   in, then reads them back.  The write is timed through fsync(),
+   so it includes putting the data on disk.  With cold=1 the
+   buffer cache is emptied before the read, so it comes from
+   disk.  op=r reads a file an earlier op=w left behind. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "bench.h"
+
+int
+main (int argc, char *argv[])
+{
+  const char *file = bench_option (argc, argv, "file", "bench.dat");
+  int bs = atoi (bench_option (argc, argv, "bs", "4096"));
+  int count = atoi (bench_option (argc, argv, "count", "256"));
+  int offset = atoi (bench_option (argc, argv, "offset", "0"));
+  const char *op = bench_option (argc, argv, "op", "rw");
+  bool cold = atoi (bench_option (argc, argv, "cold", "0"));
+  unsigned long long bytes = (unsigned long long) bs * count;
+  char *buffer;
+  char name[64];
+  int fd, i;
+
+  if (bs <= 0 || count <= 0 || offset < 0)
+    {
+      printf ("usage: bench-io [file=NAME] [bs=BYTES] [count=BLOCKS] "
+              "[offset=BYTES] [op=rw|w|r] [cold=1]\n");
+      return EXIT_FAILURE;
+    }
+  buffer = malloc (bs);
+  if (buffer == NULL)
+    {
+      printf ("bench-io: can't allocate a %d-byte block\n", bs);
+      return EXIT_FAILURE;
+    }
+
+  if (strchr (op, 'w') != NULL)
+    {
+      remove (file);
+      if (!create (file, 0) || (fd = open (file)) < 0)
+        {
+          printf ("%s: create failed\n", file);
+          return EXIT_FAILURE;
+        }
+      snprintf (name, sizeof name, "write bs=%d", bs);
+      bench_start (RUSAGE_SELF);
+      seek (fd, offset);
+      for (i = 0; i < count; i++)
+        {
+          /* Each block is filled with its number, for the read to check. */
+          memset (buffer, i, bs);
+          if (write (fd, buffer, bs) != bs)
+            {
+              printf ("%s: write of block %d failed\n", file, i);
+              return EXIT_FAILURE;
+            }
+        }
+      fsync (fd);
+      bench_report (name, count, bytes);
+      close (fd);
+    }
+
+  if (strchr (op, 'r') != NULL)
+    {
+      if (cold)
+        cache_reset ();
+      fd = open (file);
+      if (fd < 0)
+        {
+          printf ("%s: open failed\n", file);
+          return EXIT_FAILURE;
+        }
+      snprintf (name, sizeof name, "read bs=%d%s", bs, cold ? " cold" : "");
+      bench_start (RUSAGE_SELF);
+      seek (fd, offset);
+      for (i = 0; i < count; i++)
+        if (read (fd, buffer, bs) != bs
+            || buffer[0] != (char) i || buffer[bs - 1] != (char) i)
+          {
+            printf ("%s: read of block %d failed\n", file, i);
+            return EXIT_FAILURE;
+          }
+      bench_report (name, count, bytes);
+      close (fd);
+    }
+
+  free (buffer);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+/* bench-net.c
+
+   Times sending raw Ethernet frames:
+
+     bench-net [count=N] [size=BYTES] [batch=B]
+
+   sends N broadcast frames of BYTES bytes each, B to a call, and
+   reports the rate.  With "echo" as the first argument, instead
+   waits for N frames and sends each back to where it came from.
+   Needs a network card, as from "pintos --qemu --net". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "bench.h"
+
+/* Most frames sent to a call. */
+#define BATCH_MAX 64
+
+/* An unassigned EtherType, for frames nobody else should want. */
+#define ETHERTYPE_BENCH 0x88b5
+
+static uint8_t frames[BATCH_MAX][NET_FRAME_MAX];
+
+/* Receives COUNT frames and returns each to its sender. */
+static int
+echo (int count, const uint8_t mac[NET_ADDR_LEN])
+{
+  struct iovec iov;
+  unsigned long long bytes = 0;
+  int i;
+
+  bench_start (RUSAGE_SELF);
+  for (i = 0; i < count; i++)
+    {
+      int len = net_recv (frames[0], NET_FRAME_MAX);
+      if (len < 2 * NET_ADDR_LEN || len > NET_FRAME_MAX)
+        continue;
+      memcpy (frames[0], frames[0] + NET_ADDR_LEN, NET_ADDR_LEN);
+      memcpy (frames[0] + NET_ADDR_LEN, mac, NET_ADDR_LEN);
+      iov.iov_base = frames[0];
+      iov.iov_len = len;
+      if (net_send (&iov, 1) != 1)
+        {
+          printf ("bench-net: send failed\n");
+          return EXIT_FAILURE;
+        }
+      bytes += len;
+    }
+  bench_report ("net echo", count, bytes);
+  return EXIT_SUCCESS;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int count = atoi (bench_option (argc, argv, "count", "10000"));
+  int size = atoi (bench_option (argc, argv, "size", "1024"));
+  int batch = atoi (bench_option (argc, argv, "batch", "16"));
+  struct iovec iov[BATCH_MAX];
+  uint8_t mac[NET_ADDR_LEN];
+  char name[32];
+  int sent, i;
+
+  if (count <= 0 || size < 14 || size > NET_FRAME_MAX
+      || batch <= 0 || batch > BATCH_MAX)
+    {
+      printf ("usage: bench-net [echo] [count=N] [size=BYTES] [batch=B]\n");
+      return EXIT_FAILURE;
+    }
+  if (!net_info (mac))
+    {
+      printf ("bench-net: no network device\n");
+      return EXIT_FAILURE;
+    }
+  if (argc > 1 && !strcmp (argv[1], "echo"))
+    return echo (count, mac);
+
+  /* Broadcast from our address, with our EtherType. */
+  for (i = 0; i < batch; i++)
+    {
+      memset (frames[i], 0xff, NET_ADDR_LEN);
+      memcpy (frames[i] + NET_ADDR_LEN, mac, NET_ADDR_LEN);
+      frames[i][12] = ETHERTYPE_BENCH >> 8;
+      frames[i][13] = ETHERTYPE_BENCH & 0xff;
+      iov[i].iov_base = frames[i];
+      iov[i].iov_len = size;
+    }
+
+  bench_start (RUSAGE_SELF);
+  for (sent = 0; sent < count; )
+    {
+      int n = count - sent < batch ? count - sent : batch;
+      int result = net_send (iov, n);
+      if (result <= 0)
+        {
+          printf ("bench-net: send failed\n");
+          return EXIT_FAILURE;
+        }
+      sent += result;
+    }
+  snprintf (name, sizeof name, "net send size=%d batch=%d", size, batch);
+  bench_report (name, sent, (unsigned long long) sent * size);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,66 @@
+/* bench.c
+
+   Timing and resource reports shared by the bench-* examples. */
+
+#include "bench.h"
+#include <stdio.h>
+#include <string.h>
+
+static pid_t usage_of;
+static unsigned start_ticks;
+static struct rusage start_usage;
+
+void
+bench_start (pid_t who)
+{
+  usage_of = who;
+  getrusage (who, &start_usage);
+  start_ticks = ticks ();
+}
+
+void
+bench_report (const char *name, unsigned long long ops,
+              unsigned long long bytes)
+{
+  unsigned long long elapsed = ticks () - start_ticks;
+  struct rusage u;
+
+  getrusage (usage_of, &u);
+
+  /* A run shorter than a tick counts as one. */
+  if (elapsed == 0)
+    elapsed = 1;
+
+  printf ("%s: %llu ops in %llu ms: %llu us/op, %llu ops/s",
+          name, ops, elapsed * 1000 / TICKS_PER_SEC,
+          ops ? elapsed * 1000000 / TICKS_PER_SEC / ops : 0,
+          ops * TICKS_PER_SEC / elapsed);
+  if (bytes != 0)
+    printf (", %llu kB/s", bytes * TICKS_PER_SEC / elapsed / 1024);
+  printf ("\n");
+
+#define DELTA(FIELD) (u.FIELD - start_usage.FIELD)
+  printf ("%s: %s used %lld user, %lld system ticks; %u page faults; "
+          "read %llu, wrote %llu bytes; %u cache hits, %u misses; "
+          "%u voluntary, %u involuntary switches\n",
+          name, usage_of == RUSAGE_CHILDREN ? "children" : "process",
+          DELTA (user_ticks), DELTA (system_ticks), DELTA (page_faults),
+          DELTA (bytes_read), DELTA (bytes_written),
+          DELTA (cache_hits), DELTA (cache_misses),
+          DELTA (voluntary_switches), DELTA (involuntary_switches));
+#undef DELTA
+}
+
+const char *
+bench_option (int argc, char *argv[], const char *key,
+              const char *default_)
+{
+  size_t key_len = strlen (key);
+  int i;
+
+  for (i = 1; i < argc; i++)
+    if (strlen (argv[i]) > key_len && argv[i][key_len] == '='
+        && !memcmp (argv[i], key, key_len))
+      return argv[i] + key_len + 1;
+  return default_;
+}
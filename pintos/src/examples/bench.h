@@ -0,0 +1,21 @@
+#ifndef EXAMPLES_BENCH_H
+#define EXAMPLES_BENCH_H
+
+#include <syscall.h>
+
+/* Starts timing a run, noting the tick count and the resources
+   used so far by WHO, RUSAGE_SELF or RUSAGE_CHILDREN. */
+void bench_start (pid_t who);
+
+/* Reports the run since bench_start() as NAME, which did OPS
+   operations moving BYTES bytes: its time and rates, and what WHO
+   used meanwhile. */
+void bench_report (const char *name, unsigned long long ops,
+                   unsigned long long bytes);
+
+/* Returns the value of the first of ARGC arguments ARGV of the
+   form KEY=VALUE, or DEFAULT if there is none. */
+const char *bench_option (int argc, char *argv[], const char *key,
+                          const char *default_);
+
+#endif /* examples/bench.h */
@@ -1,28 +1,217 @@
 #include "filesys/cache.h"
 #include <debug.h>
 #include <round.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 #include "filesys/inode.h"
 #include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "threads/thread.h"
+#include "threads/trace.h"
 
 struct cache *memory_cache;
 
+/* A run of consecutive sectors waiting to be read ahead. */
+struct readahead_run
+  {
+    block_sector_t start;               /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+  };
+
+/* Read-ahead request queue, serviced by the "cache-readahead"
+   kernel thread.  Callers never block on a full queue; excess
+   requests are simply dropped. */
+#define READAHEAD_QUEUE_SIZE 64
+static struct
+  {
+    struct lock l;                            /* Protects all members. */
+    struct condition not_empty;               /* Signaled on enqueue. */
+    struct condition idle;                    /* Signaled when BUSY clears. */
+    struct readahead_run runs[READAHEAD_QUEUE_SIZE];  /* Ring of pending runs. */
+    size_t head;                              /* Index of oldest request. */
+    size_t cnt;                               /* Number of pending requests. */
+    bool busy;                                /* True while a prefetch runs. */
+  } readahead;
+
+/* Sectors saved by the last cache_close() that cache_prewarm()
+   left for the read-ahead thread, in sector order.  It reads them
+   only while READAHEAD has no runs queued.  Guarded by
+   READAHEAD's lock. */
+static struct
+  {
+    block_sector_t *sectors;                  /* The sectors, or null. */
+    size_t cnt;                               /* Number of SECTORS. */
+    size_t next;                              /* First not yet read. */
+  } prewarm;
+
+/* The hot set as saved on disk, at HOTSET_SECTOR. */
+#define HOTSET_MAGIC 0x484f5453               /* "HOTS". */
+#define HOTSET_MAX ((HOTSET_SECTORS * BLOCK_SECTOR_SIZE) \
+                    / sizeof (block_sector_t) - 2)
+struct hotset
+  {
+    uint32_t magic;                           /* HOTSET_MAGIC. */
+    uint32_t cnt;                             /* Sectors in SECTORS. */
+    block_sector_t sectors[HOTSET_MAX];       /* Most recently used first. */
+  };
+
+/* Most consecutive sectors the read-ahead thread reads with one
+   request, staged through READAHEAD_BUF. */
+#define READAHEAD_RUN 8
+static uint8_t readahead_buf[READAHEAD_RUN * BLOCK_SECTOR_SIZE];
+
+/* How often the write-behind thread flushes dirty blocks. */
+#define WRITE_BEHIND_TICKS (5 * TIMER_FREQ)
+
+/* The read-ahead and write-behind threads are real-time threads,
+   so that background I/O keeps pace however many processes are
+   runnable: each may run IO_THREAD_BUDGET of every
+   IO_THREAD_PERIOD ticks ahead of them. */
+#define IO_THREAD_PERIOD (TIMER_FREQ / 10)
+#define IO_THREAD_BUDGET 2
+
+/* Serializes write-behind passes against each other and against
+   cache_close(). */
+static struct lock writeback_lock;
+
+/* Most consecutive sectors a write-behind pass writes with one
+   request, staged through WRITEBACK_BUF. */
+#define WRITEBACK_RUN 8
+static uint8_t writeback_buf[WRITEBACK_RUN * BLOCK_SECTOR_SIZE];
+
+/* Staging area for the images of a journal transaction, and
+   their home sectors.  Guarded by writeback_lock. */
+#define JOURNAL_BUF_PAGES DIV_ROUND_UP (JOURNAL_CAPACITY * BLOCK_SECTOR_SIZE, PGSIZE)
+static uint8_t *journal_buf;
+static block_sector_t journal_homes[JOURNAL_CAPACITY];
+static struct cache_block *journal_blocks[JOURNAL_CAPACITY];
+
+/* Clock steps eviction takes looking for a victim that is not
+   dirty metadata, in units of the cache size, before it settles
+   for one. */
+#define META_EVICT_PASSES 3
+
+/* Shares of the cache 2Q gives to A1IN, as blocks, and to the
+   ghosts of sectors evicted from it, as sector numbers. */
+#define A1IN_SHARE(SIZE) ((SIZE) / 4 > 0 ? (SIZE) / 4 : 1)
+#define GHOST_SHARE(SIZE) ((SIZE) / 2 > 0 ? (SIZE) / 2 : 1)
+
+/* A sector lately evicted from 2Q's A1IN queue. */
+struct cache_ghost
+  {
+    block_sector_t sector;              /* The sector. */
+    bool in_use;                        /* True if in the ghost index. */
+    struct hash_elem elem;              /* Element in the ghost index. */
+  };
+
+/* A dirty block noted by a write-behind pass. */
+struct writeback_entry
+  {
+    block_sector_t sector;              /* Sector the block held when noted. */
+    struct cache_block *block;          /* The block itself. */
+  };
+
+/* Number of cache blocks cache_init() allocates. */
+size_t cache_block_cnt = CACHE_SIZE;
+
+/* Replacement policy. */
+enum cache_policy cache_policy = CACHE_POLICY_2Q;
+
+static struct cache_block *cache_fetch (block_sector_t sector, bool exclusive,
+                                        enum fs_class class);
+static struct cache_block *cache_fill (block_sector_t sector, enum fs_class class);
+static void cache_prefetch (block_sector_t start, size_t cnt);
+static bool cache_contains (block_sector_t sector);
+static inline void cache_count (uint64_t *counter, uint64_t n);
+static thread_func readahead_thread NO_RETURN;
+static thread_func write_behind_thread NO_RETURN;
+static int writeback_entry_cmp (const void *a, const void *b);
+static int sector_cmp (const void *a, const void *b);
+static void hotset_save (void);
+static void writeback_run (struct cache_block **run, size_t cnt);
+static void commit_metadata (void);
+static struct cache_block *evict_clock (void);
+static struct cache_block *evict_2q (void);
+static struct cache_block *evict_a1in (size_t *steps);
+static struct cache_block *evict_am (size_t *steps);
+static bool evictable (const struct cache_block *block, size_t steps);
+static void evict_block (struct cache_block *block);
+static void cache_admit (struct cache_block *block, enum fs_class class);
+static void ghost_add (block_sector_t sector);
+static hash_hash_func cache_block_hash;
+static hash_less_func cache_block_less;
+static hash_hash_func cache_ghost_hash;
+static hash_less_func cache_ghost_less;
+
 /* Initialize memory cache */
 void cache_init(void) {
   /* Allocate a memory cache on heap for current thread/process */
   memory_cache = (struct cache*) malloc(sizeof(struct cache));
+  if (memory_cache == NULL)
+    PANIC ("buffer cache allocation failed");
   memory_cache->clock_ptr = 0;
-  lock_init(&memory_cache->l);
 
-  int i;
-  for (i = 0; i < CACHE_SIZE; i++) {
+  /* Back the blocks with whole pages so the cache can grow well
+     past what the kernel heap comfortably hands out. */
+  ASSERT (cache_block_cnt > 0);
+  memory_cache->size = cache_block_cnt;
+  memory_cache->page_cnt = DIV_ROUND_UP (cache_block_cnt * sizeof (struct cache_block),
+                                         PGSIZE);
+  memory_cache->blocks = palloc_get_multiple (0, memory_cache->page_cnt);
+  if (memory_cache->blocks == NULL)
+    PANIC ("buffer cache of %zu blocks does not fit in kernel pool", cache_block_cnt);
+  lock_init_adaptive(&memory_cache->l);
+  lock_set_name(&memory_cache->l, "cache");
+  if (!hash_init_fixed(&memory_cache->index, cache_block_hash, cache_block_less,
+                       NULL, memory_cache->size))
+    PANIC ("buffer cache index creation failed");
+
+  list_init(&memory_cache->free);
+  list_init(&memory_cache->a1in);
+  list_init(&memory_cache->am);
+  memory_cache->a1in_cnt = 0;
+  memory_cache->a1in_max = A1IN_SHARE(memory_cache->size);
+  memory_cache->ghost_cnt = GHOST_SHARE(memory_cache->size);
+  memory_cache->ghost_next = 0;
+  memory_cache->ghosts = calloc(memory_cache->ghost_cnt, sizeof *memory_cache->ghosts);
+  if (memory_cache->ghosts == NULL
+      || !hash_init_fixed(&memory_cache->ghost_index, cache_ghost_hash, cache_ghost_less,
+                          NULL, memory_cache->ghost_cnt))
+    PANIC ("buffer cache ghost list creation failed");
+
+  size_t i;
+  for (i = 0; i < memory_cache->size; i++) {
     cache_block_init(&memory_cache->blocks[i]);
+    list_push_back(&memory_cache->free, &memory_cache->blocks[i].queue_elem);
+  }
+  memset(&memory_cache->stats, 0, sizeof memory_cache->stats);
+
+  /* The read-ahead and write-behind threads outlive
+     cache_close()/cache_init() pairs, so only start them the
+     first time through. */
+  static bool threads_started;
+  if (!threads_started) {
+    lock_init(&readahead.l);
+    cond_init(&readahead.not_empty);
+    cond_init(&readahead.idle);
+    readahead.head = readahead.cnt = 0;
+    readahead.busy = false;
+    thread_create_rt("cache-readahead", IO_THREAD_PERIOD, IO_THREAD_BUDGET,
+                     readahead_thread, NULL);
+
+    lock_init(&writeback_lock);
+    lock_set_name(&writeback_lock, "cache-writeback");
+    journal_buf = palloc_get_multiple(PAL_ASSERT, JOURNAL_BUF_PAGES);
+    thread_create_rt("cache-flusher", IO_THREAD_PERIOD, IO_THREAD_BUDGET,
+                     write_behind_thread, NULL);
+    threads_started = true;
   }
-  memory_cache->cache_hits = 0;
-  memory_cache->cache_tries = 0;
-  memory_cache->disk_reads = 0;
-  memory_cache->disk_writes = 0;
 }
 
 /* Initialize cache block BLOCK */
@@ -32,9 +221,13 @@ void cache_block_init(struct cache_block *block) {
   block->used = false;
   block->valid = false;
   block->dirty = false;
+  block->prefetched = false;
+  block->meta = false;
+  block->class = FS_CLASS_FILE;
+  block->queue = CACHE_QUEUE_FREE;
   
   memset(&block->data, 0, BLOCK_SECTOR_SIZE);
-  lock_init(&block->l);
+  rw_lock_init(&block->l);
 }
 
 
@@ -52,68 +245,65 @@ void cache_block_init(struct cache_block *block) {
 
    Internally synchronizes accesses to cache and block devices, 
    so external cache and per-block device locking is unneeded. */
-off_t cache_read (block_sector_t sector, void *buffer, off_t size, off_t sector_offs)
+off_t cache_read (block_sector_t sector, void *buffer, off_t size, off_t sector_offs,
+                  enum fs_class class)
 { 
     /* Base Case */
     if (sector_offs > BLOCK_SECTOR_SIZE) {
       return 0;
     }
 
-    int i = 0, found_cache = 0;
-    struct cache_block *block;
-
-    /* Lock the memory cache */
-    lock_acquire(&memory_cache->l);
-    memory_cache->cache_tries++;
-
-    /* Check for cache in our memory */
-    for (i = 0; i < CACHE_SIZE; i++) {
-      block = &memory_cache->blocks[i];
-      /* Note for synchronization: 
-          This cache implementation ensures that a block's dirty bit 
-          and sector number can only change when locks on both memory cache and 
-          the block itself are held, so it allows cache replacement policy
-          to be unblocking when looking for a cache block to evict */
-      if (block->valid && block->sector == sector) {
-          lock_acquire(&block->l);
-          found_cache = 1;
-          memory_cache->cache_hits++;
-          break;
-      }
-    }
-
-    /* If not found in cache, evict a cache block and allocate  */
-    /* a new cache slot and fetch in the new cache block */
-    if (!found_cache) {
-      block = evict_cache();
-      /* Free the memory cache so others can use it */
-      lock_release(&memory_cache->l);
-
-      block->sector = sector;
-
-      block->valid = true;
-      block->dirty = false;
-
-      block_read (fs_device, sector, block->data);
-      memory_cache->disk_reads++;
-    } else {
-      /* Free the memory cache so others can use it */
-      lock_release(&memory_cache->l);
-    }
+    struct cache_block *block = cache_get (sector, CACHE_READ, class);
 
     /* Read in the data from the cache block */
     off_t sector_left = BLOCK_SECTOR_SIZE - sector_offs;
     off_t bytes_read = sector_left > size ? size : sector_left;
 
     memcpy(buffer, block->data + sector_offs, bytes_read);
-    block->used = true;
 
     /* Release lock on cache block */
-    lock_release(&block->l);
+    cache_put(block);
 
     return bytes_read;
 }
 
+/* Reads the CNT sectors starting at START into BUFFER, copying
+   those in the cache and reading each stretch of the others from
+   disk with one request.  A sector missing from the index under
+   the memory cache lock is up to date on disk, since a dirty
+   block is written back before it leaves the index; the caller
+   keeps writers of the sectors away for the rest. */
+void
+cache_read_direct (block_sector_t start, size_t cnt, void *buffer_,
+                   enum fs_class class)
+{
+    uint8_t *buffer = buffer_;
+
+    while (cnt > 0) {
+      size_t n = 0;
+
+      lock_acquire(&memory_cache->l);
+      while (n < cnt && !cache_contains(start + n)) {
+        n++;
+      }
+      lock_release(&memory_cache->l);
+
+      if (n == 0) {
+        cache_read(start, buffer, BLOCK_SECTOR_SIZE, 0, class);
+        n = 1;
+      } else {
+        cache_count(&memory_cache->stats.class_misses[class], n);
+        thread_usage(thread_current())->cache_misses += n;
+        block_read_multiple (fs_device, start, n, buffer);
+        cache_count(&memory_cache->stats.disk_reads, n);
+      }
+
+      start += n;
+      cnt -= n;
+      buffer += n * BLOCK_SECTOR_SIZE;
+    }
+}
+
 /* Writes SIZE bytes to disk sector SECTOR from BUFFER, starting at 
    position SECTOR_OFFS of disk sector SECTOR.
 
@@ -128,7 +318,8 @@ off_t cache_read (block_sector_t sector, void *buffer, off_t size, off_t sector_
 
    Internally synchronizes accesses to cache and block devices, 
    so external cache and per-block device locking is unneeded. */
-off_t cache_write (block_sector_t sector, const void *buffer, off_t size, off_t sector_offs)
+off_t cache_write (block_sector_t sector, const void *buffer, off_t size, off_t sector_offs,
+                   enum fs_class class)
 {   
 
     /* Base Case */
@@ -136,62 +327,427 @@ off_t cache_write (block_sector_t sector, const void *buffer, off_t size, off_t
       return 0;
     }
 
-    int i = 0, found_cache = 0;
+    struct cache_block *block = cache_get (sector, CACHE_WRITE, class);
+
+    /* Write the data into the cache block */
+    off_t sector_left = BLOCK_SECTOR_SIZE - sector_offs;
+    off_t bytes_written = sector_left > size ? size : sector_left;
+
+    memcpy(block->data + sector_offs, buffer, bytes_written);
+
+    /* Release lock on cache block */
+    cache_put(block);
+
+
+    return bytes_written;
+}
+
+/* Pins the cache block holding sector SECTOR for access in
+   MODE.  See cache.h for details. */
+struct cache_block *
+cache_get (block_sector_t sector, enum cache_mode mode, enum fs_class class)
+{
+  struct cache_block *block = cache_fetch (sector, mode == CACHE_WRITE, class);
+  if (mode == CACHE_WRITE && class != FS_CLASS_FILE)
+    block->meta = true;
+  return block;
+}
+
+/* Adds N to statistics counter *COUNTER.  A 64-bit add is two
+   instructions here, so it is done with interrupts off, which
+   makes it atomic on this uniprocessor without taking the memory
+   cache lock, and lets cache_get_stats() see every counter at
+   one instant. */
+static inline void
+cache_count (uint64_t *counter, uint64_t n)
+{
+  enum intr_level old_level = intr_disable ();
+  *counter += n;
+  intr_set_level (old_level);
+}
+
+/* Copies a consistent snapshot of the cache statistics to
+   STATS, summing the per-class lookups into metadata and data. */
+void
+cache_get_stats (struct fs_stats *stats)
+{
+  enum intr_level old_level = intr_disable ();
+  *stats = memory_cache->stats;
+  intr_set_level (old_level);
+
+  int c;
+  stats->meta_hits = stats->meta_misses = 0;
+  for (c = 0; c < FS_CLASS_CNT; c++)
+    if (c != FS_CLASS_FILE) {
+      stats->meta_hits += stats->class_hits[c];
+      stats->meta_misses += stats->class_misses[c];
+    }
+  stats->data_hits = stats->class_hits[FS_CLASS_FILE];
+  stats->data_misses = stats->class_misses[FS_CLASS_FILE];
+}
+
+/* Releases BLOCK, pinned by cache_get(). */
+void
+cache_put (struct cache_block *block)
+{
+  block->used = true;
+  if (rw_lock_held_for_write (&block->l)) {
+    block->dirty = true;
+    rw_lock_release_write (&block->l);
+  } else {
+    rw_lock_release_read (&block->l);
+  }
+}
+
+/* Returns the cache block holding sector SECTOR, with the block's
+   lock held by the caller: for writing if EXCLUSIVE, otherwise
+   for reading.
+
+   A hit is resolved through the sector index, so the memory cache
+   lock is only held for the hash lookup.  Because a block's sector
+   can only change while both the memory cache lock and the block
+   lock are held, the block is checked again once its lock is
+   acquired and the lookup retried if it has been evicted in the
+   meantime.
+
+   On a miss, a block is evicted, indexed under SECTOR before the
+   memory cache lock is released, and then filled from disk.  Other
+   threads that find the block in the index wait on its lock until
+   the read completes.
+
+   The lookup is counted once, as a hit or a miss for CLASS. */
+static struct cache_block *
+cache_fetch (block_sector_t sector, bool exclusive, enum fs_class class)
+{
+    struct cache_block key;
     struct cache_block *block;
+    struct hash_elem *e;
+    bool counted = false;
 
-    /* Lock the memory cache */
-    lock_acquire(&memory_cache->l);
-    memory_cache->cache_tries++;
+    key.sector = sector;
 
-    /* Check for cache in our memory */
-    for (i = 0; i < CACHE_SIZE; i++) {
-      block = &memory_cache->blocks[i];
-      /* Note for synchronization: 
-          This cache implementation ensures that a block's dirty bit 
-          and sector number can only change when locks on both memory cache and 
-          the block itself are held, so it allows cache replacement policy
-          to be unblocking when looking for a cache block to evict */
-      if (block->valid && block->sector == sector) {
-          lock_acquire(&block->l);
-          found_cache = 1;
-          memory_cache->cache_hits++;
-          break;
+    while (true) {
+      /* Lock the memory cache */
+      lock_acquire(&memory_cache->l);
+
+      e = hash_find(&memory_cache->index, &key.hash_elem);
+      if (e == NULL) {
+        break;
+      }
+
+      block = hash_entry(e, struct cache_block, hash_elem);
+      if (!counted) {
+        cache_count(&memory_cache->stats.class_hits[class], 1);
+        thread_usage(thread_current())->cache_hits++;
+        counted = true;
+      }
+      if (block->prefetched) {
+        block->prefetched = false;
+        cache_count(&memory_cache->stats.readahead_hits, 1);
+      }
+
+      /* Fast path: no conflicting holder, so the block cannot
+         change sectors under us. */
+      if (exclusive ? rw_lock_try_acquire_write(&block->l)
+                    : rw_lock_try_acquire_read(&block->l)) {
+        lock_release(&memory_cache->l);
+        return block;
+      }
+
+      /* Free the memory cache so others can use it while we wait */
+      lock_release(&memory_cache->l);
+      if (exclusive) {
+        rw_lock_acquire_write(&block->l);
+        if (block->valid && block->sector == sector) {
+          return block;
+        }
+        rw_lock_release_write(&block->l);
+      } else {
+        rw_lock_acquire_read(&block->l);
+        if (block->valid && block->sector == sector) {
+          return block;
+        }
+        rw_lock_release_read(&block->l);
       }
     }
 
     /* If not found in cache, evict a cache block and allocate  */
     /* a new cache slot and fetch in the new cache block */
-    if (!found_cache) {
-      block = evict_cache();
-      /* Free the memory cache so others can use it */
-      lock_release(&memory_cache->l);
+    if (!counted) {
+      cache_count(&memory_cache->stats.class_misses[class], 1);
+      thread_usage(thread_current())->cache_misses++;
+    }
+    trace (TRACE_CACHE_MISS, sector, exclusive);
+    block = cache_fill(sector, class);
+    if (!exclusive) {
+      rw_lock_downgrade(&block->l);
+    }
+    return block;
+}
+
+/* Evicts a cache block, indexes it under SECTOR and reads SECTOR
+   into it from disk.  Must be called with the memory cache lock
+   held, which is released before the disk read.  Returns the
+   block with its lock held for writing.  CLASS says what the
+   sector holds. */
+static struct cache_block *
+cache_fill (block_sector_t sector, enum fs_class class)
+{
+    struct cache_block *block = evict_cache();
+
+    block->sector = sector;
+    block->valid = true;
+    block->dirty = false;
+    block->meta = false;
+    cache_admit(block, class);
+    hash_insert(&memory_cache->index, &block->hash_elem);
+
+    /* Free the memory cache so others can use it */
+    lock_release(&memory_cache->l);
+
+    block_read (fs_device, sector, block->data);
+    cache_count(&memory_cache->stats.disk_reads, 1);
+
+    return block;
+}
+
+/* Queues sector SECTOR to be read into the cache in the
+   background.  Never blocks on disk I/O; the request is dropped
+   if the read-ahead queue is full. */
+void
+cache_readahead (block_sector_t sector)
+{
+  cache_readahead_run (sector, 1);
+}
+
+/* Queues the CNT sectors starting at START to be read into the
+   cache in the background.  A run that continues the newest
+   pending one is merged into it, so that sequential requests
+   reach the disk as a few large reads.  Never blocks on disk
+   I/O; the request is dropped if the read-ahead queue is full. */
+void
+cache_readahead_run (block_sector_t start, size_t cnt)
+{
+  if (cnt == 0)
+    return;
+
+  lock_acquire(&readahead.l);
+  if (readahead.cnt > 0) {
+    size_t last = (readahead.head + readahead.cnt - 1) % READAHEAD_QUEUE_SIZE;
+    struct readahead_run *run = &readahead.runs[last];
+    if (run->start + run->cnt == start) {
+      run->cnt += cnt;
+      lock_release(&readahead.l);
+      return;
+    }
+  }
+  if (readahead.cnt < READAHEAD_QUEUE_SIZE) {
+    size_t tail = (readahead.head + readahead.cnt) % READAHEAD_QUEUE_SIZE;
+    readahead.runs[tail].start = start;
+    readahead.runs[tail].cnt = cnt;
+    readahead.cnt++;
+    cond_signal(&readahead.not_empty, &readahead.l);
+  }
+  lock_release(&readahead.l);
+}
+
+/* Returns true if sector SECTOR is in the cache index.  The
+   memory cache lock must be held. */
+static bool
+cache_contains (block_sector_t sector)
+{
+  struct cache_block key;
+
+  key.sector = sector;
+  return hash_find(&memory_cache->index, &key.hash_elem) != NULL;
+}
+
+/* Brings the CNT sectors starting at START into the cache,
+   skipping any that are already there.  Each stretch of missing
+   sectors is claimed under the memory cache lock, then read with
+   a single multi-sector request; readers that find a claimed
+   block wait on its lock until the read completes.  Does not
+   count towards the hit statistics, since no caller asked for
+   the data yet. */
+static void
+cache_prefetch (block_sector_t start, size_t cnt)
+{
+  struct cache_block *run[READAHEAD_RUN];
+
+  /* Leave enough unlocked blocks for eviction to make progress. */
+  size_t max_run = memory_cache->size / 2;
+  if (max_run > READAHEAD_RUN)
+    max_run = READAHEAD_RUN;
+  if (max_run == 0)
+    max_run = 1;
 
-      block->sector = sector;
+  while (cnt > 0) {
+    size_t n = 0;
+    size_t i;
 
+    lock_acquire(&memory_cache->l);
+    while (cnt > 0 && cache_contains(start)) {
+      start++;
+      cnt--;
+    }
+    while (n < cnt && n < max_run && !cache_contains(start + n)) {
+      struct cache_block *block = evict_cache();
+      block->sector = start + n;
       block->valid = true;
+      block->dirty = false;
+      block->meta = false;
+      block->prefetched = true;
+      cache_admit(block, FS_CLASS_FILE);
+      hash_insert(&memory_cache->index, &block->hash_elem);
+      run[n++] = block;
+    }
+    lock_release(&memory_cache->l);
+    if (n == 0)
+      break;
+
+    block_read_multiple (fs_device, start, n, readahead_buf);
+    cache_count(&memory_cache->stats.disk_reads, n);
+    cache_count(&memory_cache->stats.readahead_reads, n);
+    for (i = 0; i < n; i++) {
+      memcpy(run[i]->data, readahead_buf + i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+      rw_lock_release_write(&run[i]->l);
+    }
 
-      block_read (fs_device, sector, block->data);
-      memory_cache->disk_reads++;
+    start += n;
+    cnt -= n;
+  }
+}
+
+/* Services read-ahead requests forever, and reads the saved hot
+   set when there are none. */
+static void
+readahead_thread (void *aux UNUSED)
+{
+  for (;;) {
+    struct readahead_run run;
+
+    lock_acquire(&readahead.l);
+    while (readahead.cnt == 0 && prewarm.next == prewarm.cnt) {
+      cond_wait(&readahead.not_empty, &readahead.l);
+    }
+    if (readahead.cnt > 0) {
+      run = readahead.runs[readahead.head];
+      readahead.head = (readahead.head + 1) % READAHEAD_QUEUE_SIZE;
+      readahead.cnt--;
     } else {
-      /* Free the memory cache so others can use it */
-      lock_release(&memory_cache->l);
+      /* Nothing asked for: warm up with the next stretch of the
+         saved hot set. */
+      run.start = prewarm.sectors[prewarm.next++];
+      run.cnt = 1;
+      while (prewarm.next < prewarm.cnt && run.cnt < READAHEAD_RUN
+             && prewarm.sectors[prewarm.next] == run.start + run.cnt) {
+        prewarm.next++;
+        run.cnt++;
+      }
     }
+    readahead.busy = true;
+    lock_release(&readahead.l);
 
+    cache_prefetch(run.start, run.cnt);
 
-    /* Read in the data from the cache block */
-    off_t sector_left = BLOCK_SECTOR_SIZE - sector_offs;
-    off_t bytes_written = sector_left > size ? size : sector_left;
+    lock_acquire(&readahead.l);
+    readahead.busy = false;
+    cond_broadcast(&readahead.idle, &readahead.l);
+    lock_release(&readahead.l);
+  }
+}
 
-    memcpy(block->data + sector_offs, buffer, bytes_written);
-    block->used = true;
-    block->dirty = true;
-    /* Release lock on cache block */
-    lock_release(&block->l);
+/* Reads the hot set the last cache_close() saved and hands it to
+   the read-ahead thread, sorted by sector.  Sectors that no
+   longer look like the file system's are ignored; anything else
+   stale only costs a wasted read. */
+void
+cache_prewarm (void)
+{
+  struct hotset *hs = palloc_get_page (0);
+  block_sector_t *sectors = NULL;
+  size_t cnt = 0;
+  uint32_t i;
 
+  ASSERT (sizeof *hs <= PGSIZE);
+  if (hs == NULL)
+    return;
+  block_read_multiple (fs_device, HOTSET_SECTOR, HOTSET_SECTORS, hs);
+  cache_count(&memory_cache->stats.disk_reads, HOTSET_SECTORS);
+  if (hs->magic == HOTSET_MAGIC && hs->cnt <= HOTSET_MAX && hs->cnt > 0)
+    sectors = malloc (hs->cnt * sizeof *sectors);
+  if (sectors != NULL)
+    for (i = 0; i < hs->cnt; i++)
+      if (hs->sectors[i] >= HOTSET_SECTOR + HOTSET_SECTORS
+          && hs->sectors[i] < block_size (fs_device))
+        sectors[cnt++] = hs->sectors[i];
+  palloc_free_page (hs);
+  if (cnt == 0)
+    {
+      free (sectors);
+      return;
+    }
+  qsort(sectors, cnt, sizeof *sectors, sector_cmp);
 
-    return bytes_written;
+  lock_acquire(&readahead.l);
+  free(prewarm.sectors);
+  prewarm.sectors = sectors;
+  prewarm.cnt = cnt;
+  prewarm.next = 0;
+  cond_signal(&readahead.not_empty, &readahead.l);
+  lock_release(&readahead.l);
 }
 
+/* Adds to SECTORS, which has room for HOTSET_MAX and holds *CNT,
+   the sectors of the valid blocks on LIST, from back to front,
+   whose used bit is USED.  Blocks read ahead but never looked up
+   are left out. */
+static void
+hotset_add_list (struct list *list, bool used, block_sector_t *sectors,
+                 uint32_t *cnt)
+{
+  struct list_elem *e;
+
+  for (e = list_rbegin (list); e != list_rend (list) && *cnt < HOTSET_MAX;
+       e = list_prev (e)) {
+    struct cache_block *block = list_entry (e, struct cache_block, queue_elem);
+    if (block->valid && !block->prefetched && block->used == used)
+      sectors[(*cnt)++] = block->sector;
+  }
+}
+
+/* Writes the sectors the cache holds to the hot set on disk,
+   those recently used first as well as the replacement policy
+   can tell: blocks with the used bit before those without, and
+   under 2Q, the main queue before probation and the newest
+   first within each.  Called by cache_close() once nothing else
+   uses the cache. */
+static void
+hotset_save (void)
+{
+  struct hotset *hs = palloc_get_page (PAL_ZERO);
+  size_t i;
+  int pass;
+
+  if (hs == NULL)
+    return;
+  hs->magic = HOTSET_MAGIC;
+  for (pass = 0; pass < 2; pass++) {
+    bool used = pass == 0;
+    if (cache_policy == CACHE_POLICY_2Q) {
+      hotset_add_list (&memory_cache->am, used, hs->sectors, &hs->cnt);
+      hotset_add_list (&memory_cache->a1in, used, hs->sectors, &hs->cnt);
+    } else {
+      for (i = 0; i < memory_cache->size && hs->cnt < HOTSET_MAX; i++) {
+        struct cache_block *block = &memory_cache->blocks[i];
+        if (block->valid && !block->prefetched && block->used == used)
+          hs->sectors[hs->cnt++] = block->sector;
+      }
+    }
+  }
+  block_write_multiple (fs_device, HOTSET_SECTOR, HOTSET_SECTORS, hs);
+  palloc_free_page (hs);
+}
 
 /* Evict a cache block by the clock replacement algorithm. 
    Flush any changes if the evicted cache is dirty.
@@ -202,69 +758,489 @@ off_t cache_write (block_sector_t sector, const void *buffer, off_t size, off_t
 
    It will keep the lock on the cache block found to help ensure synchronization.
 
+   Dirty metadata is passed over, since it should reach disk by
+   way of the journal, unless META_EVICT_PASSES trips around the
+   cache turn up nothing else.  Then it is written in place.
+
    This function is NOT thread-safe. Need outside synchronization. */
 struct cache_block *evict_cache(void) {
+    return cache_policy == CACHE_POLICY_2Q ? evict_2q() : evict_clock();
+}
+
+/* Picks a victim with a single clock over every block. */
+static struct cache_block *
+evict_clock (void)
+{
     struct cache_block *block = NULL;
+    size_t steps = 0;
 
     while (true) {
       block = &memory_cache->blocks[memory_cache->clock_ptr];
 
       /* Note for synchronization: 
           If any cache block has a lock being held by a process, it implies it's valid and 
-          used, so we don't evict it. We use lock_try_acquire to ensure our cache 
-          replacement policy is nonblocking when looking for a block to evict. */
-      int lock_acquired = lock_try_acquire(&block->l);
+          used, so we don't evict it. A write hold is only granted when there are no 
+          readers either, so blocks being read are skipped as well. We use a try-acquire 
+          to ensure our cache replacement policy is nonblocking when looking for a block 
+          to evict. */
+      int lock_acquired = rw_lock_try_acquire_write(&block->l);
       if (lock_acquired) {
         if (!block->valid) {
           return block;
         } else if (block->used) {
           block->used = false;
-        } else {
-          if (block->dirty) {
-            flush_to_disk(block);
-          } 
+        } else if (evictable(block, steps)) {
+          evict_block(block);
+          return block;
+        }
+        rw_lock_release_write(&block->l);
+      }
+      memory_cache->clock_ptr = (memory_cache->clock_ptr + 1) % memory_cache->size;
+      steps++;
+    }
+}
+
+/* Picks a victim by 2Q.  Blocks never used go first.  After
+   that, a sector seen once sits on the A1IN FIFO and is evicted
+   from it in order, its number remembered as a ghost; only a
+   sector looked up again after that, or metadata, goes on the
+   main AM queue, which is run as a clock.  A1IN is drained first
+   while it is over its share of the cache, so a long sequential
+   read cycles through A1IN and leaves AM alone. */
+static struct cache_block *
+evict_2q (void)
+{
+    struct cache_block *block;
+    size_t steps = 0;
+
+    if (!list_empty(&memory_cache->free)) {
+      block = list_entry(list_pop_front(&memory_cache->free),
+                         struct cache_block, queue_elem);
+      /* Nobody can find a block that holds no sector. */
+      rw_lock_acquire_write(&block->l);
+      return block;
+    }
+
+    while (true) {
+      bool a1in_first = (memory_cache->a1in_cnt > memory_cache->a1in_max
+                         || list_empty(&memory_cache->am));
+
+      block = a1in_first ? evict_a1in(&steps) : evict_am(&steps);
+      if (block == NULL) {
+        block = a1in_first ? evict_am(&steps) : evict_a1in(&steps);
+      }
+      if (block != NULL) {
+        return block;
+      }
+    }
+}
+
+/* Evicts the oldest block on A1IN that can be evicted, leaves a
+   ghost for its sector and returns it locked for writing.
+   Returns a null pointer if there is none.  Adds the blocks
+   looked at to *STEPS. */
+static struct cache_block *
+evict_a1in (size_t *steps)
+{
+    struct list_elem *e;
+
+    for (e = list_begin(&memory_cache->a1in); e != list_end(&memory_cache->a1in);
+         e = list_next(e)) {
+      struct cache_block *block = list_entry(e, struct cache_block, queue_elem);
+
+      (*steps)++;
+      if (rw_lock_try_acquire_write(&block->l)) {
+        if (evictable(block, *steps)) {
+          ghost_add(block->sector);
+          evict_block(block);
+          return block;
+        }
+        rw_lock_release_write(&block->l);
+      }
+    }
+    return NULL;
+}
+
+/* Runs the clock over AM, from its front, once around, and
+   returns the first block found that is neither recently used
+   nor pinned, evicted and locked for writing.  Until the clock
+   has gone once around the whole cache, metadata is passed over
+   like a recently used block, so file data leaves AM first.
+   Returns a null pointer if no block qualifies.  Adds the blocks
+   looked at to *STEPS. */
+static struct cache_block *
+evict_am (size_t *steps)
+{
+    size_t n = list_size(&memory_cache->am);
+
+    while (n-- > 0) {
+      struct cache_block *block = list_entry(list_front(&memory_cache->am),
+                                             struct cache_block, queue_elem);
+
+      (*steps)++;
+      if (rw_lock_try_acquire_write(&block->l)) {
+        if (block->used) {
+          block->used = false;
+        } else if (block->class != FS_CLASS_FILE && *steps <= memory_cache->size) {
+          /* Metadata gets another lap. */
+        } else if (evictable(block, *steps)) {
+          evict_block(block);
           return block;
         }
-        lock_release(&block->l);
+        rw_lock_release_write(&block->l);
+      }
+      list_push_back(&memory_cache->am, list_pop_front(&memory_cache->am));
+    }
+    return NULL;
+}
+
+/* Returns true if BLOCK, locked for writing, may be evicted
+   after STEPS blocks have been looked at: a dirty metadata block
+   only once the search has gone META_EVICT_PASSES times around
+   the cache. */
+static bool
+evictable (const struct cache_block *block, size_t steps)
+{
+    return !(block->dirty && block->meta
+             && steps < META_EVICT_PASSES * memory_cache->size);
+}
+
+/* Evicts valid BLOCK, locked for writing: writes it back if it
+   is dirty, and takes it out of the sector index and its 2Q
+   queue. */
+static void
+evict_block (struct cache_block *block)
+{
+    cache_count(&memory_cache->stats.evictions, 1);
+    if (block->dirty) {
+      cache_count(&memory_cache->stats.dirty_evictions, 1);
+      flush_to_disk(block);
+    } 
+    hash_delete(&memory_cache->index, &block->hash_elem);
+    if (block->queue != CACHE_QUEUE_FREE) {
+      list_remove(&block->queue_elem);
+      if (block->queue == CACHE_QUEUE_A1IN) {
+        memory_cache->a1in_cnt--;
       }
-      memory_cache->clock_ptr = (memory_cache->clock_ptr + 1) % CACHE_SIZE;
+      block->queue = CACHE_QUEUE_FREE;
     }
+    block->valid = false;
+    block->prefetched = false;
+}
+
+/* Puts BLOCK, just evicted and assigned its new sector, on the
+   2Q queue it belongs on: AM for metadata, whose blocks are
+   looked up again and again, and for a sector evicted from A1IN
+   lately enough that its ghost remains; A1IN otherwise.  CLASS
+   says what the sector holds.  Must be called with the memory
+   cache lock held. */
+static void
+cache_admit (struct cache_block *block, enum fs_class class)
+{
+    struct cache_ghost key;
+    struct hash_elem *e;
+
+    block->class = class;
+    if (cache_policy != CACHE_POLICY_2Q) {
+      return;
+    }
+
+    key.sector = block->sector;
+    e = hash_delete(&memory_cache->ghost_index, &key.elem);
+    if (e != NULL) {
+      hash_entry(e, struct cache_ghost, elem)->in_use = false;
+    }
+
+    if (e != NULL || class != FS_CLASS_FILE) {
+      block->queue = CACHE_QUEUE_AM;
+      list_push_back(&memory_cache->am, &block->queue_elem);
+    } else {
+      block->queue = CACHE_QUEUE_A1IN;
+      list_push_back(&memory_cache->a1in, &block->queue_elem);
+      memory_cache->a1in_cnt++;
+    }
+}
+
+/* Remembers that SECTOR was evicted from A1IN, forgetting the
+   oldest such sector if the ghost ring is full. */
+static void
+ghost_add (block_sector_t sector)
+{
+    struct cache_ghost *g = &memory_cache->ghosts[memory_cache->ghost_next];
+
+    if (g->in_use) {
+      hash_delete(&memory_cache->ghost_index, &g->elem);
+    }
+    g->sector = sector;
+    g->in_use = hash_insert(&memory_cache->ghost_index, &g->elem) == NULL;
+    memory_cache->ghost_next = (memory_cache->ghost_next + 1) % memory_cache->ghost_cnt;
 }
 
 
 /* Flush changes in cache BLOCK to disk, if dirty. */
 void flush_to_disk(struct cache_block *block) {
   block_write (fs_device, block->sector, &block->data);
-  memory_cache->disk_writes++;
+  cache_count(&memory_cache->stats.disk_writes, 1);
   block->dirty = false;
+  block->meta = false;
 }
 
 
 /* Flush all changes among all cache blocks to disk, if any. 
    Usually called on system shutdown, or a write behind cache.*/
 void flush_all_cache(void) {
-    int i = 0;
+    size_t i = 0;
     struct cache_block *block;
 
     lock_acquire(&memory_cache->l);
 
-    for (i = 0; i < CACHE_SIZE; i++) {
+    for (i = 0; i < memory_cache->size; i++) {
       block = &memory_cache->blocks[i];
       /*  Note we HAVE to use blocking lock acquire to ensure that any processes 
           that's still using the cache can finish, because it may write things 
-          to the cahce. */
-      lock_acquire(&block->l);
+          to the cahce. Writing back only needs the block to hold still, 
+          so readers can carry on meanwhile. */
+      rw_lock_acquire_read(&block->l);
       if (block->dirty) {
         flush_to_disk(block);
       } 
-      lock_release(&block->l);
+      rw_lock_release_read(&block->l);
     }
 
     lock_release(&memory_cache->l);
 }
 
+/* Writes every dirty cache block back to disk in ascending
+   sector order, holding only read locks on the blocks being
+   written.  Runs of consecutive sectors go out as a single
+   multi-sector write of up to WRITEBACK_RUN sectors.  Blocks that
+   are evicted or reused while the pass runs are skipped, since
+   eviction already flushed them. */
+void
+cache_writeback (void)
+{
+  struct writeback_entry *entries;
+  struct cache_block *run[WRITEBACK_RUN];
+  size_t i, cnt = 0, run_cnt = 0;
+
+  lock_acquire(&writeback_lock);
+  if (memory_cache == NULL) {
+    lock_release(&writeback_lock);
+    return;
+  }
+  commit_metadata();
+
+  entries = malloc(memory_cache->size * sizeof *entries);
+  if (entries == NULL) {
+    /* Out of memory: fall back to flushing in cache order. */
+    flush_all_cache();
+    lock_release(&writeback_lock);
+    return;
+  }
+
+  /* Note the dirty blocks.  These reads are unsynchronized, but
+     each block is checked again under its own lock below. */
+  for (i = 0; i < memory_cache->size; i++) {
+    struct cache_block *block = &memory_cache->blocks[i];
+    if (block->valid && block->dirty) {
+      entries[cnt].sector = block->sector;
+      entries[cnt].block = block;
+      cnt++;
+    }
+  }
+  qsort(entries, cnt, sizeof *entries, writeback_entry_cmp);
+
+  for (i = 0; i < cnt; i++) {
+    struct cache_block *block = entries[i].block;
+
+    /* Write out the run so far unless this block extends it. */
+    if (run_cnt > 0 && (run_cnt == WRITEBACK_RUN
+                        || entries[i].sector != run[0]->sector + run_cnt)) {
+      writeback_run(run, run_cnt);
+      run_cnt = 0;
+    }
+
+    rw_lock_acquire_read(&block->l);
+    if (block->valid && block->dirty && block->sector == entries[i].sector) {
+      run[run_cnt++] = block;
+    } else {
+      rw_lock_release_read(&block->l);
+    }
+  }
+  writeback_run(run, run_cnt);
+
+  free(entries);
+  lock_release(&writeback_lock);
+}
+
+/* Writes the CNT read-locked blocks in RUN, which hold
+   consecutive sectors, to disk with one request, then marks them
+   clean and unlocks them.  Must be called with writeback_lock
+   held, which guards WRITEBACK_BUF. */
+static void
+writeback_run (struct cache_block **run, size_t cnt)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+
+  for (i = 0; i < cnt; i++) {
+    memcpy(writeback_buf + i * BLOCK_SECTOR_SIZE, run[i]->data, BLOCK_SECTOR_SIZE);
+  }
+  block_write_multiple(fs_device, run[0]->sector, cnt, writeback_buf);
+  cache_count(&memory_cache->stats.disk_writes, cnt);
+  cache_count(&memory_cache->stats.flusher_writes, cnt);
+
+  for (i = 0; i < cnt; i++) {
+    run[i]->dirty = false;
+    run[i]->meta = false;
+    rw_lock_release_read(&run[i]->l);
+  }
+}
+
+/* Writes every dirty metadata block home by way of the journal,
+   up to JOURNAL_CAPACITY blocks per transaction: their images go
+   to the journal and are committed, then written in place, then
+   the journal is cleared.  Operations that change metadata are
+   held off meanwhile, so each transaction is a consistent
+   snapshot.  Must be called with writeback_lock held, which
+   guards the journal staging area. */
+static void
+commit_metadata (void)
+{
+  size_t i, next = 0, cnt;
+
+  journal_freeze();
+  do {
+    /* Read-lock dirty metadata blocks, continuing the scan where
+       the last transaction left off. */
+    cnt = 0;
+    for (; next < memory_cache->size && cnt < JOURNAL_CAPACITY; next++) {
+      struct cache_block *block = &memory_cache->blocks[next];
+      if (!(block->valid && block->dirty && block->meta)) {
+        continue;
+      }
+      rw_lock_acquire_read(&block->l);
+      if (block->valid && block->dirty && block->meta) {
+        journal_homes[cnt] = block->sector;
+        memcpy(journal_buf + cnt * BLOCK_SECTOR_SIZE, block->data, BLOCK_SECTOR_SIZE);
+        journal_blocks[cnt++] = block;
+      } else {
+        rw_lock_release_read(&block->l);
+      }
+    }
+    if (cnt == 0) {
+      break;
+    }
+
+    journal_commit(journal_homes, journal_buf, cnt);
+    cache_count(&memory_cache->stats.disk_writes, cnt + 1);
+    for (i = 0; i < cnt; i++) {
+      block_write(fs_device, journal_homes[i], journal_buf + i * BLOCK_SECTOR_SIZE);
+      journal_blocks[i]->dirty = false;
+      journal_blocks[i]->meta = false;
+      rw_lock_release_read(&journal_blocks[i]->l);
+    }
+    cache_count(&memory_cache->stats.disk_writes, cnt);
+    cache_count(&memory_cache->stats.flusher_writes, cnt);
+    journal_clear();
+    cache_count(&memory_cache->stats.disk_writes, 1);
+  } while (next < memory_cache->size);
+  journal_thaw();
+}
+
+/* Orders write-back entries by ascending sector. */
+static int
+writeback_entry_cmp (const void *a_, const void *b_)
+{
+  const struct writeback_entry *a = a_;
+  const struct writeback_entry *b = b_;
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Orders sector numbers ascending. */
+static int
+sector_cmp (const void *a_, const void *b_)
+{
+  const block_sector_t *a = a_;
+  const block_sector_t *b = b_;
+  return *a < *b ? -1 : *a > *b;
+}
+
+/* Periodically writes dirty blocks back to disk, so that
+   eviction usually finds a clean victim and a crash loses at
+   most WRITE_BEHIND_TICKS worth of writes. */
+static void
+write_behind_thread (void *aux UNUSED)
+{
+  for (;;) {
+    timer_sleep(WRITE_BEHIND_TICKS);
+    cache_writeback();
+  }
+}
+
 /* Close the cache by flushing all changes to disk and free the cache heap memory. */
 void cache_close(void) {
+  /* Drop pending read-ahead and wait out any prefetch in flight,
+     keeping the queue locked so nothing new starts while the
+     cache is torn down. */
+  lock_acquire(&readahead.l);
+  readahead.cnt = 0;
+  free(prewarm.sectors);
+  prewarm.sectors = NULL;
+  prewarm.cnt = prewarm.next = 0;
+  while (readahead.busy) {
+    cond_wait(&readahead.idle, &readahead.l);
+  }
+
+  lock_acquire(&writeback_lock);
+  commit_metadata();
   flush_all_cache();
+  hotset_save();
+  hash_destroy(&memory_cache->index, NULL);
+  hash_destroy(&memory_cache->ghost_index, NULL);
+  free(memory_cache->ghosts);
+  palloc_free_multiple(memory_cache->blocks, memory_cache->page_cnt);
   free(memory_cache);
+  memory_cache = NULL;
+  lock_release(&writeback_lock);
+
+  lock_release(&readahead.l);
+}
+
+/* Returns a hash value for the sector held by cache block E. */
+static unsigned
+cache_block_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_block *block = hash_entry (e, struct cache_block, hash_elem);
+  return hash_int (block->sector);
+}
+
+/* Returns true if cache block A holds a lower sector than B. */
+static bool
+cache_block_less (const struct hash_elem *a, const struct hash_elem *b,
+                  void *aux UNUSED)
+{
+  const struct cache_block *block_a = hash_entry (a, struct cache_block, hash_elem);
+  const struct cache_block *block_b = hash_entry (b, struct cache_block, hash_elem);
+  return block_a->sector < block_b->sector;
+}
+
+/* Returns a hash value for the sector of ghost E. */
+static unsigned
+cache_ghost_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_ghost *g = hash_entry (e, struct cache_ghost, elem);
+  return hash_int (g->sector);
+}
+
+/* Returns true if ghost A is of a lower sector than B. */
+static bool
+cache_ghost_less (const struct hash_elem *a, const struct hash_elem *b,
+                  void *aux UNUSED)
+{
+  const struct cache_ghost *ghost_a = hash_entry (a, struct cache_ghost, elem);
+  const struct cache_ghost *ghost_b = hash_entry (b, struct cache_ghost, elem);
+  return ghost_a->sector < ghost_b->sector;
 }
@@ -4,39 +4,128 @@
 #include "filesys/off_t.h"
 #include "devices/block.h"
 #include "threads/synch.h"
+#include <hash.h>
+#include <list.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-#define CACHE_MAX_SIZE 64
+/* Default number of cache blocks.  Overridden at boot by the
+   "-cache=N" kernel command-line option. */
 #define CACHE_SIZE 63
 
+/* What a cached sector holds, as told by whoever asks for it.
+   The first three are file system metadata. */
+enum fs_class
+  {
+    FS_CLASS_INODE,                     /* An inode. */
+    FS_CLASS_INDEX,                     /* An indirect block. */
+    FS_CLASS_DIR,                       /* Directory entries. */
+    FS_CLASS_FILE,                      /* File data. */
+    FS_CLASS_CNT
+  };
+
+/* How evict_cache() picks a victim.  Set by the
+   "-cache-policy=" kernel command-line option. */
+enum cache_policy
+  {
+    CACHE_POLICY_CLOCK,                 /* One clock over every block. */
+    CACHE_POLICY_2Q                     /* 2Q: sectors seen once wait in a
+                                           short FIFO, so a scan cannot
+                                           push out the main queue. */
+  };
+
+/* Which 2Q queue a cache block is on. */
+enum cache_queue
+  {
+    CACHE_QUEUE_FREE,                   /* Unused, not yet holding a sector. */
+    CACHE_QUEUE_A1IN,                   /* Probation: seen once. */
+    CACHE_QUEUE_AM                      /* Main: seen again, or metadata. */
+  };
+
+/* Buffer cache statistics since the cache was last initialized.
+   Sectors read ahead are not counted as lookups. */
+struct fs_stats
+  {
+    uint64_t meta_hits;                 /* Lookups of metadata found cached. */
+    uint64_t meta_misses;               /* Lookups of metadata read from disk. */
+    uint64_t data_hits;                 /* Lookups of file data found cached. */
+    uint64_t data_misses;               /* Lookups of file data read from disk. */
+    uint64_t class_hits[FS_CLASS_CNT];  /* Hits, by what the sector holds. */
+    uint64_t class_misses[FS_CLASS_CNT]; /* Misses, by what the sector holds. */
+    uint64_t evictions;                 /* Valid blocks evicted. */
+    uint64_t dirty_evictions;           /* Of those, blocks written back first. */
+    uint64_t readahead_reads;           /* Sectors read ahead. */
+    uint64_t readahead_hits;            /* Sectors read ahead, later looked up. */
+    uint64_t flusher_writes;            /* Sectors written by write-behind and fsync. */
+    uint64_t disk_reads;                /* All sectors read from disk. */
+    uint64_t disk_writes;               /* All sectors written to disk. */
+  };
+
 struct cache_block {
     block_sector_t sector;              /* Sector number of data block's disk location. */
     
     bool dirty;                         /* True if the cache changes need to flush to disk. */
     bool used;                          /* True if the cache has recently been accessed. */
     bool valid;                         /* True if the cache is valid and is for a sector. */
+    bool prefetched;                    /* True if read ahead and not looked up since. */
+    bool meta;                          /* True if changed as metadata since last
+                                           clean, so it goes home by way of the
+                                           journal. */
+    enum fs_class class;                /* What the sector held when last
+                                           looked up. */
+    enum cache_queue queue;             /* 2Q queue QUEUE_ELEM is on. */
+    struct list_elem queue_elem;        /* Element in that queue. */
     
     uint8_t data[BLOCK_SECTOR_SIZE];    /* The cached data for the data block. */
     
-    struct lock l;                      /* Synchronization primitive for reader/write. */
+    struct rw_lock l;                   /* Shared for readers, exclusive for
+                                           writers and eviction. */
+    struct hash_elem hash_elem;         /* Element in the cache's sector index. */
 };
 
 struct cache {
-    uint8_t clock_ptr;                      /* The current clock pointer. */
-    struct cache_block blocks[CACHE_SIZE];  /* Our buffer cache will not be greater
-                                              than 64 sectors in size. We allow only
-                                              63 cache blocks to account for size of
-                                              cache metadata and other fields. */
+    size_t clock_ptr;                       /* The current clock pointer. */
+    size_t size;                            /* Number of blocks in BLOCKS. */
+    size_t page_cnt;                        /* Pages backing BLOCKS. */
+    struct cache_block *blocks;             /* Cache blocks, allocated with
+                                               palloc_get_multiple() at boot. */
     struct lock l;                          /* Synchronization primitive for clock 
                                                cache replacement policy, etc. */
-    int cache_hits;
-    int cache_tries;                        /* Gather statistics about cache performance. */
-    int disk_reads;
-    int disk_writes;
+    struct hash index;                      /* Maps sector numbers to the valid
+                                               cache blocks holding them. */
+    struct fs_stats stats;                  /* Counted with cache_count(), and
+                                               read with cache_get_stats(). */
+
+    /* 2Q state, guarded by L. */
+    struct list free;                       /* Blocks never used yet. */
+    struct list a1in;                       /* Probation FIFO, oldest first. */
+    struct list am;                         /* Main clock queue, next victim first. */
+    size_t a1in_cnt;                        /* Blocks on A1IN. */
+    size_t a1in_max;                        /* A1IN's target size. */
+    struct cache_ghost *ghosts;             /* Ring of sectors lately evicted
+                                               from A1IN (2Q's A1out). */
+    size_t ghost_cnt;                       /* Slots in GHOSTS. */
+    size_t ghost_next;                      /* Slot the next ghost takes. */
+    struct hash ghost_index;                /* Maps sectors to their ghosts. */
 };
 
+/* How cache_get() pins a block. */
+enum cache_mode
+  {
+    CACHE_READ,                         /* Shared; data must not be modified. */
+    CACHE_WRITE                         /* Exclusive; block is dirtied on put. */
+  };
+
 extern struct cache *memory_cache;
 
+/* Replacement policy.  Set by the "-cache-policy=" kernel
+   command-line option. */
+extern enum cache_policy cache_policy;
+
+/* Number of cache blocks cache_init() allocates.
+   Set by the "-cache=N" kernel command-line option. */
+extern size_t cache_block_cnt;
+
 /* Initialize memory cache */
 void cache_init(void);
 
@@ -56,8 +145,10 @@ void cache_block_init(struct cache_block *block);
    Then, we read from the newly fetched cache for sector SECTOR.
 
    Internally synchronizes accesses to cache and block devices, 
-   so external cache and per-block device locking is unneeded. */
-off_t cache_read (block_sector_t sector, void *buffer, off_t size, off_t sector_offs);
+   so external cache and per-block device locking is unneeded.
+   CLASS says what the sector holds, for the statistics. */
+off_t cache_read (block_sector_t sector, void *buffer, off_t size, off_t sector_offs,
+                  enum fs_class class);
 
 /* Writes SIZE bytes to disk sector SECTOR from BUFFER, starting at 
    position SECTOR_OFFS of disk sector SECTOR.
@@ -72,16 +163,53 @@ off_t cache_read (block_sector_t sector, void *buffer, off_t size, off_t sector_
    Then, we write to the newly fetched cache for sector SECTOR.
 
    Internally synchronizes accesses to cache and block devices, 
-   so external cache and per-block device locking is unneeded. */
-off_t cache_write (block_sector_t sector, const void *buffer, off_t size, off_t sector_offs);
-
-/* Evict a cache block by the clock replacement algorithm. 
+   so external cache and per-block device locking is unneeded.
+   CLASS says what the sector holds, for the statistics. */
+off_t cache_write (block_sector_t sector, const void *buffer, off_t size, off_t sector_offs,
+                   enum fs_class class);
+
+/* Pins the cache block holding sector SECTOR, reading it from
+   disk if needed, and returns it so the caller can access its
+   DATA in place instead of copying it out.  MODE selects shared
+   or exclusive access.  The block cannot be evicted until it is
+   released with cache_put(), and a thread must not pin the same
+   sector twice.  CLASS says what the sector holds. */
+struct cache_block *cache_get (block_sector_t sector, enum cache_mode mode,
+                               enum fs_class class);
+
+/* Releases BLOCK, pinned by cache_get().  A block pinned with
+   CACHE_WRITE is marked dirty. */
+void cache_put (struct cache_block *block);
+
+/* Reads the CNT consecutive sectors starting at START into
+   BUFFER, for a caller that keeps the data itself, such as a
+   page of memory: sectors found in the cache are copied from
+   there, and the rest are read straight from disk without taking
+   up cache blocks.  CLASS says what the sectors hold. */
+void cache_read_direct (block_sector_t start, size_t cnt, void *buffer,
+                        enum fs_class class);
+
+/* Queues sector SECTOR to be read into the cache by the
+   background read-ahead thread.  Returns immediately; the request
+   is dropped if too many are already pending. */
+void cache_readahead (block_sector_t sector);
+
+/* Queues the CNT consecutive sectors starting at START for the
+   read-ahead thread, which reads them with as few multi-sector
+   requests as the cache allows.  Returns immediately; the
+   request may be dropped like cache_readahead()'s. */
+void cache_readahead_run (block_sector_t start, size_t cnt);
+
+/* Evict a cache block by the replacement policy in CACHE_POLICY. 
    Flush any changes if the evicted cache is dirty.
    Return the cache_block that is evicted. 
 
    This method will return the first free cache block if not all
    cache blocks are used and allocated yet, and mark it valid.
 
+   A valid victim is removed from the sector index, so the caller
+   must re-insert the block once it is assigned its new sector.
+
    It will keep the lock on the cache block found to help ensure synchronization.
 
    This function is NOT thread-safe. Need outside synchronization. */
@@ -95,7 +223,23 @@ void flush_to_disk(struct cache_block *block);
    Usually called on system shutdown, or a write behind cache.*/
 void flush_all_cache(void);
 
-/* Close the cache by flushing all changes to disk and free the cache heap memory. */
+/* Write every dirty cache block back to disk in sector order,
+   committing dirty metadata through the journal first.
+   Run periodically by the write-behind thread and on demand by
+   the fsync system call. */
+void cache_writeback (void);
+
+/* Copies a consistent snapshot of the cache statistics to STATS. */
+void cache_get_stats (struct fs_stats *stats);
+
+/* Queues the sectors the cache held at the last clean shutdown,
+   as saved by cache_close(), to be read back in by the read-ahead
+   thread, in sector order, whenever it has nothing else to do. */
+void cache_prewarm (void);
+
+/* Close the cache by flushing all changes to disk and free the cache heap memory.
+   Saves the numbers of the sectors it held first, most recently
+   used first, for cache_prewarm() on the next boot. */
 void cache_close(void);
 
 #endif /* filesys/cache.h */
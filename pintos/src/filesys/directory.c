@@ -2,9 +2,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include <hash.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/tmpfs.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 
 /* A directory. */
@@ -22,6 +26,75 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* Most directories indexed at once.  The least recently used
+   index is dropped to make room for a new one. */
+#define DIR_INDEX_MAX 16
+
+/* In-memory index of a directory's entries, so that lookups,
+   adds and removes do not scan the whole directory.  Built from
+   the on-disk entries the first time the directory is searched,
+   and kept across opens of the directory. */
+struct dir_index
+  {
+    block_sector_t sector;              /* Sector of directory's inode. */
+    struct hash names;                  /* In-use entries, by name. */
+    struct list free_slots;             /* Unused entries. */
+    off_t end;                          /* Offset just past the last entry. */
+    struct list_elem elem;              /* Element in dir_indexes. */
+  };
+
+/* A directory entry slot, as tracked by a dir_index. */
+struct dir_slot
+  {
+    off_t ofs;                          /* Byte offset of entry in directory. */
+    char name[NAME_MAX + 1];            /* Name, if in use. */
+    block_sector_t inode_sector;        /* Inode sector, if in use. */
+    struct hash_elem hash_elem;         /* Element in dir_index's NAMES. */
+    struct list_elem list_elem;         /* Element in dir_index's FREE_SLOTS. */
+  };
+
+/* Directory indexes, most recently used first. */
+static struct list dir_indexes = LIST_INITIALIZER (dir_indexes);
+static size_t dir_index_cnt;
+
+/* Most path components remembered by the lookup cache. */
+#define DCACHE_SIZE 128
+
+/* Lookup cache entry: the result of looking up NAME in the
+   directory whose inode is in sector PARENT.  Remembers misses
+   as well as hits. */
+struct dentry
+  {
+    block_sector_t parent;              /* Sector of directory searched. */
+    char name[NAME_MAX + 1];            /* Name looked up. */
+    block_sector_t child;               /* Inode sector found, or 0 if none. */
+    struct hash_elem hash_elem;         /* Element in dcache. */
+    struct list_elem lru_elem;          /* Element in dcache_lru. */
+  };
+
+/* Lookup cache, with entries ordered most recently used first. */
+static struct hash dcache;
+static struct list dcache_lru = LIST_INITIALIZER (dcache_lru);
+
+/* Guards DIR_INDEXES, the contents of every index and the lookup
+   cache.  Held across the directory write that goes with an
+   update, so that they stay consistent with the disk. */
+static struct lock dir_index_lock;
+
+/* Allocator for `struct dir'. */
+static struct kmem_cache *dir_cache;
+
+static struct dir_index *dir_index_get (const struct dir *);
+static void dir_index_drop (block_sector_t sector);
+static struct dentry *dcache_find (block_sector_t parent, const char *name);
+static void dcache_insert (block_sector_t parent, const char *name,
+                           block_sector_t child);
+static void dcache_forget (block_sector_t parent, const char *name);
+static void dcache_forget_dir (block_sector_t parent);
+static bool tmpfs_remove (struct dir *, const char *name);
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+
 /* Helper function for splitting path names from the project spec.
 
    Extracts a file name part from *SRCP into PART, and updates *SRCP
@@ -29,7 +102,7 @@ struct dir_entry
    if successful, 0 at the end of string, -1 for a too-long file name part. */
 
 static int
-get_next_part (char part[NAME_MAX + 1], char **srcp) {
+get_next_part (char part[NAME_MAX + 1], const char **srcp) {
   const char *src = *srcp;
   char *dst = part;
 
@@ -57,7 +130,7 @@ get_next_part (char part[NAME_MAX + 1], char **srcp) {
 /* Walks the path given and checks if the last entry is
    a directory. If it is, open it and return it. Else,
    return NULL. */
-struct dir *dir_walk_chdir(char *path) {
+struct dir *dir_walk_chdir(const char *path) {
   
   if (path == NULL) {
     return NULL;
@@ -110,7 +183,7 @@ struct dir *dir_walk_chdir(char *path) {
 /* Walks the directory tree according to PATH. 
    On success, return the terminating directory (opened)
    and save the filename to FILENAME. On failure, return NULL. */
-struct dir *dir_walk(char *path, char **filename) {
+struct dir *dir_walk(const char *path, char **filename) {
 
   if (path == NULL || filename == NULL) {
     return NULL;
@@ -170,11 +243,29 @@ struct dir *dir_walk(char *path, char **filename) {
   return cur_dir;
 }
 
+/* Initializes the directory module. */
+void
+dir_init (void)
+{
+  lock_init (&dir_index_lock);
+  lock_set_name (&dir_index_lock, "dir-index");
+  if (!hash_init (&dcache, dentry_hash, dentry_less, NULL))
+    PANIC ("directory lookup cache creation failed");
+  dir_cache = kmem_cache_create ("dir", sizeof (struct dir), NULL);
+  if (dir_cache == NULL)
+    PANIC ("directory cache creation failed");
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt)
 {
+  /* Forget any directory that used to live in SECTOR. */
+  lock_acquire (&dir_index_lock);
+  dir_index_drop (sector);
+  dcache_forget_dir (sector);
+  lock_release (&dir_index_lock);
   return inode_create (sector, entry_cnt * sizeof (struct dir_entry), true);
 }
 
@@ -183,7 +274,7 @@ dir_create (block_sector_t sector, size_t entry_cnt)
 struct dir *
 dir_open (struct inode *inode)
 {
-  struct dir *dir = calloc (1, sizeof *dir);
+  struct dir *dir = kmem_cache_alloc (dir_cache);
   if (inode != NULL && dir != NULL)
     {
       dir->inode = inode;
@@ -193,7 +284,7 @@ dir_open (struct inode *inode)
   else
     {
       inode_close (inode);
-      free (dir);
+      kmem_cache_free (dir_cache, dir);
       return NULL;
     }
 }
@@ -221,7 +312,7 @@ dir_close (struct dir *dir)
   if (dir != NULL)
     {
       inode_close (dir->inode);
-      free (dir);
+      kmem_cache_free (dir_cache, dir);
     }
 }
 
@@ -247,6 +338,31 @@ lookup (const struct dir *dir, const char *name,
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  struct dir_index *index = dir_index_get (dir);
+  if (index != NULL)
+    {
+      struct dir_slot key;
+      struct hash_elem *he;
+
+      if (strlen (name) > NAME_MAX)
+        return false;
+      strlcpy (key.name, name, sizeof key.name);
+      he = hash_find (&index->names, &key.hash_elem);
+      if (he == NULL)
+        return false;
+
+      struct dir_slot *slot = hash_entry (he, struct dir_slot, hash_elem);
+      if (ep != NULL)
+        {
+          ep->inode_sector = slot->inode_sector;
+          strlcpy (ep->name, slot->name, sizeof ep->name);
+          ep->in_use = true;
+        }
+      if (ofsp != NULL)
+        *ofsp = slot->ofs;
+      return true;
+    }
+
   for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e)
     if (e.in_use && !strcmp (name, e.name))
@@ -268,21 +384,73 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode)
 {
-  struct dir_entry e;
-
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
   if(!strcmp(name, ".")){
     *inode = inode_reopen(dir->inode);
   }
-  else if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
   else
-    *inode = NULL;
+    {
+      block_sector_t sector;
+      *inode = dir_lookup_sector (dir, name, &sector) ? inode_open (sector) : NULL;
+    }
 
   return *inode != NULL;
 }
 
+/* Searches DIR for a file with the given NAME, through the lookup
+   cache, and stores the sector of its inode in *SECTOR without
+   opening it.  Returns true if NAME exists, false otherwise. */
+bool
+dir_lookup_sector (const struct dir *dir, const char *name,
+                   block_sector_t *sector)
+{
+  block_sector_t parent;
+  bool cacheable;
+  struct dir_entry e;
+  struct dentry *d;
+  struct tmpfs_node *tmp;
+  bool found;
+
+  ASSERT (dir != NULL);
+  ASSERT (name != NULL);
+  parent = inode_get_inumber (dir->inode);
+  cacheable = !inode_removed (dir->inode);
+  if (!strcmp (name, "."))
+    {
+      *sector = parent;
+      return true;
+    }
+
+  /* A memory-only directory is a hash table already. */
+  tmp = inode_get_tmpfs (dir->inode);
+  if (tmp != NULL)
+    {
+      if (!tmpfs_dir_lookup (tmp, name, sector))
+        return false;
+      *sector = filesys_follow_mount (*sector);
+      return true;
+    }
+
+  lock_acquire (&dir_index_lock);
+  d = cacheable ? dcache_find (parent, name) : NULL;
+  if (d != NULL)
+    {
+      found = d->child != 0;
+      e.inode_sector = d->child;
+    }
+  else
+    {
+      found = lookup (dir, name, &e, NULL);
+      if (cacheable)
+        dcache_insert (parent, name, found ? e.inode_sector : 0);
+    }
+  lock_release (&dir_index_lock);
+  if (found)
+    *sector = filesys_follow_mount (e.inode_sector);
+  return found;
+}
+
 /* Adds a file named NAME to DIR, which must not already contain a
    file by that name.  The file's inode is in sector
    INODE_SECTOR.
@@ -304,21 +472,47 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
     return false;
   }
 
+  if (inode_get_tmpfs (dir->inode) != NULL)
+    return tmpfs_dir_add (inode_get_tmpfs (dir->inode), name, inode_sector);
+
+  lock_acquire (&dir_index_lock);
+
   /* Check that NAME is not in use. */
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (!e.in_use)
-      break;
+  /* With an index, take a known free slot or append.  Nothing
+     changes in the index until the entry is on disk. */
+  struct dir_index *index = dir_index_get (dir);
+  struct dir_slot *slot = NULL;
+  if (index != NULL)
+    {
+      if (!list_empty (&index->free_slots))
+        slot = list_entry (list_front (&index->free_slots),
+                           struct dir_slot, list_elem);
+      else
+        {
+          slot = malloc (sizeof *slot);
+          if (slot == NULL)
+            goto done;
+          slot->ofs = index->end;
+        }
+      ofs = slot->ofs;
+    }
+  else
+    {
+      /* Set OFS to offset of free slot.
+         If there are no free slots, then it will be set to the
+         current end-of-file.
+
+         inode_read_at() will only return a short read at end of file.
+         Otherwise, we'd need to verify that we didn't get a short
+         read due to something intermittent such as low memory. */
+      for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+           ofs += sizeof e)
+        if (!e.in_use)
+          break;
+    }
 
   /* Write slot. */
   e.in_use = true;
@@ -326,7 +520,27 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   e.inode_sector = inode_sector;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
+  if (index != NULL)
+    {
+      bool from_free_list = slot->ofs < index->end;
+      if (success)
+        {
+          if (from_free_list)
+            list_remove (&slot->list_elem);
+          else
+            index->end += sizeof e;
+          strlcpy (slot->name, name, sizeof slot->name);
+          slot->inode_sector = inode_sector;
+          hash_insert (&index->names, &slot->hash_elem);
+        }
+      else if (!from_free_list)
+        free (slot);
+    }
+  if (success)
+    dcache_forget (inode_get_inumber (dir->inode), name);
+
  done:
+  lock_release (&dir_index_lock);
   return success;
 }
 
@@ -344,6 +558,11 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  if (inode_get_tmpfs (dir->inode) != NULL)
+    return tmpfs_remove (dir, name);
+
+  lock_acquire (&dir_index_lock);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -358,11 +577,50 @@ dir_remove (struct dir *dir, const char *name)
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
     goto done;
 
+  /* Move the entry to the free slots, and forget the index of
+     the removed inode in case it was a directory. */
+  struct dir_index *index = dir_index_get (dir);
+  if (index != NULL)
+    {
+      struct dir_slot key;
+      strlcpy (key.name, name, sizeof key.name);
+      struct hash_elem *he = hash_delete (&index->names, &key.hash_elem);
+      if (he != NULL)
+        list_push_front (&index->free_slots,
+                         &hash_entry (he, struct dir_slot, hash_elem)->list_elem);
+    }
+  dir_index_drop (e.inode_sector);
+  dcache_forget (inode_get_inumber (dir->inode), name);
+  dcache_forget_dir (e.inode_sector);
+
   /* Remove inode. */
   inode_remove (inode);
   success = true;
 
  done:
+  lock_release (&dir_index_lock);
+  inode_close (inode);
+  return success;
+}
+
+/* Removes NAME from memory-only directory DIR, as dir_remove().
+   The inode goes away once its last opener closes it. */
+static bool
+tmpfs_remove (struct dir *dir, const char *name)
+{
+  struct tmpfs_node *tmp = inode_get_tmpfs (dir->inode);
+  block_sector_t sector;
+  struct inode *inode;
+  bool success;
+
+  if (!tmpfs_dir_lookup (tmp, name, &sector))
+    return false;
+  inode = inode_open (sector);
+  if (inode == NULL)
+    return false;
+  success = tmpfs_dir_remove (tmp, name);
+  if (success)
+    inode_remove (inode);
   inode_close (inode);
   return success;
 }
@@ -377,6 +635,17 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
   char curr_name[2] = ".\0";
   char parent_name[3] = "..\0";
 
+  if (inode_get_tmpfs (dir->inode) != NULL)
+    {
+      block_sector_t inumber;
+
+      while (tmpfs_dir_next (inode_get_tmpfs (dir->inode), &dir->pos,
+                             name, &inumber))
+        if (strcmp (name, curr_name) && strcmp (name, parent_name))
+          return true;
+      return false;
+    }
+
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e)
     {
       dir->pos += sizeof e;
@@ -389,6 +658,73 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
   return false;
 }
 
+/* Directory entries dir_readdir_batch() reads with each call to
+   inode_read_at(), about two sectors' worth. */
+#define READDIR_CHUNK (2 * BLOCK_SECTOR_SIZE / sizeof (struct dir_entry))
+
+/* Reads up to MAX of the entries in DIR that follow the current
+   position into ENTS, skipping "." and "..", as that many calls
+   to dir_readdir() would, but reading the directory READDIR_CHUNK
+   entries at a time.  Returns the number of entries read, which
+   is less than MAX only at the end of the directory or if memory
+   runs out. */
+size_t
+dir_readdir_batch (struct dir *dir, struct dirent *ents, size_t max)
+{
+  struct dir_entry *chunk;
+  size_t cnt = 0;
+
+  if (inode_get_tmpfs (dir->inode) != NULL)
+    {
+      while (cnt < max
+             && tmpfs_dir_next (inode_get_tmpfs (dir->inode), &dir->pos,
+                                ents[cnt].name, &ents[cnt].inumber))
+        {
+          struct inode *inode;
+
+          if (!strcmp (ents[cnt].name, ".") || !strcmp (ents[cnt].name, ".."))
+            continue;
+          inode = inode_open (ents[cnt].inumber);
+          ents[cnt].is_dir = inode != NULL && inode_isdir (inode);
+          inode_close (inode);
+          cnt++;
+        }
+      return cnt;
+    }
+
+  chunk = malloc (READDIR_CHUNK * sizeof *chunk);
+  if (chunk == NULL)
+    return 0;
+  while (cnt < max)
+    {
+      size_t n = inode_read_at (dir->inode, chunk,
+                                READDIR_CHUNK * sizeof *chunk, dir->pos)
+                 / sizeof *chunk;
+      size_t i;
+
+      if (n == 0)
+        break;
+      for (i = 0; i < n && cnt < max; i++)
+        {
+          const struct dir_entry *e = &chunk[i];
+          struct inode *inode;
+
+          dir->pos += sizeof *e;
+          if (!e->in_use || !strcmp (e->name, ".") || !strcmp (e->name, ".."))
+            continue;
+
+          ents[cnt].inumber = e->inode_sector;
+          strlcpy (ents[cnt].name, e->name, sizeof ents[cnt].name);
+          inode = inode_open (e->inode_sector);
+          ents[cnt].is_dir = inode != NULL && inode_isdir (inode);
+          inode_close (inode);
+          cnt++;
+        }
+    }
+  free (chunk);
+  return cnt;
+}
+
 /* Return true if directory is empty. */
 bool
 dir_empty(struct dir *dir) {
@@ -408,3 +744,250 @@ int dir_get_position(struct dir *dir) {
 void dir_set_position(struct dir *dir, int pos) {
   dir->pos = pos;
 }
+
+/* Directory index. */
+
+static hash_hash_func dir_slot_hash;
+static hash_less_func dir_slot_less;
+static void dir_index_destroy (struct dir_index *);
+
+/* Returns a hash value for the name in dir_slot E. */
+static unsigned
+dir_slot_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_string (hash_entry (e, struct dir_slot, hash_elem)->name);
+}
+
+/* Returns true if dir_slot A's name sorts before B's. */
+static bool
+dir_slot_less (const struct hash_elem *a, const struct hash_elem *b,
+               void *aux UNUSED)
+{
+  return strcmp (hash_entry (a, struct dir_slot, hash_elem)->name,
+                 hash_entry (b, struct dir_slot, hash_elem)->name) < 0;
+}
+
+/* Frees dir_slot E. */
+static void
+dir_slot_free (struct hash_elem *e, void *aux UNUSED)
+{
+  free (hash_entry (e, struct dir_slot, hash_elem));
+}
+
+/* Returns the index for DIR, building it from DIR's entries if
+   it is not indexed yet.  Returns a null pointer if memory runs
+   out, in which case callers fall back to scanning DIR.
+   dir_index_lock must be held. */
+static struct dir_index *
+dir_index_get (const struct dir *dir)
+{
+  block_sector_t sector = inode_get_inumber (dir->inode);
+  struct dir_index *index;
+  struct list_elem *le;
+  struct dir_entry e;
+  off_t ofs;
+
+  /* A removed directory's sector may be reused by a plain file
+     before the last opener goes away, so never index one. */
+  if (inode_removed (dir->inode))
+    return NULL;
+
+  for (le = list_begin (&dir_indexes); le != list_end (&dir_indexes);
+       le = list_next (le))
+    {
+      index = list_entry (le, struct dir_index, elem);
+      if (index->sector == sector)
+        {
+          list_remove (le);
+          list_push_front (&dir_indexes, le);
+          return index;
+        }
+    }
+
+  index = malloc (sizeof *index);
+  if (index == NULL)
+    return NULL;
+  if (!hash_init (&index->names, dir_slot_hash, dir_slot_less, NULL))
+    {
+      free (index);
+      return NULL;
+    }
+  index->sector = sector;
+  list_init (&index->free_slots);
+
+  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e)
+    {
+      struct dir_slot *slot = malloc (sizeof *slot);
+      if (slot == NULL)
+        {
+          dir_index_destroy (index);
+          return NULL;
+        }
+      slot->ofs = ofs;
+      if (e.in_use)
+        {
+          strlcpy (slot->name, e.name, sizeof slot->name);
+          slot->inode_sector = e.inode_sector;
+          hash_insert (&index->names, &slot->hash_elem);
+        }
+      else
+        list_push_back (&index->free_slots, &slot->list_elem);
+    }
+  index->end = ofs;
+
+  if (dir_index_cnt >= DIR_INDEX_MAX)
+    {
+      struct dir_index *victim = list_entry (list_back (&dir_indexes),
+                                             struct dir_index, elem);
+      list_remove (&victim->elem);
+      dir_index_cnt--;
+      dir_index_destroy (victim);
+    }
+  list_push_front (&dir_indexes, &index->elem);
+  dir_index_cnt++;
+  return index;
+}
+
+/* Forgets the index of the directory in SECTOR, if there is one.
+   dir_index_lock must be held. */
+static void
+dir_index_drop (block_sector_t sector)
+{
+  struct list_elem *le;
+
+  for (le = list_begin (&dir_indexes); le != list_end (&dir_indexes);
+       le = list_next (le))
+    {
+      struct dir_index *index = list_entry (le, struct dir_index, elem);
+      if (index->sector == sector)
+        {
+          list_remove (le);
+          dir_index_cnt--;
+          dir_index_destroy (index);
+          return;
+        }
+    }
+}
+
+/* Frees INDEX, which must not be in dir_indexes. */
+static void
+dir_index_destroy (struct dir_index *index)
+{
+  while (!list_empty (&index->free_slots))
+    free (list_entry (list_pop_front (&index->free_slots),
+                      struct dir_slot, list_elem));
+  hash_destroy (&index->names, dir_slot_free);
+  free (index);
+}
+
+/* Path lookup cache. */
+
+/* Returns a hash value for dentry E's parent and name. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->parent);
+}
+
+/* Returns true if dentry A sorts before dentry B. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  return strcmp (a->name, b->name) < 0;
+}
+
+/* Returns the cached result of looking up NAME in the directory
+   in sector PARENT, or a null pointer if there is none.
+   dir_index_lock must be held. */
+static struct dentry *
+dcache_find (block_sector_t parent, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.parent = parent;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dcache, &key.hash_elem);
+  if (e == NULL)
+    return NULL;
+
+  struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  list_remove (&d->lru_elem);
+  list_push_front (&dcache_lru, &d->lru_elem);
+  return d;
+}
+
+/* Remembers that looking up NAME in the directory in sector
+   PARENT found the inode in sector CHILD, or nothing if CHILD is
+   0.  Recycles the least recently used entry once the cache is
+   full.  dir_index_lock must be held. */
+static void
+dcache_insert (block_sector_t parent, const char *name, block_sector_t child)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  if (hash_size (&dcache) >= DCACHE_SIZE)
+    {
+      d = list_entry (list_pop_back (&dcache_lru), struct dentry, lru_elem);
+      hash_delete (&dcache, &d->hash_elem);
+    }
+  else
+    {
+      d = malloc (sizeof *d);
+      if (d == NULL)
+        return;
+    }
+
+  d->parent = parent;
+  strlcpy (d->name, name, sizeof d->name);
+  d->child = child;
+  hash_insert (&dcache, &d->hash_elem);
+  list_push_front (&dcache_lru, &d->lru_elem);
+}
+
+/* Forgets any cached lookup of NAME in the directory in sector
+   PARENT.  dir_index_lock must be held. */
+static void
+dcache_forget (block_sector_t parent, const char *name)
+{
+  struct dentry *d = dcache_find (parent, name);
+  if (d != NULL)
+    {
+      hash_delete (&dcache, &d->hash_elem);
+      list_remove (&d->lru_elem);
+      free (d);
+    }
+}
+
+/* Forgets every cached lookup in the directory in sector PARENT,
+   whose sector is about to be freed or reused.
+   dir_index_lock must be held. */
+static void
+dcache_forget_dir (block_sector_t parent)
+{
+  struct list_elem *e = list_begin (&dcache_lru);
+
+  while (e != list_end (&dcache_lru))
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      e = list_next (e);
+      if (d->parent == parent)
+        {
+          hash_delete (&dcache, &d->hash_elem);
+          list_remove (&d->lru_elem);
+          free (d);
+        }
+    }
+}
@@ -13,7 +13,17 @@
 
 struct inode;
 
+/* One entry read by dir_readdir_batch(), laid out as in the user
+   library's <syscall.h>. */
+struct dirent
+  {
+    block_sector_t inumber;             /* Sector of the entry's inode. */
+    bool is_dir;                        /* True if the entry is a directory. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+  };
+
 /* Opening and closing directories. */
+void dir_init (void);
 bool dir_create (block_sector_t sector, size_t entry_cnt);
 struct dir *dir_open (struct inode *);
 struct dir *dir_open_root (void);
@@ -23,21 +33,24 @@ struct inode *dir_get_inode (struct dir *);
 
 /* Reading and writing. */
 bool dir_lookup (const struct dir *, const char *name, struct inode **);
+bool dir_lookup_sector (const struct dir *, const char *name,
+                        block_sector_t *);
 bool dir_add (struct dir *, const char *name, block_sector_t);
 bool dir_remove (struct dir *, const char *name);
 bool dir_readdir (struct dir *, char name[NAME_MAX + 1]);
+size_t dir_readdir_batch (struct dir *, struct dirent *, size_t max);
 
 /* Part 3 */
 
 /* Walks the directory tree according to PATH. 
    On success, return the terminating directory (opened)
    and save the filename to FILENAME. On failure, return NULL */
-struct dir *dir_walk(char *path, char **filename);
+struct dir *dir_walk(const char *path, char **filename);
 
 /* Walks the path given and checks if the last entry is
    a directory. If it is, open it and return it. Else,
    return NULL. */
-struct dir *dir_walk_chdir(char *path);
+struct dir *dir_walk_chdir(const char *path);
 
 /* Return true if directory is empty. */
 bool dir_empty(struct dir *dir);
@@ -2,10 +2,14 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "filesys/directory.h"
+#include "filesys/tmpfs.h"
+#include "threads/malloc.h"
 #include "threads/thread.h"
 
 #define READDIR_MAX_LEN 14
@@ -13,7 +17,26 @@
 /* Partition that contains the file system. */
 struct block *fs_device;
 
+/* Most memory-only file systems mounted at once. */
+#define MOUNT_MAX 4
+
+/* A memory-only file system mounted over a directory on disk.
+   Looking up the directory finds the root of the mounted file
+   system instead.  Mounts are only made while booting, so the
+   table is read without locking. */
+struct mount
+  {
+    block_sector_t covered;             /* Inode sector of the directory. */
+    block_sector_t root;                /* Inode number of the root. */
+  };
+static struct mount mounts[MOUNT_MAX];
+static size_t mount_cnt;
+
 static void do_format (void);
+static bool create_inode (struct dir *, off_t initial_size, bool is_dir,
+                          block_sector_t *);
+static bool is_mount_root (block_sector_t);
+static int defrag_tree (struct inode *);
 
 /* Initializes the file system module.
    If FORMAT is true, reformats the file system. */
@@ -24,13 +47,30 @@ filesys_init (bool format)
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  /* Put any metadata a crash left in the journal in place before
+     anything else is read. */
+  journal_init (format);
   inode_init ();
   free_map_init ();
+  file_init ();
+  dir_init ();
+  tmpfs_init ();
 
   if (format)
     do_format ();
 
   free_map_open ();
+
+  /* Keep creating inodes in the format the disk was made with. */
+  if (!format)
+    {
+      struct inode *root = inode_open (ROOT_DIR_SECTOR);
+      if (root == NULL)
+        PANIC ("can't open root directory");
+      inode_use_extents = inode_has_extents (root);
+      inode_close (root);
+      cache_prewarm ();
+    }
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -38,6 +78,7 @@ filesys_init (bool format)
 void
 filesys_done (void)
 {
+  inode_flush_all ();
   free_map_close ();
   cache_close();
 }
@@ -55,11 +96,11 @@ filesys_create (const char *name, off_t initial_size, bool is_dir)
   char *filename = NULL;
   struct dir *dir = dir_walk(path, &filename);
 
+  journal_begin ();
   bool success;
   if (is_dir) {
     success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && dir_create (inode_sector, 2) 
+                  && create_inode (dir, 0, true, &inode_sector)
                   && dir_add (dir, filename, inode_sector));
     if (success) {
       // Initialize two entries
@@ -73,15 +114,20 @@ filesys_create (const char *name, off_t initial_size, bool is_dir)
     }
   } else {
     success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size, false)
+                  && create_inode (dir, initial_size, false, &inode_sector)
                   && dir_add (dir, filename, inode_sector));
   }
 
   if (!success && inode_sector != 0)
-    free_map_release (inode_sector, 1);
+    {
+      if (tmpfs_owns (inode_sector))
+        tmpfs_delete (inode_sector);
+      else
+        free_map_release (inode_sector, 1);
+    }
 
   dir_close (dir);
+  journal_end ();
 
   return success;
 }
@@ -120,6 +166,90 @@ filesys_open (const char *name)
   return file_open (inode);
 }
 
+/* Defragments the file named NAME with inode_defrag(), or, if it
+   is a directory, every file in the tree below it.  Returns the
+   number of files moved, or -1 if NAME does not exist. */
+int
+filesys_defrag (const char *name)
+{
+  struct file *file = filesys_open (name);
+  struct inode *inode;
+
+  if (file == NULL)
+    return -1;
+  inode = inode_reopen (file_get_inode (file));
+  file_close (file);
+  return defrag_tree (inode);
+}
+
+/* Entries defrag_tree() reads from a directory at a time. */
+#define DEFRAG_BATCH 8
+
+/* Defragments INODE, or the files in the tree below it if it is a
+   directory, and closes it.  Returns the number of files moved. */
+static int
+defrag_tree (struct inode *inode)
+{
+  struct dirent ents[DEFRAG_BATCH];
+  struct dir *dir;
+  size_t cnt, i;
+  int moved = 0;
+
+  if (inode_get_tmpfs (inode) != NULL || !inode_isdir (inode))
+    {
+      moved = inode_defrag (inode);
+      inode_close (inode);
+      return moved;
+    }
+
+  dir = dir_open (inode);
+  if (dir == NULL)
+    return 0;
+  while ((cnt = dir_readdir_batch (dir, ents, DEFRAG_BATCH)) > 0)
+    for (i = 0; i < cnt; i++)
+      {
+        struct inode *child = inode_open (ents[i].inumber);
+        if (child != NULL)
+          moved += defrag_tree (child);
+      }
+  dir_close (dir);
+  return moved;
+}
+
+/* Stores the size, type and inode number of the file named NAME
+   in *ST.  The directories on the way are opened, but NAME itself
+   is looked up through the lookup cache and its inode read in
+   place, without opening it.
+   Returns true if successful, false if no file named NAME
+   exists. */
+bool
+filesys_stat (const char *name, struct stat *st)
+{
+  char *filename = NULL;
+  block_sector_t sector;
+  bool found;
+
+  if (strlen (name) == 0)
+    return false;
+  struct dir *dir = dir_walk ((char *) name, &filename);
+  if (dir == NULL)
+    return false;
+
+  if (strlen (filename) > 0)
+    found = dir_lookup_sector (dir, filename, &sector);
+  else
+    {
+      sector = inode_get_inumber (dir_get_inode (dir));
+      found = true;
+    }
+  dir_close (dir);
+  free (filename);
+
+  if (found)
+    inode_stat (sector, st);
+  return found;
+}
+
 /* Deletes the file named NAME.
    Returns true if successful, false on failure.
    Fails if no file named NAME exists,
@@ -142,8 +272,10 @@ filesys_remove (const char *name)
     dir_close(dir);
     return false;
   }
+  journal_begin ();
   bool a = (dir != NULL 
             && inode_get_inumber(child) != ROOT_DIR_SECTOR
+            && !is_mount_root (inode_get_inumber (child))
             && inode_get_inumber(child) != thread_current()->cur_dir);
   bool success = false; 
 
@@ -159,17 +291,108 @@ filesys_remove (const char *name)
   }
 
   dir_close (dir);
+  journal_end ();
 
   free(filename);
 
   return success;
 }
 
+/* Mounts a new, empty memory-only file system over directory
+   NAME, creating NAME on disk first if it does not exist.  Files
+   created under NAME from then on never touch the disk, and are
+   gone at shutdown.  Must be called only while booting, after
+   filesys_init().  Returns false if NAME cannot be made a mount
+   point. */
+bool
+filesys_mount_tmpfs (const char *name)
+{
+  struct file *file;
+  struct dir *covered, *root = NULL;
+  block_sector_t parent, root_sector = 0;
+  bool success;
+
+  if (mount_cnt >= MOUNT_MAX)
+    return false;
+  filesys_create (name, 0, true);
+  file = filesys_open (name);
+  if (file == NULL || !file_isdir (file)
+      || tmpfs_owns (inode_get_inumber (file_get_inode (file)))
+      || inode_get_inumber (file_get_inode (file)) == ROOT_DIR_SECTOR)
+    {
+      file_close (file);
+      return false;
+    }
+  covered = dir_open (inode_reopen (file_get_inode (file)));
+  file_close (file);
+
+  /* The new root's ".." leads back to where NAME is. */
+  success = (covered != NULL
+             && dir_lookup_sector (covered, "..", &parent)
+             && tmpfs_create (true, 0, &root_sector)
+             && (root = dir_open (inode_open (root_sector))) != NULL
+             && dir_add (root, ".", root_sector)
+             && dir_add (root, "..", parent));
+  dir_close (root);
+  if (success)
+    {
+      mounts[mount_cnt].covered = inode_get_inumber (dir_get_inode (covered));
+      mounts[mount_cnt].root = root_sector;
+      mount_cnt++;
+    }
+  else if (root_sector != 0)
+    tmpfs_delete (root_sector);
+  dir_close (covered);
+  return success;
+}
+
+/* Returns the root of the file system mounted over the directory
+   whose inode is in SECTOR, or SECTOR itself if none is. */
+block_sector_t
+filesys_follow_mount (block_sector_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < mount_cnt; i++)
+    if (mounts[i].covered == sector)
+      return mounts[i].root;
+  return sector;
+}
+
+/* Returns true if INUMBER is the root of a mounted file system. */
+static bool
+is_mount_root (block_sector_t inumber)
+{
+  size_t i;
+
+  for (i = 0; i < mount_cnt; i++)
+    if (mounts[i].root == inumber)
+      return true;
+  return false;
+}
+
+/* Gives a new file with room for INITIAL_SIZE bytes, or a new
+   directory if IS_DIR is true, an inode, and stores its number
+   in *SECTOR.  The inode is in memory if it is to go in DIR and
+   DIR is, on disk otherwise. */
+static bool
+create_inode (struct dir *dir, off_t initial_size, bool is_dir,
+              block_sector_t *sector)
+{
+  if (inode_get_tmpfs (dir_get_inode (dir)) != NULL)
+    return tmpfs_create (is_dir, initial_size, sector);
+  if (!free_map_allocate (1, sector))
+    return false;
+  return is_dir ? dir_create (*sector, 2)
+                : inode_create (*sector, initial_size, false);
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
 {
-  printf ("Formatting file system...");
+  printf ("Formatting file system%s...",
+          inode_use_extents ? " with extents" : "");
   free_map_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
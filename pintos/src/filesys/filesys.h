@@ -2,11 +2,20 @@
 #define FILESYS_FILESYS_H
 
 #include <stdbool.h>
+#include "devices/block.h"
 #include "filesys/off_t.h"
 
 /* Sectors of system file inodes. */
 #define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
 #define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
+#define JOURNAL_SECTOR 2        /* First sector of the metadata journal. */
+
+/* The buffer cache's hot set, saved at shutdown: HOTSET_SECTORS
+   sectors right after the journal (see journal.h). */
+#define HOTSET_SECTOR (JOURNAL_SECTOR + JOURNAL_SECTORS)
+#define HOTSET_SECTORS 8
+
+struct stat;
 
 /* Block device that contains the file system. */
 struct block *fs_device;
@@ -16,5 +25,9 @@ void filesys_done (void);
 bool filesys_create (const char *name, off_t initial_size, bool is_dir);
 struct file *filesys_open (const char *name);
 bool filesys_remove (const char *name);
+bool filesys_stat (const char *name, struct stat *);
+int filesys_defrag (const char *name);
+bool filesys_mount_tmpfs (const char *name);
+block_sector_t filesys_follow_mount (block_sector_t);
 
 #endif /* filesys/filesys.h */
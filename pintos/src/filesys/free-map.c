@@ -1,22 +1,77 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* The free map is read from its file one chunk, a sector of the
+   file, at a time, when an allocation first reaches the sectors
+   the chunk covers, instead of all at once at boot. */
+#define CHUNK_BYTES BLOCK_SECTOR_SIZE
+#define CHUNK_BITS (CHUNK_BYTES * 8)
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static size_t next_sector;           /* Where the next search starts. */
+
+static size_t chunk_cnt;             /* Number of chunks. */
+static struct bitmap *loaded;        /* Chunks read in, one bit each. */
+static size_t *chunk_free;           /* Free sectors in each loaded chunk. */
+static size_t free_cnt;              /* Free sectors in all loaded chunks. */
+static size_t reserved;              /* Free sectors promised by
+                                        free_map_reserve(). */
+
+/* Guards all of the above once the reclaim thread can release
+   sectors while other threads allocate them.  Taken only inside
+   a journal operation, since writing the map begins one. */
+static struct lock free_map_lock;
+
+static void load_chunk (size_t chunk);
+static void load_all (void);
+static bool unreserved (size_t cnt);
+static size_t find_free (size_t start);
+static void mark (block_sector_t, bool used);
+static bool save (block_sector_t first, block_sector_t last);
 
 /* Initializes the free map. */
 void
 free_map_init (void)
 {
+  size_t i;
+
+  lock_init (&free_map_lock);
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
-  bitmap_mark (free_map, FREE_MAP_SECTOR);
-  bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  chunk_cnt = DIV_ROUND_UP (bitmap_size (free_map), CHUNK_BITS);
+  loaded = bitmap_create (chunk_cnt);
+  chunk_free = malloc (chunk_cnt * sizeof *chunk_free);
+  if (loaded == NULL || chunk_free == NULL)
+    PANIC ("free map summary allocation failed");
+
+  /* Until free_map_open(), the map in memory is the whole truth. */
+  bitmap_set_all (loaded, true);
+  free_cnt = 0;
+  for (i = 0; i < chunk_cnt; i++)
+    {
+      chunk_free[i] = bitmap_count (free_map, i * CHUNK_BITS,
+                                    (i + 1 < chunk_cnt
+                                     ? CHUNK_BITS
+                                     : bitmap_size (free_map) - i * CHUNK_BITS),
+                                    false);
+      free_cnt += chunk_free[i];
+    }
+  mark (FREE_MAP_SECTOR, true);
+  mark (ROOT_DIR_SECTOR, true);
+  for (i = 0; i < JOURNAL_SECTORS; i++)
+    mark (JOURNAL_SECTOR + i, true);
+  for (i = 0; i < HOTSET_SECTORS; i++)
+    mark (HOTSET_SECTOR + i, true);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
@@ -27,37 +82,217 @@ free_map_init (void)
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  size_t sector_cnt = bitmap_size (free_map);
+  size_t start;
+  bool wrapped, success = false;
+  size_t i;
+
+  if (cnt == 0 || cnt > sector_cnt)
+    return false;
+
+  lock_acquire (&free_map_lock);
+  start = next_sector;
+  wrapped = start == 0;
+  if (!unreserved (cnt))
+    goto done;
+
+  for (;;)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false);
-      sector = BITMAP_ERROR;
+      size_t sector = find_free (start);
+      size_t run;
+
+      if (sector == BITMAP_ERROR || sector + cnt > sector_cnt)
+        {
+          if (wrapped)
+            goto done;
+          start = 0;
+          wrapped = true;
+          continue;
+        }
+
+      /* See whether the free run starting at SECTOR is long
+         enough, loading any chunk it runs into. */
+      for (run = 1; run < cnt; run++)
+        {
+          load_chunk ((sector + run) / CHUNK_BITS);
+          if (bitmap_test (free_map, sector + run))
+            break;
+        }
+      if (run == cnt)
+        {
+          for (i = 0; i < cnt; i++)
+            mark (sector + i, true);
+          if (free_map_file != NULL
+              && !save (sector, sector + cnt - 1))
+            {
+              for (i = 0; i < cnt; i++)
+                mark (sector + i, false);
+              goto done;
+            }
+          next_sector = (sector + cnt) % sector_cnt;
+          *sectorp = sector;
+          success = true;
+          goto done;
+        }
+      start = sector + run;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+
+ done:
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Allocates CNT sectors from the free map, not necessarily
+   consecutive, and stores them into SECTORS[0...CNT-1] in
+   allocation order.  Takes whole free runs in turn, searching
+   from sector HINT and wrapping around to the start of the
+   disk, so that passing the sector just past a file's last
+   block tends to keep the file contiguous.  The free map file is
+   written once for the whole batch.
+   Returns true if successful, false if not enough sectors were
+   free or if the free_map file could not be written, in which
+   case nothing is allocated. */
+bool
+free_map_allocate_batch (size_t cnt, block_sector_t hint,
+                         block_sector_t *sectors)
+{
+  size_t sector_cnt = bitmap_size (free_map);
+  size_t start = hint < sector_cnt ? hint : 0;
+  bool wrapped = start == 0;
+  block_sector_t lowest = sector_cnt, highest = 0;
+  size_t i = 0;
+
+  lock_acquire (&free_map_lock);
+  if (!unreserved (cnt))
+    {
+      lock_release (&free_map_lock);
+      return false;
+    }
+  while (i < cnt)
+    {
+      size_t sector = find_free (start);
+      if (sector == BITMAP_ERROR)
+        {
+          if (wrapped)
+            break;
+          start = 0;
+          wrapped = true;
+          continue;
+        }
+
+      /* Take as much of this free run as we still need. */
+      while (i < cnt && sector < sector_cnt)
+        {
+          load_chunk (sector / CHUNK_BITS);
+          if (bitmap_test (free_map, sector))
+            break;
+          mark (sector, true);
+          if (sector < lowest)
+            lowest = sector;
+          if (sector > highest)
+            highest = sector;
+          sectors[i++] = sector++;
+        }
+      start = sector < sector_cnt ? sector : 0;
+    }
+
+  if (i == cnt
+      && (free_map_file == NULL || cnt == 0
+          || save (lowest, highest)))
+    {
+      lock_release (&free_map_lock);
+      return true;
+    }
+
+  /* Roll back. */
+  while (i-- > 0)
+    mark (sectors[i], false);
+  lock_release (&free_map_lock);
+  return false;
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  for (i = 0; i < cnt; i++)
+    load_chunk ((sector + i) / CHUNK_BITS);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  for (i = 0; i < cnt; i++)
+    mark (sector + i, false);
+  if (cnt > 0)
+    save (sector, sector + cnt - 1);
+  lock_release (&free_map_lock);
+}
+
+/* Makes the CNT sectors in SECTORS[], in any order, available for
+   use.  The free map file is written once for all of them. */
+void
+free_map_release_batch (const block_sector_t *sectors, size_t cnt)
+{
+  block_sector_t lowest = bitmap_size (free_map), highest = 0;
+  size_t i;
+
+  if (cnt == 0)
+    return;
+
+  lock_acquire (&free_map_lock);
+  for (i = 0; i < cnt; i++)
+    {
+      load_chunk (sectors[i] / CHUNK_BITS);
+      mark (sectors[i], false);
+      if (sectors[i] < lowest)
+        lowest = sectors[i];
+      if (sectors[i] > highest)
+        highest = sectors[i];
+    }
+  save (lowest, highest);
+  lock_release (&free_map_lock);
+}
+
+/* Sets aside CNT free sectors for later allocation, without
+   choosing which ones, so that allocations that do not hold a
+   reservation cannot take them.  The holder gives them back with
+   free_map_unreserve() just before allocating them.  Returns
+   false if fewer than CNT sectors are free and unreserved. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  load_all ();
+  success = unreserved (cnt);
+  if (success)
+    reserved += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Gives back CNT sectors set aside by free_map_reserve(). */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved >= cnt);
+  reserved -= cnt;
+  lock_release (&free_map_lock);
 }
 
-/* Opens the free map file and reads it from disk. */
+/* Opens the free map file.  Its chunks are read as they are
+   needed. */
 void
 free_map_open (void)
 {
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_read (free_map, free_map_file))
-    PANIC ("can't read free map");
+  bitmap_set_all (loaded, false);
+  bitmap_mark_clean (free_map);
+  free_cnt = 0;
 }
 
 /* Writes the free map to disk and closes the free map file. */
@@ -83,3 +318,110 @@ free_map_create (void)
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
 }
+
+/* Reads CHUNK of the free map from its file, if it has not been
+   read yet, and counts its free sectors. */
+static void
+load_chunk (size_t chunk)
+{
+  size_t first = chunk * CHUNK_BITS;
+  size_t bits;
+
+  if (bitmap_test (loaded, chunk))
+    return;
+  if (!bitmap_read_range (free_map, free_map_file, chunk * CHUNK_BYTES,
+                          CHUNK_BYTES))
+    PANIC ("can't read free map");
+  bits = bitmap_size (free_map) - first;
+  if (bits > CHUNK_BITS)
+    bits = CHUNK_BITS;
+  chunk_free[chunk] = bitmap_count (free_map, first, bits, false);
+  free_cnt += chunk_free[chunk];
+  bitmap_mark (loaded, chunk);
+}
+
+/* Reads every chunk of the free map not read yet. */
+static void
+load_all (void)
+{
+  size_t chunk;
+
+  for (chunk = 0; chunk < chunk_cnt; chunk++)
+    load_chunk (chunk);
+}
+
+/* Returns true if CNT sectors can be allocated without dipping
+   into reserved ones.  Sectors are only reserved once the whole
+   map is loaded, so then FREE_CNT counts every free sector. */
+static bool
+unreserved (size_t cnt)
+{
+  return reserved == 0 || free_cnt >= reserved + cnt;
+}
+
+/* Returns the first free sector at or after START, or
+   BITMAP_ERROR if there is none.  Loads each chunk it looks in,
+   and skips those whose count says they are full. */
+static size_t
+find_free (size_t start)
+{
+  size_t sector_cnt = bitmap_size (free_map);
+  size_t chunk;
+
+  for (chunk = start / CHUNK_BITS; chunk < chunk_cnt; chunk++)
+    {
+      size_t end = (chunk + 1) * CHUNK_BITS;
+      size_t sector;
+
+      load_chunk (chunk);
+      if (chunk_free[chunk] == 0)
+        continue;
+      sector = bitmap_scan (free_map, start > chunk * CHUNK_BITS
+                                      ? start : chunk * CHUNK_BITS,
+                            1, false);
+      if (sector != BITMAP_ERROR && sector < (end < sector_cnt
+                                              ? end : sector_cnt))
+        return sector;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Marks SECTOR, whose chunk must be loaded, as USED or free. */
+static void
+mark (block_sector_t sector, bool used)
+{
+  size_t chunk = sector / CHUNK_BITS;
+
+  ASSERT (bitmap_test (free_map, sector) != used);
+  bitmap_set (free_map, sector, used);
+  if (used)
+    {
+      chunk_free[chunk]--;
+      free_cnt--;
+    }
+  else
+    {
+      chunk_free[chunk]++;
+      free_cnt++;
+    }
+}
+
+/* Writes the changes to the free map, all of which lie between
+   sectors FIRST and LAST, to its file.  bitmap_write() writes the
+   whole span from the first change to the last, so every chunk
+   in it must be loaded first, or the write would clobber chunks
+   never read with zeros.  After a failed write the changes stay
+   pending, to go out with later ones wherever those fall, so
+   load the rest of the map too. */
+static bool
+save (block_sector_t first, block_sector_t last)
+{
+  size_t chunk;
+
+  for (chunk = first / CHUNK_BITS; chunk <= last / CHUNK_BITS; chunk++)
+    load_chunk (chunk);
+  if (bitmap_write (free_map, free_map_file))
+    return true;
+  load_all ();
+  return false;
+}
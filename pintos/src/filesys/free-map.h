@@ -12,6 +12,10 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_batch (size_t, block_sector_t hint, block_sector_t *);
 void free_map_release (block_sector_t, size_t);
+void free_map_release_batch (const block_sector_t *, size_t);
+bool free_map_reserve (size_t);
+void free_map_unreserve (size_t);
 
 #endif /* filesys/free-map.h */
@@ -1,5 +1,6 @@
 #include "filesys/fsutil.h"
 #include <debug.h>
+#include <round.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +12,10 @@
 #include "threads/palloc.h"
 #include "threads/vaddr.h"
 
+/* Sectors of file data fsutil_extract() reads from the scratch
+   device, and writes to the file system, at a time. */
+#define EXTRACT_SECTORS 64
+
 /* List files in the root directory. */
 void
 fsutil_ls (char **argv UNUSED)
@@ -78,7 +83,7 @@ fsutil_extract (char **argv UNUSED)
 
   /* Allocate buffers. */
   header = malloc (BLOCK_SECTOR_SIZE);
-  data = malloc (BLOCK_SECTOR_SIZE);
+  data = malloc (EXTRACT_SECTORS * BLOCK_SECTOR_SIZE);
   if (header == NULL || data == NULL)
     PANIC ("couldn't allocate buffers");
 
@@ -116,20 +121,27 @@ fsutil_extract (char **argv UNUSED)
 
           printf ("Putting '%s' into the file system...\n", file_name);
 
-          /* Create destination file. */
+          /* Create destination file, allocating all of its
+             sectors now. */
           if (!filesys_create (file_name, size, false))
             PANIC ("%s: create failed", file_name);
           dst = filesys_open (file_name);
           if (dst == NULL)
             PANIC ("%s: open failed", file_name);
 
-          /* Do copy. */
+          /* Do copy, up to EXTRACT_SECTORS at a time. */
           while (size > 0)
             {
-              int chunk_size = (size > BLOCK_SECTOR_SIZE
-                                ? BLOCK_SECTOR_SIZE
-                                : size);
-              block_read (src, sector++, data);
+              size_t sector_cnt = DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
+              int chunk_size;
+
+              if (sector_cnt > EXTRACT_SECTORS)
+                sector_cnt = EXTRACT_SECTORS;
+              chunk_size = (size > (int) sector_cnt * BLOCK_SECTOR_SIZE
+                            ? (int) sector_cnt * BLOCK_SECTOR_SIZE
+                            : size);
+              block_read_multiple (src, sector, sector_cnt, data);
+              sector += sector_cnt;
               if (file_write (dst, data, chunk_size) != chunk_size)
                 PANIC ("%s: write failed with %d bytes unwritten",
                        file_name, size);
@@ -220,3 +232,15 @@ fsutil_append (char **argv)
   file_close (src);
   free (buffer);
 }
+
+/* Moves every fragmented file in the file system to consecutive
+   sectors. */
+void
+fsutil_defrag (char **argv UNUSED)
+{
+  int moved;
+
+  printf ("Defragmenting file system...\n");
+  moved = filesys_defrag ("/");
+  printf ("%d files moved.\n", moved);
+}
@@ -1,24 +1,72 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
+#include <limits.h>
 #include <round.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
 #include "filesys/cache.h"
+#include "filesys/journal.h"
+#include "filesys/tmpfs.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Identifies an inode that maps its data with extents. */
+#define INODE_EXTENT_MAGIC 0x494e4f45
+
+/* Identifies an inode that holds its data itself. */
+#define INODE_INLINE_MAGIC 0x494e4f49
+
 /* Pointer Counts */
 #define DIRECT_CNT 123
 #define INDIRECT_PTRS 128
 #define DOUBLY_PTRS 128
 
+/* Extents that fit in an extent-based inode. */
+#define EXTENT_CNT 62
+
+/* Bytes of data that fit in an inline inode: the space of the
+   direct, indirect, and doubly indirect pointers. */
+#define INLINE_BYTES ((DIRECT_CNT + 2) * sizeof (block_sector_t))
+
+/* Number of sectors to prefetch past a sequential read. */
+#define READAHEAD_SECTORS 8
+
+/* Most blocks of a file written but not yet given sectors. */
+#define DELALLOC_SECTORS 32
+
+/* Indirect blocks that linking in DELALLOC_SECTORS consecutive
+   blocks may need: the indirect block, the doubly indirect block,
+   and two of its second-level blocks. */
+#define DELALLOC_INDEX_SECTORS 4
+
+/* Most sectors the reclaim thread frees with one update of the
+   free map. */
+#define RECLAIM_BATCH 128
+
+/* A run of consecutive data sectors of a file.  The run ends
+   where the next extent begins, or at the end of the file. */
+struct extent
+  {
+    uint32_t first;                     /* Index of the run's first file block. */
+    block_sector_t start;               /* Sector holding that block. */
+  };
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   MAGIC selects how data blocks are mapped: through direct and
+   indirect pointers (INODE_MAGIC), or through a sorted array of
+   extents (INODE_EXTENT_MAGIC).  A file of at most INLINE_BYTES
+   has no data blocks at all: its contents are kept in the inode
+   sector itself (INODE_INLINE_MAGIC), so reading it takes one
+   sector instead of two, until it grows past that size. */
 struct inode_disk
   {
     off_t length;                       /* File size in bytes. */
@@ -26,13 +74,31 @@ struct inode_disk
     
     // uint32_t unused[125];               /* Not used. */
 
-    block_sector_t direct[DIRECT_CNT];         /* Direct pointer to file data blocks. */
-    block_sector_t indirect;            /* Indirect pointer to an indirect inode block. */
-    block_sector_t doubly_indirect;     /* Doubly indirect pointer to an indirect block. */
+    union
+      {
+        struct
+          {
+            block_sector_t direct[DIRECT_CNT];         /* Direct pointer to file data blocks. */
+            block_sector_t indirect;            /* Indirect pointer to an indirect inode block. */
+            block_sector_t doubly_indirect;     /* Doubly indirect pointer to an indirect block. */
+          };
+        struct
+          {
+            uint32_t extent_cnt;                /* Number of extents in use. */
+            struct extent extents[EXTENT_CNT];  /* Extents, by ascending FIRST. */
+          };
+        uint8_t inline_data[INLINE_BYTES];      /* File contents, if inline. */
+      };
 
     bool is_dir;                        /* True if this points to a directory. */
   };
 
+/* True if new inodes map their data with extents. */
+bool inode_use_extents;
+
+/* A sector's worth of zeros, what a hole in a file reads as. */
+static const uint8_t zero_sector[BLOCK_SECTOR_SIZE];
+
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
 static inline size_t
@@ -41,18 +107,74 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
+/* A run of consecutive blocks of a file, all holes on disk, that
+   have been written but not yet given sectors.  Space for them is
+   reserved in the free map when they are written; the sectors
+   are chosen when the run is flushed, as one contiguous batch
+   where possible, so a file written in small appends is not
+   interleaved with the blocks of other files. */
+struct delalloc
+  {
+    off_t first;                        /* Index of the first block. */
+    size_t cnt;                         /* Number of blocks. */
+    uint8_t data[DELALLOC_SECTORS][BLOCK_SECTOR_SIZE]; /* Their contents. */
+  };
+
 /* In-memory inode. */
 struct inode
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
+    struct list_elem reclaim_elem;      /* Element in the reclaim queue. */
     block_sector_t sector;              /* Sector number of disk location. 
                                            Also the unique identifier of this inode.*/
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
 
-    struct lock l;                      /* Synchronization primitive. */
+    struct lock l;                      /* Short lock on the length, the
+                                           block map and the members below
+                                           that say "Guarded by L". */
     bool is_dir;                        /* True if this points to a directory. */
+
+    /* Byte ranges being read or written.  Readers and writers
+       of disjoint ranges run at once; a writer excludes anyone
+       else in its range.  L is taken only to look up or extend
+       the block map, not for the whole transfer. */
+    struct lock ranges_lock;            /* Guards RANGES. */
+    struct condition range_released;    /* Signaled when a range is unlocked. */
+    struct list ranges;                 /* Locked ranges, as struct range. */
+
+    /* Length readers see, published by writers once the data up
+       to it is in place.  DATA's own length runs ahead of it
+       while a write that grows the file is in progress.  Written
+       only with L held; read without any lock, retrying while
+       LENGTH_SEQ is odd or changes underneath. */
+    unsigned length_seq;                /* Odd while LENGTH is updated. */
+    off_t length;                       /* Published length in bytes. */
+
+    off_t next_read_ofs;                /* Offset just past the last read, used
+                                           to detect sequential access. */
+    off_t readahead_ofs;                /* Offset up to which read-ahead has
+                                           already been requested. */
+    struct delalloc *delalloc;          /* Blocks awaiting sectors, or null.
+                                           Guarded by L. */
+    struct tmpfs_node *tmp;             /* Memory-only inode, or null if
+                                           this one is on disk.  Then
+                                           DATA is unused. */
+
+    struct inode_disk data;             /* Copy of the on-disk inode, guarded
+                                           by L and written through to the
+                                           cache whenever it changes. */
+  };
+
+/* A byte range of an inode locked by a reader or a writer,
+   living on the locker's stack. */
+struct range
+  {
+    off_t start;                        /* First byte. */
+    off_t end;                          /* Byte after the last. */
+    bool write;                         /* True if locked for writing. */
+    struct list_elem elem;              /* Element in inode's RANGES. */
   };
 
 struct indirect_disk 
@@ -60,6 +182,25 @@ struct indirect_disk
     block_sector_t pointers[INDIRECT_PTRS];  /* Pointers to other data or indirect inode blocks */
   };
 
+/* Returns what the data blocks of DISK_DATA hold, for the cache
+   statistics. */
+static inline enum fs_class
+data_class (const struct inode_disk *disk_data)
+{
+  return disk_data->is_dir ? FS_CLASS_DIR : FS_CLASS_FILE;
+}
+
+/* Returns what the data blocks of INODE hold.  The free map's
+   count as index blocks, since they are metadata and must go
+   through the journal. */
+static inline enum fs_class
+inode_class (const struct inode *inode)
+{
+  if (inode->sector == FREE_MAP_SECTOR)
+    return FS_CLASS_INDEX;
+  return inode->is_dir ? FS_CLASS_DIR : FS_CLASS_FILE;
+}
+
 
 /* Return true if the Nth data block is in direct pointers. */
 bool in_direct_ptr(off_t n) {
@@ -109,273 +250,571 @@ off_t doubly_indirect_index_2(off_t n) {
   return (n - DIRECT_CNT - INDIRECT_PTRS - 1) % INDIRECT_PTRS;
 }
 
+/* Return true if DISK_DATA maps its data with extents. */
+static inline bool
+uses_extents (const struct inode_disk *disk_data)
+{
+  return disk_data->magic == INODE_EXTENT_MAGIC;
+}
+
+/* Return true if DISK_DATA holds its data inline. */
+static inline bool
+uses_inline (const struct inode_disk *disk_data)
+{
+  return disk_data->magic == INODE_INLINE_MAGIC;
+}
+
+/* Returns the sector holding file block IDX (0-based) of the
+   extent-based DISK_DATA, found by binary search over its
+   extents, or 0 if the block is not allocated. */
+static block_sector_t
+extent_lookup (const struct inode_disk *disk_data, size_t idx)
+{
+  size_t lo = 0, hi = disk_data->extent_cnt;
+
+  if (idx >= bytes_to_sectors (disk_data->length) || hi == 0)
+    return 0;
+
+  /* Find the last extent whose first block is at most IDX. */
+  while (hi - lo > 1)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (disk_data->extents[mid].first <= idx)
+        lo = mid;
+      else
+        hi = mid;
+    }
+  return disk_data->extents[lo].start + (idx - disk_data->extents[lo].first);
+}
+
+/* Returns pointer IDX of the indirect block at sector SECTOR,
+   read in place from the cache. */
+static block_sector_t
+indirect_read (block_sector_t sector, off_t idx)
+{
+  struct cache_block *block = cache_get (sector, CACHE_READ, FS_CLASS_INDEX);
+  block_sector_t result = ((const struct indirect_disk *) block->data)->pointers[idx];
+  cache_put (block);
+  return result;
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns 0 if INODE does not contain data for a byte at offset
-   POS. */
+   POS, either because POS is past its end or because POS is in
+   a hole that has never been written. */
 static block_sector_t
 byte_to_sector (const struct inode *inode, off_t pos)
 {
   ASSERT (inode != NULL);
-  
-  struct inode_disk disk_data;
-  cache_read (inode->sector, &disk_data, BLOCK_SECTOR_SIZE, 0);
 
+  const struct inode_disk *disk_data = &inode->data;
   off_t sector_off = pos / BLOCK_SECTOR_SIZE;
 
-  if (in_direct_ptr(sector_off+1)) {
+  if (uses_inline(disk_data)) {
 
-    return disk_data.direct[direct_index(sector_off+1)];
+    return 0;
+
+  } else if (uses_extents(disk_data)) {
+
+    return extent_lookup (disk_data, sector_off);
+
+  } else if (in_direct_ptr(sector_off+1)) {
+
+    return disk_data->direct[direct_index(sector_off+1)];
 
   } else if (in_indirect_ptr(sector_off+1)) {
-    struct indirect_disk indirect_disk_node;
 
     // Indirect Pointer
-    cache_read (disk_data.indirect, &indirect_disk_node, BLOCK_SECTOR_SIZE, 0);
-    return indirect_disk_node.pointers[indirect_index(sector_off+1)];
+    if (disk_data->indirect == 0)
+      return 0;
+    return indirect_read (disk_data->indirect, indirect_index(sector_off+1));
 
   } else if (in_doubly_indirect_ptr(sector_off+1)) {
-    struct indirect_disk doubly_indirect_disk;
-    struct indirect_disk indirect;
-
-    cache_read (disk_data.doubly_indirect, &doubly_indirect_disk, BLOCK_SECTOR_SIZE, 0);
-
-    off_t level1_index = doubly_indirect_index_1(sector_off+1);
-    cache_read (doubly_indirect_disk.pointers[level1_index], &indirect, BLOCK_SECTOR_SIZE, 0);
 
-    return indirect.pointers[doubly_indirect_index_2(sector_off+1)];
+    if (disk_data->doubly_indirect == 0)
+      return 0;
+    block_sector_t level1 = indirect_read (disk_data->doubly_indirect,
+                                           doubly_indirect_index_1(sector_off+1));
+    if (level1 == 0)
+      return 0;
+    return indirect_read (level1, doubly_indirect_index_2(sector_off+1));
 
   }
   return 0;
 }
 
-/* Extend INODE to size LENGTH. Allocate and zero out allocated disk nodes.
-   Return true upon success, or false if freemap allocate fails. */
-bool extend_inode_disk(struct inode_disk *disk_data, off_t length) {
+/* Grows the extent-based DISK_DATA from CURRENT_SECTORS to
+   TARGET_SECTORS data blocks and sets its length to LENGTH.
+   New sectors are allocated near HINT, zeroed, and appended to
+   the last extent when they continue it.  Returns false, leaving
+   DISK_DATA unchanged, if the sectors cannot be allocated or need
+   more extents than the inode holds. */
+static bool
+extend_extents (struct inode_disk *disk_data, size_t current_sectors,
+                size_t target_sectors, off_t length, block_sector_t hint)
+{
+  size_t cnt = target_sectors - current_sectors;
+  size_t i, new_extents = 0;
+  block_sector_t next = 0;
+
+  block_sector_t *sectors = calloc (cnt, sizeof *sectors);
+  if (sectors == NULL)
+    return false;
+
+  if (current_sectors > 0)
+    {
+      next = extent_lookup (disk_data, current_sectors - 1) + 1;
+      hint = next;
+    }
+  if (!free_map_allocate_batch (cnt, hint, sectors))
+    {
+      free (sectors);
+      return false;
+    }
+
+  /* Count the runs the new sectors form, so that running out of
+     extents is detected before anything changes. */
+  for (i = 0; i < cnt; i++)
+    {
+      if ((i == 0 && current_sectors == 0) || sectors[i] != next)
+        new_extents++;
+      next = sectors[i] + 1;
+    }
+  if (disk_data->extent_cnt + new_extents > EXTENT_CNT)
+    {
+      for (i = 0; i < cnt; i++)
+        free_map_release (sectors[i], 1);
+      free (sectors);
+      return false;
+    }
+
+  next = current_sectors > 0 ? extent_lookup (disk_data, current_sectors - 1) + 1 : 0;
+  for (i = 0; i < cnt; i++)
+    {
+      if ((i == 0 && current_sectors == 0) || sectors[i] != next)
+        {
+          struct extent *e = &disk_data->extents[disk_data->extent_cnt++];
+          e->first = current_sectors + i;
+          e->start = sectors[i];
+        }
+      cache_write (sectors[i], zero_sector, BLOCK_SECTOR_SIZE, 0, data_class (disk_data));
+      next = sectors[i] + 1;
+    }
+
+  disk_data->length = length;
+  free (sectors);
+  return true;
+}
+
+/* Extend INODE to size LENGTH.  An inode that maps its data with
+   pointers just grows: the new blocks are holes, with null
+   pointers, until something is written to them, so seeking far
+   past the end of a file costs nothing.  Extents cannot describe
+   holes, so an extent-based inode gets its new blocks allocated
+   and zeroed now, right after its last data block if possible,
+   or else near HINT when the file has none yet.
+   Return true upon success, or false if the file would be too big
+   or freemap allocate fails. */
+bool extend_inode_disk(struct inode_disk *disk_data, off_t length,
+                       block_sector_t hint) {
 
-  int i, j, k, z, sectors_needed;
   size_t current_sectors, target_sectors;
-  static char zeros[BLOCK_SECTOR_SIZE];
 
   // No allocation needed
   if (disk_data->length >= length) {
     return true;
   }
 
-  // Calculate number of free sectors needed to grow the file
+  // Bytes past the end of inline data are always zero
+  if (uses_inline(disk_data)) {
+    ASSERT (length <= (off_t) INLINE_BYTES);
+    disk_data->length = length;
+    return true;
+  }
+
   current_sectors = bytes_to_sectors(disk_data->length);
   target_sectors = bytes_to_sectors(length);
 
-  sectors_needed = target_sectors - current_sectors;
-
-  if (sectors_needed <= 0) {
-    disk_data->length = length;
-    return true;
+  if (uses_extents(disk_data) && target_sectors > current_sectors) {
+    return extend_extents(disk_data, current_sectors, target_sectors, length, hint);
   }
 
-  // Adjust for sectors needed for indoe disk nodes
-  if (too_big(target_sectors)) {
+  if (!uses_extents(disk_data) && too_big(target_sectors)) {
     return false;
-  } else if (current_sectors == 0 || in_direct_ptr(current_sectors)) {
-    if (in_indirect_ptr(target_sectors)) {
-      sectors_needed += 1;
-    } else if (in_doubly_indirect_ptr(target_sectors)) {
-      // + 1 indirect, 1 doubly indirect, index+1 second level sectors
-      sectors_needed += 1 + 1 + doubly_indirect_index_1(target_sectors) + 1;
-    }
-  } else if (in_indirect_ptr(current_sectors)) {
-    if (in_doubly_indirect_ptr(target_sectors)) {
-      // + 1 indirect, 1 doubly indirect, index+1 second level sectors
-      sectors_needed += 1 + doubly_indirect_index_1(target_sectors) + 1;
-    }
-  } else {
-    size_t current_index = doubly_indirect_index_1(current_sectors);
-    size_t target_index = doubly_indirect_index_1(target_sectors);
-    if (target_index >= current_index) {
-      sectors_needed += target_index - current_index;
+  }
+
+  disk_data->length = length;
+  return true;
+}
+
+/* Sets pointer IDX of the indirect block at sector SECTOR to
+   VALUE, in place in the cache. */
+static void
+indirect_write (block_sector_t sector, off_t idx, block_sector_t value)
+{
+  cache_write (sector, &value, sizeof value, idx * sizeof value, FS_CLASS_INDEX);
+}
+
+/* Makes SECTOR the data sector of block IDX (0-based) of INODE,
+   which maps its data with pointers and has a hole there,
+   allocating any indirect blocks missing on the way to it.
+   INODE's lock must be held.  Returns false if the disk is
+   full. */
+static bool
+link_block (struct inode *inode, off_t idx, block_sector_t sector)
+{
+  struct inode_disk *disk_data = &inode->data;
+  off_t n = idx + 1;
+  block_sector_t sectors[3];
+  block_sector_t level1 = 0;
+  size_t cnt = 0, used = 0;
+  bool inode_dirty = false;
+
+  ASSERT (!uses_extents (disk_data));
+  ASSERT (byte_to_sector (inode, idx * BLOCK_SECTOR_SIZE) == 0);
+
+  // Count the indirect blocks that have to be created
+  if (in_indirect_ptr(n)) {
+    cnt += disk_data->indirect == 0;
+  } else if (in_doubly_indirect_ptr(n)) {
+    if (disk_data->doubly_indirect == 0) {
+      cnt += 2;
     } else {
-      return true;
+      level1 = indirect_read (disk_data->doubly_indirect,
+                              doubly_indirect_index_1(n));
+      cnt += level1 == 0;
     }
   }
-
-  // Allocate free sectors needed to grow the file
-  block_sector_t *free_sectors = NULL;
-  free_sectors = (block_sector_t *) calloc(sectors_needed, sizeof(block_sector_t));
-  if (free_sectors == NULL) {
+  if (cnt > 0 && !free_map_allocate_batch (cnt, sector + 1, sectors)) {
     return false;
   }
 
-  bool allocation_success = true;
-  i = 0;
-  while (i < sectors_needed) {
-    if (!free_map_allocate(1, &free_sectors[i]) ) {
-      allocation_success = false;
-      break;
+  if (in_direct_ptr(n)) {
+    disk_data->direct[direct_index(n)] = sector;
+    inode_dirty = true;
+  } else if (in_indirect_ptr(n)) {
+    if (disk_data->indirect == 0) {
+      disk_data->indirect = sectors[used++];
+      cache_write (disk_data->indirect, zero_sector, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INDEX);
+      inode_dirty = true;
     }
-    i++;
+    indirect_write (disk_data->indirect, indirect_index(n), sector);
+  } else {
+    if (disk_data->doubly_indirect == 0) {
+      disk_data->doubly_indirect = sectors[used++];
+      cache_write (disk_data->doubly_indirect, zero_sector, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INDEX);
+      inode_dirty = true;
+    }
+    if (level1 == 0) {
+      level1 = sectors[used++];
+      cache_write (level1, zero_sector, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INDEX);
+      indirect_write (disk_data->doubly_indirect, doubly_indirect_index_1(n), level1);
+    }
+    indirect_write (level1, doubly_indirect_index_2(n), sector);
   }
+  ASSERT (used == cnt);
 
-  // Roll back if allocation failed
-  if (!allocation_success) {
-    i = 0;
-    while (i < sectors_needed) {
-      if (free_sectors[i]) {
-        free_map_release(free_sectors[i], 1);
-      } else {
-        break;
-      }
-      i++;
-    }
-    free(free_sectors);
-    return false;
+  if (inode_dirty) {
+    cache_write (inode->sector, disk_data, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INODE);
   }
+  return true;
+}
 
+/* Points block IDX (0-based) of INODE, which maps its data with
+   pointers and already has a sector there, at SECTOR instead,
+   writing the inode through if the pointer is in it.  INODE's
+   lock must be held. */
+static void
+relink_block (struct inode *inode, off_t idx, block_sector_t sector)
+{
+  struct inode_disk *disk_data = &inode->data;
+  off_t n = idx + 1;
 
-  sectors_needed = target_sectors - current_sectors; // Data Sectors Count Only
-  i = 0;
-  j = 0;
+  ASSERT (!uses_extents (disk_data));
+  ASSERT (byte_to_sector (inode, idx * BLOCK_SECTOR_SIZE) != 0);
 
-  // Direct Pointers
-  while (i < DIRECT_CNT && sectors_needed > 0) {
-    if (!disk_data->direct[i]) {
-      disk_data->direct[i] = free_sectors[j++];
-      cache_write(disk_data->direct[i], zeros, BLOCK_SECTOR_SIZE, 0);
-      sectors_needed--;
-    }
-    i++;
+  if (in_direct_ptr(n)) {
+    disk_data->direct[direct_index(n)] = sector;
+    cache_write (inode->sector, disk_data, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INODE);
+  } else if (in_indirect_ptr(n)) {
+    indirect_write (disk_data->indirect, indirect_index(n), sector);
+  } else {
+    block_sector_t level1 = indirect_read (disk_data->doubly_indirect,
+                                           doubly_indirect_index_1(n));
+    indirect_write (level1, doubly_indirect_index_2(n), sector);
   }
+}
 
+/* Returns where to look for a free sector for block IDX of INODE:
+   right after the previous block's sector if it has one, or else
+   right after INODE itself.  INODE's lock must be held. */
+static block_sector_t
+block_hint (const struct inode *inode, off_t idx)
+{
+  block_sector_t prev = 0;
 
-  // Allocate indirect disks to use later on heap to avoid stacoverflow
-  struct indirect_disk *disk_node = NULL;
-  disk_node = (struct indirect_disk *) calloc(1, sizeof(*disk_node));
-  if (disk_node == NULL) {
-    free(free_sectors);
-    return false;
+  if (idx > 0) {
+    prev = byte_to_sector (inode, (idx - 1) * BLOCK_SECTOR_SIZE);
   }
+  return (prev != 0 ? prev : inode->sector) + 1;
+}
 
-  struct indirect_disk *disk_node2 = NULL;
-  disk_node2 = (struct indirect_disk *) calloc(1, sizeof(*disk_node2));
-  if (disk_node2 == NULL) {
-    free(free_sectors);
-    free(disk_node);
-    return false;
+/* Fills the hole at data block IDX (0-based) of INODE, which maps
+   its data with pointers, with a newly allocated zeroed sector.
+   INODE's lock must be held.  Returns the new sector, or 0 if the
+   disk is full. */
+static block_sector_t
+allocate_block (struct inode *inode, off_t idx)
+{
+  block_sector_t sector;
+
+  if (!free_map_allocate_batch (1, block_hint (inode, idx), &sector)) {
+    return 0;
+  }
+  if (!link_block (inode, idx, sector)) {
+    free_map_release (sector, 1);
+    return 0;
   }
+  cache_write (sector, zero_sector, BLOCK_SECTOR_SIZE, 0, inode_class (inode));
+  return sector;
+}
 
-  // distinguish either cache_write or block_write later
-  bool indirect_new_sector;
+/* Returns true if writes to holes in INODE go through a delayed
+   allocation run.  Directories are small and written rarely, and
+   extent-based inodes have no holes. */
+static inline bool
+uses_delalloc (const struct inode *inode)
+{
+  return (!inode->is_dir && !uses_extents (&inode->data)
+          && !uses_inline (&inode->data));
+}
 
-  // Indirect Pointers
-  if (sectors_needed > 0) {
-      // Allocate new indirect pointer if it doesn't exist
-    if (!disk_data->indirect) {
-      disk_data->indirect = free_sectors[j++];
-      indirect_new_sector = true;
-    } else {
-      // Otherwise read the existing indirect pointer
-      cache_read(disk_data->indirect, disk_node, BLOCK_SECTOR_SIZE, 0);
-      indirect_new_sector = false;
-    }
-
-    // Allocate new indirect pointers and data disks as need
-    i = 0;
-    while (i < INDIRECT_PTRS && sectors_needed > 0) {
-      if (!disk_node->pointers[i]) {
-        disk_node->pointers[i] = free_sectors[j++];
-        cache_write(disk_node->pointers[i], zeros, BLOCK_SECTOR_SIZE, 0);
-        sectors_needed--;
-      }
-      i++;
+/* Moves the contents of INODE, which holds its data inline, out
+   to a data block, mapped the way new inodes map theirs, so that
+   it can grow past INLINE_BYTES.  INODE's lock must be held.
+   Returns false, leaving INODE inline, if the disk is full. */
+static bool
+inline_to_blocks (struct inode *inode)
+{
+  struct inode_disk *disk_data = &inode->data;
+  uint8_t contents[INLINE_BYTES];
+  off_t length = disk_data->length;
+  block_sector_t sector;
+
+  ASSERT (uses_inline (disk_data));
+
+  memcpy (contents, disk_data->inline_data, INLINE_BYTES);
+  memset (disk_data->inline_data, 0, INLINE_BYTES);
+  disk_data->length = 0;
+  disk_data->magic = inode_use_extents ? INODE_EXTENT_MAGIC : INODE_MAGIC;
+  if (length > 0)
+    {
+      if (!extend_inode_disk (disk_data, length, inode->sector + 1))
+        goto fail;
+      sector = byte_to_sector (inode, 0);
+      if (sector == 0)
+        sector = allocate_block (inode, 0);
+      if (sector == 0)
+        goto fail;
+      cache_write (sector, contents, length, 0, inode_class (inode));
     }
+  return true;
 
-    // Write back indirect pointer's indirect disk node
-    cache_write(disk_data->indirect, disk_node, BLOCK_SECTOR_SIZE, 0);
-  }
+ fail:
+  disk_data->magic = INODE_INLINE_MAGIC;
+  disk_data->length = length;
+  memcpy (disk_data->inline_data, contents, INLINE_BYTES);
+  return false;
+}
 
-  // Doubly Indirect Pointers
-  memset(disk_node, 0, sizeof(*disk_node));
+/* Grows INODE to LENGTH bytes, moving its data out of the inode
+   first if it no longer fits inline.  INODE's lock must be held.
+   Returns false if the disk is full. */
+static bool
+inode_grow (struct inode *inode, off_t length)
+{
+  if (uses_inline (&inode->data) && length > (off_t) INLINE_BYTES
+      && !inline_to_blocks (inode))
+    return false;
+  return extend_inode_disk (&inode->data, length, inode->sector + 1);
+}
 
-  if (sectors_needed > 0) {
+/* Returns the contents of block IDX of INODE if it is waiting in
+   INODE's delayed allocation run, or a null pointer.  INODE's
+   lock must be held. */
+static uint8_t *
+delalloc_lookup (const struct inode *inode, off_t idx)
+{
+  struct delalloc *d = inode->delalloc;
 
-    bool doubly_new_sector;
+  if (d != NULL && idx >= d->first && idx < d->first + (off_t) d->cnt)
+    return d->data[idx - d->first];
+  return NULL;
+}
 
-      // Allocate new doubly indirect pointer if it doesn't exist
-    if (!disk_data->doubly_indirect) {
-      disk_data->doubly_indirect = free_sectors[j++];
-      doubly_new_sector = true;
-    } else {
-       // Otherwise read the existing doubly indirect pointer
-      cache_read(disk_data->doubly_indirect, disk_node, BLOCK_SECTOR_SIZE, 0);
-      doubly_new_sector = false;
-    }
+/* Gives the blocks of INODE's delayed allocation run their
+   sectors, as one batch placed after the block before the run,
+   and writes them to the cache.  INODE's lock must be held. */
+static void
+delalloc_flush (struct inode *inode)
+{
+  struct delalloc *d = inode->delalloc;
+  block_sector_t sectors[DELALLOC_SECTORS];
+  size_t i;
 
-    // Calculate where to start for efficiency
-    k = 0;
-    if (in_doubly_indirect_ptr(current_sectors)) {
-      k = doubly_indirect_index_1(current_sectors);
-    }
-    z = doubly_indirect_index_1(target_sectors);
+  if (d == NULL)
+    return;
+  inode->delalloc = NULL;
+
+  /* The reservation made room for the run, so this only fails if
+     the disk filled up anyway, and then the run is lost. */
+  free_map_unreserve (d->cnt + DELALLOC_INDEX_SECTORS);
+  if (free_map_allocate_batch (d->cnt, block_hint (inode, d->first), sectors))
+    for (i = 0; i < d->cnt; i++)
+      {
+        if (link_block (inode, d->first + i, sectors[i]))
+          cache_write (sectors[i], d->data[i], BLOCK_SECTOR_SIZE, 0,
+                       inode_class (inode));
+        else
+          free_map_release (sectors[i], 1);
+      }
+  free (d);
+}
 
-    // distinguish either cache_write or block_write later
-    bool level1_new_sector;
+/* Drops INODE's delayed allocation run, if any, unwritten. */
+static void
+delalloc_discard (struct inode *inode)
+{
+  struct delalloc *d = inode->delalloc;
 
-    // Fill in level one doubly indirect indicies
-    while (k <= z && sectors_needed > 0) {
-      
-      memset(disk_node2, 0, sizeof(*disk_node2));
+  if (d == NULL)
+    return;
+  inode->delalloc = NULL;
+  free_map_unreserve (d->cnt + DELALLOC_INDEX_SECTORS);
+  free (d);
+}
 
-        // Allocate new indirect pointer if it doesn't exist
-      if (!disk_node->pointers[k]) {
-        disk_node->pointers[k] = free_sectors[j++];
-        level1_new_sector = false;
-      } else {
-        // Otherwise read the existing indirect pointer
-        cache_read(disk_node->pointers[k], disk_node2, BLOCK_SECTOR_SIZE, 0);
-        level1_new_sector = true;
-      }
+/* Returns a buffer to write block IDX of INODE, a hole, into:
+   its slot in INODE's delayed allocation run, which is extended,
+   or flushed and started over at IDX, as needed.  New slots read
+   as zeros.  INODE's lock must be held.  Returns a null pointer
+   if no space could be reserved for the block. */
+static uint8_t *
+delalloc_slot (struct inode *inode, off_t idx)
+{
+  struct delalloc *d = inode->delalloc;
+  uint8_t *slot = delalloc_lookup (inode, idx);
 
-      // Fill in level two doubly indirect indicies
-      i = 0;
-      while (i < INDIRECT_PTRS && sectors_needed > 0) {
-        // Allocate new indirect pointers and data disks as need
-        if (!disk_node2->pointers[i]) {
-          disk_node2->pointers[i] = free_sectors[j++];
-          block_write(fs_device, disk_node2->pointers[i], zeros);
-          sectors_needed--;
-        }
-        i++;
-      }
+  if (slot != NULL)
+    return slot;
 
-      // Flush changes
-      cache_write(disk_node->pointers[k], disk_node2, BLOCK_SECTOR_SIZE, 0);
+  if (d != NULL)
+    {
+      if (idx == d->first + (off_t) d->cnt && d->cnt < DELALLOC_SECTORS)
+        {
+          if (!free_map_reserve (1))
+            return NULL;
+          slot = d->data[d->cnt++];
+          memset (slot, 0, BLOCK_SECTOR_SIZE);
+          return slot;
+        }
+      delalloc_flush (inode);
+    }
 
-      k++;
+  d = malloc (sizeof *d);
+  if (d == NULL)
+    return NULL;
+  if (!free_map_reserve (1 + DELALLOC_INDEX_SECTORS))
+    {
+      free (d);
+      return NULL;
     }
+  d->first = idx;
+  d->cnt = 1;
+  memset (d->data[0], 0, BLOCK_SECTOR_SIZE);
+  inode->delalloc = d;
+  return d->data[0];
+}
 
-    // Flush changes
-    cache_write(disk_data->doubly_indirect, disk_node, BLOCK_SECTOR_SIZE, 0);
-  }
+/* Open inodes, hashed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
 
-  disk_data->length = length;
+/* Guards OPEN_INODES and every inode's OPEN_CNT. */
+static struct lock open_inodes_lock;
 
-  // Free heap memory
-  free(free_sectors);
-  free(disk_node);
-  free(disk_node2);
+/* Allocator for `struct inode'. */
+static struct kmem_cache *inode_cache;
 
-  return true;
+/* Removed inodes whose last opener has closed them, waiting for
+   the "inode-reclaim" kernel thread to free their sectors, so
+   that closing a removed file takes the same time however large
+   it is. */
+static struct
+  {
+    struct lock l;                      /* Protects all members. */
+    struct condition not_empty;         /* Signaled on enqueue. */
+    struct condition idle;              /* Signaled when the queue drains. */
+    struct list inodes;                 /* Queued inodes, oldest first. */
+    bool busy;                          /* True while an inode is freed. */
+  } reclaim;
+
+/* Sectors gathered by the reclaim thread, released to the free
+   map together. */
+struct reclaim_batch
+  {
+    block_sector_t sectors[RECLAIM_BATCH];
+    size_t cnt;
+  };
+
+static thread_func reclaim_thread NO_RETURN;
+
+/* Returns a hash value for the sector of inode E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Returns true if inode A's sector is lower than inode B's. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return hash_entry (a, struct inode, elem)->sector
+         < hash_entry (b, struct inode, elem)->sector;
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("open inode table creation failed");
+  lock_init (&open_inodes_lock);
+  lock_set_name (&open_inodes_lock, "open-inodes");
+  inode_cache = kmem_cache_create ("inode", sizeof (struct inode), NULL);
+  if (inode_cache == NULL)
+    PANIC ("inode cache creation failed");
   cache_init();
+
+  /* The reclaim thread outlives filesys_done()/filesys_init()
+     pairs, so only start it the first time through. */
+  static bool thread_started;
+  if (!thread_started)
+    {
+      lock_init (&reclaim.l);
+      lock_set_name (&reclaim.l, "inode-reclaim");
+      cond_init (&reclaim.not_empty);
+      cond_init (&reclaim.idle);
+      list_init (&reclaim.inodes);
+      reclaim.busy = false;
+      if (thread_create ("inode-reclaim", PRI_DEFAULT, reclaim_thread, NULL)
+          == TID_ERROR)
+        PANIC ("can't start inode reclaim thread");
+      thread_started = true;
+    }
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -400,11 +839,14 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
     {
       // We initialize file to length 0 and grow as need
       disk_inode->length = 0;
-      disk_inode->magic = INODE_MAGIC;
+      if (length <= (off_t) INLINE_BYTES)
+        disk_inode->magic = INODE_INLINE_MAGIC;
+      else
+        disk_inode->magic = inode_use_extents ? INODE_EXTENT_MAGIC : INODE_MAGIC;
       disk_inode->is_dir = is_dir;
 
-      if (extend_inode_disk(disk_inode, length)) {
-        block_write(fs_device, sector, disk_inode);
+      if (extend_inode_disk(disk_inode, length, sector + 1)) {
+        cache_write(sector, disk_inode, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INODE);
         success = true;
       }
       free (disk_inode);
@@ -418,43 +860,67 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
+  lock_acquire (&open_inodes_lock);
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
-        {
-          inode_reopen (inode);
-          return inode;
-        }
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+      return inode;
     }
 
   /* Allocate memory. */
-  inode = malloc (sizeof *inode);
+  inode = kmem_cache_alloc (inode_cache);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  The table stays locked until the inode is
+     read in, so no one else sees it half-initialized. */
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->removed = false;
   inode->deny_write_cnt = 0;
+  inode->next_read_ofs = 0;
+  inode->readahead_ofs = 0;
+  inode->delalloc = NULL;
+  inode->tmp = NULL;
   lock_init(&inode->l);
+  lock_init (&inode->ranges_lock);
+  cond_init (&inode->range_released);
+  list_init (&inode->ranges);
 
-  // Read if if it's directory
-  struct inode_disk *disk_data = NULL;
-  disk_data = calloc (1, sizeof *disk_data);
-  if (disk_data == NULL) {
-    return NULL;
-  }
-  cache_read (inode->sector, disk_data, BLOCK_SECTOR_SIZE, 0);
-  inode->is_dir = disk_data->is_dir;
-  free(disk_data);
+  if (tmpfs_owns (sector))
+    {
+      inode->tmp = tmpfs_get (sector);
+      if (inode->tmp == NULL)
+        {
+          kmem_cache_free (inode_cache, inode);
+          lock_release (&open_inodes_lock);
+          return NULL;
+        }
+      inode->is_dir = tmpfs_isdir (inode->tmp);
+      hash_insert (&open_inodes, &inode->elem);
+      lock_release (&open_inodes_lock);
+      return inode;
+    }
+
+  // Keep the on-disk inode in memory for as long as it is open
+  cache_read (inode->sector, &inode->data, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INODE);
+  inode->is_dir = inode->data.is_dir;
+  inode->length_seq = 0;
+  inode->length = inode->data.length;
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
 
   return inode;
 }
@@ -464,7 +930,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -477,7 +947,8 @@ inode_get_inumber (const struct inode *inode)
 
 /* Closes INODE and writes it to disk->
    If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+   If INODE was also a removed inode, hands it to the reclaim
+   thread, which frees its blocks and then its memory. */
 void
 inode_close (struct inode *inode)
 {
@@ -486,105 +957,178 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&open_inodes_lock);
+  bool last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+
+  /* A memory-only inode goes away with its last opener, if
+     removed.  That happens with the table still locked, so that
+     no one can open it in between. */
+  if (last && inode->tmp != NULL)
     {
+      if (inode->removed)
+        tmpfs_delete (inode->sector);
+      kmem_cache_free (inode_cache, inode);
+      lock_release (&open_inodes_lock);
+      return;
+    }
+  lock_release (&open_inodes_lock);
 
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+  if (last)
+    {
+      journal_begin ();
 
-      /* Deallocate blocks if removed. */
+      /* Blocks written to a removed inode never need sectors. */
+      lock_acquire(&inode->l);
       if (inode->removed)
-        {
-
-          lock_acquire(&inode->l);
+        delalloc_discard (inode);
+      else
+        delalloc_flush (inode);
+      lock_release(&inode->l);
 
+      if (inode->removed)
+        {
+          lock_acquire (&reclaim.l);
+          list_push_back (&reclaim.inodes, &inode->reclaim_elem);
+          cond_signal (&reclaim.not_empty, &reclaim.l);
+          lock_release (&reclaim.l);
+        }
+      else
+        kmem_cache_free (inode_cache, inode);
+      journal_end ();
+    }
+}
 
-          // Allocate necessary temporary structures on heap
-          struct inode_disk *disk_data = NULL;
-          disk_data = (struct inode_disk *) calloc(1, sizeof(*disk_data));
-          ASSERT(disk_data != NULL);
+/* Releases the sectors in BATCH to the free map, which is written
+   once for all of them, and empties BATCH. */
+static void
+reclaim_flush (struct reclaim_batch *batch)
+{
+  if (batch->cnt == 0)
+    return;
+  journal_begin ();
+  free_map_release_batch (batch->sectors, batch->cnt);
+  journal_end ();
+  batch->cnt = 0;
+}
 
-          struct indirect_disk *indirect_node = NULL;
-          indirect_node = (struct indirect_disk *) calloc(1, sizeof(*indirect_node));
-          ASSERT(indirect_node != NULL);
+/* Adds SECTOR to BATCH, first releasing the batch if it is
+   full. */
+static void
+reclaim_add (struct reclaim_batch *batch, block_sector_t sector)
+{
+  if (batch->cnt == RECLAIM_BATCH)
+    reclaim_flush (batch);
+  batch->sectors[batch->cnt++] = sector;
+}
 
-          struct indirect_disk *indirect_node2 = NULL;
-          indirect_node2 = (struct indirect_disk *) calloc(1, sizeof(*indirect_node2));
-          ASSERT(indirect_node2 != NULL);
+/* Adds to BATCH the nonzero pointers in the indirect block at
+   SECTOR, then SECTOR itself.  If LEVELS is 2, each pointer names
+   another indirect block, whose pointers are added first. */
+static void
+reclaim_indirect (struct reclaim_batch *batch, block_sector_t sector,
+                  int levels)
+{
+  struct indirect_disk *node = malloc (sizeof *node);
+  int i;
+
+  ASSERT (node != NULL);
+  cache_read (sector, node, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INDEX);
+  for (i = 0; i < INDIRECT_PTRS; i++)
+    if (node->pointers[i] != 0)
+      {
+        if (levels > 1)
+          reclaim_indirect (batch, node->pointers[i], levels - 1);
+        else
+          reclaim_add (batch, node->pointers[i]);
+      }
+  free (node);
+  reclaim_add (batch, sector);
+}
 
+/* Adds every sector of the removed INODE, its data and index
+   blocks and the inode sector itself, to BATCH, and frees
+   INODE.  Nothing else refers to INODE any more. */
+static void
+reclaim_inode (struct reclaim_batch *batch, struct inode *inode)
+{
+  struct inode_disk *disk_data = &inode->data;
+  size_t i;
 
-          cache_read (inode->sector, disk_data, BLOCK_SECTOR_SIZE, 0);
+  if (uses_extents (disk_data))
+    {
+      size_t end = bytes_to_sectors (disk_data->length);
+      for (i = disk_data->extent_cnt; i-- > 0; )
+        {
+          block_sector_t s;
+          for (s = 0; s < end - disk_data->extents[i].first; s++)
+            reclaim_add (batch, disk_data->extents[i].start + s);
+          end = disk_data->extents[i].first;
+        }
+    }
+  else if (!uses_inline (disk_data))
+    {
+      /* Holes have no sectors to release. */
+      for (i = 0; i < DIRECT_CNT; i++)
+        if (disk_data->direct[i] != 0)
+          reclaim_add (batch, disk_data->direct[i]);
+      if (disk_data->indirect != 0)
+        reclaim_indirect (batch, disk_data->indirect, 1);
+      if (disk_data->doubly_indirect != 0)
+        reclaim_indirect (batch, disk_data->doubly_indirect, 2);
+    }
+  reclaim_add (batch, inode->sector);
+  kmem_cache_free (inode_cache, inode);
+}
 
-          int i, j;
+/* Frees the sectors of removed inodes as they are queued,
+   gathering them across inodes into batches of RECLAIM_BATCH.
+   A partial batch is released once the queue runs dry. */
+static void
+reclaim_thread (void *aux UNUSED)
+{
+  static struct reclaim_batch batch;
 
-          // Release free map for all direct pointers
-          for (i = 0; i < DIRECT_CNT; i++) {
-            if (disk_data->direct[i] == 0) {
-              break;
-            } else {
-              free_map_release (disk_data->direct[i], 1);
-            }
-          }
-
-          // Release free map for the indirect pointer
-          if (disk_data->indirect != 0) {
-            cache_read (disk_data->indirect, indirect_node, BLOCK_SECTOR_SIZE, 0);
-            for (i = 0; i < INDIRECT_PTRS; i++) {
-              if (indirect_node->pointers[i] == 0) {
-                break;
-              } else {
-                free_map_release (indirect_node->pointers[i], 1);
-              }
-            }
-            free_map_release (disk_data->indirect, 1);
-          }
-
-          // Release free map for the doubly indirect pointer
-          if (disk_data->doubly_indirect != 0) {
-            // Free indirect
-            cache_read (disk_data->indirect, indirect_node, BLOCK_SECTOR_SIZE, 0);
-            for (i = 0; i < INDIRECT_PTRS; i++) {
-              if (indirect_node->pointers[i] == 0) {
-                break;
-              } else {
-                free_map_release (indirect_node->pointers[i], 1);
-              }
-            }
-            free_map_release (disk_data->indirect, 1);
-
-            // Free doubly indirect level 1
-            cache_read (disk_data->doubly_indirect, indirect_node, BLOCK_SECTOR_SIZE, 0);
-            for (i = 0; i < DOUBLY_PTRS; i++) {
-              if (indirect_node->pointers[i] == 0) {
-                break;
-              } else {
-                // Free doubly indirect level 2
-                cache_read (indirect_node->pointers[i], indirect_node2, BLOCK_SECTOR_SIZE, 0);
-                for (j = 0; j < INDIRECT_PTRS; j++) {
-                  if (indirect_node2->pointers[j] == 0) {
-                    break;
-                  } else {
-                    free_map_release (indirect_node2->pointers[j], 1);
-                  }
-                }
-              }
-              free_map_release (indirect_node->pointers[i], 1);
-            }
-            free_map_release (disk_data->doubly_indirect, 1);
-          }
+  for (;;)
+    {
+      struct inode *inode;
 
-          lock_release(&inode->l);
+      lock_acquire (&reclaim.l);
+      while (list_empty (&reclaim.inodes))
+        cond_wait (&reclaim.not_empty, &reclaim.l);
+      inode = list_entry (list_pop_front (&reclaim.inodes),
+                          struct inode, reclaim_elem);
+      reclaim.busy = true;
+      lock_release (&reclaim.l);
 
-          free_map_release (inode->sector, 1);
-          free(disk_data);
-          free(indirect_node);
-          free(indirect_node2);
+      reclaim_inode (&batch, inode);
 
+      lock_acquire (&reclaim.l);
+      if (list_empty (&reclaim.inodes))
+        {
+          lock_release (&reclaim.l);
+          reclaim_flush (&batch);
+          lock_acquire (&reclaim.l);
         }
-
+      reclaim.busy = false;
+      if (list_empty (&reclaim.inodes))
+        cond_broadcast (&reclaim.idle, &reclaim.l);
+      lock_release (&reclaim.l);
     }
 }
 
+/* Waits until the reclaim thread has freed the sectors of every
+   removed inode closed so far. */
+static void
+reclaim_wait (void)
+{
+  lock_acquire (&reclaim.l);
+  while (!list_empty (&reclaim.inodes) || reclaim.busy)
+    cond_wait (&reclaim.idle, &reclaim.l);
+  lock_release (&reclaim.l);
+}
+
 /* Marks INODE to be deleted when it is closed by the last caller who
    has it open. */
 void
@@ -594,6 +1138,182 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
+/* Gives sectors to the blocks of INODE written but not yet
+   allocated, so that writing back the cache puts them on disk. */
+void
+inode_flush (struct inode *inode)
+{
+  bool use_lock = !lock_held_by_current_thread (&inode->l);
+
+  if (inode->tmp != NULL)
+    return;
+  journal_begin ();
+  if (use_lock)
+    lock_acquire (&inode->l);
+  delalloc_flush (inode);
+  if (use_lock)
+    lock_release (&inode->l);
+  journal_end ();
+}
+
+/* Calls inode_flush() on every open inode.  Each is reopened
+   while the table is locked and flushed after, so that no inode
+   lock is taken while holding the table's.  Also waits for the
+   blocks of removed inodes to be freed, so that the free map
+   written back afterward is complete. */
+void
+inode_flush_all (void)
+{
+  struct inode **inodes;
+  struct hash_iterator i;
+  size_t cnt = 0, j;
+
+  reclaim_wait ();
+  lock_acquire (&open_inodes_lock);
+  inodes = malloc (hash_size (&open_inodes) * sizeof *inodes);
+  if (inodes != NULL)
+    {
+      hash_first (&i, &open_inodes);
+      while (hash_next (&i))
+        {
+          struct inode *inode = hash_entry (hash_cur (&i), struct inode, elem);
+          inode->open_cnt++;
+          inodes[cnt++] = inode;
+        }
+    }
+  lock_release (&open_inodes_lock);
+
+  for (j = 0; j < cnt; j++)
+    {
+      inode_flush (inodes[j]);
+      inode_close (inodes[j]);
+    }
+  free (inodes);
+}
+
+/* Asks the cache to prefetch the READAHEAD_SECTORS sectors of
+   INODE that follow byte offset POS, skipping any already
+   requested by an earlier call.  INODE's lock must be held. */
+static void
+inode_readahead (struct inode *inode, off_t pos)
+{
+  off_t first = ROUND_UP (pos, BLOCK_SECTOR_SIZE);
+  off_t limit = first + READAHEAD_SECTORS * BLOCK_SECTOR_SIZE;
+  off_t length = inode_length (inode);
+  off_t ofs;
+
+  if (limit > length)
+    limit = length;
+
+  /* Start over if the window moved away from earlier requests. */
+  if (inode->readahead_ofs < first || inode->readahead_ofs > limit)
+    inode->readahead_ofs = first;
+
+  for (ofs = inode->readahead_ofs; ofs < limit; ofs += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = byte_to_sector (inode, ofs);
+      if (sector != 0)
+        cache_readahead (sector);
+    }
+  inode->readahead_ofs = ofs;
+}
+
+/* Asks the cache to read the LEN bytes of INODE starting at byte
+   offset OFS in the background, handing each run of physically
+   consecutive sectors to the read-ahead thread as one request.
+   At most half of the cache is requested, so that a large file
+   cannot push out the blocks of everybody else. */
+void
+inode_prefetch (struct inode *inode, off_t ofs, off_t len)
+{
+  off_t limit = ROUND_UP (ofs + len, BLOCK_SECTOR_SIZE);
+  off_t max_len = (off_t) (cache_block_cnt / 2) * BLOCK_SECTOR_SIZE;
+  block_sector_t run_start = 0;
+  size_t run_cnt = 0;
+
+  if (ofs < 0 || len <= 0 || inode->tmp != NULL)
+    return;
+  ofs = ROUND_DOWN (ofs, BLOCK_SECTOR_SIZE);
+  if (limit - ofs > max_len)
+    limit = ofs + max_len;
+
+  lock_acquire (&inode->l);
+  if (limit > inode_length (inode))
+    limit = inode_length (inode);
+  for (; ofs < limit; ofs += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = byte_to_sector (inode, ofs);
+      if (sector == 0)
+        continue;
+      if (run_cnt > 0 && sector != run_start + run_cnt)
+        {
+          cache_readahead_run (run_start, run_cnt);
+          run_cnt = 0;
+        }
+      if (run_cnt == 0)
+        run_start = sector;
+      run_cnt++;
+    }
+  lock_release (&inode->l);
+
+  cache_readahead_run (run_start, run_cnt);
+}
+
+/* Makes INODE's length, as seen by inode_length(), catch up with
+   its block map, once a write has put the data up to there in
+   place.  INODE's lock must be held. */
+static void
+length_publish (struct inode *inode)
+{
+  ASSERT (lock_held_by_current_thread (&inode->l));
+  if (inode->length == inode->data.length)
+    return;
+  inode->length_seq++;
+  barrier ();
+  inode->length = inode->data.length;
+  barrier ();
+  inode->length_seq++;
+}
+
+/* Locks bytes START up to END of INODE into R, for writing if
+   WRITE is true, waiting while any locked range overlaps it and
+   either of the two is a writer. */
+static void
+range_lock (struct inode *inode, struct range *r, off_t start, off_t end,
+            bool write)
+{
+  struct list_elem *e;
+
+  r->start = start;
+  r->end = end;
+  r->write = write;
+  lock_acquire (&inode->ranges_lock);
+  e = list_begin (&inode->ranges);
+  while (e != list_end (&inode->ranges))
+    {
+      struct range *held = list_entry (e, struct range, elem);
+      if ((write || held->write) && held->start < end && start < held->end)
+        {
+          cond_wait (&inode->range_released, &inode->ranges_lock);
+          e = list_begin (&inode->ranges);
+        }
+      else
+        e = list_next (e);
+    }
+  list_push_back (&inode->ranges, &r->elem);
+  lock_release (&inode->ranges_lock);
+}
+
+/* Unlocks range R of INODE. */
+static void
+range_unlock (struct inode *inode, struct range *r)
+{
+  lock_acquire (&inode->ranges_lock);
+  list_remove (&r->elem);
+  cond_broadcast (&inode->range_released, &inode->ranges_lock);
+  lock_release (&inode->ranges_lock);
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
@@ -602,82 +1322,204 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-
-  if (inode_length(inode) < (offset + size)) {
+  off_t start = offset;
+  off_t length;
+  struct range r;
+
+  if (inode->tmp != NULL)
+    return tmpfs_read_at (inode->tmp, buffer, size, offset);
+  length = inode_length (inode);
+  if (offset >= length)
     return 0;
-  }
-
+  if (size > length - offset)
+    size = length - offset;
 
+  range_lock (inode, &r, offset, offset + size, false);
   while (size > 0)
     {
-      /* Disk sector to read, starting byte offset within sector. */
+      /* Disk sector to read, starting byte offset within sector,
+         looked up under the short lock. */
       lock_acquire(&inode->l);
       block_sector_t sector_idx = byte_to_sector (inode, offset);
-      lock_release(&inode->l);
-
-      if (sector_idx == 0) {
-        break;
-      }
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      lock_acquire(&inode->l);
       off_t inode_left = inode_length (inode) - offset;
-      lock_release(&inode->l);
-
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
       /* Number of bytes to actually copy out of this sector. */
       int chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
-        break;
+        {
+          lock_release(&inode->l);
+          break;
+        }
 
-      cache_read (sector_idx, buffer + bytes_read, chunk_size, sector_ofs);
+      // A hole reads as zeros without touching the disk, unless
+      // it has been written and is waiting for a sector
+      if (sector_idx == 0) {
+        const uint8_t *pending = delalloc_lookup (inode, offset / BLOCK_SECTOR_SIZE);
+        if (uses_inline (&inode->data)) {
+          memcpy (buffer + bytes_read, inode->data.inline_data + offset, chunk_size);
+        } else if (pending != NULL) {
+          memcpy (buffer + bytes_read, pending + sector_ofs, chunk_size);
+        } else {
+          memset (buffer + bytes_read, 0, chunk_size);
+        }
+        lock_release(&inode->l);
+      } else {
+        lock_release(&inode->l);
+        cache_read (sector_idx, buffer + bytes_read, chunk_size, sector_ofs, inode_class (inode));
+      }
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
+  range_unlock (inode, &r);
+
+  /* Prefetch ahead of sequential readers so that they find the
+     following sectors already cached. */
+  if (bytes_read > 0)
+    {
+      lock_acquire(&inode->l);
+      if (start == inode->next_read_ofs)
+        inode_readahead (inode, offset);
+      inode->next_read_ofs = offset;
+      lock_release(&inode->l);
+    }
+
+  return bytes_read;
+}
+
+/* Reads SIZE bytes from INODE into BUFFER, starting at sector
+   aligned OFFSET, like inode_read_at(), for a caller that keeps
+   the data itself, in practice a frame holding a page of a file.
+   Sectors already in the buffer cache are copied from there; the
+   rest are read straight into BUFFER, each stretch of contiguous
+   sectors with one request, and never take up cache blocks, so
+   the page is held in memory once.  The range lock keeps writers
+   away meanwhile, so the disk is up to date for every sector not
+   in the cache.
+   Returns the number of bytes actually read, which is 0 if the
+   range is not all within INODE. */
+off_t
+inode_read_page (struct inode *inode, void *buffer_, off_t size, off_t offset)
+{
+  uint8_t *buffer = buffer_;
+  off_t bytes_read = 0;
+  struct range r;
+
+  if (inode->tmp != NULL || offset % BLOCK_SECTOR_SIZE != 0)
+    return inode_read_at (inode, buffer, size, offset);
+  if (inode_length (inode) < offset + size)
+    return 0;
+
+  range_lock (inode, &r, offset, offset + size, false);
+  while (bytes_read < size)
+    {
+      off_t pos = offset + bytes_read;
+      off_t chunk_size = size - bytes_read;
+      size_t cnt = 1;
+
+      lock_acquire(&inode->l);
+      block_sector_t sector_idx = byte_to_sector (inode, pos);
+      if (sector_idx == 0)
+        {
+          /* A hole, or data not yet on disk, as inode_read_at(). */
+          const uint8_t *pending = delalloc_lookup (inode, pos / BLOCK_SECTOR_SIZE);
+          if (chunk_size > BLOCK_SECTOR_SIZE)
+            chunk_size = BLOCK_SECTOR_SIZE;
+          if (uses_inline (&inode->data))
+            memcpy (buffer + bytes_read, inode->data.inline_data + pos, chunk_size);
+          else if (pending != NULL)
+            memcpy (buffer + bytes_read, pending, chunk_size);
+          else
+            memset (buffer + bytes_read, 0, chunk_size);
+          lock_release(&inode->l);
+          bytes_read += chunk_size;
+          continue;
+        }
+
+      /* Gather the whole sectors that follow on disk. */
+      while ((off_t) (cnt + 1) * BLOCK_SECTOR_SIZE <= chunk_size
+             && byte_to_sector (inode, pos + cnt * BLOCK_SECTOR_SIZE)
+                == sector_idx + cnt)
+        cnt++;
+      lock_release(&inode->l);
+
+      if (chunk_size < BLOCK_SECTOR_SIZE)
+        {
+          /* A partial last sector goes through a bounce buffer. */
+          uint8_t sector[BLOCK_SECTOR_SIZE];
+          cache_read_direct (sector_idx, 1, sector, inode_class (inode));
+          memcpy (buffer + bytes_read, sector, chunk_size);
+        }
+      else
+        {
+          chunk_size = cnt * BLOCK_SECTOR_SIZE;
+          cache_read_direct (sector_idx, cnt, buffer + bytes_read,
+                             inode_class (inode));
+        }
+      bytes_read += chunk_size;
+    }
+  range_unlock (inode, &r);
 
   return bytes_read;
 }
 
-/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   growing INODE first if the write ends past end of file.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if an error occurs. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset)
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
+  struct range r;
 
 
   if (inode->deny_write_cnt) {
     return 0;
   }
-
-  // Prevent double locking
+  if (inode->tmp != NULL)
+    return tmpfs_write_at (inode->tmp, buffer, size, offset);
+
+  // Prevent double locking.  A caller that holds the short lock
+  // already excludes everyone else, and must not wait for a range
+  // whose holder may need that lock.  The range is taken before
+  // joining the journal, so that no one waits for it from within
+  // an operation.
   bool use_lock = !lock_held_by_current_thread (&inode->l);
 
+  if (use_lock) {
+    range_lock (inode, &r, offset, offset + size, true);
+  }
+  journal_begin ();
   if (use_lock) {
     lock_acquire(&inode->l);
   }
   
-  if (inode_length(inode) < (offset + size)) {
-    struct inode_disk disk_data;
-    cache_read (inode->sector, &disk_data, BLOCK_SECTOR_SIZE, 0);
-    if (!extend_inode_disk(&disk_data, offset + size)) {
+  if (inode->data.length < (offset + size)) {
+    /* Grow the in-memory inode, then write it through.  Readers
+       of the rest of the file wait only for this, not for the
+       data written below. */
+    bool extended = inode_grow(inode, offset + size);
+    cache_write(inode->sector, &inode->data, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INODE);
+    if (!extended) {
       if (use_lock) {
         lock_release(&inode->l);
       }
+      journal_end ();
+      if (use_lock) {
+        range_unlock (inode, &r);
+      }
       return 0;
     }
-    cache_write(inode->sector, &disk_data, BLOCK_SECTOR_SIZE, 0);
   }
 
   if (use_lock) {
@@ -691,35 +1533,45 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
         lock_acquire(&inode->l);
       }
 
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
-      if (use_lock) {
-        lock_release(&inode->l);
-      }
-
-      ASSERT (sector_idx != 0);
-
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      if (use_lock) {
-        lock_acquire(&inode->l);
+      off_t inode_left = inode->data.length - offset;
+      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      /* Number of bytes to actually write into this sector. */
+      int chunk_size = size < min_left ? size : min_left;
+
+      /* A hole is written into the delayed allocation run while the
+         lock is held, since the run may be flushed once it is not,
+         or else filled with a sector of its own right away. */
+      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      uint8_t *pending = NULL;
+      if (chunk_size > 0 && uses_inline (&inode->data)) {
+        pending = inode->data.inline_data;
+      } else if (chunk_size > 0 && sector_idx == 0 && uses_delalloc (inode)) {
+        pending = delalloc_slot (inode, offset / BLOCK_SECTOR_SIZE);
+      }
+      if (pending != NULL) {
+        memcpy (pending + sector_ofs, buffer + bytes_written, chunk_size);
+        if (uses_inline (&inode->data)) {
+          cache_write(inode->sector, &inode->data, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INODE);
+        }
+      } else if (chunk_size > 0 && sector_idx == 0 && !uses_extents (&inode->data)) {
+        sector_idx = allocate_block (inode, offset / BLOCK_SECTOR_SIZE);
       }
 
-      off_t inode_left = inode_length (inode) - offset;
-      
       if (use_lock) {
         lock_release(&inode->l);
       }
 
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
-      /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0) {
+      if (chunk_size <= 0 || (sector_idx == 0 && pending == NULL)) {
         break;
       }
 
-      cache_write (sector_idx, buffer + bytes_written, chunk_size, sector_ofs);
+      if (pending == NULL) {
+        cache_write (sector_idx, buffer + bytes_written, chunk_size, sector_ofs, inode_class (inode));
+      }
 
       /* Advance. */
       size -= chunk_size;
@@ -727,9 +1579,337 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       bytes_written += chunk_size;
     }
 
+  /* Only now may readers see past the old end of file. */
+  if (use_lock) {
+    lock_acquire(&inode->l);
+  }
+  length_publish (inode);
+  if (use_lock) {
+    lock_release(&inode->l);
+  }
+
+  journal_end ();
+  if (use_lock) {
+    range_unlock (inode, &r);
+  }
+  return bytes_written;
+}
+
+/* Returns the total length of the IOVCNT buffers in IOV. */
+static off_t
+iov_total (const struct iovec *iov, int iovcnt)
+{
+  off_t total = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  return total;
+}
+
+/* Moves SIZE bytes between INODE, starting at OFFSET, and the
+   IOVCNT buffers in IOV, which must hold at least SIZE bytes in
+   all.  Copies into the buffers if WRITE is false, out of them
+   otherwise.  Each sector is looked up and pinned once, however
+   many buffers it spans.  The caller must hold a range lock
+   covering the transfer; INODE's short lock is taken for each
+   sector's lookup, and held across the copy only for data that
+   lives in the inode itself.
+   Returns the number of bytes moved. */
+static off_t
+inode_xfer_vec (struct inode *inode, const struct iovec *iov, int iovcnt,
+                off_t offset, off_t size, bool write)
+{
+  int seg = 0;
+  size_t seg_ofs = 0;
+  off_t done = 0;
+
+  while (done < size)
+    {
+      /* Disk sector, starting byte offset within sector.  A hole
+         reads as zeros, and is filled in when written. */
+      lock_acquire(&inode->l);
+      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      uint8_t *pending = NULL;
+      if (uses_inline (&inode->data))
+        pending = inode->data.inline_data;
+      else if (sector_idx == 0)
+        pending = (write && uses_delalloc (inode)
+                   ? delalloc_slot (inode, offset / BLOCK_SECTOR_SIZE)
+                   : delalloc_lookup (inode, offset / BLOCK_SECTOR_SIZE));
+      if (sector_idx == 0 && pending == NULL && write
+          && !uses_extents (&inode->data))
+        sector_idx = allocate_block (inode, offset / BLOCK_SECTOR_SIZE);
+      int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+
+      /* Bytes left in inode, bytes left in sector, lesser of the two. */
+      off_t inode_left = (write ? inode->data.length : inode_length (inode))
+                         - offset;
+      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      int chunk_size = size - done < min_left ? size - done : min_left;
+      if (chunk_size <= 0 || (sector_idx == 0 && pending == NULL && write))
+        {
+          lock_release(&inode->l);
+          break;
+        }
+
+      /* Data held by the inode may move once the lock is dropped,
+         so it is copied under the lock.  A sector is pinned in the
+         cache without it. */
+      struct cache_block *block = NULL;
+      uint8_t *dst = pending;
+      const uint8_t *src = pending != NULL ? pending : zero_sector;
+      if (sector_idx != 0)
+        {
+          lock_release(&inode->l);
+          block = cache_get (sector_idx, write ? CACHE_WRITE : CACHE_READ,
+                             inode_class (inode));
+          dst = block->data;
+          src = block->data;
+        }
+      int copied = 0;
+      while (copied < chunk_size)
+        {
+          while (seg_ofs == iov[seg].iov_len)
+            {
+              ASSERT (seg + 1 < iovcnt);
+              seg++;
+              seg_ofs = 0;
+            }
+
+          size_t n = iov[seg].iov_len - seg_ofs;
+          if (n > (size_t) (chunk_size - copied))
+            n = chunk_size - copied;
+
+          uint8_t *buf = (uint8_t *) iov[seg].iov_base + seg_ofs;
+          if (write)
+            memcpy (dst + sector_ofs + copied, buf, n);
+          else
+            memcpy (buf, src + sector_ofs + copied, n);
+          copied += n;
+          seg_ofs += n;
+        }
+      if (block != NULL)
+        cache_put (block);
+      else
+        lock_release(&inode->l);
+
+      /* Advance. */
+      offset += chunk_size;
+      done += chunk_size;
+    }
+  return done;
+}
+
+/* Moves data between memory-only INODE, starting at OFFSET, and
+   the IOVCNT buffers in IOV, one buffer at a time.  Copies into
+   the buffers if WRITE is false, out of them otherwise.  Returns
+   the number of bytes moved. */
+static off_t
+tmpfs_xfer_vec (struct inode *inode, const struct iovec *iov, int iovcnt,
+                off_t offset, bool write)
+{
+  off_t done = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    {
+      off_t n = (write
+                 ? tmpfs_write_at (inode->tmp, iov[i].iov_base,
+                                   iov[i].iov_len, offset + done)
+                 : tmpfs_read_at (inode->tmp, iov[i].iov_base,
+                                  iov[i].iov_len, offset + done));
+      done += n;
+      if (n < (off_t) iov[i].iov_len)
+        break;
+    }
+  return done;
+}
+
+/* Reads from INODE, starting at position OFFSET, into the IOVCNT
+   buffers in IOV, filling each in turn.  Like inode_read_at(),
+   but takes one range lock for the whole transfer.
+   Returns the number of bytes actually read, which may be less
+   than requested if an error occurs or end of file is reached. */
+off_t
+inode_read_at_vec (struct inode *inode, const struct iovec *iov, int iovcnt,
+                   off_t offset)
+{
+  off_t size = iov_total (iov, iovcnt);
+  off_t bytes_read;
+  struct range r;
+
+  if (inode->tmp != NULL)
+    return tmpfs_xfer_vec (inode, iov, iovcnt, offset, false);
+  if (inode_length(inode) < (offset + size)) {
+    return 0;
+  }
+
+  range_lock (inode, &r, offset, offset + size, false);
+  bytes_read = inode_xfer_vec (inode, iov, iovcnt, offset, size, false);
+  range_unlock (inode, &r);
+
+  /* Prefetch ahead of sequential readers, as inode_read_at(). */
+  if (bytes_read > 0)
+    {
+      lock_acquire(&inode->l);
+      if (offset == inode->next_read_ofs)
+        inode_readahead (inode, offset + bytes_read);
+      inode->next_read_ofs = offset + bytes_read;
+      lock_release(&inode->l);
+    }
+
+  return bytes_read;
+}
+
+/* Writes the IOVCNT buffers in IOV into INODE, one after another,
+   starting at OFFSET, growing INODE as needed.  Like
+   inode_write_at(), but takes one range lock for the whole
+   transfer.
+   Returns the number of bytes actually written, which may be
+   less than requested if an error occurs. */
+off_t
+inode_write_at_vec (struct inode *inode, const struct iovec *iov, int iovcnt,
+                    off_t offset)
+{
+  off_t size = iov_total (iov, iovcnt);
+  off_t bytes_written;
+  struct range r;
+
+  if (inode->deny_write_cnt) {
+    return 0;
+  }
+  if (inode->tmp != NULL)
+    return tmpfs_xfer_vec (inode, iov, iovcnt, offset, true);
+
+  range_lock (inode, &r, offset, offset + size, true);
+  journal_begin ();
+  lock_acquire(&inode->l);
+  if (inode->data.length < (offset + size)) {
+    /* Grow the in-memory inode, then write it through. */
+    bool extended = inode_grow(inode, offset + size);
+    cache_write(inode->sector, &inode->data, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INODE);
+    if (!extended) {
+      lock_release(&inode->l);
+      journal_end ();
+      range_unlock (inode, &r);
+      return 0;
+    }
+  }
+  lock_release(&inode->l);
+
+  bytes_written = inode_xfer_vec (inode, iov, iovcnt, offset, size, true);
+  lock_acquire(&inode->l);
+  if (uses_inline (&inode->data) && bytes_written > 0) {
+    cache_write(inode->sector, &inode->data, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INODE);
+  }
+  length_publish (inode);
+  lock_release(&inode->l);
+  journal_end ();
+  range_unlock (inode, &r);
+
   return bytes_written;
 }
 
+/* Moves the data blocks of INODE, if they lie in more than one
+   run of sectors, to a single run of consecutive sectors, so that
+   reading the file in order reads the disk in order.  Holes stay
+   holes.  Files held inline, directories, the free map and
+   memory-only files are left alone.
+
+   The blocks are copied through the cache, and the copies are
+   written to disk before the block map is switched over to them
+   in one journal operation with the release of the old sectors.
+   A crash therefore leaves the file on one copy or the other,
+   never a mix; one before the switch leaks the new sectors.
+   Reads and writes of INODE wait meanwhile.  Returns true if
+   INODE was moved. */
+bool
+inode_defrag (struct inode *inode)
+{
+  uint8_t buffer[BLOCK_SECTOR_SIZE];
+  block_sector_t *old = NULL;
+  block_sector_t first = 0, prev = 0;
+  size_t block_cnt, cnt = 0, runs = 0, i, j;
+  struct range r;
+  bool moved = false;
+
+  if (inode->tmp != NULL || inode->is_dir || inode->sector == FREE_MAP_SECTOR)
+    return false;
+
+  range_lock (inode, &r, 0, INT_MAX, true);
+
+  /* Blocks waiting for sectors get them first, so they move too. */
+  journal_begin ();
+  lock_acquire (&inode->l);
+  delalloc_flush (inode);
+  lock_release (&inode->l);
+  journal_end ();
+
+  /* Note each block's sector, 0 for a hole, and count the runs. */
+  block_cnt = bytes_to_sectors (inode->data.length);
+  if (uses_inline (&inode->data) || block_cnt == 0)
+    goto done;
+  old = malloc (block_cnt * sizeof *old);
+  if (old == NULL)
+    goto done;
+  lock_acquire (&inode->l);
+  for (i = 0; i < block_cnt; i++)
+    {
+      old[i] = byte_to_sector (inode, i * BLOCK_SECTOR_SIZE);
+      if (old[i] == 0)
+        continue;
+      if (cnt++ == 0 || old[i] != prev + 1)
+        runs++;
+      prev = old[i];
+    }
+  lock_release (&inode->l);
+  if (runs <= 1)
+    goto done;
+
+  journal_begin ();
+  moved = free_map_allocate (cnt, &first);
+  journal_end ();
+  if (!moved)
+    goto done;
+
+  for (i = j = 0; i < block_cnt; i++)
+    if (old[i] != 0)
+      {
+        cache_read (old[i], buffer, BLOCK_SECTOR_SIZE, 0, FS_CLASS_FILE);
+        cache_write (first + j++, buffer, BLOCK_SECTOR_SIZE, 0, FS_CLASS_FILE);
+      }
+  cache_writeback ();
+
+  journal_begin ();
+  lock_acquire (&inode->l);
+  if (uses_extents (&inode->data))
+    {
+      inode->data.extent_cnt = 1;
+      inode->data.extents[0].first = 0;
+      inode->data.extents[0].start = first;
+      cache_write (inode->sector, &inode->data, BLOCK_SECTOR_SIZE, 0, FS_CLASS_INODE);
+    }
+  else
+    for (i = j = 0; i < block_cnt; i++)
+      if (old[i] != 0)
+        relink_block (inode, i, first + j++);
+  lock_release (&inode->l);
+
+  /* Gather the old sectors to the front and free them. */
+  for (i = j = 0; i < block_cnt; i++)
+    if (old[i] != 0)
+      old[j++] = old[i];
+  free_map_release_batch (old, cnt);
+  journal_end ();
+
+ done:
+  range_unlock (inode, &r);
+  free (old);
+  return moved;
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
@@ -750,13 +1930,81 @@ inode_allow_write (struct inode *inode)
   inode->deny_write_cnt--;
 }
 
-/* Returns the length, in bytes, of INODE's data. */
+/* Returns the length, in bytes, of INODE's data, as far as it
+   has been written.  Takes no lock: if a writer publishes a new
+   length meanwhile, just reads it again. */
 off_t
 inode_length (const struct inode *inode)
 { 
-  struct inode_disk disk_data;
-  cache_read (inode->sector, &disk_data, BLOCK_SECTOR_SIZE, 0);
-  return disk_data.length;
+  unsigned seq;
+  off_t length;
+
+  if (inode->tmp != NULL)
+    return tmpfs_length (inode->tmp);
+  for (;;)
+    {
+      seq = inode->length_seq;
+      barrier ();
+      length = inode->length;
+      barrier ();
+      if (seq % 2 == 0 && seq == inode->length_seq)
+        return length;
+      if (seq % 2 != 0)
+        thread_yield ();
+    }
+}
+
+/* Return true if INODE maps its data with extents. */
+bool
+inode_has_extents (const struct inode *inode)
+{
+  return inode->tmp == NULL && uses_extents (&inode->data);
+}
+
+/* Stores INODE's size, type and inode number in *ST. */
+void
+inode_get_stat (const struct inode *inode, struct stat *st)
+{
+  st->inumber = inode->sector;
+  st->size = inode_length (inode);
+  st->is_dir = inode->is_dir;
+}
+
+/* Stores the size, type and inode number of the inode in SECTOR
+   in *ST, read in place from the cache, without opening it.  An
+   open inode's changes are written through to the cache, so this
+   agrees with inode_get_stat(). */
+void
+inode_stat (block_sector_t sector, struct stat *st)
+{
+  struct cache_block *block;
+  const struct inode_disk *disk_data;
+
+  if (tmpfs_owns (sector))
+    {
+      struct inode *inode = inode_open (sector);
+      if (inode != NULL)
+        inode_get_stat (inode, st);
+      else
+        memset (st, 0, sizeof *st);
+      inode_close (inode);
+      return;
+    }
+
+  block = cache_get (sector, CACHE_READ, FS_CLASS_INODE);
+  disk_data = (const struct inode_disk *) block->data;
+  st->inumber = sector;
+  st->size = disk_data->length;
+  st->is_dir = disk_data->is_dir;
+  cache_put (block);
+}
+
+/* Returns INODE's memory-only inode, or a null pointer if INODE
+   is on disk. */
+struct tmpfs_node *
+inode_get_tmpfs (const struct inode *inode)
+{
+  return inode->tmp;
 }
 
 /* Return true if inode is a directory. */
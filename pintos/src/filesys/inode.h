@@ -2,10 +2,34 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
 
 struct bitmap;
+struct tmpfs_node;
+
+/* One buffer of a vectored read or write. */
+struct iovec
+  {
+    void *iov_base;                     /* Start of buffer. */
+    size_t iov_len;                     /* Length of buffer in bytes. */
+  };
+
+/* A file's size, type and inode number, laid out as in the user
+   library's <syscall.h>. */
+struct stat
+  {
+    block_sector_t inumber;             /* Sector of the file's inode. */
+    off_t size;                         /* File size in bytes. */
+    bool is_dir;                        /* True if a directory. */
+  };
+
+/* True if new inodes map their data with extents instead of
+   indirect blocks.  Chosen by the "-extents" kernel command-line
+   option when formatting, and read back from the root directory
+   when an existing file system is mounted. */
+extern bool inode_use_extents;
 
 void inode_init (void);
 bool inode_create (block_sector_t, off_t, bool is_dir);
@@ -14,11 +38,23 @@ struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+void inode_flush (struct inode *);
+void inode_flush_all (void);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+off_t inode_read_page (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+void inode_prefetch (struct inode *, off_t ofs, off_t len);
+bool inode_defrag (struct inode *);
+off_t inode_read_at_vec (struct inode *, const struct iovec *, int iovcnt,
+                         off_t offset);
+off_t inode_write_at_vec (struct inode *, const struct iovec *, int iovcnt,
+                          off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
+bool inode_has_extents (const struct inode *);
+void inode_get_stat (const struct inode *, struct stat *);
+void inode_stat (block_sector_t, struct stat *);
 
 /* Helper Functions for Project 3 */
 
@@ -41,6 +77,9 @@ off_t doubly_indirect_index_1(off_t n);
 /* Return the second level index into doubly indirect pointers for Nth data block. */
 off_t doubly_indirect_index_2(off_t n);
 
+/* Memory-only inodes, which live in filesys/tmpfs.c. */
+struct tmpfs_node *inode_get_tmpfs (const struct inode *);
+
 /* Return true if inode is a directory. */
 bool inode_isdir (const struct inode *inode);
 
@@ -0,0 +1,172 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* The metadata journal.
+
+   File system metadata (inodes, indirect blocks, directory
+   entries, and the free map) reaches its home sectors only by way
+   of the journal.  The cache writes a batch of dirty metadata
+   sectors into the journal area, then commits them by writing
+   the header sector, which names their homes, then writes them
+   home, then clears the header.  A crash before the header is
+   written leaves the old metadata in place; a crash after it is
+   repaired at the next boot by copying the images home again.
+   Either way recovery reads only the journal, however large the
+   disk.
+
+   A batch must not catch an operation half done, so each
+   operation that changes metadata runs between journal_begin()
+   and journal_end(), and the cache brackets a commit with
+   journal_freeze() and journal_thaw(), which waits for those in
+   progress to end and holds off new ones. */
+
+/* Marks a header that describes a committed transaction. */
+#define JOURNAL_MAGIC 0x4a524e4c
+
+/* The journal's first sector.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_header
+  {
+    uint32_t magic;                     /* JOURNAL_MAGIC if committed. */
+    uint32_t cnt;                       /* Sector images that follow. */
+    block_sector_t homes[JOURNAL_CAPACITY]; /* Where each image belongs. */
+  };
+
+static struct lock journal_lock;        /* Guards ACTIVE and FROZEN. */
+static struct condition idle;           /* Signaled when ACTIVE drops to 0. */
+static struct condition thawed;         /* Signaled when FROZEN clears. */
+static int active;                      /* Operations in progress. */
+static bool frozen;                     /* True while a batch is taken. */
+
+/* Header buffer.  Commits are serialized by the cache. */
+static struct journal_header header;
+
+static void replay (void);
+
+/* Initializes the journal.  If FORMAT is true, the journal area
+   is emptied; otherwise, a transaction committed before a crash
+   is written home. */
+void
+journal_init (bool format)
+{
+  ASSERT (sizeof header == BLOCK_SECTOR_SIZE);
+
+  lock_init (&journal_lock);
+  cond_init (&idle);
+  cond_init (&thawed);
+  active = 0;
+  frozen = false;
+
+  if (format)
+    journal_clear ();
+  else
+    replay ();
+}
+
+/* Marks the start of an operation that changes metadata.  Calls
+   may nest. */
+void
+journal_begin (void)
+{
+  lock_acquire (&journal_lock);
+  while (frozen)
+    cond_wait (&thawed, &journal_lock);
+  active++;
+  lock_release (&journal_lock);
+}
+
+/* Marks the end of an operation begun with journal_begin(). */
+void
+journal_end (void)
+{
+  lock_acquire (&journal_lock);
+  ASSERT (active > 0);
+  if (--active == 0)
+    cond_broadcast (&idle, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Waits until no operation is in progress and keeps new ones
+   from starting until journal_thaw(), so that the metadata in the
+   cache is consistent while a batch of it is taken.  Must not be
+   called from within an operation. */
+void
+journal_freeze (void)
+{
+  lock_acquire (&journal_lock);
+  while (active > 0)
+    cond_wait (&idle, &journal_lock);
+  frozen = true;
+  lock_release (&journal_lock);
+}
+
+/* Lets operations held off by journal_freeze() go ahead. */
+void
+journal_thaw (void)
+{
+  lock_acquire (&journal_lock);
+  frozen = false;
+  cond_broadcast (&thawed, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Writes the CNT sector images in IMAGES, which belong in sectors
+   HOMES[0...CNT-1], to the journal and commits them.  Once this
+   returns, the caller may write them home, and then must call
+   journal_clear(). */
+void
+journal_commit (const block_sector_t homes[], const void *images,
+                size_t cnt)
+{
+  ASSERT (cnt > 0 && cnt <= JOURNAL_CAPACITY);
+
+  block_write_multiple (fs_device, JOURNAL_SECTOR + 1, cnt, images);
+
+  memset (&header, 0, sizeof header);
+  header.magic = JOURNAL_MAGIC;
+  header.cnt = cnt;
+  memcpy (header.homes, homes, cnt * sizeof *homes);
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+}
+
+/* Empties the journal, once its transaction is home. */
+void
+journal_clear (void)
+{
+  memset (&header, 0, sizeof header);
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+}
+
+/* Writes home the transaction in the journal, if one was
+   committed and not cleared, and empties the journal. */
+static void
+replay (void)
+{
+  uint8_t *image;
+  size_t i;
+
+  block_read (fs_device, JOURNAL_SECTOR, &header);
+  if (header.magic != JOURNAL_MAGIC)
+    return;
+  if (header.cnt > JOURNAL_CAPACITY)
+    PANIC ("journal header is corrupt");
+
+  image = malloc (BLOCK_SECTOR_SIZE);
+  if (image == NULL)
+    PANIC ("can't allocate journal replay buffer");
+  for (i = 0; i < header.cnt; i++)
+    {
+      block_read (fs_device, JOURNAL_SECTOR + 1 + i, image);
+      block_write (fs_device, header.homes[i], image);
+    }
+  free (image);
+  printf ("journal: replayed %"PRIu32" sectors\n", header.cnt);
+
+  journal_clear ();
+}
@@ -0,0 +1,26 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+/* The metadata journal occupies JOURNAL_SECTORS sectors starting
+   at JOURNAL_SECTOR (see filesys.h): a header sector, then room
+   for the images of JOURNAL_CAPACITY sectors. */
+#define JOURNAL_CAPACITY 126
+#define JOURNAL_SECTORS (1 + JOURNAL_CAPACITY)
+
+void journal_init (bool format);
+
+void journal_begin (void);
+void journal_end (void);
+
+void journal_freeze (void);
+void journal_thaw (void);
+
+void journal_commit (const block_sector_t homes[], const void *images,
+                     size_t cnt);
+void journal_clear (void);
+
+#endif /* filesys/journal.h */
@@ -0,0 +1,387 @@
+#include "filesys/tmpfs.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <round.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* A memory-only inode.  A file's data lives in whole pages from
+   the user pool, allocated as they are first written, so a hole
+   costs nothing.  A directory's entries live in a hash table
+   instead of in file data.  Nothing is ever written to disk. */
+struct tmpfs_node
+  {
+    block_sector_t inumber;             /* Inode number. */
+    bool is_dir;                        /* True if a directory. */
+    struct hash_elem elem;              /* Element in NODES. */
+
+    struct lock lock;                   /* Guards the members below. */
+    off_t length;                       /* File size in bytes. */
+    uint8_t **pages;                    /* Data pages, null for holes. */
+    size_t page_cnt;                    /* Elements in PAGES. */
+    struct hash entries;                /* Directory entries, by name. */
+    struct list order;                  /* Directory entries, oldest first. */
+    unsigned next_seq;                  /* Sequence number of next entry. */
+  };
+
+/* A directory entry. */
+struct tmpfs_entry
+  {
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    block_sector_t inumber;             /* Inode number. */
+    unsigned seq;                       /* Order added, counting from 1.
+                                           Readdir positions are these. */
+    struct hash_elem hash_elem;         /* Element in node's ENTRIES. */
+    struct list_elem list_elem;         /* Element in node's ORDER. */
+  };
+
+/* Every memory-only inode, by inode number.  A node stays here,
+   open or not, until it is deleted. */
+static struct hash nodes;
+
+/* Guards NODES and NEXT_INUMBER. */
+static struct lock nodes_lock;
+
+/* Number for the next inode created.  Never reused, so a stale
+   number finds nothing rather than another file. */
+static block_sector_t next_inumber = TMPFS_INUMBER_MIN;
+
+static hash_hash_func node_hash;
+static hash_less_func node_less;
+static hash_hash_func entry_hash;
+static hash_less_func entry_less;
+static hash_action_func entry_free;
+
+/* Initializes the memory-only file system, which starts out
+   empty. */
+void
+tmpfs_init (void)
+{
+  if (!hash_init (&nodes, node_hash, node_less, NULL))
+    PANIC ("tmpfs node table creation failed");
+  lock_init (&nodes_lock);
+  lock_set_name (&nodes_lock, "tmpfs");
+}
+
+/* Creates a file LENGTH bytes long, all of them zeros, or a
+   directory without entries if IS_DIR is true, and stores its
+   inode number in *INUMBER.  Returns false if memory runs out. */
+bool
+tmpfs_create (bool is_dir, off_t length, block_sector_t *inumber)
+{
+  struct tmpfs_node *node = malloc (sizeof *node);
+  if (node == NULL)
+    return false;
+  if (is_dir && !hash_init (&node->entries, entry_hash, entry_less, NULL))
+    {
+      free (node);
+      return false;
+    }
+  node->is_dir = is_dir;
+  lock_init (&node->lock);
+  node->length = is_dir ? 0 : length;
+  node->pages = NULL;
+  node->page_cnt = 0;
+  list_init (&node->order);
+  node->next_seq = 1;
+
+  lock_acquire (&nodes_lock);
+  node->inumber = next_inumber++;
+  hash_insert (&nodes, &node->elem);
+  lock_release (&nodes_lock);
+
+  *inumber = node->inumber;
+  return true;
+}
+
+/* Returns the node with the given INUMBER, or a null pointer if
+   it has been deleted. */
+struct tmpfs_node *
+tmpfs_get (block_sector_t inumber)
+{
+  struct tmpfs_node key;
+  struct hash_elem *e;
+
+  key.inumber = inumber;
+  lock_acquire (&nodes_lock);
+  e = hash_find (&nodes, &key.elem);
+  lock_release (&nodes_lock);
+  return e != NULL ? hash_entry (e, struct tmpfs_node, elem) : NULL;
+}
+
+/* Deletes the node with the given INUMBER and frees its pages.
+   Called once it is removed and no longer open, or if it was
+   never linked into a directory. */
+void
+tmpfs_delete (block_sector_t inumber)
+{
+  struct tmpfs_node key;
+  struct hash_elem *e;
+  struct tmpfs_node *node;
+  size_t i;
+
+  key.inumber = inumber;
+  lock_acquire (&nodes_lock);
+  e = hash_delete (&nodes, &key.elem);
+  lock_release (&nodes_lock);
+  if (e == NULL)
+    return;
+
+  node = hash_entry (e, struct tmpfs_node, elem);
+  for (i = 0; i < node->page_cnt; i++)
+    if (node->pages[i] != NULL)
+      palloc_free_page (node->pages[i]);
+  free (node->pages);
+  if (node->is_dir)
+    hash_destroy (&node->entries, entry_free);
+  free (node);
+}
+
+/* Returns true if NODE is a directory. */
+bool
+tmpfs_isdir (const struct tmpfs_node *node)
+{
+  return node->is_dir;
+}
+
+/* Returns NODE's length in bytes.  A single aligned word can be
+   read without NODE's lock. */
+off_t
+tmpfs_length (const struct tmpfs_node *node)
+{
+  return node->length;
+}
+
+/* Reads up to SIZE bytes from NODE into BUFFER, starting at
+   OFFSET.  Returns the number of bytes read, which is less than
+   SIZE only at end of file. */
+off_t
+tmpfs_read_at (struct tmpfs_node *node, void *buffer_, off_t size,
+               off_t offset)
+{
+  uint8_t *buffer = buffer_;
+  off_t bytes_read = 0;
+
+  lock_acquire (&node->lock);
+  if (offset < node->length && size > node->length - offset)
+    size = node->length - offset;
+  while (size > 0 && offset < node->length)
+    {
+      size_t idx = offset / PGSIZE;
+      int page_ofs = offset % PGSIZE;
+      int chunk_size = PGSIZE - page_ofs < size ? PGSIZE - page_ofs : size;
+
+      if (idx < node->page_cnt && node->pages[idx] != NULL)
+        memcpy (buffer + bytes_read, node->pages[idx] + page_ofs, chunk_size);
+      else
+        memset (buffer + bytes_read, 0, chunk_size);
+
+      size -= chunk_size;
+      offset += chunk_size;
+      bytes_read += chunk_size;
+    }
+  lock_release (&node->lock);
+  return bytes_read;
+}
+
+/* Writes SIZE bytes from BUFFER into NODE, starting at OFFSET,
+   growing it as needed.  Returns the number of bytes written,
+   which is less than SIZE only if memory runs out. */
+off_t
+tmpfs_write_at (struct tmpfs_node *node, const void *buffer_, off_t size,
+                off_t offset)
+{
+  const uint8_t *buffer = buffer_;
+  off_t bytes_written = 0;
+  size_t need;
+
+  if (size <= 0)
+    return 0;
+
+  lock_acquire (&node->lock);
+  need = DIV_ROUND_UP (offset + size, PGSIZE);
+  if (need > node->page_cnt)
+    {
+      uint8_t **pages = realloc (node->pages, need * sizeof *pages);
+      if (pages == NULL)
+        {
+          lock_release (&node->lock);
+          return 0;
+        }
+      memset (pages + node->page_cnt, 0,
+              (need - node->page_cnt) * sizeof *pages);
+      node->pages = pages;
+      node->page_cnt = need;
+    }
+
+  while (size > 0)
+    {
+      size_t idx = offset / PGSIZE;
+      int page_ofs = offset % PGSIZE;
+      int chunk_size = PGSIZE - page_ofs < size ? PGSIZE - page_ofs : size;
+
+      if (node->pages[idx] == NULL)
+        {
+          node->pages[idx] = palloc_get_page (PAL_USER | PAL_ZERO);
+          if (node->pages[idx] == NULL)
+            break;
+        }
+      memcpy (node->pages[idx] + page_ofs, buffer + bytes_written, chunk_size);
+
+      size -= chunk_size;
+      offset += chunk_size;
+      bytes_written += chunk_size;
+    }
+  if (offset > node->length)
+    node->length = offset;
+  lock_release (&node->lock);
+  return bytes_written;
+}
+
+/* Looks up NAME in directory NODE.  Returns true and stores the
+   inode number in *INUMBER if found, returns false otherwise. */
+bool
+tmpfs_dir_lookup (struct tmpfs_node *node, const char *name,
+                  block_sector_t *inumber)
+{
+  struct tmpfs_entry key;
+  struct hash_elem *e;
+
+  ASSERT (node->is_dir);
+  if (strlen (name) > NAME_MAX)
+    return false;
+  strlcpy (key.name, name, sizeof key.name);
+  lock_acquire (&node->lock);
+  e = hash_find (&node->entries, &key.hash_elem);
+  if (e != NULL)
+    *inumber = hash_entry (e, struct tmpfs_entry, hash_elem)->inumber;
+  lock_release (&node->lock);
+  return e != NULL;
+}
+
+/* Adds NAME, for INUMBER, to directory NODE.  Returns false if
+   NAME is already there or memory runs out. */
+bool
+tmpfs_dir_add (struct tmpfs_node *node, const char *name,
+               block_sector_t inumber)
+{
+  struct tmpfs_entry *entry;
+
+  ASSERT (node->is_dir);
+  ASSERT (strlen (name) <= NAME_MAX);
+  entry = malloc (sizeof *entry);
+  if (entry == NULL)
+    return false;
+  strlcpy (entry->name, name, sizeof entry->name);
+  entry->inumber = inumber;
+
+  lock_acquire (&node->lock);
+  if (hash_insert (&node->entries, &entry->hash_elem) != NULL)
+    {
+      lock_release (&node->lock);
+      free (entry);
+      return false;
+    }
+  entry->seq = node->next_seq++;
+  list_push_back (&node->order, &entry->list_elem);
+  lock_release (&node->lock);
+  return true;
+}
+
+/* Removes NAME from directory NODE.  Returns false if it was not
+   there. */
+bool
+tmpfs_dir_remove (struct tmpfs_node *node, const char *name)
+{
+  struct tmpfs_entry key;
+  struct hash_elem *e;
+
+  ASSERT (node->is_dir);
+  if (strlen (name) > NAME_MAX)
+    return false;
+  strlcpy (key.name, name, sizeof key.name);
+  lock_acquire (&node->lock);
+  e = hash_delete (&node->entries, &key.hash_elem);
+  if (e != NULL)
+    list_remove (&hash_entry (e, struct tmpfs_entry, hash_elem)->list_elem);
+  lock_release (&node->lock);
+  if (e == NULL)
+    return false;
+  free (hash_entry (e, struct tmpfs_entry, hash_elem));
+  return true;
+}
+
+/* Finds the first entry in directory NODE added after the one at
+   position *POS, 0 to start from the beginning, and stores its
+   name in NAME, its inode number in *INUMBER, and its position in
+   *POS.  Entries removed or added meanwhile do not disturb the
+   walk.  Returns false if there are no more entries. */
+bool
+tmpfs_dir_next (struct tmpfs_node *node, off_t *pos,
+                char name[NAME_MAX + 1], block_sector_t *inumber)
+{
+  struct list_elem *e;
+  bool found = false;
+
+  ASSERT (node->is_dir);
+  lock_acquire (&node->lock);
+  for (e = list_begin (&node->order); e != list_end (&node->order);
+       e = list_next (e))
+    {
+      struct tmpfs_entry *entry = list_entry (e, struct tmpfs_entry,
+                                              list_elem);
+      if (entry->seq > (unsigned) *pos)
+        {
+          strlcpy (name, entry->name, NAME_MAX + 1);
+          *inumber = entry->inumber;
+          *pos = entry->seq;
+          found = true;
+          break;
+        }
+    }
+  lock_release (&node->lock);
+  return found;
+}
+
+/* Returns a hash value for node E's inode number. */
+static unsigned
+node_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct tmpfs_node, elem)->inumber);
+}
+
+/* Returns true if node A's inode number is lower than B's. */
+static bool
+node_less (const struct hash_elem *a, const struct hash_elem *b,
+           void *aux UNUSED)
+{
+  return hash_entry (a, struct tmpfs_node, elem)->inumber
+         < hash_entry (b, struct tmpfs_node, elem)->inumber;
+}
+
+/* Returns a hash value for entry E's name. */
+static unsigned
+entry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_string (hash_entry (e, struct tmpfs_entry, hash_elem)->name);
+}
+
+/* Returns true if entry A's name sorts before B's. */
+static bool
+entry_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return strcmp (hash_entry (a, struct tmpfs_entry, hash_elem)->name,
+                 hash_entry (b, struct tmpfs_entry, hash_elem)->name) < 0;
+}
+
+/* Frees entry E. */
+static void
+entry_free (struct hash_elem *e, void *aux UNUSED)
+{
+  free (hash_entry (e, struct tmpfs_entry, hash_elem));
+}
@@ -0,0 +1,45 @@
+#ifndef FILESYS_TMPFS_H
+#define FILESYS_TMPFS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+#include "filesys/directory.h"
+#include "filesys/off_t.h"
+
+/* Inode numbers of memory-only files start here, far past any
+   sector of the file system device, so that the rest of the file
+   system can tell the two kinds apart by number alone. */
+#define TMPFS_INUMBER_MIN 0x40000000
+
+/* Returns true if INUMBER names a memory-only inode. */
+static inline bool
+tmpfs_owns (block_sector_t inumber)
+{
+  return inumber >= TMPFS_INUMBER_MIN;
+}
+
+struct tmpfs_node;
+
+void tmpfs_init (void);
+bool tmpfs_create (bool is_dir, off_t length, block_sector_t *inumber);
+struct tmpfs_node *tmpfs_get (block_sector_t inumber);
+void tmpfs_delete (block_sector_t inumber);
+
+/* Files. */
+bool tmpfs_isdir (const struct tmpfs_node *);
+off_t tmpfs_length (const struct tmpfs_node *);
+off_t tmpfs_read_at (struct tmpfs_node *, void *, off_t size, off_t offset);
+off_t tmpfs_write_at (struct tmpfs_node *, const void *, off_t size,
+                      off_t offset);
+
+/* Directories. */
+bool tmpfs_dir_lookup (struct tmpfs_node *, const char *name,
+                       block_sector_t *inumber);
+bool tmpfs_dir_add (struct tmpfs_node *, const char *name,
+                    block_sector_t inumber);
+bool tmpfs_dir_remove (struct tmpfs_node *, const char *name);
+bool tmpfs_dir_next (struct tmpfs_node *, off_t *pos,
+                     char name[NAME_MAX + 1], block_sector_t *inumber);
+
+#endif /* filesys/tmpfs.h */
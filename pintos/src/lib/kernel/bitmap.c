@@ -28,6 +28,8 @@ struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+    size_t dirty_start; /* First element changed since bitmap_write(). */
+    size_t dirty_end;   /* One past the last such element. */
   };
 
 /* Returns the index of the element that contains the bit
@@ -69,6 +71,41 @@ last_mask (const struct bitmap *b)
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
 
+/* Notes that element IDX of B no longer matches B's file. */
+static inline void
+mark_dirty (struct bitmap *b, size_t idx)
+{
+  if (idx < b->dirty_start)
+    b->dirty_start = idx;
+  if (idx >= b->dirty_end)
+    b->dirty_end = idx + 1;
+}
+
+/* Returns the index of the first bit in B between START and END,
+   exclusive, that is set to VALUE, or END if there is none.
+   Examines a whole element at a time, so runs of bits that are
+   all !VALUE are skipped quickly. */
+static size_t
+find_bit (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  size_t i;
+
+  for (i = start; i < end; )
+    {
+      elem_type e = b->bits[elem_idx (i)];
+      if (!value)
+        e = ~e;
+      e &= ~(bit_mask (i) - 1);
+      if (e != 0)
+        {
+          size_t idx = elem_idx (i) * ELEM_BITS + __builtin_ctzl (e);
+          return idx < end ? idx : end;
+        }
+      i = (elem_idx (i) + 1) * ELEM_BITS;
+    }
+  return end;
+}
+
 /* Creation and destruction. */
 
 /* Creates and returns a pointer to a newly allocated bitmap with room for
@@ -85,6 +122,7 @@ bitmap_create (size_t bit_cnt)
       b->bits = malloc (byte_cnt (bit_cnt));
       if (b->bits != NULL || bit_cnt == 0)
         {
+          bitmap_mark_clean (b);
           bitmap_set_all (b, false);
           return b;
         }
@@ -105,6 +143,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+  bitmap_mark_clean (b);
   bitmap_set_all (b, false);
   return b;
 }
@@ -138,6 +177,18 @@ bitmap_size (const struct bitmap *b)
   return b->bit_cnt;
 }
 
+/* Change tracking. */
+
+/* Treats B as matching its file, so that bitmap_write() has
+   nothing to write until B changes again.  Used when B's bits
+   are read from its file piecemeal, with bitmap_read_range(). */
+void
+bitmap_mark_clean (struct bitmap *b)
+{
+  b->dirty_start = elem_cnt (b->bit_cnt);
+  b->dirty_end = 0;
+}
+
 /* Setting and testing single bits. */
 
 /* Atomically sets the bit numbered IDX in B to VALUE. */
@@ -162,6 +213,7 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
   /* This is equivalent to `b->bits[idx] |= mask' except that it
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the OR instruction in [IA32-v2b]. */
+  mark_dirty (b, idx);
   asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
 }
 
@@ -175,6 +227,7 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
   /* This is equivalent to `b->bits[idx] &= ~mask' except that it
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the AND instruction in [IA32-v2a]. */
+  mark_dirty (b, idx);
   asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
 }
 
@@ -190,6 +243,7 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
   /* This is equivalent to `b->bits[idx] ^= mask' except that it
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the XOR instruction in [IA32-v2b]. */
+  mark_dirty (b, idx);
   asm ("xorl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
 }
 
@@ -250,16 +304,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t i;
-
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return find_bit (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -301,10 +350,30 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   if (cnt <= b->bit_cnt)
     {
       size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i;
+      size_t i = start;
+
+      if (cnt == 0)
+        return i <= last ? i : BITMAP_ERROR;
+      if (cnt == 1)
+        {
+          i = find_bit (b, i, b->bit_cnt, value);
+          return i < b->bit_cnt ? i : BITMAP_ERROR;
+        }
+
+      /* Jump from each run of VALUE bits to the next, instead of
+         trying every start index in turn. */
+      while (i <= last)
+        {
+          size_t end;
+
+          i = find_bit (b, i, last + 1, value);
+          if (i > last)
+            break;
+          end = find_bit (b, i, i + cnt, !value);
+          if (end == i + cnt)
+            return i;
+          i = end;
+        }
     }
   return BITMAP_ERROR;
 }
@@ -325,6 +394,27 @@ bitmap_scan_and_flip (struct bitmap *b, size_t start, size_t cnt, bool value)
   return idx;
 }
 
+/* Like bitmap_scan_and_flip(), but searches next-fit: starts at
+   *CURSOR, wraps around to the start of B if nothing is found
+   past it, and on success moves *CURSOR just past the group, so
+   that the next search does not rescan bits that were just
+   allocated.  *CURSOR must be less than or equal to B's size. */
+size_t
+bitmap_scan_and_flip_next (struct bitmap *b, size_t *cursor, size_t cnt,
+                           bool value)
+{
+  size_t idx;
+
+  ASSERT (cursor != NULL);
+
+  idx = bitmap_scan_and_flip (b, *cursor, cnt, value);
+  if (idx == BITMAP_ERROR && *cursor != 0)
+    idx = bitmap_scan_and_flip (b, 0, cnt, value);
+  if (idx != BITMAP_ERROR)
+    *cursor = (idx + cnt) % (b->bit_cnt != 0 ? b->bit_cnt : 1);
+  return idx;
+}
+
 /* File input and output. */
 
 #ifdef FILESYS
@@ -347,16 +437,50 @@ bitmap_read (struct bitmap *b, struct file *file)
       success = file_read_at (file, b->bits, size, 0) == size;
       b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
     }
+  bitmap_mark_clean (b);
   return success;
 }
 
-/* Writes B to FILE.  Return true if successful, false
-   otherwise. */
+/* Writes B to FILE.  Only the elements changed since B was
+   created, read, or last written are written, so that flipping a
+   bit costs a write of the sector holding it rather than of the
+   whole file.  Return true if successful, false otherwise. */
+bool
+bitmap_write (struct bitmap *b, struct file *file)
+{
+  off_t ofs, size;
+
+  if (b->dirty_start >= b->dirty_end)
+    return true;
+  ofs = b->dirty_start * sizeof (elem_type);
+  size = (b->dirty_end - b->dirty_start) * sizeof (elem_type);
+  if (file_write_at (file, b->bits + b->dirty_start, size, ofs) != size)
+    return false;
+  bitmap_mark_clean (b);
+  return true;
+}
+
+/* Reads bytes OFS through OFS + SIZE - 1 of B, as bitmap_write()
+   lays B out in FILE, from FILE, leaving the rest of B alone.
+   SIZE is cut off at the end of B.  Returns true if successful,
+   false otherwise. */
 bool
-bitmap_write (const struct bitmap *b, struct file *file)
+bitmap_read_range (struct bitmap *b, struct file *file, size_t ofs,
+                   size_t size)
 {
-  off_t size = byte_cnt (b->bit_cnt);
-  return file_write_at (file, b->bits, size, 0) == size;
+  size_t end = byte_cnt (b->bit_cnt);
+  bool success = true;
+
+  if (ofs < end)
+    {
+      if (size > end - ofs)
+        size = end - ofs;
+      success = (file_read_at (file, (uint8_t *) b->bits + ofs, size, ofs)
+                 == (off_t) size);
+      if (ofs + size == end)
+        b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+    }
+  return success;
 }
 #endif /* FILESYS */
 
@@ -16,6 +16,9 @@ void bitmap_destroy (struct bitmap *);
 /* Bitmap size. */
 size_t bitmap_size (const struct bitmap *);
 
+/* Change tracking, for bitmap_write(). */
+void bitmap_mark_clean (struct bitmap *);
+
 /* Setting and testing single bits. */
 void bitmap_set (struct bitmap *, size_t idx, bool);
 void bitmap_mark (struct bitmap *, size_t idx);
@@ -36,13 +39,17 @@ bool bitmap_all (const struct bitmap *, size_t start, size_t cnt);
 #define BITMAP_ERROR SIZE_MAX
 size_t bitmap_scan (const struct bitmap *, size_t start, size_t cnt, bool);
 size_t bitmap_scan_and_flip (struct bitmap *, size_t start, size_t cnt, bool);
+size_t bitmap_scan_and_flip_next (struct bitmap *, size_t *cursor,
+                                  size_t cnt, bool);
 
 /* File input and output. */
 #ifdef FILESYS
 struct file;
 size_t bitmap_file_size (const struct bitmap *);
 bool bitmap_read (struct bitmap *, struct file *);
-bool bitmap_write (const struct bitmap *, struct file *);
+bool bitmap_write (struct bitmap *, struct file *);
+bool bitmap_read_range (struct bitmap *, struct file *, size_t ofs,
+                        size_t size);
 #endif
 
 /* Debugging. */
@@ -12,25 +12,55 @@
 #define list_elem_to_hash_elem(LIST_ELEM)                       \
         list_entry(LIST_ELEM, struct hash_elem, list_elem)
 
-static struct list *find_bucket (struct hash *, struct hash_elem *);
+static struct list *find_bucket (struct hash *, unsigned hash);
 static struct hash_elem *find_elem (struct hash *, struct list *,
                                     struct hash_elem *);
 static void insert_elem (struct hash *, struct list *, struct hash_elem *);
 static void remove_elem (struct hash *, struct hash_elem *);
+static bool init (struct hash *, hash_hash_func *, hash_less_func *,
+                  void *aux, size_t bucket_cnt, bool fixed);
+static size_t ideal_bucket_cnt (size_t elem_cnt);
 static void rehash (struct hash *);
+static void move_buckets (struct hash *, size_t cnt);
 
 /* Initializes hash table H to compute hash values using HASH and
    compare hash elements using LESS, given auxiliary data AUX. */
 bool
 hash_init (struct hash *h,
            hash_hash_func *hash, hash_less_func *less, void *aux)
+{
+  return init (h, hash, less, aux, 4, false);
+}
+
+/* Initializes hash table H like hash_init(), but with its buckets
+   allocated up front for about CAPACITY elements.  H is never
+   resized, so insertions and deletions never allocate memory or
+   move elements.  H still works if it outgrows CAPACITY, only
+   more slowly. */
+bool
+hash_init_fixed (struct hash *h, hash_hash_func *hash,
+                 hash_less_func *less, void *aux, size_t capacity)
+{
+  return init (h, hash, less, aux, ideal_bucket_cnt (capacity), true);
+}
+
+/* Initializes H with BUCKET_CNT buckets, which must be a power of
+   2.  Returns true if successful, false if memory is not
+   available. */
+static bool
+init (struct hash *h, hash_hash_func *hash, hash_less_func *less,
+      void *aux, size_t bucket_cnt, bool fixed)
 {
   h->elem_cnt = 0;
-  h->bucket_cnt = 4;
+  h->bucket_cnt = bucket_cnt;
   h->buckets = malloc (sizeof *h->buckets * h->bucket_cnt);
   h->hash = hash;
   h->less = less;
   h->aux = aux;
+  h->fixed = fixed;
+  h->old_buckets = NULL;
+  h->old_bucket_cnt = 0;
+  h->move_idx = 0;
 
   if (h->buckets != NULL)
     {
@@ -55,6 +85,7 @@ hash_clear (struct hash *h, hash_action_func *destructor)
 {
   size_t i;
 
+  move_buckets (h, SIZE_MAX);
   for (i = 0; i < h->bucket_cnt; i++)
     {
       struct list *bucket = &h->buckets[i];
@@ -88,6 +119,7 @@ hash_destroy (struct hash *h, hash_action_func *destructor)
 {
   if (destructor != NULL)
     hash_clear (h, destructor);
+  free (h->old_buckets);
   free (h->buckets);
 }
 
@@ -98,8 +130,12 @@ hash_destroy (struct hash *h, hash_action_func *destructor)
 struct hash_elem *
 hash_insert (struct hash *h, struct hash_elem *new)
 {
-  struct list *bucket = find_bucket (h, new);
-  struct hash_elem *old = find_elem (h, bucket, new);
+  struct list *bucket;
+  struct hash_elem *old;
+
+  new->hash = h->hash (new, h->aux);
+  bucket = find_bucket (h, new->hash);
+  old = find_elem (h, bucket, new);
 
   if (old == NULL)
     insert_elem (h, bucket, new);
@@ -114,8 +150,12 @@ hash_insert (struct hash *h, struct hash_elem *new)
 struct hash_elem *
 hash_replace (struct hash *h, struct hash_elem *new)
 {
-  struct list *bucket = find_bucket (h, new);
-  struct hash_elem *old = find_elem (h, bucket, new);
+  struct list *bucket;
+  struct hash_elem *old;
+
+  new->hash = h->hash (new, h->aux);
+  bucket = find_bucket (h, new->hash);
+  old = find_elem (h, bucket, new);
 
   if (old != NULL)
     remove_elem (h, old);
@@ -131,7 +171,8 @@ hash_replace (struct hash *h, struct hash_elem *new)
 struct hash_elem *
 hash_find (struct hash *h, struct hash_elem *e)
 {
-  return find_elem (h, find_bucket (h, e), e);
+  e->hash = h->hash (e, h->aux);
+  return find_elem (h, find_bucket (h, e->hash), e);
 }
 
 /* Finds, removes, and returns an element equal to E in hash
@@ -144,7 +185,10 @@ hash_find (struct hash *h, struct hash_elem *e)
 struct hash_elem *
 hash_delete (struct hash *h, struct hash_elem *e)
 {
-  struct hash_elem *found = find_elem (h, find_bucket (h, e), e);
+  struct hash_elem *found;
+
+  e->hash = h->hash (e, h->aux);
+  found = find_elem (h, find_bucket (h, e->hash), e);
   if (found != NULL)
     {
       remove_elem (h, found);
@@ -166,6 +210,7 @@ hash_apply (struct hash *h, hash_action_func *action)
 
   ASSERT (action != NULL);
 
+  move_buckets (h, SIZE_MAX);
   for (i = 0; i < h->bucket_cnt; i++)
     {
       struct list *bucket = &h->buckets[i];
@@ -202,6 +247,10 @@ hash_first (struct hash_iterator *i, struct hash *h)
   ASSERT (i != NULL);
   ASSERT (h != NULL);
 
+  /* Finish any resize, so that all elements are in one array.
+     This costs no more than the iteration itself. */
+  move_buckets (h, SIZE_MAX);
+
   i->hash = h;
   i->bucket = i->hash->buckets;
   i->elem = list_elem_to_hash_elem (list_head (i->bucket));
@@ -301,12 +350,19 @@ hash_int (int i)
   return hash_bytes (&i, sizeof i);
 }
 
-/* Returns the bucket in H that E belongs in. */
+/* Returns the bucket in H that an element with hash value HASH
+   belongs in.  While H is being resized, that is its bucket in
+   the old array if that bucket has not been moved yet. */
 static struct list *
-find_bucket (struct hash *h, struct hash_elem *e)
+find_bucket (struct hash *h, unsigned hash)
 {
-  size_t bucket_idx = h->hash (e, h->aux) & (h->bucket_cnt - 1);
-  return &h->buckets[bucket_idx];
+  if (h->old_buckets != NULL)
+    {
+      size_t old_idx = hash & (h->old_bucket_cnt - 1);
+      if (old_idx >= h->move_idx)
+        return &h->old_buckets[old_idx];
+    }
+  return &h->buckets[hash & (h->bucket_cnt - 1)];
 }
 
 /* Searches BUCKET in H for a hash element equal to E.  Returns
@@ -319,7 +375,8 @@ find_elem (struct hash *h, struct list *bucket, struct hash_elem *e)
   for (i = list_begin (bucket); i != list_end (bucket); i = list_next (i))
     {
       struct hash_elem *hi = list_elem_to_hash_elem (i);
-      if (!h->less (hi, e, h->aux) && !h->less (e, hi, h->aux))
+      if (hi->hash == e->hash
+          && !h->less (hi, e, h->aux) && !h->less (e, hi, h->aux))
         return hi;
     }
   return NULL;
@@ -344,35 +401,51 @@ is_power_of_2 (size_t x)
 #define BEST_ELEMS_PER_BUCKET 2 /* Ideal elems/bucket. */
 #define MAX_ELEMS_PER_BUCKET  4 /* Elems/bucket > 4: increase # of buckets. */
 
-/* Changes the number of buckets in hash table H to match the
-   ideal.  This function can fail because of an out-of-memory
-   condition, but that'll just make hash accesses less efficient;
-   we can still continue. */
+/* Number of old buckets moved by each insertion or deletion
+   while a table is being resized.  Growing or shrinking again
+   takes at least as many operations as there are old buckets, so
+   any rate of at least 1 finishes each resize in time. */
+#define MOVE_STEP 2
+
+/* Returns the number of buckets to use for ELEM_CNT elements:
+   about one for every BEST_ELEMS_PER_BUCKET, at least four, and
+   a power of 2. */
+static size_t
+ideal_bucket_cnt (size_t elem_cnt)
+{
+  size_t bucket_cnt = elem_cnt / BEST_ELEMS_PER_BUCKET;
+  if (bucket_cnt < 4)
+    bucket_cnt = 4;
+  while (!is_power_of_2 (bucket_cnt))
+    bucket_cnt = turn_off_least_1bit (bucket_cnt);
+  return bucket_cnt;
+}
+
+/* Moves H a step closer to the ideal number of buckets, starting
+   a resize if none is in progress and one is called for.  This
+   function can fail because of an out-of-memory condition, but
+   that'll just make hash accesses less efficient; we can still
+   continue. */
 static void
 rehash (struct hash *h)
 {
-  size_t old_bucket_cnt, new_bucket_cnt;
-  struct list *new_buckets, *old_buckets;
+  size_t new_bucket_cnt;
+  struct list *new_buckets;
   size_t i;
 
   ASSERT (h != NULL);
 
-  /* Save old bucket info for later use. */
-  old_buckets = h->buckets;
-  old_bucket_cnt = h->bucket_cnt;
-
-  /* Calculate the number of buckets to use now.
-     We want one bucket for about every BEST_ELEMS_PER_BUCKET.
-     We must have at least four buckets, and the number of
-     buckets must be a power of 2. */
-  new_bucket_cnt = h->elem_cnt / BEST_ELEMS_PER_BUCKET;
-  if (new_bucket_cnt < 4)
-    new_bucket_cnt = 4;
-  while (!is_power_of_2 (new_bucket_cnt))
-    new_bucket_cnt = turn_off_least_1bit (new_bucket_cnt);
+  if (h->fixed)
+    return;
+  if (h->old_buckets != NULL)
+    {
+      move_buckets (h, MOVE_STEP);
+      return;
+    }
 
   /* Don't do anything if the bucket count wouldn't change. */
-  if (new_bucket_cnt == old_bucket_cnt)
+  new_bucket_cnt = ideal_bucket_cnt (h->elem_cnt);
+  if (new_bucket_cnt == h->bucket_cnt)
     return;
 
   /* Allocate new buckets and initialize them as empty. */
@@ -387,29 +460,45 @@ rehash (struct hash *h)
   for (i = 0; i < new_bucket_cnt; i++)
     list_init (&new_buckets[i]);
 
-  /* Install new bucket info. */
+  /* Install new bucket info, keeping the old buckets around
+     until all their elements have been moved. */
+  h->old_buckets = h->buckets;
+  h->old_bucket_cnt = h->bucket_cnt;
+  h->move_idx = 0;
   h->buckets = new_buckets;
   h->bucket_cnt = new_bucket_cnt;
 
-  /* Move each old element into the appropriate new bucket. */
-  for (i = 0; i < old_bucket_cnt; i++)
+  move_buckets (h, MOVE_STEP);
+}
+
+/* Moves the elements of up to CNT old buckets of H into H's
+   current buckets, by their cached hash values, and frees the old
+   bucket array once it is empty. */
+static void
+move_buckets (struct hash *h, size_t cnt)
+{
+  if (h->old_buckets == NULL)
+    return;
+
+  for (; cnt > 0 && h->move_idx < h->old_bucket_cnt; cnt--)
     {
-      struct list *old_bucket;
-      struct list_elem *elem, *next;
+      struct list *old_bucket = &h->old_buckets[h->move_idx++];
 
-      old_bucket = &old_buckets[i];
-      for (elem = list_begin (old_bucket);
-           elem != list_end (old_bucket); elem = next)
+      while (!list_empty (old_bucket))
         {
-          struct list *new_bucket
-            = find_bucket (h, list_elem_to_hash_elem (elem));
-          next = list_next (elem);
-          list_remove (elem);
-          list_push_front (new_bucket, elem);
+          struct list_elem *elem = list_pop_front (old_bucket);
+          unsigned hash = list_elem_to_hash_elem (elem)->hash;
+          list_push_front (&h->buckets[hash & (h->bucket_cnt - 1)], elem);
         }
     }
 
-  free (old_buckets);
+  if (h->move_idx >= h->old_bucket_cnt)
+    {
+      free (h->old_buckets);
+      h->old_buckets = NULL;
+      h->old_bucket_cnt = 0;
+      h->move_idx = 0;
+    }
 }
 
 /* Inserts E into BUCKET (in hash table H). */
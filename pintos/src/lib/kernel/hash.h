@@ -18,7 +18,19 @@
    conversion from a struct hash_elem back to a structure object
    that contains it.  This is the same technique used in the
    linked list implementation.  Refer to lib/kernel/list.h for a
-   detailed explanation. */
+   detailed explanation.
+
+   Each element remembers its hash value, so the hash function is
+   called once per insertion or lookup and never while resizing,
+   and most non-matching elements in a bucket are skipped without
+   calling the comparison function.
+
+   A table is resized incrementally: once its load calls for a
+   new bucket count, the new bucket array is allocated and every
+   later insertion or deletion moves a few buckets' worth of
+   elements from the old array, so no single operation has to
+   move the whole table.  A table created with hash_init_fixed()
+   is sized once for a known capacity and never resized. */
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -29,6 +41,7 @@
 struct hash_elem
   {
     struct list_elem list_elem;
+    unsigned hash;              /* Cached hash value. */
   };
 
 /* Converts pointer to hash element HASH_ELEM into a pointer to
@@ -64,6 +77,13 @@ struct hash
     hash_hash_func *hash;       /* Hash function. */
     hash_less_func *less;       /* Comparison function. */
     void *aux;                  /* Auxiliary data for `hash' and `less'. */
+    bool fixed;                 /* Never resize? */
+
+    /* While a resize is in progress, the buckets not yet moved
+       into `buckets'.  Old buckets below `move_idx' are empty. */
+    struct list *old_buckets;   /* Old array, or null if not resizing. */
+    size_t old_bucket_cnt;      /* Number of buckets in old array. */
+    size_t move_idx;            /* First old bucket not yet moved. */
   };
 
 /* A hash table iterator. */
@@ -76,6 +96,8 @@ struct hash_iterator
 
 /* Basic life cycle. */
 bool hash_init (struct hash *, hash_hash_func *, hash_less_func *, void *aux);
+bool hash_init_fixed (struct hash *, hash_hash_func *, hash_less_func *,
+                      void *aux, size_t capacity);
 void hash_clear (struct hash *, hash_action_func *);
 void hash_destroy (struct hash *, hash_action_func *);
 
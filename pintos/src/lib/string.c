@@ -1,5 +1,15 @@
 #include <string.h>
 #include <debug.h>
+#include <stdint.h>
+
+/* Blocks shorter than this are handled a byte at a time, since
+   aligning and setting up a string instruction would cost more
+   than it saves. */
+#define BULK_MIN 16
+
+/* A 32-bit word that may alias any other type, for reading
+   blocks of bytes a word at a time. */
+typedef uint32_t __attribute__ ((__may_alias__)) word_t;
 
 /* Copies SIZE bytes from SRC to DST, which must not overlap.
    Returns DST. */
@@ -12,6 +22,18 @@ memcpy (void *dst_, const void *src_, size_t size)
   ASSERT (dst != NULL || size == 0);
   ASSERT (src != NULL || size == 0);
 
+  if (size >= BULK_MIN)
+    {
+      /* Align DST, then copy whole words with "rep movsl". */
+      size_t words;
+
+      for (; (uintptr_t) dst % sizeof (word_t) != 0; size--)
+        *dst++ = *src++;
+      words = size / sizeof (word_t);
+      size %= sizeof (word_t);
+      asm volatile ("rep movsl"
+                    : "+D" (dst), "+S" (src), "+c" (words) : : "memory");
+    }
   while (size-- > 0)
     *dst++ = *src++;
 
@@ -31,18 +53,37 @@ memmove (void *dst_, const void *src_, size_t size)
 
   if (dst < src)
     {
-      while (size-- > 0)
-        *dst++ = *src++;
+      /* Copying upward never overwrites source bytes that have
+         yet to be read. */
+      return memcpy (dst, src, size);
     }
   else
     {
       dst += size;
       src += size;
+      if (size >= BULK_MIN)
+        {
+          /* Align the end of DST, then copy whole words downward
+             with the direction flag set.  Interrupt handlers clear
+             it for themselves and IRET restores it. */
+          size_t words;
+
+          for (; (uintptr_t) dst % sizeof (word_t) != 0; size--)
+            *--dst = *--src;
+          words = size / sizeof (word_t);
+          size %= sizeof (word_t);
+          dst -= sizeof (word_t);
+          src -= sizeof (word_t);
+          asm volatile ("std; rep movsl; cld"
+                        : "+D" (dst), "+S" (src), "+c" (words) : : "memory");
+          dst += sizeof (word_t);
+          src += sizeof (word_t);
+        }
       while (size-- > 0)
         *--dst = *--src;
     }
 
-  return dst;
+  return dst_;
 }
 
 /* Find the first differing byte in the two blocks of SIZE bytes
@@ -58,6 +99,15 @@ memcmp (const void *a_, const void *b_, size_t size)
   ASSERT (a != NULL || size == 0);
   ASSERT (b != NULL || size == 0);
 
+  /* Skip over equal words, then find the differing byte, if any,
+     one byte at a time. */
+  for (; size >= sizeof (word_t); size -= sizeof (word_t))
+    {
+      if (*(const word_t *) a != *(const word_t *) b)
+        break;
+      a += sizeof (word_t);
+      b += sizeof (word_t);
+    }
   for (; size-- > 0; a++, b++)
     if (*a != *b)
       return *a > *b ? +1 : -1;
@@ -282,6 +332,19 @@ memset (void *dst_, int value, size_t size)
 
   ASSERT (dst != NULL || size == 0);
 
+  if (size >= BULK_MIN)
+    {
+      /* Align DST, then store whole words with "rep stosl". */
+      word_t word = (unsigned char) value * 0x01010101u;
+      size_t words;
+
+      for (; (uintptr_t) dst % sizeof (word_t) != 0; size--)
+        *dst++ = value;
+      words = size / sizeof (word_t);
+      size %= sizeof (word_t);
+      asm volatile ("rep stosl"
+                    : "+D" (dst), "+c" (words) : "a" (word) : "memory");
+    }
   while (size-- > 0)
     *dst++ = value;
 
@@ -34,7 +34,76 @@ enum
     SYS_CACHETRIES,             /* The number of tries that have been made in the buffer cache. */
     SYS_DISKREADS,              /* The number of disk reads the buffer cache has performed. */
     SYS_DISKWRITES,             /* The number of disk writes the buffer cache has performed. */
-    SYS_CACHERESET              /* Reset to a cold buffer cache. */
+    SYS_CACHERESET,             /* Reset to a cold buffer cache. */
+    SYS_FSYNC,                  /* Write a file's cached data to disk. */
+    SYS_READV,                  /* Read from a file into several buffers. */
+    SYS_WRITEV,                 /* Write several buffers to a file. */
+    SYS_PREAD,                  /* Read from a file at a given offset. */
+    SYS_PWRITE,                 /* Write to a file at a given offset. */
+    SYS_SCHEDSTATS,             /* Get scheduler statistics. */
+    SYS_FORK,                   /* Duplicate the calling process. */
+    SYS_BATCH,                  /* Run several operations at once. */
+    SYS_EXECV,                  /* Start a process from an argv array. */
+    SYS_WAITANY,                /* Wait for whichever child dies first. */
+    SYS_FSSTATS,                /* Get buffer cache statistics. */
+    SYS_TICKS,                  /* Timer ticks since boot. */
+    SYS_GETDENTS,               /* Reads many directory entries. */
+    SYS_FSTAT,                  /* Get an open file's size, type and inumber. */
+    SYS_STAT,                   /* Get a named file's size, type and inumber. */
+    SYS_PIPE,                   /* Create a pipe. */
+    SYS_SBRK,                   /* Grow or shrink the heap. */
+    SYS_THREADCREATE,           /* Start a thread in this process. */
+    SYS_THREADJOIN,             /* Wait for a thread to exit. */
+    SYS_THREADEXIT,             /* End the calling thread. */
+    SYS_FUTEXWAIT,              /* Sleep on a user address. */
+    SYS_FUTEXWAKE,              /* Wake threads sleeping on an address. */
+    SYS_BLOCKSTATS,             /* Get a block device's statistics. */
+    SYS_AIOREAD,                /* Start reading a file. */
+    SYS_AIOWRITE,               /* Start writing a file. */
+    SYS_AIOWAIT,                /* Wait for a read or write to finish. */
+    SYS_AIOPOLL,                /* Check whether one has finished. */
+    SYS_SHMOPEN,                /* Find or create a shared memory segment. */
+    SYS_SHMMAP,                 /* Map a shared memory segment. */
+    SYS_DEFRAG,                 /* Defragment a file or directory tree. */
+    SYS_GETRUSAGE,              /* Get a process's resource use. */
+    SYS_NETINFO,                /* Get the network device's address. */
+    SYS_NETSEND,                /* Send raw Ethernet frames. */
+    SYS_NETRECV                 /* Receive a raw Ethernet frame. */
   };
 
+/* Option for SYS_WAITANY: return 0 at once if no child has
+   exited yet. */
+#define WNOHANG 1
+
+/* Special process ids for SYS_GETRUSAGE: the calling process, and
+   the children it has waited for. */
+#define RUSAGE_SELF 0
+#define RUSAGE_CHILDREN -1
+
+/* Operations SYS_BATCH can run. */
+enum
+  {
+    BATCH_READ,                 /* Read from a file. */
+    BATCH_WRITE,                /* Write to a file. */
+    BATCH_SEEK,                 /* Change position in a file. */
+    BATCH_OPEN,                 /* Open a file. */
+    BATCH_CLOSE                 /* Close a file. */
+  };
+
+/* Most operations one SYS_BATCH call accepts. */
+#define BATCH_MAX 256
+
+/* Offset for BATCH_READ and BATCH_WRITE meaning "at the file
+   position, then advance it", as read() and write() do. */
+#define BATCH_POS ((unsigned) -1)
+
+/* Most bytes one SYS_AIOREAD or SYS_AIOWRITE moves. */
+#define AIO_MAX_SIZE (64 * 1024)
+
+/* Most reads and writes a process may have outstanding. */
+#define AIO_MAX_PENDING 32
+
+/* Returned by SYS_AIOPOLL for a transfer not yet finished. */
+#define AIO_PENDING (-2)
+
 #endif /* lib/syscall-nr.h */
@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <debug.h>
+#include <mutex.h>
+#include <round.h>
+#include <stdint.h>
+#include <string.h>
+#include <syscall.h>
+
+/* A user-space malloc(), laid out like the kernel's in
+   threads/malloc.c, but taking its pages from the heap with
+   sbrk() instead of from a page allocator.
+
+   Requests of up to a quarter page are rounded up to a power of 2
+   of at least 16 bytes, and served from that size's free list.
+   When the list is empty, a page of the heap, an "arena", is
+   split into blocks of the size, all put on the list.  When every
+   block of an arena is free again, the arena goes back to the
+   free page runs.
+
+   Larger requests get a run of whole pages with a header in
+   front.  Freed runs are kept sorted by address and merged with
+   their neighbors.  A run that ends at the top of the heap is
+   handed back to the kernel by shrinking the heap, so a program
+   holds only the pages it still uses.  The kernel maps heap
+   pages only when they are first touched.
+
+   The threads of a process share one heap, under one mutex. */
+
+/* Size of a page of the heap. */
+#define PAGE_SIZE 4096
+
+/* Magic number for detecting arena corruption. */
+#define ARENA_MAGIC 0x9a548eed
+
+/* Descriptor for blocks of one size. */
+struct desc
+  {
+    size_t block_size;          /* Size of each block in bytes. */
+    size_t blocks_per_arena;    /* Number of blocks in an arena. */
+    struct block *free_list;    /* Free blocks, or null. */
+  };
+
+/* Arena, at the start of each page of small blocks and of each
+   run of pages holding one large block. */
+struct arena
+  {
+    unsigned magic;             /* Always set to ARENA_MAGIC. */
+    struct desc *desc;          /* Owning descriptor, null for big block. */
+    size_t free_cnt;            /* Free blocks; pages in big block. */
+  };
+
+/* Free block, on a doubly linked list so that an arena's blocks
+   can be taken off it when the arena is given back. */
+struct block
+  {
+    struct block *prev;         /* Previous free block, or null. */
+    struct block *next;         /* Next free block, or null. */
+  };
+
+/* Run of free pages, at the start of the run. */
+struct run
+  {
+    size_t page_cnt;            /* Pages in the run. */
+    struct run *next;           /* Next run, at a higher address. */
+  };
+
+/* Descriptors for 16, 32, ..., PAGE_SIZE / 4 byte blocks. */
+static struct desc descs[8];
+static size_t desc_cnt;
+
+/* Free page runs, by ascending address. */
+static struct run *runs;
+
+/* Guards the descriptors and the free runs. */
+static struct mutex lock = MUTEX_INITIALIZER;
+
+/* Returns the offset of P within its page. */
+static inline uintptr_t
+pg_ofs (const void *p)
+{
+  return (uintptr_t) p & (PAGE_SIZE - 1);
+}
+
+static void init (void);
+static struct arena *block_to_arena (struct block *);
+static void *get_pages (size_t page_cnt);
+static void put_pages (void *, size_t page_cnt);
+static void list_push (struct desc *, struct block *);
+static void list_unlink (struct desc *, struct block *);
+
+/* Obtains and returns a new block of at least SIZE bytes.
+   Returns a null pointer if SIZE is 0 or the heap cannot grow. */
+void *
+malloc (size_t size)
+{
+  struct desc *d;
+  struct block *b;
+  struct arena *a;
+
+  if (size == 0)
+    return NULL;
+  mutex_lock (&lock);
+  if (desc_cnt == 0)
+    init ();
+
+  /* Find the smallest descriptor that satisfies a SIZE-byte
+     request. */
+  for (d = descs; d < descs + desc_cnt; d++)
+    if (d->block_size >= size)
+      break;
+  if (d == descs + desc_cnt)
+    {
+      /* SIZE is too big for any descriptor.
+         Allocate enough pages to hold SIZE plus an arena. */
+      size_t page_cnt = DIV_ROUND_UP (size + sizeof *a, PAGE_SIZE);
+      a = page_cnt >= size / PAGE_SIZE ? get_pages (page_cnt) : NULL;
+      if (a != NULL)
+        {
+          a->magic = ARENA_MAGIC;
+          a->desc = NULL;
+          a->free_cnt = page_cnt;
+          a++;
+        }
+      mutex_unlock (&lock);
+      return a;
+    }
+
+  /* If the free list is empty, split a new arena into blocks. */
+  if (d->free_list == NULL)
+    {
+      size_t i;
+
+      a = get_pages (1);
+      if (a == NULL)
+        {
+          mutex_unlock (&lock);
+          return NULL;
+        }
+      a->magic = ARENA_MAGIC;
+      a->desc = d;
+      a->free_cnt = d->blocks_per_arena;
+      for (i = 0; i < d->blocks_per_arena; i++)
+        list_push (d, (struct block *) ((uint8_t *) a + sizeof *a
+                                        + i * d->block_size));
+    }
+
+  /* Get a block from the free list and return it. */
+  b = d->free_list;
+  list_unlink (d, b);
+  block_to_arena (b)->free_cnt--;
+  mutex_unlock (&lock);
+  return b;
+}
+
+/* Allocates and returns A times B bytes initialized to zeros.
+   Returns a null pointer if memory is not available. */
+void *
+calloc (size_t a, size_t b)
+{
+  void *p;
+  size_t size;
+
+  /* Calculate block size and make sure it fits in size_t. */
+  size = a * b;
+  if (size < a || size < b)
+    return NULL;
+
+  p = malloc (size);
+  if (p != NULL)
+    memset (p, 0, size);
+  return p;
+}
+
+/* Returns the number of bytes allocated for BLOCK. */
+static size_t
+block_size (void *block)
+{
+  struct block *b = block;
+  struct arena *a = block_to_arena (b);
+  struct desc *d = a->desc;
+
+  return d != NULL ? d->block_size : PAGE_SIZE * a->free_cnt - pg_ofs (block);
+}
+
+/* Attempts to resize OLD_BLOCK to NEW_SIZE bytes, possibly
+   moving it in the process.
+   If successful, returns the new block; on failure, returns a
+   null pointer.
+   A call with null OLD_BLOCK is equivalent to malloc(NEW_SIZE).
+   A call with zero NEW_SIZE is equivalent to free(OLD_BLOCK). */
+void *
+realloc (void *old_block, size_t new_size)
+{
+  if (new_size == 0)
+    {
+      free (old_block);
+      return NULL;
+    }
+  else
+    {
+      void *new_block = malloc (new_size);
+      if (old_block != NULL && new_block != NULL)
+        {
+          size_t old_size = block_size (old_block);
+          size_t min_size = new_size < old_size ? new_size : old_size;
+          memcpy (new_block, old_block, min_size);
+          free (old_block);
+        }
+      return new_block;
+    }
+}
+
+/* Frees block P, which must have been previously allocated with
+   malloc(), calloc(), or realloc(). */
+void
+free (void *p)
+{
+  struct block *b = p;
+  struct arena *a;
+  struct desc *d;
+
+  if (p == NULL)
+    return;
+
+  a = block_to_arena (b);
+  d = a->desc;
+  mutex_lock (&lock);
+  if (d == NULL)
+    {
+      /* It's a big block.  Give back its pages. */
+      put_pages (a, a->free_cnt);
+      mutex_unlock (&lock);
+      return;
+    }
+
+#ifndef NDEBUG
+  /* Clear the block to help detect use-after-free bugs. */
+  memset (b, 0xcc, d->block_size);
+#endif
+
+  list_push (d, b);
+
+  /* If the arena is now entirely unused, give it back. */
+  if (++a->free_cnt >= d->blocks_per_arena)
+    {
+      size_t i;
+
+      ASSERT (a->free_cnt == d->blocks_per_arena);
+      for (i = 0; i < d->blocks_per_arena; i++)
+        list_unlink (d, (struct block *) ((uint8_t *) a + sizeof *a
+                                          + i * d->block_size));
+      put_pages (a, 1);
+    }
+  mutex_unlock (&lock);
+}
+
+/* Sets up the descriptors. */
+static void
+init (void)
+{
+  size_t block_size;
+
+  for (block_size = 16; block_size < PAGE_SIZE / 2; block_size *= 2)
+    {
+      struct desc *d = &descs[desc_cnt++];
+      ASSERT (desc_cnt <= sizeof descs / sizeof *descs);
+      d->block_size = block_size;
+      d->blocks_per_arena = (PAGE_SIZE - sizeof (struct arena)) / block_size;
+      d->free_list = NULL;
+    }
+}
+
+/* Returns the arena that block B is inside. */
+static struct arena *
+block_to_arena (struct block *b)
+{
+  struct arena *a = (struct arena *) ((uintptr_t) b & ~(PAGE_SIZE - 1));
+
+  /* Check that the arena is valid. */
+  ASSERT (a->magic == ARENA_MAGIC);
+
+  /* Check that the block is properly aligned for the arena. */
+  ASSERT (a->desc == NULL
+          || (pg_ofs (b) - sizeof *a) % a->desc->block_size == 0);
+  ASSERT (a->desc != NULL || pg_ofs (b) == sizeof *a);
+
+  return a;
+}
+
+/* Returns PAGE_CNT contiguous free pages, the first fit among the
+   free runs or else new ones from the top of the heap, or a null
+   pointer if the heap cannot grow. */
+static void *
+get_pages (size_t page_cnt)
+{
+  struct run **rp;
+  void *pages;
+
+  for (rp = &runs; *rp != NULL; rp = &(*rp)->next)
+    {
+      struct run *r = *rp;
+      if (r->page_cnt == page_cnt)
+        {
+          *rp = r->next;
+          return r;
+        }
+      else if (r->page_cnt > page_cnt)
+        {
+          /* Take the front of the run and keep the rest. */
+          struct run *rest = (struct run *) ((uint8_t *) r
+                                             + page_cnt * PAGE_SIZE);
+          rest->page_cnt = r->page_cnt - page_cnt;
+          rest->next = r->next;
+          *rp = rest;
+          return r;
+        }
+    }
+
+  /* Arenas must be page-aligned, so first pad the heap out to a
+     page boundary. */
+  pages = sbrk (0);
+  if (pg_ofs (pages) != 0
+      && sbrk (PAGE_SIZE - pg_ofs (pages)) == (void *) -1)
+    return NULL;
+  pages = sbrk (page_cnt * PAGE_SIZE);
+  return pages != (void *) -1 ? pages : NULL;
+}
+
+/* Adds the PAGE_CNT pages at P to the free runs, merging them with
+   adjacent runs, and shrinks the heap if they end up at its top. */
+static void
+put_pages (void *p, size_t page_cnt)
+{
+  struct run *r = p;
+  struct run **rp;
+  struct run *prev = NULL;
+
+  for (rp = &runs; *rp != NULL && *rp < r; rp = &(*rp)->next)
+    prev = *rp;
+  r->page_cnt = page_cnt;
+  r->next = *rp;
+  *rp = r;
+
+  /* Merge with the next run, then with the previous one. */
+  if (r->next != NULL
+      && (uint8_t *) r + r->page_cnt * PAGE_SIZE == (uint8_t *) r->next)
+    {
+      r->page_cnt += r->next->page_cnt;
+      r->next = r->next->next;
+    }
+  if (prev != NULL
+      && (uint8_t *) prev + prev->page_cnt * PAGE_SIZE == (uint8_t *) r)
+    {
+      prev->page_cnt += r->page_cnt;
+      prev->next = r->next;
+      r = prev;
+    }
+
+  /* Give a run at the top of the heap back to the kernel.  It is
+     the last run, since every run lies below the top. */
+  if (r->next == NULL
+      && (uint8_t *) r + r->page_cnt * PAGE_SIZE == (uint8_t *) sbrk (0))
+    {
+      size_t size = r->page_cnt * PAGE_SIZE;
+
+      for (rp = &runs; *rp != r; rp = &(*rp)->next)
+        continue;
+      *rp = NULL;
+      sbrk (-(intptr_t) size);
+    }
+}
+
+/* Pushes B onto the front of D's free list. */
+static void
+list_push (struct desc *d, struct block *b)
+{
+  b->prev = NULL;
+  b->next = d->free_list;
+  if (b->next != NULL)
+    b->next->prev = b;
+  d->free_list = b;
+}
+
+/* Removes B from D's free list. */
+static void
+list_unlink (struct desc *d, struct block *b)
+{
+  if (b->prev != NULL)
+    b->prev->next = b->next;
+  else
+    d->free_list = b->next;
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+}
@@ -0,0 +1,63 @@
+#include <mutex.h>
+#include <syscall.h>
+
+/* The mutex of Drepper, "Futexes Are Tricky".  STATE is 0
+   when free and 1 when held by a thread that need not wake
+   anyone on release.  A thread that finds it held sets it to 2
+   before sleeping, so the holder knows to make the system call
+   to wake it, and a thread woken takes it as 2 in case others
+   are still asleep. */
+
+/* Atomically sets *P to NEW if it is OLD, and returns what *P
+   was. */
+static inline int
+compare_exchange (int *p, int old, int new)
+{
+  asm volatile ("lock cmpxchgl %2, %1"
+                : "+a" (old), "+m" (*p)
+                : "r" (new)
+                : "memory");
+  return old;
+}
+
+/* Atomically sets *P to NEW and returns what *P was. */
+static inline int
+exchange (int *p, int new)
+{
+  asm volatile ("xchgl %0, %1" : "+r" (new), "+m" (*p) : : "memory");
+  return new;
+}
+
+/* Initializes M as free. */
+void
+mutex_init (struct mutex *m)
+{
+  m->state = 0;
+}
+
+/* Takes M, sleeping until it is free. */
+void
+mutex_lock (struct mutex *m)
+{
+  int c = compare_exchange (&m->state, 0, 1);
+
+  if (c != 0)
+    {
+      if (c != 2)
+        c = exchange (&m->state, 2);
+      while (c != 0)
+        {
+          futex_wait (&m->state, 2);
+          c = exchange (&m->state, 2);
+        }
+    }
+}
+
+/* Releases M, which the calling thread holds, waking a thread
+   waiting for it if there may be one. */
+void
+mutex_unlock (struct mutex *m)
+{
+  if (exchange (&m->state, 0) == 2)
+    futex_wake (&m->state, 1);
+}
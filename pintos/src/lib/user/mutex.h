@@ -0,0 +1,19 @@
+#ifndef __LIB_USER_MUTEX_H
+#define __LIB_USER_MUTEX_H
+
+/* A lock for the threads of one process.  Taking and releasing an
+   uncontended mutex is an atomic instruction, without entering
+   the kernel; a thread that has to wait sleeps on a futex. */
+struct mutex
+  {
+    int state;          /* 0 free, 1 held, 2 held with waiters. */
+  };
+
+/* Initializer for a free mutex. */
+#define MUTEX_INITIALIZER { 0 }
+
+void mutex_init (struct mutex *);
+void mutex_lock (struct mutex *);
+void mutex_unlock (struct mutex *);
+
+#endif /* lib/user/mutex.h */
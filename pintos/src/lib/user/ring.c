@@ -0,0 +1,88 @@
+#include <ring.h>
+#include <debug.h>
+#include <string.h>
+
+/* The writer fills the bytes from HEAD on and then advances HEAD;
+   the reader empties the bytes from TAIL on and then advances
+   TAIL.  Both counters run freely and wrap around, and HEAD - TAIL
+   is always the number of bytes in the ring.  The x86 keeps
+   stores in order with other stores, and loads with other loads,
+   so it is enough that the compiler does not move the data copies
+   past the counter updates. */
+
+/* Keeps the compiler from moving memory accesses across it. */
+#define barrier() asm volatile ("" : : : "memory")
+
+/* Sets up an empty ring in the MEM_SIZE bytes at MEM, which the
+   writer and reader both map, and returns it.  The ring holds the
+   largest power of 2 of bytes that fits.  Only one side should
+   call this, before the other starts using the ring. */
+struct ring *
+ring_init (void *mem, size_t mem_size)
+{
+  struct ring *r = mem;
+  size_t size = 1;
+
+  ASSERT (mem_size > sizeof *r);
+  while (size * 2 <= mem_size - sizeof *r)
+    size *= 2;
+  r->head = r->tail = 0;
+  r->size = size;
+  return r;
+}
+
+/* Copies up to SIZE bytes from BUF into R, as many as there is
+   room for, and returns the number copied.  Only the writer may
+   call this. */
+size_t
+ring_write (struct ring *r, const void *buf_, size_t size)
+{
+  const uint8_t *buf = buf_;
+  uint32_t head = r->head;
+  uint32_t room = r->size - (head - r->tail);
+  size_t done = 0;
+
+  if (size > room)
+    size = room;
+  barrier ();
+  while (done < size)
+    {
+      uint32_t ofs = (head + done) & (r->size - 1);
+      size_t chunk = r->size - ofs;
+      if (chunk > size - done)
+        chunk = size - done;
+      memcpy (r->data + ofs, buf + done, chunk);
+      done += chunk;
+    }
+  barrier ();
+  r->head = head + done;
+  return done;
+}
+
+/* Copies up to SIZE bytes out of R into BUF, as many as are
+   there, and returns the number copied.  Only the reader may call
+   this. */
+size_t
+ring_read (struct ring *r, void *buf_, size_t size)
+{
+  uint8_t *buf = buf_;
+  uint32_t tail = r->tail;
+  uint32_t avail = r->head - tail;
+  size_t done = 0;
+
+  if (size > avail)
+    size = avail;
+  barrier ();
+  while (done < size)
+    {
+      uint32_t ofs = (tail + done) & (r->size - 1);
+      size_t chunk = r->size - ofs;
+      if (chunk > size - done)
+        chunk = size - done;
+      memcpy (buf + done, r->data + ofs, chunk);
+      done += chunk;
+    }
+  barrier ();
+  r->tail = tail + done;
+  return done;
+}
@@ -0,0 +1,23 @@
+#ifndef __LIB_USER_RING_H
+#define __LIB_USER_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A ring buffer of bytes for one writer and one reader, which may
+   be in different processes sharing the memory it lives in, as
+   from shm_map().  Neither side locks or enters the kernel: each
+   owns one of the two counters and only reads the other. */
+struct ring
+  {
+    volatile uint32_t head;     /* Bytes written ever; writer's. */
+    volatile uint32_t tail;     /* Bytes read ever; reader's. */
+    uint32_t size;              /* Capacity, a power of 2. */
+    uint8_t data[];             /* SIZE bytes. */
+  };
+
+struct ring *ring_init (void *mem, size_t mem_size);
+size_t ring_write (struct ring *, const void *, size_t);
+size_t ring_read (struct ring *, void *, size_t);
+
+#endif /* lib/user/ring.h */
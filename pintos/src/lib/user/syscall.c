@@ -1,31 +1,45 @@
 #include <syscall.h>
 #include "../syscall-nr.h"
 
+/* Instruction sequence that enters the kernel, and the registers
+   it clobbers besides %eax.  Define SYSCALL_SYSENTER to use the
+   SYSENTER fast path, which needs a CPU that supports it; the
+   kernel still accepts "int $0x30" either way. */
+#ifdef SYSCALL_SYSENTER
+#define SYSCALL_TRAP "movl %%esp, %%ecx; movl $1f, %%edx; sysenter; 1:"
+#define SYSCALL_CLOBBERS "memory", "ecx", "edx"
+#else
+#define SYSCALL_TRAP "int $0x30"
+#define SYSCALL_CLOBBERS "memory"
+#endif
+
 /* Invokes syscall NUMBER, passing no arguments, and returns the
    return value as an `int'. */
 #define syscall0(NUMBER)                                        \
         ({                                                      \
           int retval;                                           \
           asm volatile                                          \
-            ("pushl %[number]; int $0x30; addl $4, %%esp"       \
+            ("pushl %[number]; " SYSCALL_TRAP                   \
+             "; addl $4, %%esp"                                 \
                : "=a" (retval)                                  \
                : [number] "i" (NUMBER)                          \
-               : "memory");                                     \
+               : SYSCALL_CLOBBERS);                             \
           retval;                                               \
         })
 
 /* Invokes syscall NUMBER, passing argument ARG0, and returns the
    return value as an `int'. */
-#define syscall1(NUMBER, ARG0)                                           \
-        ({                                                               \
-          int retval;                                                    \
-          asm volatile                                                   \
-            ("pushl %[arg0]; pushl %[number]; int $0x30; addl $8, %%esp" \
-               : "=a" (retval)                                           \
-               : [number] "i" (NUMBER),                                  \
-                 [arg0] "g" (ARG0)                                       \
-               : "memory");                                              \
-          retval;                                                        \
+#define syscall1(NUMBER, ARG0)                                  \
+        ({                                                      \
+          int retval;                                           \
+          asm volatile                                          \
+            ("pushl %[arg0]; pushl %[number]; "                 \
+             SYSCALL_TRAP "; addl $8, %%esp"                    \
+               : "=a" (retval)                                  \
+               : [number] "i" (NUMBER),                         \
+                 [arg0] "g" (ARG0)                              \
+               : SYSCALL_CLOBBERS);                             \
+          retval;                                               \
         })
 
 /* Invokes syscall NUMBER, passing arguments ARG0 and ARG1, and
@@ -35,12 +49,13 @@
           int retval;                                           \
           asm volatile                                          \
             ("pushl %[arg1]; pushl %[arg0]; "                   \
-             "pushl %[number]; int $0x30; addl $12, %%esp"      \
+             "pushl %[number]; " SYSCALL_TRAP                   \
+             "; addl $12, %%esp"                                \
                : "=a" (retval)                                  \
                : [number] "i" (NUMBER),                         \
                  [arg0] "r" (ARG0),                             \
                  [arg1] "r" (ARG1)                              \
-               : "memory");                                     \
+               : SYSCALL_CLOBBERS);                             \
           retval;                                               \
         })
 
@@ -51,13 +66,34 @@
           int retval;                                           \
           asm volatile                                          \
             ("pushl %[arg2]; pushl %[arg1]; pushl %[arg0]; "    \
-             "pushl %[number]; int $0x30; addl $16, %%esp"      \
+             "pushl %[number]; " SYSCALL_TRAP                   \
+             "; addl $16, %%esp"                                \
                : "=a" (retval)                                  \
                : [number] "i" (NUMBER),                         \
                  [arg0] "r" (ARG0),                             \
                  [arg1] "r" (ARG1),                             \
                  [arg2] "r" (ARG2)                              \
-               : "memory");                                     \
+               : SYSCALL_CLOBBERS);                             \
+          retval;                                               \
+        })
+
+/* Invokes syscall NUMBER, passing arguments ARG0, ARG1, ARG2,
+   and ARG3, and returns the return value as an `int'. */
+#define syscall4(NUMBER, ARG0, ARG1, ARG2, ARG3)                \
+        ({                                                      \
+          int retval;                                           \
+          asm volatile                                          \
+            ("pushl %[arg3]; pushl %[arg2]; pushl %[arg1]; "    \
+             "pushl %[arg0]; "                                  \
+             "pushl %[number]; " SYSCALL_TRAP                   \
+             "; addl $20, %%esp"                                \
+               : "=a" (retval)                                  \
+               : [number] "i" (NUMBER),                         \
+                 [arg0] "r" (ARG0),                             \
+                 [arg1] "r" (ARG1),                             \
+                 [arg2] "r" (ARG2),                             \
+                 [arg3] "r" (ARG3)                              \
+               : SYSCALL_CLOBBERS);                             \
           retval;                                               \
         })
 
@@ -81,18 +117,104 @@ exit (int status)
   NOT_REACHED ();
 }
 
+/* Runs FUNC (AUX) as a new thread's first function, then ends
+   the thread. */
+static void NO_RETURN
+thread_start (thread_func *func, void *aux)
+{
+  func (aux);
+  thread_exit ();
+}
+
+/* Starts a thread running FUNC (AUX) on the STACK_SIZE bytes of
+   stack at STACK, which must stay allocated until the thread
+   exits.  Returns the new thread's tid, or TID_ERROR. */
+tid_t
+thread_create (thread_func *func, void *aux, void *stack, size_t stack_size)
+{
+  return syscall4 (SYS_THREADCREATE, thread_start, func, aux,
+                   (uint8_t *) stack + stack_size);
+}
+
+bool
+thread_join (tid_t tid)
+{
+  return syscall1 (SYS_THREADJOIN, tid);
+}
+
+void
+thread_exit (void)
+{
+  syscall0 (SYS_THREADEXIT);
+  NOT_REACHED ();
+}
+
+int
+futex_wait (int *addr, int val)
+{
+  return syscall2 (SYS_FUTEXWAIT, addr, val);
+}
+
+int
+futex_wake (int *addr, int cnt)
+{
+  return syscall2 (SYS_FUTEXWAKE, addr, cnt);
+}
+
+int
+aio_read (int fd, void *buffer, unsigned size, unsigned offset)
+{
+  return syscall4 (SYS_AIOREAD, fd, buffer, size, offset);
+}
+
+int
+aio_write (int fd, const void *buffer, unsigned size, unsigned offset)
+{
+  return syscall4 (SYS_AIOWRITE, fd, buffer, size, offset);
+}
+
+int
+aio_wait (int id)
+{
+  return syscall1 (SYS_AIOWAIT, id);
+}
+
+int
+aio_poll (int id)
+{
+  return syscall1 (SYS_AIOPOLL, id);
+}
+
 pid_t
 exec (const char *file)
 {
   return (pid_t) syscall1 (SYS_EXEC, file);
 }
 
+pid_t
+exec_argv (char *const argv[])
+{
+  return (pid_t) syscall1 (SYS_EXECV, argv);
+}
+
+pid_t
+fork (void)
+{
+  return (pid_t) syscall0 (SYS_FORK);
+}
+
 int
 wait (pid_t pid)
 {
   return syscall1 (SYS_WAIT, pid);
 }
 
+pid_t
+waitany (int *status, int options)
+{
+  return (pid_t) syscall2 (SYS_WAITANY, status, options);
+}
+
 bool
 create (const char *file, unsigned initial_size)
 {
@@ -159,6 +281,24 @@ munmap (mapid_t mapid)
   syscall1 (SYS_MUNMAP, mapid);
 }
 
+void *
+sbrk (intptr_t increment)
+{
+  return (void *) syscall1 (SYS_SBRK, increment);
+}
+
+int
+shm_open (int key, size_t size)
+{
+  return syscall2 (SYS_SHMOPEN, key, size);
+}
+
+void *
+shm_map (int id, void *addr)
+{
+  return (void *) syscall2 (SYS_SHMMAP, id, addr);
+}
+
 bool
 chdir (const char *dir)
 {
@@ -177,6 +317,42 @@ readdir (int fd, char name[READDIR_MAX_LEN + 1])
   return syscall2 (SYS_READDIR, fd, name);
 }
 
+int
+getdents (int fd, struct dirent *buf, unsigned size)
+{
+  return syscall3 (SYS_GETDENTS, fd, buf, size);
+}
+
+bool
+fstat (int fd, struct stat *st)
+{
+  return syscall2 (SYS_FSTAT, fd, st);
+}
+
+bool
+stat (const char *file, struct stat *st)
+{
+  return syscall2 (SYS_STAT, file, st);
+}
+
+int
+defrag (const char *file)
+{
+  return syscall1 (SYS_DEFRAG, file);
+}
+
+bool
+getrusage (pid_t pid, struct rusage *usage)
+{
+  return syscall2 (SYS_GETRUSAGE, pid, usage);
+}
+
+bool
+pipe (int fds[2])
+{
+  return syscall1 (SYS_PIPE, fds);
+}
+
 bool
 isdir (int fd)
 {
@@ -218,3 +394,81 @@ cache_reset ()
 {
   return syscall0 (SYS_CACHERESET);
 }
+
+bool
+fsync (int fd)
+{
+  return syscall1 (SYS_FSYNC, fd);
+}
+
+int
+readv (int fd, const struct iovec *iov, int iovcnt)
+{
+  return syscall3 (SYS_READV, fd, iov, iovcnt);
+}
+
+int
+writev (int fd, const struct iovec *iov, int iovcnt)
+{
+  return syscall3 (SYS_WRITEV, fd, iov, iovcnt);
+}
+
+int
+pread (int fd, void *buffer, unsigned size, unsigned offset)
+{
+  return syscall4 (SYS_PREAD, fd, buffer, size, offset);
+}
+
+int
+pwrite (int fd, const void *buffer, unsigned size, unsigned offset)
+{
+  return syscall4 (SYS_PWRITE, fd, buffer, size, offset);
+}
+
+bool
+sched_stats (struct sched_stats *stats)
+{
+  return syscall1 (SYS_SCHEDSTATS, stats);
+}
+
+int
+batch (struct batch_op *ops, int cnt)
+{
+  return syscall2 (SYS_BATCH, ops, cnt);
+}
+
+bool
+fsstats (struct fs_stats *stats)
+{
+  return syscall1 (SYS_FSSTATS, stats);
+}
+
+unsigned
+ticks (void)
+{
+  return syscall0 (SYS_TICKS);
+}
+
+bool
+blockstats (unsigned idx, struct block_stats *stats)
+{
+  return syscall2 (SYS_BLOCKSTATS, idx, stats);
+}
+
+bool
+net_info (uint8_t mac[NET_ADDR_LEN])
+{
+  return syscall1 (SYS_NETINFO, mac);
+}
+
+int
+net_send (const struct iovec *packets, int cnt)
+{
+  return syscall2 (SYS_NETSEND, packets, cnt);
+}
+
+int
+net_recv (void *buffer, unsigned size)
+{
+  return syscall2 (SYS_NETRECV, buffer, size);
+}
@@ -2,6 +2,8 @@
 #define __LIB_USER_SYSCALL_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <debug.h>
 
 /* Process identifier. */
@@ -23,7 +25,10 @@ typedef int mapid_t;
 void halt (void) NO_RETURN;
 void exit (int status) NO_RETURN;
 pid_t exec (const char *file);
+pid_t exec_argv (char *const argv[]);
+pid_t fork (void);
 int wait (pid_t);
+pid_t waitany (int *status, int options);
 bool create (const char *file, unsigned initial_size);
 bool remove (const char *file);
 int open (const char *file);
@@ -35,14 +40,88 @@ unsigned tell (int fd);
 void close (int fd);
 int practice (int i);
 
+/* Thread identifier. */
+typedef int tid_t;
+#define TID_ERROR ((tid_t) -1)
+
+/* A process's threads share its memory and open files, but each
+   has its own working directory.  exit() from any of them ends
+   the whole process. */
+typedef void thread_func (void *aux);
+tid_t thread_create (thread_func *, void *aux, void *stack,
+                     size_t stack_size);
+bool thread_join (tid_t);
+void thread_exit (void) NO_RETURN;
+
+/* Sleeps while *ADDR == VAL, until futex_wake() on ADDR.  Returns
+   -1 at once if *ADDR != VAL. */
+int futex_wait (int *addr, int val);
+/* Wakes up to CNT threads sleeping on ADDR; returns how many. */
+int futex_wake (int *addr, int cnt);
+
+/* Asynchronous I/O.  aio_read() and aio_write() start moving up
+   to AIO_MAX_SIZE bytes at OFFSET in FD and return an id for the
+   transfer at once, or -1.  aio_wait() waits for it to finish;
+   aio_poll() returns AIO_PENDING instead if it has not.  Both
+   return the bytes moved, or -1, and the id is then used up.
+   A read's BUFFER is filled in only by aio_wait() or aio_poll();
+   a write's may be reused as soon as aio_write() returns. */
+int aio_read (int fd, void *buffer, unsigned size, unsigned offset);
+int aio_write (int fd, const void *buffer, unsigned size, unsigned offset);
+int aio_wait (int id);
+int aio_poll (int id);
+
 /* Project 3 and optionally project 4. */
 mapid_t mmap (int fd, void *addr);
 void munmap (mapid_t);
+void *sbrk (intptr_t increment);
+
+/* Shared memory.  shm_open() returns the id of the segment with
+   KEY, creating it SIZE bytes long, in whole pages, if there is
+   none, or -1.  shm_map() maps the whole segment writable at
+   page-aligned ADDR and returns ADDR, or a null pointer.  Every
+   process mapping a segment sees the same memory.  A segment goes
+   away once the last process that mapped it exits. */
+int shm_open (int key, size_t size);
+void *shm_map (int id, void *addr);
 
 /* Project 4 only. */
 bool chdir (const char *dir);
 bool mkdir (const char *dir);
 bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
+
+/* One directory entry written by getdents(). */
+struct dirent
+  {
+    unsigned inumber;           /* Inode number, as inumber() returns. */
+    bool is_dir;                /* True if the entry is a directory. */
+    char name[READDIR_MAX_LEN + 1]; /* Null-terminated file name. */
+  };
+
+int getdents (int fd, struct dirent *buf, unsigned size);
+
+/* A file's size, type and inode number, as fstat() and stat()
+   report them. */
+struct stat
+  {
+    unsigned inumber;           /* Inode number, as inumber() returns. */
+    int size;                   /* File size in bytes. */
+    bool is_dir;                /* True if a directory. */
+  };
+
+bool fstat (int fd, struct stat *);
+bool stat (const char *file, struct stat *);
+
+/* Moves FILE, or every file in the tree below it if it is a
+   directory, to consecutive sectors wherever it is fragmented.
+   Returns the number of files moved, or -1 if FILE does not
+   exist. */
+int defrag (const char *file);
+
+/* Creates a pipe, storing the fd of its read end in FDS[0] and of
+   its write end in FDS[1].  A child started with exec() inherits
+   the pipe fds of its parent, but no other fds. */
+bool pipe (int fds[2]);
 bool isdir (int fd);
 int inumber (int fd);
 int cache_hits (void);
@@ -50,5 +129,167 @@ int cache_tries (void);
 int disk_reads (void);
 int disk_writes (void);
 void cache_reset (void);
+bool fsync (int fd);
+
+/* One buffer of a vectored read or write. */
+struct iovec
+  {
+    void *iov_base;             /* Start of buffer. */
+    size_t iov_len;             /* Length of buffer in bytes. */
+  };
+
+/* Most buffers readv() or writev() accept at once. */
+#define IOV_MAX 1024
+
+int readv (int fd, const struct iovec *iov, int iovcnt);
+int writev (int fd, const struct iovec *iov, int iovcnt);
+int pread (int fd, void *buffer, unsigned size, unsigned offset);
+int pwrite (int fd, const void *buffer, unsigned size, unsigned offset);
+
+/* Number of buckets in a scheduler latency histogram.  Bucket 0
+   counts intervals shorter than one timer tick, bucket B counts
+   intervals of 2**(B-1) to 2**B - 1 ticks, and the last bucket
+   also takes anything longer. */
+#define SCHED_HIST_BUCKETS 16
+
+/* Scheduler statistics for the calling thread, plus system-wide
+   latency histograms. */
+struct sched_stats
+  {
+    int64_t run_ticks;                  /* Ticks spent running. */
+    int64_t ready_ticks;                /* Ticks spent ready to run. */
+    int64_t blocked_ticks;              /* Ticks spent blocked. */
+    unsigned voluntary_switches;        /* Switches away by blocking. */
+    unsigned involuntary_switches;      /* Switches away while ready. */
+    unsigned ready_hist[SCHED_HIST_BUCKETS];   /* Waits to be scheduled. */
+    unsigned blocked_hist[SCHED_HIST_BUCKETS]; /* Times spent blocked. */
+  };
+
+bool sched_stats (struct sched_stats *);
+
+/* Resources used by a process. */
+struct rusage
+  {
+    int64_t user_ticks;                 /* Ticks running user code. */
+    int64_t system_ticks;               /* Ticks running in the kernel. */
+    unsigned page_faults;               /* Page faults taken. */
+    unsigned resident_pages;            /* User pages in memory. */
+    uint64_t bytes_read;                /* Bytes read from fds. */
+    uint64_t bytes_written;             /* Bytes written to fds. */
+    unsigned cache_hits;                /* Buffer cache hits. */
+    unsigned cache_misses;              /* Buffer cache misses. */
+    unsigned voluntary_switches;        /* Switches away by blocking. */
+    unsigned involuntary_switches;      /* Switches away while ready. */
+  };
+
+/* Stores in *USAGE the resources used by process PID: the caller
+   if PID is RUSAGE_SELF, the sum over the children it has waited
+   for if RUSAGE_CHILDREN, or otherwise a child that has exited but
+   not yet been waited for.  A child's RESIDENT_PAGES is what it
+   held as it exited.  Returns false if PID is none of these. */
+#define RUSAGE_SELF 0             /* getrusage() of the caller. */
+#define RUSAGE_CHILDREN -1        /* getrusage() of waited-for children. */
+bool getrusage (pid_t pid, struct rusage *);
+
+/* One operation for batch().  The kernel stores the value the
+   equivalent system call would return in RESULT. */
+struct batch_op
+  {
+    int op;                     /* BATCH_READ, BATCH_WRITE, ... */
+    int fd;                     /* File descriptor. */
+    void *buf;                  /* Buffer, or file name for BATCH_OPEN. */
+    unsigned len;               /* Buffer size in bytes. */
+    unsigned offset;            /* File offset, or BATCH_POS. */
+    int result;                 /* Set by the kernel. */
+  };
+
+int batch (struct batch_op *ops, int cnt);
+
+/* What a cached sector holds.  The first three are file system
+   metadata. */
+enum fs_class
+  {
+    FS_CLASS_INODE,                     /* An inode. */
+    FS_CLASS_INDEX,                     /* An indirect block. */
+    FS_CLASS_DIR,                       /* Directory entries. */
+    FS_CLASS_FILE,                      /* File data. */
+    FS_CLASS_CNT
+  };
+
+/* Buffer cache statistics since the cache was last initialized.
+   Sectors read ahead are not counted as lookups. */
+struct fs_stats
+  {
+    uint64_t meta_hits;                 /* Lookups of metadata found cached. */
+    uint64_t meta_misses;               /* Lookups of metadata read from disk. */
+    uint64_t data_hits;                 /* Lookups of file data found cached. */
+    uint64_t data_misses;               /* Lookups of file data read from disk. */
+    uint64_t class_hits[FS_CLASS_CNT];  /* Hits, by what the sector holds. */
+    uint64_t class_misses[FS_CLASS_CNT]; /* Misses, by what the sector holds. */
+    uint64_t evictions;                 /* Valid blocks evicted. */
+    uint64_t dirty_evictions;           /* Of those, blocks written back first. */
+    uint64_t readahead_reads;           /* Sectors read ahead. */
+    uint64_t readahead_hits;            /* Sectors read ahead, later looked up. */
+    uint64_t flusher_writes;            /* Sectors written by write-behind and fsync. */
+    uint64_t disk_reads;                /* All sectors read from disk. */
+    uint64_t disk_writes;               /* All sectors written to disk. */
+  };
+
+bool fsstats (struct fs_stats *);
+
+/* Timer interrupts per second, the rate ticks() counts at. */
+#define TICKS_PER_SEC 100
+
+unsigned ticks (void);
+
+/* Number of buckets in a block latency histogram.  Bucket 0
+   counts intervals of 0 cycles of the time stamp counter, bucket
+   B counts intervals of 2**(B-1) to 2**B - 1 cycles, and the
+   last bucket also takes anything longer. */
+#define BLOCK_HIST_BUCKETS 32
+
+/* Statistics for one block device since boot.  Requests to a
+   partition are counted there and again on the disk under it;
+   only the disk sees transfers and their timing. */
+struct block_stats
+  {
+    char name[16];                      /* Device name, e.g. "hda". */
+    uint64_t read_cnt;                  /* Sectors read. */
+    uint64_t write_cnt;                 /* Sectors written. */
+    uint64_t read_bytes;                /* Bytes read. */
+    uint64_t write_bytes;               /* Bytes written. */
+    uint64_t requests;                  /* Reads and writes asked for. */
+    uint64_t transfers;                 /* Transfers the driver did; the
+                                           rest of REQUESTS were merged. */
+    uint64_t sequential;                /* Transfers starting where the
+                                           one before ended. */
+    uint64_t depth_sum;                 /* Requests queued or in flight,
+                                           summed over each new request. */
+    uint32_t depth_max;                 /* Most requests queued or in
+                                           flight at once. */
+    uint32_t cycles_per_tick;           /* Time stamp counter rate. */
+    uint64_t queue_cycles;              /* Total time requests waited to
+                                           be started. */
+    uint64_t service_cycles;            /* Total time transfers took. */
+    uint32_t queue_hist[BLOCK_HIST_BUCKETS];   /* Waits to be started. */
+    uint32_t service_hist[BLOCK_HIST_BUCKETS]; /* Transfer times. */
+  };
+
+bool blockstats (unsigned idx, struct block_stats *);
+
+/* Raw Ethernet frames, with their headers but not their CRCs.
+   net_info() stores the network device's address in MAC and
+   returns false if there is no device.  net_send() sends each of
+   the CNT buffers in PACKETS as a frame of NET_FRAME_MAX bytes or
+   fewer, in one batch, and returns how many it sent, or -1 on
+   error; it returns once the frames are queued.  net_recv() waits
+   for a frame, copies as much of it as fits into BUFFER, and
+   returns its length, or -1 on error.  Frames arriving faster
+   than they are received are dropped. */
+#define NET_ADDR_LEN 6
+#define NET_FRAME_MAX 1514
+bool net_info (uint8_t mac[NET_ADDR_LEN]);
+int net_send (const struct iovec *packets, int cnt);
+int net_recv (void *buffer, unsigned size);
 
 #endif /* lib/user/syscall.h */
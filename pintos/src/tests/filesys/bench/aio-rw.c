@@ -0,0 +1,84 @@
+/* Reads a file at random offsets, working on each chunk as it
+   arrives, first one read at a time and then with several
+   asynchronous reads kept in flight. */
+
+#include <random.h>
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+#include "tests/filesys/bench/bench.h"
+
+#define FILE_SIZE (1024 * 1024)
+#define CHUNK 4096
+#define OP_CNT 256
+#define IN_FLIGHT 8
+
+static char buf[IN_FLIGHT][CHUNK];
+static unsigned offsets[OP_CNT];
+
+/* Stands in for computing on a chunk of data. */
+static unsigned
+work (const char *p)
+{
+  unsigned sum = 0;
+  int pass, i;
+
+  for (pass = 0; pass < 8; pass++)
+    for (i = 0; i < CHUNK; i++)
+      sum = sum * 31 + p[i];
+  return sum;
+}
+
+void
+test_main (void)
+{
+  int ids[IN_FLIGHT];
+  size_t i, ofs;
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("aio", 0), "create \"aio\"");
+  CHECK ((fd = open ("aio")) > 1, "open \"aio\"");
+  for (ofs = 0; ofs < FILE_SIZE; ofs += CHUNK)
+    bench_write (fd, buf[0], CHUNK);
+  for (i = 0; i < OP_CNT; i++)
+    offsets[i] = random_ulong () % (FILE_SIZE / CHUNK) * CHUNK;
+
+  cache_reset ();
+  bench_start ();
+  for (i = 0; i < OP_CNT; i++)
+    {
+      int n = pread (fd, buf[0], CHUNK, offsets[i]);
+      if (n != CHUNK)
+        fail ("pread %d bytes returned %d", CHUNK, n);
+      work (buf[0]);
+    }
+  bench_report ("sync read", OP_CNT, (unsigned long long) OP_CNT * CHUNK);
+
+  /* Keep IN_FLIGHT reads queued, collecting the oldest before
+     starting the next into its buffer. */
+  cache_reset ();
+  bench_start ();
+  for (i = 0; i < OP_CNT + IN_FLIGHT; i++)
+    {
+      size_t slot = i % IN_FLIGHT;
+      if (i >= IN_FLIGHT)
+        {
+          int n = aio_wait (ids[slot]);
+          if (n != CHUNK)
+            fail ("aio_wait returned %d", n);
+          work (buf[slot]);
+        }
+      if (i < OP_CNT)
+        {
+          ids[slot] = aio_read (fd, buf[slot], CHUNK, offsets[i]);
+          if (ids[slot] < 0)
+            fail ("aio_read at %u failed", offsets[i]);
+        }
+    }
+  bench_report ("aio read", OP_CNT, (unsigned long long) OP_CNT * CHUNK);
+
+  close (fd);
+  CHECK (remove ("aio"), "remove \"aio\"");
+}
@@ -0,0 +1,69 @@
+#include "tests/filesys/bench/bench.h"
+#include <syscall.h>
+#include "tests/lib.h"
+
+static unsigned start_ticks;
+static struct fs_stats start_stats;
+static struct rusage start_usage;
+
+void
+bench_start (void)
+{
+  fsstats (&start_stats);
+  getrusage (RUSAGE_SELF, &start_usage);
+  start_ticks = ticks ();
+}
+
+void
+bench_report (const char *name, unsigned long long ops,
+              unsigned long long bytes)
+{
+  unsigned long long elapsed = ticks () - start_ticks;
+  struct fs_stats s;
+  struct rusage u;
+
+  fsstats (&s);
+  getrusage (RUSAGE_SELF, &u);
+
+  /* A run shorter than a tick counts as one. */
+  if (elapsed == 0)
+    elapsed = 1;
+
+#define DELTA(FIELD) (s.FIELD - start_stats.FIELD)
+  msg ("%s: %llu ops in %llu ms: %llu ops/s, %llu kB/s",
+       name, ops, elapsed * 1000 / TICKS_PER_SEC,
+       ops * TICKS_PER_SEC / elapsed, bytes * TICKS_PER_SEC / elapsed / 1024);
+  msg ("%s: hits %llu meta, %llu data; misses %llu meta, %llu data",
+       name, DELTA (meta_hits), DELTA (data_hits),
+       DELTA (meta_misses), DELTA (data_misses));
+  msg ("%s: evictions %llu, %llu dirty; read ahead %llu, %llu used; "
+       "flusher wrote %llu; disk read %llu, wrote %llu",
+       name, DELTA (evictions), DELTA (dirty_evictions),
+       DELTA (readahead_reads), DELTA (readahead_hits),
+       DELTA (flusher_writes), DELTA (disk_reads), DELTA (disk_writes));
+#undef DELTA
+#define DELTA(FIELD) (u.FIELD - start_usage.FIELD)
+  msg ("%s: process used %lld user, %lld system ticks; %u page faults, "
+       "%u resident pages; %u cache hits, %u misses; "
+       "%u voluntary, %u involuntary switches",
+       name, DELTA (user_ticks), DELTA (system_ticks), DELTA (page_faults),
+       u.resident_pages, DELTA (cache_hits), DELTA (cache_misses),
+       DELTA (voluntary_switches), DELTA (involuntary_switches));
+#undef DELTA
+}
+
+void
+bench_write (int fd, const void *buf, size_t size)
+{
+  int n = write (fd, buf, size);
+  if (n != (int) size)
+    fail ("write %zu bytes returned %d", size, n);
+}
+
+void
+bench_read (int fd, void *buf, size_t size)
+{
+  int n = read (fd, buf, size);
+  if (n != (int) size)
+    fail ("read %zu bytes returned %d", size, n);
+}
@@ -0,0 +1,22 @@
+#ifndef TESTS_FILESYS_BENCH_BENCH_H
+#define TESTS_FILESYS_BENCH_BENCH_H
+
+#include <stddef.h>
+
+/* Starts timing a run, noting the tick count and the buffer
+   cache statistics. */
+void bench_start (void);
+
+/* Reports the run since bench_start() as NAME, which did OPS
+   operations moving BYTES bytes: its rates, what the buffer cache
+   did meanwhile, and what the process used. */
+void bench_report (const char *name, unsigned long long ops,
+                   unsigned long long bytes);
+
+/* Writes SIZE bytes from BUF to FD, or fails. */
+void bench_write (int fd, const void *buf, size_t size);
+
+/* Reads SIZE bytes from FD into BUF, or fails. */
+void bench_read (int fd, void *buf, size_t size);
+
+#endif /* tests/filesys/bench/bench.h */
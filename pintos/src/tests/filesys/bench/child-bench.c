@@ -0,0 +1,38 @@
+/* Child process for concurrent: writes file "concN" if N, its
+   argument, is even, or reads it if odd.  Exits with status N. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/filesys/bench/bench.h"
+#include "tests/filesys/bench/concurrent.h"
+
+const char *test_name = "child-bench";
+
+static char buf[CHUNK_SIZE];
+
+int
+main (int argc, char *argv[])
+{
+  int id = argc > 1 ? atoi (argv[1]) : 0;
+  char name[32];
+  size_t ofs;
+  int fd;
+
+  quiet = true;
+  snprintf (name, sizeof name, "conc%d", id);
+  if (id % 2 == 0 && !create (name, 0))
+    fail ("create \"%s\"", name);
+  if ((fd = open (name)) < 2)
+    fail ("open \"%s\"", name);
+  for (ofs = 0; ofs < CHILD_FILE_SIZE; ofs += sizeof buf)
+    {
+      if (id % 2 == 0)
+        bench_write (fd, buf, sizeof buf);
+      else
+        bench_read (fd, buf, sizeof buf);
+    }
+  close (fd);
+  return id;
+}
@@ -0,0 +1,42 @@
+/* Runs several processes at once, half of them writing files
+   and half reading them, and times them all together. */
+
+#include <random.h>
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+#include "tests/filesys/bench/bench.h"
+#include "tests/filesys/bench/concurrent.h"
+
+static char buf[CHUNK_SIZE];
+
+void
+test_main (void)
+{
+  pid_t children[CHILD_CNT];
+  char name[32];
+  int i;
+  size_t ofs;
+
+  /* Readers need files to read. */
+  random_bytes (buf, sizeof buf);
+  for (i = 1; i < CHILD_CNT; i += 2)
+    {
+      int fd;
+
+      snprintf (name, sizeof name, "conc%d", i);
+      CHECK (create (name, 0), "create \"%s\"", name);
+      CHECK ((fd = open (name)) > 1, "open \"%s\"", name);
+      for (ofs = 0; ofs < CHILD_FILE_SIZE; ofs += sizeof buf)
+        bench_write (fd, buf, sizeof buf);
+      close (fd);
+    }
+
+  bench_start ();
+  exec_children ("child-bench", children, CHILD_CNT);
+  wait_children (children, CHILD_CNT);
+  bench_report ("readers and writers",
+                CHILD_CNT * CHILD_FILE_SIZE / CHUNK_SIZE,
+                (unsigned long long) CHILD_CNT * CHILD_FILE_SIZE);
+}
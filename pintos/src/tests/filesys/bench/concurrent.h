@@ -0,0 +1,12 @@
+#ifndef TESTS_FILESYS_BENCH_CONCURRENT_H
+#define TESTS_FILESYS_BENCH_CONCURRENT_H
+
+/* Number of child-bench processes concurrent starts.  Even ones
+   write a file of their own, odd ones read one. */
+#define CHILD_CNT 4
+
+/* Bytes each child reads or writes, and how many at a time. */
+#define CHILD_FILE_SIZE (256 * 1024)
+#define CHUNK_SIZE 4096
+
+#endif /* tests/filesys/bench/concurrent.h */
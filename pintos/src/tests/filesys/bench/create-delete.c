@@ -0,0 +1,47 @@
+/* Creates many small files in one directory, then removes them,
+   for a few rounds. */
+
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+#include "tests/filesys/bench/bench.h"
+
+#define FILE_CNT 200
+#define ROUND_CNT 3
+
+static char buf[512];
+
+void
+test_main (void)
+{
+  int round, i;
+  char name[32];
+
+  CHECK (mkdir ("storm"), "mkdir \"storm\"");
+  for (round = 0; round < ROUND_CNT; round++)
+    {
+      bench_start ();
+      for (i = 0; i < FILE_CNT; i++)
+        {
+          int fd;
+
+          snprintf (name, sizeof name, "storm/f%d", i);
+          if (!create (name, 0) || (fd = open (name)) < 2)
+            fail ("create \"%s\"", name);
+          bench_write (fd, buf, sizeof buf);
+          close (fd);
+        }
+      bench_report ("create", FILE_CNT, FILE_CNT * sizeof buf);
+
+      bench_start ();
+      for (i = 0; i < FILE_CNT; i++)
+        {
+          snprintf (name, sizeof name, "storm/f%d", i);
+          if (!remove (name))
+            fail ("remove \"%s\"", name);
+        }
+      bench_report ("remove", FILE_CNT, 0);
+    }
+  CHECK (remove ("storm"), "remove \"storm\"");
+}
@@ -0,0 +1,38 @@
+/* Opens a file at the bottom of a deep chain of directories by
+   its absolute path, over and over. */
+
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+#include "tests/filesys/bench/bench.h"
+
+#define DEPTH 16
+#define OP_CNT 500
+
+void
+test_main (void)
+{
+  char path[DEPTH * 3 + 16] = "";
+  int depth, op;
+
+  for (depth = 0; depth < DEPTH; depth++)
+    {
+      strlcat (path, "/d", sizeof path);
+      if (!mkdir (path))
+        fail ("mkdir \"%s\"", path);
+    }
+  strlcat (path, "/leaf", sizeof path);
+  CHECK (create (path, 512), "create \"%s\"", path);
+
+  bench_start ();
+  for (op = 0; op < OP_CNT; op++)
+    {
+      int fd = open (path);
+      if (fd < 2)
+        fail ("open \"%s\"", path);
+      close (fd);
+    }
+  bench_report ("open depth 16", OP_CNT, 0);
+}
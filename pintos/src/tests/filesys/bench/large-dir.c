@@ -0,0 +1,49 @@
+/* Fills one directory with many files, then looks them up at
+   random and lists the directory. */
+
+#include <random.h>
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+#include "tests/filesys/bench/bench.h"
+
+#define FILE_CNT 500
+#define OP_CNT 1000
+
+void
+test_main (void)
+{
+  char name[READDIR_MAX_LEN + 1];
+  char path[32];
+  int i, fd, cnt;
+
+  CHECK (mkdir ("big"), "mkdir \"big\"");
+  bench_start ();
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      snprintf (path, sizeof path, "big/f%d", i);
+      if (!create (path, 0))
+        fail ("create \"%s\"", path);
+    }
+  bench_report ("create", FILE_CNT, 0);
+
+  bench_start ();
+  for (i = 0; i < OP_CNT; i++)
+    {
+      snprintf (path, sizeof path, "big/f%lu", random_ulong () % FILE_CNT);
+      if ((fd = open (path)) < 2)
+        fail ("open \"%s\"", path);
+      close (fd);
+    }
+  bench_report ("open", OP_CNT, 0);
+
+  CHECK ((fd = open ("big")) > 1, "open \"big\"");
+  bench_start ();
+  for (cnt = 0; readdir (fd, name); cnt++)
+    continue;
+  bench_report ("readdir", cnt, 0);
+  close (fd);
+  if (cnt != FILE_CNT)
+    fail ("readdir found %d entries, not %d", cnt, FILE_CNT);
+}
@@ -0,0 +1,57 @@
+/* Reads and writes a file at random offsets, in chunks of
+   several sizes. */
+
+#include <random.h>
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+#include "tests/filesys/bench/bench.h"
+
+#define FILE_SIZE (1024 * 1024)
+#define OP_CNT 512
+
+static char buf[4096];
+static const size_t chunk_sizes[] = {512, 4096};
+
+void
+test_main (void)
+{
+  size_t i, ofs;
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("rand", 0), "create \"rand\"");
+  CHECK ((fd = open ("rand")) > 1, "open \"rand\"");
+  for (ofs = 0; ofs < FILE_SIZE; ofs += sizeof buf)
+    bench_write (fd, buf, sizeof buf);
+
+  for (i = 0; i < sizeof chunk_sizes / sizeof *chunk_sizes; i++)
+    {
+      size_t chunk = chunk_sizes[i];
+      size_t chunk_cnt = FILE_SIZE / chunk;
+      char name[32];
+      int op;
+
+      snprintf (name, sizeof name, "read %zu", chunk);
+      bench_start ();
+      for (op = 0; op < OP_CNT; op++)
+        {
+          seek (fd, random_ulong () % chunk_cnt * chunk);
+          bench_read (fd, buf, chunk);
+        }
+      bench_report (name, OP_CNT, (unsigned long long) OP_CNT * chunk);
+
+      snprintf (name, sizeof name, "write %zu", chunk);
+      bench_start ();
+      for (op = 0; op < OP_CNT; op++)
+        {
+          seek (fd, random_ulong () % chunk_cnt * chunk);
+          bench_write (fd, buf, chunk);
+        }
+      bench_report (name, OP_CNT, (unsigned long long) OP_CNT * chunk);
+    }
+
+  close (fd);
+  CHECK (remove ("rand"), "remove \"rand\"");
+}
@@ -0,0 +1,48 @@
+/* Writes a file sequentially, then reads it back, in chunks of
+   several sizes. */
+
+#include <random.h>
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+#include "tests/filesys/bench/bench.h"
+
+#define FILE_SIZE (1024 * 1024)
+
+static char buf[64 * 1024];
+static const size_t chunk_sizes[] = {512, 4096, 64 * 1024};
+
+void
+test_main (void)
+{
+  size_t i;
+
+  random_bytes (buf, sizeof buf);
+  for (i = 0; i < sizeof chunk_sizes / sizeof *chunk_sizes; i++)
+    {
+      size_t chunk = chunk_sizes[i];
+      size_t ofs;
+      char name[32];
+      int fd;
+
+      CHECK (create ("seq", 0), "create \"seq\"");
+      CHECK ((fd = open ("seq")) > 1, "open \"seq\"");
+
+      snprintf (name, sizeof name, "write %zu", chunk);
+      bench_start ();
+      for (ofs = 0; ofs < FILE_SIZE; ofs += chunk)
+        bench_write (fd, buf, chunk);
+      bench_report (name, FILE_SIZE / chunk, FILE_SIZE);
+
+      seek (fd, 0);
+      snprintf (name, sizeof name, "read %zu", chunk);
+      bench_start ();
+      for (ofs = 0; ofs < FILE_SIZE; ofs += chunk)
+        bench_read (fd, buf, chunk);
+      bench_report (name, FILE_SIZE / chunk, FILE_SIZE);
+
+      close (fd);
+      CHECK (remove ("seq"), "remove \"seq\"");
+    }
+}
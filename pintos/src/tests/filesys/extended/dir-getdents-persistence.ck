@@ -0,0 +1,6 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_archive ({'a' => {'x' => ["\0" x 10], 'y' => [''], 'sub' => {}}});
+pass;
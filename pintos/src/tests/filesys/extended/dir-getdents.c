@@ -0,0 +1,82 @@
+/* Lists a directory with getdents(), which must return each of
+   its entries once, with the right type and inode number, but
+   not "." or "..", and then 0.  Lists it again one entry per
+   call, which must give the same entries. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+/* The entries made in "a". */
+static const struct
+  {
+    const char *name;
+    bool is_dir;
+  }
+expected[] = {{"x", false}, {"y", false}, {"sub", true}};
+
+#define EXPECTED_CNT (sizeof expected / sizeof *expected)
+
+/* Checks that the CNT entries in ENTS are those in EXPECTED, in
+   any order, and that each has the inode number of the file it
+   names. */
+static void
+check_entries (const struct dirent *ents, int cnt)
+{
+  size_t i;
+  int j;
+
+  if (cnt != EXPECTED_CNT)
+    fail ("getdents() found %d entries, not %zu", cnt, EXPECTED_CNT);
+  for (i = 0; i < EXPECTED_CNT; i++)
+    {
+      char path[32] = "a/";
+      int fd;
+
+      for (j = 0; j < cnt; j++)
+        if (!strcmp (ents[j].name, expected[i].name))
+          break;
+      if (j == cnt)
+        fail ("getdents() did not find \"%s\"", expected[i].name);
+      if (ents[j].is_dir != expected[i].is_dir)
+        fail ("getdents() says \"%s\" is %sa directory",
+              expected[i].name, ents[j].is_dir ? "" : "not ");
+
+      strlcat (path, expected[i].name, sizeof path);
+      fd = open (path);
+      if (fd < 2)
+        fail ("open \"%s\"", path);
+      if ((int) ents[j].inumber != inumber (fd))
+        fail ("getdents() gives \"%s\" inode %u, not %d",
+              path, ents[j].inumber, inumber (fd));
+      close (fd);
+    }
+}
+
+void
+test_main (void)
+{
+  struct dirent ents[8];
+  int fd, cnt;
+
+  CHECK (mkdir ("a"), "mkdir \"a\"");
+  CHECK (create ("a/x", 10), "create \"a/x\"");
+  CHECK (create ("a/y", 0), "create \"a/y\"");
+  CHECK (mkdir ("a/sub"), "mkdir \"a/sub\"");
+
+  CHECK ((fd = open ("a")) > 1, "open \"a\"");
+  cnt = getdents (fd, ents, sizeof ents);
+  check_entries (ents, cnt);
+  msg ("getdents() found \"x\", \"y\" and \"sub\"");
+  CHECK (getdents (fd, ents, sizeof ents) == 0, "getdents() at the end");
+  close (fd);
+
+  CHECK ((fd = open ("a")) > 1, "open \"a\"");
+  for (cnt = 0; cnt < 8; cnt++)
+    if (getdents (fd, &ents[cnt], sizeof *ents) != 1)
+      break;
+  check_entries (ents, cnt);
+  msg ("getdents() one at a time found \"x\", \"y\" and \"sub\"");
+  close (fd);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-getdents) begin
+(dir-getdents) mkdir "a"
+(dir-getdents) create "a/x"
+(dir-getdents) create "a/y"
+(dir-getdents) mkdir "a/sub"
+(dir-getdents) open "a"
+(dir-getdents) getdents() found "x", "y" and "sub"
+(dir-getdents) getdents() at the end
+(dir-getdents) open "a"
+(dir-getdents) getdents() one at a time found "x", "y" and "sub"
+(dir-getdents) end
+EOF
+pass;
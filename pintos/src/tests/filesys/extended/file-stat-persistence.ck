@@ -0,0 +1,6 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_archive ({'f' => ["\0" x 1234 . 'x' x 100], 'd' => {}});
+pass;
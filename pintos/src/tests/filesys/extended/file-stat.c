@@ -0,0 +1,44 @@
+/* Checks the size, type and inode number that stat() and fstat()
+   report for a file and a directory, and that the size follows
+   the file as it grows. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  static char buf[100];
+  struct stat st;
+  int fd, dir_fd;
+
+  CHECK (create ("f", 1234), "create \"f\"");
+  CHECK (mkdir ("d"), "mkdir \"d\"");
+
+  CHECK (stat ("f", &st), "stat \"f\"");
+  CHECK (st.size == 1234 && !st.is_dir,
+         "\"f\" is a file of %d bytes", st.size);
+
+  CHECK ((fd = open ("f")) > 1, "open \"f\"");
+  CHECK (fstat (fd, &st), "fstat \"f\"");
+  CHECK (st.size == 1234 && !st.is_dir && (int) st.inumber == inumber (fd),
+         "\"f\" is a file of %d bytes with its own inode number", st.size);
+
+  memset (buf, 'x', sizeof buf);
+  seek (fd, 1234);
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"f\"");
+  CHECK (fstat (fd, &st), "fstat \"f\" after write");
+  CHECK (st.size == 1334, "\"f\" has grown to %d bytes", st.size);
+  close (fd);
+
+  CHECK (stat ("d", &st) && st.is_dir, "stat \"d\": a directory");
+  CHECK ((dir_fd = open ("d")) > 1, "open \"d\"");
+  CHECK (fstat (dir_fd, &st) && st.is_dir
+         && (int) st.inumber == inumber (dir_fd),
+         "fstat \"d\": a directory with its own inode number");
+  close (dir_fd);
+
+  CHECK (!stat ("missing", &st), "stat \"missing\" (must return false)");
+}
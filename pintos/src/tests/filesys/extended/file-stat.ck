@@ -0,0 +1,23 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(file-stat) begin
+(file-stat) create "f"
+(file-stat) mkdir "d"
+(file-stat) stat "f"
+(file-stat) "f" is a file of 1234 bytes
+(file-stat) open "f"
+(file-stat) fstat "f"
+(file-stat) "f" is a file of 1234 bytes with its own inode number
+(file-stat) write "f"
+(file-stat) fstat "f" after write
+(file-stat) "f" has grown to 1334 bytes
+(file-stat) stat "d": a directory
+(file-stat) open "d"
+(file-stat) fstat "d": a directory with its own inode number
+(file-stat) stat "missing" (must return false)
+(file-stat) end
+EOF
+pass;
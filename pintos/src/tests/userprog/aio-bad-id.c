@@ -0,0 +1,31 @@
+/* Tries to start asynchronous I/O on bad fds and with too large
+   a size, and to collect ids that were never handed out or were
+   already collected.  Each must fail with -1. */
+
+#include <stdio.h>
+#include <syscall.h>
+#include <syscall-nr.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[AIO_MAX_SIZE + 1];
+
+void
+test_main (void)
+{
+  int handle, id;
+
+  CHECK (aio_read (0x20101234, buf, 10, 0) == -1, "aio_read bad fd");
+  CHECK (aio_write (0x20101234, buf, 10, 0) == -1, "aio_write bad fd");
+  CHECK (aio_read (STDIN_FILENO, buf, 10, 0) == -1, "aio_read stdin");
+  CHECK (aio_wait (12345) == -1, "aio_wait unknown id");
+  CHECK (aio_poll (12345) == -1, "aio_poll unknown id");
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK (aio_read (handle, buf, sizeof buf, 0) == -1,
+         "aio_read more than AIO_MAX_SIZE bytes");
+  CHECK ((id = aio_read (handle, buf, 10, 0)) != -1, "aio_read");
+  CHECK (aio_wait (id) == 10, "aio_wait");
+  CHECK (aio_wait (id) == -1, "aio_wait same id again");
+  CHECK (aio_poll (id) == -1, "aio_poll same id again");
+}
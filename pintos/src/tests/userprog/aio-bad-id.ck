@@ -0,0 +1,21 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(aio-bad-id) begin
+(aio-bad-id) aio_read bad fd
+(aio-bad-id) aio_write bad fd
+(aio-bad-id) aio_read stdin
+(aio-bad-id) aio_wait unknown id
+(aio-bad-id) aio_poll unknown id
+(aio-bad-id) open "sample.txt"
+(aio-bad-id) aio_read more than AIO_MAX_SIZE bytes
+(aio-bad-id) aio_read
+(aio-bad-id) aio_wait
+(aio-bad-id) aio_wait same id again
+(aio-bad-id) aio_poll same id again
+(aio-bad-id) end
+aio-bad-id: exit(0)
+EOF
+pass;
@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(aio-bad-ptr) begin
+(aio-bad-ptr) open "sample.txt"
+aio-bad-ptr: exit(-1)
+EOF
+pass;
@@ -0,0 +1,55 @@
+/* Starts two asynchronous reads of "sample.txt" at once and
+   collects them in the opposite order, then one that runs past
+   the end of the file and comes up short, and finally one that
+   is collected by polling. */
+
+#include <string.h>
+#include <syscall.h>
+#include <syscall-nr.h>
+#include "tests/userprog/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  size_t size = sizeof sample - 1;
+  char whole[sizeof sample], part[100];
+  int handle, all_id, part_id, id, byte_cnt;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK ((all_id = aio_read (handle, whole, size, 0)) != -1,
+         "aio_read whole file");
+  CHECK ((part_id = aio_read (handle, part, sizeof part, 10)) != -1,
+         "aio_read 100 bytes at offset 10");
+  if (all_id == part_id)
+    fail ("both reads have id %d", all_id);
+
+  byte_cnt = aio_wait (part_id);
+  if (byte_cnt != sizeof part)
+    fail ("aio_wait() returned %d instead of %zu", byte_cnt, sizeof part);
+  if (memcmp (part, sample + 10, sizeof part))
+    fail ("read 100 bytes at offset 10 wrong");
+  byte_cnt = aio_wait (all_id);
+  if (byte_cnt != (int) size)
+    fail ("aio_wait() returned %d instead of %zu", byte_cnt, size);
+  if (memcmp (whole, sample, size))
+    fail ("read whole file wrong");
+  msg ("collected both reads");
+
+  CHECK ((id = aio_read (handle, part, sizeof part, size - 10)) != -1,
+         "aio_read past end of file");
+  CHECK (aio_wait (id) == 10, "aio_wait returned the 10 bytes left");
+  if (memcmp (part, sample + size - 10, 10))
+    fail ("read at end of file wrong");
+
+  CHECK ((id = aio_read (handle, part, sizeof part, 0)) != -1,
+         "aio_read for polling");
+  while ((byte_cnt = aio_poll (id)) == AIO_PENDING)
+    continue;
+  if (byte_cnt != sizeof part)
+    fail ("aio_poll() returned %d instead of %zu", byte_cnt, sizeof part);
+  if (memcmp (part, sample, sizeof part))
+    fail ("polled read wrong");
+  msg ("collected read by polling");
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(aio-read) begin
+(aio-read) open "sample.txt"
+(aio-read) aio_read whole file
+(aio-read) aio_read 100 bytes at offset 10
+(aio-read) collected both reads
+(aio-read) aio_read past end of file
+(aio-read) aio_wait returned the 10 bytes left
+(aio-read) aio_read for polling
+(aio-read) collected read by polling
+(aio-read) end
+aio-read: exit(0)
+EOF
+pass;
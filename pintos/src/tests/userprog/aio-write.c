@@ -0,0 +1,42 @@
+/* Writes the second half of "test.txt" and then the first half
+   with asynchronous writes that are both in flight at once.  Each
+   buffer is overwritten as soon as aio_write() returns, which
+   must not change what reaches the file. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/userprog/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  size_t half = (sizeof sample - 1) / 2;
+  size_t rest = sizeof sample - 1 - half;
+  char buf[sizeof sample];
+  int handle, first_id, second_id, byte_cnt;
+
+  CHECK (create ("test.txt", 0), "create \"test.txt\"");
+  CHECK ((handle = open ("test.txt")) > 1, "open \"test.txt\"");
+
+  memcpy (buf, sample + half, rest);
+  CHECK ((second_id = aio_write (handle, buf, rest, half)) != -1,
+         "aio_write second half");
+  memset (buf, 'x', sizeof buf);
+  memcpy (buf, sample, half);
+  CHECK ((first_id = aio_write (handle, buf, half, 0)) != -1,
+         "aio_write first half");
+  memset (buf, 'x', sizeof buf);
+
+  byte_cnt = aio_wait (second_id);
+  if (byte_cnt != (int) rest)
+    fail ("aio_wait() returned %d instead of %zu", byte_cnt, rest);
+  byte_cnt = aio_wait (first_id);
+  if (byte_cnt != (int) half)
+    fail ("aio_wait() returned %d instead of %zu", byte_cnt, half);
+  msg ("collected both writes");
+  close (handle);
+
+  check_file ("test.txt", sample, sizeof sample - 1);
+}
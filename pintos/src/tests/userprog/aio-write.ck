@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(aio-write) begin
+(aio-write) create "test.txt"
+(aio-write) open "test.txt"
+(aio-write) aio_write second half
+(aio-write) aio_write first half
+(aio-write) collected both writes
+(aio-write) open "test.txt" for verification
+(aio-write) verified contents of "test.txt"
+(aio-write) close "test.txt"
+(aio-write) end
+aio-write: exit(0)
+EOF
+pass;
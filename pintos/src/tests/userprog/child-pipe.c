@@ -0,0 +1,42 @@
+/* Child process run by the pipe tests.
+
+   Invoked as "child-pipe R W [FD...]".  Closes each FD, which
+   should include the write end of the pipe it reads, then reads
+   fd R to end of file, checking that byte I has the value
+   I % 251.  Finally writes two ints to fd W: the number of bytes
+   read, and the offset of the first byte that did not match, or
+   -1 if all of them did. */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include "tests/lib.h"
+
+const char *test_name = "child-pipe";
+
+int
+main (int argc, char *argv[])
+{
+  static char buf[512];
+  int report[2] = {0, -1};
+  int i, n;
+
+  if (argc < 3)
+    fail ("bad command-line arguments");
+  for (i = 1; i < argc; i++)
+    if (!isdigit (*argv[i]))
+      fail ("bad command-line arguments");
+  for (i = 3; i < argc; i++)
+    close (atoi (argv[i]));
+
+  while ((n = read (atoi (argv[1]), buf, sizeof buf)) > 0)
+    for (i = 0; i < n; i++, report[0]++)
+      if (report[1] < 0 && (unsigned char) buf[i] != report[0] % 251)
+        report[1] = report[0];
+  if (n < 0)
+    fail ("read from pipe");
+
+  if (write (atoi (argv[2]), report, sizeof report) != sizeof report)
+    fail ("write to pipe");
+  return 0;
+}
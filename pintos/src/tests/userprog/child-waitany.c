@@ -0,0 +1,24 @@
+/* Child process run by the waitany tests.
+
+   Reads a byte from the pipe whose read end is the fd passed as
+   the first command-line argument, so that it exits only once
+   its parent writes to the pipe. */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include "tests/lib.h"
+
+const char *test_name = "child-waitany";
+
+int
+main (int argc UNUSED, char *argv[])
+{
+  char c;
+
+  if (!isdigit (*argv[1]))
+    fail ("bad command-line arguments");
+  if (read (atoi (argv[1]), &c, 1) != 1)
+    fail ("read from pipe");
+  return 82;
+}
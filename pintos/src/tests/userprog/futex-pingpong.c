@@ -0,0 +1,73 @@
+/* Passes a turn back and forth between the main thread and a
+   second thread, each sleeping with futex_wait() until the other
+   hands the turn over with futex_wake().  The two must strictly
+   alternate, without a wakeup being lost along the way. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define ROUNDS 100
+
+static char stack[4096];
+static int turn;                /* Which thread may run: 0 or 1. */
+static int order[2 * ROUNDS];   /* Which thread ran each step. */
+static int order_cnt;
+
+/* Waits until it is thread WHO's turn. */
+static void
+wait_for (int who)
+{
+  while (turn != who)
+    futex_wait (&turn, !who);
+}
+
+/* Hands the turn to thread WHO. */
+static void
+pass_to (int who)
+{
+  turn = who;
+  futex_wake (&turn, 1);
+}
+
+/* Takes ROUNDS turns as thread WHO. */
+static void
+play (int who)
+{
+  int i;
+
+  for (i = 0; i < ROUNDS; i++)
+    {
+      wait_for (who);
+      order[order_cnt++] = who;
+      pass_to (!who);
+    }
+}
+
+static void
+pong (void *aux UNUSED)
+{
+  play (1);
+}
+
+void
+test_main (void)
+{
+  tid_t tid;
+  int i;
+
+  CHECK (futex_wait (&turn, 1) == -1, "futex_wait with a stale value");
+  CHECK (futex_wake (&turn, 1) == 0, "futex_wake with no waiters");
+
+  CHECK ((tid = thread_create (pong, NULL, stack, sizeof stack))
+         != TID_ERROR, "thread_create");
+  play (0);
+  CHECK (thread_join (tid), "thread_join");
+
+  if (order_cnt != 2 * ROUNDS)
+    fail ("took %d turns, not %d", order_cnt, 2 * ROUNDS);
+  for (i = 0; i < order_cnt; i++)
+    if (order[i] != i % 2)
+      fail ("turn %d went to thread %d", i, order[i]);
+  msg ("threads took %d turns in strict alternation", order_cnt);
+}
@@ -0,0 +1,15 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(futex-pingpong) begin
+(futex-pingpong) futex_wait with a stale value
+(futex-pingpong) futex_wake with no waiters
+(futex-pingpong) thread_create
+(futex-pingpong) thread_join
+(futex-pingpong) threads took 200 turns in strict alternation
+(futex-pingpong) end
+futex-pingpong: exit(0)
+EOF
+pass;
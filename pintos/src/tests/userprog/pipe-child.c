@@ -0,0 +1,42 @@
+/* Sends data to a child process over one pipe and reads its
+   reply over another.  The child sees end of file once the
+   parent closes its write end, and the parent sees end of file
+   once the child has exited. */
+
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  char cmd_line[64];
+  char buf[100];
+  int to_child[2], from_child[2], report[2];
+  pid_t pid;
+  size_t i;
+
+  for (i = 0; i < sizeof buf; i++)
+    buf[i] = i % 251;
+
+  CHECK (pipe (to_child), "pipe to child");
+  CHECK (pipe (from_child), "pipe from child");
+  snprintf (cmd_line, sizeof cmd_line, "child-pipe %d %d %d %d",
+            to_child[0], from_child[1], to_child[1], from_child[0]);
+  CHECK ((pid = exec (cmd_line)) != PID_ERROR, "exec \"child-pipe\"");
+  close (to_child[0]);
+  close (from_child[1]);
+
+  CHECK (write (to_child[1], buf, 30) == 30, "write 30 bytes to child");
+  CHECK (write (to_child[1], buf + 30, 70) == 70, "write 70 bytes to child");
+  close (to_child[1]);
+  msg ("wait(exec()) = %d", wait (pid));
+
+  CHECK (read (from_child[0], report, sizeof report) == sizeof report,
+         "read reply from child");
+  if (report[0] != 100 || report[1] != -1)
+    fail ("child read %d bytes, first mismatch at %d", report[0], report[1]);
+  CHECK (read (from_child[0], buf, sizeof buf) == 0,
+         "read end of file from child");
+}
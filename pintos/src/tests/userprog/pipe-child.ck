@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(pipe-child) begin
+(pipe-child) pipe to child
+(pipe-child) pipe from child
+(pipe-child) exec "child-pipe"
+(pipe-child) write 30 bytes to child
+(pipe-child) write 70 bytes to child
+child-pipe: exit(0)
+(pipe-child) wait(exec()) = 0
+(pipe-child) read reply from child
+(pipe-child) read end of file from child
+(pipe-child) end
+pipe-child: exit(0)
+EOF
+pass;
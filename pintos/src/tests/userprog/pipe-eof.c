@@ -0,0 +1,31 @@
+/* Reads a pipe in pieces after its write end is closed.  The
+   data written must still arrive, followed by end of file.  Then
+   checks that writing to a pipe with no reader fails. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  char buf[16];
+  int fds[2];
+
+  CHECK (pipe (fds), "pipe");
+  CHECK (write (fds[1], "abc", 3) == 3, "write 3 bytes");
+  close (fds[1]);
+  CHECK (read (fds[0], buf, 2) == 2 && !memcmp (buf, "ab", 2),
+         "read first 2 bytes");
+  CHECK (read (fds[0], buf, sizeof buf) == 1 && buf[0] == 'c',
+         "read last byte");
+  CHECK (read (fds[0], buf, sizeof buf) == 0, "read end of file");
+  CHECK (read (fds[0], buf, sizeof buf) == 0, "read end of file again");
+  close (fds[0]);
+
+  CHECK (pipe (fds), "pipe");
+  close (fds[0]);
+  CHECK (write (fds[1], "abc", 3) == -1, "write with no reader");
+  close (fds[1]);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(pipe-eof) begin
+(pipe-eof) pipe
+(pipe-eof) write 3 bytes
+(pipe-eof) read first 2 bytes
+(pipe-eof) read last byte
+(pipe-eof) read end of file
+(pipe-eof) read end of file again
+(pipe-eof) pipe
+(pipe-eof) write with no reader
+(pipe-eof) end
+pipe-eof: exit(0)
+EOF
+pass;
@@ -0,0 +1,61 @@
+/* Writes more than a pipe holds in a single write() to a child
+   process, which must wait for the child to make room and then
+   deliver every byte in order.  First checks, without a child,
+   that reads and writes that cross the end of the pipe's buffer
+   are split and joined correctly. */
+
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+/* More than three times what a pipe buffers. */
+#define BIG_SIZE (3 * 4096 + 100)
+
+static char buf[BIG_SIZE];
+static char copy[BIG_SIZE];
+
+void
+test_main (void)
+{
+  char cmd_line[64];
+  int fds[2], to_child[2], from_child[2], report[2];
+  pid_t pid;
+  size_t i;
+
+  for (i = 0; i < sizeof buf; i++)
+    buf[i] = i % 251;
+
+  CHECK (pipe (fds), "pipe");
+  CHECK (write (fds[1], buf, 4000) == 4000, "write 4000 bytes");
+  CHECK (read (fds[0], copy, 1000) == 1000, "read 1000 bytes");
+  CHECK (read (fds[0], copy + 1000, 4000) == 3000, "read 3000 bytes");
+  CHECK (write (fds[1], buf + 4000, 200) == 200,
+         "write 200 bytes across the end of the buffer");
+  CHECK (read (fds[0], copy + 4000, 4000) == 200, "read 200 bytes");
+  if (memcmp (buf, copy, 4200))
+    fail ("data read back differs from data written");
+  close (fds[0]);
+  close (fds[1]);
+
+  CHECK (pipe (to_child), "pipe to child");
+  CHECK (pipe (from_child), "pipe from child");
+  snprintf (cmd_line, sizeof cmd_line, "child-pipe %d %d %d %d",
+            to_child[0], from_child[1], to_child[1], from_child[0]);
+  CHECK ((pid = exec (cmd_line)) != PID_ERROR, "exec \"child-pipe\"");
+  close (to_child[0]);
+  close (from_child[1]);
+
+  CHECK (write (to_child[1], buf, BIG_SIZE) == BIG_SIZE,
+         "write %d bytes to child", BIG_SIZE);
+  close (to_child[1]);
+  msg ("wait(exec()) = %d", wait (pid));
+
+  CHECK (read (from_child[0], report, sizeof report) == sizeof report,
+         "read reply from child");
+  if (report[0] != BIG_SIZE || report[1] != -1)
+    fail ("child read %d bytes, first mismatch at %d", report[0], report[1]);
+  msg ("child read %d bytes", report[0]);
+  close (from_child[0]);
+}
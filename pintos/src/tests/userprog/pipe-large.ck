@@ -0,0 +1,24 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(pipe-large) begin
+(pipe-large) pipe
+(pipe-large) write 4000 bytes
+(pipe-large) read 1000 bytes
+(pipe-large) read 3000 bytes
+(pipe-large) write 200 bytes across the end of the buffer
+(pipe-large) read 200 bytes
+(pipe-large) pipe to child
+(pipe-large) pipe from child
+(pipe-large) exec "child-pipe"
+(pipe-large) write 12388 bytes to child
+child-pipe: exit(0)
+(pipe-large) wait(exec()) = 0
+(pipe-large) read reply from child
+(pipe-large) child read 12388 bytes
+(pipe-large) end
+pipe-large: exit(0)
+EOF
+pass;
@@ -0,0 +1,29 @@
+/* Reads across and past the end of "sample.txt" with pread().
+   A read that crosses the end must return the bytes up to it,
+   and one that starts at or past the end must return 0. */
+
+#include <syscall.h>
+#include "tests/userprog/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  size_t size = sizeof sample - 1;
+  char buf[50];
+  int handle, byte_cnt;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+
+  byte_cnt = pread (handle, buf, sizeof buf, size - 10);
+  if (byte_cnt != 10)
+    fail ("pread() across the end returned %d instead of 10", byte_cnt);
+  compare_bytes (buf, sample + size - 10, 10, size - 10, "sample.txt");
+  msg ("pread() across the end returned 10");
+
+  byte_cnt = pread (handle, buf, sizeof buf, size);
+  CHECK (byte_cnt == 0, "pread() at the end returned %d", byte_cnt);
+  byte_cnt = pread (handle, buf, sizeof buf, size + 1000);
+  CHECK (byte_cnt == 0, "pread() past the end returned %d", byte_cnt);
+}
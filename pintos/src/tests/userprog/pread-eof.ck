@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(pread-eof) begin
+(pread-eof) open "sample.txt"
+(pread-eof) pread() across the end returned 10
+(pread-eof) pread() at the end returned 0
+(pread-eof) pread() past the end returned 0
+(pread-eof) end
+pread-eof: exit(0)
+EOF
+pass;
@@ -0,0 +1,28 @@
+/* Reads from the middle of "sample.txt" with pread(), which must
+   leave the file position where it was. */
+
+#include <syscall.h>
+#include "tests/userprog/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  char buf[20];
+  int handle, byte_cnt;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+
+  byte_cnt = pread (handle, buf, sizeof buf, 30);
+  if (byte_cnt != sizeof buf)
+    fail ("pread() returned %d instead of %zu", byte_cnt, sizeof buf);
+  compare_bytes (buf, sample + 30, sizeof buf, 30, "sample.txt");
+
+  CHECK (tell (handle) == 0, "tell \"sample.txt\" after pread");
+  byte_cnt = read (handle, buf, sizeof buf);
+  if (byte_cnt != sizeof buf)
+    fail ("read() returned %d instead of %zu", byte_cnt, sizeof buf);
+  compare_bytes (buf, sample, sizeof buf, 0, "sample.txt");
+  msg ("verified contents of \"sample.txt\"");
+}
@@ -0,0 +1,31 @@
+/* Writes the second half of "test.txt" with pwrite() and the
+   first half with write(), which must pick up at the position
+   pwrite() left alone. */
+
+#include <syscall.h>
+#include "tests/userprog/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  size_t half = (sizeof sample - 1) / 2;
+  size_t rest = sizeof sample - 1 - half;
+  int handle, byte_cnt;
+
+  CHECK (create ("test.txt", 0), "create \"test.txt\"");
+  CHECK ((handle = open ("test.txt")) > 1, "open \"test.txt\"");
+
+  byte_cnt = pwrite (handle, sample + half, rest, half);
+  if (byte_cnt != (int) rest)
+    fail ("pwrite() returned %d instead of %zu", byte_cnt, rest);
+  CHECK (tell (handle) == 0, "tell \"test.txt\" after pwrite");
+
+  byte_cnt = write (handle, sample, half);
+  if (byte_cnt != (int) half)
+    fail ("write() returned %d instead of %zu", byte_cnt, half);
+  close (handle);
+
+  check_file ("test.txt", sample, sizeof sample - 1);
+}
@@ -0,0 +1,35 @@
+/* Reads "sample.txt" with readv() into three buffers of
+   different sizes, which must receive the file's bytes in
+   order. */
+
+#include <syscall.h>
+#include "tests/userprog/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  char head[10], middle[50], tail[sizeof sample];
+  size_t tail_len = sizeof sample - 1 - sizeof head - sizeof middle;
+  struct iovec iov[3] =
+    {
+      { head, sizeof head },
+      { middle, sizeof middle },
+      { tail, tail_len },
+    };
+  int handle, byte_cnt;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+
+  byte_cnt = readv (handle, iov, 3);
+  if (byte_cnt != sizeof sample - 1)
+    fail ("readv() returned %d instead of %zu", byte_cnt, sizeof sample - 1);
+
+  compare_bytes (head, sample, sizeof head, 0, "sample.txt");
+  compare_bytes (middle, sample + sizeof head, sizeof middle,
+                 sizeof head, "sample.txt");
+  compare_bytes (tail, sample + sizeof head + sizeof middle, tail_len,
+                 sizeof head + sizeof middle, "sample.txt");
+  msg ("verified contents of \"sample.txt\"");
+}
@@ -0,0 +1,17 @@
+/* Asks for the usage of a process that is not a child, which must
+   fail, and then passes an invalid pointer to getrusage().  The
+   process must be terminated with -1 exit code. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  struct rusage usage;
+
+  CHECK (!getrusage (12345, &usage), "getrusage of a stranger");
+  getrusage (RUSAGE_SELF, (struct rusage *) 0xc0100000);
+  fail ("should not have survived getrusage()");
+}
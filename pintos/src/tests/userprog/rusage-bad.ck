@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(rusage-bad) begin
+(rusage-bad) getrusage of a stranger
+rusage-bad: exit(-1)
+EOF
+pass;
@@ -0,0 +1,36 @@
+/* Checks getrusage() of a child that has exited but not yet been
+   waited for, that it fails once the child is waited for, and
+   that RUSAGE_CHILDREN then includes the child.  child-simple
+   writes one 19-byte line. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  const size_t line = strlen ("(child-simple) run\n");
+  struct rusage usage;
+  pid_t pid;
+
+  CHECK (getrusage (RUSAGE_CHILDREN, &usage), "getrusage children");
+  if (usage.bytes_written != 0 || usage.user_ticks != 0)
+    fail ("children used resources before there were any");
+
+  CHECK ((pid = exec ("child-simple")) != PID_ERROR, "exec \"child-simple\"");
+  while (!getrusage (pid, &usage))
+    continue;
+  if (usage.bytes_written != line)
+    fail ("child wrote %d bytes, not %zu", (int) usage.bytes_written, line);
+  msg ("getrusage of exited child");
+
+  msg ("wait(exec()) = %d", wait (pid));
+  CHECK (!getrusage (pid, &usage), "getrusage of waited-for child");
+  CHECK (getrusage (RUSAGE_CHILDREN, &usage), "getrusage children");
+  if (usage.bytes_written != line)
+    fail ("children wrote %d bytes, not %zu",
+          (int) usage.bytes_written, line);
+  msg ("children's usage includes the child");
+}
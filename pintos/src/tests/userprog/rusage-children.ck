@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(rusage-children) begin
+(rusage-children) getrusage children
+(rusage-children) exec "child-simple"
+(child-simple) run
+child-simple: exit(81)
+(rusage-children) getrusage of exited child
+(rusage-children) wait(exec()) = 81
+(rusage-children) getrusage of waited-for child
+(rusage-children) getrusage children
+(rusage-children) children's usage includes the child
+(rusage-children) end
+rusage-children: exit(0)
+EOF
+pass;
@@ -0,0 +1,53 @@
+/* Checks that getrusage() of the calling process counts the bytes
+   it reads and writes, and the ticks it spends running user
+   code. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  struct rusage before, after;
+  char buf[100];
+  unsigned start;
+  int handle, byte_cnt;
+  volatile int spin;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK (getrusage (RUSAGE_SELF, &before), "getrusage");
+  byte_cnt = read (handle, buf, sizeof buf);
+  if (!getrusage (RUSAGE_SELF, &after))
+    fail ("getrusage failed after read");
+  if (after.bytes_read - before.bytes_read != (uint64_t) byte_cnt)
+    fail ("read %d bytes but bytes_read grew by %d",
+          byte_cnt, (int) (after.bytes_read - before.bytes_read));
+  msg ("bytes_read counts the read");
+  close (handle);
+
+  CHECK (create ("test.txt", 0), "create \"test.txt\"");
+  CHECK ((handle = open ("test.txt")) > 1, "open \"test.txt\"");
+  CHECK (getrusage (RUSAGE_SELF, &before), "getrusage");
+  byte_cnt = write (handle, buf, sizeof buf);
+  if (!getrusage (RUSAGE_SELF, &after))
+    fail ("getrusage failed after write");
+  if (after.bytes_written - before.bytes_written != (uint64_t) byte_cnt)
+    fail ("wrote %d bytes but bytes_written grew by %d",
+          byte_cnt, (int) (after.bytes_written - before.bytes_written));
+  msg ("bytes_written counts the write");
+  close (handle);
+
+  /* Spin in user code for a while. */
+  CHECK (getrusage (RUSAGE_SELF, &before), "getrusage");
+  start = ticks ();
+  while (ticks () - start < 20)
+    for (spin = 0; spin < 10000; spin++)
+      continue;
+  CHECK (getrusage (RUSAGE_SELF, &after), "getrusage");
+  if (after.user_ticks <= before.user_ticks)
+    fail ("user_ticks did not grow while spinning");
+  msg ("user_ticks grew while spinning");
+  if (after.resident_pages == 0)
+    fail ("no resident pages");
+}
@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(rusage-self) begin
+(rusage-self) open "sample.txt"
+(rusage-self) getrusage
+(rusage-self) bytes_read counts the read
+(rusage-self) create "test.txt"
+(rusage-self) open "test.txt"
+(rusage-self) getrusage
+(rusage-self) bytes_written counts the write
+(rusage-self) getrusage
+(rusage-self) getrusage
+(rusage-self) user_ticks grew while spinning
+(rusage-self) end
+rusage-self: exit(0)
+EOF
+pass;
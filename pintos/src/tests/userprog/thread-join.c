@@ -0,0 +1,44 @@
+/* Starts three threads that each fill in their own slot of an
+   array shared with the main thread, and joins them.  Each must
+   run with the aux it was given, and its writes must be visible
+   once it is joined.  Joining a thread a second time, or a tid
+   that is not a thread of this process, must fail. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define THREAD_CNT 3
+
+static char stacks[THREAD_CNT][4096];
+static int slots[THREAD_CNT];
+
+static void
+fill_slot (void *aux)
+{
+  int *slot = aux;
+  *slot = (slot - slots + 1) * 100;
+}
+
+void
+test_main (void)
+{
+  tid_t tids[THREAD_CNT];
+  int i;
+
+  for (i = 0; i < THREAD_CNT; i++)
+    CHECK ((tids[i] = thread_create (fill_slot, &slots[i], stacks[i],
+                                     sizeof stacks[i])) != TID_ERROR,
+           "thread_create %d", i);
+  for (i = 0; i < THREAD_CNT; i++)
+    CHECK (thread_join (tids[i]), "thread_join %d", i);
+  for (i = 0; i < THREAD_CNT; i++)
+    if (slots[i] != (i + 1) * 100)
+      fail ("thread %d left %d in its slot, not %d",
+            i, slots[i], (i + 1) * 100);
+  msg ("every thread filled in its slot");
+
+  CHECK (!thread_join (tids[0]), "thread_join 0 again");
+  CHECK (!thread_join (tids[THREAD_CNT - 1] + 1000),
+         "thread_join a tid that is not ours");
+}
@@ -0,0 +1,35 @@
+/* Calls waitany() with WNOHANG while the only child is still
+   running, which must return 0 and leave the status alone, and
+   then until the child has exited, when it must reap it. */
+
+#include <stdio.h>
+#include <syscall.h>
+#include <syscall-nr.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  char cmd_line[32];
+  pid_t held, pid;
+  int fds[2], status;
+
+  CHECK (pipe (fds), "pipe");
+  snprintf (cmd_line, sizeof cmd_line, "child-waitany %d", fds[0]);
+  CHECK ((held = exec (cmd_line)) != PID_ERROR, "exec \"child-waitany\"");
+
+  status = 1234;
+  pid = waitany (&status, WNOHANG);
+  CHECK (pid == 0 && status == 1234,
+         "waitany(WNOHANG) with no child exited returned %d", pid);
+
+  write (fds[1], "x", 1);
+  do
+    pid = waitany (&status, WNOHANG);
+  while (pid == 0);
+  if (pid != held)
+    fail ("waitany(WNOHANG) returned %d, not child-waitany's pid %d",
+          pid, held);
+  msg ("waitany(WNOHANG) reaped child-waitany with status %d", status);
+}
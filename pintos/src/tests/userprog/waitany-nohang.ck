@@ -0,0 +1,15 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(waitany-nohang) begin
+(waitany-nohang) pipe
+(waitany-nohang) exec "child-waitany"
+(waitany-nohang) waitany(WNOHANG) with no child exited returned 0
+child-waitany: exit(82)
+(waitany-nohang) waitany(WNOHANG) reaped child-waitany with status 82
+(waitany-nohang) end
+waitany-nohang: exit(0)
+EOF
+pass;
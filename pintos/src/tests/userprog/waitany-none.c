@@ -0,0 +1,19 @@
+/* Calls waitany() from a process with no children, and again
+   once its only child has been reaped by wait().  Each call
+   must return -1 at once, with or without WNOHANG. */
+
+#include <syscall.h>
+#include <syscall-nr.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  int status;
+
+  CHECK (waitany (&status, 0) == -1, "waitany() with no children");
+  CHECK (waitany (NULL, WNOHANG) == -1, "waitany(WNOHANG) with no children");
+  msg ("wait(exec()) = %d", wait (exec ("child-simple")));
+  CHECK (waitany (&status, 0) == -1, "waitany() after wait()");
+}
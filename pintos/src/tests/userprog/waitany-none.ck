@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(waitany-none) begin
+(waitany-none) waitany() with no children
+(waitany-none) waitany(WNOHANG) with no children
+(child-simple) run
+child-simple: exit(81)
+(waitany-none) wait(exec()) = 81
+(waitany-none) waitany() after wait()
+(waitany-none) end
+waitany-none: exit(0)
+EOF
+pass;
@@ -0,0 +1,35 @@
+/* Starts a child that waits on a pipe and then one that exits at
+   once.  waitany() must reap them in the order they exit, not
+   the order they started, and return -1 once none is left. */
+
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  char cmd_line[32];
+  pid_t held, quick, pid;
+  int fds[2], status;
+
+  CHECK (pipe (fds), "pipe");
+  snprintf (cmd_line, sizeof cmd_line, "child-waitany %d", fds[0]);
+  CHECK ((held = exec (cmd_line)) != PID_ERROR, "exec \"child-waitany\"");
+  CHECK ((quick = exec ("child-simple")) != PID_ERROR,
+         "exec \"child-simple\"");
+
+  pid = waitany (&status, 0);
+  if (pid != quick)
+    fail ("waitany() returned %d, not child-simple's pid %d", pid, quick);
+  msg ("waitany() reaped child-simple with status %d", status);
+
+  write (fds[1], "x", 1);
+  pid = waitany (&status, 0);
+  if (pid != held)
+    fail ("waitany() returned %d, not child-waitany's pid %d", pid, held);
+  msg ("waitany() reaped child-waitany with status %d", status);
+
+  CHECK (waitany (&status, 0) == -1, "waitany() with no children left");
+}
@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(waitany-order) begin
+(waitany-order) pipe
+(waitany-order) exec "child-waitany"
+(waitany-order) exec "child-simple"
+(child-simple) run
+child-simple: exit(81)
+(waitany-order) waitany() reaped child-simple with status 81
+child-waitany: exit(82)
+(waitany-order) waitany() reaped child-waitany with status 82
+(waitany-order) waitany() with no children left
+(waitany-order) end
+waitany-order: exit(0)
+EOF
+pass;
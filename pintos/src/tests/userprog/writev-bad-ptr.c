@@ -0,0 +1,23 @@
+/* Passes writev() a valid array of buffers, one of which is at
+   an unmapped address.  The process must be terminated with -1
+   exit code. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  static char ok[16];
+  struct iovec iov[2] =
+    {
+      { ok, sizeof ok },
+      { (char *) 0x10123420, 123 },
+    };
+  int handle;
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+
+  writev (handle, iov, 2);
+  fail ("should have exited with -1");
+}
@@ -0,0 +1,45 @@
+/* Writes with writev() from buffers that include empty ones,
+   whose null bases must not be touched, and reads the result
+   back with readv(), again through an empty buffer. */
+
+#include <syscall.h>
+#include "tests/userprog/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  struct iovec out[4] =
+    {
+      { NULL, 0 },
+      { sample, 20 },
+      { NULL, 0 },
+      { sample + 20, sizeof sample - 1 - 20 },
+    };
+  char buf[sizeof sample];
+  struct iovec in[2] =
+    {
+      { NULL, 0 },
+      { buf, sizeof sample - 1 },
+    };
+  int handle, byte_cnt;
+
+  CHECK (create ("test.txt", 0), "create \"test.txt\"");
+  CHECK ((handle = open ("test.txt")) > 1, "open \"test.txt\"");
+
+  byte_cnt = writev (handle, out, 4);
+  if (byte_cnt != sizeof sample - 1)
+    fail ("writev() returned %d instead of %zu", byte_cnt, sizeof sample - 1);
+
+  byte_cnt = writev (handle, out, 1);
+  if (byte_cnt != 0)
+    fail ("writev() of one empty buffer returned %d instead of 0", byte_cnt);
+
+  seek (handle, 0);
+  byte_cnt = readv (handle, in, 2);
+  if (byte_cnt != sizeof sample - 1)
+    fail ("readv() returned %d instead of %zu", byte_cnt, sizeof sample - 1);
+  compare_bytes (buf, sample, sizeof sample - 1, 0, "test.txt");
+  msg ("verified contents of \"test.txt\"");
+}
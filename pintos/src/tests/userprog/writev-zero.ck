@@ -0,0 +1,13 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(writev-zero) begin
+(writev-zero) create "test.txt"
+(writev-zero) open "test.txt"
+(writev-zero) verified contents of "test.txt"
+(writev-zero) end
+writev-zero: exit(0)
+EOF
+pass;
@@ -0,0 +1,69 @@
+/* Child process of shm-share and shm-ring.
+
+   Invoked as "child-shm share KEY", maps the two-page segment
+   with KEY, checks that its first page holds byte I % 251 at
+   offset I, as shm-share wrote it, and sets each byte of the
+   second page to one more than the byte at the same offset in the
+   first.
+
+   Invoked as "child-shm ring KEY CNT", maps the segment with KEY,
+   which holds a ring that shm-ring writes to, and reads CNT bytes
+   from the ring, checking that byte I is I % 251. */
+
+#include <ring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+
+const char *test_name = "child-shm";
+
+#define PAGE_SIZE 4096
+
+int
+main (int argc, char *argv[])
+{
+  uint8_t *shared = (uint8_t *) 0x20000000;
+  int id;
+
+  if (argc < 3)
+    fail ("bad command-line arguments");
+  id = shm_open (atoi (argv[2]), 1);
+  if (id == -1)
+    fail ("shm_open");
+  if (shm_map (id, shared) != shared)
+    fail ("shm_map");
+
+  if (!strcmp (argv[1], "share"))
+    {
+      size_t i;
+
+      for (i = 0; i < PAGE_SIZE; i++)
+        if (shared[i] != i % 251)
+          fail ("byte %zu of shared page is %d, not %d",
+                i, shared[i], i % 251);
+      for (i = 0; i < PAGE_SIZE; i++)
+        shared[PAGE_SIZE + i] = shared[i] + 1;
+    }
+  else if (!strcmp (argv[1], "ring") && argc == 4)
+    {
+      struct ring *r = (struct ring *) shared;
+      size_t cnt = atoi (argv[3]);
+      uint8_t buf[500];
+      size_t ofs = 0;
+
+      while (ofs < cnt)
+        {
+          size_t n = ring_read (r, buf, sizeof buf);
+          size_t i;
+
+          for (i = 0; i < n; i++, ofs++)
+            if (buf[i] != ofs % 251)
+              fail ("byte %zu from ring is %d, not %d",
+                    ofs, buf[i], ofs % 251);
+        }
+    }
+  else
+    fail ("bad command-line arguments");
+  return 0;
+}
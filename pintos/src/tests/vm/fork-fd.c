@@ -0,0 +1,40 @@
+/* Forks a child, which must inherit the parent's open file under
+   the same fd and at the same position.  The child's handle is
+   its own: reading through it leaves the parent's position
+   alone. */
+
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  char buf[10];
+  int handle;
+  pid_t pid;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK (read (handle, buf, sizeof buf) == sizeof buf, "read \"sample.txt\"");
+
+  CHECK ((pid = fork ()) != PID_ERROR, "fork");
+  if (pid == 0)
+    {
+      CHECK (tell (handle) == sizeof buf, "child's position is %u",
+             tell (handle));
+      CHECK (read (handle, buf, sizeof buf) == sizeof buf,
+             "child read \"sample.txt\"");
+      compare_bytes (buf, sample + sizeof buf, sizeof buf, sizeof buf,
+                     "sample.txt");
+      close (handle);
+      exit (0);
+    }
+
+  CHECK (wait (pid) == 0, "wait for child");
+  CHECK (tell (handle) == sizeof buf, "parent's position is %u",
+         tell (handle));
+  CHECK (read (handle, buf, sizeof buf) == sizeof buf, "read \"sample.txt\"");
+  compare_bytes (buf, sample + sizeof buf, sizeof buf, sizeof buf,
+                 "sample.txt");
+}
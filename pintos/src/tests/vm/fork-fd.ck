@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fork-fd) begin
+(fork-fd) open "sample.txt"
+(fork-fd) read "sample.txt"
+(fork-fd) fork
+(fork-fd) child's position is 10
+(fork-fd) child read "sample.txt"
+fork-fd: exit(0)
+(fork-fd) wait for child
+(fork-fd) parent's position is 10
+(fork-fd) read "sample.txt"
+(fork-fd) end
+fork-fd: exit(0)
+EOF
+pass;
@@ -0,0 +1,52 @@
+/* Forks a child, and then has parent and child each write the
+   same memory.  Neither may see the other's writes.  A pipe
+   holds the child back until the parent has written. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static int data = 1;
+static char bss[2 * 4096];
+
+/* Fails unless all of BSS is C. */
+static void
+check_bss (char c, const char *who)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof bss; i++)
+    if (bss[i] != c)
+      fail ("bss[%zu] is %d in %s, not %d", i, bss[i], who, c);
+}
+
+void
+test_main (void)
+{
+  int fds[2];
+  pid_t pid;
+  char c;
+
+  memset (bss, 'b', sizeof bss);
+  CHECK (pipe (fds), "pipe");
+  CHECK ((pid = fork ()) != PID_ERROR, "fork");
+  if (pid == 0)
+    {
+      CHECK (read (fds[0], &c, 1) == 1, "child read from pipe");
+      CHECK (data == 1, "child sees data %d", data);
+      check_bss ('b', "child");
+      msg ("child sees bss unchanged");
+      data = 3;
+      memset (bss, 'c', sizeof bss);
+      exit (0);
+    }
+
+  data = 2;
+  memset (bss, 'p', sizeof bss);
+  write (fds[1], "x", 1);
+  CHECK (wait (pid) == 0, "wait for child");
+  CHECK (data == 2, "parent sees data %d", data);
+  check_bss ('p', "parent");
+  msg ("parent sees its own bss");
+}
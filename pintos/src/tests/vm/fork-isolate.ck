@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fork-isolate) begin
+(fork-isolate) pipe
+(fork-isolate) fork
+(fork-isolate) child read from pipe
+(fork-isolate) child sees data 1
+(fork-isolate) child sees bss unchanged
+fork-isolate: exit(0)
+(fork-isolate) wait for child
+(fork-isolate) parent sees data 2
+(fork-isolate) parent sees its own bss
+(fork-isolate) end
+fork-isolate: exit(0)
+EOF
+pass;
@@ -0,0 +1,41 @@
+/* Forks a child, which must see the parent's data, heap and
+   stack as they were at the fork. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static int data = 1;
+static char bss[2 * 4096];
+
+void
+test_main (void)
+{
+  int stack = 2;
+  char *heap;
+  pid_t pid;
+
+  CHECK ((heap = malloc (100)) != NULL, "malloc");
+  strlcpy (heap, "on the heap", 100);
+  memset (bss, 'b', sizeof bss);
+  data = 42;
+  stack = 43;
+
+  CHECK ((pid = fork ()) != PID_ERROR, "fork");
+  if (pid == 0)
+    {
+      size_t i;
+
+      CHECK (data == 42, "child sees data %d", data);
+      CHECK (stack == 43, "child sees stack %d", stack);
+      CHECK (!strcmp (heap, "on the heap"), "child sees heap \"%s\"", heap);
+      for (i = 0; i < sizeof bss; i++)
+        if (bss[i] != 'b')
+          fail ("bss[%zu] is %d in child", i, bss[i]);
+      msg ("child sees bss");
+      exit (0);
+    }
+  CHECK (wait (pid) == 0, "wait for child");
+}
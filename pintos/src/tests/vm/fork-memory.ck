@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fork-memory) begin
+(fork-memory) malloc
+(fork-memory) fork
+(fork-memory) child sees data 42
+(fork-memory) child sees stack 43
+(fork-memory) child sees heap "on the heap"
+(fork-memory) child sees bss
+fork-memory: exit(0)
+(fork-memory) wait for child
+(fork-memory) end
+fork-memory: exit(0)
+EOF
+pass;
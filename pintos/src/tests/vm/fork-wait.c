@@ -0,0 +1,23 @@
+/* Forks two children, one that exits with a status and one that
+   is killed.  wait() must return each one's status, once. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  pid_t pid;
+
+  CHECK ((pid = fork ()) != PID_ERROR, "fork");
+  if (pid == 0)
+    exit (42);
+  msg ("wait(fork()) = %d", wait (pid));
+  msg ("wait again = %d", wait (pid));
+
+  CHECK ((pid = fork ()) != PID_ERROR, "fork");
+  if (pid == 0)
+    fail ("bad addr read as %d", *(int *) 0x04000000);
+  msg ("wait(fork()) = %d", wait (pid));
+}
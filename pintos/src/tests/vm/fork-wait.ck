@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_USER_FAULTS => 1, [<<'EOF']);
+(fork-wait) begin
+(fork-wait) fork
+fork-wait: exit(42)
+(fork-wait) wait(fork()) = 42
+(fork-wait) wait again = -1
+(fork-wait) fork
+fork-wait: exit(-1)
+(fork-wait) wait(fork()) = -1
+(fork-wait) end
+fork-wait: exit(0)
+EOF
+pass;
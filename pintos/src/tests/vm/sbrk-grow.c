@@ -0,0 +1,60 @@
+/* Grows the heap by three pages with sbrk(), checks that the new
+   pages read as zeros and keep what is written to them, and then
+   shrinks it again.  Pages given back must read as zeros if the
+   heap grows over them again, shrinking the heap below its start
+   must fail, and touching memory past the break must kill the
+   process. */
+
+#include <stdint.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+
+void
+test_main (void)
+{
+  char *heap;
+  size_t i;
+
+  /* Start the heap on a page boundary, so that the break lands
+     on one too. */
+  heap = sbrk (0);
+  if ((uintptr_t) heap % PAGE_SIZE != 0)
+    sbrk (PAGE_SIZE - (uintptr_t) heap % PAGE_SIZE);
+
+  CHECK ((heap = sbrk (3 * PAGE_SIZE)) != (void *) -1,
+         "grow heap by 3 pages");
+  CHECK ((char *) sbrk (0) == heap + 3 * PAGE_SIZE, "break is 3 pages up");
+  for (i = 0; i < 3 * PAGE_SIZE; i++)
+    if (heap[i] != 0)
+      fail ("byte %zu of new heap is %d, not 0", i, heap[i]);
+  for (i = 0; i < 3 * PAGE_SIZE; i++)
+    heap[i] = i % 251;
+  for (i = 0; i < 3 * PAGE_SIZE; i++)
+    if (heap[i] != (char) (i % 251))
+      fail ("byte %zu of heap changed after it was written", i);
+  msg ("wrote and read back 3 pages");
+
+  CHECK ((char *) sbrk (-2 * PAGE_SIZE) == heap + 3 * PAGE_SIZE,
+         "shrink heap by 2 pages");
+  for (i = 0; i < PAGE_SIZE; i++)
+    if (heap[i] != (char) (i % 251))
+      fail ("byte %zu of heap changed after shrinking", i);
+
+  CHECK ((char *) sbrk (PAGE_SIZE) == heap + PAGE_SIZE,
+         "grow heap by 1 page");
+  for (i = PAGE_SIZE; i < 2 * PAGE_SIZE; i++)
+    if (heap[i] != 0)
+      fail ("byte %zu of regrown heap is %d, not 0", i, heap[i]);
+  CHECK ((char *) sbrk (-PAGE_SIZE) == heap + 2 * PAGE_SIZE,
+         "shrink heap by 1 page");
+
+  CHECK (sbrk (-1024 * PAGE_SIZE) == (void *) -1,
+         "shrink heap below its start");
+
+  msg ("touch memory past the break");
+  heap[PAGE_SIZE] = 1;
+  fail ("survived touching memory past the break");
+}
@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_USER_FAULTS => 1, [<<'EOF']);
+(sbrk-grow) begin
+(sbrk-grow) grow heap by 3 pages
+(sbrk-grow) break is 3 pages up
+(sbrk-grow) wrote and read back 3 pages
+(sbrk-grow) shrink heap by 2 pages
+(sbrk-grow) grow heap by 1 page
+(sbrk-grow) shrink heap by 1 page
+(sbrk-grow) shrink heap below its start
+(sbrk-grow) touch memory past the break
+sbrk-grow: exit(-1)
+EOF
+pass;
@@ -0,0 +1,34 @@
+/* Tries to create shared memory segments of bad sizes, to reopen
+   a segment at a larger size, and to map segments by bad ids, at
+   bad addresses, and over memory already in use.  Each must
+   fail. */
+
+#include <stdint.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+
+void
+test_main (void)
+{
+  char *shared = (char *) 0x10000000;
+  int id;
+
+  CHECK (shm_open (1, 0) == -1, "shm_open 0 bytes");
+  CHECK (shm_open (1, 257 * PAGE_SIZE) == -1, "shm_open 257 pages");
+  CHECK ((id = shm_open (1, PAGE_SIZE)) != -1, "shm_open 1 page");
+  CHECK (shm_open (1, 2 * PAGE_SIZE) == -1, "shm_open 2 pages of it");
+  CHECK (shm_open (1, 100) == id, "shm_open 100 bytes of it");
+
+  CHECK (shm_map (id + 1000, shared) == NULL, "shm_map unknown id");
+  CHECK (shm_map (id, NULL) == NULL, "shm_map at null");
+  CHECK (shm_map (id, shared + 1) == NULL, "shm_map misaligned");
+  CHECK (shm_map (id, (void *) 0xc0000000) == NULL,
+         "shm_map in kernel memory");
+  CHECK (shm_map (id, (void *) ((uintptr_t) test_main & ~(PAGE_SIZE - 1)))
+         == NULL, "shm_map over code");
+  CHECK (shm_map (id, shared) == shared, "shm_map");
+  CHECK (shm_map (id, shared) == NULL, "shm_map over itself");
+}
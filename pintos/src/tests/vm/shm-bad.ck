@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(shm-bad) begin
+(shm-bad) shm_open 0 bytes
+(shm-bad) shm_open 257 pages
+(shm-bad) shm_open 1 page
+(shm-bad) shm_open 2 pages of it
+(shm-bad) shm_open 100 bytes of it
+(shm-bad) shm_map unknown id
+(shm-bad) shm_map at null
+(shm-bad) shm_map misaligned
+(shm-bad) shm_map in kernel memory
+(shm-bad) shm_map over code
+(shm-bad) shm_map
+(shm-bad) shm_map over itself
+(shm-bad) end
+shm-bad: exit(0)
+EOF
+pass;
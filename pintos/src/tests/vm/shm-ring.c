@@ -0,0 +1,41 @@
+/* Sets up a ring buffer in a one-page shared memory segment and
+   writes many times its capacity through it to a child process,
+   which reads every byte and checks that they arrive in order.
+   Neither side makes a system call to move the data. */
+
+#include <ring.h>
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define RING_BYTES (64 * 1024)
+
+void
+test_main (void)
+{
+  uint8_t *shared = (uint8_t *) 0x10000000;
+  char cmd_line[64];
+  uint8_t buf[300];
+  struct ring *r;
+  size_t ofs;
+  pid_t pid;
+  int id;
+
+  CHECK ((id = shm_open (456, 4096)) != -1, "shm_open");
+  CHECK (shm_map (id, shared) == shared, "shm_map");
+  r = ring_init (shared, 4096);
+
+  snprintf (cmd_line, sizeof cmd_line, "child-shm ring 456 %d", RING_BYTES);
+  CHECK ((pid = exec (cmd_line)) != PID_ERROR, "exec \"child-shm\"");
+  for (ofs = 0; ofs < RING_BYTES; )
+    {
+      size_t n = RING_BYTES - ofs < sizeof buf ? RING_BYTES - ofs : sizeof buf;
+      size_t i;
+
+      for (i = 0; i < n; i++)
+        buf[i] = (ofs + i) % 251;
+      ofs += ring_write (r, buf, n);
+    }
+  msg ("wait(exec()) = %d", wait (pid));
+}
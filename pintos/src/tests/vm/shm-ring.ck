@@ -0,0 +1,15 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(shm-ring) begin
+(shm-ring) shm_open
+(shm-ring) shm_map
+(shm-ring) exec "child-shm"
+child-shm: exit(0)
+(shm-ring) wait(exec()) = 0
+(shm-ring) end
+shm-ring: exit(0)
+EOF
+pass;
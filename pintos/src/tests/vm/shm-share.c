@@ -0,0 +1,34 @@
+/* Creates a two-page shared memory segment, fills its first page,
+   and has a child process that maps the same segment at another
+   address check that page and fill in the second.  The parent
+   must see what the child wrote. */
+
+#include <stdint.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+
+void
+test_main (void)
+{
+  uint8_t *shared = (uint8_t *) 0x10000000;
+  size_t i;
+  int id;
+
+  CHECK ((id = shm_open (123, 2 * PAGE_SIZE)) != -1, "shm_open");
+  CHECK (shm_map (id, shared) == shared, "shm_map");
+  for (i = 0; i < 2 * PAGE_SIZE; i++)
+    if (shared[i] != 0)
+      fail ("byte %zu of new segment is %d, not 0", i, shared[i]);
+  for (i = 0; i < PAGE_SIZE; i++)
+    shared[i] = i % 251;
+
+  msg ("wait(exec()) = %d", wait (exec ("child-shm share 123")));
+  for (i = 0; i < PAGE_SIZE; i++)
+    if (shared[PAGE_SIZE + i] != (uint8_t) (i % 251 + 1))
+      fail ("byte %zu of child's page is %d, not %d",
+            i, shared[PAGE_SIZE + i], i % 251 + 1);
+  msg ("child's writes are visible");
+}
@@ -0,0 +1,15 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(shm-share) begin
+(shm-share) shm_open
+(shm-share) shm_map
+child-shm: exit(0)
+(shm-share) wait(exec()) = 0
+(shm-share) child's writes are visible
+(shm-share) end
+shm-share: exit(0)
+EOF
+pass;
@@ -4,10 +4,12 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <random.h>
+#include <round.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "devices/e1000.h"
 #include "devices/kbd.h"
 #include "devices/input.h"
 #include "devices/serial.h"
@@ -20,8 +22,11 @@
 #include "threads/loader.h"
 #include "threads/malloc.h"
 #include "threads/palloc.h"
+#include "threads/profile.h"
 #include "threads/pte.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
+#include "threads/trace.h"
 #ifdef USERPROG
 #include "userprog/process.h"
 #include "userprog/exception.h"
@@ -34,8 +39,18 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
+#include "devices/virtio-blk.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/inode.h"
+#endif
+#ifdef VM
+#include "vm/frame.h"
+#include "vm/page.h"
+#include "vm/shm.h"
+#include "vm/swap.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -49,6 +64,9 @@ static bool format_filesys;
    overriding the defaults. */
 static const char *filesys_bdev_name;
 static const char *scratch_bdev_name;
+
+/* -tmpfs: Directory to mount a memory-only file system over. */
+static const char *tmpfs_mount_point;
 #ifdef VM
 static const char *swap_bdev_name;
 #endif
@@ -59,6 +77,7 @@ static size_t user_page_limit = SIZE_MAX;
 
 static void bss_init (void);
 static void paging_init (void);
+static bool enable_large_pages (void);
 
 static char **read_command_line (void);
 static char **parse_options (char **argv);
@@ -68,6 +87,7 @@ static void usage (void);
 #ifdef FILESYS
 static void locate_block_devices (void);
 static void locate_block_device (enum block_type, const char *name);
+static void parse_ramdisk (char *spec);
 #endif
 
 int main (void) NO_RETURN;
@@ -98,6 +118,7 @@ main (void)
   palloc_init (user_page_limit);
   malloc_init ();
   paging_init ();
+  trace_init ();
 
   /* Segmentation. */
 #ifdef USERPROG
@@ -114,6 +135,11 @@ main (void)
   exception_init ();
   syscall_init ();
 #endif
+#ifdef VM
+  frame_init ();
+  page_init ();
+  shm_init ();
+#endif
 
   /* Start thread scheduler and enable interrupts. */
   thread_start ();
@@ -122,9 +148,19 @@ main (void)
 
 #ifdef FILESYS
   /* Initialize file system. */
+  ramdisk_init ();
   ide_init ();
+  virtio_blk_init ();
   locate_block_devices ();
   filesys_init (format_filesys);
+  if (tmpfs_mount_point != NULL && !filesys_mount_tmpfs (tmpfs_mount_point))
+    PANIC ("can't mount tmpfs on %s", tmpfs_mount_point);
+#endif
+
+  /* Initialize network device. */
+  e1000_init ();
+#ifdef VM
+  swap_init ();
 #endif
 
   printf ("Boot complete.\n");
@@ -150,16 +186,33 @@ bss_init (void)
   memset (&_start_bss, 0, &_end_bss - &_start_bss);
 }
 
+/* CPUID leaf 1 feature bits in EDX.  See [IA32-v2a] "CPUID". */
+#define CPUID_PSE (1u << 3)     /* 4 MB pages. */
+#define CPUID_PGE (1u << 13)    /* Global pages. */
+
+/* CR4 control bits.  See [IA32-v3a] 2.5 "Control Registers". */
+#define CR4_PSE (1u << 4)       /* Enable 4 MB pages. */
+#define CR4_PGE (1u << 7)       /* Enable global pages. */
+
 /* Populates the base page directory and page table with the
    kernel virtual mapping, and then sets up the CPU to use the
    new page directory.  Points init_page_dir to the page
-   directory it creates. */
+   directory it creates.
+
+   If the CPU supports them, every 4 MB of physical memory that
+   does not hold kernel text is mapped with a single global large
+   page, and the remaining kernel PTEs are made global as well, so
+   kernel translations survive the CR3 reload on each process
+   switch.  The span holding kernel text keeps 4 kB pages, so that
+   the text stays read-only. */
 static void
 paging_init (void)
 {
   uint32_t *pd, *pt;
   size_t page;
   extern char _start, _end_kernel_text;
+  bool large = enable_large_pages ();
+  uint32_t global = large ? PTE_G : 0;
 
   pd = init_page_dir = palloc_get_page (PAL_ASSERT | PAL_ZERO);
   pt = NULL;
@@ -171,13 +224,22 @@ paging_init (void)
       size_t pte_idx = pt_no (vaddr);
       bool in_kernel_text = &_start <= vaddr && vaddr < &_end_kernel_text;
 
+      if (large && pte_idx == 0
+          && page + PTSPAN / PGSIZE <= init_ram_pages
+          && (vaddr + PTSPAN <= &_start || vaddr >= &_end_kernel_text))
+        {
+          pd[pde_idx] = pde_create_large (vaddr, true);
+          page += PTSPAN / PGSIZE - 1;
+          continue;
+        }
+
       if (pd[pde_idx] == 0)
         {
           pt = palloc_get_page (PAL_ASSERT | PAL_ZERO);
           pd[pde_idx] = pde_create (pt);
         }
 
-      pt[pte_idx] = pte_create_kernel (vaddr, !in_kernel_text);
+      pt[pte_idx] = pte_create_kernel (vaddr, !in_kernel_text) | global;
     }
 
   /* Store the physical address of the page directory into CR3
@@ -188,6 +250,24 @@ paging_init (void)
   asm volatile ("movl %0, %%cr3" : : "r" (vtop (init_page_dir)));
 }
 
+/* Turns on 4 MB and global pages in CR4 if the CPU supports
+   both, and returns true if it did. */
+static bool
+enable_large_pages (void)
+{
+  uint32_t eax = 1, ebx, ecx, edx;
+  uint32_t cr4;
+
+  asm ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+  if ((edx & (CPUID_PSE | CPUID_PGE)) != (CPUID_PSE | CPUID_PGE))
+    return false;
+
+  asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+  cr4 |= CR4_PSE | CR4_PGE;
+  asm volatile ("movl %0, %%cr4" : : "r" (cr4) : "memory");
+  return true;
+}
+
 /* Breaks the kernel command line into words and returns them as
    an argv-like array. */
 static char **
@@ -223,6 +303,29 @@ read_command_line (void)
   return argv;
 }
 
+#ifdef FILESYS
+/* Parses SPEC, the value of a "-ramdisk=ROLE:KB" option, and
+   asks for such a RAM disk. */
+static void
+parse_ramdisk (char *spec)
+{
+  char *save_ptr;
+  char *role = spec != NULL ? strtok_r (spec, ":", &save_ptr) : NULL;
+  char *size = role != NULL ? strtok_r (NULL, "", &save_ptr) : NULL;
+  int kb = size != NULL ? atoi (size) : 0;
+  int type;
+
+  if (kb <= 0)
+    PANIC ("-ramdisk requires ROLE:KB, e.g. -ramdisk=scratch:1024");
+  for (type = 0; type < BLOCK_ROLE_CNT; type++)
+    if (!strcmp (role, block_type_name (type)))
+      break;
+  if (type == BLOCK_KERNEL || type == BLOCK_ROLE_CNT)
+    PANIC ("-ramdisk: ROLE must be filesys, scratch, or swap");
+  ramdisk_add (type, DIV_ROUND_UP ((size_t) kb * 1024, BLOCK_SECTOR_SIZE));
+}
+#endif
+
 /* Parses options in ARGV[]
    and returns the first non-option argument. */
 static char **
@@ -243,10 +346,31 @@ parse_options (char **argv)
 #ifdef FILESYS
       else if (!strcmp (name, "-f"))
         format_filesys = true;
+      else if (!strcmp (name, "-extents"))
+        inode_use_extents = true;
       else if (!strcmp (name, "-filesys"))
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        {
+          if (value == NULL || atoi (value) <= 0)
+            PANIC ("-cache requires a positive number of sectors");
+          cache_block_cnt = atoi (value);
+        }
+      else if (!strcmp (name, "-ramdisk"))
+        parse_ramdisk (value);
+      else if (!strcmp (name, "-tmpfs"))
+        tmpfs_mount_point = value != NULL ? value : "/tmp";
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (value != NULL && !strcmp (value, "clock"))
+            cache_policy = CACHE_POLICY_CLOCK;
+          else if (value != NULL && !strcmp (value, "2q"))
+            cache_policy = CACHE_POLICY_2Q;
+          else
+            PANIC ("-cache-policy must be \"clock\" or \"2q\"");
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -256,9 +380,27 @@ parse_options (char **argv)
         random_init (atoi (value));
       else if (!strcmp (name, "-mlfqs"))
         thread_mlfqs = true;
+      else if (!strcmp (name, "-lockprof"))
+        lock_profiling = true;
+      else if (!strcmp (name, "-intrtrace"))
+        intr_tracing = true;
+      else if (!strcmp (name, "-tickless"))
+        timer_tickless = true;
+      else if (!strcmp (name, "-trace"))
+        trace_enabled = true;
+      else if (!strcmp (name, "-profile"))
+        profile_enabled = true;
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
+#endif
+#ifdef VM
+      else if (!strcmp (name, "-stack"))
+        {
+          if (value == NULL || atoi (value) <= 0)
+            PANIC ("-stack requires a positive number of kB");
+          stack_max = (size_t) atoi (value) * 1024;
+        }
 #endif
       else
         PANIC ("unknown option `%s' (use -h for help)", name);
@@ -315,6 +457,7 @@ run_actions (char **argv)
       {"rm", 2, fsutil_rm},
       {"extract", 1, fsutil_extract},
       {"append", 2, fsutil_append},
+      {"defrag", 1, fsutil_defrag},
 #endif
       {NULL, 0, NULL},
     };
@@ -361,6 +504,7 @@ usage (void)
           "  ls                 List files in the root directory.\n"
           "  cat FILE           Print FILE to the console.\n"
           "  rm FILE            Delete FILE.\n"
+          "  defrag             Move fragmented files to consecutive sectors.\n"
           "Use these actions indirectly via `pintos' -g and -p options:\n"
           "  extract            Untar from scratch device into file system.\n"
           "  append FILE        Append FILE to tar file on scratch device.\n"
@@ -371,16 +515,30 @@ usage (void)
           "  -r                 Reboot after actions.\n"
 #ifdef FILESYS
           "  -f                 Format file system device during startup.\n"
+          "  -extents           With -f, map file data with extents.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=N           Use N sectors of buffer cache (default 63).\n"
+          "  -cache-policy=P    Replace cache blocks by P: clock or 2q (default).\n"
+          "  -ramdisk=ROLE:KB   Add a KB kB RAM disk for ROLE (filesys, scratch,\n"
+          "                     or swap), used for ROLE unless another is named.\n"
+          "  -tmpfs[=DIR]       Keep files under DIR (default /tmp) in memory only.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
+          "  -lockprof          Report contention on named locks at shutdown.\n"
+          "  -intrtrace         Report the longest interrupts-off windows.\n"
+          "  -tickless          Stop the timer tick while the CPU is idle.\n"
+          "  -trace             Record kernel events, dump them at power off.\n"
+          "  -profile           Sample the code each timer tick interrupts.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+          "  -stack=N           Limit user stacks to N kB (default 8192).\n"
 #endif
           );
   shutdown_power_off ();
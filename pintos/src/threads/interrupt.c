@@ -7,8 +7,13 @@
 #include "threads/intr-stubs.h"
 #include "threads/io.h"
 #include "threads/thread.h"
+#include "threads/trace.h"
 #include "threads/vaddr.h"
 #include "devices/timer.h"
+#ifdef USERPROG
+#include "userprog/gdt.h"
+#include "userprog/process.h"
+#endif
 
 /* Programmable Interrupt Controller (PIC) registers.
    A PC has two PICs, called the master and slave PICs, with the
@@ -47,6 +52,42 @@ static unsigned int unexpected_cnt[INTR_CNT];
 static bool in_external_intr;   /* Are we processing an external interrupt? */
 static bool yield_on_return;    /* Should we yield on interrupt return? */
 
+/* Interrupts-off latency tracing.
+
+   While enabled, each window in which a kernel thread keeps
+   interrupts off, from the intr_disable() that turns them off to
+   the intr_enable() that turns them back on, is timed with the
+   time stamp counter.  The longest window seen from each pair of
+   call sites is kept, and reported at shutdown.
+
+   Windows that end with a bare "sti", as in the idle thread, or
+   with the return from an interrupt are not timed, and neither is
+   the time spent in external interrupt handlers, which the CPU
+   enters with interrupts already off. */
+bool intr_tracing;
+
+/* Longest window seen from one pair of call sites. */
+struct intr_window
+  {
+    void *off_at;               /* Where interrupts went off. */
+    void *on_at;                /* Where they came back on. */
+    uint64_t max_cycles;        /* Longest such window. */
+    unsigned cnt;               /* Number of such windows. */
+  };
+
+/* Number of distinct windows kept. */
+#define INTR_WINDOW_CNT 16
+
+static struct intr_window windows[INTR_WINDOW_CNT];
+static uint64_t window_cnt;     /* Windows timed. */
+static uint64_t window_cycles;  /* Their total length. */
+static uint64_t off_tsc;        /* When the open window began. */
+static void *off_at;            /* Its intr_disable() caller, or NULL. */
+
+static enum intr_level enable_from (void *caller);
+static enum intr_level disable_from (void *caller);
+static void window_close (void *on_at);
+
 /* Programmable Interrupt Controller helpers. */
 static void pic_init (void);
 static void pic_end_of_interrupt (int irq);
@@ -80,16 +121,35 @@ intr_get_level (void)
 enum intr_level
 intr_set_level (enum intr_level level)
 {
-  return level == INTR_ON ? intr_enable () : intr_disable ();
+  void *caller = __builtin_return_address (0);
+  return level == INTR_ON ? enable_from (caller) : disable_from (caller);
 }
 
 /* Enables interrupts and returns the previous interrupt status. */
 enum intr_level
 intr_enable (void)
+{
+  return enable_from (__builtin_return_address (0));
+}
+
+/* Disables interrupts and returns the previous interrupt status. */
+enum intr_level
+intr_disable (void)
+{
+  return disable_from (__builtin_return_address (0));
+}
+
+/* Enables interrupts on behalf of CALLER and returns the previous
+   interrupt status. */
+static enum intr_level
+enable_from (void *caller)
 {
   enum intr_level old_level = intr_get_level ();
   ASSERT (!intr_context ());
 
+  if (intr_tracing && old_level == INTR_OFF)
+    window_close (caller);
+
   /* Enable interrupts by setting the interrupt flag.
 
      See [IA32-v2b] "STI" and [IA32-v3a] 5.8.1 "Masking Maskable
@@ -99,9 +159,10 @@ intr_enable (void)
   return old_level;
 }
 
-/* Disables interrupts and returns the previous interrupt status. */
-enum intr_level
-intr_disable (void)
+/* Disables interrupts on behalf of CALLER and returns the
+   previous interrupt status. */
+static enum intr_level
+disable_from (void *caller)
 {
   enum intr_level old_level = intr_get_level ();
 
@@ -110,9 +171,90 @@ intr_disable (void)
      Hardware Interrupts". */
   asm volatile ("cli" : : : "memory");
 
+  if (intr_tracing && old_level == INTR_ON)
+    {
+      off_tsc = rdtsc ();
+      off_at = caller;
+    }
+
   return old_level;
 }
 
+/* Ends the open interrupts-off window, if any, at ON_AT, and
+   records its length.  Interrupts must be off. */
+static void
+window_close (void *on_at)
+{
+  uint64_t cycles;
+  struct intr_window *w, *shortest;
+
+  if (off_at == NULL)
+    return;
+  cycles = rdtsc () - off_tsc;
+  window_cnt++;
+  window_cycles += cycles;
+
+  shortest = windows;
+  for (w = windows; w < windows + INTR_WINDOW_CNT; w++)
+    {
+      if (w->off_at == off_at && w->on_at == on_at)
+        break;
+      if (w->max_cycles < shortest->max_cycles)
+        shortest = w;
+    }
+  if (w == windows + INTR_WINDOW_CNT)
+    {
+      /* A new pair of call sites displaces the one with the
+         shortest window, if this window is longer. */
+      w = shortest;
+      if (w->max_cycles >= cycles)
+        {
+          off_at = NULL;
+          return;
+        }
+      w->off_at = off_at;
+      w->on_at = on_at;
+      w->max_cycles = 0;
+      w->cnt = 0;
+    }
+  w->cnt++;
+  if (cycles > w->max_cycles)
+    w->max_cycles = cycles;
+  off_at = NULL;
+}
+
+/* Prints the longest interrupts-off windows, longest first, with
+   the addresses that turned interrupts off and on again, for the
+   "backtrace" utility to resolve. */
+void
+intr_print_stats (void)
+{
+  struct intr_window *sorted[INTR_WINDOW_CNT];
+  size_t cnt = 0;
+  size_t i, j;
+
+  if (!intr_tracing)
+    return;
+
+  for (i = 0; i < INTR_WINDOW_CNT; i++)
+    if (windows[i].cnt > 0)
+      {
+        for (j = cnt; j > 0
+               && sorted[j - 1]->max_cycles < windows[i].max_cycles; j--)
+          sorted[j] = sorted[j - 1];
+        sorted[j] = &windows[i];
+        cnt++;
+      }
+
+  printf ("Interrupts off: %"PRIu64" windows, %"PRIu64" cycles\n",
+          window_cnt, window_cycles);
+  for (i = 0; i < cnt; i++)
+    printf ("Interrupts off: %"PRIu64" max cycles, %u times, "
+            "off at %p, on at %p\n",
+            sorted[i]->max_cycles, sorted[i]->cnt,
+            sorted[i]->off_at, sorted[i]->on_at);
+}
+
 /* Initializes the interrupt system. */
 void
 intr_init (void)
@@ -206,6 +348,13 @@ intr_register_int (uint8_t vec_no, int dpl, enum intr_level level,
   register_handler (vec_no, dpl, level, handler, name);
 }
 
+/* Returns true if interrupt VEC_NO already has a handler. */
+bool
+intr_is_registered (uint8_t vec_no)
+{
+  return intr_handlers[vec_no] != NULL;
+}
+
 /* Returns true during processing of an external interrupt
    and false at all other times. */
 bool
@@ -359,6 +508,10 @@ intr_handler (struct intr_frame *frame)
 
       in_external_intr = true;
       yield_on_return = false;
+
+      /* Interrupts were on for this interrupt to arrive, so any
+         window still open was closed behind our back. */
+      off_at = NULL;
     }
 
   /* Invoke the interrupt's handler. */
@@ -386,6 +539,12 @@ intr_handler (struct intr_frame *frame)
       if (yield_on_return)
         thread_yield ();
     }
+
+#ifdef USERPROG
+  /* Don't go back to a user process that is exiting. */
+  if (frame->cs == SEL_UCSEG)
+    process_stop_if_exiting ();
+#endif
 }
 
 /* Handles an unexpected interrupt with interrupt frame F.  An
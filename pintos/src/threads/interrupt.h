@@ -16,6 +16,11 @@ enum intr_level intr_set_level (enum intr_level);
 enum intr_level intr_enable (void);
 enum intr_level intr_disable (void);
 
+/* If true, intr_disable() and intr_enable() time how long
+   interrupts stay off, for intr_print_stats().  Set by kernel
+   command-line option "-intrtrace". */
+extern bool intr_tracing;
+
 /* Interrupt stack frame. */
 struct intr_frame
   {
@@ -61,10 +66,12 @@ void intr_init (void);
 void intr_register_ext (uint8_t vec, intr_handler_func *, const char *name);
 void intr_register_int (uint8_t vec, int dpl, enum intr_level,
                         intr_handler_func *, const char *name);
+bool intr_is_registered (uint8_t vec);
 bool intr_context (void);
 void intr_yield_on_return (void);
 
 void intr_dump_frame (const struct intr_frame *);
 const char *intr_name (uint8_t vec);
+void intr_print_stats (void);
 
 #endif /* threads/interrupt.h */
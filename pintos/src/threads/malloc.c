@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -32,7 +33,19 @@
    because they're too big to fit in a single page with a
    descriptor.  We handle those by allocating contiguous pages
    with the page allocator and sticking the allocation size at
-   the beginning of the allocated block's arena header. */
+   the beginning of the allocated block's arena header.
+
+   In front of each descriptor's free list sits a small
+   "magazine" of free blocks for the CPU, used with interrupts
+   off instead of the descriptor's lock.  Most malloc() and
+   free() calls are satisfied from the magazine.  It is refilled
+   from, and drained to, the free list MAG_BATCH blocks at a
+   time.  Blocks in a magazine count as in use by their arena. */
+
+/* Blocks held in a magazine, and blocks moved between a magazine
+   and its descriptor's free list at a time. */
+#define MAG_SIZE 16
+#define MAG_BATCH (MAG_SIZE / 2)
 
 /* Descriptor. */
 struct desc
@@ -41,6 +54,10 @@ struct desc
     size_t blocks_per_arena;    /* Number of blocks in an arena. */
     struct list free_list;      /* List of free blocks. */
     struct lock lock;           /* Lock. */
+
+    /* The CPU's magazine.  Only touched with interrupts off. */
+    struct block *mag[MAG_SIZE]; /* Free blocks. */
+    size_t mag_cnt;             /* Number of blocks in mag. */
   };
 
 /* Magic number for detecting arena corruption. */
@@ -64,14 +81,24 @@ struct block
 static struct desc descs[10];   /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 
+/* Smallest descriptor for each request size, indexed by
+   (size - 1) / CLASS_GRAIN, for sizes up to that of the largest
+   descriptor. */
+#define CLASS_GRAIN 16
+#define CLASS_CNT (PGSIZE / 4 / CLASS_GRAIN)
+static struct desc *size_class[CLASS_CNT];
+
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static struct block *take_block (struct desc *);
+static void return_block (struct desc *, struct block *);
 
 /* Initializes the malloc() descriptors. */
 void
 malloc_init (void)
 {
   size_t block_size;
+  size_t i;
 
   for (block_size = 16; block_size < PGSIZE / 2; block_size *= 2)
     {
@@ -81,6 +108,20 @@ malloc_init (void)
       d->blocks_per_arena = (PGSIZE - sizeof (struct arena)) / block_size;
       list_init (&d->free_list);
       lock_init (&d->lock);
+      d->mag_cnt = 0;
+    }
+
+  ASSERT (descs[desc_cnt - 1].block_size <= CLASS_CNT * CLASS_GRAIN);
+  for (i = 0; i < CLASS_CNT; i++)
+    {
+      size_t size = (i + 1) * CLASS_GRAIN;
+      struct desc *d;
+
+      for (d = descs; d < descs + desc_cnt; d++)
+        if (d->block_size >= size)
+          break;
+      ASSERT (d < descs + desc_cnt);
+      size_class[i] = d;
     }
 }
 
@@ -92,6 +133,9 @@ malloc (size_t size)
   struct desc *d;
   struct block *b;
   struct arena *a;
+  struct block *batch[MAG_BATCH];
+  enum intr_level old_level;
+  size_t cnt;
 
   /* A null pointer satisfies a request for 0 bytes. */
   if (size == 0)
@@ -99,10 +143,9 @@ malloc (size_t size)
 
   /* Find the smallest descriptor that satisfies a SIZE-byte
      request. */
-  for (d = descs; d < descs + desc_cnt; d++)
-    if (d->block_size >= size)
-      break;
-  if (d == descs + desc_cnt)
+  if (size <= descs[desc_cnt - 1].block_size)
+    d = size_class[(size - 1) / CLASS_GRAIN];
+  else
     {
       /* SIZE is too big for any descriptor.
          Allocate enough pages to hold SIZE plus an arena. */
@@ -119,7 +162,54 @@ malloc (size_t size)
       return a + 1;
     }
 
+  /* Take a block from the magazine if it has one. */
+  old_level = intr_disable ();
+  if (d->mag_cnt > 0)
+    {
+      b = d->mag[--d->mag_cnt];
+      intr_set_level (old_level);
+      return b;
+    }
+  intr_set_level (old_level);
+
+  /* Otherwise take a batch from the free list, return one block
+     and load the rest into the magazine. */
   lock_acquire (&d->lock);
+  for (cnt = 0; cnt < MAG_BATCH; cnt++)
+    {
+      batch[cnt] = take_block (d);
+      if (batch[cnt] == NULL)
+        break;
+    }
+  if (cnt == 0)
+    {
+      lock_release (&d->lock);
+      return NULL;
+    }
+  b = batch[--cnt];
+
+  old_level = intr_disable ();
+  while (cnt > 0 && d->mag_cnt < MAG_SIZE)
+    d->mag[d->mag_cnt++] = batch[--cnt];
+  intr_set_level (old_level);
+
+  /* Another thread may have filled the magazine meanwhile. */
+  while (cnt > 0)
+    return_block (d, batch[--cnt]);
+  lock_release (&d->lock);
+  return b;
+}
+
+/* Removes a block from D's free list, creating a new arena if the
+   list is empty, and returns it.  Returns a null pointer if no
+   memory is available.  D's lock must be held. */
+static struct block *
+take_block (struct desc *d)
+{
+  struct block *b;
+  struct arena *a;
+
+  ASSERT (lock_held_by_current_thread (&d->lock));
 
   /* If the free list is empty, create a new arena. */
   if (list_empty (&d->free_list))
@@ -129,10 +219,7 @@ malloc (size_t size)
       /* Allocate a page. */
       a = palloc_get_page (0);
       if (a == NULL)
-        {
-          lock_release (&d->lock);
-          return NULL;
-        }
+        return NULL;
 
       /* Initialize arena and add its blocks to the free list. */
       a->magic = ARENA_MAGIC;
@@ -145,14 +232,41 @@ malloc (size_t size)
         }
     }
 
-  /* Get a block from free list and return it. */
+  /* Get a block from free list. */
   b = list_entry (list_pop_front (&d->free_list), struct block, free_elem);
   a = block_to_arena (b);
   a->free_cnt--;
-  lock_release (&d->lock);
   return b;
 }
 
+/* Adds block B back to D's free list, giving its arena back to
+   the page allocator if the arena is now entirely unused.  D's
+   lock must be held. */
+static void
+return_block (struct desc *d, struct block *b)
+{
+  struct arena *a = block_to_arena (b);
+
+  ASSERT (lock_held_by_current_thread (&d->lock));
+
+  /* Add block to free list. */
+  list_push_front (&d->free_list, &b->free_elem);
+
+  /* If the arena is now entirely unused, free it. */
+  if (++a->free_cnt >= d->blocks_per_arena)
+    {
+      size_t i;
+
+      ASSERT (a->free_cnt == d->blocks_per_arena);
+      for (i = 0; i < d->blocks_per_arena; i++)
+        {
+          struct block *b = arena_to_block (a, i);
+          list_remove (&b->free_elem);
+        }
+      palloc_free_page (a);
+    }
+}
+
 /* Allocates and return A times B bytes initialized to zeroes.
    Returns a null pointer if memory is not available. */
 void *
@@ -233,25 +347,29 @@ free (void *p)
           memset (b, 0xcc, d->block_size);
 #endif
 
-          lock_acquire (&d->lock);
-
-          /* Add block to free list. */
-          list_push_front (&d->free_list, &b->free_elem);
+          struct block *batch[MAG_BATCH];
+          enum intr_level old_level;
+          size_t cnt = 0;
 
-          /* If the arena is now entirely unused, free it. */
-          if (++a->free_cnt >= d->blocks_per_arena)
+          /* Put the block in the magazine if there is room. */
+          old_level = intr_disable ();
+          if (d->mag_cnt < MAG_SIZE)
             {
-              size_t i;
-
-              ASSERT (a->free_cnt == d->blocks_per_arena);
-              for (i = 0; i < d->blocks_per_arena; i++)
-                {
-                  struct block *b = arena_to_block (a, i);
-                  list_remove (&b->free_elem);
-                }
-              palloc_free_page (a);
+              d->mag[d->mag_cnt++] = b;
+              intr_set_level (old_level);
+              return;
             }
 
+          /* Otherwise drain a batch from the magazine, and the
+             block itself, back to the free list. */
+          while (cnt < MAG_BATCH && d->mag_cnt > 0)
+            batch[cnt++] = d->mag[--d->mag_cnt];
+          intr_set_level (old_level);
+
+          lock_acquire (&d->lock);
+          return_block (d, b);
+          while (cnt > 0)
+            return_block (d, batch[--cnt]);
           lock_release (&d->lock);
         }
       else
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/loader.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -23,7 +24,32 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   Single pages, which make up most requests, are recycled
+   through a stack of freed pages threaded through the pages
+   themselves.  Pages on the stack stay marked in use in the
+   pool's bitmap, so the bitmap only has to be searched when the
+   stack is empty or for multi-page requests.  Searches start
+   where the last one left off rather than at page 0.  A
+   multi-page request that cannot be met returns the stacked
+   pages to the bitmap and tries again.
+
+   The idle thread zeroes stacked pages in the background and
+   moves them to a second stack of zeroed pages, so that most
+   PAL_ZERO requests need no memset().  The first word of a page
+   on either stack holds the link to the next one and is cleared
+   when the page is handed out.
+
+   The stacks are guarded by turning interrupts off rather than by
+   the pool lock, because thread_schedule_tail() frees the page
+   of a dying thread from inside the scheduler. */
+
+/* A free page on a pool's free page stack. */
+struct free_page
+  {
+    struct free_page *next;             /* Next free page, or NULL. */
+  };
 
 /* A memory pool. */
 struct pool
@@ -31,6 +57,11 @@ struct pool
     struct lock lock;                   /* Mutual exclusion. */
     struct bitmap *used_map;            /* Bitmap of free pages. */
     uint8_t *base;                      /* Base of pool. */
+    struct free_page *free_stack;       /* Freed single pages.
+                                           Interrupts off to access. */
+    struct free_page *zero_stack;       /* Zeroed single pages.
+                                           Interrupts off to access. */
+    size_t next_idx;                    /* Where to start searching. */
   };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -39,6 +70,11 @@ static struct pool kernel_pool, user_pool;
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
 static bool page_from_pool (const struct pool *, void *page);
+static struct pool *page_pool (void *page);
+static size_t scan_pool (struct pool *, size_t page_cnt);
+static struct free_page *pop_page (struct free_page **stack);
+static void push_page (struct free_page **stack, void *page);
+static bool zero_pool_page (struct pool *);
 
 /* Initializes the page allocator.  At most USER_PAGE_LIMIT
    pages are put into the user pool. */
@@ -72,23 +108,64 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 {
   struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
   void *pages;
+  bool zeroed;
   size_t page_idx;
 
   if (page_cnt == 0)
     return NULL;
 
-  lock_acquire (&pool->lock);
-  page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-  lock_release (&pool->lock);
+  pages = NULL;
+  zeroed = false;
+  if (page_cnt == 1)
+    {
+      /* Prefer whichever stack matches the request. */
+      struct free_page **first, **second;
 
-  if (page_idx != BITMAP_ERROR)
-    pages = pool->base + PGSIZE * page_idx;
-  else
-    pages = NULL;
+      if (flags & PAL_ZERO)
+        {
+          first = &pool->zero_stack;
+          second = &pool->free_stack;
+        }
+      else
+        {
+          first = &pool->free_stack;
+          second = &pool->zero_stack;
+        }
+      pages = pop_page (first);
+      if (pages != NULL)
+        zeroed = first == &pool->zero_stack;
+      else
+        {
+          pages = pop_page (second);
+          zeroed = pages != NULL && second == &pool->zero_stack;
+        }
+    }
+
+  if (pages == NULL)
+    {
+      lock_acquire (&pool->lock);
+      page_idx = scan_pool (pool, page_cnt);
+      if (page_idx == BITMAP_ERROR
+          && (pool->free_stack != NULL || pool->zero_stack != NULL))
+        {
+          /* Give the stacked pages back to the bitmap, in case
+             they make up the run we need, and look again. */
+          struct free_page *p;
+
+          while ((p = pop_page (&pool->free_stack)) != NULL
+                 || (p = pop_page (&pool->zero_stack)) != NULL)
+            bitmap_reset (pool->used_map, pg_no (p) - pg_no (pool->base));
+          page_idx = scan_pool (pool, page_cnt);
+        }
+      lock_release (&pool->lock);
+
+      if (page_idx != BITMAP_ERROR)
+        pages = pool->base + PGSIZE * page_idx;
+    }
 
   if (pages != NULL)
     {
-      if (flags & PAL_ZERO)
+      if ((flags & PAL_ZERO) && !zeroed)
         memset (pages, 0, PGSIZE * page_cnt);
     }
   else
@@ -124,13 +201,7 @@ palloc_free_multiple (void *pages, size_t page_cnt)
   if (pages == NULL || page_cnt == 0)
     return;
 
-  if (page_from_pool (&kernel_pool, pages))
-    pool = &kernel_pool;
-  else if (page_from_pool (&user_pool, pages))
-    pool = &user_pool;
-  else
-    NOT_REACHED ();
-
+  pool = page_pool (pages);
   page_idx = pg_no (pages) - pg_no (pool->base);
 
 #ifndef NDEBUG
@@ -138,7 +209,10 @@ palloc_free_multiple (void *pages, size_t page_cnt)
 #endif
 
   ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
-  bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  if (page_cnt == 1)
+    push_page (&pool->free_stack, pages);
+  else
+    bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
 }
 
 /* Frees the page at PAGE. */
@@ -148,6 +222,58 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Initializes BATCH as empty. */
+void
+palloc_batch_init (struct palloc_batch *batch)
+{
+  batch->head[0] = batch->head[1] = NULL;
+  batch->tail[0] = batch->tail[1] = NULL;
+}
+
+/* Adds PAGE, which must be a single page obtained from
+   palloc_get_page(), to BATCH.  PAGE must no longer be used, but
+   it is not actually freed until palloc_free_batch(). */
+void
+palloc_batch_add (struct palloc_batch *batch, void *page)
+{
+  struct pool *pool;
+  struct free_page *p = page;
+  int i;
+
+  ASSERT (page != NULL && pg_ofs (page) == 0);
+  pool = page_pool (page);
+  i = pool == &user_pool;
+  ASSERT (bitmap_test (pool->used_map, pg_no (page) - pg_no (pool->base)));
+
+#ifndef NDEBUG
+  memset (page, 0xcc, PGSIZE);
+#endif
+
+  p->next = batch->head[i];
+  if (batch->head[i] == NULL)
+    batch->tail[i] = p;
+  batch->head[i] = p;
+}
+
+/* Frees all the pages in BATCH by splicing them onto their pools'
+   free page stacks in one step, and leaves BATCH empty. */
+void
+palloc_free_batch (struct palloc_batch *batch)
+{
+  struct pool *pools[2] = { &kernel_pool, &user_pool };
+  enum intr_level old_level = intr_disable ();
+  int i;
+
+  for (i = 0; i < 2; i++)
+    if (batch->head[i] != NULL)
+      {
+        batch->tail[i]->next = pools[i]->free_stack;
+        pools[i]->free_stack = batch->head[i];
+      }
+  intr_set_level (old_level);
+  palloc_batch_init (batch);
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
@@ -164,9 +290,91 @@ init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
   printf ("%zu pages available in %s.\n", page_cnt, name);
 
   /* Initialize the pool. */
-  lock_init (&p->lock);
+  lock_init_adaptive (&p->lock);
+  lock_set_name (&p->lock, name);
   p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
   p->base = base + bm_pages * PGSIZE;
+  p->free_stack = NULL;
+  p->zero_stack = NULL;
+  p->next_idx = 0;
+}
+
+/* Zeroes one freed page, from the user pool if it has one and
+   otherwise from the kernel pool, so that a later PAL_ZERO
+   request can skip the memset().  Returns false if there was no
+   page left to zero.  Called by the idle thread. */
+bool
+palloc_zero_free_page (void)
+{
+  return zero_pool_page (&user_pool) || zero_pool_page (&kernel_pool);
+}
+
+/* Moves one page from POOL's free stack to its zeroed stack,
+   zeroing it with interrupts on.  Returns false if the free stack
+   is empty. */
+static bool
+zero_pool_page (struct pool *pool)
+{
+  struct free_page *p = pop_page (&pool->free_stack);
+
+  if (p == NULL)
+    return false;
+  memset (p, 0, PGSIZE);
+  push_page (&pool->zero_stack, p);
+  return true;
+}
+
+/* Pops a page off STACK and returns it with its link cleared, or
+   returns a null pointer if STACK is empty. */
+static struct free_page *
+pop_page (struct free_page **stack)
+{
+  enum intr_level old_level = intr_disable ();
+  struct free_page *p = *stack;
+
+  if (p != NULL)
+    {
+      *stack = p->next;
+      p->next = NULL;
+    }
+  intr_set_level (old_level);
+  return p;
+}
+
+/* Pushes PAGE onto STACK. */
+static void
+push_page (struct free_page **stack, void *page)
+{
+  struct free_page *p = page;
+  enum intr_level old_level = intr_disable ();
+
+  p->next = *stack;
+  *stack = p;
+  intr_set_level (old_level);
+}
+
+/* Finds PAGE_CNT contiguous free pages in POOL's bitmap, marks
+   them in use and returns the index of the first, or
+   BITMAP_ERROR if there is no such run.  Starts looking where the
+   previous search ended and wraps around to the start of the
+   pool.  POOL's lock must be held. */
+static size_t
+scan_pool (struct pool *pool, size_t page_cnt)
+{
+  return bitmap_scan_and_flip_next (pool->used_map, &pool->next_idx,
+                                    page_cnt, false);
+}
+
+/* Returns the pool that PAGE was allocated from. */
+static struct pool *
+page_pool (void *page)
+{
+  if (page_from_pool (&kernel_pool, page))
+    return &kernel_pool;
+  else if (page_from_pool (&user_pool, page))
+    return &user_pool;
+  else
+    NOT_REACHED ();
 }
 
 /* Returns true if PAGE was allocated from POOL,
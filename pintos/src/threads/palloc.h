@@ -1,6 +1,7 @@
 #ifndef THREADS_PALLOC_H
 #define THREADS_PALLOC_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 /* How to allocate pages. */
@@ -11,10 +12,25 @@ enum palloc_flags
     PAL_USER = 004              /* User page. */
   };
 
+/* Pages gathered by palloc_batch_add() to be freed together by
+   palloc_free_batch().  The pages are threaded through themselves,
+   one list per pool, so a batch can grow without bound and costs
+   nothing but these pointers. */
+struct palloc_batch
+  {
+    struct free_page *head[2];  /* First page, per pool. */
+    struct free_page *tail[2];  /* Last page, per pool. */
+  };
+
 void palloc_init (size_t user_page_limit);
 void *palloc_get_page (enum palloc_flags);
 void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
 void palloc_free_page (void *);
 void palloc_free_multiple (void *, size_t page_cnt);
+bool palloc_zero_free_page (void);
+
+void palloc_batch_init (struct palloc_batch *);
+void palloc_batch_add (struct palloc_batch *, void *page);
+void palloc_free_batch (struct palloc_batch *);
 
 #endif /* threads/palloc.h */
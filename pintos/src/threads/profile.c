@@ -0,0 +1,93 @@
+#include "threads/profile.h"
+#include <inttypes.h>
+#include <round.h>
+#include <stdio.h>
+#include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* Samples each processor's buffer holds, about 40 seconds' worth
+   at 100 ticks per second.  Ticks after it fills are counted but
+   not kept. */
+#define PROFILE_CNT 4096
+
+bool profile_enabled;
+
+/* Allocates BUF's samples, if profiling was requested. */
+void
+profile_init (struct profile_buf *buf)
+{
+  size_t page_cnt = DIV_ROUND_UP (PROFILE_CNT * sizeof *buf->samples,
+                                  PGSIZE);
+
+  buf->cnt = buf->dropped = 0;
+  buf->samples = (profile_enabled
+                  ? palloc_get_multiple (PAL_ASSERT, page_cnt)
+                  : NULL);
+}
+
+/* Samples the code that timer interrupt frame F interrupted into
+   BUF: its instruction pointer and, for kernel code, the return
+   addresses found by following saved frame pointers up the
+   kernel stack.  User code gets its instruction pointer only,
+   since its stack may not be mapped. */
+void
+profile_record (struct profile_buf *buf, const struct intr_frame *f)
+{
+  struct profile_sample *s;
+  const uint32_t *frame;
+  int i;
+
+  if (buf->samples == NULL)
+    return;
+  if (buf->cnt >= PROFILE_CNT)
+    {
+      buf->dropped++;
+      return;
+    }
+
+  s = &buf->samples[buf->cnt++];
+  s->pc[0] = (uint32_t) f->eip;
+  i = 1;
+  if (is_kernel_vaddr ((void *) f->eip))
+    {
+      /* Frames of the interrupted code are on the kernel stack
+         that F is on, and each is above the one it calls. */
+      void *stack = pg_round_down (f);
+      for (frame = (const uint32_t *) f->ebp;
+           i < PROFILE_DEPTH && pg_round_down (frame) == stack
+             && frame[1] != 0;
+           frame = (const uint32_t *) frame[0])
+        {
+          s->pc[i++] = frame[1];
+          if (frame[0] <= (uint32_t) frame)
+            break;
+        }
+    }
+  for (; i < PROFILE_DEPTH; i++)
+    s->pc[i] = 0;
+}
+
+/* Prints BUF's samples for processor CPU_ID, one per line, for
+   "backtrace --profile" to turn into a profile. */
+void
+profile_dump (const struct profile_buf *buf, int cpu_id)
+{
+  size_t i;
+
+  if (buf->samples == NULL)
+    return;
+
+  printf ("Profile: cpu %d: %zu samples, %zu dropped\n",
+          cpu_id, buf->cnt, buf->dropped);
+  for (i = 0; i < buf->cnt; i++)
+    {
+      const struct profile_sample *s = &buf->samples[i];
+      int j;
+
+      printf ("sample");
+      for (j = 0; j < PROFILE_DEPTH && s->pc[j] != 0; j++)
+        printf (" %#"PRIx32, s->pc[j]);
+      printf ("\n");
+    }
+}
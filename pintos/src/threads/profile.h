@@ -0,0 +1,36 @@
+#ifndef THREADS_PROFILE_H
+#define THREADS_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct intr_frame;
+
+/* Addresses kept per sample: the interrupted instruction, then
+   the return addresses of its callers, innermost first. */
+#define PROFILE_DEPTH 8
+
+/* One timer tick's sample.  Unused slots of PC are 0. */
+struct profile_sample
+  {
+    uint32_t pc[PROFILE_DEPTH];
+  };
+
+/* A processor's samples. */
+struct profile_buf
+  {
+    struct profile_sample *samples;     /* Allocated by profile_init(). */
+    size_t cnt;                         /* Samples taken. */
+    size_t dropped;                     /* Ticks missed with SAMPLES full. */
+  };
+
+/* If true, each timer tick samples the code it interrupted.
+   Set by kernel command-line option "-profile". */
+extern bool profile_enabled;
+
+void profile_init (struct profile_buf *);
+void profile_record (struct profile_buf *, const struct intr_frame *);
+void profile_dump (const struct profile_buf *, int cpu_id);
+
+#endif /* threads/profile.h */
@@ -0,0 +1,227 @@
+#include "threads/slab.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* A slab allocator for kernel objects of one fixed size.
+
+   Each cache carves pages from the page allocator into "slabs"
+   of equal-size objects.  The objects are exactly as big as the
+   type they hold, rounded up only for alignment, instead of to
+   the next power of 2 as with malloc().  A slab starts with a
+   header and keeps its free objects on a list threaded through
+   the objects themselves.
+
+   The cache keeps the slabs that have a free object on a list,
+   partly used slabs at the front and wholly free ones at the
+   back, so allocation takes the first free object of the first
+   slab and freeing pushes the object back onto its slab's list.
+   Both are O(1).  One wholly free slab is kept around so that a
+   cache hovering at a slab boundary doesn't go to the page
+   allocator on every call; any further free slabs are returned.
+
+   If the cache has a constructor, it is run on each object as
+   the object is allocated. */
+
+/* Magic number for detecting slab corruption. */
+#define SLAB_MAGIC 0x51ab51ab
+
+/* Alignment of objects in a slab. */
+#define SLAB_ALIGN 8
+
+/* A cache. */
+struct kmem_cache
+  {
+    const char *name;           /* Name, for debugging. */
+    size_t obj_size;            /* Size of each object in bytes. */
+    size_t objs_per_slab;       /* Number of objects in a slab. */
+    void (*ctor) (void *);      /* Constructor, or null. */
+    struct lock lock;           /* Lock. */
+    struct list slabs;          /* Slabs with a free object. */
+    size_t empty_cnt;           /* Wholly free slabs on SLABS. */
+  };
+
+/* Free object. */
+struct free_obj
+  {
+    struct free_obj *next;      /* Next free object in slab, or null. */
+  };
+
+/* Slab header, at the start of each slab's page. */
+struct slab
+  {
+    unsigned magic;             /* Always set to SLAB_MAGIC. */
+    struct kmem_cache *cache;   /* Owning cache. */
+    struct list_elem elem;      /* Element in cache's SLABS list. */
+    size_t free_cnt;            /* Number of free objects. */
+    struct free_obj *free;      /* Free objects. */
+  };
+
+/* Offset of the first object in a slab. */
+#define SLAB_HEADER ROUND_UP (sizeof (struct slab), SLAB_ALIGN)
+
+static struct slab *new_slab (struct kmem_cache *);
+static struct slab *obj_to_slab (struct kmem_cache *, void *);
+
+/* Creates and returns a cache of objects SIZE bytes in size,
+   named NAME for debugging purposes.  If CTOR is nonnull, it is
+   called on each object as it is allocated.  Returns a null
+   pointer if memory is not available. */
+struct kmem_cache *
+kmem_cache_create (const char *name, size_t size, void (*ctor) (void *))
+{
+  struct kmem_cache *c;
+
+  ASSERT (name != NULL);
+  ASSERT (size > 0);
+
+  size = ROUND_UP (size, SLAB_ALIGN);
+  ASSERT (size <= PGSIZE - SLAB_HEADER);
+
+  c = malloc (sizeof *c);
+  if (c == NULL)
+    return NULL;
+
+  c->name = name;
+  c->obj_size = size;
+  c->objs_per_slab = (PGSIZE - SLAB_HEADER) / size;
+  c->ctor = ctor;
+  lock_init (&c->lock);
+  list_init (&c->slabs);
+  c->empty_cnt = 0;
+  return c;
+}
+
+/* Obtains and returns a new object from cache C, constructed if
+   C has a constructor.  Returns a null pointer if memory is not
+   available. */
+void *
+kmem_cache_alloc (struct kmem_cache *c)
+{
+  struct slab *s;
+  struct free_obj *obj;
+
+  ASSERT (c != NULL);
+
+  lock_acquire (&c->lock);
+  if (list_empty (&c->slabs))
+    {
+      s = new_slab (c);
+      if (s == NULL)
+        {
+          lock_release (&c->lock);
+          return NULL;
+        }
+    }
+  else
+    s = list_entry (list_front (&c->slabs), struct slab, elem);
+
+  /* Take the slab's first free object. */
+  obj = s->free;
+  s->free = obj->next;
+  if (s->free_cnt-- == c->objs_per_slab)
+    c->empty_cnt--;
+  if (s->free_cnt == 0)
+    list_remove (&s->elem);
+  lock_release (&c->lock);
+
+  if (c->ctor != NULL)
+    c->ctor (obj);
+  return obj;
+}
+
+/* Returns object P, which must have been allocated from cache C
+   with kmem_cache_alloc(), to C.  A null P is ignored. */
+void
+kmem_cache_free (struct kmem_cache *c, void *p)
+{
+  struct free_obj *obj = p;
+  struct slab *s;
+
+  if (p == NULL)
+    return;
+
+  s = obj_to_slab (c, p);
+
+#ifndef NDEBUG
+  /* Clear the object to help detect use-after-free bugs. */
+  memset (p, 0xcc, c->obj_size);
+#endif
+
+  lock_acquire (&c->lock);
+  obj->next = s->free;
+  s->free = obj;
+
+  /* A full slab has a free object again. */
+  if (s->free_cnt++ == 0)
+    list_push_front (&c->slabs, &s->elem);
+
+  /* Keep one wholly free slab at the back of the list and give
+     any others back to the page allocator. */
+  if (s->free_cnt == c->objs_per_slab)
+    {
+      list_remove (&s->elem);
+      if (c->empty_cnt > 0)
+        palloc_free_page (s);
+      else
+        {
+          list_push_back (&c->slabs, &s->elem);
+          c->empty_cnt++;
+        }
+    }
+  lock_release (&c->lock);
+}
+
+/* Adds a new, wholly free slab to the back of C's list and
+   returns it, or returns a null pointer if no page is available.
+   C's lock must be held. */
+static struct slab *
+new_slab (struct kmem_cache *c)
+{
+  struct slab *s;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+
+  s = palloc_get_page (0);
+  if (s == NULL)
+    return NULL;
+
+  s->magic = SLAB_MAGIC;
+  s->cache = c;
+  s->free = NULL;
+  for (i = c->objs_per_slab; i-- > 0; )
+    {
+      struct free_obj *obj
+        = (struct free_obj *) ((uint8_t *) s + SLAB_HEADER + i * c->obj_size);
+      obj->next = s->free;
+      s->free = obj;
+    }
+  s->free_cnt = c->objs_per_slab;
+  list_push_back (&c->slabs, &s->elem);
+  c->empty_cnt++;
+  return s;
+}
+
+/* Returns the slab that object P, from cache C, is inside. */
+static struct slab *
+obj_to_slab (struct kmem_cache *c, void *p)
+{
+  struct slab *s = pg_round_down (p);
+
+  /* Check that the slab is valid and belongs to C. */
+  ASSERT (s->magic == SLAB_MAGIC);
+  ASSERT (s->cache == c);
+
+  /* Check that the object is properly aligned for the slab. */
+  ASSERT (pg_ofs (p) >= SLAB_HEADER);
+  ASSERT ((pg_ofs (p) - SLAB_HEADER) % c->obj_size == 0);
+
+  return s;
+}
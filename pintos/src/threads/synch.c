@@ -29,8 +29,30 @@
 #include "threads/synch.h"
 #include <stdio.h>
 #include <string.h>
+#include "devices/timer.h"
 #include "threads/interrupt.h"
 #include "threads/thread.h"
+#include "threads/trace.h"
+
+/* If true, named locks keep contention statistics. */
+bool lock_profiling;
+
+/* Contention statistics for the locks sharing one name. */
+struct lock_profile
+  {
+    const char *name;           /* Name given to lock_set_name(). */
+    unsigned acquires;          /* Times acquired. */
+    unsigned contended;         /* Acquires that had to wait. */
+    int64_t wait_ticks;         /* Total ticks spent waiting. */
+    int64_t max_hold_ticks;     /* Longest time held. */
+    int64_t acquired_at;        /* Tick of the latest acquire. */
+  };
+
+/* Profiles handed out by lock_set_name().  Locks are set up
+   before malloc() is, so these are allocated statically. */
+#define LOCK_PROFILE_CNT 64
+static struct lock_profile profiles[LOCK_PROFILE_CNT];
+static size_t profile_cnt;
 
 /* Initializes semaphore SEMA to VALUE.  A semaphore is a
    nonnegative integer along with two atomic operators for
@@ -66,6 +88,7 @@ sema_down (struct semaphore *sema)
   ASSERT (!intr_context ());
 
   old_level = intr_disable ();
+  trace (TRACE_SEMA_DOWN, (uint32_t) sema, sema->value);
   while (sema->value == 0)
     {
       list_push_back (&sema->waiters, &thread_current ()->elem);
@@ -101,8 +124,20 @@ sema_try_down (struct semaphore *sema)
   return success;
 }
 
+/* Orders threads on a semaphore's wait list by priority. */
+static bool
+priority_less (const struct list_elem *a_, const struct list_elem *b_,
+               void *aux UNUSED)
+{
+  const struct thread *a = list_entry (a_, struct thread, elem);
+  const struct thread *b = list_entry (b_, struct thread, elem);
+
+  return a->priority < b->priority;
+}
+
 /* Up or "V" operation on a semaphore.  Increments SEMA's value
-   and wakes up one thread of those waiting for SEMA, if any.
+   and wakes up the highest-priority thread of those waiting for
+   SEMA, if any, preempting the caller if that thread outranks it.
 
    This function may be called from an interrupt handler. */
 void
@@ -113,11 +148,17 @@ sema_up (struct semaphore *sema)
   ASSERT (sema != NULL);
 
   old_level = intr_disable ();
+  trace (TRACE_SEMA_UP, (uint32_t) sema, !list_empty (&sema->waiters));
   if (!list_empty (&sema->waiters))
-    thread_unblock (list_entry (list_pop_front (&sema->waiters),
-                                struct thread, elem));
+    {
+      struct list_elem *e = list_max (&sema->waiters, priority_less, NULL);
+      list_remove (e);
+      thread_unblock (list_entry (e, struct thread, elem));
+    }
   sema->value++;
   intr_set_level (old_level);
+
+  thread_check_preempt ();
 }
 
 static void sema_test_helper (void *sema_);
@@ -178,9 +219,80 @@ lock_init (struct lock *lock)
   ASSERT (lock != NULL);
 
   lock->holder = NULL;
+  lock->profile = NULL;
+  lock->adaptive = false;
   sema_init (&lock->semaphore, 1);
 }
 
+/* Initializes LOCK as an adaptive lock, for short critical
+   sections.  A thread that finds an adaptive lock held by a
+   runnable thread first lets the holder run, up to
+   LOCK_SPIN_TRIES times, and blocks only if the lock is still
+   held after that or the holder itself blocks.  This saves
+   sleeping on the semaphore and being woken again when the
+   holder only needs a moment to finish. */
+void
+lock_init_adaptive (struct lock *lock)
+{
+  lock_init (lock);
+  lock->adaptive = true;
+}
+
+/* Names LOCK for the lock profiler and starts keeping contention
+   statistics for it, if profiling is enabled.  Locks given the
+   same name share statistics, so a lock that is reinitialized
+   keeps counting where it left off.  NAME must remain valid
+   until shutdown. */
+void
+lock_set_name (struct lock *lock, const char *name)
+{
+  enum intr_level old_level;
+  size_t i;
+
+  ASSERT (lock != NULL);
+  ASSERT (name != NULL);
+
+  if (!lock_profiling)
+    return;
+
+  old_level = intr_disable ();
+  for (i = 0; i < profile_cnt; i++)
+    if (!strcmp (profiles[i].name, name))
+      break;
+  if (i == profile_cnt && profile_cnt < LOCK_PROFILE_CNT)
+    profiles[profile_cnt++].name = name;
+  if (i < profile_cnt)
+    lock->profile = &profiles[i];
+  intr_set_level (old_level);
+}
+
+/* Prints the contention statistics of every named lock, most
+   time spent waiting first. */
+void
+lock_print_stats (void)
+{
+  struct lock_profile *sorted[LOCK_PROFILE_CNT];
+  size_t i, j;
+
+  if (!lock_profiling)
+    return;
+
+  for (i = 0; i < profile_cnt; i++)
+    {
+      for (j = i; j > 0 && sorted[j - 1]->wait_ticks < profiles[i].wait_ticks;
+           j--)
+        sorted[j] = sorted[j - 1];
+      sorted[j] = &profiles[i];
+    }
+
+  printf ("Locks: %zu profiled\n", profile_cnt);
+  for (i = 0; i < profile_cnt; i++)
+    printf ("Lock %s: %u acquires, %u contended, %lld wait ticks, "
+            "%lld max hold ticks\n",
+            sorted[i]->name, sorted[i]->acquires, sorted[i]->contended,
+            sorted[i]->wait_ticks, sorted[i]->max_hold_ticks);
+}
+
 /* Acquires LOCK, sleeping until it becomes available if
    necessary.  The lock must not already be held by the current
    thread.
@@ -192,12 +304,74 @@ lock_init (struct lock *lock)
 void
 lock_acquire (struct lock *lock)
 {
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+  int64_t start = 0;
+  bool contended;
+
   ASSERT (lock != NULL);
   ASSERT (!intr_context ());
   ASSERT (!lock_held_by_current_thread (lock));
 
+  old_level = intr_disable ();
+  contended = lock->holder != NULL;
+  if (lock->profile != NULL)
+    start = timer_ticks ();
+  if (lock->holder != NULL && !thread_mlfqs)
+    {
+      /* Lend our priority to the holder, and on down the chain of
+         holders that are themselves waiting on locks. */
+      struct lock *l = lock;
+      int depth;
+
+      cur->waiting_lock = lock;
+      for (depth = 0; depth < LOCK_DONATE_DEPTH && l != NULL
+             && l->holder != NULL; depth++)
+        {
+          thread_donate_priority (l->holder, cur->priority);
+          l = l->holder->waiting_lock;
+        }
+    }
+
+  /* Give a runnable holder of an adaptive lock the chance to
+     release it before we block.  Only possible if the caller had
+     interrupts on, because we must yield the CPU. */
+  if (lock->adaptive && old_level == INTR_ON)
+    {
+      int tries;
+
+      for (tries = 0; tries < LOCK_SPIN_TRIES && lock->holder != NULL;
+           tries++)
+        {
+          enum thread_status status = lock->holder->status;
+
+          if (status != THREAD_READY && status != THREAD_RUNNING)
+            break;
+          intr_set_level (old_level);
+          if (status == THREAD_READY)
+            thread_yield ();
+          else
+            asm volatile ("pause");
+          intr_disable ();
+        }
+    }
+
   sema_down (&lock->semaphore);
-  lock->holder = thread_current ();
+  cur->waiting_lock = NULL;
+  lock->holder = cur;
+  list_push_back (&cur->locks_held, &lock->elem);
+  if (lock->profile != NULL)
+    {
+      struct lock_profile *p = lock->profile;
+      p->acquired_at = timer_ticks ();
+      p->acquires++;
+      if (contended)
+        {
+          p->contended++;
+          p->wait_ticks += p->acquired_at - start;
+        }
+    }
+  intr_set_level (old_level);
 }
 
 /* Tries to acquires LOCK and returns true if successful or false
@@ -209,14 +383,25 @@ lock_acquire (struct lock *lock)
 bool
 lock_try_acquire (struct lock *lock)
 {
+  enum intr_level old_level;
   bool success;
 
   ASSERT (lock != NULL);
   ASSERT (!lock_held_by_current_thread (lock));
 
+  old_level = intr_disable ();
   success = sema_try_down (&lock->semaphore);
   if (success)
-    lock->holder = thread_current ();
+    {
+      lock->holder = thread_current ();
+      list_push_back (&thread_current ()->locks_held, &lock->elem);
+      if (lock->profile != NULL)
+        {
+          lock->profile->acquired_at = timer_ticks ();
+          lock->profile->acquires++;
+        }
+    }
+  intr_set_level (old_level);
   return success;
 }
 
@@ -228,11 +413,27 @@ lock_try_acquire (struct lock *lock)
 void
 lock_release (struct lock *lock)
 {
+  enum intr_level old_level;
+
   ASSERT (lock != NULL);
   ASSERT (lock_held_by_current_thread (lock));
 
+  /* Give back whatever priority the waiters on LOCK lent us. */
+  old_level = intr_disable ();
+  if (lock->profile != NULL)
+    {
+      struct lock_profile *p = lock->profile;
+      int64_t held = timer_ticks () - p->acquired_at;
+      if (held > p->max_hold_ticks)
+        p->max_hold_ticks = held;
+    }
+  list_remove (&lock->elem);
   lock->holder = NULL;
+  thread_refresh_priority (thread_current ());
   sema_up (&lock->semaphore);
+  intr_set_level (old_level);
+
+  thread_check_preempt ();
 }
 
 /* Returns true if the current thread holds LOCK, false
@@ -251,8 +452,22 @@ struct semaphore_elem
   {
     struct list_elem elem;              /* List element. */
     struct semaphore semaphore;         /* This semaphore. */
+    struct thread *thread;              /* Thread waiting on it. */
   };
 
+/* Orders cond_wait() waiters by the priority of their threads. */
+static bool
+waiter_priority_less (const struct list_elem *a_,
+                      const struct list_elem *b_, void *aux UNUSED)
+{
+  const struct semaphore_elem *a
+    = list_entry (a_, struct semaphore_elem, elem);
+  const struct semaphore_elem *b
+    = list_entry (b_, struct semaphore_elem, elem);
+
+  return a->thread->priority < b->thread->priority;
+}
+
 /* Initializes condition variable COND.  A condition variable
    allows one piece of code to signal a condition and cooperating
    code to receive the signal and act upon it. */
@@ -295,6 +510,7 @@ cond_wait (struct condition *cond, struct lock *lock)
   ASSERT (lock_held_by_current_thread (lock));
 
   sema_init (&waiter.semaphore, 0);
+  waiter.thread = thread_current ();
   list_push_back (&cond->waiters, &waiter.elem);
   lock_release (lock);
   sema_down (&waiter.semaphore);
@@ -302,7 +518,8 @@ cond_wait (struct condition *cond, struct lock *lock)
 }
 
 /* If any threads are waiting on COND (protected by LOCK), then
-   this function signals one of them to wake up from its wait.
+   this function signals the highest-priority one to wake up from
+   its wait.
    LOCK must be held before calling this function.
 
    An interrupt handler cannot acquire a lock, so it does not
@@ -317,8 +534,12 @@ cond_signal (struct condition *cond, struct lock *lock UNUSED)
   ASSERT (lock_held_by_current_thread (lock));
 
   if (!list_empty (&cond->waiters))
-    sema_up (&list_entry (list_pop_front (&cond->waiters),
-                          struct semaphore_elem, elem)->semaphore);
+    {
+      struct list_elem *e = list_max (&cond->waiters,
+                                      waiter_priority_less, NULL);
+      list_remove (e);
+      sema_up (&list_entry (e, struct semaphore_elem, elem)->semaphore);
+    }
 }
 
 /* Wakes up all threads, if any, waiting on COND (protected by
@@ -336,3 +557,162 @@ cond_broadcast (struct condition *cond, struct lock *lock)
   while (!list_empty (&cond->waiters))
     cond_signal (cond, lock);
 }
+
+/* Initializes readers-writer lock RW, which starts out held by
+   no one. */
+void
+rw_lock_init (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+
+  lock_init (&rw->lock);
+  cond_init (&rw->readers_ok);
+  cond_init (&rw->writer_ok);
+  rw->readers = 0;
+  rw->waiting_writers = 0;
+  rw->writer = NULL;
+}
+
+/* Acquires RW for reading, sleeping while a writer holds it or
+   is waiting for it.  The current thread must not already hold
+   RW for writing.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rw_lock_acquire_read (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rw_lock_held_for_write (rw));
+
+  lock_acquire (&rw->lock);
+  while (rw->writer != NULL || rw->waiting_writers > 0)
+    cond_wait (&rw->readers_ok, &rw->lock);
+  rw->readers++;
+  lock_release (&rw->lock);
+}
+
+/* Tries to acquire RW for reading and returns true if successful
+   or false if a writer holds it or is waiting for it.  Never
+   waits for the lock's holders, but may briefly sleep on the
+   lock's internal state, so it must not be called within an
+   interrupt handler. */
+bool
+rw_lock_try_acquire_read (struct rw_lock *rw)
+{
+  bool success;
+
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rw_lock_held_for_write (rw));
+
+  lock_acquire (&rw->lock);
+  success = rw->writer == NULL && rw->waiting_writers == 0;
+  if (success)
+    rw->readers++;
+  lock_release (&rw->lock);
+  return success;
+}
+
+/* Releases RW, which the current thread must hold for reading.
+   The last reader out lets a waiting writer in. */
+void
+rw_lock_release_read (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+
+  lock_acquire (&rw->lock);
+  ASSERT (rw->readers > 0);
+  if (--rw->readers == 0)
+    cond_signal (&rw->writer_ok, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Acquires RW for writing, sleeping until no other thread holds
+   it.  The current thread must not already hold RW.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rw_lock_acquire_write (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rw_lock_held_for_write (rw));
+
+  lock_acquire (&rw->lock);
+  rw->waiting_writers++;
+  while (rw->writer != NULL || rw->readers > 0)
+    cond_wait (&rw->writer_ok, &rw->lock);
+  rw->waiting_writers--;
+  rw->writer = thread_current ();
+  lock_release (&rw->lock);
+}
+
+/* Tries to acquire RW for writing and returns true if successful
+   or false if any other thread holds it.  Like
+   rw_lock_try_acquire_read(), never waits for the lock's
+   holders. */
+bool
+rw_lock_try_acquire_write (struct rw_lock *rw)
+{
+  bool success;
+
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (!rw_lock_held_for_write (rw));
+
+  lock_acquire (&rw->lock);
+  success = rw->writer == NULL && rw->readers == 0;
+  if (success)
+    rw->writer = thread_current ();
+  lock_release (&rw->lock);
+  return success;
+}
+
+/* Releases RW, which the current thread must hold for writing.
+   Waiting writers go first; otherwise all waiting readers are
+   let in together. */
+void
+rw_lock_release_write (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (rw_lock_held_for_write (rw));
+
+  lock_acquire (&rw->lock);
+  rw->writer = NULL;
+  if (rw->waiting_writers > 0)
+    cond_signal (&rw->writer_ok, &rw->lock);
+  else
+    cond_broadcast (&rw->readers_ok, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Converts the current thread's write hold on RW into a read
+   hold, without letting any writer in between.  Other readers
+   are admitted only if no writer is waiting. */
+void
+rw_lock_downgrade (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (rw_lock_held_for_write (rw));
+
+  lock_acquire (&rw->lock);
+  rw->writer = NULL;
+  rw->readers = 1;
+  if (rw->waiting_writers == 0)
+    cond_broadcast (&rw->readers_ok, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Returns true if the current thread holds RW for writing, false
+   otherwise.  (There is no matching test for readers, which are
+   not tracked individually.) */
+bool
+rw_lock_held_for_write (const struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+
+  return rw->writer == thread_current ();
+}
@@ -20,15 +20,34 @@ void sema_self_test (void);
 /* Lock. */
 struct lock
   {
-    struct thread *holder;      /* Thread holding lock (for debugging). */
+    struct thread *holder;      /* Thread holding lock. */
     struct semaphore semaphore; /* Binary semaphore controlling access. */
+    struct list_elem elem;      /* Element in holder's list of held locks. */
+    struct lock_profile *profile; /* Contention statistics, or NULL. */
+    bool adaptive;              /* Wait for a runnable holder before blocking? */
   };
 
+/* If true, locks given a name with lock_set_name() keep
+   contention statistics.  Set by kernel command-line option
+   "-lockprof". */
+extern bool lock_profiling;
+
+/* Greatest number of lock holders a priority donation is passed
+   along, through threads that are themselves waiting on locks. */
+#define LOCK_DONATE_DEPTH 8
+
+/* Greatest number of times an adaptive lock lets a runnable
+   holder run before giving up and blocking. */
+#define LOCK_SPIN_TRIES 4
+
 void lock_init (struct lock *);
+void lock_init_adaptive (struct lock *);
 void lock_acquire (struct lock *);
 bool lock_try_acquire (struct lock *);
 void lock_release (struct lock *);
 bool lock_held_by_current_thread (const struct lock *);
+void lock_set_name (struct lock *, const char *name);
+void lock_print_stats (void);
 
 /* Condition variable. */
 struct condition
@@ -41,6 +60,30 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Readers-writer lock.  Any number of readers may hold it at
+   once, or a single writer.  Waiting writers are preferred over
+   new readers, so a steady stream of readers cannot starve a
+   writer. */
+struct rw_lock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition readers_ok;  /* Signaled when readers may enter. */
+    struct condition writer_ok;   /* Signaled when a writer may enter. */
+    unsigned readers;           /* Number of threads reading. */
+    unsigned waiting_writers;   /* Number of threads waiting to write. */
+    struct thread *writer;      /* Thread writing, or NULL. */
+  };
+
+void rw_lock_init (struct rw_lock *);
+void rw_lock_acquire_read (struct rw_lock *);
+bool rw_lock_try_acquire_read (struct rw_lock *);
+void rw_lock_release_read (struct rw_lock *);
+void rw_lock_acquire_write (struct rw_lock *);
+bool rw_lock_try_acquire_write (struct rw_lock *);
+void rw_lock_release_write (struct rw_lock *);
+void rw_lock_downgrade (struct rw_lock *);
+bool rw_lock_held_for_write (const struct rw_lock *);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
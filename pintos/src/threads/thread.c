@@ -4,12 +4,16 @@
 #include <random.h>
 #include <stdio.h>
 #include <string.h>
+#include "devices/timer.h"
 #include "threads/flags.h"
 #include "threads/interrupt.h"
 #include "threads/intr-stubs.h"
 #include "threads/palloc.h"
+#include "threads/profile.h"
+#include "threads/slab.h"
 #include "threads/switch.h"
 #include "threads/synch.h"
+#include "threads/trace.h"
 #include "threads/vaddr.h"
 #ifdef USERPROG
 #include "userprog/process.h"
@@ -22,23 +26,96 @@
    of thread.h for details. */
 #define THREAD_MAGIC 0xcd6abf4b
 
-/* List of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-static struct list ready_list;
+/* Number of words in a ready mask: bit P of word P / 32 is set
+   if the ready list for priority P is nonempty. */
+#define READY_WORDS ((PRI_MAX + 32) / 32)
+
+/* Number of exited threads' pages each processor keeps for
+   thread_create() to reuse. */
+#define THREAD_PAGE_CACHE 8
+
+/* Per-processor scheduler state.
+
+   Everything the scheduler keeps for the processor it runs on
+   lives here rather than in globals, so that each processor
+   could have its own run queue, idle thread and statistics.
+
+   This is preparation only: Pintos does not run on more than one
+   processor.  Nothing starts the application processors through
+   the local APIC, there are no spinlocks and no inter-processor
+   interrupts, and the scheduler, synch.c, palloc and the rest of
+   the kernel rely on turning interrupts off for mutual exclusion,
+   which only excludes the processor that does it.  So there is
+   exactly one such structure, the boot processor's, and
+   this_cpu() always returns it. */
+struct cpu
+  {
+    int id;                     /* Processor number. */
+    struct thread *idle_thread; /* Runs when nothing else is ready. */
+
+    /* Lists of processes in THREAD_READY state, that is,
+       processes that are ready to run but not actually running,
+       one list per priority. */
+    struct list ready_lists[PRI_MAX + 1];
+    uint32_t ready_mask[READY_WORDS];   /* Nonempty ready lists. */
+    int ready_cnt;              /* Number of threads on ready lists. */
+
+    /* Ready real-time threads with budget left, earliest deadline
+       first.  These run ahead of everything on READY_LISTS.
+       Counted in READY_CNT too. */
+    struct list rt_ready;
+
+    unsigned thread_ticks;      /* # of timer ticks since last yield. */
+
+    /* Pages of exited threads, reused by thread_create() without
+       a trip through palloc. */
+    void *free_pages[THREAD_PAGE_CACHE];
+    int free_page_cnt;          /* Number of pages in FREE_PAGES. */
+
+    /* Statistics. */
+    long long idle_ticks;       /* # of timer ticks spent idle. */
+    long long kernel_ticks;     /* # of timer ticks in kernel threads. */
+    long long user_ticks;       /* # of timer ticks in user programs. */
+    struct profile_buf profile; /* Samples taken under -profile. */
+  };
+
+/* Processors.  Only the boot processor, cpus[0], exists, but the
+   scheduler is written against all of them: a processor with
+   nothing to run takes work from the others' run queues.  With
+   CPU_MAX at 1 there are no others, so that never happens. */
+#define CPU_MAX 1
+static struct cpu cpus[CPU_MAX];
+
+/* How often, in timer ticks, a processor evens out its run queue
+   against the busiest one. */
+#define REBALANCE_TICKS 20
+
+/* System-wide histograms of how long threads waited on the run
+   queue and how long they stayed blocked. */
+static unsigned ready_hist[SCHED_HIST_BUCKETS];
+static unsigned blocked_hist[SCHED_HIST_BUCKETS];
+
+/* System load average, for -mlfqs: an exponentially weighted
+   moving average of the number of threads ready to run. */
+static fixed_point_t load_avg;
+
+/* Every real-time thread, for thread_tick() to start their new
+   periods. */
+static struct list rt_threads;
 
 /* List of all processes.  Processes are added to this list
    when they are first scheduled and removed when they exit. */
 static struct list all_list;
 
-/* Idle thread. */
-static struct thread *idle_thread;
-
 /* Initial thread, the thread running init.c:main(). */
 static struct thread *initial_thread;
 
 /* Lock used by allocate_tid(). */
 static struct lock tid_lock;
 
+/* Allocator for `struct child_data'. */
+static struct kmem_cache *child_data_cache;
+
 /* Stack frame for kernel_thread(). */
 struct kernel_thread_frame
   {
@@ -47,14 +124,8 @@ struct kernel_thread_frame
     void *aux;                  /* Auxiliary data for function. */
   };
 
-/* Statistics. */
-static long long idle_ticks;    /* # of timer ticks spent idle. */
-static long long kernel_ticks;  /* # of timer ticks in kernel threads. */
-static long long user_ticks;    /* # of timer ticks in user programs. */
-
 /* Scheduling. */
 #define TIME_SLICE 4            /* # of timer ticks to give each thread. */
-static unsigned thread_ticks;   /* # of timer ticks since last yield. */
 
 /* If false (default), use round-robin scheduler.
    If true, use multi-level feedback queue scheduler.
@@ -64,14 +135,40 @@ bool thread_mlfqs;
 static void kernel_thread (thread_func *, void *aux);
 
 static void idle (void *aux UNUSED);
+static struct cpu *this_cpu (void);
 static struct thread *running_thread (void);
 static struct thread *next_thread_to_run (void);
 static void init_thread (struct thread *, const char *name, int priority);
+static void *thread_page_get (void);
+static void thread_page_put (void *);
+static void ready_push (struct thread *);
+static void ready_insert (struct cpu *, struct thread *);
+static void ready_remove (struct thread *);
+static struct thread *ready_steal (struct cpu *);
+static struct thread *ready_steal_from (struct cpu *);
+static struct cpu *busiest_cpu (struct cpu *, int min);
+static void ready_rebalance (struct cpu *);
+static int ready_total (void);
+static void set_effective_priority (struct thread *, int priority);
+static void mlfqs_update_priority (struct thread *, void *aux);
+static void hist_add (unsigned hist[], int64_t ticks);
+static void print_hist (const char *name, const unsigned hist[]);
+static void mlfqs_update_recent_cpu (struct thread *, void *aux);
+static int ready_max_priority (void);
 static bool is_thread (struct thread *) UNUSED;
 static void *alloc_frame (struct thread *, size_t size);
 static void schedule (void);
 void thread_schedule_tail (struct thread *prev);
 static tid_t allocate_tid (void);
+static tid_t create_thread (const char *name, int priority,
+                            int64_t period, int64_t budget,
+                            thread_func *, void *aux);
+static bool rt_active (const struct thread *);
+static bool deadline_less (const struct list_elem *,
+                           const struct list_elem *, void *aux);
+static void rt_new_period (struct thread *, int64_t now);
+static bool rt_replenish (void);
+static bool ready_preempts (struct thread *);
 
 /* Initializes the threading system by transforming the code
    that's currently running into a thread.  This can't work in
@@ -89,10 +186,21 @@ static tid_t allocate_tid (void);
 void
 thread_init (void)
 {
+  int i;
+
   ASSERT (intr_get_level () == INTR_OFF);
 
   lock_init (&tid_lock);
-  list_init (&ready_list);
+  for (i = 0; i < CPU_MAX; i++)
+    {
+      int pri;
+
+      cpus[i].id = i;
+      for (pri = 0; pri <= PRI_MAX; pri++)
+        list_init (&cpus[i].ready_lists[pri]);
+      list_init (&cpus[i].rt_ready);
+    }
+  list_init (&rt_threads);
   list_init (&all_list);
 
   /* Set up a thread structure for the running thread. */
@@ -108,8 +216,17 @@ thread_init (void)
 void
 thread_start (void)
 {
-  /* Create the idle thread. */
+  /* Create the idle thread.  malloc() is up by now, so the
+     child data cache can be made first. */
   struct semaphore idle_started;
+  int i;
+
+  for (i = 0; i < CPU_MAX; i++)
+    profile_init (&cpus[i].profile);
+  child_data_cache = kmem_cache_create ("child-data",
+                                        sizeof (struct child_data), NULL);
+  if (child_data_cache == NULL)
+    PANIC ("child data cache creation failed");
   sema_init (&idle_started, 0);
   thread_create ("idle", PRI_MIN, idle, &idle_started);
 
@@ -120,25 +237,79 @@ thread_start (void)
   sema_down (&idle_started);
 }
 
-/* Called by the timer interrupt handler at each timer tick.
-   Thus, this function runs in an external interrupt context. */
+/* Called by the timer interrupt handler at each timer tick,
+   with F the frame of the code it interrupted.  Thus, this
+   function runs in an external interrupt context. */
 void
-thread_tick (void)
+thread_tick (struct intr_frame *f)
 {
+  struct cpu *c = this_cpu ();
   struct thread *t = thread_current ();
 
+  profile_record (&c->profile, f);
+
   /* Update statistics. */
-  if (t == idle_thread)
-    idle_ticks++;
+  if (t == c->idle_thread)
+    c->idle_ticks++;
 #ifdef USERPROG
   else if (t->pagedir != NULL)
-    user_ticks++;
+    c->user_ticks++;
 #endif
   else
-    kernel_ticks++;
+    c->kernel_ticks++;
+  if (t != c->idle_thread)
+    {
+      /* The low bits of CS are the interrupted code's privilege
+         level, 3 for user code. */
+      if ((f->cs & 3) == 3)
+        thread_usage (t)->user_ticks++;
+      else
+        thread_usage (t)->system_ticks++;
+    }
+
+  /* Charge the tick to a real-time thread's budget, dropping it to
+     its ordinary priority once the budget is spent, and start new
+     periods for real-time threads whose deadlines have passed. */
+  if (rt_active (t) && ++t->rt_used >= t->rt_budget)
+    {
+      t->rt_throttled = true;
+      t->rt_throttle_cnt++;
+      intr_yield_on_return ();
+    }
+  if (rt_replenish ())
+    thread_check_preempt ();
+
+  if (thread_mlfqs)
+    {
+      int64_t now = timer_ticks ();
+
+      if (t != c->idle_thread)
+        t->recent_cpu = fix_add (t->recent_cpu, fix_int (1));
+
+      /* Once a second, age everyone's recent_cpu and recompute
+         every priority.  Otherwise only the running thread's
+         recent_cpu has changed, so it is the only priority that
+         needs recomputing. */
+      if (now % TIMER_FREQ == 0)
+        {
+          int ready = ready_total () + (t != c->idle_thread);
+          load_avg = fix_add (fix_mul (fix_frac (59, 60), load_avg),
+                              fix_scale (fix_frac (1, 60), ready));
+          thread_foreach (mlfqs_update_recent_cpu, NULL);
+          thread_foreach (mlfqs_update_priority, NULL);
+        }
+      else if (now % 4 == 0)
+        mlfqs_update_priority (t, NULL);
+
+      thread_check_preempt ();
+    }
+
+  /* Move work over from a busier processor now and then. */
+  if (CPU_MAX > 1 && timer_ticks () % REBALANCE_TICKS == 0)
+    ready_rebalance (c);
 
   /* Enforce preemption. */
-  if (++thread_ticks >= TIME_SLICE)
+  if (++c->thread_ticks >= TIME_SLICE)
     intr_yield_on_return ();
 }
 
@@ -146,8 +317,86 @@ thread_tick (void)
 void
 thread_print_stats (void)
 {
+  struct cpu *c = this_cpu ();
+  struct list_elem *e;
+
   printf ("Thread: %lld idle ticks, %lld kernel ticks, %lld user ticks\n",
-          idle_ticks, kernel_ticks, user_ticks);
+          c->idle_ticks, c->kernel_ticks, c->user_ticks);
+  print_hist ("ready wait", ready_hist);
+  print_hist ("blocked", blocked_hist);
+  for (e = list_begin (&rt_threads); e != list_end (&rt_threads);
+       e = list_next (e))
+    {
+      struct thread *t = list_entry (e, struct thread, rt_elem);
+      printf ("Thread: real-time %s: period %lld, budget %lld, "
+              "%u periods throttled\n", t->name, t->rt_period,
+              t->rt_budget, t->rt_throttle_cnt);
+    }
+  profile_dump (&c->profile, c->id);
+}
+
+/* Fills in STATS with the running thread's scheduler counters
+   and the system-wide latency histograms. */
+void
+thread_get_sched_stats (struct sched_stats *stats)
+{
+  struct thread *cur = thread_current ();
+  enum intr_level old_level = intr_disable ();
+
+  /* Count the current run, which schedule() has not seen yet. */
+  stats->run_ticks = cur->run_ticks + (timer_ticks () - cur->state_since);
+  stats->ready_ticks = cur->ready_ticks;
+  stats->blocked_ticks = cur->blocked_ticks;
+  stats->voluntary_switches = cur->voluntary_switches;
+  stats->involuntary_switches = cur->involuntary_switches;
+  memcpy (stats->ready_hist, ready_hist, sizeof ready_hist);
+  memcpy (stats->blocked_hist, blocked_hist, sizeof blocked_hist);
+  intr_set_level (old_level);
+}
+
+/* Returns the resource usage that T's use is charged to: that of
+   its process, if T belongs to a user process, so that all of a
+   process's threads add to one total. */
+struct rusage *
+thread_usage (struct thread *t)
+{
+#ifdef USERPROG
+  return &t->process->usage;
+#else
+  return &t->usage;
+#endif
+}
+
+/* Counts an interval of TICKS ticks in histogram HIST. */
+static void
+hist_add (unsigned hist[], int64_t ticks)
+{
+  int b = 0;
+
+  while (ticks > 0 && b < SCHED_HIST_BUCKETS - 1)
+    {
+      ticks >>= 1;
+      b++;
+    }
+  hist[b]++;
+}
+
+/* Prints the nonempty buckets of histogram HIST, labeled NAME. */
+static void
+print_hist (const char *name, const unsigned hist[])
+{
+  int b;
+
+  printf ("Thread: %s ticks:", name);
+  for (b = 0; b < SCHED_HIST_BUCKETS; b++)
+    if (hist[b] != 0)
+      {
+        if (b == 0)
+          printf (" [0]=%u", hist[b]);
+        else
+          printf (" [%d,%d)=%u", 1 << (b - 1), 1 << b, hist[b]);
+      }
+  printf ("\n");
 }
 
 /* Creates a new kernel thread named NAME with the given initial
@@ -162,12 +411,42 @@ thread_print_stats (void)
    scheduled.  Use a semaphore or some other form of
    synchronization if you need to ensure ordering.
 
-   The code provided sets the new thread's `priority' member to
-   PRIORITY, but no actual priority scheduling is implemented.
-   Priority scheduling is the goal of Problem 1-3. */
+   The new thread preempts the caller right away if PRIORITY is
+   higher than the caller's. */
 tid_t
 thread_create (const char *name, int priority,
                thread_func *function, void *aux)
+{
+  return create_thread (name, priority, 0, 0, function, aux);
+}
+
+/* Creates a real-time kernel thread named NAME, which executes
+   FUNCTION passing AUX as the argument, as thread_create() does.
+
+   Every PERIOD timer ticks the thread may run for BUDGET of them
+   ahead of all threads of the priority and MLFQS classes, with
+   the real-time thread whose period ends first running first.
+   Once it has run for BUDGET ticks in a period, it runs at
+   PRI_DEFAULT like any other thread until its next period
+   begins, so that a thread that never blocks cannot starve the
+   rest of the system.  Meant for kernel service threads that
+   spend most of their time blocked and need to run promptly when
+   woken. */
+tid_t
+thread_create_rt (const char *name, int64_t period, int64_t budget,
+                  thread_func *function, void *aux)
+{
+  ASSERT (period > 0);
+  ASSERT (budget > 0 && budget <= period);
+
+  return create_thread (name, PRI_DEFAULT, period, budget, function, aux);
+}
+
+/* Creates a thread for thread_create() or, if PERIOD is nonzero,
+   for thread_create_rt(). */
+static tid_t
+create_thread (const char *name, int priority, int64_t period,
+               int64_t budget, thread_func *function, void *aux)
 {
   struct thread *t;
   struct kernel_thread_frame *kf;
@@ -180,7 +459,7 @@ thread_create (const char *name, int priority,
   ASSERT (function != NULL);
 
   /* Allocate thread. */
-  t = palloc_get_page (PAL_ZERO);
+  t = thread_page_get ();
   if (t == NULL)
     return TID_ERROR;
 
@@ -190,11 +469,12 @@ thread_create (const char *name, int priority,
   tid = t->tid = allocate_tid ();
 
   // Part 2 To-Do for Parent Thread
-  cd = (struct child_data*) malloc(sizeof(struct child_data));
+  cd = kmem_cache_alloc (child_data_cache);
   t->data = cd;
   cd->tid = tid;
   cd->ref_cnt = 2;
   cd->load_status = 0;
+  cd->parent = thread_current ();
   sema_init(&cd->loaded, 0);
   sema_init(&cd->terminated, 0);
   
@@ -203,11 +483,6 @@ thread_create (const char *name, int priority,
   list_push_back(&thread_current()->children, &cd->elem);
   intr_set_level (old_level);
 
-  // Part 3 To-Do for Parent Thread
-  old_level = intr_disable ();
-  list_init(&t->file_mappings);
-  intr_set_level (old_level);
-
   /* Stack frame for kernel_thread(). */
   kf = alloc_frame (t, sizeof *kf);
   kf->eip = NULL;
@@ -226,12 +501,29 @@ thread_create (const char *name, int priority,
   // Part 3: file system
   t->cur_dir = thread_current()->cur_dir;
 
+  if (period > 0)
+    {
+      t->rt_period = period;
+      t->rt_budget = budget;
+      t->rt_deadline = timer_ticks () + period;
+      old_level = intr_disable ();
+      list_push_back (&rt_threads, &t->rt_elem);
+      intr_set_level (old_level);
+    }
+
   /* Add to run queue. */
   thread_unblock (t);
 
   return tid;
 }
 
+/* Frees CD, which must have been allocated by thread_create(). */
+void
+thread_free_child_data (struct child_data *cd)
+{
+  kmem_cache_free (child_data_cache, cd);
+}
+
 /* Puts the current thread to sleep.  It will not be scheduled
    again until awoken by thread_unblock().
 
@@ -252,10 +544,12 @@ thread_block (void)
    This is an error if T is not blocked.  (Use thread_yield() to
    make the running thread ready.)
 
-   This function does not preempt the running thread.  This can
-   be important: if the caller had disabled interrupts itself,
-   it may expect that it can atomically unblock a thread and
-   update other data. */
+   If T has higher priority than the running thread, the running
+   thread is preempted, but only once interrupts are on: if the
+   caller had disabled interrupts itself, it may expect that it
+   can atomically unblock a thread and update other data.  From
+   an interrupt handler the switch happens on return from the
+   interrupt. */
 void
 thread_unblock (struct thread *t)
 {
@@ -265,9 +559,44 @@ thread_unblock (struct thread *t)
 
   old_level = intr_disable ();
   ASSERT (t->status == THREAD_BLOCKED);
-  list_push_back (&ready_list, &t->elem);
+  if (t->rt_period > 0 && timer_ticks () >= t->rt_deadline)
+    rt_new_period (t, timer_ticks ());
+  ready_push (t);
   t->status = THREAD_READY;
+  if (t->state_since >= 0)
+    {
+      int64_t now = timer_ticks ();
+      t->blocked_ticks += now - t->state_since;
+      hist_add (blocked_hist, now - t->state_since);
+      t->state_since = now;
+    }
+  else
+    t->state_since = timer_ticks ();
   intr_set_level (old_level);
+
+  thread_check_preempt ();
+}
+
+/* Yields the CPU if a ready thread should run ahead of the
+   running thread: a real-time thread with an earlier deadline,
+   or, if the running thread is not real-time, any real-time
+   thread or a thread of higher priority.  In an interrupt handler, yields on return from
+   the interrupt instead.  Does nothing if interrupts are off in a
+   kernel thread; callers that turn them back on should call this
+   again. */
+void
+thread_check_preempt (void)
+{
+  enum intr_level old_level = intr_disable ();
+  bool preempt = ready_preempts (thread_current ());
+  intr_set_level (old_level);
+
+  if (!preempt)
+    return;
+  if (intr_context ())
+    intr_yield_on_return ();
+  else if (old_level == INTR_ON)
+    thread_yield ();
 }
 
 /* Returns the name of the running thread. */
@@ -319,6 +648,8 @@ thread_exit (void)
      when it calls thread_schedule_tail(). */
   intr_disable ();
   list_remove (&thread_current()->allelem);
+  if (thread_current ()->rt_period > 0)
+    list_remove (&thread_current ()->rt_elem);
   thread_current ()->status = THREAD_DYING;
   schedule ();
   NOT_REACHED ();
@@ -335,8 +666,8 @@ thread_yield (void)
   ASSERT (!intr_context ());
 
   old_level = intr_disable ();
-  if (cur != idle_thread)
-    list_push_back (&ready_list, &cur->elem);
+  if (cur != this_cpu ()->idle_thread)
+    ready_push (cur);
   cur->status = THREAD_READY;
   schedule ();
   intr_set_level (old_level);
@@ -363,7 +694,85 @@ thread_foreach (thread_action_func *func, void *aux)
 void
 thread_set_priority (int new_priority)
 {
-  thread_current ()->priority = new_priority;
+  enum intr_level old_level;
+
+  ASSERT (PRI_MIN <= new_priority && new_priority <= PRI_MAX);
+
+  /* The feedback queue scheduler sets priorities itself. */
+  if (thread_mlfqs)
+    return;
+
+  old_level = intr_disable ();
+  thread_current ()->base_priority = new_priority;
+  thread_refresh_priority (thread_current ());
+  intr_set_level (old_level);
+
+  thread_check_preempt ();
+}
+
+/* Raises T's effective priority to PRIORITY, if that is higher,
+   on behalf of a thread waiting for a lock T holds.  Interrupts
+   must be off. */
+void
+thread_donate_priority (struct thread *t, int priority)
+{
+  ASSERT (is_thread (t));
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (priority > t->priority)
+    set_effective_priority (t, priority);
+}
+
+/* Recomputes T's effective priority from its base priority and
+   the threads still waiting on the locks it holds.  Interrupts
+   must be off. */
+void
+thread_refresh_priority (struct thread *t)
+{
+  int priority = t->base_priority;
+  struct list_elem *e, *w;
+
+  ASSERT (is_thread (t));
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  /* There are no donations under -mlfqs. */
+  if (thread_mlfqs)
+    return;
+
+  for (e = list_begin (&t->locks_held); e != list_end (&t->locks_held);
+       e = list_next (e))
+    {
+      struct lock *lock = list_entry (e, struct lock, elem);
+      struct list *waiters = &lock->semaphore.waiters;
+
+      for (w = list_begin (waiters); w != list_end (waiters);
+           w = list_next (w))
+        {
+          struct thread *waiter = list_entry (w, struct thread, elem);
+          if (waiter->priority > priority)
+            priority = waiter->priority;
+        }
+    }
+
+  if (priority != t->priority)
+    set_effective_priority (t, priority);
+}
+
+/* Sets T's effective priority to PRIORITY, moving T to the right
+   ready list if it is ready to run.  Interrupts must be off. */
+static void
+set_effective_priority (struct thread *t, int priority)
+{
+  if (t->status == THREAD_READY)
+    {
+      struct cpu *c = t->cpu;
+
+      ready_remove (t);
+      t->priority = priority;
+      ready_insert (c, t);
+    }
+  else
+    t->priority = priority;
 }
 
 /* Returns the current thread's priority. */
@@ -373,35 +782,93 @@ thread_get_priority (void)
   return thread_current ()->priority;
 }
 
-/* Sets the current thread's nice value to NICE. */
+/* Sets the current thread's nice value to NICE and recomputes
+   its priority, yielding if it no longer has the highest
+   priority. */
 void
-thread_set_nice (int nice UNUSED)
+thread_set_nice (int nice)
 {
-  /* Not yet implemented. */
+  enum intr_level old_level;
+
+  ASSERT (NICE_MIN <= nice && nice <= NICE_MAX);
+
+  old_level = intr_disable ();
+  thread_current ()->nice = nice;
+  if (thread_mlfqs)
+    mlfqs_update_priority (thread_current (), NULL);
+  intr_set_level (old_level);
+
+  thread_check_preempt ();
 }
 
 /* Returns the current thread's nice value. */
 int
 thread_get_nice (void)
 {
-  /* Not yet implemented. */
-  return 0;
+  return thread_current ()->nice;
 }
 
 /* Returns 100 times the system load average. */
 int
 thread_get_load_avg (void)
 {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable ();
+  int load = fix_round (fix_scale (load_avg, 100));
+  intr_set_level (old_level);
+
+  return load;
 }
 
 /* Returns 100 times the current thread's recent_cpu value. */
 int
 thread_get_recent_cpu (void)
 {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable ();
+  fixed_point_t recent_cpu = thread_current ()->recent_cpu;
+  intr_set_level (old_level);
+
+  return fix_round (fix_mul (recent_cpu, fix_int (100)));
+}
+
+/* Recomputes T's priority from its recent_cpu and nice values,
+   as priority = PRI_MAX - recent_cpu / 4 - nice * 2, clamped to
+   the valid range.  Interrupts must be off. */
+static void
+mlfqs_update_priority (struct thread *t, void *aux UNUSED)
+{
+  int priority;
+
+  if (t == this_cpu ()->idle_thread)
+    return;
+
+  priority = PRI_MAX - fix_trunc (fix_unscale (t->recent_cpu, 4))
+             - t->nice * 2;
+  if (priority < PRI_MIN)
+    priority = PRI_MIN;
+  else if (priority > PRI_MAX)
+    priority = PRI_MAX;
+
+  t->base_priority = priority;
+  if (priority != t->priority)
+    set_effective_priority (t, priority);
+}
+
+/* Decays T's recent_cpu by the load average, as
+   recent_cpu = (2 * load_avg) / (2 * load_avg + 1) * recent_cpu
+                + nice.
+   Interrupts must be off. */
+static void
+mlfqs_update_recent_cpu (struct thread *t, void *aux UNUSED)
+{
+  fixed_point_t twice_load = fix_scale (load_avg, 2);
+  fixed_point_t decay = fix_div (twice_load,
+                                 fix_add (twice_load, fix_int (1)));
+
+  if (t == this_cpu ()->idle_thread)
+    return;
+
+  t->recent_cpu = fix_add (fix_mul (decay, t->recent_cpu),
+                           fix_int (t->nice));
 }
 
 /* Idle thread.  Executes when no other thread is ready to run.
@@ -417,11 +884,17 @@ static void
 idle (void *idle_started_ UNUSED)
 {
   struct semaphore *idle_started = idle_started_;
-  idle_thread = thread_current ();
+  this_cpu ()->idle_thread = thread_current ();
   sema_up (idle_started);
 
   for (;;)
     {
+      /* Spend idle time zeroing freed pages for palloc.  This
+         runs with interrupts on, so any thread that becomes ready
+         preempts it. */
+      while (palloc_zero_free_page ())
+        continue;
+
       /* Let someone else run. */
       intr_disable ();
       thread_block ();
@@ -438,7 +911,13 @@ idle (void *idle_started_ UNUSED)
 
          See [IA32-v2a] "HLT", [IA32-v2b] "STI", and [IA32-v3a]
          7.11.1 "HLT Instruction". */
+      timer_idle_enter ();
       asm volatile ("sti; hlt" : : : "memory");
+
+      /* Whatever woke us, go back to ticking periodically. */
+      intr_disable ();
+      timer_idle_exit ();
+      intr_enable ();
     }
 }
 
@@ -467,6 +946,13 @@ running_thread (void)
   return pg_round_down (esp);
 }
 
+/* Returns the running processor's scheduler state. */
+static struct cpu *
+this_cpu (void)
+{
+  return &cpus[0];
+}
+
 /* Returns true if T appears to point to a valid thread. */
 static bool
 is_thread (struct thread *t)
@@ -490,6 +976,23 @@ init_thread (struct thread *t, const char *name, int priority)
   strlcpy (t->name, name, sizeof t->name);
   t->stack = (uint8_t *) t + PGSIZE;
   t->priority = priority;
+  t->base_priority = priority;
+  list_init (&t->locks_held);
+  t->waiting_lock = NULL;
+  t->state_since = t == initial_thread ? 0 : -1;
+  if (t == initial_thread)
+    {
+      t->nice = NICE_DEFAULT;
+      t->recent_cpu = fix_int (0);
+    }
+  else
+    {
+      /* Inherit the scheduling state of the creating thread. */
+      t->nice = thread_current ()->nice;
+      t->recent_cpu = thread_current ()->recent_cpu;
+    }
+  if (thread_mlfqs)
+    mlfqs_update_priority (t, NULL);
   t->magic = THREAD_MAGIC;
 
   old_level = intr_disable ();
@@ -499,11 +1002,31 @@ init_thread (struct thread *t, const char *name, int priority)
   // User Program Part 2 Process Control Syscalls Initializations
   list_init(&t->children);
   t->data = NULL;
+  list_init(&t->exited_children);
+  sema_init(&t->child_exited, 0);
   
   // User Program Part 3 File Operation Syscall Initializations
-  list_init(&t->file_mappings);
-  t->last_fd = 1;
-
+  t->fd_table = NULL;
+  t->fd_table_size = 0;
+  t->fd_used = NULL;
+  lock_init (&t->fd_lock);
+
+  t->process = t;
+  t->uthread = NULL;
+  lock_init (&t->uthread_lock);
+  cond_init (&t->uthread_exited);
+  list_init (&t->uthreads);
+  t->uthread_cnt = 0;
+  t->exiting = false;
+  t->aio = NULL;
+
+#ifdef VM
+  lock_init (&t->pages_lock);
+  lock_init (&t->vm_lock);
+  list_init (&t->mmaps);
+  t->next_mapid = 0;
+  t->heap_start = t->heap_brk = NULL;
+#endif
 }
 
 /* Allocates a SIZE-byte frame at the top of thread T's stack and
@@ -522,15 +1045,262 @@ alloc_frame (struct thread *t, size_t size)
 /* Chooses and returns the next thread to be scheduled.  Should
    return a thread from the run queue, unless the run queue is
    empty.  (If the running thread can continue running, then it
-   will be in the run queue.)  If the run queue is empty, return
+   will be in the run queue.)  Real-time threads come first, by
+   deadline.  If the run queue is empty, try to steal a thread
+   from another processor's run queue, and failing that return
    idle_thread. */
 static struct thread *
 next_thread_to_run (void)
 {
-  if (list_empty (&ready_list))
-    return idle_thread;
+  struct cpu *c = this_cpu ();
+  int pri = ready_max_priority ();
+  struct thread *t;
+
+  if (!list_empty (&c->rt_ready))
+    {
+      t = list_entry (list_front (&c->rt_ready), struct thread, elem);
+      ready_remove (t);
+      return t;
+    }
+  if (pri < 0)
+    {
+      t = ready_steal (c);
+      return t != NULL ? t : c->idle_thread;
+    }
+
+  t = list_entry (list_front (&c->ready_lists[pri]), struct thread, elem);
+  ready_remove (t);
+  return t;
+}
+
+/* Adds T to the back of the running processor's ready list for
+   its priority.  Interrupts must be off. */
+static void
+ready_push (struct thread *t)
+{
+  ready_insert (this_cpu (), t);
+}
+
+/* Adds T to the back of C's ready list for its priority, or by
+   deadline to C's real-time ready list if T is a real-time thread
+   with budget left.  Interrupts must be off. */
+static void
+ready_insert (struct cpu *c, struct thread *t)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (rt_active (t))
+    list_insert_ordered (&c->rt_ready, &t->elem, deadline_less, NULL);
   else
-    return list_entry (list_pop_front (&ready_list), struct thread, elem);
+    {
+      list_push_back (&c->ready_lists[t->priority], &t->elem);
+      c->ready_mask[t->priority / 32] |= 1u << (t->priority % 32);
+    }
+  c->ready_cnt++;
+  t->cpu = c;
+}
+
+/* Removes ready thread T from its processor's run queue.
+   Interrupts must be off. */
+static void
+ready_remove (struct thread *t)
+{
+  struct cpu *c = t->cpu;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (c != NULL);
+
+  list_remove (&t->elem);
+  c->ready_cnt--;
+  if (!rt_active (t) && list_empty (&c->ready_lists[t->priority]))
+    c->ready_mask[t->priority / 32] &= ~(1u << (t->priority % 32));
+  t->cpu = NULL;
+}
+
+/* Returns the processor other than C with the most ready
+   threads, or a null pointer if no other processor has more
+   than MIN of them. */
+static struct cpu *
+busiest_cpu (struct cpu *c, int min)
+{
+  struct cpu *busiest = NULL;
+  int i;
+
+  for (i = 0; i < CPU_MAX; i++)
+    if (&cpus[i] != c && cpus[i].ready_cnt > min
+        && (busiest == NULL || cpus[i].ready_cnt > busiest->ready_cnt))
+      busiest = &cpus[i];
+  return busiest;
+}
+
+/* Takes a thread off the run queue of the busiest processor other
+   than C and returns it, or returns a null pointer if every other
+   run queue is empty.  Interrupts must be off. */
+static struct thread *
+ready_steal (struct cpu *c)
+{
+  struct cpu *victim = busiest_cpu (c, 0);
+
+  return victim != NULL ? ready_steal_from (victim) : NULL;
+}
+
+/* Takes the thread at the tail of VICTIM's highest-priority
+   nonempty ready list off VICTIM's run queue and returns it.
+   That thread would have waited longest on VICTIM.  Real-time
+   threads go first, latest deadline first.  VICTIM must have a
+   ready thread.  Interrupts must be off. */
+static struct thread *
+ready_steal_from (struct cpu *victim)
+{
+  struct thread *t;
+  int w;
+
+  if (!list_empty (&victim->rt_ready))
+    {
+      t = list_entry (list_back (&victim->rt_ready), struct thread, elem);
+      ready_remove (t);
+      return t;
+    }
+
+  for (w = READY_WORDS - 1; w >= 0; w--)
+    if (victim->ready_mask[w] != 0)
+      break;
+  ASSERT (w >= 0);
+  t = list_entry (list_back (&victim->ready_lists[w * 32 + 31
+                                     - __builtin_clz (victim->ready_mask[w])]),
+                  struct thread, elem);
+  ready_remove (t);
+  return t;
+}
+
+/* Moves one ready thread to C from the busiest other processor,
+   if that one has at least two more ready threads than C.
+   Interrupts must be off. */
+static void
+ready_rebalance (struct cpu *c)
+{
+  struct cpu *busiest = busiest_cpu (c, c->ready_cnt + 1);
+
+  if (busiest != NULL)
+    ready_insert (c, ready_steal_from (busiest));
+}
+
+/* Returns the number of ready threads on all processors.
+   Interrupts must be off. */
+static int
+ready_total (void)
+{
+  int total = 0;
+  int i;
+
+  for (i = 0; i < CPU_MAX; i++)
+    total += cpus[i].ready_cnt;
+  return total;
+}
+
+/* Returns the highest priority that has a ready thread, or -1 if
+   no thread is ready.  Interrupts must be off. */
+static int
+ready_max_priority (void)
+{
+  struct cpu *c = this_cpu ();
+  int w;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  for (w = READY_WORDS - 1; w >= 0; w--)
+    if (c->ready_mask[w] != 0)
+      return w * 32 + 31 - __builtin_clz (c->ready_mask[w]);
+  return -1;
+}
+
+/* Returns true if the running thread T should give way to a
+   thread on the run queue.  Interrupts must be off. */
+static bool
+ready_preempts (struct thread *t)
+{
+  struct cpu *c = this_cpu ();
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (!list_empty (&c->rt_ready))
+    {
+      struct thread *first = list_entry (list_front (&c->rt_ready),
+                                         struct thread, elem);
+      return !rt_active (t) || first->rt_deadline < t->rt_deadline;
+    }
+  return !rt_active (t) && ready_max_priority () > t->priority;
+}
+
+/* Returns true if T is a real-time thread with budget left in its
+   current period. */
+static bool
+rt_active (const struct thread *t)
+{
+  return t->rt_period > 0 && !t->rt_throttled;
+}
+
+/* Orders threads on a real-time ready list by deadline, earliest
+   first. */
+static bool
+deadline_less (const struct list_elem *a_, const struct list_elem *b_,
+               void *aux UNUSED)
+{
+  const struct thread *a = list_entry (a_, struct thread, elem);
+  const struct thread *b = list_entry (b_, struct thread, elem);
+
+  return a->rt_deadline < b->rt_deadline;
+}
+
+/* Starts real-time thread T's next period, as of tick NOW, which
+   must be at or past its deadline.  T must not be on a run
+   queue, since the period may change the queue it belongs on.
+   A thread that slept through whole periods starts afresh from
+   NOW. */
+static void
+rt_new_period (struct thread *t, int64_t now)
+{
+  ASSERT (t->cpu == NULL);
+
+  t->rt_deadline += t->rt_period;
+  if (t->rt_deadline <= now)
+    t->rt_deadline = now + t->rt_period;
+  t->rt_used = 0;
+  t->rt_throttled = false;
+}
+
+/* Starts a new period for each real-time thread whose deadline
+   has passed, moving it on the run queue if it is ready.  Returns
+   true if any did.  Interrupts must be off. */
+static bool
+rt_replenish (void)
+{
+  int64_t now = timer_ticks ();
+  bool any = false;
+  struct list_elem *e;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  for (e = list_begin (&rt_threads); e != list_end (&rt_threads);
+       e = list_next (e))
+    {
+      struct thread *t = list_entry (e, struct thread, rt_elem);
+
+      if (now < t->rt_deadline)
+        continue;
+      if (t->status == THREAD_READY)
+        {
+          struct cpu *c = t->cpu;
+
+          ready_remove (t);
+          rt_new_period (t, now);
+          ready_insert (c, t);
+        }
+      else
+        rt_new_period (t, now);
+      any = true;
+    }
+  return any;
 }
 
 /* Completes a thread switch by activating the new thread's page
@@ -556,11 +1326,24 @@ thread_schedule_tail (struct thread *prev)
 
   ASSERT (intr_get_level () == INTR_OFF);
 
-  /* Mark us as running. */
+  /* Leaving the idle thread: restart a tick stopped by tickless
+     idle before anything else looks at the time. */
+  if (prev != NULL && prev == this_cpu ()->idle_thread)
+    timer_idle_exit ();
+
+  /* Mark us as running, and charge the time since we became ready
+     to our run queue wait. */
   cur->status = THREAD_RUNNING;
+  if (prev != NULL)
+    {
+      int64_t now = timer_ticks ();
+      cur->ready_ticks += now - cur->state_since;
+      hist_add (ready_hist, now - cur->state_since);
+      cur->state_since = now;
+    }
 
   /* Start new time slice. */
-  thread_ticks = 0;
+  this_cpu ()->thread_ticks = 0;
 
 #ifdef USERPROG
   /* Activate the new address space. */
@@ -575,10 +1358,44 @@ thread_schedule_tail (struct thread *prev)
   if (prev != NULL && prev->status == THREAD_DYING && prev != initial_thread)
     {
       ASSERT (prev != cur);
-      palloc_free_page (prev);
+      thread_page_put (prev);
     }
 }
 
+/* Returns a page to hold a new thread and its stack, one that an
+   exited thread left in the running processor's cache if there
+   is one, or a null pointer if memory runs out.  The page is not
+   zeroed: init_thread() clears the struct thread, and the stack
+   needs nothing. */
+static void *
+thread_page_get (void)
+{
+  enum intr_level old_level = intr_disable ();
+  struct cpu *c = this_cpu ();
+  void *page = NULL;
+
+  if (c->free_page_cnt > 0)
+    page = c->free_pages[--c->free_page_cnt];
+  intr_set_level (old_level);
+  return page != NULL ? page : palloc_get_page (0);
+}
+
+/* Frees PAGE, the page of a thread that has exited, into the
+   running processor's cache, or back to palloc if the cache is
+   full.  Interrupts must be off. */
+static void
+thread_page_put (void *page)
+{
+  struct cpu *c = this_cpu ();
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (c->free_page_cnt < THREAD_PAGE_CACHE)
+    c->free_pages[c->free_page_cnt++] = page;
+  else
+    palloc_free_page (page);
+}
+
 /* Schedules a new process.  At entry, interrupts must be off and
    the running process's state must have been changed from
    running to some other state.  This function finds another
@@ -598,7 +1415,23 @@ schedule (void)
   ASSERT (is_thread (next));
 
   if (cur != next)
-    prev = switch_threads (cur, next);
+    {
+      int64_t now = timer_ticks ();
+      trace (TRACE_SCHEDULE, cur->tid, next->tid);
+      cur->run_ticks += now - cur->state_since;
+      cur->state_since = now;
+      if (cur->status == THREAD_BLOCKED)
+        {
+          cur->voluntary_switches++;
+          thread_usage (cur)->voluntary_switches++;
+        }
+      else if (cur->status == THREAD_READY)
+        {
+          cur->involuntary_switches++;
+          thread_usage (cur)->involuntary_switches++;
+        }
+      prev = switch_threads (cur, next);
+    }
   thread_schedule_tail (prev);
 }
 
@@ -28,6 +28,45 @@ typedef int tid_t;
 #define PRI_DEFAULT 31                  /* Default priority. */
 #define PRI_MAX 63                      /* Highest priority. */
 
+/* Thread nice values, for the multi-level feedback queue scheduler. */
+#define NICE_MIN -20                    /* Nicest to other threads. */
+#define NICE_DEFAULT 0                  /* Default nice value. */
+#define NICE_MAX 20                     /* Least nice to other threads. */
+
+/* Number of buckets in a scheduler latency histogram.  Bucket 0
+   counts intervals shorter than one timer tick, bucket B counts
+   intervals of 2**(B-1) to 2**B - 1 ticks, and the last bucket
+   also takes anything longer. */
+#define SCHED_HIST_BUCKETS 16
+
+/* Scheduler statistics for the calling thread, plus system-wide
+   latency histograms. */
+struct sched_stats
+  {
+    int64_t run_ticks;                  /* Ticks spent running. */
+    int64_t ready_ticks;                /* Ticks spent ready to run. */
+    int64_t blocked_ticks;              /* Ticks spent blocked. */
+    unsigned voluntary_switches;        /* Switches away by blocking. */
+    unsigned involuntary_switches;      /* Switches away while ready. */
+    unsigned ready_hist[SCHED_HIST_BUCKETS];   /* Waits to be scheduled. */
+    unsigned blocked_hist[SCHED_HIST_BUCKETS]; /* Times spent blocked. */
+  };
+
+/* Resources used by a process, for getrusage(). */
+struct rusage
+  {
+    int64_t user_ticks;                 /* Ticks running user code. */
+    int64_t system_ticks;               /* Ticks running in the kernel. */
+    unsigned page_faults;               /* Page faults taken. */
+    unsigned resident_pages;            /* User pages in memory. */
+    uint64_t bytes_read;                /* Bytes read from fds. */
+    uint64_t bytes_written;             /* Bytes written to fds. */
+    unsigned cache_hits;                /* Buffer cache hits. */
+    unsigned cache_misses;              /* Buffer cache misses. */
+    unsigned voluntary_switches;        /* Switches away by blocking. */
+    unsigned involuntary_switches;      /* Switches away while ready. */
+  };
+
 /* A kernel thread or user process.
 
    Each thread structure is stored in its own 4 kB page.  The
@@ -83,7 +122,9 @@ typedef int tid_t;
    semaphore wait list (synch.c).  It can be used these two ways
    only because they are mutually exclusive: only a thread in the
    ready state is on the run queue, whereas only a thread in the
-   blocked state is on a semaphore wait list. */
+   blocked state is on a semaphore wait list.  A thread blocked in
+   timer_sleep() uses it the same way for the sleep list
+   (devices/timer.c). */
 struct thread
   {
     /* Owned by thread.c. */
@@ -91,12 +132,39 @@ struct thread
     enum thread_status status;          /* Thread state. */
     char name[16];                      /* Name (for debugging purposes). */
     uint8_t *stack;                     /* Saved stack pointer. */
-    int priority;                       /* Priority. */
+    int priority;                       /* Effective priority. */
+    int base_priority;                  /* Priority before donations. */
+    struct cpu *cpu;                    /* Run queue holding us, if ready. */
+    struct list locks_held;             /* Locks held, for donations. */
+    struct lock *waiting_lock;          /* Lock being waited on, or NULL. */
+    int nice;                           /* Nice value, for -mlfqs. */
+    fixed_point_t recent_cpu;           /* Recent CPU use, for -mlfqs. */
+    int64_t rt_period;                  /* Real-time period in ticks, or 0. */
+    int64_t rt_budget;                  /* Ticks it may run each period. */
+    int64_t rt_deadline;                /* End of the current period. */
+    int64_t rt_used;                    /* Ticks run in this period. */
+    bool rt_throttled;                  /* Budget spent for this period? */
+    unsigned rt_throttle_cnt;           /* Periods whose budget ran out. */
+    struct list_elem rt_elem;           /* Element in real-time threads list. */
+
+    /* Scheduler statistics, owned by thread.c. */
+    int64_t state_since;                /* Tick of last status change. */
+    int64_t run_ticks;                  /* Ticks spent running. */
+    int64_t ready_ticks;                /* Ticks spent ready to run. */
+    int64_t blocked_ticks;              /* Ticks spent blocked. */
+    unsigned voluntary_switches;        /* Switches away by blocking. */
+    unsigned involuntary_switches;      /* Switches away while ready. */
+    struct rusage usage;                /* Resources used by the threads
+                                           charged here; see
+                                           thread_usage(). */
     struct list_elem allelem;           /* List element for all threads list. */
 
     /* Shared between thread.c and synch.c. */
     struct list_elem elem;              /* List element. */
 
+    /* Owned by devices/timer.c. */
+    int64_t wakeup_tick;                /* Tick to wake up at, if sleeping. */
+
 #ifdef USERPROG
     /* Owned by userprog/process.c. */
     uint32_t *pagedir;                  /* Page directory. */
@@ -104,11 +172,50 @@ struct thread
     /* For Part 2 Syscalls, especially Wait() and Exec() */
     struct list children;       /* a list of child_data for all children of this thread */
     struct child_data *data;    /* a pointer to the child_data of this thread, stored in the parent process's children list, if any parent. */
+    struct list exited_children;  /* child_data of children that have exited but not been waited for, oldest first. */
+    struct semaphore child_exited; /* Upped each time a child exits. */
+    struct rusage child_usage;  /* Summed over children reaped by wait. */
 
     /* For Part 3 File Syscalls */
     struct file *executable;
-    struct list file_mappings;
-    int last_fd;
+    struct fd_file_mapping **fd_table;  /* Open files indexed by fd, NULL if free. */
+    size_t fd_table_size;               /* Number of slots in fd_table. */
+    struct bitmap *fd_used;             /* Bit set for each fd in use. */
+    struct lock fd_lock;                /* Guards the fd table against the
+                                           process's threads. */
+
+    /* User threads.  A process's first thread holds everything
+       its threads share: page directory, page table, open files,
+       memory maps and heap.  Each thread's PROCESS points to it. */
+    struct thread *process;             /* First thread of our process. */
+    struct uthread *uthread;            /* Our record, if not first. */
+    struct lock uthread_lock;           /* Guards the members below. */
+    struct condition uthread_exited;    /* Signaled as each thread exits. */
+    struct list uthreads;               /* Unjoined threads' records. */
+    int uthread_cnt;                    /* Threads running besides us. */
+    bool exiting;                       /* Threads should stop. */
+
+    /* Owned by userprog/aio.c. */
+    struct aio_context *aio;            /* Asynchronous I/O, or null. */
+#endif
+
+#ifdef VM
+    /* Owned by vm/page.c. */
+    struct hash *pages;                 /* Supplemental page table. */
+    struct lock pages_lock;             /* Guards PAGES against the
+                                           process's threads. */
+    void *user_esp;                     /* User stack pointer on entry
+                                           to the last system call. */
+
+    /* Owned by userprog/syscall.c. */
+    struct lock vm_lock;                /* Guards the members below
+                                           against the process's threads. */
+    struct list mmaps;                  /* Memory-mapped files. */
+    int next_mapid;                     /* Id for the next mapping. */
+    uint8_t *heap_start;                /* Start of the heap, just past
+                                           the executable's segments. */
+    uint8_t *heap_brk;                  /* End of the heap, moved by
+                                           sbrk(). */
 #endif
 
     #ifdef FILESYS
@@ -131,15 +238,21 @@ struct child_data {
     struct semaphore loaded;    /* semaphore on whether the child has loaded executables */
     struct semaphore terminated;/* semaphore on whether the child has terminated */
     struct list_elem elem;      /* list elem used for linking in a list */
+    struct thread *parent;      /* Parent thread, valid while ref_cnt is 2. */
+    struct list_elem exit_elem; /* Element in parent's exited_children. */
+    struct rusage usage;        /* Child's resource use, once it has exited. */
 };
 
 
 /* Mapping between file descriptors and files, used for file operation syscalls */
 struct fd_file_mapping{
     int fd;                 /* the file descriptor */
-    struct file* file;      /* the file structure object */
-    struct list_elem elem;  /* list elem used to link the structure in a list */
+    struct file* file;      /* the file structure object, or NULL for a pipe */
     bool is_dir;            /* True if fd points to a directory. */
+    struct pipe *pipe;      /* The pipe, if FILE is NULL. */
+    bool pipe_writer;       /* True for a pipe's write end. */
+    int ref_cnt;            /* The fd table's reference, plus one for
+                               each system call using the fd. */
 };
 
 
@@ -148,17 +261,29 @@ struct fd_file_mapping{
    Controlled by kernel command-line option "-o mlfqs". */
 extern bool thread_mlfqs;
 
+struct intr_frame;
+
 void thread_init (void);
 void thread_start (void);
 
-void thread_tick (void);
+void thread_tick (struct intr_frame *);
 void thread_print_stats (void);
+void thread_get_sched_stats (struct sched_stats *);
+struct rusage *thread_usage (struct thread *);
+
+struct child_data;
+void thread_free_child_data (struct child_data *);
 
 typedef void thread_func (void *aux);
 tid_t thread_create (const char *name, int priority, thread_func *, void *);
+tid_t thread_create_rt (const char *name, int64_t period, int64_t budget,
+                        thread_func *, void *);
 
 void thread_block (void);
 void thread_unblock (struct thread *);
+void thread_check_preempt (void);
+void thread_donate_priority (struct thread *, int priority);
+void thread_refresh_priority (struct thread *);
 
 struct thread *thread_current (void);
 tid_t thread_tid (void);
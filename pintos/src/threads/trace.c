@@ -0,0 +1,111 @@
+#include "threads/trace.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <round.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Records the trace buffer holds.  Once full, each new record
+   overwrites the oldest. */
+#define TRACE_CNT 4096
+
+/* Records dumped per line of console output. */
+#define TRACE_PER_LINE 4
+
+bool trace_enabled;
+
+/* The ring buffer, allocated by trace_init().  Records are
+   stored at TRACE_NEXT % TRACE_CNT, TRACE_NEXT counting every
+   record ever made. */
+static struct trace_record *trace_buf;
+static uint64_t trace_next;
+
+/* Time stamp counter and tick count when tracing began, to let
+   trace_dump() relate cycles to ticks. */
+static uint64_t start_tsc;
+static int64_t start_ticks;
+
+/* Allocates the trace buffer, if tracing was requested. */
+void
+trace_init (void)
+{
+  size_t page_cnt = DIV_ROUND_UP (TRACE_CNT * sizeof *trace_buf, PGSIZE);
+
+  if (!trace_enabled)
+    return;
+
+  trace_buf = palloc_get_multiple (PAL_ASSERT, page_cnt);
+  start_ticks = timer_ticks ();
+  start_tsc = rdtsc ();
+}
+
+/* Adds EVENT with ARG0 and ARG1 to the trace buffer.  May be
+   called from an interrupt handler or with interrupts off. */
+void
+trace_record (enum trace_event event, uint32_t arg0, uint32_t arg1)
+{
+  struct trace_record *r;
+  enum intr_level old_level;
+
+  if (trace_buf == NULL)
+    return;
+
+  old_level = intr_disable ();
+  r = &trace_buf[trace_next++ % TRACE_CNT];
+  r->tsc = rdtsc ();
+  r->event = event;
+  /* Not thread_current(), which asserts the thread is running:
+     schedule() traces after the old thread stops. */
+  r->tid = ((struct thread *) pg_round_down (&r))->tid;
+  r->arg0 = arg0;
+  r->arg1 = arg1;
+  intr_set_level (old_level);
+}
+
+/* Stops tracing and prints the trace buffer, oldest record
+   first, as lines of hex-encoded struct trace_record for
+   utils/trace2json to decode. */
+void
+trace_dump (void)
+{
+  uint64_t first, i;
+  uint64_t cycles;
+  int64_t ticks;
+
+  if (trace_buf == NULL)
+    return;
+  trace_enabled = false;
+
+  ticks = timer_ticks () - start_ticks;
+  cycles = rdtsc () - start_tsc;
+  first = trace_next > TRACE_CNT ? trace_next - TRACE_CNT : 0;
+  printf ("Trace: %"PRIu64" events, %"PRIu64" dropped, "
+          "%"PRIu64" cycles per tick, %d ticks per second\n",
+          trace_next - first, first, ticks > 0 ? cycles / ticks : 0,
+          TIMER_FREQ);
+
+  for (i = first; i < trace_next; )
+    {
+      char line[TRACE_PER_LINE * sizeof *trace_buf * 2 + 1];
+      char *q = line;
+      int n;
+
+      for (n = 0; n < TRACE_PER_LINE && i < trace_next; n++, i++)
+        {
+          const uint8_t *p = (const uint8_t *) &trace_buf[i % TRACE_CNT];
+          size_t j;
+
+          for (j = 0; j < sizeof *trace_buf; j++)
+            {
+              *q++ = "0123456789abcdef"[p[j] >> 4];
+              *q++ = "0123456789abcdef"[p[j] & 0xf];
+            }
+        }
+      *q = '\0';
+      printf ("trace %s\n", line);
+    }
+}
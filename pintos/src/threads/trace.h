@@ -0,0 +1,67 @@
+#ifndef THREADS_TRACE_H
+#define THREADS_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Events recorded in the trace buffer.  utils/trace2json knows
+   these by number, so add new ones at the end. */
+enum trace_event
+  {
+    TRACE_SCHEDULE,             /* Thread switch: old tid, new tid. */
+    TRACE_SEMA_DOWN,            /* sema_down(): semaphore, its value. */
+    TRACE_SEMA_UP,              /* sema_up(): semaphore, 1 if it woke
+                                   a waiter. */
+    TRACE_CACHE_MISS,           /* Buffer cache miss: sector, 1 if
+                                   for writing. */
+    TRACE_IDE_READ,             /* IDE read begins: sector, count. */
+    TRACE_IDE_WRITE,            /* IDE write begins: sector, count. */
+    TRACE_IDE_DONE,             /* IDE transfer ends: the sector after
+                                   it, 0. */
+    TRACE_PAGE_FAULT,           /* Page fault: address, error code. */
+    TRACE_SYSCALL,              /* System call begins: number, first
+                                   argument. */
+    TRACE_SYSCALL_DONE,         /* System call returns: number, result. */
+    TRACE_BLOCK_QUEUE,          /* Block request queued: sector,
+                                   requests queued or in flight. */
+    TRACE_EVENT_CNT
+  };
+
+/* One entry in the trace buffer, dumped in this layout. */
+struct trace_record
+  {
+    uint64_t tsc;               /* Time stamp counter. */
+    uint32_t event;             /* enum trace_event. */
+    uint32_t tid;               /* Running thread. */
+    uint32_t arg0, arg1;        /* Depend on EVENT. */
+  };
+
+/* If true, tracepoints record into the trace buffer, which is
+   dumped at power off.  Set by kernel command-line option
+   "-trace". */
+extern bool trace_enabled;
+
+/* Returns the CPU's time stamp counter.
+   See [IA32-v2b] "RDTSC". */
+static inline uint64_t
+rdtsc (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+void trace_init (void);
+void trace_record (enum trace_event, uint32_t arg0, uint32_t arg1);
+void trace_dump (void);
+
+/* Records EVENT with ARG0 and ARG1, if tracing is on.  Cheap
+   enough to leave in hot paths when it is off. */
+static inline void
+trace (enum trace_event event, uint32_t arg0, uint32_t arg1)
+{
+  if (trace_enabled)
+    trace_record (event, arg0, arg1);
+}
+
+#endif /* threads/trace.h */
@@ -0,0 +1,271 @@
+#include "userprog/aio.h"
+#include <debug.h>
+#include <list.h>
+#include <stdio.h>
+#include <syscall-nr.h>
+#include "devices/timer.h"
+#include "filesys/file.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "userprog/syscall.h"
+
+/* Asynchronous I/O.
+
+   aio_submit() hands a read or write to a pool of kernel worker
+   threads and returns at once, so that a process can keep
+   computing while the transfer waits on the disk.  The workers
+   run without the process's page directory, so they move data
+   through a kernel buffer: a write's data is copied in when it
+   is submitted, and a read's is copied out when the process
+   collects it with aio_collect().
+
+   Each request holds its own handle on the file, so closing the
+   fd it came through does not pull the file out from under a
+   worker. */
+
+/* Worker threads. */
+#define AIO_WORKERS 4
+
+/* Each worker is a real-time thread that may run AIO_BUDGET of
+   every AIO_PERIOD ticks ahead of ordinary threads, so that
+   requests complete promptly under load. */
+#define AIO_PERIOD (TIMER_FREQ / 10)
+#define AIO_BUDGET 2
+
+/* A process's outstanding asynchronous I/O. */
+struct aio_context
+  {
+    struct list requests;       /* Uncollected requests. */
+    struct condition done;      /* Signaled when one of them finishes. */
+    int next_id;                /* Id for the next request. */
+  };
+
+/* One read or write. */
+struct aio_request
+  {
+    int id;                     /* Id returned to the process. */
+    struct aio_context *ctx;    /* Owning process's context. */
+    struct file *file;          /* Our own handle on the file. */
+    bool write;                 /* Write if true, read if false. */
+    void *ubuf;                 /* User buffer. */
+    void *kbuf;                 /* Kernel buffer, SIZE bytes. */
+    off_t size;                 /* Bytes to transfer. */
+    off_t offset;               /* File offset. */
+    bool queued;                /* True while waiting for a worker. */
+    bool done;                  /* True once finished. */
+    int result;                 /* Bytes transferred, or -1. */
+    struct list_elem elem;      /* Element in context's REQUESTS. */
+    struct list_elem queue_elem; /* Element in QUEUE while queued. */
+  };
+
+/* Guards QUEUE, every context and every request. */
+static struct lock aio_lock;
+
+/* Requests waiting for a worker, oldest first. */
+static struct list queue;
+
+/* Signaled when a request is queued. */
+static struct condition work_ready;
+
+static thread_func worker;
+static void request_free (struct aio_request *);
+
+/* Starts the worker threads. */
+void
+aio_init (void)
+{
+  int i;
+
+  lock_init (&aio_lock);
+  list_init (&queue);
+  cond_init (&work_ready);
+  for (i = 0; i < AIO_WORKERS; i++)
+    {
+      char name[16];
+
+      snprintf (name, sizeof name, "aio-worker-%d", i);
+      if (thread_create_rt (name, AIO_PERIOD, AIO_BUDGET, worker, NULL)
+          == TID_ERROR)
+        PANIC ("aio worker creation failed");
+    }
+}
+
+/* Queues a read of SIZE bytes at OFFSET in FILE into user buffer
+   UBUF, or a write from UBUF if WRITE is true.  Returns an id for
+   the request, for aio_collect(), or -1 if SIZE is out of range,
+   the process has too many requests outstanding, or memory runs
+   out. */
+int
+aio_submit (struct file *file, bool write, void *ubuf, off_t size,
+            off_t offset)
+{
+  struct thread *process = thread_current ()->process;
+  struct aio_request *r;
+  int id;
+
+  if (size < 0 || size > AIO_MAX_SIZE)
+    return -1;
+
+  r = malloc (sizeof *r);
+  if (r == NULL)
+    return -1;
+  r->kbuf = malloc (size > 0 ? size : 1);
+  r->file = file_reopen (file);
+  if (r->kbuf == NULL || r->file == NULL)
+    {
+      request_free (r);
+      return -1;
+    }
+  if (write)
+    copy_from_user (r->kbuf, ubuf, size);
+  r->write = write;
+  r->ubuf = ubuf;
+  r->size = size;
+  r->offset = offset;
+  r->queued = true;
+  r->done = false;
+  r->result = -1;
+
+  lock_acquire (&aio_lock);
+  if (process->aio == NULL)
+    {
+      process->aio = malloc (sizeof *process->aio);
+      if (process->aio == NULL)
+        {
+          lock_release (&aio_lock);
+          request_free (r);
+          return -1;
+        }
+      list_init (&process->aio->requests);
+      cond_init (&process->aio->done);
+      process->aio->next_id = 1;
+    }
+  if (list_size (&process->aio->requests) >= AIO_MAX_PENDING)
+    {
+      lock_release (&aio_lock);
+      request_free (r);
+      return -1;
+    }
+  r->ctx = process->aio;
+  id = r->id = r->ctx->next_id++;
+  list_push_back (&r->ctx->requests, &r->elem);
+  list_push_back (&queue, &r->queue_elem);
+  cond_signal (&work_ready, &aio_lock);
+  lock_release (&aio_lock);
+  return id;
+}
+
+/* Collects request ID of the current process: copies the data
+   of a read out to its user buffer and returns the number of
+   bytes transferred, or -1 if the transfer failed or there is no
+   such request.  Waits for the request to finish if BLOCK is
+   true; otherwise returns AIO_PENDING if it has not, and the
+   request may be collected later. */
+int
+aio_collect (int id, bool block)
+{
+  struct aio_context *ctx = thread_current ()->process->aio;
+  struct aio_request *r = NULL;
+  struct list_elem *e;
+  int result;
+
+  if (ctx == NULL)
+    return -1;
+
+  lock_acquire (&aio_lock);
+  for (e = list_begin (&ctx->requests); e != list_end (&ctx->requests);
+       e = list_next (e))
+    if (list_entry (e, struct aio_request, elem)->id == id)
+      {
+        r = list_entry (e, struct aio_request, elem);
+        break;
+      }
+  if (r == NULL || (!r->done && !block))
+    {
+      lock_release (&aio_lock);
+      return r == NULL ? -1 : AIO_PENDING;
+    }
+  while (!r->done)
+    cond_wait (&ctx->done, &aio_lock);
+  list_remove (&r->elem);
+  lock_release (&aio_lock);
+
+  result = r->result;
+  if (!r->write && result > 0)
+    copy_to_user (r->ubuf, r->kbuf, result);
+  request_free (r);
+  return result;
+}
+
+/* Drops the requests of PROCESS that no worker has started yet,
+   waits for the rest to finish, and frees them all.  Called as
+   PROCESS exits, after its other threads have stopped. */
+void
+aio_destroy (struct thread *process)
+{
+  struct aio_context *ctx = process->aio;
+
+  if (ctx == NULL)
+    return;
+
+  lock_acquire (&aio_lock);
+  while (!list_empty (&ctx->requests))
+    {
+      struct aio_request *r = list_entry (list_front (&ctx->requests),
+                                          struct aio_request, elem);
+      if (r->queued)
+        {
+          list_remove (&r->queue_elem);
+          r->queued = false;
+          r->done = true;
+        }
+      while (!r->done)
+        cond_wait (&ctx->done, &aio_lock);
+      list_remove (&r->elem);
+      lock_release (&aio_lock);
+      request_free (r);
+      lock_acquire (&aio_lock);
+    }
+  process->aio = NULL;
+  lock_release (&aio_lock);
+  free (ctx);
+}
+
+/* A worker thread: runs queued requests, one at a time. */
+static void
+worker (void *aux UNUSED)
+{
+  for (;;)
+    {
+      struct aio_request *r;
+      int result;
+
+      lock_acquire (&aio_lock);
+      while (list_empty (&queue))
+        cond_wait (&work_ready, &aio_lock);
+      r = list_entry (list_pop_front (&queue), struct aio_request,
+                      queue_elem);
+      r->queued = false;
+      lock_release (&aio_lock);
+
+      result = (r->write
+                ? file_write_at (r->file, r->kbuf, r->size, r->offset)
+                : file_read_at (r->file, r->kbuf, r->size, r->offset));
+
+      lock_acquire (&aio_lock);
+      r->result = result;
+      r->done = true;
+      cond_broadcast (&r->ctx->done, &aio_lock);
+      lock_release (&aio_lock);
+    }
+}
+
+/* Frees R and what it holds. */
+static void
+request_free (struct aio_request *r)
+{
+  file_close (r->file);
+  free (r->kbuf);
+  free (r);
+}
@@ -0,0 +1,16 @@
+#ifndef USERPROG_AIO_H
+#define USERPROG_AIO_H
+
+#include <stdbool.h>
+#include "filesys/off_t.h"
+
+struct file;
+struct thread;
+
+void aio_init (void);
+int aio_submit (struct file *, bool write, void *ubuf, off_t size,
+                off_t offset);
+int aio_collect (int id, bool block);
+void aio_destroy (struct thread *process);
+
+#endif /* userprog/aio.h */
@@ -4,6 +4,11 @@
 #include "userprog/gdt.h"
 #include "threads/interrupt.h"
 #include "threads/thread.h"
+#include "threads/trace.h"
+#include "threads/vaddr.h"
+#ifdef VM
+#include "vm/page.h"
+#endif
 
 /* Number of page faults processed. */
 static long long page_fault_cnt;
@@ -147,12 +152,33 @@ page_fault (struct intr_frame *f)
 
   /* Count page faults. */
   page_fault_cnt++;
+  thread_usage (thread_current ())->page_faults++;
+  trace (TRACE_PAGE_FAULT, (uint32_t) fault_addr, f->error_code);
 
   /* Determine cause. */
   not_present = (f->error_code & PF_P) == 0;
   write = (f->error_code & PF_W) != 0;
   user = (f->error_code & PF_U) != 0;
 
+#ifdef VM
+  /* Bring in a page that the process, or the kernel on its
+     behalf, touched, or grow the stack to cover it.  The kernel
+     only touches user memory in system calls, so a kernel fault
+     is judged against the stack pointer the process had then. */
+  if (not_present && is_user_vaddr (fault_addr))
+    {
+      void *esp = user ? f->esp : thread_current ()->user_esp;
+      if (page_load (fault_addr) || page_grow_stack (fault_addr, esp))
+        return;
+    }
+
+  /* A write to a page shared copy-on-write.  CR0.WP is set, so
+     this catches the kernel writing to user memory too. */
+  if (!not_present && write && is_user_vaddr (fault_addr)
+      && page_copy_on_write (fault_addr))
+    return;
+#endif
+
   /* To implement virtual memory, delete the rest of the function
      body, and replace it with code that brings in the page to
      which fault_addr refers. */
@@ -0,0 +1,145 @@
+#include "userprog/futex.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Futexes: wait queues keyed on user addresses.
+
+   A user-space lock or condition keeps its state in an int of
+   user memory and changes it with atomic instructions, entering
+   the kernel only to sleep when it has to wait, or to wake
+   sleepers when it knows there are some.  futex_wait() sleeps
+   only if the int still holds the value the caller saw, checked
+   under the same lock futex_wake() takes, so a wakeup that comes
+   between the caller's look and its sleep is not lost.
+
+   Nothing is allocated per futex.  Waiters sit on the list of
+   one of a fixed set of buckets, picked by hashing the address,
+   with their process telling apart the same address in
+   different processes. */
+
+/* Number of buckets. */
+#define FUTEX_BUCKETS 64
+
+/* A bucket of waiters. */
+struct futex_bucket
+  {
+    struct lock lock;           /* Guards WAITERS. */
+    struct list waiters;        /* struct futex_waiter, oldest first. */
+  };
+
+/* A thread in futex_wait(), on its kernel stack. */
+struct futex_waiter
+  {
+    struct thread *process;     /* Process of the waiting thread. */
+    int *uaddr;                 /* User address waited on. */
+    struct semaphore sema;      /* Upped to wake the thread. */
+    struct list_elem elem;      /* Element in bucket's WAITERS. */
+  };
+
+static struct futex_bucket buckets[FUTEX_BUCKETS];
+
+/* Returns the bucket for UADDR. */
+static struct futex_bucket *
+bucket_for (const int *uaddr)
+{
+  return &buckets[hash_int ((int) uaddr) % FUTEX_BUCKETS];
+}
+
+/* Initializes the futex buckets. */
+void
+futex_init (void)
+{
+  size_t i;
+
+  for (i = 0; i < FUTEX_BUCKETS; i++)
+    {
+      lock_init (&buckets[i].lock);
+      list_init (&buckets[i].waiters);
+    }
+}
+
+/* Sleeps on UADDR, if the int there still holds VAL, until
+   futex_wake() wakes us.  UADDR must be a valid, aligned user
+   address.  Returns 0 after sleeping, or -1 at once if *UADDR is
+   not VAL. */
+int
+futex_wait (int *uaddr, int val)
+{
+  struct futex_bucket *b = bucket_for (uaddr);
+  struct futex_waiter w;
+
+  lock_acquire (&b->lock);
+  if (*uaddr != val)
+    {
+      lock_release (&b->lock);
+      return -1;
+    }
+  w.process = thread_current ()->process;
+  w.uaddr = uaddr;
+  sema_init (&w.sema, 0);
+  list_push_back (&b->waiters, &w.elem);
+  lock_release (&b->lock);
+
+  sema_down (&w.sema);
+  return 0;
+}
+
+/* Wakes up to CNT of the running process's threads sleeping on
+   UADDR, the longest sleeping first.  Returns the number woken. */
+int
+futex_wake (int *uaddr, int cnt)
+{
+  struct thread *process = thread_current ()->process;
+  struct futex_bucket *b = bucket_for (uaddr);
+  struct list_elem *e;
+  int woken = 0;
+
+  lock_acquire (&b->lock);
+  for (e = list_begin (&b->waiters);
+       e != list_end (&b->waiters) && woken < cnt; )
+    {
+      struct futex_waiter *w = list_entry (e, struct futex_waiter, elem);
+      if (w->process == process && w->uaddr == uaddr)
+        {
+          e = list_remove (e);
+          sema_up (&w->sema);
+          woken++;
+        }
+      else
+        e = list_next (e);
+    }
+  lock_release (&b->lock);
+  return woken;
+}
+
+/* Wakes every thread of PROCESS sleeping on any futex, as the
+   process exits. */
+void
+futex_wake_process (struct thread *process)
+{
+  size_t i;
+
+  for (i = 0; i < FUTEX_BUCKETS; i++)
+    {
+      struct futex_bucket *b = &buckets[i];
+      struct list_elem *e;
+
+      lock_acquire (&b->lock);
+      for (e = list_begin (&b->waiters); e != list_end (&b->waiters); )
+        {
+          struct futex_waiter *w = list_entry (e, struct futex_waiter,
+                                               elem);
+          if (w->process == process)
+            {
+              e = list_remove (e);
+              sema_up (&w->sema);
+            }
+          else
+            e = list_next (e);
+        }
+      lock_release (&b->lock);
+    }
+}
@@ -7,6 +7,7 @@
 #include "threads/palloc.h"
 
 static uint32_t *active_pd (void);
+static void load_pagedir (uint32_t *);
 static void invalidate_pagedir (uint32_t *);
 
 /* Creates a new page directory that has mappings for kernel
@@ -27,12 +28,14 @@ pagedir_create (void)
 void
 pagedir_destroy (uint32_t *pd)
 {
+  struct palloc_batch batch;
   uint32_t *pde;
 
   if (pd == NULL)
     return;
 
   ASSERT (pd != init_page_dir);
+  palloc_batch_init (&batch);
   for (pde = pd; pde < pd + pd_no (PHYS_BASE); pde++)
     if (*pde & PTE_P)
       {
@@ -41,10 +44,11 @@ pagedir_destroy (uint32_t *pd)
 
         for (pte = pt; pte < pt + PGSIZE / sizeof *pte; pte++)
           if (*pte & PTE_P)
-            palloc_free_page (pte_get_page (*pte));
-        palloc_free_page (pt);
+            palloc_batch_add (&batch, pte_get_page (*pte));
+        palloc_batch_add (&batch, pt);
       }
-  palloc_free_page (pd);
+  palloc_batch_add (&batch, pd);
+  palloc_free_batch (&batch);
 }
 
 /* Returns the address of the page table entry for virtual
@@ -185,6 +189,27 @@ pagedir_set_dirty (uint32_t *pd, const void *vpage, bool dirty)
     }
 }
 
+/* Makes the mapping of user virtual page UPAGE in PD writable if
+   WRITABLE is true, read-only otherwise, preserving the other
+   bits of its page table entry.  UPAGE need not be mapped. */
+void
+pagedir_set_writable (uint32_t *pd, const void *upage, bool writable)
+{
+  uint32_t *pte;
+
+  ASSERT (is_user_vaddr (upage));
+
+  pte = lookup_page (pd, upage, false);
+  if (pte != NULL && (*pte & PTE_P) != 0)
+    {
+      if (writable)
+        *pte |= PTE_W;
+      else
+        *pte &= ~(uint32_t) PTE_W;
+      invalidate_pagedir (pd);
+    }
+}
+
 /* Returns true if the PTE for virtual page VPAGE in PD has been
    accessed recently, that is, between the time the PTE was
    installed and the last time it was cleared.  Returns false if
@@ -214,14 +239,48 @@ pagedir_set_accessed (uint32_t *pd, const void *vpage, bool accessed)
     }
 }
 
+/* Returns the number of user pages present in page directory
+   PD, which may be a null pointer. */
+unsigned
+pagedir_count_present (uint32_t *pd)
+{
+  unsigned cnt = 0;
+  uint32_t *pde;
+
+  if (pd == NULL)
+    return 0;
+
+  for (pde = pd; pde < pd + pd_no (PHYS_BASE); pde++)
+    if (*pde & PTE_P)
+      {
+        uint32_t *pt = pde_get_pt (*pde);
+        uint32_t *pte;
+
+        for (pte = pt; pte < pt + PGSIZE / sizeof *pte; pte++)
+          if (*pte & PTE_P)
+            cnt++;
+      }
+  return cnt;
+}
+
 /* Loads page directory PD into the CPU's page directory base
-   register. */
+   register, unless it is already loaded.  Reloading the same
+   page directory would only flush the TLB for nothing. */
 void
 pagedir_activate (uint32_t *pd)
 {
   if (pd == NULL)
     pd = init_page_dir;
 
+  if (active_pd () != pd)
+    load_pagedir (pd);
+}
+
+/* Loads page directory PD into the CPU's page directory base
+   register, flushing all non-global TLB entries. */
+static void
+load_pagedir (uint32_t *pd)
+{
   /* Store the physical address of the page directory into CR3
      aka PDBR (page directory base register).  This activates our
      new page tables immediately.  See [IA32-v2a] "MOV--Move
@@ -256,8 +315,8 @@ invalidate_pagedir (uint32_t *pd)
 {
   if (active_pd () == pd)
     {
-      /* Re-activating PD clears the TLB.  See [IA32-v3a] 3.12
+      /* Re-loading PD clears the TLB.  See [IA32-v3a] 3.12
          "Translation Lookaside Buffers (TLBs)". */
-      pagedir_activate (pd);
+      load_pagedir (pd);
     }
 }
@@ -0,0 +1,157 @@
+#include "userprog/pipe.h"
+#include <debug.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Bytes a pipe buffers between its writers and its readers. */
+#define PIPE_SIZE PGSIZE
+
+/* A pipe: a ring buffer of PIPE_SIZE bytes, written at one end
+   and read at the other, with a count of the fds open on each
+   end.  Freed when both counts drop to 0. */
+struct pipe
+  {
+    struct lock lock;                   /* Protects all members. */
+    struct condition not_empty;         /* Signaled when data arrives
+                                           or the last writer closes. */
+    struct condition not_full;          /* Signaled when space frees up
+                                           or the last reader closes. */
+    uint8_t *buf;                       /* Ring buffer, one page. */
+    size_t head;                        /* Index of the oldest byte. */
+    size_t cnt;                         /* Bytes in BUF. */
+    int readers;                        /* Open read ends. */
+    int writers;                        /* Open write ends. */
+  };
+
+/* Creates a pipe with one read end and one write end open.
+   Returns the new pipe, or a null pointer if memory runs out. */
+struct pipe *
+pipe_create (void)
+{
+  struct pipe *p = malloc (sizeof *p);
+  if (p == NULL)
+    return NULL;
+  p->buf = palloc_get_page (0);
+  if (p->buf == NULL)
+    {
+      free (p);
+      return NULL;
+    }
+  lock_init (&p->lock);
+  cond_init (&p->not_empty);
+  cond_init (&p->not_full);
+  p->head = p->cnt = 0;
+  p->readers = p->writers = 1;
+  return p;
+}
+
+/* Opens another read end of P, or write end if WRITER is true,
+   as when an fd for it is inherited. */
+void
+pipe_open (struct pipe *p, bool writer)
+{
+  lock_acquire (&p->lock);
+  if (writer)
+    p->writers++;
+  else
+    p->readers++;
+  lock_release (&p->lock);
+}
+
+/* Closes a read end of P, or a write end if WRITER is true.
+   Readers see end of file once the last writer is gone, and
+   writers stop waiting once the last reader is.  Frees P when
+   nothing has it open. */
+void
+pipe_close (struct pipe *p, bool writer)
+{
+  bool done;
+
+  lock_acquire (&p->lock);
+  if (writer)
+    {
+      ASSERT (p->writers > 0);
+      if (--p->writers == 0)
+        cond_broadcast (&p->not_empty, &p->lock);
+    }
+  else
+    {
+      ASSERT (p->readers > 0);
+      if (--p->readers == 0)
+        cond_broadcast (&p->not_full, &p->lock);
+    }
+  done = p->readers == 0 && p->writers == 0;
+  lock_release (&p->lock);
+
+  if (done)
+    {
+      palloc_free_page (p->buf);
+      free (p);
+    }
+}
+
+/* Reads up to SIZE bytes from P into BUFFER, waiting until at
+   least one byte is there or no writer is left.  Returns the
+   number of bytes read, which is 0 only at end of file. */
+int
+pipe_read (struct pipe *p, void *buffer, size_t size)
+{
+  uint8_t *dst = buffer;
+  size_t done = 0;
+
+  lock_acquire (&p->lock);
+  while (p->cnt == 0 && p->writers > 0 && size > 0)
+    cond_wait (&p->not_empty, &p->lock);
+  while (done < size && p->cnt > 0)
+    {
+      /* Copy up to the end of the ring at a time. */
+      size_t chunk = PIPE_SIZE - p->head;
+      if (chunk > p->cnt)
+        chunk = p->cnt;
+      if (chunk > size - done)
+        chunk = size - done;
+      memcpy (dst + done, p->buf + p->head, chunk);
+      p->head = (p->head + chunk) % PIPE_SIZE;
+      p->cnt -= chunk;
+      done += chunk;
+    }
+  if (done > 0)
+    cond_broadcast (&p->not_full, &p->lock);
+  lock_release (&p->lock);
+  return done;
+}
+
+/* Writes the SIZE bytes in BUFFER to P, waiting for readers to
+   make room as needed.  Returns SIZE, or fewer if the last reader
+   closes first, or -1 if there was no reader to begin with. */
+int
+pipe_write (struct pipe *p, const void *buffer, size_t size)
+{
+  const uint8_t *src = buffer;
+  size_t done = 0;
+
+  lock_acquire (&p->lock);
+  while (done < size && p->readers > 0)
+    {
+      size_t tail, chunk;
+
+      if (p->cnt == PIPE_SIZE)
+        {
+          cond_wait (&p->not_full, &p->lock);
+          continue;
+        }
+      tail = (p->head + p->cnt) % PIPE_SIZE;
+      chunk = tail >= p->head ? PIPE_SIZE - tail : p->head - tail;
+      if (chunk > size - done)
+        chunk = size - done;
+      memcpy (p->buf + tail, src + done, chunk);
+      p->cnt += chunk;
+      done += chunk;
+      cond_broadcast (&p->not_empty, &p->lock);
+    }
+  lock_release (&p->lock);
+  return done == 0 && size > 0 ? -1 : (int) done;
+}
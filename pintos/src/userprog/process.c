@@ -5,8 +5,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syscall-nr.h>
+#include "userprog/aio.h"
+#include "userprog/futex.h"
 #include "userprog/gdt.h"
 #include "userprog/pagedir.h"
+#include "userprog/syscall.h"
 #include "userprog/tss.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
@@ -14,13 +18,70 @@
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
+#include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
 #include "threads/vaddr.h"
+#ifdef VM
+#include "vm/page.h"
+#endif
+
+/* A parsed command line, in one block: ARGC pointers to the
+   arguments and a null pointer, followed by the argument strings
+   themselves, each null-terminated, back to back.  Because the
+   strings are laid out as they will be on the user stack, load()
+   copies them there in one piece. */
+struct exec_args
+  {
+    int argc;                   /* Number of arguments. */
+    size_t str_len;             /* Bytes of strings, with nulls. */
+    char *argv[];               /* Arguments, then the strings. */
+  };
 
+static struct exec_args *args_alloc (int argc, size_t str_len);
+static char *args_strings (const struct exec_args *);
+static tid_t execute (struct exec_args *);
+static int reap (struct child_data *);
+static void usage_add (struct rusage *, const struct rusage *);
 static thread_func start_process NO_RETURN;
-static bool load (const char *cmdline, void (**eip) (void), void **esp);
+static thread_func start_uthread NO_RETURN;
+static bool load (const struct exec_args *, void (**eip) (void), void **esp);
+static void release_children (struct thread *);
+static void uthread_exit (void);
+static void uthreads_stop (void);
+#ifdef VM
+static thread_func fork_process NO_RETURN;
+static bool duplicate (struct thread *parent);
+
+/* What fork_process() needs from its parent. */
+struct fork_info
+  {
+    struct thread *parent;      /* Process being duplicated. */
+    struct intr_frame if_;      /* Its user registers at fork(). */
+  };
+#endif
+
+/* A user thread other than its process's first, as
+   process_thread_join() sees it.  On the first thread's UTHREADS
+   list from when it starts until it is joined or the process
+   exits. */
+struct uthread
+  {
+    tid_t tid;                  /* The thread's tid. */
+    bool exited;                /* Has the thread exited? */
+    bool joining;               /* Is another thread joining it? */
+    struct list_elem elem;      /* Element in UTHREADS. */
+  };
+
+/* What start_uthread() needs from the thread creating it. */
+struct uthread_info
+  {
+    struct thread *process;     /* First thread of the process. */
+    struct intr_frame if_;      /* User registers to start with. */
+    struct uthread *uthread;    /* The new thread's record. */
+    struct semaphore started;   /* Upped once this is not needed. */
+  };
 
 /* Starts a new thread running a user program loaded from
    FILENAME.  The new thread may be scheduled (and may even exit)
@@ -29,34 +90,129 @@ static bool load (const char *cmdline, void (**eip) (void), void **esp);
 tid_t
 process_execute (const char *file_name)
 {
-  char *fn_copy;
-  tid_t tid;
+  struct exec_args *args;
+  const char *p;
+  char *s;
+  size_t str_len = 0;
+  int argc = 0;
+  int i;
+
+  /* Count the words, then copy them.  Parsing here, once, lets
+     both the thread name and the user stack come from ARGS. */
+  for (p = file_name; *p != '\0'; )
+    {
+      const char *start;
+
+      while (*p == ' ')
+        p++;
+      if (*p == '\0')
+        break;
+      for (start = p; *p != ' ' && *p != '\0'; p++)
+        continue;
+      argc++;
+      str_len += p - start + 1;
+    }
+  args = args_alloc (argc, str_len);
+  if (args == NULL)
+    return TID_ERROR;
+
+  s = args_strings (args);
+  p = file_name;
+  for (i = 0; i < argc; i++)
+    {
+      while (*p == ' ')
+        p++;
+      args->argv[i] = s;
+      while (*p != ' ' && *p != '\0')
+        *s++ = *p++;
+      *s++ = '\0';
+    }
+  return execute (args);
+}
+
+/* Starts a new thread running the user program named by ARGV[0],
+   with the ARGC arguments in ARGV, as process_execute() does for
+   a command line.  Arguments may contain spaces. */
+tid_t
+process_execute_argv (int argc, char *const argv[])
+{
+  struct exec_args *args;
+  size_t str_len = 0;
+  char *s;
+  int i;
 
-  /* Make a copy of FILE_NAME.
-     Otherwise there's a race between the caller and load(). */
-  fn_copy = palloc_get_page (0);
-  if (fn_copy == NULL)
+  for (i = 0; i < argc; i++)
+    str_len += strlen (argv[i]) + 1;
+  args = args_alloc (argc, str_len);
+  if (args == NULL)
     return TID_ERROR;
-  strlcpy (fn_copy, file_name, PGSIZE);
 
-  char* index;
-  char file_name_copy[128];
-  strlcpy(file_name_copy, file_name, 128);
-  char *name = strtok_r(file_name_copy, " ", &index);
+  s = args_strings (args);
+  for (i = 0; i < argc; i++)
+    {
+      size_t len = strlen (argv[i]) + 1;
+      memcpy (s, argv[i], len);
+      args->argv[i] = s;
+      s += len;
+    }
+  return execute (args);
+}
+
+/* Returns a new exec_args for ARGC arguments totalling STR_LEN
+   bytes, with its argv[ARGC] already null, or a null pointer if
+   there are no arguments, if they would not fit in the first
+   page of the user stack, or if memory runs out. */
+static struct exec_args *
+args_alloc (int argc, size_t str_len)
+{
+  struct exec_args *args;
+  size_t ptr_size;
+
+  /* The stack holds the strings, up to 3 bytes of padding, the
+     argv array and its null, argv, argc, and a return address. */
+  if (argc <= 0 || (size_t) argc > PGSIZE / sizeof (char *)
+      || str_len > PGSIZE)
+    return NULL;
+  ptr_size = (argc + 1) * sizeof (char *);
+  if (str_len + 3 + ptr_size + 3 * sizeof (void *) > PGSIZE)
+    return NULL;
+
+  args = malloc (sizeof *args + ptr_size + str_len);
+  if (args == NULL)
+    return NULL;
+  args->argc = argc;
+  args->str_len = str_len;
+  args->argv[argc] = NULL;
+  return args;
+}
+
+/* Returns the start of ARGS's strings. */
+static char *
+args_strings (const struct exec_args *args)
+{
+  return (char *) &args->argv[args->argc + 1];
+}
+
+/* Starts a thread named for ARGS's first argument to load and run
+   the program it names, passing ARGS and responsibility for
+   freeing it to the new thread. */
+static tid_t
+execute (struct exec_args *args)
+{
+  tid_t tid;
 
-  /* Create a new thread to execute FILE_NAME. */
-  tid = thread_create (name, PRI_DEFAULT, start_process, fn_copy);
+  tid = thread_create (args->argv[0], PRI_DEFAULT, start_process, args);
   if (tid == TID_ERROR)
-    palloc_free_page (fn_copy);
+    free (args);
   return tid;
 }
 
 /* A thread function that loads a user process and starts it
    running. */
 static void
-start_process (void *file_name_)
+start_process (void *args_)
 {
-  char *file_name = file_name_;
+  struct exec_args *args = args_;
   struct intr_frame if_;
   bool success;
 
@@ -65,12 +221,16 @@ start_process (void *file_name_)
   if_.gs = if_.fs = if_.es = if_.ds = if_.ss = SEL_UDSEG;
   if_.cs = SEL_UCSEG;
   if_.eflags = FLAG_IF | FLAG_MBS;
-  success = load (file_name, &if_.eip, &if_.esp);
+  success = load (args, &if_.eip, &if_.esp);
+
+  /* Take the parent's pipes while it waits for us to load. */
+  if (success)
+    success = fd_table_inherit (thread_current()->data->parent);
   thread_current()->data->load_status = success ? 1 : -1;
   sema_up(&thread_current()->data->loaded);
 
   /* If load failed, quit. */
-  palloc_free_page (file_name);
+  free (args);
   if (!success)
     thread_exit ();
 
@@ -84,6 +244,248 @@ start_process (void *file_name_)
   NOT_REACHED ();
 }
 
+#ifdef VM
+/* Starts a new process that is a duplicate of the running one,
+   resuming in user mode from the registers in IF_ but with 0 as
+   the return value.  Only the calling thread is duplicated.  The caller must wait on the new process's
+   LOADED semaphore, and not run, until the duplicate is made.
+   Returns the new process's thread id, or TID_ERROR if the
+   thread cannot be created. */
+tid_t
+process_fork (const struct intr_frame *if_)
+{
+  struct fork_info *info;
+  tid_t tid;
+
+  info = malloc (sizeof *info);
+  if (info == NULL)
+    return TID_ERROR;
+  info->parent = thread_current ()->process;
+  info->if_ = *if_;
+
+  tid = thread_create (thread_name (), PRI_DEFAULT, fork_process, info);
+  if (tid == TID_ERROR)
+    free (info);
+  return tid;
+}
+
+/* A thread function that duplicates a user process and starts
+   the duplicate running. */
+static void
+fork_process (void *info_)
+{
+  struct fork_info *info = info_;
+  struct intr_frame if_ = info->if_;
+  bool success;
+
+  success = duplicate (info->parent);
+  free (info);
+  thread_current()->data->load_status = success ? 1 : -1;
+  sema_up(&thread_current()->data->loaded);
+  if (!success)
+    thread_exit ();
+
+  /* fork() returns 0 in the child. */
+  if_.eax = 0;
+  asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (&if_) : "memory");
+  NOT_REACHED ();
+}
+
+/* Makes the running thread a copy of user process PARENT: its
+   address space, which shares PARENT's pages copy-on-write, and
+   its open files.  Returns true if successful, false if memory
+   runs out, in which case whatever was copied is freed by
+   process_exit(). */
+static bool
+duplicate (struct thread *parent)
+{
+  struct thread *t = thread_current ();
+
+  t->pagedir = pagedir_create ();
+  if (t->pagedir == NULL || !page_table_create ())
+    return false;
+  process_activate ();
+
+  t->executable = file_reopen (parent->executable);
+  if (t->executable == NULL)
+    return false;
+  file_deny_write (t->executable);
+  t->heap_start = parent->heap_start;
+  t->heap_brk = parent->heap_brk;
+
+  return fd_table_copy (parent)
+         && page_table_copy (parent, t->executable);
+}
+#endif
+
+/* Starts a new thread in the running process, sharing its
+   address space and open files, that begins running user code at
+   EIP with stack pointer ESP.  Returns the new thread's tid, or
+   TID_ERROR if the process is exiting or memory runs out. */
+tid_t
+process_thread_create (void (*eip) (void), void *esp)
+{
+  struct thread *p = thread_current ()->process;
+  struct uthread_info info;
+  tid_t tid;
+
+  info.uthread = malloc (sizeof *info.uthread);
+  if (info.uthread == NULL)
+    return TID_ERROR;
+  info.process = p;
+  memset (&info.if_, 0, sizeof info.if_);
+  info.if_.gs = info.if_.fs = info.if_.es = SEL_UDSEG;
+  info.if_.ds = info.if_.ss = SEL_UDSEG;
+  info.if_.cs = SEL_UCSEG;
+  info.if_.eflags = FLAG_IF | FLAG_MBS;
+  info.if_.eip = eip;
+  info.if_.esp = esp;
+  sema_init (&info.started, 0);
+
+  /* Count the thread before it exists, so that the process can't
+     finish exiting while it starts. */
+  lock_acquire (&p->uthread_lock);
+  if (p->exiting)
+    {
+      lock_release (&p->uthread_lock);
+      free (info.uthread);
+      return TID_ERROR;
+    }
+  p->uthread_cnt++;
+  lock_release (&p->uthread_lock);
+
+  tid = thread_create (p->name, PRI_DEFAULT, start_uthread, &info);
+  if (tid == TID_ERROR)
+    {
+      lock_acquire (&p->uthread_lock);
+      p->uthread_cnt--;
+      cond_broadcast (&p->uthread_exited, &p->uthread_lock);
+      lock_release (&p->uthread_lock);
+      free (info.uthread);
+      return TID_ERROR;
+    }
+  sema_down (&info.started);
+  return tid;
+}
+
+/* A thread function that joins the running thread to a user
+   process and starts it running user code. */
+static void
+start_uthread (void *info_)
+{
+  struct uthread_info *info = info_;
+  struct thread *t = thread_current ();
+  struct thread *p = info->process;
+  struct intr_frame if_ = info->if_;
+  enum intr_level old_level;
+
+  /* thread_create() made us a child of the thread that created
+     us, but that thread can't wait() for us.  Share the process's
+     child_data instead, so exit() sets the process's status. */
+  old_level = intr_disable ();
+  list_remove (&t->data->elem);
+  intr_set_level (old_level);
+  thread_free_child_data (t->data);
+  t->data = p->data;
+
+  t->process = p;
+  t->pagedir = p->pagedir;
+  t->uthread = info->uthread;
+  t->uthread->tid = t->tid;
+  t->uthread->exited = t->uthread->joining = false;
+  lock_acquire (&p->uthread_lock);
+  list_push_back (&p->uthreads, &t->uthread->elem);
+  lock_release (&p->uthread_lock);
+  process_activate ();
+
+  /* INFO is on our creator's stack, so let it go only now. */
+  sema_up (&info->started);
+
+  asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (&if_) : "memory");
+  NOT_REACHED ();
+}
+
+/* Waits for thread TID of the running process to exit.  Returns
+   true if it has, false without waiting if TID is not a thread of
+   the process other than its first and the caller, or another
+   thread already joined it, or false once the process starts
+   exiting. */
+bool
+process_thread_join (tid_t tid)
+{
+  struct thread *p = thread_current ()->process;
+  struct uthread *u = NULL;
+  struct list_elem *e;
+  bool success = false;
+
+  if (tid == thread_tid ())
+    return false;
+
+  lock_acquire (&p->uthread_lock);
+  for (e = list_begin (&p->uthreads); e != list_end (&p->uthreads);
+       e = list_next (e))
+    {
+      struct uthread *v = list_entry (e, struct uthread, elem);
+      if (v->tid == tid && !v->joining)
+        {
+          u = v;
+          break;
+        }
+    }
+  if (u != NULL)
+    {
+      u->joining = true;
+      while (!u->exited && !p->exiting)
+        cond_wait (&p->uthread_exited, &p->uthread_lock);
+
+      /* If the process is exiting, its first thread frees U. */
+      if (u->exited)
+        {
+          list_remove (&u->elem);
+          free (u);
+          success = true;
+        }
+    }
+  lock_release (&p->uthread_lock);
+  return success;
+}
+
+/* Marks the running thread's process as exiting, which stops each
+   of its threads the next time it would return to user mode, and
+   wakes any of them sleeping on a futex or in a join.  Returns
+   true if the process was not already exiting, in which case the
+   caller reports its exit status. */
+bool
+process_begin_exit (void)
+{
+  struct thread *p = thread_current ()->process;
+  bool first, others;
+
+  lock_acquire (&p->uthread_lock);
+  first = !p->exiting;
+  others = p->uthread_cnt > 0;
+  p->exiting = true;
+  cond_broadcast (&p->uthread_exited, &p->uthread_lock);
+  lock_release (&p->uthread_lock);
+
+  if (first && others)
+    futex_wake_process (p);
+  return first;
+}
+
+/* Exits the running thread if its process is exiting.  Called
+   just before returning to user mode, so that a thread that never
+   makes a system call still stops. */
+void
+process_stop_if_exiting (void)
+{
+  if (thread_current ()->process->exiting)
+    {
+      intr_enable ();
+      thread_exit ();
+    }
+}
+
 /* Waits for thread TID to die and returns its exit status.  If
    it was terminated by the kernel (i.e. killed due to an
    exception), returns -1.  If TID is invalid or if it was not a
@@ -98,7 +500,6 @@ process_wait (tid_t child_tid)
 { struct child_data* cd;
   struct list_elem *e;
   enum intr_level old_level;
-  int exit_status;
 
   old_level = intr_disable ();
   for (e = list_begin (&thread_current()->children); 
@@ -108,41 +509,179 @@ process_wait (tid_t child_tid)
       cd = list_entry (e, struct child_data, elem);
       if (cd->tid == child_tid) {
         sema_down(&cd->terminated);
-        list_remove(&cd->elem);
         intr_set_level (old_level);
-        exit_status = cd->status;
-        if (cd->ref_cnt == 1) {
-          free(cd);
-        } else {
-          cd->ref_cnt--;
-        }
-        return exit_status;
+        return reap (cd);
       }
   }
   intr_set_level (old_level);
   return -1;
 }
 
+/* Waits for any child of the running process to die, and returns
+   its tid, storing its exit status in *STATUS.  Children are
+   reaped in the order they exit, not the order they were
+   started.  If NOHANG is true and no child has exited yet,
+   returns 0 at once instead of waiting.  Returns TID_ERROR if
+   the process has no children left to wait for. */
+tid_t
+process_wait_any (int *status, bool nohang)
+{
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
+  old_level = intr_disable ();
+  for (;;)
+    {
+      if (!list_empty (&cur->exited_children))
+        {
+          struct child_data *cd = list_entry (list_front (&cur->exited_children),
+                                              struct child_data, exit_elem);
+          tid_t tid = cd->tid;
+
+          intr_set_level (old_level);
+          *status = reap (cd);
+          return tid;
+        }
+      if (list_empty (&cur->children))
+        break;
+      if (nohang)
+        {
+          intr_set_level (old_level);
+          return 0;
+        }
+
+      /* A child reaped by process_wait() since it upped the
+         semaphore leaves it too high, so recheck on waking. */
+      sema_down (&cur->child_exited);
+    }
+  intr_set_level (old_level);
+  return TID_ERROR;
+}
+
+/* Removes CD, for a child of the running process that has exited,
+   from the process's lists, adds its resource use to the
+   process's total for its children, frees it if the child is done
+   with it too, and returns the child's exit status. */
+static int
+reap (struct child_data *cd)
+{
+  enum intr_level old_level;
+  int exit_status;
+
+  old_level = intr_disable ();
+  list_remove (&cd->elem);
+  list_remove (&cd->exit_elem);
+  usage_add (&thread_current ()->child_usage, &cd->usage);
+  exit_status = cd->status;
+  if (cd->ref_cnt == 1) {
+    thread_free_child_data (cd);
+  } else {
+    cd->ref_cnt--;
+  }
+  intr_set_level (old_level);
+  return exit_status;
+}
+
+/* Stores in *USAGE the resources used by WHO: the running
+   process if WHO is RUSAGE_SELF, the children it has waited for,
+   summed, if RUSAGE_CHILDREN, or otherwise the child with tid
+   WHO, if it has exited but not yet been waited for.  Returns
+   false if WHO is none of these. */
+bool
+process_get_usage (int who, struct rusage *usage)
+{
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+  struct list_elem *e;
+  bool found = false;
+
+  if (who == RUSAGE_SELF)
+    {
+      old_level = intr_disable ();
+      *usage = cur->process->usage;
+      intr_set_level (old_level);
+      usage->resident_pages = pagedir_count_present (cur->process->pagedir);
+      return true;
+    }
+
+  old_level = intr_disable ();
+  if (who == RUSAGE_CHILDREN)
+    {
+      *usage = cur->child_usage;
+      found = true;
+    }
+  else
+    for (e = list_begin (&cur->children); e != list_end (&cur->children);
+         e = list_next (e))
+      {
+        struct child_data *cd = list_entry (e, struct child_data, elem);
+        if (cd->tid == who && cd->ref_cnt < 2)
+          {
+            *usage = cd->usage;
+            found = true;
+            break;
+          }
+      }
+  intr_set_level (old_level);
+  return found;
+}
+
+/* Adds the counts in B to A.  RESIDENT_PAGES, a snapshot rather
+   than a count, adds up too, as the total the processes held as
+   they exited. */
+static void
+usage_add (struct rusage *a, const struct rusage *b)
+{
+  a->user_ticks += b->user_ticks;
+  a->system_ticks += b->system_ticks;
+  a->page_faults += b->page_faults;
+  a->resident_pages += b->resident_pages;
+  a->bytes_read += b->bytes_read;
+  a->bytes_written += b->bytes_written;
+  a->cache_hits += b->cache_hits;
+  a->cache_misses += b->cache_misses;
+  a->voluntary_switches += b->voluntary_switches;
+  a->involuntary_switches += b->involuntary_switches;
+}
+
 /* Free the current process's resources. */
 void
 process_exit (void)
 {
   struct thread *cur = thread_current ();
   uint32_t *pd;
+  enum intr_level old_level;
+
+  if (cur->process != cur)
+    {
+      uthread_exit ();
+      return;
+    }
+
+  /* The other threads use everything freed below, so they go
+     first. */
+  uthreads_stop ();
+
+  /* Workers may still be using the process's files. */
+  aio_destroy (cur);
 
   // Close all associated file descriptors to the current thread and free memory
-  struct list_elem *e;
-  enum intr_level old_level;
+  fd_table_destroy ();
+
 
+#ifdef VM
+  /* Write back mapped files, then free the page table, which
+     refers to the executable, before the executable is closed. */
+  mmap_destroy ();
+  page_table_destroy ();
+#endif
 
+  /* Leave our resource use for our parent, with what we hold in
+     memory as we go. */
   old_level = intr_disable ();
-  while (!list_empty (&cur->file_mappings)) {
-    struct list_elem *e = list_front (&cur->file_mappings);
-    struct fd_file_mapping *f = list_entry (e, struct fd_file_mapping, elem);
-    close(f->fd);
-  }
+  cur->data->usage = cur->usage;
   intr_set_level (old_level);
-
+  cur->data->usage.resident_pages = pagedir_count_present (cur->pagedir);
 
   /* Destroy the current process's page directory and switch back
      to the kernel-only page directory. */
@@ -161,30 +700,89 @@ process_exit (void)
       pagedir_destroy (pd);
     }
 
+  /* If the parent is still around, queue ourselves for
+     process_wait_any() in the same step that wakes any
+     process_wait() for us, so that an exited child is always
+     on the parent's exited_children. */
+  old_level = intr_disable ();
+  if (cur->data->ref_cnt == 2) {
+    list_push_back(&cur->data->parent->exited_children,
+                   &cur->data->exit_elem);
+    sema_up(&cur->data->parent->child_exited);
+  }
   sema_up(&cur->data->terminated);
+  intr_set_level (old_level);
+
+  release_children (cur);
+
+  if (cur->data->ref_cnt == 1) {
+    thread_free_child_data (cur->data);
+  } else {
+    cur->data->ref_cnt--;
+  }
+
+  file_close (cur->executable);
+
+}
 
+/* Lets go of T's children, freeing the child_data of those that
+   have exited. */
+static void
+release_children (struct thread *t)
+{
+  enum intr_level old_level;
 
   old_level = intr_disable ();
-  while (!list_empty (&cur->children)) {
-    struct list_elem *e = list_pop_front (&cur->children);
+  while (!list_empty (&t->children)) {
+    struct list_elem *e = list_pop_front (&t->children);
     struct child_data *cd = list_entry (e, struct child_data, elem);
     if (cd->ref_cnt == 1) {
-      free(cd);
+      thread_free_child_data (cd);
     } else {
       cd->ref_cnt--;
     }
   }
   intr_set_level (old_level);
+}
 
+/* Ends the running thread, a user thread other than its
+   process's first: gives up the process's page directory, which
+   the first thread destroys once every thread is gone, and
+   records that it has exited. */
+static void
+uthread_exit (void)
+{
+  struct thread *cur = thread_current ();
+  struct thread *p = cur->process;
 
-  if (cur->data->ref_cnt == 1) {
-    free(cur->data);
-  } else {
-    cur->data->ref_cnt--;
-  }
+  cur->pagedir = NULL;
+  pagedir_activate (NULL);
+  release_children (cur);
 
-  file_close (cur->executable);
+  lock_acquire (&p->uthread_lock);
+  cur->uthread->exited = true;
+  p->uthread_cnt--;
+  cond_broadcast (&p->uthread_exited, &p->uthread_lock);
+  lock_release (&p->uthread_lock);
+}
+
+/* Stops the running process's other threads and waits for them
+   to exit, then frees their records.  Threads blocked in a system
+   call other than futex_wait() or thread_join() stop once it
+   returns. */
+static void
+uthreads_stop (void)
+{
+  struct thread *cur = thread_current ();
 
+  process_begin_exit ();
+  lock_acquire (&cur->uthread_lock);
+  while (cur->uthread_cnt > 0)
+    cond_wait (&cur->uthread_exited, &cur->uthread_lock);
+  while (!list_empty (&cur->uthreads))
+    free (list_entry (list_pop_front (&cur->uthreads),
+                      struct uthread, elem));
+  lock_release (&cur->uthread_lock);
 }
 
 /* Sets up the CPU for running user code in the current
@@ -195,8 +793,14 @@ process_activate (void)
 {
   struct thread *t = thread_current ();
 
-  /* Activate thread's page tables. */
-  pagedir_activate (t->pagedir);
+  /* Activate thread's page tables.  A kernel thread has no user
+     mappings, and every page directory maps the kernel alike, so
+     it keeps running on whatever page directory is loaded rather
+     than flushing the TLB of the process it interrupted.  A
+     process switches to init_page_dir itself before destroying
+     its page directory, so the loaded one is never freed. */
+  if (t->pagedir != NULL)
+    pagedir_activate (t->pagedir);
 
   /* Set thread's kernel stack for use in processing
      interrupts. */
@@ -272,20 +876,15 @@ static bool load_segment (struct file *file, off_t ofs, uint8_t *upage,
                           uint32_t read_bytes, uint32_t zero_bytes,
                           bool writable);
 
-/* Loads an ELF executable from FILE_NAME into the current thread.
+/* Loads the ELF executable named by ARGS's first argument into
+   the current thread, with ARGS on its stack.
    Stores the executable's entry point into *EIP
    and its initial stack pointer into *ESP.
    Returns true if successful, false otherwise. */
-bool
-load (const char *file_name, void (**eip) (void), void **esp)
+static bool
+load (const struct exec_args *args, void (**eip) (void), void **esp)
 {
-  char file_copy[128];
-  strlcpy(file_copy, file_name, 128);
-  char *index;
-  char *token = strtok_r(file_copy, " ", &index);
-
-  char *name = token;
-
+  const char *name = args->argv[0];
   struct thread *t = thread_current ();
   struct Elf32_Ehdr ehdr;
   struct file *file = NULL;
@@ -297,6 +896,10 @@ load (const char *file_name, void (**eip) (void), void **esp)
   t->pagedir = pagedir_create ();
   if (t->pagedir == NULL)
     goto done;
+#ifdef VM
+  if (!page_table_create ())
+    goto done;
+#endif
   process_activate ();
 
   /* Open executable file. */
@@ -363,6 +966,11 @@ load (const char *file_name, void (**eip) (void), void **esp)
                   read_bytes = page_offset + phdr.p_filesz;
                   zero_bytes = (ROUND_UP (page_offset + phdr.p_memsz, PGSIZE)
                                 - read_bytes);
+
+                  /* Tell the cache the whole segment is wanted, so
+                     it arrives in a few large reads rather than
+                     one sector per request. */
+                  file_prefetch (file, file_page, read_bytes);
                 }
               else
                 {
@@ -374,6 +982,13 @@ load (const char *file_name, void (**eip) (void), void **esp)
               if (!load_segment (file, file_page, (void *) mem_page,
                                  read_bytes, zero_bytes, writable))
                 goto done;
+#ifdef VM
+              /* The heap starts past the highest segment. */
+              if ((uint8_t *) mem_page + read_bytes + zero_bytes
+                  > t->heap_start)
+                t->heap_start = t->heap_brk
+                  = (uint8_t *) mem_page + read_bytes + zero_bytes;
+#endif
             }
           else
             goto done;
@@ -384,51 +999,30 @@ load (const char *file_name, void (**eip) (void), void **esp)
   if (!setup_stack (esp))
     goto done;
 
-  // Assuming arguments never reach more than 128 in the tests
-  int argc = 0;
-  char* argv_value[64];
-  void* argv_address[64];
-
-  int length;
-  for (; token != NULL; token = strtok_r(NULL, " ", &index)) {
-    argv_value[argc] = token;
-    argc += 1;
-  }
-
-  for(i=argc-1; i>=0; i--){
-    length = strlen(argv_value[i])+1;
-    *esp -= length;
-    memcpy(*esp, argv_value[i], length);
-    argv_address[i] = *esp;
-  }
-  // Word Align
-  int mod4 = ((uint32_t)(*esp))%4;
-  (*esp)-=mod4;
-  memset(*esp, 0, mod4);
-  
-  // For the last element of argv[i] (null pointer)
-  (*esp)-=4;
-  memset(*esp, 0, 4);
-
-  // Stack addresses for all the inserted arv[i]
-  for(i=argc-1; i>=0; i--){
-    (*esp)-=4;
-    memcpy(*esp, &argv_address[i], 4);
+  /* Push the argument strings in one copy, then argv, each
+     pointer moved from ARGS's copy of the strings to the
+     stack's, then argv itself, argc, and a null return address.
+     The stack page is zeroed, so the padding already is too. */
+  {
+    char *strings = (char *) *esp - args->str_len;
+    ptrdiff_t delta = strings - args_strings (args);
+    char **argv;
+    uint32_t *sp;
+
+    memcpy (strings, args_strings (args), args->str_len);
+    argv = (char **) ROUND_DOWN ((uintptr_t) strings, sizeof (char *))
+           - (args->argc + 1);
+    for (i = 0; i < args->argc; i++)
+      argv[i] = args->argv[i] + delta;
+    argv[args->argc] = NULL;
+
+    sp = (uint32_t *) argv;
+    *--sp = (uint32_t) argv;
+    *--sp = args->argc;
+    *--sp = 0;
+    *esp = sp;
   }
 
-  // Address of argv
-  void* argvloc = *esp;
-  *esp-=4;
-  memcpy(*esp, &argvloc,4);
-
-  // Argc
-  *esp-=4;
-  *((int*)(*esp)) = argc;
-
-  // Return Address set to NULL
-  *esp-=4;
-  memset(*esp, 0, 4);
-
   /* Start address. */
   *eip = (void (*) (void)) ehdr.e_entry;
   
@@ -440,7 +1034,9 @@ load (const char *file_name, void (**eip) (void), void **esp)
 
 /* load() helpers. */
 
+#ifndef VM
 static bool install_page (void *upage, void *kpage, bool writable);
+#endif
 
 /* Checks whether PHDR describes a valid, loadable segment in
    FILE and returns true if so, false otherwise. */
@@ -499,6 +1095,9 @@ validate_segment (const struct Elf32_Phdr *phdr, struct file *file)
    The pages initialized by this function must be writable by the
    user process if WRITABLE is true, read-only otherwise.
 
+   With VM, the pages are only recorded in the supplemental page
+   table, to be read in by page_fault() when first touched.
+
    Return true if successful, false if a memory allocation error
    or disk read error occurs. */
 static bool
@@ -509,6 +1108,22 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
   ASSERT (pg_ofs (upage) == 0);
   ASSERT (ofs % PGSIZE == 0);
 
+#ifdef VM
+  while (read_bytes > 0 || zero_bytes > 0)
+    {
+      size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
+      size_t page_zero_bytes = PGSIZE - page_read_bytes;
+
+      if (!page_add_file (upage, file, ofs, page_read_bytes, writable))
+        return false;
+
+      read_bytes -= page_read_bytes;
+      zero_bytes -= page_zero_bytes;
+      ofs += page_read_bytes;
+      upage += PGSIZE;
+    }
+  return true;
+#else
   file_seek (file, ofs);
   while (read_bytes > 0 || zero_bytes > 0)
     {
@@ -544,6 +1159,7 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
       upage += PGSIZE;
     }
   return true;
+#endif
 }
 
 /* Create a minimal stack by mapping a zeroed page at the top of
@@ -551,6 +1167,13 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 static bool
 setup_stack (void **esp)
 {
+#ifdef VM
+  uint8_t *upage = ((uint8_t *) PHYS_BASE) - PGSIZE;
+  if (!page_add_zero (upage, true) || !page_load (upage))
+    return false;
+  *esp = PHYS_BASE;
+  return true;
+#else
   uint8_t *kpage;
   bool success = false;
 
@@ -564,8 +1187,10 @@ setup_stack (void **esp)
         palloc_free_page (kpage);
     }
   return success;
+#endif
 }
 
+#ifndef VM
 /* Adds a mapping from user virtual address UPAGE to kernel
    virtual address KPAGE to the page table.
    If WRITABLE is true, the user process may modify the page;
@@ -585,3 +1210,4 @@ install_page (void *upage, void *kpage, bool writable)
   return (pagedir_get_page (t->pagedir, upage) == NULL
           && pagedir_set_page (t->pagedir, upage, kpage, writable));
 }
+#endif
@@ -4,7 +4,18 @@
 #include "threads/thread.h"
 
 tid_t process_execute (const char *file_name);
+tid_t process_execute_argv (int argc, char *const argv[]);
+#ifdef VM
+struct intr_frame;
+tid_t process_fork (const struct intr_frame *);
+#endif
+tid_t process_thread_create (void (*eip) (void), void *esp);
+bool process_thread_join (tid_t);
+bool process_begin_exit (void);
+void process_stop_if_exiting (void);
 int process_wait (tid_t);
+tid_t process_wait_any (int *status, bool nohang);
+bool process_get_usage (int who, struct rusage *);
 void process_exit (void);
 void process_activate (void);
 
@@ -2,25 +2,81 @@
 #include <stdio.h>
 #include <syscall-nr.h>
 #include <limits.h>
+#include <round.h>
 #include "threads/interrupt.h"
 #include "threads/thread.h"
+#include "threads/trace.h"
 #include "threads/vaddr.h"
+#include "userprog/aio.h"
+#include "userprog/futex.h"
 #include "userprog/pagedir.h"
+#include "userprog/pipe.h"
+#include "userprog/process.h"
+#include "userprog/tss.h"
 #include "filesys/filesys.h"
+#include "filesys/directory.h"
 #include "filesys/file.h"
 #include <stdbool.h>
 #include "filesys/inode.h"
 #include "filesys/cache.h"
+#include "devices/block.h"
+#include "devices/e1000.h"
+#include "devices/input.h"
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/slab.h"
+#ifdef VM
+#include "vm/page.h"
+#include "vm/shm.h"
+#endif
+#include <bitmap.h>
+#include <string.h>
 
 #define READDIR_MAX_LEN 14
 
+/* Initial and largest number of slots in a process's fd table.
+   The table doubles in size as it fills up. */
+#define FD_TABLE_INIT 16
+#define FD_TABLE_MAX 4096
+
+/* Most buffers readv() or writev() accept at once. */
+#define IOV_MAX 1024
+
+/* Directory entries getdents() gathers in the kernel before
+   copying them out. */
+#define GETDENTS_CHUNK 16
+
+/* Frames net_send() copies into packet buffers before handing
+   them to the network device. */
+#define NET_SEND_BATCH 16
+
+#ifdef VM
+/* A memory-mapped file. */
+struct mmap_mapping
+  {
+    int id;                     /* Mapping id. */
+    struct file *file;          /* Backing file, opened separately
+                                   from the fd it was mapped through. */
+    uint8_t *addr;              /* First mapped page. */
+    size_t page_cnt;            /* Number of mapped pages. */
+    struct list_elem elem;      /* Element in thread's mmaps list. */
+  };
+#endif
+
+/* Allocator for `struct fd_file_mapping'. */
+static struct kmem_cache *fd_mapping_cache;
+
 static void syscall_handler (struct intr_frame *);
+static void count_io (int result, bool write);
 int is_valid_vaddr(void *vaddr);
-int range_is_valid(void*vaddr, int range);
+int range_is_valid(const void *vaddr, size_t size);
+int str_is_valid(const char *str);
 
 int practice(int i);
 void halt();
 void exit(int status);
+pid_t exec(const char *cmd_line);
+int wait(pid_t pid);
 int open(const char* file);
 int read(int fd, const void* buffer, unsigned size);
 int write(int fd, const void* buffer, unsigned size);
@@ -34,541 +90,2114 @@ bool chdir (const char *dir);
 bool mkdir (const char *dir);
 bool isdir (int fd);
 bool readdir (int fd, char *name);
+int getdents (int fd, struct dirent *buf, unsigned size);
+bool fstat (int fd, struct stat *st);
+bool stat (const char *file, struct stat *st);
+int defrag (const char *file);
 int inumber (int fd);
 int cache_tries (void);
 int cache_hits (void);
 int disk_reads (void);
 int disk_writes (void);
 void cache_reset (void);
+bool fsync (int fd);
+int readv (int fd, const struct iovec *iov, int iovcnt);
+int writev (int fd, const struct iovec *iov, int iovcnt);
+static bool iov_is_valid (const struct iovec *iov, int iovcnt);
+int pread (int fd, void *buffer, unsigned size, unsigned offset);
+int pwrite (int fd, const void *buffer, unsigned size, unsigned offset);
+bool sched_stats (struct sched_stats *stats);
+bool getrusage (pid_t pid, struct rusage *usage);
+bool fsstats (struct fs_stats *stats);
+bool blockstats (unsigned idx, struct block_stats *stats);
+bool net_info (uint8_t mac[ETH_ADDR_LEN]);
+int net_send (const struct iovec *packets, int cnt);
+int net_recv (void *buffer, unsigned size);
+int aio_read (int fd, void *buffer, unsigned size, unsigned offset);
+int aio_write (int fd, const void *buffer, unsigned size, unsigned offset);
+int batch (struct batch_op *ops, int cnt);
+pid_t exec_argv (char *const argv[]);
+pid_t waitany (int *status, int options);
+#ifdef VM
+pid_t do_fork (struct intr_frame *f);
+int mmap (int fd, void *addr);
+void munmap (int mapping);
+void *sbrk (intptr_t increment);
+void *shm_map (int id, void *addr);
+static void mmap_unmap (struct mmap_mapping *m);
+#endif
+bool pipe (int *fds);
+tid_t do_thread_create (void (*eip) (void), void *func, void *aux,
+                        void *stack_top);
+static struct fd_file_mapping *fd_lookup (int fd);
+static struct fd_file_mapping *fd_lookup_file (int fd);
+static bool fd_table_dup (struct thread *parent, bool pipes_only);
+static int fd_install (struct fd_file_mapping *mapping);
+static struct fd_file_mapping *fd_remove (int fd);
+static void fd_put (struct fd_file_mapping *);
+static pid_t wait_for_load (tid_t tid);
+
+/* CPUID leaf 1 %edx bit for SYSENTER and SYSEXIT. */
+#define CPUID_SEP (1u << 11)
+
+/* Entry point for SYSENTER, in sysenter.S. */
+void syscall_sysenter (void);
+
+/* Returns true if the CPU has working SYSENTER and SYSEXIT.
+   The earliest Pentium Pro steppings set the CPUID bit without
+   implementing the instructions. */
+static bool
+sysenter_supported (void)
+{
+  uint32_t eax = 1, ebx, ecx, edx;
+  unsigned family, model, stepping;
+
+  asm ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+  if ((edx & CPUID_SEP) == 0)
+    return false;
+  family = (eax >> 8) & 0xf;
+  model = (eax >> 4) & 0xf;
+  stepping = eax & 0xf;
+  return !(family == 6 && model < 3 && stepping < 3);
+}
 
 void
 syscall_init (void)
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
+  if (sysenter_supported ())
+    tss_init_sysenter (syscall_sysenter);
+  futex_init ();
+  aio_init ();
+  fd_mapping_cache = kmem_cache_create ("fd-mapping",
+                                        sizeof (struct fd_file_mapping),
+                                        NULL);
+  if (fd_mapping_cache == NULL)
+    PANIC ("fd mapping cache creation failed");
 }
 
+/* System call handlers.  Each receives the interrupt frame and
+   the user stack, whose first word is the system call number
+   and whose next words are the arguments.  syscall_handler()
+   has already checked that the argument words are readable, but
+   any pointers among them are the handler's to check. */
 static void
-syscall_handler (struct intr_frame *f UNUSED)
+sys_practice (struct intr_frame *f, uint32_t *args)
 {
-  void* buffer_addr, *file_name, *cmd_line;
-  uint32_t* args = ((uint32_t*) f->esp);
-  // make sure esp pointer is in valid memory portion
-  range_is_valid(args, 4);
+  f->eax = practice (args[1]);
+}
 
-  switch(args[0]){
-    // Process Control Syscalls
-    case SYS_PRACTICE:
-      range_is_valid(args, 8);
-      f->eax = practice(args[1]);
-      break;
-    case SYS_HALT:
-      halt();
-      break;
-    case SYS_EXIT:
-      range_is_valid(args, 8);
-      exit(args[1]); 
-      break;
-    case SYS_EXEC:
-      range_is_valid(args, 8);
-      cmd_line = (char *) args[1];
-      is_valid_vaddr(cmd_line);
-      f->eax = exec(cmd_line);
-      break;
-    case SYS_WAIT:
-      range_is_valid(args, 8);
-      f->eax = wait(args[1]);
-      break;
-    // File Operation Syscalls
-    case SYS_CREATE:
-      range_is_valid(args, 12);
-      file_name = (void*) args[1];
-      is_valid_vaddr(file_name);
-      f->eax = create(args[1], args[2]);
-      break;
-    case SYS_REMOVE:
-      range_is_valid(args, 8);
-      file_name= (void*) args[1];
-      is_valid_vaddr(file_name);
-      f->eax = remove(args[1]);
-      break;
-    case SYS_OPEN:
-      range_is_valid(args, 8);
-      file_name = (void*) args[1];
-      is_valid_vaddr(file_name);
-      f->eax = open((char*)args[1]);
-      break;
-    case SYS_READ:
-      range_is_valid(args, 16);
-      buffer_addr = (void*) args[2];
-      range_is_valid(buffer_addr, args[3]);
-      f->eax = read(args[1], (const void*)args[2], (unsigned)args[3]);
-      break;
-    case SYS_WRITE:
-      range_is_valid(args, 16);
-      buffer_addr = (void*) args[2];
-      range_is_valid(buffer_addr, args[3]);
-      f->eax = write(args[1], (const void*)args[2], (unsigned)args[3]);
-      break;
-    case SYS_CLOSE:
-      range_is_valid(args, 8);
-      close(args[1]);
-      break;
-    case SYS_FILESIZE:
-      range_is_valid(args, 8);
-      f->eax = filesize(args[1]);
-      break;
-    case SYS_SEEK:
-      range_is_valid(args, 12);
-      seek(args[1], args[2]);
-      break;
-    case SYS_TELL:
-      range_is_valid(args, 8);
-      f->eax = tell(args[1]);
-      break;
-    // Directory Syscalls
-    case SYS_CHDIR:
-      range_is_valid(args, 8);
-      file_name = (void*) args[1];
-      is_valid_vaddr(file_name);
-      f->eax = chdir((char*)args[1]);
-      break;
-    case SYS_MKDIR:
-      range_is_valid(args, 8);
-      file_name = (void*) args[1];
-      is_valid_vaddr(file_name);
-      f->eax = mkdir((char*)args[1]);
-      break;
-    case SYS_READDIR:
-      range_is_valid(args, 12);
-      file_name = (void*) args[2];
-      is_valid_vaddr(file_name);
-      f->eax = readdir(args[1], (char*) args[2]);
-      break;
-    case SYS_ISDIR:
-      range_is_valid(args, 8);
-      f->eax = isdir(args[1]);
-      break;
-    // Other Syscalls
-    case SYS_INUMBER:
-      range_is_valid(args, 8);
-      f->eax = inumber(args[1]);
-      break;
-    case SYS_CACHETRIES:
-      f->eax = cache_tries ();
-      break;
-    case SYS_CACHEHITS:
-      f->eax = cache_hits ();
-      break;
-    case SYS_DISKREADS:
-      f->eax = disk_reads ();
-      break;
-    case SYS_DISKWRITES:
-      f->eax = disk_writes ();
-      break;
-  }
+static void
+sys_halt (struct intr_frame *f UNUSED, uint32_t *args UNUSED)
+{
+  halt ();
 }
 
-/* Return 1 if VADDR is a valid virtual address. 
-   Otherwise, exit with -1 status code. */
-int is_valid_vaddr(void *vaddr){
-  if(vaddr == NULL || !is_user_vaddr(vaddr) || 
-    !pagedir_get_page(thread_current()->pagedir, vaddr)){
-    exit(-1);
-  }
-  return 1;
+static void
+sys_exit (struct intr_frame *f UNUSED, uint32_t *args)
+{
+  exit (args[1]);
 }
 
-/* Return 1 if [VADDR, VADDR+range) are all valid virtual addresses. 
-   Otherwise, exit with -1 status code. */
-int range_is_valid(void *vaddr, int range){
-  is_valid_vaddr(vaddr);
-  is_valid_vaddr(vaddr + range -1);
-  return 1;
+static void
+sys_exec (struct intr_frame *f, uint32_t *args)
+{
+  str_is_valid ((char *) args[1]);
+  f->eax = exec ((char *) args[1]);
 }
 
-/* Process Control Syscalls*/
+static void
+sys_waitany (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = waitany ((int *) args[1], (int) args[2]);
+}
 
-int practice(int i){
-  return i + 1;
+static void
+sys_execv (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = exec_argv ((char *const *) args[1]);
 }
 
-void halt(){
-    shutdown_power_off();
+static void
+sys_wait (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = wait (args[1]);
 }
 
-void exit(int status){
-  thread_current()->data->status = status;
-  printf("%s: exit(%d)\n", &thread_current ()->name, status);
-  thread_exit();
+static void
+sys_create (struct intr_frame *f, uint32_t *args)
+{
+  str_is_valid ((char *) args[1]);
+  f->eax = create ((char *) args[1], args[2]);
 }
 
-int wait(pid_t pid) {
-  return process_wait((tid_t) pid);
+static void
+sys_remove (struct intr_frame *f, uint32_t *args)
+{
+  str_is_valid ((char *) args[1]);
+  f->eax = remove ((char *) args[1]);
 }
 
-pid_t exec (const char *cmd_line) {
-  struct child_data* cd;
-  enum intr_level old_level;
+static void
+sys_open (struct intr_frame *f, uint32_t *args)
+{
+  str_is_valid ((char *) args[1]);
+  f->eax = open ((char *) args[1]);
+}
 
-  tid_t tid = process_execute(cmd_line);
-  if (tid == TID_ERROR) {
-    return -1;
-  }
+static void
+sys_read (struct intr_frame *f, uint32_t *args)
+{
+  range_is_valid ((void *) args[2], args[3]);
+  f->eax = read (args[1], (const void *) args[2], (unsigned) args[3]);
+  count_io (f->eax, false);
+}
 
-  old_level = intr_disable ();
-  struct list_elem *e;
-  for (e = list_begin (&thread_current()->children); 
-       e != list_end (&thread_current()->children); 
-       e = list_next (e))
-  {
-      cd = list_entry (e, struct child_data, elem);
-      if (cd->tid == tid) {
-        if (cd->load_status == 0) {
-          sema_down(&cd->loaded);
-        }
-        if (cd->load_status == -1) {
-          intr_set_level (old_level);
-          return -1;
-        }
-        break;
-      }
-  }
-  intr_set_level (old_level);
-  return (pid_t) tid;
+static void
+sys_write (struct intr_frame *f, uint32_t *args)
+{
+  range_is_valid ((void *) args[2], args[3]);
+  f->eax = write (args[1], (const void *) args[2], (unsigned) args[3]);
+  count_io (f->eax, true);
 }
 
-/* File Operation Syscalls */
+static void
+sys_close (struct intr_frame *f UNUSED, uint32_t *args)
+{
+  close (args[1]);
+}
 
-bool create(const char* file, unsigned initial_size){
+static void
+sys_filesize (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = filesize (args[1]);
+}
 
-  if(file == NULL){
-    return 0;
-  }
+static void
+sys_seek (struct intr_frame *f UNUSED, uint32_t *args)
+{
+  seek (args[1], args[2]);
+}
 
-  int temp = filesys_create(file, initial_size, false);
+static void
+sys_tell (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = tell (args[1]);
+}
 
-  return temp;
+static void
+sys_chdir (struct intr_frame *f, uint32_t *args)
+{
+  str_is_valid ((char *) args[1]);
+  f->eax = chdir ((char *) args[1]);
 }
 
-// Copied from create
-bool remove(const char* file){
+static void
+sys_mkdir (struct intr_frame *f, uint32_t *args)
+{
+  str_is_valid ((char *) args[1]);
+  f->eax = mkdir ((char *) args[1]);
+}
 
-  if (file == NULL){
-    return 0;
-  }
+static void
+sys_readdir (struct intr_frame *f, uint32_t *args)
+{
+  range_is_valid ((void *) args[2], READDIR_MAX_LEN + 1);
+  f->eax = readdir (args[1], (char *) args[2]);
+}
 
-  int temp = filesys_remove(file);
+static void
+sys_getdents (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = getdents (args[1], (struct dirent *) args[2], (unsigned) args[3]);
+}
 
-  return temp;
+static void
+sys_fstat (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = fstat (args[1], (struct stat *) args[2]);
 }
 
-int open(const char* file){
+static void
+sys_stat (struct intr_frame *f, uint32_t *args)
+{
+  str_is_valid ((char *) args[1]);
+  f->eax = stat ((const char *) args[1], (struct stat *) args[2]);
+}
 
-  if(file == NULL){
-    return -1; 
-  }
+static void
+sys_defrag (struct intr_frame *f, uint32_t *args)
+{
+  str_is_valid ((char *) args[1]);
+  f->eax = defrag ((const char *) args[1]);
+}
 
-  struct file* f = filesys_open(file);
-  if(f == NULL){
-    return -1;
-  }
+static void
+sys_pipe (struct intr_frame *f, uint32_t *args)
+{
+  range_is_valid ((void *) args[1], 2 * sizeof (int));
+  f->eax = pipe ((int *) args[1]);
+}
 
-  struct fd_file_mapping* newFileBlock = (struct fd_file_mapping*) malloc(sizeof(struct fd_file_mapping));
-  if (newFileBlock == NULL) {
-    return -1;
+static void
+sys_thread_create (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = do_thread_create ((void (*) (void)) args[1], (void *) args[2],
+                             (void *) args[3], (void *) args[4]);
+}
+
+static void
+sys_thread_join (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = process_thread_join (args[1]);
+}
+
+static void
+sys_thread_exit (struct intr_frame *f UNUSED, uint32_t *args UNUSED)
+{
+  thread_exit ();
+}
+
+static void
+sys_futex_wait (struct intr_frame *f, uint32_t *args)
+{
+  int *uaddr = (int *) args[1];
+
+  if ((uintptr_t) uaddr % sizeof *uaddr != 0) {
+    f->eax = -1;
+    return;
   }
-  newFileBlock->file = f;
-  thread_current()->last_fd++;
-  newFileBlock->fd = thread_current()->last_fd;
-  newFileBlock->is_dir = file_isdir(f);
-  
-  list_push_back(&thread_current()->file_mappings, &newFileBlock->elem);
+  range_is_valid (uaddr, sizeof *uaddr);
+  f->eax = futex_wait (uaddr, args[2]);
+}
 
-  return newFileBlock->fd;
+static void
+sys_futex_wake (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = futex_wake ((int *) args[1], args[2]);
+}
+
+static void
+sys_isdir (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = isdir (args[1]);
+}
+
+static void
+sys_inumber (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = inumber (args[1]);
+}
+
+static void
+sys_cache_tries (struct intr_frame *f, uint32_t *args UNUSED)
+{
+  f->eax = cache_tries ();
+}
+
+static void
+sys_cache_hits (struct intr_frame *f, uint32_t *args UNUSED)
+{
+  f->eax = cache_hits ();
+}
+
+static void
+sys_disk_reads (struct intr_frame *f, uint32_t *args UNUSED)
+{
+  f->eax = disk_reads ();
+}
+
+static void
+sys_disk_writes (struct intr_frame *f, uint32_t *args UNUSED)
+{
+  f->eax = disk_writes ();
+}
+
+static void
+sys_fsync (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = fsync (args[1]);
+}
+
+static void
+sys_readv (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = readv (args[1], (const struct iovec *) args[2], (int) args[3]);
+  count_io (f->eax, false);
+}
+
+static void
+sys_writev (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = writev (args[1], (const struct iovec *) args[2], (int) args[3]);
+  count_io (f->eax, true);
+}
+
+static void
+sys_pread (struct intr_frame *f, uint32_t *args)
+{
+  range_is_valid ((void *) args[2], args[3]);
+  f->eax = pread (args[1], (void *) args[2], (unsigned) args[3],
+                  (unsigned) args[4]);
+  count_io (f->eax, false);
+}
+
+static void
+sys_pwrite (struct intr_frame *f, uint32_t *args)
+{
+  range_is_valid ((void *) args[2], args[3]);
+  f->eax = pwrite (args[1], (const void *) args[2], (unsigned) args[3],
+                   (unsigned) args[4]);
+  count_io (f->eax, true);
+}
+
+static void
+sys_sched_stats (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = sched_stats ((struct sched_stats *) args[1]);
+}
+
+static void
+sys_getrusage (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = getrusage ((pid_t) args[1], (struct rusage *) args[2]);
+}
+
+static void
+sys_fsstats (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = fsstats ((struct fs_stats *) args[1]);
+}
+
+static void
+sys_blockstats (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = blockstats (args[1], (struct block_stats *) args[2]);
+}
+
+static void
+sys_net_info (struct intr_frame *f, uint32_t *args)
+{
+  range_is_valid ((void *) args[1], ETH_ADDR_LEN);
+  f->eax = net_info ((uint8_t *) args[1]);
+}
+
+static void
+sys_net_send (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = net_send ((const struct iovec *) args[1], (int) args[2]);
+}
+
+static void
+sys_net_recv (struct intr_frame *f, uint32_t *args)
+{
+  range_is_valid ((void *) args[1], args[2]);
+  f->eax = net_recv ((void *) args[1], (unsigned) args[2]);
+}
+
+static void
+sys_aio_read (struct intr_frame *f, uint32_t *args)
+{
+  range_is_valid ((void *) args[2], args[3]);
+  f->eax = aio_read (args[1], (void *) args[2], args[3], args[4]);
+}
+
+static void
+sys_aio_write (struct intr_frame *f, uint32_t *args)
+{
+  range_is_valid ((void *) args[2], args[3]);
+  f->eax = aio_write (args[1], (const void *) args[2], args[3], args[4]);
+}
+
+static void
+sys_aio_wait (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = aio_collect (args[1], true);
+}
+
+static void
+sys_aio_poll (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = aio_collect (args[1], false);
+}
+
+/* Returns the timer ticks since boot, truncated to 32 bits;
+   differences between two calls are still right. */
+static void
+sys_ticks (struct intr_frame *f, uint32_t *args UNUSED)
+{
+  f->eax = (uint32_t) timer_ticks ();
+}
+
+static void
+sys_batch (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = batch ((struct batch_op *) args[1], (int) args[2]);
+}
+
+#ifdef VM
+static void
+sys_mmap (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = mmap (args[1], (void *) args[2]);
+}
+
+static void
+sys_munmap (struct intr_frame *f UNUSED, uint32_t *args)
+{
+  munmap (args[1]);
+}
+
+static void
+sys_sbrk (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = (uint32_t) sbrk ((intptr_t) args[1]);
+}
+
+static void
+sys_fork (struct intr_frame *f, uint32_t *args UNUSED)
+{
+  f->eax = do_fork (f);
+}
+
+static void
+sys_shm_open (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = shm_open (args[1], args[2]);
+}
+
+static void
+sys_shm_map (struct intr_frame *f, uint32_t *args)
+{
+  f->eax = (uint32_t) shm_map (args[1], (void *) args[2]);
+}
+#endif
+
+/* A system call: its handler and how many argument words it
+   takes from the user stack. */
+struct syscall
+  {
+    void (*handler) (struct intr_frame *, uint32_t *args);
+    int arg_cnt;
+  };
+
+/* System calls, indexed by number.  Numbers with no handler are
+   ignored, as they always have been. */
+static const struct syscall syscalls[] =
+  {
+    [SYS_HALT] = {sys_halt, 0},
+    [SYS_EXIT] = {sys_exit, 1},
+    [SYS_EXEC] = {sys_exec, 1},
+    [SYS_WAIT] = {sys_wait, 1},
+    [SYS_CREATE] = {sys_create, 2},
+    [SYS_REMOVE] = {sys_remove, 1},
+    [SYS_OPEN] = {sys_open, 1},
+    [SYS_FILESIZE] = {sys_filesize, 1},
+    [SYS_READ] = {sys_read, 3},
+    [SYS_WRITE] = {sys_write, 3},
+    [SYS_SEEK] = {sys_seek, 2},
+    [SYS_TELL] = {sys_tell, 1},
+    [SYS_CLOSE] = {sys_close, 1},
+    [SYS_PRACTICE] = {sys_practice, 1},
+#ifdef VM
+    [SYS_MMAP] = {sys_mmap, 2},
+    [SYS_MUNMAP] = {sys_munmap, 1},
+#endif
+    [SYS_CHDIR] = {sys_chdir, 1},
+    [SYS_MKDIR] = {sys_mkdir, 1},
+    [SYS_READDIR] = {sys_readdir, 2},
+    [SYS_ISDIR] = {sys_isdir, 1},
+    [SYS_INUMBER] = {sys_inumber, 1},
+    [SYS_CACHEHITS] = {sys_cache_hits, 0},
+    [SYS_CACHETRIES] = {sys_cache_tries, 0},
+    [SYS_DISKREADS] = {sys_disk_reads, 0},
+    [SYS_DISKWRITES] = {sys_disk_writes, 0},
+    [SYS_FSYNC] = {sys_fsync, 1},
+    [SYS_READV] = {sys_readv, 3},
+    [SYS_WRITEV] = {sys_writev, 3},
+    [SYS_PREAD] = {sys_pread, 4},
+    [SYS_PWRITE] = {sys_pwrite, 4},
+    [SYS_SCHEDSTATS] = {sys_sched_stats, 1},
+#ifdef VM
+    [SYS_FORK] = {sys_fork, 0},
+    [SYS_SBRK] = {sys_sbrk, 1},
+    [SYS_SHMOPEN] = {sys_shm_open, 2},
+    [SYS_SHMMAP] = {sys_shm_map, 2},
+#endif
+    [SYS_BATCH] = {sys_batch, 2},
+    [SYS_EXECV] = {sys_execv, 1},
+    [SYS_WAITANY] = {sys_waitany, 2},
+    [SYS_FSSTATS] = {sys_fsstats, 1},
+    [SYS_TICKS] = {sys_ticks, 0},
+    [SYS_GETDENTS] = {sys_getdents, 3},
+    [SYS_FSTAT] = {sys_fstat, 2},
+    [SYS_STAT] = {sys_stat, 2},
+    [SYS_PIPE] = {sys_pipe, 1},
+    [SYS_THREADCREATE] = {sys_thread_create, 4},
+    [SYS_THREADJOIN] = {sys_thread_join, 1},
+    [SYS_THREADEXIT] = {sys_thread_exit, 0},
+    [SYS_FUTEXWAIT] = {sys_futex_wait, 2},
+    [SYS_FUTEXWAKE] = {sys_futex_wake, 2},
+    [SYS_BLOCKSTATS] = {sys_blockstats, 2},
+    [SYS_AIOREAD] = {sys_aio_read, 4},
+    [SYS_AIOWRITE] = {sys_aio_write, 4},
+    [SYS_AIOWAIT] = {sys_aio_wait, 1},
+    [SYS_AIOPOLL] = {sys_aio_poll, 1},
+    [SYS_DEFRAG] = {sys_defrag, 1},
+    [SYS_GETRUSAGE] = {sys_getrusage, 2},
+    [SYS_NETINFO] = {sys_net_info, 1},
+    [SYS_NETSEND] = {sys_net_send, 2},
+    [SYS_NETRECV] = {sys_net_recv, 2},
+  };
+
+static void
+syscall_handler (struct intr_frame *f)
+{
+  uint32_t *args = f->esp;
+  const struct syscall *sc;
+#ifdef VM
+  thread_current()->user_esp = f->esp;
+#endif
+  // make sure esp pointer is in valid memory portion
+  range_is_valid(args, 4);
+
+  if (args[0] >= sizeof syscalls / sizeof *syscalls)
+    return;
+  sc = &syscalls[args[0]];
+  if (sc->handler == NULL)
+    return;
+  range_is_valid(args, 4 * (sc->arg_cnt + 1));
+  trace (TRACE_SYSCALL, args[0], sc->arg_cnt > 0 ? args[1] : 0);
+  sc->handler (f, args);
+  trace (TRACE_SYSCALL_DONE, args[0], f->eax);
+}
+
+/* Charges RESULT bytes, if RESULT is positive, to the running
+   process's bytes written if WRITE is true, or read otherwise. */
+static void
+count_io (int result, bool write)
+{
+  struct rusage *usage = thread_usage (thread_current ());
+
+  if (result <= 0)
+    return;
+  if (write)
+    usage->bytes_written += result;
+  else
+    usage->bytes_read += result;
+}
+
+/* Return 1 if VADDR is a valid virtual address. 
+   Otherwise, exit with -1 status code. */
+int is_valid_vaddr(void *vaddr){
+  if(vaddr == NULL || !is_user_vaddr(vaddr)){
+    exit(-1);
+  }
+  if(!pagedir_get_page(thread_current()->pagedir, vaddr)){
+#ifdef VM
+    /* Bring the page in now, rather than fault on it with
+       file system locks held.  It may be a buffer on a part of
+       the stack that hasn't been touched yet. */
+    if(page_load(vaddr)
+       || page_grow_stack(vaddr, thread_current()->user_esp)){
+      return 1;
+    }
+#endif
+    exit(-1);
+  }
+  return 1;
+}
+
+/* Return 1 if [VADDR, VADDR+SIZE) are all valid virtual addresses.
+   Otherwise, or if the range wraps around the top of the address
+   space, exit with -1 status code.  Looks up each page the range
+   touches once, rather than every byte. */
+int range_is_valid(const void *vaddr, size_t size){
+  uintptr_t start = (uintptr_t) vaddr;
+  uintptr_t last = start + (size > 0 ? size - 1 : 0);
+  uintptr_t page;
+
+  if (last < start) {
+    exit(-1);
+  }
+  is_valid_vaddr((void *) vaddr);
+  for (page = (uintptr_t) pg_round_down(vaddr) + PGSIZE;
+       page > start && page <= last; page += PGSIZE) {
+    is_valid_vaddr((void *) page);
+  }
+  return 1;
+}
+
+/* Return 1 if the null-terminated string at STR lies entirely in
+   valid virtual addresses.  Otherwise, exit with -1 status code. */
+int str_is_valid(const char *str){
+  is_valid_vaddr((void *) str);
+  while (*str != '\0') {
+    str++;
+    if (pg_ofs(str) == 0) {
+      is_valid_vaddr((void *) str);
+    }
+  }
+  return 1;
+}
+
+/* Copies SIZE bytes from user address USRC to kernel buffer DST,
+   a page at a time through the kernel's mapping of each user
+   page.  Exits with -1 status code if any byte is not valid. */
+void copy_from_user(void *dst, const void *usrc, size_t size){
+  uint8_t *d = dst;
+  const uint8_t *u = usrc;
+
+  while (size > 0) {
+    size_t chunk = PGSIZE - pg_ofs(u);
+    if (chunk > size) {
+      chunk = size;
+    }
+    is_valid_vaddr((void *) u);
+#ifdef VM
+    /* As in copy_to_user(). */
+    memcpy(d, u, chunk);
+#else
+    memcpy(d, pagedir_get_page(thread_current()->pagedir, u), chunk);
+#endif
+    d += chunk;
+    u += chunk;
+    size -= chunk;
+  }
+}
+
+/* Copies SIZE bytes from kernel buffer SRC to user address UDST,
+   a page at a time.  Exits with -1 status code if any byte is not
+   valid. */
+void copy_to_user(void *udst, const void *src, size_t size){
+  uint8_t *u = udst;
+  const uint8_t *s = src;
+
+  while (size > 0) {
+    size_t chunk = PGSIZE - pg_ofs(u);
+    if (chunk > size) {
+      chunk = size;
+    }
+    is_valid_vaddr(u);
+#ifdef VM
+    /* The page may be evicted at any time, so write through the
+       user mapping, which page_fault() can bring back and which
+       records the write in the page's dirty bit. */
+    memcpy(u, s, chunk);
+#else
+    memcpy(pagedir_get_page(thread_current()->pagedir, u), s, chunk);
+#endif
+    u += chunk;
+    s += chunk;
+    size -= chunk;
+  }
+}
+
+/* Process Control Syscalls*/
+
+int practice(int i){
+  return i + 1;
+}
+
+void halt(){
+    shutdown_power_off();
+}
+
+/* Ends the current process, with all its threads.  If another
+   thread got there first, its status stands. */
+void exit(int status){
+  if (process_begin_exit()) {
+    thread_current()->data->status = status;
+    printf("%s: exit(%d)\n", &thread_current ()->name, status);
+  }
+  thread_exit();
+}
+
+int wait(pid_t pid) {
+  return process_wait((tid_t) pid);
+}
+
+/* Waits for whichever child exits first and returns its pid,
+   storing its exit status in *STATUS unless STATUS is null.
+   With WNOHANG in OPTIONS, returns 0 rather than waiting if no
+   child has exited yet.  Returns -1 if there are no children. */
+pid_t waitany(int *status, int options) {
+  int exit_status;
+  tid_t tid;
+
+  if (status != NULL) {
+    range_is_valid(status, sizeof *status);
+  }
+  tid = process_wait_any(&exit_status, (options & WNOHANG) != 0);
+  if (tid > 0 && status != NULL) {
+    copy_to_user(status, &exit_status, sizeof exit_status);
+  }
+  return tid;
+}
+
+pid_t exec (const char *cmd_line) {
+  tid_t tid = process_execute(cmd_line);
+  if (tid == TID_ERROR) {
+    return -1;
+  }
+  return wait_for_load(tid);
+}
+
+/* Runs the program named by ARGV[0], passing it the arguments in
+   the null-terminated array ARGV as they are, without splitting
+   them at spaces.  Returns the new process's pid, or -1 if it
+   could not be started. */
+pid_t exec_argv (char *const argv[]) {
+  tid_t tid;
+  int argc;
+
+  for (argc = 0; ; argc++) {
+    if (argc > PGSIZE / (int) sizeof *argv) {
+      return -1;
+    }
+    range_is_valid((void *) &argv[argc], sizeof *argv);
+    if (argv[argc] == NULL) {
+      break;
+    }
+    str_is_valid(argv[argc]);
+  }
+
+  tid = process_execute_argv(argc, argv);
+  if (tid == TID_ERROR) {
+    return -1;
+  }
+  return wait_for_load(tid);
+}
+
+#ifdef VM
+/* Duplicates the current process, whose user registers are in F.
+   Returns the child's pid in the parent and 0 in the child, or -1
+   if the child couldn't be made. */
+pid_t do_fork (struct intr_frame *f) {
+  tid_t tid = process_fork(f);
+  if (tid == TID_ERROR) {
+    return -1;
+  }
+  return wait_for_load(tid);
+}
+#endif
+
+/* Starts a new thread in the current process running user code
+   at EIP, on the stack that ends at STACK_TOP, with FUNC and AUX
+   as the arguments of its first function call.  Returns the new
+   thread's tid, or -1 if it could not be started. */
+tid_t do_thread_create (void (*eip) (void), void *func, void *aux,
+                        void *stack_top) {
+  uint32_t frame[3];
+  uint8_t *sp;
+
+  if ((uintptr_t) stack_top < sizeof frame) {
+    return -1;
+  }
+
+  /* A null return address, then the arguments. */
+  frame[0] = 0;
+  frame[1] = (uint32_t) func;
+  frame[2] = (uint32_t) aux;
+  sp = (uint8_t *) ROUND_DOWN ((uintptr_t) stack_top, sizeof (uint32_t))
+       - sizeof frame;
+  copy_to_user (sp, frame, sizeof frame);
+  return process_thread_create (eip, sp);
+}
+
+/* Waits for child TID of the current process to finish loading
+   and returns its pid, or -1 if loading failed. */
+static pid_t wait_for_load (tid_t tid) {
+  struct child_data* cd;
+  enum intr_level old_level;
+
+  old_level = intr_disable ();
+  struct list_elem *e;
+  for (e = list_begin (&thread_current()->children); 
+       e != list_end (&thread_current()->children); 
+       e = list_next (e))
+  {
+      cd = list_entry (e, struct child_data, elem);
+      if (cd->tid == tid) {
+        if (cd->load_status == 0) {
+          sema_down(&cd->loaded);
+        }
+        if (cd->load_status == -1) {
+          intr_set_level (old_level);
+          return -1;
+        }
+        break;
+      }
+  }
+  intr_set_level (old_level);
+  return (pid_t) tid;
+}
+
+/* File Operation Syscalls */
+
+bool create(const char* file, unsigned initial_size){
+
+  if(file == NULL){
+    return 0;
+  }
+
+  int temp = filesys_create(file, initial_size, false);
+
+  return temp;
+}
+
+// Copied from create
+bool remove(const char* file){
+
+  if (file == NULL){
+    return 0;
+  }
+
+  int temp = filesys_remove(file);
+
+  return temp;
+}
+
+/* Returns the open file mapped to FD in the current process, or
+   a null pointer if FD is not open.  The process's threads share
+   its fds, so the mapping comes with a reference that keeps it
+   alive even if another thread closes FD meanwhile; the caller
+   must drop it with fd_put(). */
+static struct fd_file_mapping *
+fd_lookup (int fd)
+{
+  struct thread *t = thread_current ()->process;
+  struct fd_file_mapping *f = NULL;
+
+  lock_acquire (&t->fd_lock);
+  if (fd >= 0 && (size_t) fd < t->fd_table_size) {
+    f = t->fd_table[fd];
+    if (f != NULL) {
+      f->ref_cnt++;
+    }
+  }
+  lock_release (&t->fd_lock);
+  return f;
+}
+
+/* Returns the open file mapped to FD in the current process, as
+   fd_lookup() does, or a null pointer if FD is not open or is a
+   pipe, which has no file behind it. */
+static struct fd_file_mapping *
+fd_lookup_file (int fd)
+{
+  struct fd_file_mapping *f = fd_lookup (fd);
+
+  if (f != NULL && f->file == NULL) {
+    fd_put (f);
+    f = NULL;
+  }
+  return f;
+}
+
+/* Drops a reference to F, from fd_lookup() or the fd table.  The
+   last one closes F's file or pipe end and frees F. */
+static void
+fd_put (struct fd_file_mapping *f)
+{
+  struct thread *t = thread_current ()->process;
+  bool last;
+
+  lock_acquire (&t->fd_lock);
+  last = --f->ref_cnt == 0;
+  lock_release (&t->fd_lock);
+
+  if (last) {
+    if (f->pipe != NULL) {
+      pipe_close (f->pipe, f->pipe_writer);
+    } else {
+      file_close (f->file);
+    }
+    kmem_cache_free (fd_mapping_cache, f);
+  }
+}
+
+/* Doubles the size of T's fd table, up to FD_TABLE_MAX slots.
+   Returns false if the table is full or memory runs out. */
+static bool
+fd_table_grow (struct thread *t)
+{
+  size_t old_size = t->fd_table_size;
+  size_t new_size = old_size == 0 ? FD_TABLE_INIT : old_size * 2;
+  struct fd_file_mapping **table;
+  struct bitmap *used;
+  size_t i;
+
+  if (new_size > FD_TABLE_MAX) {
+    new_size = FD_TABLE_MAX;
+  }
+  if (new_size <= old_size) {
+    return false;
+  }
+
+  table = realloc (t->fd_table, new_size * sizeof *table);
+  if (table == NULL) {
+    return false;
+  }
+  t->fd_table = table;
+  memset (table + old_size, 0, (new_size - old_size) * sizeof *table);
+
+  used = bitmap_create (new_size);
+  if (used == NULL) {
+    return false;
+  }
+  if (t->fd_used == NULL) {
+    /* Reserve the console fds. */
+    bitmap_mark (used, STDIN_FILENO);
+    bitmap_mark (used, STDOUT_FILENO);
+  } else {
+    for (i = 0; i < old_size; i++) {
+      bitmap_set (used, i, bitmap_test (t->fd_used, i));
+    }
+    bitmap_destroy (t->fd_used);
+  }
+  t->fd_used = used;
+  t->fd_table_size = new_size;
+  return true;
+}
+
+/* Maps MAPPING to the lowest free fd in the current process and
+   returns it, or -1 if the process has too many files open. */
+static int
+fd_install (struct fd_file_mapping *mapping)
+{
+  struct thread *t = thread_current ()->process;
+  size_t fd = BITMAP_ERROR;
+
+  lock_acquire (&t->fd_lock);
+  if (t->fd_used != NULL) {
+    fd = bitmap_scan_and_flip (t->fd_used, 0, 1, false);
+  }
+  if (fd == BITMAP_ERROR) {
+    if (!fd_table_grow (t)) {
+      lock_release (&t->fd_lock);
+      return -1;
+    }
+    fd = bitmap_scan_and_flip (t->fd_used, 0, 1, false);
+  }
+  mapping->ref_cnt = 1;
+  t->fd_table[fd] = mapping;
+  lock_release (&t->fd_lock);
+  return fd;
+}
+
+/* Takes FD out of the current process's table, freeing its slot
+   for reuse, and returns its mapping with the table's reference,
+   or a null pointer if FD is not open.  Of several threads closing
+   FD at once, only one gets the mapping. */
+static struct fd_file_mapping *
+fd_remove (int fd)
+{
+  struct thread *t = thread_current ()->process;
+  struct fd_file_mapping *f = NULL;
+
+  lock_acquire (&t->fd_lock);
+  if (fd >= 0 && (size_t) fd < t->fd_table_size) {
+    f = t->fd_table[fd];
+    if (f != NULL) {
+      t->fd_table[fd] = NULL;
+      bitmap_reset (t->fd_used, fd);
+    }
+  }
+  lock_release (&t->fd_lock);
+  return f;
+}
+
+/* Closes every file the current process has open and frees its
+   fd table. */
+void
+fd_table_destroy (void)
+{
+  struct thread *t = thread_current ();
+  size_t fd;
+
+  for (fd = 0; fd < t->fd_table_size; fd++) {
+    if (t->fd_table[fd] != NULL) {
+      close (fd);
+    }
+  }
+  free (t->fd_table);
+  bitmap_destroy (t->fd_used);
+  t->fd_table = NULL;
+  t->fd_table_size = 0;
+  t->fd_used = NULL;
+}
+
+/* Gives the current process, which must have no files open, a
+   copy of each fd PARENT has open, under the same number: its own
+   end of each pipe and, unless PIPES_ONLY, its own handle on each
+   file, at the same position.  Returns false if memory runs
+   out. */
+static bool
+fd_table_dup (struct thread *parent, bool pipes_only)
+{
+  struct thread *t = thread_current ();
+  bool success = true;
+  size_t fd;
+
+  /* PARENT's other threads may be opening and closing files. */
+  lock_acquire (&parent->fd_lock);
+  for (fd = 0; fd < parent->fd_table_size; fd++) {
+    struct fd_file_mapping *pf = parent->fd_table[fd];
+    struct fd_file_mapping *cf;
+
+    if (pf == NULL || (pipes_only && pf->pipe == NULL)) {
+      continue;
+    }
+    while (success && t->fd_table_size <= fd) {
+      success = fd_table_grow (t);
+    }
+    cf = success ? kmem_cache_alloc (fd_mapping_cache) : NULL;
+    if (cf == NULL) {
+      success = false;
+      break;
+    }
+    if (pf->pipe != NULL) {
+      cf->file = NULL;
+      pipe_open (pf->pipe, pf->pipe_writer);
+    } else {
+      cf->file = file_reopen (pf->file);
+      if (cf->file == NULL) {
+        kmem_cache_free (fd_mapping_cache, cf);
+        success = false;
+        break;
+      }
+      file_seek (cf->file, file_tell (pf->file));
+    }
+    cf->fd = fd;
+    cf->is_dir = pf->is_dir;
+    cf->pipe = pf->pipe;
+    cf->pipe_writer = pf->pipe_writer;
+    cf->ref_cnt = 1;
+    t->fd_table[fd] = cf;
+    bitmap_mark (t->fd_used, fd);
+  }
+  lock_release (&parent->fd_lock);
+  return success;
+}
+
+/* Gives the current process, a child PARENT is starting with
+   exec(), its own end of each pipe PARENT has open, under the same
+   fd, so that pipes can connect the stages of a pipeline.  Files
+   are not inherited.  PARENT must be waiting for the child to
+   load.  Returns false if memory runs out. */
+bool
+fd_table_inherit (struct thread *parent)
+{
+  return fd_table_dup (parent->process, true);
+}
+
+/* Creates a pipe and stores the fd of its read end in FDS[0] and
+   that of its write end in FDS[1].  Returns false if memory runs
+   out or the process has too many files open. */
+bool pipe (int *fds) {
+  struct fd_file_mapping *ends[2];
+  int k[2];
+  int i;
+
+  struct pipe *p = pipe_create ();
+  if (p == NULL) {
+    return false;
+  }
+  for (i = 0; i < 2; i++) {
+    ends[i] = kmem_cache_alloc (fd_mapping_cache);
+    if (ends[i] == NULL) {
+      break;
+    }
+    ends[i]->file = NULL;
+    ends[i]->is_dir = false;
+    ends[i]->pipe = p;
+    ends[i]->pipe_writer = i == 1;
+    ends[i]->fd = k[i] = fd_install (ends[i]);
+    if (k[i] < 0) {
+      kmem_cache_free (fd_mapping_cache, ends[i]);
+      break;
+    }
+  }
+  if (i < 2) {
+    /* Each end closed here drops one of the pipe's counts. */
+    if (i == 1) {
+      close (k[0]);
+    } else {
+      pipe_close (p, false);
+    }
+    pipe_close (p, true);
+    return false;
+  }
+
+  copy_to_user (fds, k, sizeof k);
+  return true;
+}
+
+int open(const char* file){
+
+  if(file == NULL){
+    return -1; 
+  }
+
+  struct file* f = filesys_open(file);
+  if(f == NULL){
+    return -1;
+  }
+
+  struct fd_file_mapping* newFileBlock = kmem_cache_alloc(fd_mapping_cache);
+  if (newFileBlock == NULL) {
+    return -1;
+  }
+  newFileBlock->file = f;
+  newFileBlock->is_dir = file_isdir(f);
+  newFileBlock->pipe = NULL;
+  newFileBlock->fd = fd_install(newFileBlock);
+  if (newFileBlock->fd < 0) {
+    file_close(f);
+    kmem_cache_free(fd_mapping_cache, newFileBlock);
+    return -1;
+  }
+
+  return newFileBlock->fd;
+}
+
+int read(int fd, const void* buffer, unsigned size){
+  int i = -1;
+
+  if(fd == 1 || fd < 0 || fd > 4096){
+    return i;
+  }
+
+  if(fd == 0){
+    /* Drain whatever keys are queued into a kernel buffer and
+       copy them out a chunk at a time. */
+    uint8_t keys[64];
+    unsigned done, n;
+    for(done = 0; done < size; done += n){
+      n = size - done < sizeof keys ? size - done : sizeof keys;
+      n = input_getbuf(keys, n);
+      copy_to_user((char *) buffer + done, keys, n);
+    }
+    return size;
+  }
+
+
+  struct fd_file_mapping *f = fd_lookup (fd);
+  if (f != NULL) {
+    if (f->is_dir || (f->pipe != NULL && f->pipe_writer)) {
+      i = -1;
+    } else if (f->pipe != NULL) {
+      i = pipe_read (f->pipe, (void *) buffer, size);
+    } else {
+      i = file_read(f->file, buffer, size);
+    }
+    fd_put (f);
+  }
+
+  return i;
+}
+
+int write(int fd, const void* buffer, unsigned size){
+  int i=-1;
+  if(fd <=0 || fd>4096){
+    return i;
+  }
+
+  if(fd==1){
+    putbuf(buffer, size);
+    return size;
+  }
+
+
+  struct fd_file_mapping *f = fd_lookup (fd);
+  if (f != NULL) {
+    if (f->is_dir || (f->pipe != NULL && !f->pipe_writer)) {
+      i = -1;
+    } else if (f->pipe != NULL) {
+      i = pipe_write (f->pipe, buffer, size);
+    } else {
+      i = file_write(f->file, buffer, size);
+    }
+    fd_put (f);
+  }
+
+  return i;
+}
+
+void close(int fd){
+  if(fd <= 1 || fd > 4096){
+    return;
+  }
+
+  struct fd_file_mapping *f = fd_remove (fd);
+  if (f != NULL) {
+    fd_put (f);
+  }
+
+}
+
+int filesize(int fd) {
+  if (fd <= 1 || fd > 4096) {
+    return -1;
+  }
+
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f == NULL) {
+    return -1;
+  }
+
+  int length = file_length (f->file);
+  fd_put (f);
+  return length;
+}
+
+void seek(int fd, unsigned position) {
+  if (fd <= 1 || fd > 4096) {
+    return -1;
+  }
+
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f != NULL) {
+    file_seek (f->file, position);
+    fd_put (f);
+  }
+
+}
+
+unsigned tell(int fd) {
+  if (fd <= 1 || fd > 4096) {
+    return -1;
+  }
+
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f == NULL) {
+    return -1;
+  }
+
+  unsigned position = file_tell (f->file);
+  fd_put (f);
+  return position;
+}
+
+bool chdir (const char *dir) {
+  
+  struct dir *cur_dir = dir_open(inode_open(thread_current()->cur_dir));
+  if (cur_dir == NULL) {
+    return false;
+  }
+
+  struct dir *target_dir = dir_walk_chdir(dir);
+  
+  if (!target_dir) {
+     dir_close(cur_dir);
+    return false;
+  }
+
+  thread_current()->cur_dir = inode_get_inumber(dir_get_inode(target_dir));
+  
+  dir_close(cur_dir);
+  dir_close(target_dir);
+
+  return true;
+}
+
+bool mkdir (const char *dir) {
+  if (dir == NULL) {
+    return false;
+  }
+  return filesys_create (dir, 0, true);
+}
+
+bool isdir (int fd) {
+  if(fd <= 1 || fd > 4096){
+    return false;
+  }
+
+  struct fd_file_mapping *f = fd_lookup (fd);
+  if (f != NULL) {
+    bool is_dir = f->is_dir;
+    fd_put (f);
+    return is_dir;
+  }
+
+  return false;
+}
+
+
+bool readdir (int fd, char *name) {
+  if(fd <= 1 || fd > 4096){
+    return -1;
+  }
+
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f != NULL) {
+    bool result = false;
+    if (f->is_dir) {
+      struct dir *directory = dir_open (file_get_inode(f->file));
+      if (directory != NULL) {
+        dir_set_position(directory, file_get_position(f->file));
+        result =  dir_readdir(directory, name);
+        file_seek(f->file, dir_get_position(directory));
+
+        // comment this out will fail open for some weird reason
+
+        // dir_close(directory);
+      }
+    }
+    fd_put (f);
+    return result;
+  }
+
+  return false;
+}
+
+/* Reads as many entries of directory FD, from its current
+   position on, as fit in the SIZE bytes at BUF, and advances the
+   position past them.  Returns the number of entries read, 0 at
+   the end of the directory, or -1 if FD is not a directory. */
+int getdents (int fd, struct dirent *buf, unsigned size) {
+  struct fd_file_mapping *f;
+  struct dirent ents[GETDENTS_CHUNK];
+  size_t max = size / sizeof *ents;
+  size_t cnt = 0;
+
+  /* Check BUF before taking FD, since a bad one ends the process
+     and would leave FD's reference held. */
+  if (max > 0) {
+    range_is_valid (buf, max * sizeof *buf);
+  }
+  f = fd_lookup_file (fd);
+  if (f == NULL) {
+    return -1;
+  }
+  struct dir *directory = NULL;
+  if (f->is_dir) {
+    directory = dir_open (inode_reopen (file_get_inode (f->file)));
+  }
+  if (directory == NULL) {
+    fd_put (f);
+    return -1;
+  }
+  dir_set_position (directory, file_get_position (f->file));
+  while (cnt < max) {
+    size_t want = max - cnt < GETDENTS_CHUNK ? max - cnt : GETDENTS_CHUNK;
+    size_t n = dir_readdir_batch (directory, ents, want);
+    copy_to_user (buf + cnt, ents, n * sizeof *ents);
+    cnt += n;
+    if (n < want) {
+      break;
+    }
+  }
+  file_seek (f->file, dir_get_position (directory));
+  dir_close (directory);
+  fd_put (f);
+  return cnt;
+}
+
+/* Stores the size, type and inode number of open file FD in *ST,
+   from its open inode.  Returns false if FD is not an open
+   file. */
+bool fstat (int fd, struct stat *st) {
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  struct stat k;
+
+  if (f == NULL) {
+    return false;
+  }
+  inode_get_stat (file_get_inode (f->file), &k);
+  fd_put (f);
+  copy_to_user (st, &k, sizeof k);
+  return true;
+}
+
+/* Stores the size, type and inode number of FILE in *ST without
+   opening it.  Returns false if FILE does not exist. */
+bool stat (const char *file, struct stat *st) {
+  struct stat k;
+
+  if (!filesys_stat (file, &k)) {
+    return false;
+  }
+  copy_to_user (st, &k, sizeof k);
+  return true;
+}
+
+/* Moves the file FILE, or every file below it if it is a
+   directory, to consecutive sectors where it is fragmented.
+   Returns the number of files moved, or -1 if FILE does not
+   exist. */
+int defrag (const char *file) {
+  return filesys_defrag (file);
+}
+
+int inumber (int fd) {
+  if(fd <= 1 || fd > 4096){
+    return -1;
+  }
+
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f != NULL) {
+    int inumber = inode_get_inumber(file_get_inode(f->file));
+    fd_put (f);
+    return inumber;
+  }
+
+  return -1;
+}
+
+/* The single-counter calls below are what fsstats() reports,
+   truncated to int. */
+int
+cache_tries (void)
+{
+  struct fs_stats s;
+
+  cache_get_stats (&s);
+  return s.meta_hits + s.meta_misses + s.data_hits + s.data_misses;
+}
+
+int
+cache_hits (void)
+{
+  struct fs_stats s;
+
+  cache_get_stats (&s);
+  return s.meta_hits + s.data_hits;
+}
+
+int
+disk_reads (void)
+{
+  struct fs_stats s;
+
+  cache_get_stats (&s);
+  return s.disk_reads;
+}
+
+int
+disk_writes (void)
+{
+  struct fs_stats s;
+
+  cache_get_stats (&s);
+  return s.disk_writes;
+}
+
+void
+cache_reset (void)
+{
+  cache_close ();
+  cache_init ();
 }
 
-int read(int fd, const void* buffer, unsigned size){
-  int i = -1;
-
-  if(fd == 1 || fd < 0 || fd > 4096){
-    return i;
+/* Gives FD's delayed-allocation blocks their sectors, then writes
+   the dirty contents of the buffer cache to disk.  The cache does
+   not track which blocks belong to which file, so this flushes
+   every dirty block, not just FD's. */
+bool
+fsync (int fd)
+{
+  if(fd <= 1 || fd > 4096){
+    return false;
   }
 
-  if(fd == 0){
-    char* one_byte_increment = (char*)buffer;
-    for(i=0; i<size; i++){
-      one_byte_increment[i] = (char)input_getc();
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f != NULL) {
+    if (!f->is_dir) {
+      inode_flush (file_get_inode (f->file));
     }
-    return size;
+    fd_put (f);
+    cache_writeback ();
+    return true;
   }
 
+  return false;
+}
 
-  struct list_elem *e;
+/* Checks the IOVCNT buffers in IOV, exiting with -1 status code if
+   the array or any buffer is not valid user memory.  Returns false
+   if IOVCNT is out of range or the buffers add up to more than a
+   single transfer can carry. */
+static bool
+iov_is_valid (const struct iovec *iov, int iovcnt)
+{
+  size_t total = 0;
+  int i;
 
-  for (e = list_begin (&thread_current()->file_mappings); 
-       e != list_end (&thread_current()->file_mappings); 
-       e = list_next (e))
-  {
-      struct fd_file_mapping *f = list_entry (e, struct fd_file_mapping, elem);
-      if(f->fd == fd){
-        if (f->is_dir) {
-          return -1;
-        }
-        int bytes_read = file_read(f->file, buffer, size);
-        return bytes_read;
-      }
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return false;
   }
+  range_is_valid((void *) iov, iovcnt * sizeof *iov);
 
-  return i;
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > INT_MAX - total) {
+      return false;
+    }
+    total += iov[i].iov_len;
+    if (iov[i].iov_len > 0) {
+      range_is_valid(iov[i].iov_base, iov[i].iov_len);
+    }
+  }
+  return true;
 }
 
-int write(int fd, const void* buffer, unsigned size){
-  int i=-1;
-  if(fd <=0 || fd>4096){
-    return i;
+/* Reads from FD into the IOVCNT buffers in IOV, filling each in
+   turn, with one pass over the file's inode. */
+int
+readv (int fd, const struct iovec *iov, int iovcnt)
+{
+  if(fd == 1 || fd < 0 || fd > 4096 || !iov_is_valid(iov, iovcnt)){
+    return -1;
   }
 
-  if(fd==1){
-    putbuf(buffer, size);
-    return size;
+  if(fd == 0){
+    int i, bytes_read = 0;
+    size_t j;
+    for(i = 0; i < iovcnt; i++){
+      for(j = 0; j < iov[i].iov_len; ){
+        j += input_getbuf((uint8_t *) iov[i].iov_base + j, iov[i].iov_len - j);
+      }
+      bytes_read += iov[i].iov_len;
+    }
+    return bytes_read;
   }
 
-
-  struct list_elem *e;
-  for (e = list_begin (&thread_current()->file_mappings); 
-       e != list_end (&thread_current()->file_mappings); 
-       e = list_next(e))
-  {
-      struct fd_file_mapping *f = list_entry (e, struct fd_file_mapping, elem);
-      if(f->fd == fd){
-        if (f->is_dir) {
-          return -1;
-        }
-        int bytes_written = file_write(f->file, buffer, size);
-        return bytes_written;
-      }
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f != NULL) {
+    int result = f->is_dir ? -1 : file_readv(f->file, iov, iovcnt);
+    fd_put (f);
+    return result;
   }
 
-  return i;
+  return -1;
 }
 
-void close(int fd){
-  if(fd <= 1 || fd > 4096){
-    return;
+/* Writes the IOVCNT buffers in IOV to FD, one after another, with
+   one pass over the file's inode. */
+int
+writev (int fd, const struct iovec *iov, int iovcnt)
+{
+  if(fd <= 0 || fd > 4096 || !iov_is_valid(iov, iovcnt)){
+    return -1;
   }
 
-  struct list_elem *e;
+  if(fd == 1){
+    int i, bytes_written = 0;
+    for(i = 0; i < iovcnt; i++){
+      putbuf(iov[i].iov_base, iov[i].iov_len);
+      bytes_written += iov[i].iov_len;
+    }
+    return bytes_written;
+  }
 
-  for (e = list_begin (&thread_current()->file_mappings); 
-       e != list_end (&thread_current()->file_mappings); 
-       e = list_next (e))
-  {
-      struct fd_file_mapping *f = list_entry (e, struct fd_file_mapping, elem);
-      if(f->fd == fd){
-        file_close (f->file);
-        list_remove(&f->elem);
-        free(f);
-        break;
-      }
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f != NULL) {
+    int result = f->is_dir ? -1 : file_writev(f->file, iov, iovcnt);
+    fd_put (f);
+    return result;
   }
 
+  return -1;
 }
 
-int filesize(int fd) {
-  if (fd <= 1 || fd > 4096) {
+/* Reads SIZE bytes from FD into BUFFER, starting at byte OFFSET
+   of the file, without moving the file position. */
+int
+pread (int fd, void *buffer, unsigned size, unsigned offset)
+{
+  if(fd <= 1 || fd > 4096 || offset > INT_MAX || size > INT_MAX - offset){
     return -1;
   }
 
-  
-  struct list_elem *e;
-  int size;
-
-  for (e = list_begin (&thread_current()->file_mappings); 
-       e != list_end(&thread_current()->file_mappings); 
-       e = list_next (e)) {
-    struct fd_file_mapping *f = list_entry (e, struct fd_file_mapping, elem);
-    if (f->fd == fd) {
-      size = file_length (f->file);
-      break;
-    }
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f != NULL) {
+    int result = f->is_dir ? -1 : file_read_at(f->file, buffer, size, offset);
+    fd_put (f);
+    return result;
   }
 
-  return size;
+  return -1;
 }
 
-void seek(int fd, unsigned position) {
-  if (fd <= 1 || fd > 4096) {
+/* Writes SIZE bytes from BUFFER to FD, starting at byte OFFSET of
+   the file, without moving the file position. */
+int
+pwrite (int fd, const void *buffer, unsigned size, unsigned offset)
+{
+  if(fd <= 1 || fd > 4096 || offset > INT_MAX || size > INT_MAX - offset){
     return -1;
   }
 
-  
-  struct list_elem *e;
-
-  for (e = list_begin (&thread_current()->file_mappings); 
-       e != list_end(&thread_current()->file_mappings); 
-       e = list_next (e)) {
-    struct fd_file_mapping *f = list_entry (e, struct fd_file_mapping, elem);
-    if (f->fd == fd) {
-      file_seek (f->file, position);
-      break;
-    }
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f != NULL) {
+    int result = f->is_dir ? -1 : file_write_at(f->file, buffer, size, offset);
+    fd_put (f);
+    return result;
   }
 
+  return -1;
 }
 
-unsigned tell(int fd) {
-  if (fd <= 1 || fd > 4096) {
-    return -1;
-  }
+/* Copies the calling thread's scheduler statistics and the
+   system-wide latency histograms to STATS. */
+bool
+sched_stats (struct sched_stats *stats)
+{
+  struct sched_stats k;
 
-  
-  struct list_elem *e;
-  unsigned position;
+  thread_get_sched_stats (&k);
+  copy_to_user (stats, &k, sizeof k);
+  return true;
+}
 
-  for (e = list_begin (&thread_current()->file_mappings); 
-       e != list_end(&thread_current()->file_mappings); 
-       e = list_next (e)) {
-    struct fd_file_mapping *f = list_entry (e, struct fd_file_mapping, elem);
-    if (f->fd == fd) {
-      position = file_tell (f->file);
-      break;
-    }
-  }
+/* Copies the resource use of PID, RUSAGE_SELF or RUSAGE_CHILDREN
+   to USAGE.  Returns false if PID is not the caller, nor a child
+   of the caller that has exited and not been waited for. */
+bool
+getrusage (pid_t pid, struct rusage *usage)
+{
+  struct rusage k;
 
-  return position;
+  if (!process_get_usage (pid, &k))
+    return false;
+  copy_to_user (usage, &k, sizeof k);
+  return true;
 }
 
-bool chdir (const char *dir) {
-  
-  struct dir *cur_dir = dir_open(inode_open(thread_current()->cur_dir));
-  if (cur_dir == NULL) {
-    return false;
-  }
+/* Copies a snapshot of the buffer cache statistics to STATS. */
+bool
+fsstats (struct fs_stats *stats)
+{
+  struct fs_stats k;
 
-  struct dir *target_dir = dir_walk_chdir(dir);
-  
-  if (!target_dir) {
-     dir_close(cur_dir);
-    return false;
-  }
+  cache_get_stats (&k);
+  copy_to_user (stats, &k, sizeof k);
+  return true;
+}
 
-  thread_current()->cur_dir = inode_get_inumber(dir_get_inode(target_dir));
-  
-  dir_close(cur_dir);
-  dir_close(target_dir);
+/* Copies the statistics of block device IDX, counting in kernel
+   probe order from 0, to STATS.  Returns false if there is no
+   such device. */
+bool
+blockstats (unsigned idx, struct block_stats *stats)
+{
+  struct block_stats k;
+  struct block *b;
 
+  for (b = block_first (); b != NULL && idx > 0; b = block_next (b))
+    idx--;
+  if (b == NULL)
+    return false;
+  block_get_stats (b, &k);
+  copy_to_user (stats, &k, sizeof k);
   return true;
 }
 
-bool mkdir (const char *dir) {
-  if (dir == NULL) {
+/* Copies the network device's Ethernet address to MAC.  Returns
+   false if there is no network device. */
+bool
+net_info (uint8_t mac[ETH_ADDR_LEN])
+{
+  uint8_t k[ETH_ADDR_LEN];
+
+  if (!e1000_present ()) {
     return false;
   }
-  return filesys_create (dir, 0, true);
+  e1000_get_mac (k);
+  copy_to_user (mac, k, sizeof k);
+  return true;
 }
 
-bool isdir (int fd) {
-  if(fd <= 1 || fd > 4096){
-    return false;
+/* Sends each of the CNT buffers in PACKETS as an Ethernet frame.
+   Each is copied straight into a packet buffer the device sends
+   from, and the device is handed NET_SEND_BATCH of them at a
+   time.  Returns the number of frames sent, which is fewer than
+   CNT if packet buffers run out, or -1 on error. */
+int
+net_send (const struct iovec *packets, int cnt)
+{
+  struct netbuf *bufs[NET_SEND_BATCH];
+  int sent = 0;
+  int i;
+
+  if (!e1000_present () || !iov_is_valid (packets, cnt)) {
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    if (packets[i].iov_len > ETH_FRAME_MAX) {
+      return -1;
+    }
   }
 
-  struct list_elem *e;
+  while (sent < cnt) {
+    int n = 0;
 
-  for (e = list_begin (&thread_current()->file_mappings); 
-       e != list_end (&thread_current()->file_mappings); 
-       e = list_next (e))
-  {
-      struct fd_file_mapping *f = list_entry (e, struct fd_file_mapping, elem);
-      if(f->fd == fd){
-        return f->is_dir;
-      }
+    while (n < NET_SEND_BATCH && sent + n < cnt
+           && (bufs[n] = netbuf_alloc ()) != NULL) {
+      const struct iovec *p = &packets[sent + n];
+
+      copy_from_user (bufs[n]->data, p->iov_base, p->iov_len);
+      bufs[n]->len = p->iov_len;
+      n++;
+    }
+    if (n == 0) {
+      break;
+    }
+    e1000_send (bufs, n);
+    sent += n;
   }
+  return sent;
+}
 
-  return false;
+/* Waits for an Ethernet frame, copies as much of it as fits in
+   SIZE bytes to BUFFER, and returns the frame's length, or -1 if
+   there is no network device. */
+int
+net_recv (void *buffer, unsigned size)
+{
+  struct netbuf *b;
+  int len;
+
+  if (!e1000_present ()) {
+    return -1;
+  }
+  b = e1000_receive ();
+  len = b->len;
+  copy_to_user (buffer, b->data, size < b->len ? size : b->len);
+  netbuf_free (b);
+  return len;
 }
 
+/* Starts reading SIZE bytes from FD, at byte OFFSET of the file,
+   into BUFFER, and returns an id for aio_collect() at once, or -1
+   on error.  BUFFER is filled in only when the read is
+   collected. */
+int
+aio_read (int fd, void *buffer, unsigned size, unsigned offset)
+{
+  if (offset > INT_MAX || size > INT_MAX - offset) {
+    return -1;
+  }
 
-bool readdir (int fd, char *name) {
-  if(fd <= 1 || fd > 4096){
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f == NULL) {
     return -1;
   }
+  int id = f->is_dir ? -1 : aio_submit (f->file, false, buffer, size, offset);
+  fd_put (f);
+  return id;
+}
 
-  struct list_elem *e;
+/* Starts writing SIZE bytes from BUFFER to FD, at byte OFFSET of
+   the file, and returns an id for aio_collect() at once, or -1
+   on error.  BUFFER may be reused as soon as this returns. */
+int
+aio_write (int fd, const void *buffer, unsigned size, unsigned offset)
+{
+  if (offset > INT_MAX || size > INT_MAX - offset) {
+    return -1;
+  }
 
-  for (e = list_begin (&thread_current()->file_mappings); 
-       e != list_end (&thread_current()->file_mappings); 
-       e = list_next (e))
-  {
-      struct fd_file_mapping *f = list_entry (e, struct fd_file_mapping, elem);
-      if(f->fd == fd){
-        if (!f->is_dir) {
-          return false;
-        }
-        struct dir *directory = dir_open (file_get_inode(f->file));
-        if (directory == NULL) {
-          return false;
-        }
-        dir_set_position(directory, file_get_position(f->file));
-        bool result =  dir_readdir(directory, name);
-        file_seek(f->file, dir_get_position(directory));
+  struct fd_file_mapping *f = fd_lookup_file (fd);
+  if (f == NULL) {
+    return -1;
+  }
+  int id = f->is_dir ? -1 : aio_submit (f->file, true, (void *) buffer, size, offset);
+  fd_put (f);
+  return id;
+}
 
-        // comment this out will fail open for some weird reason
-        
-        // dir_close(directory);
-        return result;
+/* Runs operation OP as the matching system call would, after the
+   same checks on its pointers, and returns that call's result. */
+static int
+batch_run (const struct batch_op *op)
+{
+  switch (op->op) {
+    case BATCH_READ:
+      range_is_valid(op->buf, op->len);
+      if (op->offset == BATCH_POS) {
+        return read(op->fd, op->buf, op->len);
+      }
+      return pread(op->fd, op->buf, op->len, op->offset);
+    case BATCH_WRITE:
+      range_is_valid(op->buf, op->len);
+      if (op->offset == BATCH_POS) {
+        return write(op->fd, op->buf, op->len);
       }
+      return pwrite(op->fd, op->buf, op->len, op->offset);
+    case BATCH_SEEK:
+      seek(op->fd, op->offset);
+      return 0;
+    case BATCH_OPEN:
+      str_is_valid(op->buf);
+      return open(op->buf);
+    case BATCH_CLOSE:
+      close(op->fd);
+      return 0;
+    default:
+      return -1;
   }
+}
 
-  return false;
+/* Runs the CNT operations in OPS in order, storing each one's
+   result, so that a program doing many small file operations
+   enters the kernel once rather than once per operation.  Later
+   operations run even if earlier ones fail, so an open whose
+   descriptor a later read depends on must be checked by the
+   caller, as with separate calls.  Returns CNT, or -1 if CNT is
+   out of range. */
+int
+batch (struct batch_op *ops, int cnt)
+{
+  int i;
+
+  if (cnt < 0 || cnt > BATCH_MAX) {
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    struct batch_op op;
+
+    copy_from_user(&op, &ops[i], sizeof op);
+    op.result = batch_run(&op);
+    copy_to_user(&ops[i].result, &op.result, sizeof op.result);
+  }
+  return cnt;
 }
 
-int inumber (int fd) {
-  if(fd <= 1 || fd > 4096){
+#ifdef VM
+/* Maps the file open as FD into consecutive pages starting at
+   ADDR, to be read in as they are touched and written back when
+   changed.  Returns the mapping's id, or -1 if the file is empty,
+   ADDR is not page-aligned, or the pages overlap anything already
+   in the address space. */
+int
+mmap (int fd, void *addr)
+{
+  struct thread *t = thread_current ()->process;
+  struct fd_file_mapping *f;
+  struct mmap_mapping *m;
+  off_t length;
+  size_t i;
+
+  if (fd <= 1 || fd > 4096 || addr == NULL || pg_ofs (addr) != 0) {
     return -1;
   }
 
-  struct list_elem *e;
+  f = fd_lookup_file (fd);
+  if (f == NULL) {
+    return -1;
+  }
+  length = f->is_dir ? 0 : file_length (f->file);
+  if (length == 0) {
+    fd_put (f);
+    return -1;
+  }
 
-  for (e = list_begin (&thread_current()->file_mappings); 
-       e != list_end (&thread_current()->file_mappings); 
-       e = list_next (e))
-  {
-      struct fd_file_mapping *f = list_entry (e, struct fd_file_mapping, elem);
-      if(f->fd == fd){
-        return inode_get_inumber(file_get_inode(f->file));
-      }
+  m = malloc (sizeof *m);
+  if (m == NULL) {
+    fd_put (f);
+    return -1;
+  }
+  m->addr = addr;
+  m->page_cnt = DIV_ROUND_UP (length, PGSIZE);
+
+  /* The whole range must be free user memory, clear of the
+     space the stack may grow into. */
+  if ((uintptr_t) m->addr + m->page_cnt * PGSIZE < (uintptr_t) m->addr
+      || m->addr + m->page_cnt * PGSIZE > (uint8_t *) PHYS_BASE - stack_max) {
+    fd_put (f);
+    free (m);
+    return -1;
+  }
+  m->file = file_reopen (f->file);
+  fd_put (f);
+  if (m->file == NULL) {
+    free (m);
+    return -1;
   }
 
-  return -1;
+  lock_acquire (&t->vm_lock);
+  for (i = 0; i < m->page_cnt; i++) {
+    if (page_lookup (m->addr + i * PGSIZE) != NULL) {
+      lock_release (&t->vm_lock);
+      file_close (m->file);
+      free (m);
+      return -1;
+    }
+  }
+  for (i = 0; i < m->page_cnt; i++) {
+    off_t ofs = i * PGSIZE;
+    size_t read_bytes = length - ofs < PGSIZE ? length - ofs : PGSIZE;
+    if (!page_add_mmap (m->addr + i * PGSIZE, m->file, ofs, read_bytes)) {
+      lock_release (&t->vm_lock);
+      m->page_cnt = i;
+      mmap_unmap (m);
+      return -1;
+    }
+  }
+
+  m->id = t->next_mapid++;
+  list_push_back (&t->mmaps, &m->elem);
+  lock_release (&t->vm_lock);
+  return m->id;
 }
 
-int
-cache_tries (void)
+/* Unmaps MAPPING, writing back any pages that were changed. */
+void
+munmap (int mapping)
 {
-  return memory_cache->cache_tries;
+  struct thread *t = thread_current ()->process;
+  struct mmap_mapping *m = NULL;
+  struct list_elem *e;
+
+  lock_acquire (&t->vm_lock);
+  for (e = list_begin (&t->mmaps); e != list_end (&t->mmaps);
+       e = list_next (e)) {
+    if (list_entry (e, struct mmap_mapping, elem)->id == mapping) {
+      m = list_entry (e, struct mmap_mapping, elem);
+      list_remove (&m->elem);
+      break;
+    }
+  }
+  lock_release (&t->vm_lock);
+  if (m != NULL) {
+    mmap_unmap (m);
+  }
 }
 
-int
-cache_hits (void)
+/* Moves the end of the current process's heap by INCREMENT bytes,
+   which may be negative, and returns its old end.  Pages added to
+   the heap are zero-filled and brought in only when touched;
+   pages wholly past the new end are discarded.  Returns
+   (void *) -1, leaving the heap alone, if the heap would shrink
+   below its start, run into the space the stack may grow into, or
+   overlap a memory-mapped file. */
+void *
+sbrk (intptr_t increment)
 {
-  return memory_cache->cache_hits;
+  struct thread *t = thread_current ()->process;
+  uint8_t *old_brk, *new_brk, *old_end, *new_end;
+  uint8_t *upage;
+
+  lock_acquire (&t->vm_lock);
+  old_brk = t->heap_brk;
+  new_brk = old_brk + increment;
+  old_end = pg_round_up (old_brk);
+  new_end = pg_round_up (new_brk);
+  if (increment > 0) {
+    if (new_brk < old_brk
+        || new_brk > (uint8_t *) PHYS_BASE - stack_max) {
+      goto fail;
+    }
+    for (upage = old_end; upage < new_end; upage += PGSIZE) {
+      if (!page_add_zero (upage, true)) {
+        while (upage > old_end) {
+          upage -= PGSIZE;
+          page_remove (upage);
+        }
+        goto fail;
+      }
+    }
+  } else if (increment < 0) {
+    if (new_brk > old_brk || new_brk < t->heap_start) {
+      goto fail;
+    }
+    for (upage = new_end; upage < old_end; upage += PGSIZE) {
+      page_remove (upage);
+    }
+  }
+  t->heap_brk = new_brk;
+  lock_release (&t->vm_lock);
+  return old_brk;
+
+ fail:
+  lock_release (&t->vm_lock);
+  return (void *) -1;
 }
 
-int
-disk_reads (void)
+/* Maps all of shared memory segment ID, from shm_open(), into
+   the current process at ADDR, writable, and returns ADDR.  The
+   pages stay mapped until the process exits.  Returns a null
+   pointer if there is no such segment, or if ADDR is not page
+   aligned or the range is not free user memory, as for mmap(). */
+void *
+shm_map (int id, void *addr)
 {
-  return memory_cache->disk_reads;
+  struct thread *t = thread_current ()->process;
+  struct shm_segment *seg;
+  uint8_t *upage = addr;
+  size_t page_cnt;
+  size_t i;
+
+  if (addr == NULL || pg_ofs (addr) != 0) {
+    return NULL;
+  }
+  seg = shm_acquire (id, &page_cnt);
+  if (seg == NULL) {
+    return NULL;
+  }
+  if ((uintptr_t) upage + page_cnt * PGSIZE < (uintptr_t) upage
+      || upage + page_cnt * PGSIZE > (uint8_t *) PHYS_BASE - stack_max) {
+    shm_release (seg);
+    return NULL;
+  }
+
+  lock_acquire (&t->vm_lock);
+  for (i = 0; i < page_cnt; i++) {
+    if (page_lookup (upage + i * PGSIZE) != NULL) {
+      break;
+    }
+  }
+  if (i == page_cnt) {
+    for (i = 0; i < page_cnt; i++) {
+      if (!page_add_shm (upage + i * PGSIZE, seg, i)) {
+        while (i-- > 0) {
+          page_remove (upage + i * PGSIZE);
+        }
+        i = 0;
+        break;
+      }
+    }
+  }
+  lock_release (&t->vm_lock);
+  shm_release (seg);
+  return i == page_cnt ? addr : NULL;
 }
 
-int
-disk_writes (void)
+/* Gives the current process, which must have no files open, its
+   own handle on each file PARENT has open, under the same fd and
+   at the same position, and its own end of each pipe.  Returns
+   false if memory runs out. */
+bool
+fd_table_copy (struct thread *parent)
 {
-  return memory_cache->disk_writes;
+  return fd_table_dup (parent, false);
 }
 
+/* Unmaps every file the current process has mapped. */
 void
-cache_reset (void)
+mmap_destroy (void)
 {
-  cache_close ();
-  cache_init ();
+  struct thread *t = thread_current ();
+
+  while (!list_empty (&t->mmaps)) {
+    struct list_elem *e = list_pop_front (&t->mmaps);
+    mmap_unmap (list_entry (e, struct mmap_mapping, elem));
+  }
+}
+
+/* Removes M's pages, writing back any that were changed, and
+   frees M. */
+static void
+mmap_unmap (struct mmap_mapping *m)
+{
+  size_t i;
+
+  for (i = 0; i < m->page_cnt; i++) {
+    page_remove (m->addr + i * PGSIZE);
+  }
+  file_close (m->file);
+  free (m);
 }
+#endif
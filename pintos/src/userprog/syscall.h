@@ -1,8 +1,33 @@
 #ifndef USERPROG_SYSCALL_H
 #define USERPROG_SYSCALL_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef int pid_t;
 
+/* One operation for SYS_BATCH, laid out as in the user library's
+   <syscall.h>. */
+struct batch_op
+  {
+    int op;                     /* BATCH_READ, BATCH_WRITE, ... */
+    int fd;                     /* File descriptor. */
+    void *buf;                  /* Buffer, or file name for BATCH_OPEN. */
+    unsigned len;               /* Buffer size in bytes. */
+    unsigned offset;            /* File offset, or BATCH_POS. */
+    int result;                 /* Set by the kernel. */
+  };
+
+struct thread;
+
 void syscall_init (void);
+void copy_from_user (void *dst, const void *usrc, size_t size);
+void copy_to_user (void *udst, const void *src, size_t size);
+void fd_table_destroy (void);
+bool fd_table_inherit (struct thread *parent);
+#ifdef VM
+void mmap_destroy (void);
+bool fd_table_copy (struct thread *parent);
+#endif
 
 #endif /* userprog/syscall.h */
@@ -75,6 +75,20 @@ struct tss
 /* Kernel TSS. */
 static struct tss *tss;
 
+/* Model-specific registers that configure SYSENTER.
+   See [IA32-v3b] 4.8.7 "Performing Fast Calls to System
+   Procedures with the SYSENTER and SYSEXIT Instructions". */
+#define MSR_SYSENTER_CS  0x174  /* Kernel code selector. */
+#define MSR_SYSENTER_ESP 0x175  /* Kernel stack pointer. */
+#define MSR_SYSENTER_EIP 0x176  /* Kernel entry point. */
+
+/* Writes VALUE to model-specific register MSR. */
+static inline void
+wrmsr (uint32_t msr, uint32_t value)
+{
+  asm volatile ("wrmsr" : : "c" (msr), "a" (value), "d" (0));
+}
+
 /* Initializes the kernel TSS. */
 void
 tss_init (void)
@@ -88,6 +102,20 @@ tss_init (void)
   tss_update ();
 }
 
+/* Points SYSENTER at ENTRY.  SYSENTER loads a fixed stack
+   pointer, not one per thread, so rather than rewrite it on
+   every thread switch we point it at the TSS's esp0 member,
+   which already tracks the running thread's kernel stack.
+   ENTRY's first instruction loads %esp from there. */
+void
+tss_init_sysenter (void (*entry) (void))
+{
+  ASSERT (tss != NULL);
+  wrmsr (MSR_SYSENTER_CS, SEL_KCSEG);
+  wrmsr (MSR_SYSENTER_ESP, (uint32_t) &tss->esp0);
+  wrmsr (MSR_SYSENTER_EIP, (uint32_t) entry);
+}
+
 /* Returns the kernel TSS. */
 struct tss *
 tss_get (void)
@@ -0,0 +1,600 @@
+#include "vm/frame.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/file.h"
+#include "filesys/inode.h"
+#include "threads/palloc.h"
+#include "threads/slab.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "userprog/pagedir.h"
+#include "vm/page.h"
+
+/* Frame table.
+
+   Every frame from the user pool that holds a user page is on
+   FRAMES, in a circle swept by the clock hand.  When the user
+   pool runs dry, frame_alloc() evicts the first unpinned frame
+   whose page has not been accessed since the hand last passed
+   it, clearing accessed bits as it goes.
+
+   Eviction takes the victim's page lock, with lock_try_acquire()
+   so that it never waits while holding FRAME_LOCK, and keeps it
+   until the page has been written out.  A process that faults on
+   the page meanwhile waits on the lock and then reads it back.
+
+   Read-only pages of files, in practice the code of executables,
+   are shared: the sharing table maps a file's inode sector and a
+   page offset in it to the frame holding that page, and every
+   process that loads the page maps the same frame.  The frame
+   keeps a list of the pages mapping it and is freed when the last
+   one goes away.  Sharers are attached and detached, and shared
+   frames evicted, entirely under FRAME_LOCK; a shared frame is
+   never dirty, so evicting one only unmaps it.
+
+   After fork, a page that was in a frame is shared the same way
+   between the parent and the child, but copy-on-write: every
+   mapping of the frame is read-only, and the first process to
+   write the page gets a copy of its own.  When only one sharer
+   is left, the frame becomes an ordinary frame of that page
+   again.  Copy-on-write frames may hold data found nowhere else,
+   so they are not evicted while shared.
+
+   Frames of shared memory segments (see shm.c) are mapped
+   writable by every process that maps the segment, so they hold
+   data found nowhere else and are never evicted.  Each counts the
+   references to it, one from its segment and one from each page
+   mapping it, and is freed when the last goes away. */
+
+/* Frames in use, in clock order. */
+static struct list frames;
+
+/* Next frame the clock hand examines, or null. */
+static struct list_elem *hand;
+
+/* Shared frames, keyed by inode sector and offset. */
+static struct hash share_table;
+
+/* Guards FRAMES, HAND, SHARE_TABLE, every frame's PINNED and
+   SHARERS, and the FRAME of every page of a shared frame. */
+static struct lock frame_lock;
+
+/* Allocator for `struct frame'. */
+static struct kmem_cache *frame_cache;
+
+static struct frame *frame_evict (void);
+static void frame_discard (struct frame *, struct palloc_batch *);
+static bool evict_shared (struct frame *);
+static void advance_hand (void);
+static struct frame *share_lookup (struct page *);
+static void cow_settle (struct frame *);
+static void share_map (struct frame *, struct page *);
+static hash_hash_func share_hash;
+static hash_less_func share_less;
+
+/* Initializes the frame table. */
+void
+frame_init (void)
+{
+  list_init (&frames);
+  hand = NULL;
+  lock_init (&frame_lock);
+  lock_set_name (&frame_lock, "frames");
+  frame_cache = kmem_cache_create ("frame", sizeof (struct frame), NULL);
+  if (frame_cache == NULL)
+    PANIC ("frame cache creation failed");
+  if (!hash_init (&share_table, share_hash, share_less, NULL))
+    PANIC ("frame sharing table creation failed");
+}
+
+/* Obtains a frame for page P of the running process, evicting
+   another page if the user pool is exhausted, and zeroes it if
+   ZERO is true.  The frame is pinned until frame_unpin().
+   Returns a null pointer if no frame can be had. */
+struct frame *
+frame_alloc (struct page *p, bool zero)
+{
+  struct frame *f;
+  void *kpage;
+
+  kpage = palloc_get_page (PAL_USER | (zero ? PAL_ZERO : 0));
+  if (kpage != NULL)
+    {
+      f = kmem_cache_alloc (frame_cache);
+      if (f == NULL)
+        {
+          palloc_free_page (kpage);
+          return NULL;
+        }
+      f->kpage = kpage;
+      f->pinned = true;
+      f->shared = false;
+      f->cow = false;
+      f->shm_refs = 0;
+      list_init (&f->sharers);
+      lock_acquire (&frame_lock);
+      list_push_back (&frames, &f->elem);
+      lock_release (&frame_lock);
+    }
+  else
+    {
+      f = frame_evict ();
+      if (f == NULL)
+        return NULL;
+      if (zero)
+        memset (f->kpage, 0, PGSIZE);
+    }
+
+  f->owner = thread_current ()->process;
+  f->page = p;
+  return f;
+}
+
+/* Makes F a candidate for eviction again. */
+void
+frame_unpin (struct frame *f)
+{
+  lock_acquire (&frame_lock);
+  ASSERT (f->pinned);
+  f->pinned = false;
+  lock_release (&frame_lock);
+}
+
+/* Removes F from the frame table and frees it and its page of
+   memory.  The page F holds must already be unmapped. */
+void
+frame_free (struct frame *f)
+{
+  frame_discard (f, NULL);
+}
+
+/* Like frame_free(), but if BATCH is nonnull, adds F's page to
+   BATCH instead of freeing it right away. */
+static void
+frame_discard (struct frame *f, struct palloc_batch *batch)
+{
+  lock_acquire (&frame_lock);
+  if (hand == &f->elem)
+    advance_hand ();
+  list_remove (&f->elem);
+  if (list_empty (&frames))
+    hand = NULL;
+  lock_release (&frame_lock);
+
+  if (batch != NULL)
+    palloc_batch_add (batch, f->kpage);
+  else
+    palloc_free_page (f->kpage);
+  kmem_cache_free (frame_cache, f);
+}
+
+/* Frees the frame of page P, which must already be unmapped, or
+   if the frame is shared copy-on-write, just drops P from its
+   sharers.  P's lock must be held.  If BATCH is nonnull, a freed
+   frame's page is added to it rather than freed at once. */
+void
+frame_release (struct page *p, struct palloc_batch *batch)
+{
+  struct frame *f = p->frame;
+  bool cow;
+
+  ASSERT (f != NULL && !f->shared);
+
+  lock_acquire (&frame_lock);
+  cow = f->cow;
+  if (cow)
+    {
+      list_remove (&p->share_elem);
+      cow_settle (f);
+    }
+  lock_release (&frame_lock);
+
+  p->frame = NULL;
+  if (!cow)
+    frame_discard (f, batch);
+}
+
+/* Chooses a frame with the clock algorithm, writes its page out
+   and returns it, pinned.  Returns a null pointer if every frame
+   is pinned or in use, or if the page cannot be written out. */
+static struct frame *
+frame_evict (void)
+{
+  struct frame *f = NULL;
+  size_t tries;
+
+  lock_acquire (&frame_lock);
+  if (list_empty (&frames))
+    {
+      lock_release (&frame_lock);
+      return NULL;
+    }
+
+  /* Two sweeps clear every accessed bit, so a third finds a
+     victim unless everything is pinned or busy. */
+  for (tries = 3 * list_size (&frames); tries > 0; tries--)
+    {
+      struct frame *cand;
+      uint32_t *pd;
+
+      if (hand == NULL)
+        hand = list_begin (&frames);
+      cand = list_entry (hand, struct frame, elem);
+      advance_hand ();
+
+      if (cand->pinned || cand->cow)
+        continue;
+      if (cand->shared)
+        {
+          if (evict_shared (cand))
+            {
+              f = cand;
+              f->pinned = true;
+              lock_release (&frame_lock);
+              return f;
+            }
+          continue;
+        }
+      if (!lock_try_acquire (&cand->page->lock))
+        continue;
+
+      pd = cand->owner->pagedir;
+      if (pagedir_is_accessed (pd, cand->page->upage))
+        {
+          pagedir_set_accessed (pd, cand->page->upage, false);
+          lock_release (&cand->page->lock);
+          continue;
+        }
+
+      f = cand;
+      f->pinned = true;
+      break;
+    }
+  lock_release (&frame_lock);
+
+  if (f == NULL)
+    return NULL;
+
+  /* Write the page out while holding its lock, then forget the
+     frame.  If it can't be written out, put it back. */
+  if (!page_evict (f->page, f->owner))
+    {
+      lock_release (&f->page->lock);
+      frame_unpin (f);
+      return NULL;
+    }
+  lock_release (&f->page->lock);
+  return f;
+}
+
+/* Evicts shared frame F, unless one of the pages mapping it has
+   been accessed since the clock hand last came by, and returns
+   true if it was evicted.  FRAME_LOCK must be held. */
+static bool
+evict_shared (struct frame *f)
+{
+  struct list_elem *e;
+  bool accessed = false;
+
+  for (e = list_begin (&f->sharers); e != list_end (&f->sharers);
+       e = list_next (e))
+    {
+      struct page *p = list_entry (e, struct page, share_elem);
+      uint32_t *pd = p->owner->pagedir;
+      if (pagedir_is_accessed (pd, p->upage))
+        {
+          pagedir_set_accessed (pd, p->upage, false);
+          accessed = true;
+        }
+    }
+  if (accessed)
+    return false;
+
+  while (!list_empty (&f->sharers))
+    {
+      struct page *p = list_entry (list_pop_front (&f->sharers),
+                                   struct page, share_elem);
+      pagedir_clear_page (p->owner->pagedir, p->upage);
+      p->frame = NULL;
+    }
+  hash_delete (&share_table, &f->share_elem);
+  f->shared = false;
+  return true;
+}
+
+/* If another process already has read-only file page P in a
+   frame, maps that frame for P in the running process and
+   returns true.  Otherwise returns false.  P's lock must be
+   held. */
+bool
+frame_share_attach (struct page *p)
+{
+  struct frame *f;
+
+  lock_acquire (&frame_lock);
+  f = share_lookup (p);
+  if (f != NULL)
+    share_map (f, p);
+  lock_release (&frame_lock);
+  return f != NULL;
+}
+
+/* Maps F, which holds read-only file page P freshly read in and
+   is pinned, for P in the running process and enters it in the
+   sharing table, so that other processes can map it too.  If
+   another process entered the same page meanwhile, maps that
+   frame instead and frees F.  Returns false if the mapping could
+   not be made, in which case F is freed. */
+bool
+frame_share_publish (struct frame *f, struct page *p)
+{
+  struct frame *other;
+  bool success;
+
+  lock_acquire (&frame_lock);
+  other = share_lookup (p);
+  if (other != NULL)
+    share_map (other, p);
+  else
+    {
+      share_map (f, p);
+      if (p->frame != NULL)
+        {
+          f->owner = NULL;
+          f->page = NULL;
+          f->sector = inode_get_inumber (file_get_inode (p->file));
+          f->ofs = p->ofs;
+          f->shared = true;
+          hash_insert (&share_table, &f->share_elem);
+          f->pinned = false;
+        }
+    }
+  success = p->frame != NULL;
+  lock_release (&frame_lock);
+
+  if (other != NULL || !success)
+    frame_free (f);
+  return success;
+}
+
+/* Unmaps shared page P from the running process and drops it
+   from its frame's sharers, freeing the frame if P was the last
+   one.  P's lock must be held.  BATCH is as for frame_release(). */
+void
+frame_share_detach (struct page *p, struct palloc_batch *batch)
+{
+  struct frame *f;
+  bool last = false;
+
+  lock_acquire (&frame_lock);
+  f = p->frame;
+  if (f != NULL)
+    {
+      ASSERT (f->shared);
+      pagedir_clear_page (p->owner->pagedir, p->upage);
+      list_remove (&p->share_elem);
+      p->frame = NULL;
+      if (list_empty (&f->sharers))
+        {
+          hash_delete (&share_table, &f->share_elem);
+          f->shared = false;
+          f->pinned = true;
+          last = true;
+        }
+    }
+  lock_release (&frame_lock);
+
+  if (last)
+    frame_discard (f, batch);
+}
+
+/* Maps the frame holding page P of the parent process, read-only,
+   for page Q of the running child process, and makes the
+   parent's mapping read-only too, so that the page is copied
+   when either writes it.  P's lock must be held.  Returns false
+   if memory is not available. */
+bool
+frame_cow_share (struct page *p, struct page *q)
+{
+  struct frame *f = p->frame;
+  uint32_t *ppd = p->owner->pagedir;
+  uint32_t *cpd = q->owner->pagedir;
+  bool success = false;
+
+  ASSERT (f != NULL && !f->shared);
+
+  lock_acquire (&frame_lock);
+  if (pagedir_set_page (cpd, q->upage, f->kpage, false))
+    {
+      /* The child's copy must be saved on eviction if the
+         parent's would be. */
+      if (pagedir_is_dirty (ppd, p->upage))
+        pagedir_set_dirty (cpd, q->upage, true);
+      if (!f->cow)
+        {
+          f->cow = true;
+          f->owner = NULL;
+          f->page = NULL;
+          list_push_back (&f->sharers, &p->share_elem);
+          pagedir_set_writable (ppd, p->upage, false);
+        }
+      list_push_back (&f->sharers, &q->share_elem);
+      q->frame = f;
+      success = true;
+    }
+  lock_release (&frame_lock);
+  return success;
+}
+
+/* Lets the running process write page P, which is in a frame
+   but mapped read-only: if P shares a copy-on-write frame, moves
+   it to a copy of its own, and then makes the mapping writable.
+   P's lock must be held.  Returns false if no frame is available
+   for the copy. */
+bool
+frame_unshare (struct page *p)
+{
+  struct frame *f = p->frame;
+  struct frame *copy;
+  uint32_t *pd = p->owner->pagedir;
+  bool cow;
+
+  lock_acquire (&frame_lock);
+  cow = f->cow;
+  lock_release (&frame_lock);
+
+  if (cow)
+    {
+      copy = frame_alloc (p, false);
+      if (copy == NULL)
+        return false;
+      memcpy (copy->kpage, f->kpage, PGSIZE);
+
+      lock_acquire (&frame_lock);
+      cow = f->cow;
+      if (cow)
+        {
+          list_remove (&p->share_elem);
+          cow_settle (f);
+        }
+      lock_release (&frame_lock);
+
+      if (cow)
+        {
+          /* A private copy exists nowhere else. */
+          pagedir_clear_page (pd, p->upage);
+          if (!pagedir_set_page (pd, p->upage, copy->kpage, true))
+            NOT_REACHED ();
+          pagedir_set_dirty (pd, p->upage, true);
+          p->frame = copy;
+          frame_unpin (copy);
+          return true;
+        }
+
+      /* The other sharers went away while we copied, leaving the
+         frame to P alone. */
+      frame_free (copy);
+    }
+
+  pagedir_set_writable (pd, p->upage, true);
+  return true;
+}
+
+/* Obtains a zeroed frame for a shared memory segment, evicting
+   another page if the user pool is exhausted.  The frame stays
+   pinned, and starts out with the one reference of its segment.
+   Returns a null pointer if no frame can be had. */
+struct frame *
+frame_alloc_shm (void)
+{
+  struct frame *f = frame_alloc (NULL, true);
+
+  if (f != NULL)
+    {
+      f->owner = NULL;
+      f->shm_refs = 1;
+    }
+  return f;
+}
+
+/* Adds a reference to shared memory frame F. */
+void
+frame_shm_ref (struct frame *f)
+{
+  lock_acquire (&frame_lock);
+  ASSERT (f->shm_refs > 0);
+  f->shm_refs++;
+  lock_release (&frame_lock);
+}
+
+/* Drops a reference to shared memory frame F, which must already
+   be unmapped by whatever held it, and frees F when it was the
+   last.  BATCH is as for frame_release(). */
+void
+frame_shm_unref (struct frame *f, struct palloc_batch *batch)
+{
+  bool last;
+
+  lock_acquire (&frame_lock);
+  ASSERT (f->shm_refs > 0 && f->pinned);
+  last = --f->shm_refs == 0;
+  lock_release (&frame_lock);
+
+  if (last)
+    frame_discard (f, batch);
+}
+
+/* Turns copy-on-write frame F back into an ordinary frame if it
+   has just one sharer left.  FRAME_LOCK must be held. */
+static void
+cow_settle (struct frame *f)
+{
+  ASSERT (f->cow && !list_empty (&f->sharers));
+
+  if (list_begin (&f->sharers) == list_rbegin (&f->sharers))
+    {
+      struct page *q = list_entry (list_pop_front (&f->sharers),
+                                   struct page, share_elem);
+      f->cow = false;
+      f->owner = q->owner;
+      f->page = q;
+    }
+}
+
+/* Returns the shared frame holding the file page P, if any.
+   FRAME_LOCK must be held. */
+static struct frame *
+share_lookup (struct page *p)
+{
+  struct frame f;
+  struct hash_elem *e;
+
+  f.sector = inode_get_inumber (file_get_inode (p->file));
+  f.ofs = p->ofs;
+  e = hash_find (&share_table, &f.share_elem);
+  return e != NULL ? hash_entry (e, struct frame, share_elem) : NULL;
+}
+
+/* Maps shared frame F, read-only, for P in the running process and
+   adds P to F's sharers.  Leaves P's FRAME null if the mapping
+   can't be made.  FRAME_LOCK must be held. */
+static void
+share_map (struct frame *f, struct page *p)
+{
+  if (pagedir_set_page (p->owner->pagedir, p->upage, f->kpage, false))
+    {
+      list_push_back (&f->sharers, &p->share_elem);
+      p->frame = f;
+    }
+}
+
+/* Returns a hash value for the file page of shared frame E. */
+static unsigned
+share_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct frame *f = hash_entry (e, struct frame, share_elem);
+  return hash_int (f->sector) ^ hash_int (f->ofs);
+}
+
+/* Returns true if shared frame A's file page precedes B's. */
+static bool
+share_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct frame *a = hash_entry (a_, struct frame, share_elem);
+  const struct frame *b = hash_entry (b_, struct frame, share_elem);
+  if (a->sector != b->sector)
+    return a->sector < b->sector;
+  return a->ofs < b->ofs;
+}
+
+/* Moves the clock hand to the next frame, wrapping around.
+   FRAME_LOCK must be held. */
+static void
+advance_hand (void)
+{
+  hand = list_next (hand);
+  if (hand == list_end (&frames))
+    hand = list_begin (&frames);
+}
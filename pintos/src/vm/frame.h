@@ -0,0 +1,54 @@
+#ifndef VM_FRAME_H
+#define VM_FRAME_H
+
+#include <hash.h>
+#include <list.h>
+#include <stdbool.h>
+#include "devices/block.h"
+#include "filesys/off_t.h"
+
+struct page;
+struct palloc_batch;
+
+/* A frame of physical memory holding a user page. */
+struct frame
+  {
+    void *kpage;                /* Kernel virtual address. */
+    struct thread *owner;       /* Process whose page this is. */
+    struct page *page;          /* Page held, in OWNER's page table. */
+    bool pinned;                /* Exempt from eviction? */
+    struct list_elem elem;      /* Element in frame table. */
+
+    /* For a read-only file page shared between processes, or a
+       page shared copy-on-write after fork, OWNER and PAGE are
+       null and these are used instead. */
+    bool shared;                /* In the sharing table? */
+    bool cow;                   /* Shared copy-on-write? */
+    block_sector_t sector;      /* Inode sector of the file. */
+    off_t ofs;                  /* Offset of the page in the file. */
+    struct list sharers;        /* Pages mapping this frame. */
+    struct hash_elem share_elem; /* Element in sharing table. */
+
+    /* For a frame of a shared memory segment, which is always
+       pinned, OWNER and PAGE are null too. */
+    unsigned shm_refs;          /* Segment and pages holding it, or 0. */
+  };
+
+void frame_init (void);
+struct frame *frame_alloc (struct page *, bool zero);
+void frame_unpin (struct frame *);
+void frame_free (struct frame *);
+void frame_release (struct page *, struct palloc_batch *);
+
+bool frame_share_attach (struct page *);
+bool frame_share_publish (struct frame *, struct page *);
+void frame_share_detach (struct page *, struct palloc_batch *);
+
+bool frame_cow_share (struct page *, struct page *);
+bool frame_unshare (struct page *);
+
+struct frame *frame_alloc_shm (void);
+void frame_shm_ref (struct frame *);
+void frame_shm_unref (struct frame *, struct palloc_batch *);
+
+#endif /* vm/frame.h */
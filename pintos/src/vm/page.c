@@ -0,0 +1,736 @@
+#include "vm/page.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/file.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/slab.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "userprog/pagedir.h"
+#include "vm/frame.h"
+#include "vm/shm.h"
+#include "vm/swap.h"
+
+/* Supplemental page table.
+
+   Each process has a hash table, keyed by user page, recording
+   where every page of its address space comes from.  It is kept
+   in the process's first thread, and its threads share it under
+   PAGES_LOCK.  load()
+   fills it in instead of reading the executable up front, and
+   page_fault() calls page_load() the first time a page is
+   touched to bring it into a frame and map it.  Pages that are
+   never touched are never read and never take up memory.
+
+   The stack starts as a single page and grows down a page at a
+   time as the process touches addresses just below it, up to
+   STACK_MAX bytes.
+
+   When the frame table evicts a page, a clean page that came
+   from a file or was all zeros is simply dropped, to be brought
+   in again the same way.  A dirty page of a memory-mapped file
+   is written back to the file, and anything else goes to swap.
+
+   Read-only pages of files are not read in again by every
+   process that needs them: the frame table shares one frame
+   among all of them (see frame.c).
+
+   Pages of shared memory segments are mapped as soon as they are
+   added, to frames that are never evicted, so they never fault
+   (see shm.c).
+
+   A fault on a page in swap also brings in the pages after it
+   that sit in the following swap slots, up to SWAP_CLUSTER pages
+   in all, with one read (see swap.c).  A process coming back to
+   memory it was swapped out of then takes one fault and one
+   request per cluster instead of per page. */
+
+/* Largest size of a process's stack, in bytes. */
+size_t stack_max = STACK_MAX_DEFAULT;
+
+/* Allocator for `struct page'. */
+static struct kmem_cache *page_cache;
+
+static hash_hash_func page_hash;
+static hash_less_func page_less;
+static hash_action_func page_free;
+static struct page *page_new (void *upage, enum page_type, bool writable);
+static bool page_insert (struct page *);
+static bool page_is_shareable (const struct page *);
+static bool page_copy_swap (struct page *, struct page *);
+static bool page_map_shm (struct page *);
+static void page_discard (struct page *, struct palloc_batch *);
+static void page_write_back (struct page *, uint32_t *pd);
+static void page_swap_in_around (struct page *, struct frame *);
+
+/* Initializes the supplemental page table module. */
+void
+page_init (void)
+{
+  page_cache = kmem_cache_create ("page", sizeof (struct page), NULL);
+  if (page_cache == NULL)
+    PANIC ("page cache creation failed");
+}
+
+/* Creates an empty page table for the running process.  Returns
+   true if successful, false if memory is not available. */
+bool
+page_table_create (void)
+{
+  struct thread *t = thread_current ()->process;
+
+  ASSERT (t->pages == NULL);
+
+  t->pages = malloc (sizeof *t->pages);
+  if (t->pages == NULL)
+    return false;
+  if (!hash_init (t->pages, page_hash, page_less, NULL))
+    {
+      free (t->pages);
+      t->pages = NULL;
+      return false;
+    }
+  return true;
+}
+
+/* Destroys the running process's page table, if it has one,
+   unmapping and freeing its frames and swap slots.  Must be
+   called before the process's page directory is destroyed. */
+void
+page_table_destroy (void)
+{
+  struct thread *t = thread_current ()->process;
+
+  if (t->pages != NULL)
+    {
+      /* Free the frames' memory in one go at the end.  The table's
+         aux is handed to page_free() as the batch to add to. */
+      struct palloc_batch batch;
+
+      palloc_batch_init (&batch);
+      t->pages->aux = &batch;
+      hash_destroy (t->pages, page_free);
+      palloc_free_batch (&batch);
+      free (t->pages);
+      t->pages = NULL;
+    }
+}
+
+/* Records that user page UPAGE is to be loaded from FILE: the
+   first READ_BYTES bytes are read starting at offset OFS and the
+   rest of the page is zeroed.  FILE must stay open for as long as
+   the page exists.  The process may write the page if WRITABLE
+   is true.  Returns true if successful, false if UPAGE is already
+   in the table or memory is not available. */
+bool
+page_add_file (void *upage, struct file *file, off_t ofs,
+               size_t read_bytes, bool writable)
+{
+  struct page *p;
+
+  ASSERT (pg_ofs (upage) == 0);
+  ASSERT (read_bytes <= PGSIZE);
+
+  if (read_bytes == 0)
+    return page_add_zero (upage, writable);
+
+  p = page_new (upage, PAGE_FILE, writable);
+  if (p == NULL)
+    return false;
+  p->file = file;
+  p->ofs = ofs;
+  p->read_bytes = read_bytes;
+  return page_insert (p);
+}
+
+/* Records that user page UPAGE of a memory-mapped file is to be
+   loaded from FILE as by page_add_file(), and that changes to it
+   are written back to FILE when it is evicted or removed.  The
+   page is writable.  Returns true if successful, false if UPAGE
+   is already in the table or memory is not available. */
+bool
+page_add_mmap (void *upage, struct file *file, off_t ofs, size_t read_bytes)
+{
+  struct page *p;
+
+  ASSERT (read_bytes > 0 && read_bytes <= PGSIZE);
+
+  p = page_new (upage, PAGE_FILE, true);
+  if (p == NULL)
+    return false;
+  p->file = file;
+  p->ofs = ofs;
+  p->read_bytes = read_bytes;
+  p->write_back = true;
+  return page_insert (p);
+}
+
+/* Records that user page UPAGE is to be filled with zeros.  The
+   process may write the page if WRITABLE is true.  Returns true
+   if successful, false if UPAGE is already in the table or
+   memory is not available. */
+bool
+page_add_zero (void *upage, bool writable)
+{
+  struct page *p;
+
+  ASSERT (pg_ofs (upage) == 0);
+
+  p = page_new (upage, PAGE_ZERO, writable);
+  if (p == NULL)
+    return false;
+  return page_insert (p);
+}
+
+/* Records that user page UPAGE maps page SHM_PAGE of shared
+   memory segment SEG, to which the caller holds a reference, and
+   maps it writable right away.  The page holds references of its
+   own to SEG and to the frame.  Returns true if successful, false
+   if UPAGE is already in the table or memory is not available. */
+bool
+page_add_shm (void *upage, struct shm_segment *seg, size_t shm_page)
+{
+  struct page *p;
+
+  p = page_new (upage, PAGE_SHM, true);
+  if (p == NULL)
+    return false;
+  p->shm = seg;
+  p->shm_page = shm_page;
+  if (!page_map_shm (p))
+    {
+      kmem_cache_free (page_cache, p);
+      return false;
+    }
+  if (!page_insert (p))
+    {
+      /* page_insert() freed P, so undo by hand what it held. */
+      struct frame *f = shm_frame (seg, shm_page);
+      pagedir_clear_page (thread_current ()->process->pagedir, upage);
+      frame_shm_unref (f, NULL);
+      shm_release (seg);
+      return false;
+    }
+  return true;
+}
+
+/* Removes UPAGE from the running process's page table, writing
+   it back first if it is a changed page of a memory-mapped file,
+   and frees its frame or swap slot.  Does nothing if UPAGE is
+   not in the table. */
+void
+page_remove (void *upage)
+{
+  struct thread *t = thread_current ()->process;
+  struct page key;
+  struct hash_elem *e;
+
+  if (t->pages == NULL || !is_user_vaddr (upage))
+    return;
+
+  /* Look up and remove in one step, so that two threads removing
+     the same page can't both get it. */
+  key.upage = pg_round_down (upage);
+  lock_acquire (&t->pages_lock);
+  e = hash_delete (t->pages, &key.elem);
+  lock_release (&t->pages_lock);
+  if (e != NULL)
+    page_discard (hash_entry (e, struct page, elem), NULL);
+}
+
+/* Returns the running process's page table entry for the page
+   containing UADDR, or a null pointer if there is none. */
+struct page *
+page_lookup (const void *uaddr)
+{
+  struct thread *t = thread_current ()->process;
+  struct page p;
+  struct hash_elem *e;
+
+  if (t->pages == NULL || !is_user_vaddr (uaddr))
+    return NULL;
+
+  p.upage = pg_round_down (uaddr);
+  lock_acquire (&t->pages_lock);
+  e = hash_find (t->pages, &p.elem);
+  lock_release (&t->pages_lock);
+  return e != NULL ? hash_entry (e, struct page, elem) : NULL;
+}
+
+/* Brings the page containing UADDR into a frame and maps it in
+   the running process's page directory.  Returns true if
+   successful, false if UADDR is not in the page table, or if no
+   frame is available or the page cannot be read. */
+bool
+page_load (const void *uaddr)
+{
+  struct thread *t = thread_current ()->process;
+  struct page *p = page_lookup (uaddr);
+  struct frame *f;
+  bool success = false;
+
+  if (p == NULL)
+    return false;
+
+  lock_acquire (&p->lock);
+
+  /* Another fault, from the kernel touching the same page in a
+     system call, may already have brought it in. */
+  if (p->frame != NULL)
+    {
+      lock_release (&p->lock);
+      return true;
+    }
+
+  if (page_is_shareable (p))
+    {
+      if (frame_share_attach (p))
+        {
+          success = true;
+          goto done;
+        }
+      f = frame_alloc (p, false);
+      if (f == NULL)
+        goto done;
+      if (file_read_page (p->file, f->kpage, p->read_bytes, p->ofs)
+          != (off_t) p->read_bytes)
+        {
+          frame_free (f);
+          goto done;
+        }
+      memset ((uint8_t *) f->kpage + p->read_bytes, 0,
+              PGSIZE - p->read_bytes);
+      success = frame_share_publish (f, p);
+      goto done;
+    }
+
+  f = frame_alloc (p, p->type == PAGE_ZERO);
+  if (f == NULL)
+    goto done;
+
+  switch (p->type)
+    {
+    case PAGE_FILE:
+      if (file_read_page (p->file, f->kpage, p->read_bytes, p->ofs)
+          != (off_t) p->read_bytes)
+        {
+          frame_free (f);
+          goto done;
+        }
+      memset ((uint8_t *) f->kpage + p->read_bytes, 0,
+              PGSIZE - p->read_bytes);
+      break;
+
+    case PAGE_ZERO:
+      break;
+
+    case PAGE_SWAP:
+      page_swap_in_around (p, f);
+      break;
+
+    default:
+      NOT_REACHED ();
+    }
+
+  if (!pagedir_set_page (t->pagedir, p->upage, f->kpage, p->writable))
+    {
+      frame_free (f);
+      goto done;
+    }
+
+  /* A page read back from swap no longer has a slot, so it must
+     be written out again when it is next evicted. */
+  if (p->type == PAGE_SWAP)
+    {
+      swap_free (p->swap_slot);
+      pagedir_set_dirty (t->pagedir, p->upage, true);
+    }
+
+  p->frame = f;
+  frame_unpin (f);
+  success = true;
+
+ done:
+  lock_release (&p->lock);
+  return success;
+}
+
+/* Handles a write by the running process to the page containing
+   UADDR, which is mapped read-only, by giving the process its
+   own copy of the page if it shares it copy-on-write.  Returns
+   true if the write may be retried, false if the page is not
+   writable at all or no frame is available. */
+bool
+page_copy_on_write (const void *uaddr)
+{
+  struct page *p = page_lookup (uaddr);
+  bool success = true;
+
+  if (p == NULL || !p->writable)
+    return false;
+
+  lock_acquire (&p->lock);
+
+  /* If the page was evicted meanwhile, retrying faults it back
+     in writable. */
+  if (p->frame != NULL)
+    success = frame_unshare (p);
+  lock_release (&p->lock);
+  return success;
+}
+
+/* Fills the running process's empty page table with a copy of
+   PARENT's, for fork.  Memory-mapped files are not inherited.
+   Pages in memory are shared with PARENT, copy-on-write or, for
+   read-only file pages, through the frame sharing table; pages in
+   swap are read into frames of the child's own.  File pages are
+   read from EXECUTABLE, the child's own handle on PARENT's
+   executable.  PARENT's thread that forked must not run
+   meanwhile.  Returns false if
+   memory is not available. */
+bool
+page_table_copy (struct thread *parent, struct file *executable)
+{
+  struct hash_iterator i;
+  bool success = true;
+
+  /* PARENT's other threads may be running. */
+  lock_acquire (&parent->pages_lock);
+  hash_first (&i, parent->pages);
+  while (success && hash_next (&i))
+    {
+      struct page *p = hash_entry (hash_cur (&i), struct page, elem);
+      struct page *q;
+
+      if (p->write_back)
+        continue;
+
+      q = page_new (p->upage, p->type, p->writable);
+      if (q == NULL)
+        {
+          success = false;
+          break;
+        }
+      if (p->type == PAGE_SHM)
+        {
+          /* The child maps the same segment, not a copy. */
+          q->shm = p->shm;
+          q->shm_page = p->shm_page;
+          success = page_map_shm (q);
+          if (success)
+            page_insert (q);
+          else
+            kmem_cache_free (page_cache, q);
+          continue;
+        }
+      if (p->file != NULL)
+        q->file = executable;
+      q->ofs = p->ofs;
+      q->read_bytes = p->read_bytes;
+
+      lock_acquire (&p->lock);
+      if (page_is_shareable (p))
+        {
+          /* Not finding the frame, because it was just evicted,
+             only means Q starts out not present. */
+          if (p->frame != NULL)
+            frame_share_attach (q);
+        }
+      else if (p->frame != NULL)
+        success = frame_cow_share (p, q);
+      else if (p->type == PAGE_SWAP)
+        success = page_copy_swap (p, q);
+      lock_release (&p->lock);
+
+      if (success)
+        page_insert (q);
+      else
+        kmem_cache_free (page_cache, q);
+    }
+  lock_release (&parent->pages_lock);
+  return success;
+}
+
+/* Reads page P of another process, which is in swap, into a new
+   frame for page Q of the running process.  P's lock must be
+   held.  Returns false if no frame is available. */
+static bool
+page_copy_swap (struct page *p, struct page *q)
+{
+  struct frame *f = frame_alloc (q, false);
+
+  if (f == NULL)
+    return false;
+  swap_read (p->swap_slot, f->kpage);
+  if (!pagedir_set_page (q->owner->pagedir, q->upage, f->kpage,
+                         q->writable))
+    {
+      frame_free (f);
+      return false;
+    }
+
+  /* Q's copy is the only one that isn't in P's slot. */
+  pagedir_set_dirty (q->owner->pagedir, q->upage, true);
+  q->frame = f;
+  frame_unpin (f);
+  return true;
+}
+
+/* Maps the frame of shared memory page P, writable, in its
+   owner's page directory, taking references to the frame and
+   segment.  Returns false if memory is not available. */
+static bool
+page_map_shm (struct page *p)
+{
+  struct frame *f = shm_frame (p->shm, p->shm_page);
+
+  if (!pagedir_set_page (p->owner->pagedir, p->upage, f->kpage, true))
+    return false;
+  frame_shm_ref (f);
+  shm_ref (p->shm);
+  p->frame = f;
+  return true;
+}
+
+/* Extends the running process's stack down to the page
+   containing UADDR and brings that page in, if UADDR is a
+   plausible stack access for stack pointer ESP: no more than
+   STACK_SLACK bytes below ESP and within STACK_MAX bytes of the
+   top of user memory.  Returns true if successful, false if
+   UADDR is not a stack access or memory is not available. */
+bool
+page_grow_stack (const void *uaddr, const void *esp)
+{
+  const uint8_t *addr = uaddr;
+  void *upage = pg_round_down (uaddr);
+
+  if (thread_current ()->process->pages == NULL || esp == NULL
+      || !is_user_vaddr (uaddr)
+      || addr + STACK_SLACK < (const uint8_t *) esp
+      || addr < (const uint8_t *) PHYS_BASE - stack_max)
+    return false;
+
+  return page_add_zero (upage, true) && page_load (upage);
+}
+
+/* Unmaps page P, which belongs to OWNER and is in a frame, from
+   OWNER's page directory and saves its contents if they can't be
+   brought in again from where they came from.  P's lock must be
+   held.  Returns true if successful, false if P had to go to
+   swap and swap is full. */
+bool
+page_evict (struct page *p, struct thread *owner)
+{
+  uint32_t *pd = owner->pagedir;
+
+  ASSERT (lock_held_by_current_thread (&p->lock));
+  ASSERT (p->frame != NULL);
+
+  /* Unmap first, so the process can't dirty the page after we
+     look. */
+  pagedir_clear_page (pd, p->upage);
+  if (p->write_back)
+    page_write_back (p, pd);
+  else if (pagedir_is_dirty (pd, p->upage))
+    {
+      size_t slot = swap_out (p->frame->kpage, owner, p->upage);
+      if (slot == SWAP_ERROR)
+        {
+          pagedir_set_page (pd, p->upage, p->frame->kpage, p->writable);
+          pagedir_set_dirty (pd, p->upage, true);
+          return false;
+        }
+      p->type = PAGE_SWAP;
+      p->swap_slot = slot;
+    }
+  p->frame = NULL;
+  return true;
+}
+
+/* Reads page P, which is in swap, into frame F, leaving its slot
+   in use for the caller to free once P is mapped.  Any of the
+   pages that follow P in the running process's address space
+   that are in the slots following P's, and not busy, are read in
+   with it and mapped.  P's lock must be held. */
+static void
+page_swap_in_around (struct page *p, struct frame *f)
+{
+  uint32_t *pd = thread_current ()->process->pagedir;
+  struct page *around[SWAP_CLUSTER];
+  struct frame *frames[SWAP_CLUSTER];
+  size_t slots[SWAP_CLUSTER];
+  void *kpages[SWAP_CLUSTER];
+  size_t first = swap_disk_slot (p->swap_slot);
+  size_t cnt = 1;
+  size_t i;
+
+  around[0] = p;
+  frames[0] = f;
+  slots[0] = p->swap_slot;
+  kpages[0] = f->kpage;
+
+  /* Only try for the neighbors' locks: whoever holds one may be
+     waiting for a frame that this thread's frames would free. */
+  for (; first != SWAP_ERROR && cnt < SWAP_CLUSTER; cnt++)
+    {
+      struct page *q = page_lookup ((uint8_t *) p->upage + cnt * PGSIZE);
+      if (q == NULL || !lock_try_acquire (&q->lock))
+        break;
+      if (q->type != PAGE_SWAP || q->frame != NULL
+          || swap_disk_slot (q->swap_slot) != first + cnt
+          || (frames[cnt] = frame_alloc (q, false)) == NULL)
+        {
+          lock_release (&q->lock);
+          break;
+        }
+      around[cnt] = q;
+      slots[cnt] = q->swap_slot;
+      kpages[cnt] = frames[cnt]->kpage;
+    }
+
+  swap_read_run (slots, kpages, cnt);
+
+  for (i = 1; i < cnt; i++)
+    {
+      struct page *q = around[i];
+      if (pagedir_set_page (pd, q->upage, frames[i]->kpage, q->writable))
+        {
+          swap_free (q->swap_slot);
+          pagedir_set_dirty (pd, q->upage, true);
+          q->frame = frames[i];
+          frame_unpin (frames[i]);
+        }
+      else
+        frame_free (frames[i]);
+      lock_release (&q->lock);
+    }
+}
+
+/* Returns a new page table entry for UPAGE, of the given TYPE,
+   or a null pointer if memory is not available. */
+static struct page *
+page_new (void *upage, enum page_type type, bool writable)
+{
+  struct page *p;
+
+  ASSERT (pg_ofs (upage) == 0);
+
+  p = kmem_cache_alloc (page_cache);
+  if (p == NULL)
+    return NULL;
+  p->upage = upage;
+  p->owner = thread_current ()->process;
+  p->type = type;
+  p->writable = writable;
+  p->file = NULL;
+  p->ofs = 0;
+  p->read_bytes = 0;
+  p->write_back = false;
+  p->swap_slot = SWAP_ERROR;
+  p->shm = NULL;
+  p->shm_page = 0;
+  lock_init (&p->lock);
+  p->frame = NULL;
+  return p;
+}
+
+/* Inserts P into the running process's page table.  Frees P and
+   returns false if its page is already there. */
+static bool
+page_insert (struct page *p)
+{
+  struct thread *t = thread_current ()->process;
+  struct hash_elem *old;
+
+  ASSERT (t->pages != NULL);
+
+  lock_acquire (&t->pages_lock);
+  old = hash_insert (t->pages, &p->elem);
+  lock_release (&t->pages_lock);
+  if (old != NULL)
+    {
+      kmem_cache_free (page_cache, p);
+      return false;
+    }
+  return true;
+}
+
+/* Frees page P, which has been removed from the running process's
+   page table, along with its frame or swap slot, writing it back
+   first if it is a changed page of a memory-mapped file.  If
+   BATCH is nonnull, the frame's memory is added to it instead of
+   being freed at once. */
+static void
+page_discard (struct page *p, struct palloc_batch *batch)
+{
+  uint32_t *pd = thread_current ()->process->pagedir;
+
+  /* Wait out any eviction in progress. */
+  lock_acquire (&p->lock);
+  if (page_is_shareable (p))
+    frame_share_detach (p, batch);
+  else if (p->type == PAGE_SHM)
+    {
+      pagedir_clear_page (pd, p->upage);
+      frame_shm_unref (p->frame, batch);
+      p->frame = NULL;
+      shm_release (p->shm);
+    }
+  else if (p->frame != NULL)
+    {
+      pagedir_clear_page (pd, p->upage);
+      if (p->write_back)
+        page_write_back (p, pd);
+      frame_release (p, batch);
+    }
+  else if (p->type == PAGE_SWAP)
+    swap_free (p->swap_slot);
+  lock_release (&p->lock);
+  kmem_cache_free (page_cache, p);
+}
+
+/* Returns true if P's frame may be shared with other processes
+   that map the same file page: P is a read-only page of a file,
+   which can never differ from the file's contents. */
+static bool
+page_is_shareable (const struct page *p)
+{
+  return p->type == PAGE_FILE && !p->writable && !p->write_back;
+}
+
+/* Writes page P, which is in a frame but no longer mapped in page
+   directory PD, back to its file if it was changed. */
+static void
+page_write_back (struct page *p, uint32_t *pd)
+{
+  if (pagedir_is_dirty (pd, p->upage))
+    file_write_at (p->file, p->frame->kpage, p->read_bytes, p->ofs);
+}
+
+/* Returns a hash value for the page of entry E. */
+static unsigned
+page_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct page *p = hash_entry (e, struct page, elem);
+  return hash_bytes (&p->upage, sizeof p->upage);
+}
+
+/* Returns true if entry A's page precedes entry B's. */
+static bool
+page_less (const struct hash_elem *a, const struct hash_elem *b,
+           void *aux UNUSED)
+{
+  const struct page *pa = hash_entry (a, struct page, elem);
+  const struct page *pb = hash_entry (b, struct page, elem);
+  return pa->upage < pb->upage;
+}
+
+/* Frees entry E of the running process's page table, along
+   with its frame or swap slot, adding the frame's memory to the
+   palloc batch BATCH. */
+static void
+page_free (struct hash_elem *e, void *batch)
+{
+  page_discard (hash_entry (e, struct page, elem), batch);
+}
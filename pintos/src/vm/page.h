@@ -0,0 +1,81 @@
+#ifndef VM_PAGE_H
+#define VM_PAGE_H
+
+#include <hash.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "filesys/off_t.h"
+#include "threads/synch.h"
+
+struct shm_segment;
+struct thread;
+
+/* Default limit on the size of a process's stack, in bytes.
+   Overridden at boot by the "-stack=N" kernel command-line
+   option. */
+#define STACK_MAX_DEFAULT (8 * 1024 * 1024)
+
+/* How far below the stack pointer an access may fall and still
+   count as stack growth.  PUSHA writes 32 bytes below ESP before
+   moving it. */
+#define STACK_SLACK 32
+
+extern size_t stack_max;
+
+/* Where the contents of a user page come from when it is next
+   brought in. */
+enum page_type
+  {
+    PAGE_FILE,                  /* Read from a file, zero the rest. */
+    PAGE_ZERO,                  /* All zeros. */
+    PAGE_SWAP,                  /* Saved in a swap slot. */
+    PAGE_SHM                    /* A page of a shared memory segment. */
+  };
+
+/* An entry in a process's supplemental page table.  Describes one
+   page of user virtual memory that is not necessarily present. */
+struct page
+  {
+    void *upage;                /* User virtual address. */
+    struct thread *owner;       /* Process the page belongs to. */
+    enum page_type type;        /* Source of the page's contents. */
+    bool writable;              /* May the process write the page? */
+
+    /* For PAGE_FILE. */
+    struct file *file;          /* File to read from. */
+    off_t ofs;                  /* Offset in FILE. */
+    size_t read_bytes;          /* Bytes to read; the rest is zeroed. */
+    bool write_back;            /* Write changes back to FILE? */
+
+    /* For PAGE_SWAP. */
+    size_t swap_slot;           /* Slot holding the page. */
+
+    /* For PAGE_SHM. */
+    struct shm_segment *shm;    /* Segment mapped. */
+    size_t shm_page;            /* Page of the segment. */
+
+    struct lock lock;           /* Held while loading or evicting. */
+    struct frame *frame;        /* Frame holding the page, or null. */
+    struct list_elem share_elem; /* Element in shared frame's sharers. */
+    struct hash_elem elem;      /* Element in thread's page table. */
+  };
+
+void page_init (void);
+bool page_table_create (void);
+void page_table_destroy (void);
+
+bool page_add_file (void *upage, struct file *, off_t ofs,
+                    size_t read_bytes, bool writable);
+bool page_add_mmap (void *upage, struct file *, off_t ofs,
+                    size_t read_bytes);
+bool page_add_zero (void *upage, bool writable);
+bool page_add_shm (void *upage, struct shm_segment *, size_t shm_page);
+void page_remove (void *upage);
+struct page *page_lookup (const void *uaddr);
+bool page_load (const void *uaddr);
+bool page_grow_stack (const void *uaddr, const void *esp);
+bool page_copy_on_write (const void *uaddr);
+bool page_table_copy (struct thread *parent, struct file *executable);
+bool page_evict (struct page *, struct thread *owner);
+
+#endif /* vm/page.h */
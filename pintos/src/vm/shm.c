@@ -0,0 +1,192 @@
+#include "vm/shm.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "vm/frame.h"
+
+/* Shared memory segments.
+
+   A segment is a run of zeroed frames that any process may map
+   into its address space, writable, by the segment's id, so that
+   processes exchange data through memory with no system call and
+   no copy.  shm_open() finds a segment by the key its creator
+   chose, creating it if there is none yet.  The frames are taken
+   up front and pinned, so a mapped segment never faults.
+
+   Each page mapping the segment holds a reference to it, and to
+   its frame.  Once mapped, a segment lives until the last of its
+   pages is unmapped, whether by exit or otherwise; one created
+   but never mapped stays until some process maps it. */
+
+/* Largest segment, in pages. */
+#define SHM_MAX_PAGES 256
+
+/* A shared memory segment. */
+struct shm_segment
+  {
+    int id;                     /* Id for shm_map(). */
+    int key;                    /* Key for shm_open(). */
+    size_t page_cnt;            /* Number of pages. */
+    struct frame **frames;      /* The frames, PAGE_CNT of them. */
+    unsigned refs;              /* References held. */
+    bool mapped;                /* Mapped by a page yet? */
+    struct list_elem elem;      /* Element in SEGMENTS. */
+  };
+
+/* Every segment. */
+static struct list segments;
+
+/* Guards SEGMENTS, NEXT_ID, and each segment's REFS and MAPPED. */
+static struct lock shm_lock;
+
+/* Id for the next segment created. */
+static int next_id = 1;
+
+static void segment_free (struct shm_segment *);
+
+/* Initializes the segment table. */
+void
+shm_init (void)
+{
+  list_init (&segments);
+  lock_init (&shm_lock);
+  lock_set_name (&shm_lock, "shm");
+}
+
+/* Returns the id of the segment with the given KEY, creating it
+   SIZE bytes long, rounded up to whole pages, if there is none.
+   Returns -1 if SIZE is 0, if an existing segment is shorter than
+   SIZE, if a new one would be longer than SHM_MAX_PAGES, or if
+   memory runs out. */
+int
+shm_open (int key, size_t size)
+{
+  size_t page_cnt = DIV_ROUND_UP (size, PGSIZE);
+  struct shm_segment *seg;
+  struct list_elem *e;
+  int id = -1;
+
+  if (size == 0 || page_cnt > SHM_MAX_PAGES)
+    return -1;
+
+  lock_acquire (&shm_lock);
+  for (e = list_begin (&segments); e != list_end (&segments);
+       e = list_next (e))
+    {
+      seg = list_entry (e, struct shm_segment, elem);
+      if (seg->key == key)
+        {
+          id = seg->page_cnt >= page_cnt ? seg->id : -1;
+          lock_release (&shm_lock);
+          return id;
+        }
+    }
+
+  /* Allocating frames may evict pages, but no one else needs
+     SHM_LOCK for that. */
+  seg = malloc (sizeof *seg);
+  if (seg != NULL)
+    {
+      seg->frames = calloc (page_cnt, sizeof *seg->frames);
+      seg->page_cnt = 0;
+      if (seg->frames != NULL)
+        while (seg->page_cnt < page_cnt)
+          {
+            struct frame *f = frame_alloc_shm ();
+            if (f == NULL)
+              break;
+            seg->frames[seg->page_cnt++] = f;
+          }
+      if (seg->frames != NULL && seg->page_cnt == page_cnt)
+        {
+          seg->id = id = next_id++;
+          seg->key = key;
+          seg->refs = 0;
+          seg->mapped = false;
+          list_push_back (&segments, &seg->elem);
+        }
+      else
+        segment_free (seg);
+    }
+  lock_release (&shm_lock);
+  return id;
+}
+
+/* Returns the segment with the given ID, with a reference added
+   for the caller to drop with shm_release(), and stores its
+   length in pages in *PAGE_CNT.  Returns a null pointer if there
+   is no such segment. */
+struct shm_segment *
+shm_acquire (int id, size_t *page_cnt)
+{
+  struct list_elem *e;
+
+  lock_acquire (&shm_lock);
+  for (e = list_begin (&segments); e != list_end (&segments);
+       e = list_next (e))
+    {
+      struct shm_segment *seg = list_entry (e, struct shm_segment, elem);
+      if (seg->id == id)
+        {
+          seg->refs++;
+          *page_cnt = seg->page_cnt;
+          lock_release (&shm_lock);
+          return seg;
+        }
+    }
+  lock_release (&shm_lock);
+  return NULL;
+}
+
+/* Adds a reference to SEG for a page that maps it. */
+void
+shm_ref (struct shm_segment *seg)
+{
+  lock_acquire (&shm_lock);
+  ASSERT (seg->refs > 0);
+  seg->refs++;
+  seg->mapped = true;
+  lock_release (&shm_lock);
+}
+
+/* Drops a reference to SEG, and frees SEG once it has been mapped
+   and nothing refers to it any more. */
+void
+shm_release (struct shm_segment *seg)
+{
+  bool dead;
+
+  lock_acquire (&shm_lock);
+  ASSERT (seg->refs > 0);
+  dead = --seg->refs == 0 && seg->mapped;
+  if (dead)
+    list_remove (&seg->elem);
+  lock_release (&shm_lock);
+
+  if (dead)
+    segment_free (seg);
+}
+
+/* Returns the frame holding page PAGE of SEG, to which the
+   caller must hold a reference. */
+struct frame *
+shm_frame (struct shm_segment *seg, size_t page)
+{
+  ASSERT (page < seg->page_cnt);
+  return seg->frames[page];
+}
+
+/* Drops SEG's references to its frames and frees it. */
+static void
+segment_free (struct shm_segment *seg)
+{
+  size_t i;
+
+  for (i = 0; i < seg->page_cnt; i++)
+    frame_shm_unref (seg->frames[i], NULL);
+  free (seg->frames);
+  free (seg);
+}
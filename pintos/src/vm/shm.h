@@ -0,0 +1,16 @@
+#ifndef VM_SHM_H
+#define VM_SHM_H
+
+#include <stddef.h>
+
+struct frame;
+struct shm_segment;
+
+void shm_init (void);
+int shm_open (int key, size_t size);
+struct shm_segment *shm_acquire (int id, size_t *page_cnt);
+void shm_ref (struct shm_segment *);
+void shm_release (struct shm_segment *);
+struct frame *shm_frame (struct shm_segment *, size_t page);
+
+#endif /* vm/shm.h */
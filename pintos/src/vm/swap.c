@@ -0,0 +1,515 @@
+#include "vm/swap.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <list.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Swap space.
+
+   The swap block device is divided into page-size slots.  A
+   bitmap records which slots hold a page.  Each slot is written
+   and read with one multi-sector request.
+
+   In front of the device sits a pool of compressed pages in
+   kernel memory.  swap_out() compresses a page into the pool if
+   it shrinks to a quarter page or less, and writes it straight
+   to a slot only if it does not.  Once the pool outgrows
+   ZPOOL_BYTES, its oldest pages are decompressed and written to
+   consecutive slots, up to SWAP_CLUSTER of them with one request.
+   Most pages evicted by programs that overcommit memory shrink
+   well, so that they come back without a disk access at all.
+
+   A spill writes each page followed by the pages after it in
+   the same process's address space that are in the pool too, so
+   that neighbors end up in neighboring slots.  The page table
+   then reads them back together, with swap_read_run(), when one
+   of them faults.
+
+   The value swap_out() returns identifies a page for as long as
+   it is swapped, wherever it lives: below the number of slots it
+   is a slot, and at or above it is a pool entry, which may have
+   been spilled to a slot since. */
+
+/* Sectors per swap slot. */
+#define SLOT_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Largest compressed page kept in the pool. */
+#define ZSIZE_MAX (PGSIZE / 4)
+
+/* Compressed bytes the pool holds before spilling to disk. */
+#define ZPOOL_BYTES (32 * PGSIZE)
+
+/* Number of pool entries, whether in memory or spilled. */
+#define ZPOOL_ENTRIES 1024
+
+/* Swap device, or null if there is none. */
+static struct block *swap_device;
+
+/* Bit set for each slot in use. */
+static struct bitmap *swap_slots;
+
+/* Number of slots, 0 if there is no swap device. */
+static size_t slot_cnt;
+
+/* Slot where the next search for a free one starts. */
+static size_t next_slot;
+
+/* Guards SWAP_SLOTS and NEXT_SLOT. */
+static struct lock swap_lock;
+
+/* A page swapped to the pool. */
+struct zentry
+  {
+    uint8_t *data;              /* Compressed page, or null if spilled. */
+    uint16_t len;               /* Bytes in DATA. */
+    size_t slot;                /* Slot holding the page once spilled. */
+    const struct thread *owner; /* Process the page belongs to. */
+    const uint8_t *upage;       /* Its user virtual address. */
+    struct list_elem elem;      /* Element in LRU while in memory. */
+  };
+
+/* Pool entries, and a bit set for each one in use. */
+static struct zentry *zentries;
+static struct bitmap *zentry_map;
+
+/* Entries with data in memory, least recently swapped out
+   first. */
+static struct list lru;
+
+/* Compressed bytes in memory. */
+static size_t zpool_bytes;
+
+/* Pages staged for a spill, and for swap_read_run(),
+   SWAP_CLUSTER of them each, or null if there is no swap
+   device. */
+static uint8_t *spill_buf;
+static uint8_t *read_buf;
+
+/* Guards READ_BUF. */
+static struct lock read_lock;
+
+/* Guards the pool: ZENTRIES, ZENTRY_MAP, LRU, ZPOOL_BYTES,
+   SPILL_BUF, and the compressor's tables.  Held across a spill's
+   disk write, so that no entry is read while it moves. */
+static struct lock zpool_lock;
+
+static size_t slot_alloc (size_t cnt);
+static void slot_free (size_t slot);
+static bool zpool_spill (void);
+static size_t compress_page (const uint8_t *src, uint8_t *dst);
+static void decompress_page (const uint8_t *src, size_t len, uint8_t *dst);
+
+/* Initializes swap space on the BLOCK_SWAP device, if there is
+   one, and the compressed pool in front of it.  Without a
+   device, swap_out() fails once the pool is full. */
+void
+swap_init (void)
+{
+  lock_init (&swap_lock);
+  lock_set_name (&swap_lock, "swap");
+  lock_init (&zpool_lock);
+  lock_set_name (&zpool_lock, "zpool");
+  lock_init (&read_lock);
+  lock_set_name (&read_lock, "swap-read");
+  list_init (&lru);
+
+  zentries = malloc (ZPOOL_ENTRIES * sizeof *zentries);
+  zentry_map = bitmap_create (ZPOOL_ENTRIES);
+  if (zentries == NULL || zentry_map == NULL)
+    PANIC ("swap pool creation failed");
+
+  swap_device = block_get_role (BLOCK_SWAP);
+  if (swap_device == NULL)
+    {
+      printf ("swap: no swap device, swapping to memory only\n");
+      return;
+    }
+  slot_cnt = block_size (swap_device) / SLOT_SECTORS;
+  swap_slots = bitmap_create (slot_cnt);
+  spill_buf = palloc_get_multiple (0, SWAP_CLUSTER);
+  read_buf = palloc_get_multiple (0, SWAP_CLUSTER);
+  if (swap_slots == NULL || spill_buf == NULL || read_buf == NULL)
+    PANIC ("swap slot table creation failed");
+}
+
+/* Saves the page at KPAGE, which is user page UPAGE of OWNER,
+   compressed in memory or to a free slot, and returns a value
+   that identifies it to the other functions here.  Returns
+   SWAP_ERROR if there is no room. */
+size_t
+swap_out (const void *kpage, const struct thread *owner, const void *upage)
+{
+  static uint8_t zbuf[ZSIZE_MAX];
+  struct zentry *z;
+  size_t idx, len, slot;
+
+  lock_acquire (&zpool_lock);
+  idx = bitmap_scan_and_flip (zentry_map, 0, 1, false);
+  if (idx != BITMAP_ERROR)
+    {
+      z = &zentries[idx];
+      len = compress_page (kpage, zbuf);
+      z->data = len != 0 ? malloc (len) : NULL;
+      if (z->data != NULL)
+        {
+          memcpy (z->data, zbuf, len);
+          z->len = len;
+          z->slot = SWAP_ERROR;
+          z->owner = owner;
+          z->upage = upage;
+          list_push_back (&lru, &z->elem);
+          zpool_bytes += len;
+          while (zpool_bytes > ZPOOL_BYTES && zpool_spill ())
+            continue;
+          if (zpool_bytes <= ZPOOL_BYTES || z->data == NULL)
+            {
+              lock_release (&zpool_lock);
+              return slot_cnt + idx;
+            }
+
+          /* Nowhere to spill to.  Take the page back out. */
+          list_remove (&z->elem);
+          zpool_bytes -= len;
+          free (z->data);
+        }
+      bitmap_reset (zentry_map, idx);
+    }
+  lock_release (&zpool_lock);
+
+  /* Incompressible, or the pool is out of room. */
+  slot = slot_alloc (1);
+  if (slot != SWAP_ERROR)
+    block_write_multiple (swap_device, slot * SLOT_SECTORS, SLOT_SECTORS,
+                          kpage);
+  return slot;
+}
+
+/* Reads page SLOT into KPAGE and frees SLOT. */
+void
+swap_in (size_t slot, void *kpage)
+{
+  swap_read (slot, kpage);
+  swap_free (slot);
+}
+
+/* Reads page SLOT into KPAGE, leaving SLOT in use. */
+void
+swap_read (size_t slot, void *kpage)
+{
+  struct zentry *z;
+
+  if (slot >= slot_cnt)
+    {
+      ASSERT (bitmap_test (zentry_map, slot - slot_cnt));
+      z = &zentries[slot - slot_cnt];
+      lock_acquire (&zpool_lock);
+      if (z->data != NULL)
+        {
+          decompress_page (z->data, z->len, kpage);
+          lock_release (&zpool_lock);
+          return;
+        }
+      slot = z->slot;
+      lock_release (&zpool_lock);
+    }
+
+  ASSERT (swap_slots != NULL && bitmap_test (swap_slots, slot));
+  block_read_multiple (swap_device, slot * SLOT_SECTORS, SLOT_SECTORS,
+                       kpage);
+}
+
+/* Returns the slot on the swap device holding page SLOT, or
+   SWAP_ERROR if it is in memory.  Once on the device, a page
+   stays in the same slot until it is freed. */
+size_t
+swap_disk_slot (size_t slot)
+{
+  struct zentry *z;
+
+  if (slot < slot_cnt)
+    return slot;
+
+  z = &zentries[slot - slot_cnt];
+  lock_acquire (&zpool_lock);
+  slot = z->data == NULL ? z->slot : SWAP_ERROR;
+  lock_release (&zpool_lock);
+  return slot;
+}
+
+/* Reads pages SLOTS[0] through SLOTS[CNT - 1] into KPAGES[0]
+   through KPAGES[CNT - 1], leaving the slots in use.  If CNT is
+   more than 1, the pages must be on the device in consecutive
+   slots, as swap_disk_slot() reports, and are read with one
+   request. */
+void
+swap_read_run (const size_t slots[], void *kpages[], size_t cnt)
+{
+  size_t first, i;
+
+  ASSERT (cnt > 0 && cnt <= SWAP_CLUSTER);
+  if (cnt == 1)
+    {
+      swap_read (slots[0], kpages[0]);
+      return;
+    }
+
+  first = swap_disk_slot (slots[0]);
+  for (i = 0; i < cnt; i++)
+    ASSERT (swap_disk_slot (slots[i]) == first + i);
+
+  lock_acquire (&read_lock);
+  block_read_multiple (swap_device, first * SLOT_SECTORS,
+                       cnt * SLOT_SECTORS, read_buf);
+  for (i = 0; i < cnt; i++)
+    memcpy (kpages[i], read_buf + i * PGSIZE, PGSIZE);
+  lock_release (&read_lock);
+}
+
+/* Frees SLOT without reading it. */
+void
+swap_free (size_t slot)
+{
+  struct zentry *z;
+
+  if (slot >= slot_cnt)
+    {
+      lock_acquire (&zpool_lock);
+      ASSERT (bitmap_test (zentry_map, slot - slot_cnt));
+      z = &zentries[slot - slot_cnt];
+      slot = z->slot;
+      if (z->data != NULL)
+        {
+          list_remove (&z->elem);
+          zpool_bytes -= z->len;
+          free (z->data);
+        }
+      bitmap_reset (zentry_map, z - zentries);
+      lock_release (&zpool_lock);
+      if (slot == SWAP_ERROR)
+        return;
+    }
+  slot_free (slot);
+}
+
+/* Takes CNT consecutive free slots and returns the first, or
+   returns SWAP_ERROR if there are none. */
+static size_t
+slot_alloc (size_t cnt)
+{
+  size_t slot;
+
+  if (swap_slots == NULL)
+    return SWAP_ERROR;
+
+  lock_acquire (&swap_lock);
+  slot = bitmap_scan_and_flip_next (swap_slots, &next_slot, cnt, false);
+  lock_release (&swap_lock);
+  return slot != BITMAP_ERROR ? slot : SWAP_ERROR;
+}
+
+/* Frees slot SLOT. */
+static void
+slot_free (size_t slot)
+{
+  ASSERT (swap_slots != NULL);
+
+  lock_acquire (&swap_lock);
+  ASSERT (bitmap_test (swap_slots, slot));
+  bitmap_reset (swap_slots, slot);
+  lock_release (&swap_lock);
+}
+
+/* Returns the entry in memory for user page UPAGE of OWNER, or
+   a null pointer if there is none.  ZPOOL_LOCK must be held. */
+static struct zentry *
+zpool_find (const struct thread *owner, const uint8_t *upage)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&lru); e != list_end (&lru); e = list_next (e))
+    {
+      struct zentry *z = list_entry (e, struct zentry, elem);
+      if (z->owner == owner && z->upage == upage)
+        return z;
+    }
+  return NULL;
+}
+
+/* Writes the oldest pages in the pool, each followed by its
+   virtual neighbors in the pool, as many as SWAP_CLUSTER in all,
+   to consecutive slots with one request and drops their
+   compressed data.  ZPOOL_LOCK must be held.  Returns false if
+   nothing could be spilled, because the pool is empty or swap is
+   full or absent. */
+static bool
+zpool_spill (void)
+{
+  struct zentry *batch[SWAP_CLUSTER];
+  size_t first = SWAP_ERROR;
+  size_t cnt = 0;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&zpool_lock));
+
+  while (cnt < SWAP_CLUSTER && !list_empty (&lru))
+    {
+      struct zentry *z = list_entry (list_pop_front (&lru),
+                                     struct zentry, elem);
+      batch[cnt++] = z;
+      while (cnt < SWAP_CLUSTER
+             && (z = zpool_find (z->owner, z->upage + PGSIZE)) != NULL)
+        {
+          list_remove (&z->elem);
+          batch[cnt++] = z;
+        }
+    }
+
+  /* Take as long a run of slots as there is, and put back the
+     pages that do not fit, still oldest first. */
+  for (i = cnt; i > 0; i--)
+    {
+      first = slot_alloc (i);
+      if (first != SWAP_ERROR)
+        break;
+    }
+  while (cnt > i)
+    list_push_front (&lru, &batch[--cnt]->elem);
+  if (cnt == 0)
+    return false;
+
+  for (i = 0; i < cnt; i++)
+    decompress_page (batch[i]->data, batch[i]->len,
+                     spill_buf + i * PGSIZE);
+  block_write_multiple (swap_device, first * SLOT_SECTORS,
+                        cnt * SLOT_SECTORS, spill_buf);
+  for (i = 0; i < cnt; i++)
+    {
+      zpool_bytes -= batch[i]->len;
+      free (batch[i]->data);
+      batch[i]->data = NULL;
+      batch[i]->slot = first + i;
+    }
+  return true;
+}
+
+/* Page compression.
+
+   A compressed page is a sequence of items.  An item whose first
+   byte B is below 0x80 is B + 1 literal bytes, which follow.  One
+   whose first byte is 0x80 or above is a match: B - 0x80 +
+   MIN_MATCH bytes repeated from earlier in the page, the
+   distance back given by the next two bytes, little-endian.  A
+   match may overlap its own output, so a run of one byte costs
+   three bytes per MAX_MATCH. */
+
+#define MIN_MATCH 4
+#define MAX_MATCH (0x7f + MIN_MATCH)
+#define MAX_LITERALS 0x80
+#define HASH_BITS 10
+
+/* Last position in the page seen for each hash of MIN_MATCH
+   bytes.  Guarded by ZPOOL_LOCK. */
+static uint16_t match_table[1 << HASH_BITS];
+
+/* Appends the CNT literal bytes at SRC to DST, which holds *OUT
+   bytes.  Returns false if they do not fit in ZSIZE_MAX. */
+static bool
+emit_literals (const uint8_t *src, size_t cnt, uint8_t *dst, size_t *out)
+{
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_LITERALS ? cnt : MAX_LITERALS;
+      if (*out + 1 + n > ZSIZE_MAX)
+        return false;
+      dst[(*out)++] = n - 1;
+      memcpy (dst + *out, src, n);
+      *out += n;
+      src += n;
+      cnt -= n;
+    }
+  return true;
+}
+
+/* Compresses the page at SRC into DST, which has room for
+   ZSIZE_MAX bytes.  Returns the compressed length, or 0 if it
+   would exceed ZSIZE_MAX.  ZPOOL_LOCK must be held. */
+static size_t
+compress_page (const uint8_t *src, uint8_t *dst)
+{
+  size_t pos = 0;               /* Next byte to look at. */
+  size_t lit = 0;               /* First byte not yet emitted. */
+  size_t out = 0;
+
+  memset (match_table, 0, sizeof match_table);
+  while (pos + MIN_MATCH <= PGSIZE)
+    {
+      uint32_t v;
+      size_t h, cand, len;
+
+      memcpy (&v, src + pos, sizeof v);
+      h = (v * 2654435761u) >> (32 - HASH_BITS);
+      cand = match_table[h];
+      match_table[h] = pos;
+      if (cand >= pos || memcmp (src + cand, src + pos, MIN_MATCH))
+        {
+          pos++;
+          continue;
+        }
+
+      len = MIN_MATCH;
+      while (len < MAX_MATCH && pos + len < PGSIZE
+             && src[cand + len] == src[pos + len])
+        len++;
+      if (!emit_literals (src + lit, pos - lit, dst, &out)
+          || out + 3 > ZSIZE_MAX)
+        return 0;
+      dst[out++] = 0x80 + (len - MIN_MATCH);
+      dst[out++] = (pos - cand) & 0xff;
+      dst[out++] = (pos - cand) >> 8;
+      pos += len;
+      lit = pos;
+    }
+  if (!emit_literals (src + lit, PGSIZE - lit, dst, &out))
+    return 0;
+  return out;
+}
+
+/* Decompresses the LEN bytes at SRC, produced by compress_page(),
+   into the page at DST. */
+static void
+decompress_page (const uint8_t *src, size_t len, uint8_t *dst)
+{
+  size_t in = 0, out = 0;
+
+  while (in < len)
+    {
+      unsigned b = src[in++];
+      if (b < 0x80)
+        {
+          size_t n = b + 1;
+          ASSERT (in + n <= len && out + n <= PGSIZE);
+          memcpy (dst + out, src + in, n);
+          in += n;
+          out += n;
+        }
+      else
+        {
+          size_t n = b - 0x80 + MIN_MATCH;
+          size_t dist;
+          ASSERT (in + 2 <= len);
+          dist = src[in] | (src[in + 1] << 8);
+          in += 2;
+          ASSERT (dist > 0 && dist <= out && out + n <= PGSIZE);
+          for (; n > 0; n--, out++)
+            dst[out] = dst[out - dist];
+        }
+    }
+  ASSERT (out == PGSIZE);
+}
@@ -0,0 +1,23 @@
+#ifndef VM_SWAP_H
+#define VM_SWAP_H
+
+#include <stddef.h>
+
+struct thread;
+
+/* Returned by swap_out() when no slot is available. */
+#define SWAP_ERROR ((size_t) -1)
+
+/* Most pages written or read together with one request. */
+#define SWAP_CLUSTER 8
+
+void swap_init (void);
+size_t swap_out (const void *kpage, const struct thread *owner,
+                 const void *upage);
+void swap_in (size_t slot, void *kpage);
+void swap_read (size_t slot, void *kpage);
+size_t swap_disk_slot (size_t slot);
+void swap_read_run (const size_t slots[], void *kpages[], size_t cnt);
+void swap_free (size_t slot);
+
+#endif /* vm/swap.h */
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
@@ -11,9 +13,15 @@
 #include <unistd.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "tokenizer.h"
 
+extern char **environ;
+
 /* Convenience macro to silence compiler warnings about unused function parameters. */
 #define unused __attribute__((unused))
 
@@ -29,16 +37,52 @@ struct termios shell_tmodes;
 /* Process group id for the shell */
 pid_t shell_pgid;
 
+/* A job: the processes started by one command line, in one process group */
+struct job {
+  int id;
+  pid_t pgid;
+  pid_t *pids;        /* its processes, each 0 once it has exited */
+  size_t count;
+  size_t live;        /* how many of them haven't exited yet */
+  bool stopped;
+  char *command;
+  struct job *next;
+};
+
+/* The jobs not known to have finished, oldest first */
+struct job *jobs;
+
+/* Set by SIGCHLD, so the shell reaps its children before the next prompt */
+volatile sig_atomic_t child_changed;
+
 /* Declare functions */
 int cmd_exit(struct tokens *tokens);
 int cmd_help(struct tokens *tokens);
 int cmd_pwd(struct tokens *tokens);
 int cmd_cd(struct tokens *tokens);
 int cmd_wait(struct tokens *tokens);
+int cmd_hash(struct tokens *tokens);
+int cmd_jobs(struct tokens *tokens);
+int cmd_fg(struct tokens *tokens);
+int cmd_bg(struct tokens *tokens);
+int cmd_echo(struct tokens *tokens);
+int cmd_printf(struct tokens *tokens);
+int cmd_test(struct tokens *tokens);
+int cmd_true(struct tokens *tokens);
+int cmd_false(struct tokens *tokens);
+int cmd_sleep(struct tokens *tokens);
+int cmd_parallel(struct tokens *tokens);
+
+void path_cache_forget(const char *path);
 
 /* Built-in command functions take token array (see parse.h) and return int */
 typedef int cmd_fun_t(struct tokens *tokens);
 
+/* Returned, before it has written anything, by a built-in command that
+ * stands in for a program when it meets something only the program knows,
+ * so that the program is run instead. */
+#define BUILTIN_EXTERNAL -2
+
 /* Built-in command struct and lookup table */
 typedef struct fun_desc {
   cmd_fun_t *fun;
@@ -51,7 +95,20 @@ fun_desc_t cmd_table[] = {
   {cmd_exit, "exit", "exit the command shell"},
   {cmd_pwd, "pwd", "prints the current working directory"},
   {cmd_cd, "cd", "changes the current working directory to target directory"},
-  {cmd_wait, "wait", "waits until all background jobs before returning"},
+  {cmd_wait, "wait", "waits until all background jobs, or job %n, finish before returning"},
+  {cmd_jobs, "jobs", "lists the background and stopped jobs"},
+  {cmd_fg, "fg", "brings the latest job, or job %n, to the foreground"},
+  {cmd_bg, "bg", "continues the latest stopped job, or job %n, in the background"},
+  {cmd_hash, "hash", "lists the remembered paths of commands; hash -r forgets them"},
+  {cmd_echo, "echo", "writes its arguments, then a newline unless -n; -e reads backslash escapes"},
+  {cmd_printf, "printf", "writes its arguments as FORMAT says, reusing it while any are left"},
+  {cmd_test, "test", "succeeds if the expression is true"},
+  {cmd_test, "[", "succeeds if the expression, ended by ], is true"},
+  {cmd_true, "true", "succeeds"},
+  {cmd_false, "false", "fails"},
+  {cmd_sleep, "sleep", "waits for a number of seconds, or with suffix m, h or d, minutes, hours or days"},
+  {cmd_parallel, "parallel", "parallel [-j N] COMMAND [::: ARGS] runs COMMAND once per argument, or "
+   "line of input, N at a time, with {} replaced by it or else it appended"},
 };
 
 /* Prints a helpful description for the given command */
@@ -86,10 +143,669 @@ int cmd_cd(struct tokens *tokens) {
   return 0;
 }
 
-/* Waits until all background jobs before returning */
-int cmd_wait(struct tokens *tokens) {
+/* Writes the escape sequence after the backslash at C the way printf's
+ * format reads it, or if ECHO_STYLE, the way echo -e and printf's %b read
+ * it, with octal escapes written \0NNN. Returns how many characters after
+ * the backslash it took up, or -1 for \c, which ends all output. */
+int write_escape(const char *c, bool echo_style) {
+  const char *names = "abefnrtv\\";
+  const char *values = "\a\b\e\f\n\r\t\v\\";
+  if (*c == 'c')
+    return -1;
+  if (*c && strchr(names, *c)) {
+    fputc(values[strchr(names, *c) - names], stdout);
+    return 1;
+  }
+  if (*c == 'x' && isxdigit((unsigned char) c[1])) {
+    int n = 1, value = 0;
+    for (; n <= 2 && isxdigit((unsigned char) c[n]); n++)
+      value = value * 16 + (isdigit((unsigned char) c[n]) ? c[n] - '0' : tolower(c[n]) - 'a' + 10);
+    fputc(value, stdout);
+    return n;
+  }
+  if (echo_style ? *c == '0' : (*c >= '0' && *c <= '7')) {
+    int n = echo_style ? 1 : 0, end = n + 3, value = 0;
+    for (; n < end && c[n] >= '0' && c[n] <= '7'; n++)
+      value = value * 8 + c[n] - '0';
+    fputc(value & 0xff, stdout);
+    return n;
+  }
+  if (*c == '\0') {
+    fputc('\\', stdout);
+    return 0;
+  }
+  if (!echo_style && (*c == '"' || *c == '\'')) {
+    fputc(*c, stdout);
+    return 1;
+  }
+  fputc('\\', stdout);
+  fputc(*c, stdout);
+  return 1;
+}
+
+/* Writes S with its escapes read as write_escape() reads them with
+ * ECHO_STYLE. Returns false if it stopped at \c, so nothing more is to be
+ * written. */
+bool write_escaped(const char *s, bool echo_style) {
+  for (; *s; s++) {
+    if (*s != '\\') {
+      fputc(*s, stdout);
+      continue;
+    }
+    int taken = write_escape(s + 1, echo_style);
+    if (taken < 0)
+      return false;
+    s += taken;
+  }
+  return true;
+}
+
+/* Writes its arguments separated by spaces, then a newline, as bash's echo
+ * does: leading options made up of n, e and E leave out the newline and
+ * turn reading backslash escapes on and off */
+int cmd_echo(struct tokens *tokens) {
+  size_t length = tokens_get_length(tokens);
+  size_t first = 1;
+  bool newline = true, escapes = false;
+  for (; first < length; first++) {
+    char *option = tokens_get_token(tokens, first);
+    if (option[0] != '-' || !option[1] || option[1 + strspn(option + 1, "neE")])
+      break;
+    for (char *c = option + 1; *c; c++) {
+      if (*c == 'n')
+        newline = false;
+      else
+        escapes = *c == 'e';
+    }
+  }
+  for (size_t i = first; i < length; i++) {
+    char *arg = tokens_get_token(tokens, i);
+    if (i > first)
+      fputc(' ', stdout);
+    if (!escapes)
+      fputs(arg, stdout);
+    else if (!write_escaped(arg, true))
+      return 0;
+  }
+  if (newline)
+    fputc('\n', stdout);
+  return 0;
+}
+
+/* Returns whether the builtin printf knows every conversion in FORMAT:
+ * those of d, i, o, u, x, X, f, F, e, E, g, G, a, A, c and s with flags,
+ * width and precision given in the format, and plain %b and %%. */
+bool printf_supported(const char *format) {
+  for (const char *c = format; *c; c++) {
+    if (*c == '\\' && c[1]) {
+      c++;
+    } else if (*c == '%') {
+      size_t n = strspn(c + 1, "-+ #0123456789.");
+      char conversion = c[1 + n];
+      if (n > 20 || !conversion || !strchr("diouxXfFeEgGaAcsb%", conversion) ||
+          (n > 0 && strchr("b%", conversion)))
+        return false;
+      c += n + 1;
+    }
+  }
+  return true;
+}
+
+/* Returns whether ARG, read as a number up to END, was one, as printf
+ * checks its numeric arguments, after saying why not if it wasn't */
+bool printf_number_read(const char *arg, const char *end) {
+  if (errno == ERANGE)
+    fprintf(stderr, "printf: %s: %s\n", arg, strerror(ERANGE));
+  else if (end == arg)
+    fprintf(stderr, "printf: %s: expected a numeric value\n", arg);
+  else if (*end)
+    fprintf(stderr, "printf: %s: value not completely converted\n", arg);
+  else
+    return true;
+  return false;
+}
+
+/* Writes ARG with the conversion at C, which starts with '%' and which
+ * printf_supported() accepts, and returns the conversion's last character.
+ * A numeric conversion of an argument that isn't a number sets *FAILED; one
+ * that starts with a quote takes the code of the character after it. */
+char *printf_convert(char *c, char *arg, bool *failed) {
+  char spec[32] = "%";
+  size_t n = 1;
+  for (c++; *c && strchr("-+ #0123456789.", *c); c++)
+    spec[n++] = *c;
+  bool quoted = arg && (arg[0] == '\'' || arg[0] == '"');
+  char *end;
+  errno = 0;
+  if (strchr("diouxX", *c)) {
+    long long value = 0;
+    if (quoted) {
+      value = (unsigned char) arg[1];
+    } else if (arg) {
+      value = *c == 'd' || *c == 'i' ? strtoll(arg, &end, 0) : (long long) strtoull(arg, &end, 0);
+      *failed |= !printf_number_read(arg, end);
+    }
+    sprintf(spec + n, "ll%c", *c);
+    fprintf(stdout, spec, value);
+  } else if (strchr("fFeEgGaA", *c)) {
+    double value = 0;
+    if (quoted) {
+      value = (unsigned char) arg[1];
+    } else if (arg) {
+      value = strtod(arg, &end);
+      *failed |= !printf_number_read(arg, end);
+    }
+    sprintf(spec + n, "%c", *c);
+    fprintf(stdout, spec, value);
+  } else if (*c == 's') {
+    strcpy(spec + n, "s");
+    fprintf(stdout, spec, arg ? arg : "");
+  } else if (*c == 'c') {
+    strcpy(spec + n, "c");
+    if (arg && *arg)
+      fprintf(stdout, spec, *arg);
+  }
+  return c;
+}
+
+/* Writes its arguments as the format in the first says, the format being
+ * reused while arguments are left over. A format with a conversion it
+ * doesn't know, such as one with a * width, is left to the printf program
+ * instead. */
+int cmd_printf(struct tokens *tokens) {
+  size_t length = tokens_get_length(tokens);
+  if (length < 2) {
+    fprintf(stderr, "printf: usage: printf FORMAT [ARGUMENTS]...\n");
+    return -1;
+  }
+  char *format = tokens_get_token(tokens, 1);
+  if (!printf_supported(format))
+    return BUILTIN_EXTERNAL;
+  size_t next = 2;
+  size_t used;
+  bool failed = false;
+  do {
+    used = next;
+    for (char *c = format; *c; c++) {
+      char *arg = next < length ? tokens_get_token(tokens, next) : NULL;
+      if (*c == '\\') {
+        int taken = write_escape(c + 1, false);
+        if (taken < 0)
+          return failed ? -1 : 0;
+        c += taken;
+      } else if (*c == '%' && c[1] == '%') {
+        fputc('%', stdout);
+        c++;
+      } else if (*c == '%' && c[1] == 'b') {
+        next++;
+        c++;
+        if (arg && !write_escaped(arg, true))
+          return failed ? -1 : 0;
+      } else if (*c == '%') {
+        c = printf_convert(c, arg, &failed);
+        next++;
+      } else {
+        fputc(*c, stdout);
+      }
+    }
+  } while (next < length && next > used);
+  return failed ? -1 : 0;
+}
+
+/* Returns whether OP is a unary test */
+bool test_unary_op(char *op) {
+  return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghknprstuwxzGLNOS", op[1]);
+}
+
+/* Returns 0 if the unary test OP, which test_unary_op() accepts, of ARG
+ * holds, or 1 if not */
+int test_unary(char *op, char *arg) {
+  struct stat sb;
+  char *end;
+  switch (op[1]) {
+    case 'n': return arg[0] == '\0';
+    case 'z': return arg[0] != '\0';
+    case 'r': return access(arg, R_OK) != 0;
+    case 'w': return access(arg, W_OK) != 0;
+    case 'x': return access(arg, X_OK) != 0;
+    case 't': {
+      long fd = strtol(arg, &end, 10);
+      return end == arg || *end || fd < 0 || fd > INT_MAX || !isatty(fd);
+    }
+    case 'h':
+    case 'L': return !(lstat(arg, &sb) == 0 && S_ISLNK(sb.st_mode));
+  }
+  if (stat(arg, &sb) != 0)
+    return 1;
+  switch (op[1]) {
+    case 'b': return !S_ISBLK(sb.st_mode);
+    case 'c': return !S_ISCHR(sb.st_mode);
+    case 'd': return !S_ISDIR(sb.st_mode);
+    case 'f': return !S_ISREG(sb.st_mode);
+    case 'p': return !S_ISFIFO(sb.st_mode);
+    case 'S': return !S_ISSOCK(sb.st_mode);
+    case 'g': return !(sb.st_mode & S_ISGID);
+    case 'u': return !(sb.st_mode & S_ISUID);
+    case 'k': return !(sb.st_mode & S_ISVTX);
+    case 's': return sb.st_size == 0;
+    case 'G': return sb.st_gid != getegid();
+    case 'O': return sb.st_uid != geteuid();
+    case 'N': return sb.st_mtime <= sb.st_atime;
+    default: return 0;
+  }
+}
+
+/* The binary tests: strings compared, then integers, then files */
+const char *test_binary_ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                                 "-nt", "-ot", "-ef"};
+
+/* Returns the index of binary test OP in test_binary_ops, or -1 */
+int test_binary_op(char *op) {
+  for (int i = 0; i < (int) (sizeof(test_binary_ops) / sizeof(test_binary_ops[0])); i++)
+    if (strcmp(op, test_binary_ops[i]) == 0)
+      return i;
+  return -1;
+}
+
+/* Returns whether A was modified after B */
+bool test_newer(struct stat *a, struct stat *b) {
+  return a->st_mtim.tv_sec != b->st_mtim.tv_sec ? a->st_mtim.tv_sec > b->st_mtim.tv_sec
+                                                 : a->st_mtim.tv_nsec > b->st_mtim.tv_nsec;
+}
+
+/* Returns 0 if the binary test OP of LEFT and RIGHT holds, 1 if not, or 2
+ * if OP isn't one or an operand isn't the integer it compares */
+int test_binary(char *left, char *op, char *right) {
+  int i = test_binary_op(op);
+  if (i < 0)
+    return 2;
+  if (i < 3)
+    return (strcmp(left, right) == 0) == (i == 2);
+  if (i >= 9) {
+    struct stat a, b;
+    bool has_a = stat(left, &a) == 0, has_b = stat(right, &b) == 0;
+    if (i == 9)
+      return !(has_a && (!has_b || test_newer(&a, &b)));
+    if (i == 10)
+      return !(has_b && (!has_a || test_newer(&b, &a)));
+    return !(has_a && has_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino);
+  }
+  char *end_left, *end_right;
+  long long a = strtoll(left, &end_left, 10);
+  long long b = strtoll(right, &end_right, 10);
+  if (end_left == left || *end_left || end_right == right || *end_right)
+    return 2;
+  bool holds[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+  return !holds[i - 3];
+}
+
+/* A test expression being parsed: its COUNT words and the next to read */
+struct test_parser {
+  char **args;
+  size_t count;
+  size_t next;
+  bool malformed;
+};
+
+int test_or(struct test_parser *p);
+
+/* Parses and evaluates "! TERM", "( EXPRESSION )", a unary or binary test,
+ * or a string, which holds if it isn't empty */
+int test_term(struct test_parser *p) {
+  if (p->next == p->count) {
+    p->malformed = true;
+    return 2;
+  }
+  char *word = p->args[p->next++];
+  if (strcmp(word, "!") == 0)
+    return !test_term(p);
+  if (strcmp(word, "(") == 0) {
+    int result = test_or(p);
+    if (p->next == p->count || strcmp(p->args[p->next++], ")") != 0)
+      p->malformed = true;
+    return result;
+  }
+  if (test_unary_op(word) && p->next < p->count)
+    return test_unary(word, p->args[p->next++]);
+  if (p->next + 1 < p->count && test_binary_op(p->args[p->next]) >= 0) {
+    int result = test_binary(word, p->args[p->next], p->args[p->next + 1]);
+    p->next += 2;
+    p->malformed |= result == 2;
+    return result;
+  }
+  return word[0] == '\0';
+}
+
+/* Parses and evaluates terms joined by -a */
+int test_and(struct test_parser *p) {
+  int result = test_term(p);
+  while (p->next < p->count && strcmp(p->args[p->next], "-a") == 0) {
+    p->next++;
+    int right = test_term(p);
+    result = result != 0 || right != 0;
+  }
+  return result;
+}
+
+/* Parses and evaluates -a expressions joined by -o */
+int test_or(struct test_parser *p) {
+  int result = test_and(p);
+  while (p->next < p->count && strcmp(p->args[p->next], "-o") == 0) {
+    p->next++;
+    int right = test_and(p);
+    result = result != 0 && right != 0;
+  }
+  return result;
+}
+
+/* Returns 0 if the expression of the COUNT words at ARGS is true, 1 if
+ * not, or 2 if it's malformed. Up to four words are read by POSIX's rules
+ * for that many, so that an operand that looks like an operator is still an
+ * operand; longer expressions are parsed with ! binding tightest, then
+ * -a, then -o, and ( ) grouping. */
+int test_eval(char **args, size_t count) {
+  int result;
+  switch (count) {
+    case 0:
+      return 1;
+    case 1:
+      return args[0][0] == '\0';
+    case 2:
+      if (strcmp(args[0], "!") == 0)
+        return args[1][0] != '\0';
+      return test_unary_op(args[0]) ? test_unary(args[0], args[1]) : 2;
+    case 3:
+      if (test_binary_op(args[1]) >= 0)
+        return test_binary(args[0], args[1], args[2]);
+      if (strcmp(args[1], "-a") == 0)
+        return args[0][0] == '\0' || args[2][0] == '\0';
+      if (strcmp(args[1], "-o") == 0)
+        return args[0][0] == '\0' && args[2][0] == '\0';
+      if (strcmp(args[0], "!") == 0) {
+        result = test_eval(args + 1, 2);
+        return result == 2 ? 2 : !result;
+      }
+      if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0)
+        return test_eval(args + 1, 1);
+      return 2;
+    case 4:
+      if (strcmp(args[0], "!") == 0) {
+        result = test_eval(args + 1, 3);
+        return result == 2 ? 2 : !result;
+      }
+      if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0)
+        return test_eval(args + 1, 2);
+      break;
+  }
+  struct test_parser p = {args, count, 0, false};
+  result = test_or(&p);
+  return p.malformed || p.next != count ? 2 : result;
+}
+
+/* Succeeds if the expression in its arguments is true; as [, the last must
+ * be ]. An expression it can't make out is left to the test program, to
+ * report as it does. */
+int cmd_test(struct tokens *tokens) {
+  size_t count = tokens_get_length(tokens) - 1;
+  char *name = tokens_get_token(tokens, 0);
+  if (strcmp(name, "[") == 0) {
+    if (count == 0 || strcmp(tokens_get_token(tokens, count), "]") != 0)
+      return BUILTIN_EXTERNAL;
+    count--;
+  }
+  char *args[count + 1];
+  for (size_t i = 0; i < count; i++)
+    args[i] = tokens_get_token(tokens, i + 1);
+  int result = test_eval(args, count);
+  if (result == 2)
+    return BUILTIN_EXTERNAL;
+  return result == 0 ? 0 : -1;
+}
+
+/* Succeeds */
+int cmd_true(unused struct tokens *tokens) {
+  return 0;
+}
+
+/* Fails */
+int cmd_false(unused struct tokens *tokens) {
+  return -1;
+}
+
+/* Set by SIGINT while a builtin that waits catches it, so ^C ends the wait */
+volatile sig_atomic_t interrupted;
+
+void handle_interrupt(unused int sig) {
+  interrupted = 1;
+}
+
+/* Has SIGINT set interrupted, saving its handler in SAVED, if this is the
+ * interactive shell's own process, which otherwise ignores it. Returns
+ * whether it did. */
+bool interrupt_catch(struct sigaction *saved) {
+  interrupted = 0;
+  if (!shell_is_interactive || getpgrp() != shell_pgid)
+    return false;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_interrupt;
+  sigaction(SIGINT, &action, saved);
+  return true;
+}
+
+/* Puts back the SIGINT handler interrupt_catch() saved in SAVED if CAUGHT */
+void interrupt_release(bool caught, struct sigaction *saved) {
+  if (caught)
+    sigaction(SIGINT, saved, NULL);
+}
+
+/* Waits for the number of seconds given, or minutes, hours or days with
+ * suffix m, h or d. In an interactive shell ^C ends the wait, as it would
+ * a program's. Anything else, such as several intervals to add up, is left
+ * to the sleep program. */
+int cmd_sleep(struct tokens *tokens) {
+  char *arg = tokens_get_token(tokens, 1);
+  char *end = arg;
+  double seconds = arg ? strtod(arg, &end) : 0;
+  const char *units = "smhd";
+  const double scale[] = {1, 60, 3600, 86400};
+  char *unit = *end ? strchr(units, *end) : (char *) units;
+  if (tokens_get_length(tokens) != 2 || end == arg || !unit || (*end && end[1]) ||
+      !(seconds >= 0 && seconds < 1e9))
+    return BUILTIN_EXTERNAL;
+  seconds *= scale[unit - units];
+  struct timespec left;
+  left.tv_sec = (time_t) seconds;
+  left.tv_nsec = (long) ((seconds - left.tv_sec) * 1e9);
+
+  struct sigaction saved;
+  bool caught = interrupt_catch(&saved);
+  while (nanosleep(&left, &left) < 0 && errno == EINTR && !interrupted)
+    continue;
+  interrupt_release(caught, &saved);
+  return interrupted ? -1 : 0;
+}
+
+void handle_sigchld(unused int sig) {
+  child_changed = 1;
+}
+
+/* Adds a job of the COUNT processes PIDS, in group PGID, started by COMMAND */
+struct job *job_add(pid_t pgid, pid_t *pids, size_t count, char *command) {
+  struct job *job = malloc(sizeof(struct job));
+  job->id = 1;
+  job->pgid = pgid;
+  job->pids = malloc(count * sizeof(pid_t));
+  memcpy(job->pids, pids, count * sizeof(pid_t));
+  job->count = job->live = count;
+  job->stopped = false;
+  job->command = strdup(command);
+  job->next = NULL;
+
+  struct job **link = &jobs;
+  for (; *link; link = &(*link)->next)
+    job->id = (*link)->id + 1;
+  *link = job;
+  return job;
+}
+
+void job_remove(struct job *job) {
+  struct job **link = &jobs;
+  while (*link != job)
+    link = &(*link)->next;
+  *link = job->next;
+  free(job->pids);
+  free(job->command);
+  free(job);
+}
+
+/* Returns the job SPEC names, "%n" or "n", or the latest job if SPEC is NULL */
+struct job *job_lookup(char *spec) {
+  int id = 0;
+  if (spec)
+    id = atoi(spec[0] == '%' ? spec + 1 : spec);
+  struct job *found = NULL;
+  for (struct job *job = jobs; job; job = job->next)
+    if (spec ? job->id == id : true)
+      found = job;
+  return found;
+}
+
+/* Record the STATUS waitpid() returned for PID */
+void job_mark(pid_t pid, int status) {
+  for (struct job *job = jobs; job; job = job->next) {
+    for (size_t i = 0; i < job->count; i++) {
+      if (job->pids[i] != pid)
+        continue;
+      if (WIFSTOPPED(status)) {
+        job->stopped = true;
+      } else if (WIFCONTINUED(status)) {
+        job->stopped = false;
+      } else {
+        job->pids[i] = 0;
+        job->live--;
+      }
+      return;
+    }
+  }
+}
+
+/* Waits until every process of JOB has exited, or it's stopped */
+void job_wait(struct job *job) {
+  while (job->live > 0 && !job->stopped) {
+    int status;
+    pid_t pid = waitpid(-job->pgid, &status, WUNTRACED);
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    job_mark(pid, status);
+  }
+}
+
+/* Reaps whichever children have changed state, without blocking, and
+ * drops the jobs that are done, saying so if the shell is interactive */
+void reap_jobs() {
+  child_changed = 0;
   int status;
-  while (wait(&status) > 0);
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0)
+    job_mark(pid, status);
+
+  struct job *next;
+  for (struct job *job = jobs; job; job = next) {
+    next = job->next;
+    if (job->live == 0) {
+      if (shell_is_interactive)
+        fprintf(stdout, "[%d]  Done\t%s\n", job->id, job->command);
+      job_remove(job);
+    }
+  }
+}
+
+/* Gives JOB the terminal, continuing it if CONTINUE, and waits until it's
+ * done or stopped */
+void job_foreground(struct job *job, bool cont) {
+  if (shell_is_interactive)
+    tcsetpgrp(shell_terminal, job->pgid);
+  if (cont && job->stopped) {
+    job->stopped = false;
+    kill(-job->pgid, SIGCONT);
+  }
+  job_wait(job);
+  if (shell_is_interactive) {
+    tcsetpgrp(shell_terminal, shell_pgid);
+    tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+  }
+  if (job->live == 0) {
+    job_remove(job);
+  } else {
+    fprintf(stdout, "\n[%d]+  Stopped\t%s\n", job->id, job->command);
+  }
+}
+
+/* Runs the job just started in the background if IS_BG, or else in the foreground */
+void job_start(struct job *job, int is_bg) {
+  if (is_bg) {
+    if (shell_is_interactive)
+      fprintf(stdout, "[%d] %d\n", job->id, job->pgid);
+  } else {
+    job_foreground(job, false);
+  }
+}
+
+/* Waits until all background jobs, or the one given, finish before returning */
+int cmd_wait(struct tokens *tokens) {
+  char *spec = tokens_get_token(tokens, 1);
+  struct job *job = jobs;
+  if (spec && !(job = job_lookup(spec))) {
+    fprintf(stderr, "wait: %s: no such job\n", spec);
+    return -1;
+  }
+  while (job) {
+    struct job *next = spec ? NULL : job->next;
+    job_wait(job);
+    if (job->live == 0)
+      job_remove(job);
+    job = next;
+  }
+  return 0;
+}
+
+/* Lists the jobs not known to have finished */
+int cmd_jobs(unused struct tokens *tokens) {
+  reap_jobs();
+  for (struct job *job = jobs; job; job = job->next)
+    fprintf(stdout, "[%d]  %s\t%s\n", job->id, job->stopped ? "Stopped" : "Running",
+            job->command);
+  return 0;
+}
+
+/* Brings a job to the foreground */
+int cmd_fg(struct tokens *tokens) {
+  struct job *job = job_lookup(tokens_get_token(tokens, 1));
+  if (!job) {
+    fprintf(stderr, "fg: no such job\n");
+    return -1;
+  }
+  fprintf(stdout, "%s\n", job->command);
+  job_foreground(job, true);
+  return 0;
+}
+
+/* Continues a stopped job in the background */
+int cmd_bg(struct tokens *tokens) {
+  struct job *job = job_lookup(tokens_get_token(tokens, 1));
+  if (!job) {
+    fprintf(stderr, "bg: no such job\n");
+    return -1;
+  }
+  if (job->stopped) {
+    job->stopped = false;
+    kill(-job->pgid, SIGCONT);
+  }
+  fprintf(stdout, "[%d]+ %s &\n", job->id, job->command);
   return 0;
 }
 
@@ -110,20 +826,21 @@ void restore_default_signal() {
 * - if io_redir = 1, input redirection is supported
  * - if io_redir = 0, no I/O redirection is supported
  * - if io_redir = -1, output redirection is supported
+ * Returns 0, or -1 after saying why the file couldn't be opened.
  */
-void redirect_io(int io_redir, char *redirect_file_path) {
+int redirect_io(int io_redir, char *redirect_file_path) {
   int newfd;
   if (io_redir == 1) { // input redirect
     newfd = open(redirect_file_path, O_RDONLY, 0644);
     if (newfd < 0) {
       fprintf(stderr, "%s: No such file or directory\n", redirect_file_path);
-      exit(1);
+      return -1;
     }
   } else { // output redirect
     newfd = open(redirect_file_path, O_CREAT|O_TRUNC|O_WRONLY, 0644);
     if (newfd < 0) {
       fprintf(stderr, "%s: Cannot open or create file\n", redirect_file_path);
-      exit(1);
+      return -1;
     }
   }
   if (io_redir == 1) { // input redirect
@@ -131,37 +848,115 @@ void redirect_io(int io_redir, char *redirect_file_path) {
   } else { // output redirect
     dup2(newfd, 1);
   }
+  close(newfd);
+  return 0;
 }
 
-/* Run a execv call in a forked child process 
- * and I/O redirection to redirect_file_path.
+/* Runs the built-in command FUNDEX in the shell itself, with the
+ * redirection IO_REDIR to redirect_file_path, if any, applied to the
+ * shell's own standard input or output meanwhile and undone afterwards.
+ * Returns what the command does, which may be BUILTIN_EXTERNAL, or -1 if
+ * the redirection failed.
  */
-int run_execv(char *arg, char **argv, int io_redir, 
-              char *redirect_file_path, int is_bg) {
-  pid_t pid = fork();
-  int status;
-  if (pid == 0) { // child
-    restore_default_signal();
-    if (io_redir) 
-      redirect_io(io_redir, redirect_file_path);
-    setpgid(getpid(), getpid());
-    if (!is_bg) {
-      tcsetpgrp(shell_terminal, getpid());
+int run_builtin(int fundex, struct tokens *tokens, int io_redir, char *redirect_file_path) {
+  int fd = io_redir == 1 ? STDIN_FILENO : STDOUT_FILENO;
+  int saved = -1;
+  if (io_redir) {
+    fflush(stdout);
+    saved = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    if (saved < 0 || redirect_io(io_redir, redirect_file_path) < 0) {
+      if (saved >= 0)
+        close(saved);
+      return -1;
     }
-    if (execv(arg, argv) < 0) {
-      fprintf(stderr, "This shell doesn't know how to run this program/command.\n");
-    }
-    //fprintf(stdout, "[%d]+ Done\n", pid);
-    exit(0);
-  } else if (pid > 0) { // parent
-    if (!is_bg) {
-      wait(&status);
-      tcsetpgrp(shell_terminal, getpid());
-    }
-  } else { // failed to fork
+  }
+  int status = cmd_table[fundex].fun(tokens);
+  /* Before any child forked next could inherit the output. */
+  fflush(stdout);
+  if (io_redir) {
+    dup2(saved, fd);
+    close(saved);
+  }
+  return status;
+}
+
+/* Start the program PATH with arguments ARGV in a child process. Unlike
+ * fork(), posix_spawn() doesn't copy the shell's address space: the child
+ * runs on it only until it execs. The child gets default signal handlers,
+ * joins process group PGID, or a group of its own if PGID is 0, and takes
+ * the terminal if FOREGROUND. IN and OUT become its standard input and
+ * output, UNUSED_FD, if not -1, is closed, and then the redirection
+ * IO_REDIR to redirect_file_path, if any, is applied over them.
+ * Returns the child's pid, or -1 after saying why it couldn't start.
+ */
+pid_t spawn_program(char *path, char **argv, int io_redir, char *redirect_file_path,
+                    pid_t pgid, int in, int out, int unused_fd, int foreground) {
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGINT);
+  sigaddset(&defaults, SIGQUIT);
+  sigaddset(&defaults, SIGTERM);
+  sigaddset(&defaults, SIGTSTP);
+  sigaddset(&defaults, SIGCONT);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setpgroup(&attr, pgid);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (foreground && shell_is_interactive)
+    posix_spawn_file_actions_addtcsetpgrp_np(&actions, shell_terminal);
+  if (in != STDIN_FILENO) {
+    posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&actions, in);
+  }
+  if (out != STDOUT_FILENO) {
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, out);
+  }
+  if (unused_fd >= 0)
+    posix_spawn_file_actions_addclose(&actions, unused_fd);
+  if (io_redir == 1) { // input redirect
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, redirect_file_path,
+                                     O_RDONLY, 0644);
+  } else if (io_redir) { // output redirect
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, redirect_file_path,
+                                     O_CREAT|O_TRUNC|O_WRONLY, 0644);
+  }
+
+  pid_t pid;
+  int error = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (error == 0)
+    return pid;
+
+  /* Whichever step failed, the error comes back the same way. */
+  if (error == EAGAIN || error == ENOMEM) {
     fprintf(stderr, "Failed to fork a child process to run command.\n");
-    return -1;
+  } else if (io_redir == 1 && access(redirect_file_path, R_OK) != 0) {
+    fprintf(stderr, "%s: No such file or directory\n", redirect_file_path);
+  } else if (io_redir == -1 && access(redirect_file_path, W_OK) != 0) {
+    fprintf(stderr, "%s: Cannot open or create file\n", redirect_file_path);
+  } else {
+    path_cache_forget(path);
+    fprintf(stderr, "This shell doesn't know how to run this program/command.\n");
   }
+  return -1;
+}
+
+/* Run a program in a child process 
+ * and I/O redirection to redirect_file_path.
+ */
+int run_execv(char *arg, char **argv, int io_redir, 
+              char *redirect_file_path, int is_bg, char *command) {
+  pid_t pid = spawn_program(arg, argv, io_redir, redirect_file_path,
+                            0, STDIN_FILENO, STDOUT_FILENO, -1, !is_bg);
+  if (pid < 0)
+    return -1;
+  job_start(job_add(pid, &pid, 1, command), is_bg);
   return 0;
 }
 
@@ -175,58 +970,432 @@ int file_exists(char *path) {
   return 0;
 }
 
+/* Number of buckets in the table of commands found on PATH. */
+#define PATH_CACHE_BUCKETS 64
+
+/* A command found on PATH, remembered so running it again doesn't search
+ * PATH for it. Entries are chained by bucket. */
+struct path_entry {
+  char *name;
+  char *path;
+  struct path_entry *next;
+};
+
+struct path_entry *path_cache[PATH_CACHE_BUCKETS];
+
+/* The value of PATH the remembered commands were found on */
+char *path_cache_env;
+
+/* Returns the bucket of the command NAME. */
+struct path_entry **path_cache_bucket(const char *name) {
+  unsigned long hash = 5381;
+  for (const char *c = name; *c; c++)
+    hash = hash * 33 + (unsigned char) *c;
+  return &path_cache[hash % PATH_CACHE_BUCKETS];
+}
+
+/* Forgets every remembered command. */
+void path_cache_clear() {
+  for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+    while (path_cache[i]) {
+      struct path_entry *entry = path_cache[i];
+      path_cache[i] = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+    }
+  }
+  free(path_cache_env);
+  path_cache_env = NULL;
+}
+
+/* Forgets the commands remembered at PATH, which failed to run. */
+void path_cache_forget(const char *path) {
+  for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+    struct path_entry **link = &path_cache[i];
+    while (*link) {
+      struct path_entry *entry = *link;
+      if (strcmp(entry->path, path) == 0) {
+        *link = entry->next;
+        free(entry->name);
+        free(entry->path);
+        free(entry);
+      } else {
+        link = &entry->next;
+      }
+    }
+  }
+}
+
+/* Lists the remembered commands, or with -r forgets them */
+int cmd_hash(struct tokens *tokens) {
+  char *option = tokens_get_token(tokens, 1);
+  if (option && strcmp(option, "-r") == 0) {
+    path_cache_clear();
+    return 0;
+  }
+  for (int i = 0; i < PATH_CACHE_BUCKETS; i++)
+    for (struct path_entry *entry = path_cache[i]; entry; entry = entry->next)
+      fprintf(stdout, "%s\t%s\n", entry->name, entry->path);
+  return 0;
+}
+
 /* Return the absolute path of a relative path using PATH
  * environment variable. Otherwise, the relative path is returned.
  * Note the returned value is always a new dynamically allocated variable.
+ *
+ * Paths found on PATH are remembered until PATH changes, or until the file
+ * found is no longer executable, which is checked each time it's used.
  */
 char* resolve_path(char *path) {
-  // Get PATH environment variable and make a copy to prevent modification by strtok
   char *pPath = getenv("PATH");
+  if (file_exists(path) || strchr(path, '/') || !pPath) {
+    return strdup(path);
+  }
+  if (!path_cache_env || strcmp(path_cache_env, pPath) != 0) {
+    path_cache_clear();
+    path_cache_env = strdup(pPath);
+  }
+
+  struct path_entry **bucket = path_cache_bucket(path);
+  for (struct path_entry **link = bucket; *link; link = &(*link)->next) {
+    struct path_entry *entry = *link;
+    if (strcmp(entry->name, path) == 0) {
+      if (access(entry->path, X_OK) == 0) {
+        return strdup(entry->path);
+      }
+      *link = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      break;
+    }
+  }
+
+  // Make a copy of PATH to prevent modification by strtok_r
   char path_env[strlen(pPath) + 1];
   strcpy(path_env, pPath);
 
   // Resolve absolute path
-  char *path_prefix;
-  char *absolute_path = (char *) malloc(PATH_MAX + 1);
-
-  if (!file_exists(path) && pPath) {
-    path_prefix = strtok(path_env, ":");
-    while (path_prefix != NULL) {
-      strcpy(absolute_path, path_prefix);
-      strncat(absolute_path, "/", 1);
-      strncat(absolute_path, path, PATH_MAX);
-      if (file_exists(absolute_path)) {
-        return absolute_path;
-      }
-      path_prefix = strtok(NULL, ":");
+  char *save;
+  char absolute_path[PATH_MAX + 1];
+  for (char *path_prefix = strtok_r(path_env, ":", &save); path_prefix != NULL;
+       path_prefix = strtok_r(NULL, ":", &save)) {
+    if (snprintf(absolute_path, sizeof(absolute_path), "%s/%s", path_prefix, path)
+        >= (int) sizeof(absolute_path)) {
+      continue;
+    }
+    if (access(absolute_path, X_OK) == 0) {
+      struct path_entry *entry = malloc(sizeof(struct path_entry));
+      entry->name = strdup(path);
+      entry->path = strdup(absolute_path);
+      entry->next = *bucket;
+      *bucket = entry;
+      return strdup(absolute_path);
     }
   }
   // Still return the same path, if absolute path cannot find
-  strcpy(absolute_path, path);
-  return absolute_path;
+  return strdup(path);
 }
 
 /* Execute a program using execv with path resolution 
- * and IO redirection to redirect_file_path if io_redit != 0
+ * and IO redirection to redirect_file_path if io_redit != 0,
+ * as a job started by COMMAND
  */
-int execute_program(struct tokens *tokens, int io_redir, char *redirect_file_path, int is_bg) {
+int execute_program(struct tokens *tokens, int io_redir, char *redirect_file_path, int is_bg,
+                    char *command) {
   size_t args_length = tokens_get_length(tokens);
   if (args_length <= 0) {
     return 0;
   }
   char *args[args_length+1];
-  for (size_t i = 0; i < args_length; i++) {
-    args[i] = resolve_path(tokens_get_token(tokens, i));
+  args[0] = resolve_path(tokens_get_token(tokens, 0));
+  for (size_t i = 1; i < args_length; i++) {
+    args[i] = tokens_get_token(tokens, i);
   }
   args[args_length] = NULL;
-  int status = run_execv(args[0], args, io_redir, redirect_file_path, is_bg);
-  // free absolute paths
-  for (size_t i = 0; i < args_length; i++) {
-    free(args[i]);
+  int status = run_execv(args[0], args, io_redir, redirect_file_path, is_bg, command);
+  // free absolute path
+  free(args[0]);
+  return status;
+}
+
+/* One command parallel is running, as a job of its own */
+struct parallel_slot {
+  struct job *job;    /* NULL if the slot is free */
+  int out;            /* read end of the pipe it writes to, -1 at its end */
+  bool exited;
+  int status;
+  char *output;       /* what it has written so far */
+  size_t length;
+  size_t capacity;
+};
+
+/* Returns WORD with every {} replaced by ARG, newly allocated */
+char *parallel_substitute(char *word, char *arg) {
+  size_t count = 0;
+  for (char *c = strstr(word, "{}"); c; c = strstr(c + 2, "{}"))
+    count++;
+  char *result = malloc(strlen(word) + count * strlen(arg) + 1);
+  char *out = result;
+  for (char *c = word; *c; ) {
+    if (c[0] == '{' && c[1] == '}') {
+      out = stpcpy(out, arg);
+      c += 2;
+    } else {
+      *out++ = *c++;
+    }
+  }
+  *out = '\0';
+  return result;
+}
+
+/* Starts the command of the COUNT words WORDS for ARG in SLOT, its
+ * standard input IN and its standard output a pipe the shell reads.
+ * Returns -1 after saying why if it couldn't be started. */
+int parallel_start(struct parallel_slot *slot, char **words, size_t count, char *arg, int in) {
+  bool substituted = false;
+  char *argv[count + 2];
+  size_t length = 0;
+  for (size_t i = 0; i < count; i++) {
+    argv[i] = parallel_substitute(words[i], arg);
+    substituted |= strcmp(argv[i], words[i]) != 0;
+    length += strlen(argv[i]) + 1;
+  }
+  size_t argc = count;
+  if (!substituted) {
+    argv[argc++] = strdup(arg);
+    length += strlen(arg) + 1;
+  }
+  argv[argc] = NULL;
+
+  char command[length + 1];
+  char *end = command;
+  for (size_t i = 0; i < argc; i++)
+    end += sprintf(end, i ? " %s" : "%s", argv[i]);
+
+  int status = -1;
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    fprintf(stderr, "parallel: %s\n", strerror(errno));
+  } else {
+    char *path = resolve_path(argv[0]);
+    pid_t pid = spawn_program(path, argv, 0, NULL, 0, in, fds[1], -1, false);
+    free(path);
+    close(fds[1]);
+    if (pid < 0) {
+      close(fds[0]);
+    } else {
+      slot->job = job_add(pid, &pid, 1, command);
+      slot->out = fds[0];
+      slot->exited = false;
+      slot->length = 0;
+      status = 0;
+    }
   }
+  for (size_t i = 0; i < argc; i++)
+    free(argv[i]);
   return status;
 }
 
+/* Writes out what the command in SLOT wrote, says how it failed if it did,
+ * and frees SLOT. Returns whether it succeeded. */
+bool parallel_finish(struct parallel_slot *slot) {
+  fwrite(slot->output, 1, slot->length, stdout);
+  fflush(stdout);
+  bool succeeded = WIFEXITED(slot->status) && WEXITSTATUS(slot->status) == 0;
+  if (WIFEXITED(slot->status) && !succeeded)
+    fprintf(stderr, "parallel: %s: exit status %d\n", slot->job->command,
+            WEXITSTATUS(slot->status));
+  else if (WIFSIGNALED(slot->status))
+    fprintf(stderr, "parallel: %s: %s\n", slot->job->command,
+            strsignal(WTERMSIG(slot->status)));
+  job_remove(slot->job);
+  slot->job = NULL;
+  return succeeded;
+}
+
+/* Appends what can be read from the pipe of SLOT to its output, closing
+ * the pipe at its end */
+void parallel_read(struct parallel_slot *slot) {
+  if (slot->capacity - slot->length < PIPE_BUF) {
+    slot->capacity = slot->capacity * 2 + PIPE_BUF;
+    slot->output = realloc(slot->output, slot->capacity);
+  }
+  ssize_t n = read(slot->out, slot->output + slot->length, slot->capacity - slot->length);
+  if (n > 0) {
+    slot->length += n;
+  } else if (n == 0 || errno != EINTR) {
+    close(slot->out);
+    slot->out = -1;
+  }
+}
+
+/* Reads standard input to its end and returns its nonempty lines, as
+ * many as *COUNT says, within a buffer at *TEXT; both are to be freed */
+char **parallel_read_lines(char **text, size_t *count) {
+  size_t length = 0, capacity = 4096;
+  *text = malloc(capacity + 1);
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, *text + length, capacity - length)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    length += n;
+    if (length == capacity)
+      *text = realloc(*text, (capacity *= 2) + 1);
+  }
+  (*text)[length] = '\0';
+
+  char **lines = malloc((length / 2 + 1) * sizeof(char *));
+  *count = 0;
+  char *save;
+  for (char *line = strtok_r(*text, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+    lines[(*count)++] = line;
+  return lines;
+}
+
+/* Runs a command once for each argument after :::, or else each line of
+ * standard input, keeping up to N of them (-j N, by default one per
+ * processor) running at once. Each is a job of its own, writing to a pipe
+ * the shell reads, so that what each writes comes out in one piece once
+ * it's done, in the order they finish. Fails if any of them did. */
+int cmd_parallel(struct tokens *tokens) {
+  size_t length = tokens_get_length(tokens);
+  long limit = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t first = 1;
+  char *option = tokens_get_token(tokens, 1);
+  if (option && strncmp(option, "-j", 2) == 0) {
+    char *value = option[2] ? option + 2 : tokens_get_token(tokens, 2);
+    char *end;
+    limit = value ? strtol(value, &end, 10) : 0;
+    if (!value || *end || limit <= 0) {
+      fprintf(stderr, "parallel: -j needs a number of jobs above 0\n");
+      return -1;
+    }
+    first = option[2] ? 2 : 3;
+  }
+  char *words[length + 1];
+  size_t count = 0;
+  while (first + count < length && strcmp(tokens_get_token(tokens, first + count), ":::") != 0) {
+    words[count] = tokens_get_token(tokens, first + count);
+    count++;
+  }
+  if (count == 0) {
+    fprintf(stderr, "parallel: usage: parallel [-j N] COMMAND [::: ARGS]\n");
+    return -1;
+  }
+
+  /* The arguments come after :::, or else one per line of input, in
+   * which case the commands get none. */
+  char *text = NULL;
+  char **args;
+  size_t arg_count;
+  int in = STDIN_FILENO;
+  if (first + count < length) {
+    arg_count = length - first - count - 1;
+    args = malloc(arg_count * sizeof(char *));
+    for (size_t i = 0; i < arg_count; i++)
+      args[i] = tokens_get_token(tokens, first + count + 1 + i);
+  } else {
+    args = parallel_read_lines(&text, &arg_count);
+    in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+
+  if ((size_t) limit > arg_count)
+    limit = arg_count;
+  struct parallel_slot *slots = calloc(limit ? limit : 1, sizeof(struct parallel_slot));
+  struct pollfd *fds = malloc((limit ? limit : 1) * sizeof(struct pollfd));
+
+  /* SIGCHLD is held off except while waiting, so one can't slip in
+   * between seeing no child has changed and starting to wait. */
+  sigset_t chld, unblocked;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &unblocked);
+  struct sigaction saved;
+  bool caught = interrupt_catch(&saved);
+  bool failed = false, stopping = false;
+  size_t next = 0, running = 0;
+  fflush(stdout);
+
+  while (running > 0 || (next < arg_count && !stopping)) {
+    /* Fill the free slots. Children mustn't inherit SIGCHLD held off. */
+    for (long i = 0; i < limit && next < arg_count && !stopping; i++) {
+      if (slots[i].job)
+        continue;
+      sigprocmask(SIG_SETMASK, &unblocked, NULL);
+      int started = parallel_start(&slots[i], words, count, args[next++], in);
+      sigprocmask(SIG_BLOCK, &chld, NULL);
+      if (started < 0)
+        failed = true;
+      else
+        running++;
+    }
+
+    if (interrupted && !stopping) {
+      stopping = true;
+      for (long i = 0; i < limit; i++)
+        if (slots[i].job)
+          kill(-slots[i].job->pgid, SIGINT);
+    }
+
+    if (child_changed) {
+      child_changed = 0;
+      for (long i = 0; i < limit; i++) {
+        struct parallel_slot *slot = &slots[i];
+        if (slot->job && !slot->exited && waitpid(slot->job->pgid, &slot->status, WNOHANG) > 0) {
+          job_mark(slot->job->pgid, slot->status);
+          slot->exited = true;
+        }
+      }
+    }
+
+    /* A command is done once it has exited and its output has ended. */
+    size_t watched = 0;
+    bool finished = false;
+    for (long i = 0; i < limit; i++) {
+      struct parallel_slot *slot = &slots[i];
+      if (!slot->job)
+        continue;
+      if (slot->exited && slot->out < 0) {
+        failed |= !parallel_finish(slot);
+        running--;
+        finished = true;
+      } else if (slot->out >= 0) {
+        fds[watched].fd = slot->out;
+        fds[watched].events = POLLIN;
+        fds[watched++].revents = 0;
+      }
+    }
+    if (finished || running == 0)
+      continue;
+
+    /* Wait for output, or with it all read, a signal. */
+    if (ppoll(fds, watched, NULL, &unblocked) <= 0)
+      continue;
+    for (long i = 0, j = 0; i < limit; i++)
+      if (slots[i].job && slots[i].out >= 0 && fds[j++].revents)
+        parallel_read(&slots[i]);
+  }
+
+  interrupt_release(caught, &saved);
+  sigprocmask(SIG_SETMASK, &unblocked, NULL);
+  /* Other jobs may have changed meanwhile, unnoticed. */
+  child_changed = 1;
+  for (long i = 0; i < limit; i++)
+    free(slots[i].output);
+  free(slots);
+  free(fds);
+  free(args);
+  free(text);
+  if (in != STDIN_FILENO && in >= 0)
+    close(in);
+  return failed || stopping ? -1 : 0;
+}
+
 /* Return 1 if input redirection, -1 if output redirection, 0 if no redirection. */
 int io_redirection_type(char *line) {
   if (strchr(line, '<')) {
@@ -238,6 +1407,23 @@ int io_redirection_type(char *line) {
   }
 }
 
+/* Returns the first character of S in SET that isn't quoted or escaped,
+ * reading quotes and backslashes the way the tokenizer does, or NULL. */
+char *find_unquoted(char *s, const char *set) {
+  char quote = 0;
+  for (; *s; s++) {
+    if (*s == '\\' && s[1])
+      s++;
+    else if (quote)
+      quote = *s == quote ? 0 : quote;
+    else if (*s == '\'' || *s == '"')
+      quote = *s;
+    else if (strchr(set, *s))
+      return s;
+  }
+  return NULL;
+}
+
 /* Looks up the built-in command, if it exists. */
 int lookup(char cmd[]) {
   for (unsigned int i = 0; i < sizeof(cmd_table) / sizeof(fun_desc_t); i++)
@@ -246,13 +1432,181 @@ int lookup(char cmd[]) {
   return -1;
 }
 
-/* Initialization procedures for this shell */
-void init_shell() {
+/* Most stages in one pipeline. */
+#define PIPELINE_MAX 64
+
+/* One stage of a pipeline: its words, the program it runs unless it's a
+ * built-in command, and the file it redirects to, if any. */
+struct stage {
+  struct tokens *tokens;
+  char *path;
+  struct tokens *redirect_tokens;
+  int io_redir;
+};
+
+/* Start a child to run STAGE in process group PGID, or a group of its
+ * own if PGID is 0, with IN and OUT as its standard input and output
+ * unless the stage redirects them, and with UNUSED_FD, if not -1, closed.
+ * A program is spawned; a built-in command runs in a forked copy of the
+ * shell. Returns the child's pid, or -1 if it couldn't be started.
+ */
+pid_t run_stage(struct stage *stage, pid_t pgid, int in, int out, int unused_fd, int is_bg) {
+  if (stage->path) {
+    size_t args_length = tokens_get_length(stage->tokens);
+    char *args[args_length+1];
+    args[0] = stage->path;
+    for (size_t i = 1; i < args_length; i++) {
+      args[i] = tokens_get_token(stage->tokens, i);
+    }
+    args[args_length] = NULL;
+    return spawn_program(stage->path, args, stage->io_redir,
+                         tokens_get_token(stage->redirect_tokens, 0),
+                         pgid, in, out, unused_fd, !is_bg);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) { // child
+    restore_default_signal();
+    setpgid(0, pgid);
+    if (!is_bg && shell_is_interactive) {
+      tcsetpgrp(shell_terminal, getpgrp());
+    }
+    if (in != STDIN_FILENO) {
+      dup2(in, STDIN_FILENO);
+      close(in);
+    }
+    if (out != STDOUT_FILENO) {
+      dup2(out, STDOUT_FILENO);
+      close(out);
+    }
+    if (unused_fd >= 0) {
+      close(unused_fd);
+    }
+    if (stage->io_redir &&
+        redirect_io(stage->io_redir, tokens_get_token(stage->redirect_tokens, 0)) < 0)
+      _exit(1);
+
+    /* _exit(), since exit() would hand back the input the shell has
+     * buffered but not yet read, rewinding a script it's reading. */
+    int fundex = lookup(tokens_get_token(stage->tokens, 0));
+    int status = cmd_table[fundex].fun(stage->tokens);
+    fflush(stdout);
+    if (status == BUILTIN_EXTERNAL) {
+      size_t args_length = tokens_get_length(stage->tokens);
+      char *args[args_length + 1];
+      args[0] = resolve_path(tokens_get_token(stage->tokens, 0));
+      for (size_t i = 1; i < args_length; i++)
+        args[i] = tokens_get_token(stage->tokens, i);
+      args[args_length] = NULL;
+      execv(args[0], args);
+      fprintf(stderr, "This shell doesn't know how to run this program/command.\n");
+      _exit(127);
+    }
+    _exit(status < 0);
+  } else if (pid > 0) { // parent
+    /* Set the group here too, so it exists before the next stage joins it. */
+    setpgid(pid, pgid == 0 ? pid : pgid);
+  } else {
+    fprintf(stderr, "Failed to fork a child process to run command.\n");
+  }
+  return pid;
+}
+
+/* Run LINE, commands separated by '|', as one job started by COMMAND.
+ * Every stage starts at once, in one process group, reading what the stage
+ * before it writes through a pipe. Unless IS_BG, the job gets the terminal
+ * and the shell waits until all of its stages have exited or it's stopped.
+ */
+int execute_pipeline(char *line, int is_bg, char *command) {
+  struct stage stages[PIPELINE_MAX];
+  size_t count = 0;
+  int status = 0;
+
+  char *background = strchr(line, '&');
+  if (background)
+    *background = '\0';
+  /* A '|' in quotes is part of a word, not the end of a stage. */
+  char *bar;
+  for (char *text = line; text != NULL; text = bar ? bar + 1 : NULL) {
+    bar = find_unquoted(text, "|");
+    if (bar)
+      *bar = '\0';
+    if (count == PIPELINE_MAX) {
+      fprintf(stderr, "Too many commands in one pipeline.\n");
+      status = -1;
+      break;
+    }
+    struct stage *stage = &stages[count++];
+    stage->io_redir = io_redirection_type(text);
+    stage->redirect_tokens = NULL;
+    stage->path = NULL;
+    if (stage->io_redir) {
+      char *save_redirect;
+      stage->tokens = tokenize(strtok_r(text, "<>", &save_redirect));
+      stage->redirect_tokens = tokenize(strtok_r(NULL, "<>", &save_redirect));
+    } else {
+      stage->tokens = tokenize(text);
+    }
+    if (tokens_get_length(stage->tokens) == 0 ||
+        (stage->io_redir && tokens_get_length(stage->redirect_tokens) == 0)) {
+      fprintf(stderr, "Syntax error in pipeline.\n");
+      status = -1;
+      break;
+    }
+    /* Resolved here, so the shell remembers what its children find. */
+    if (lookup(tokens_get_token(stage->tokens, 0)) < 0)
+      stage->path = resolve_path(tokens_get_token(stage->tokens, 0));
+  }
+  pid_t pids[PIPELINE_MAX];
+  size_t launched = 0;
+  pid_t pgid = 0;
+  int in = STDIN_FILENO;
+  size_t runnable = status == 0 ? count : 0;
+  for (size_t i = 0; i < runnable; i++) {
+    int fds[2] = {-1, STDOUT_FILENO};
+    if (i + 1 < count && pipe(fds) < 0) {
+      fprintf(stderr, "Failed to create a pipe: %s\n", strerror(errno));
+      status = -1;
+      break;
+    }
+    pid_t pid = run_stage(&stages[i], pgid, in, fds[1], fds[0], is_bg);
+    if (in != STDIN_FILENO)
+      close(in);
+    if (fds[1] != STDOUT_FILENO)
+      close(fds[1]);
+    in = fds[0];
+    /* The stages either side of one that didn't start see its pipes close. */
+    if (pid < 0) {
+      status = -1;
+      continue;
+    }
+    if (pgid == 0)
+      pgid = pid;
+    pids[launched++] = pid;
+  }
+  if (in > STDIN_FILENO)
+    close(in);
+
+  /* Stages already started see the pipeline end where it failed. */
+  if (launched > 0)
+    job_start(job_add(pgid, pids, launched, command), is_bg);
+
+  for (size_t i = 0; i < count; i++) {
+    tokens_destroy(stages[i].tokens);
+    tokens_destroy(stages[i].redirect_tokens);
+    free(stages[i].path);
+  }
+  return status;
+}
+
+/* Initialization procedures for this shell. Unless FROM_STDIN, it's
+ * running a batch of commands, and never interactive. */
+void init_shell(bool from_stdin) {
   /* Our shell is connected to standard input. */
   shell_terminal = STDIN_FILENO;
 
   /* Check if we are running interactively */
-  shell_is_interactive = isatty(shell_terminal);
+  shell_is_interactive = from_stdin && isatty(shell_terminal);
 
   if (shell_is_interactive) {
     /* If the shell is not currently in the foreground, we must pause the shell until it becomes a
@@ -287,59 +1641,122 @@ void init_shell() {
     /* Save the current termios to a variable, so it can be restored later. */
     tcgetattr(shell_terminal, &shell_tmodes);
   }
-}
 
-int main(unused int argc, unused char *argv[]) {
-  init_shell();
+  /* Note when children change state; reaping waits for the next prompt. */
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_sigchld;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGCHLD, &action, NULL);
+}
 
-  static char line[4096];
+/* Runs one command LINE, which it splits up as it goes. */
+void run_line(char *line) {
   char *redirect_file_path;
-  int line_num = 0, io_redir = 0;
+  int io_redir = 0;
 
-  /* Please only print shell prompts when standard input is not a tty */
-  if (shell_is_interactive)
-    fprintf(stdout, "%d: ", line_num);
+  /* Arguments passed to the process, and the redirection's. */
+  struct tokens *tokens;
+  struct tokens *redirect_tokens = NULL;
 
-  while (fgets(line, 4096, stdin)) {
+  /* Check if a background processing is requested. */
+  int is_bg = 0;
+  if (strchr(line, '&')) {
+    is_bg = 1;
+  }
 
-    /* Arguments passed to the process. */
-    struct tokens *tokens;
+  /* The command as jobs lists it, before the line is split up. */
+  char command[strlen(line) + 1];
+  strcpy(command, line);
+  size_t command_length = strcspn(command, "&\n");
+  while (command_length > 0 && isspace(command[command_length - 1]))
+    command_length--;
+  command[command_length] = '\0';
 
-    /* Check if a background processing is requested. */
-    int is_bg = 0;
-    if (strchr(line, '&')) {
-      is_bg = 1;
-    }
+  /* A pipeline is parsed and run as a whole. */
+  if (find_unquoted(line, "|")) {
+    execute_pipeline(line, is_bg, command);
+    return;
+  }
 
-    /* Split our line into arguments and forwarded filename. */
-    io_redir = io_redirection_type(line);
-    if (io_redir) { // Has IO redirect
-      tokens = tokenize(strtok(line, "<>&"));
-      redirect_file_path = tokens_get_token(tokenize(strtok(NULL, "<>&")), 0);
+  /* Split our line into arguments and forwarded filename. */
+  io_redir = io_redirection_type(line);
+  if (io_redir) { // Has IO redirect
+    tokens = tokenize(strtok(line, "<>&"));
+    redirect_tokens = tokenize(strtok(NULL, "<>&"));
+    redirect_file_path = tokens_get_token(redirect_tokens, 0);
+  } else {
+    if (is_bg) {
+      tokens = tokenize(strtok(line, "&"));
     } else {
-      if (is_bg) {
-        tokens = tokenize(strtok(line, "&"));
-      } else {
-        tokens = tokenize(line);
-      }
+      tokens = tokenize(line);
     }
+  }
 
-    /* Find which built-in function to run. */
-    int fundex = lookup(tokens_get_token(tokens, 0));
+  /* Find which built-in function to run. */
+  int fundex = lookup(tokens_get_token(tokens, 0));
 
-    if (fundex >= 0) {
-        cmd_table[fundex].fun(tokens);
-    } else {
-        execute_program(tokens, io_redir, redirect_file_path, is_bg);
+  /* A built-in command may leave the work to the program it stands in for. */
+  if (fundex < 0 ||
+      run_builtin(fundex, tokens, io_redir, redirect_file_path) == BUILTIN_EXTERNAL) {
+      execute_program(tokens, io_redir, redirect_file_path, is_bg, command);
+  }
+
+  /* Clean up memory */
+  tokens_destroy(tokens);
+  tokens_destroy(redirect_tokens);
+}
+
+/* Buffer size for reading a script */
+#define SCRIPT_BUFFER_SIZE (64 * 1024)
+
+/* With no arguments the shell reads commands from standard input, and is
+ * interactive if that's a terminal. "shell -c COMMANDS" runs the lines of
+ * COMMANDS, and "shell FILE" the lines of FILE; either way it's a batch
+ * run, with no prompts or terminal handling.
+ */
+int main(int argc, char *argv[]) {
+  FILE *input = stdin;
+  char *source = argv[1];
+  if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+    if (argc < 3) {
+      fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+      return 2;
     }
+    if (argv[2][0] == '\0')
+      return 0;
+    source = argv[2];
+    input = fmemopen(source, strlen(source), "r");
+  } else if (argc > 1) {
+    input = fopen(argv[1], "r");
+    if (input)
+      setvbuf(input, NULL, _IOFBF, SCRIPT_BUFFER_SIZE);
+  }
+  if (!input) {
+    fprintf(stderr, "%s: %s\n", source, strerror(errno));
+    return 127;
+  }
+  init_shell(input == stdin);
+
+  char *line = NULL;
+  size_t line_capacity = 0;
+  int line_num = 0;
+
+  /* Please only print shell prompts when standard input is not a tty */
+  if (shell_is_interactive)
+    fprintf(stdout, "%d: ", line_num);
+
+  while (getline(&line, &line_capacity, input) >= 0) {
+    run_line(line);
+
+    if (child_changed)
+      reap_jobs();
 
     if (shell_is_interactive)
       /* Please only print shell prompts when standard input is not a tty */
       fprintf(stdout, "%d: ", ++line_num);
-
-    /* Clean up memory */
-    tokens_destroy(tokens);
   }
 
+  free(line);
   return 0;
 }
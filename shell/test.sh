@@ -0,0 +1,51 @@
+#!/bin/bash
+# Runs command lines through the shell and compares what they print with
+# what they should.
+#
+# Usage: ./test.sh   (or "make test")
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+failed=0
+count=0
+
+# Runs COMMANDS, lines for "shell -c", and checks that they print EXPECTED
+# on standard output.
+check() {
+  local name=$1 commands=$2 expected=$3 actual
+  count=$((count + 1))
+  actual=$("$SHELL_BIN" -c "$commands" 2>/dev/null < /dev/null)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: $name"
+    echo "  expected: $(printf '%q' "$expected")"
+    echo "  actual:   $(printf '%q' "$actual")"
+    failed=$((failed + 1))
+  fi
+}
+
+check "pipeline" 'echo abc | tr a-c x-z' 'xyz'
+check "three-stage pipeline" '/bin/echo one two | tr " " "\\n" | sort -r' $'two\none'
+check "quoted bar" 'echo "a|b"' 'a|b'
+check "single-quoted bar" "echo 'a | b'" 'a | b'
+check "escaped bar" 'echo a\|b' 'a|b'
+check "quoted bar in a pipeline" 'echo "x|y" | tr "|" -' 'x-y'
+
+check "echo" 'echo a  b' 'a b'
+check "echo -n" $'echo -n a\necho b' 'ab'
+check "echo -e" 'echo -e "a\\tb\\x41\\0102"' $'a\tbAB'
+check "echo -e with \\c" 'echo -e "x\\cy"'$'\n''echo z' 'xz'
+check "echo without -e" 'echo "a\\tb"' 'a\tb'
+check "echo non-option" 'echo -x -n' '-x -n'
+check "printf integers" 'printf "%d %i %5u|%-4x|%X %o\\n" 42 -7 3 255 255 8' '42 -7     3|ff  |FF 10'
+check "printf floats" 'printf "%5.2f %e %g\\n" 3.14159 1234.5 0.0001' ' 3.14 1.234500e+03 0.0001'
+check "printf strings" 'printf "%s-%5s-%c\\n" a b cat' 'a-    b-c'
+check "printf reuses the format" 'printf "%s=%d\\n" a 1 b 2' $'a=1\nb=2'
+check "printf %b" 'printf "%b|\\n" "x\\ty"' $'x\ty|'
+check "printf escapes" "printf '\\\\101\\\\x42\\\\\"\\\\n'" 'AB"'
+check "printf character code" "printf '%d\\\\n' \"'A\"" '65'
+check "printf bad number" 'printf "%d|\\n" abc' '0|'
+check "printf * width" 'printf "%*d|\\n" 5 42' '   42|'
+check "printf * width in a pipeline" 'printf "%*d|\\n" 5 42 | cat' '   42|'
+check "sleep with two intervals" $'sleep 0.01 0.01\necho done' 'done'
+
+echo "$((count - failed)) of $count passed"
+[ $failed -eq 0 ]
@@ -3,25 +3,24 @@
 #include <string.h>
 #include "tokenizer.h"
 
+/* A line's words are copied, each after the other, into the text that
+ * follows the struct in the same allocation. The copies never take more
+ * room than the line itself. */
 struct tokens {
   size_t tokens_length;
+  size_t tokens_capacity;
   char **tokens;
-  size_t buffers_length;
-  char **buffers;
+  char text[];
 };
 
-static void *vector_push(char ***pointer, size_t *size, void *elem) {
-  *pointer = (char**) realloc(*pointer, sizeof(char *) * (*size + 1));
-  (*pointer)[*size] = elem;
-  *size += 1;
-  return elem;
-}
-
-static void *copy_word(char *source, size_t n) {
-  source[n] = '\0';
-  char *word = (char *) malloc(n + 1);
-  strncpy(word, source, n + 1);
-  return word;
+static void push_word(struct tokens *tokens, char *word) {
+  if (tokens->tokens_length == tokens->tokens_capacity) {
+    tokens->tokens_capacity = tokens->tokens_capacity ? tokens->tokens_capacity * 2 : 8;
+    tokens->tokens = (char **) realloc(tokens->tokens,
+                                       sizeof(char *) * tokens->tokens_capacity);
+    if (tokens->tokens == NULL) abort();
+  }
+  tokens->tokens[tokens->tokens_length++] = word;
 }
 
 struct tokens *tokenize(const char *line) {
@@ -29,23 +28,23 @@ struct tokens *tokenize(const char *line) {
     return NULL;
   }
 
-  static char token[4096];
-  size_t n = 0, n_max = 4096;
-  struct tokens *tokens;
   size_t line_length = strlen(line);
-
-  tokens = (struct tokens *) malloc(sizeof(struct tokens));
+  struct tokens *tokens = (struct tokens *) malloc(sizeof(struct tokens) + line_length + 1);
+  if (tokens == NULL) abort();
   tokens->tokens_length = 0;
+  tokens->tokens_capacity = 0;
   tokens->tokens = NULL;
-  tokens->buffers_length = 0;
-  tokens->buffers = NULL;
+
+  /* The word being read starts at token, and has n characters so far. */
+  char *token = tokens->text;
+  size_t n = 0;
 
   const int MODE_NORMAL = 0,
         MODE_SQUOTE = 1,
         MODE_DQUOTE = 2;
   int mode = MODE_NORMAL;
 
-  for (unsigned int i = 0; i < line_length; i++) {
+  for (size_t i = 0; i < line_length; i++) {
     char c = line[i];
     if (mode == MODE_NORMAL) {
       if (c == '\'') {
@@ -58,8 +57,9 @@ struct tokens *tokenize(const char *line) {
         }
       } else if (isspace(c)) {
         if (n > 0) {
-          void *word = copy_word(token, n);
-          vector_push(&tokens->tokens, &tokens->tokens_length, word);
+          token[n] = '\0';
+          push_word(tokens, token);
+          token += n + 1;
           n = 0;
         }
       } else {
@@ -86,13 +86,11 @@ struct tokens *tokenize(const char *line) {
         token[n++] = c;
       }
     }
-    if (n + 1 >= n_max) abort();
   }
 
   if (n > 0) {
-    void *word = copy_word(token, n);
-    vector_push(&tokens->tokens, &tokens->tokens_length, word);
-    n = 0;
+    token[n] = '\0';
+    push_word(tokens, token);
   }
   return tokens;
 }
@@ -117,14 +115,6 @@ void tokens_destroy(struct tokens *tokens) {
   if (tokens == NULL) {
     return;
   }
-  for (int i = 0; i < tokens->tokens_length; i++) {
-    free(tokens->tokens[i]);
-  }
-  for (int i = 0; i < tokens->buffers_length; i++) {
-    free(tokens->buffers[i]);
-  }
-  if (tokens->tokens) {
-    free(tokens->tokens);
-  }
+  free(tokens->tokens);
   free(tokens);
 }